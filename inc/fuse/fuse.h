@@ -87,6 +87,10 @@ struct fuse_operations
         unsigned int flags, void *data);
     int (*poll)(const char *path, struct fuse_file_info *fi,
         struct fuse_pollhandle *ph, unsigned *reventsp);
+    int (*write_buf)(const char *path, struct fuse_bufvec *buf, fuse_off_t off,
+        struct fuse_file_info *fi);
+    int (*read_buf)(const char *path, struct fuse_bufvec **bufp,
+        size_t size, fuse_off_t off, struct fuse_file_info *fi);
 };
 
 struct fuse_context
@@ -73,6 +73,56 @@ struct fuse_conn_info
     unsigned reserved[25];
 };
 
+enum fuse_buf_flags
+{
+    FUSE_BUF_IS_FD                      = (1 << 1),
+    FUSE_BUF_FD_SEEK                    = (1 << 2),
+    FUSE_BUF_FD_RETRY                   = (1 << 3),
+};
+
+enum fuse_buf_copy_flags
+{
+    FUSE_BUF_NO_SPLICE                  = (1 << 1),
+    FUSE_BUF_FORCE_SPLICE               = (1 << 2),
+    FUSE_BUF_SPLICE_MOVE                = (1 << 3),
+    FUSE_BUF_SPLICE_NONBLOCK            = (1 << 4),
+};
+
+struct fuse_buf
+{
+    size_t size;
+    enum fuse_buf_flags flags;
+    void *mem;
+    int fd;
+    fuse_off_t pos;
+};
+
+struct fuse_bufvec
+{
+    size_t count;
+    size_t idx;
+    size_t off;
+    struct fuse_buf buf[1];
+};
+
+#define FUSE_BUFVEC_INIT(size)          \
+    ((struct fuse_bufvec)               \
+    {                                   \
+        /* .count = */ 1,               \
+        /* .idx = */ 0,                 \
+        /* .off = */ 0,                 \
+        /* .buf = */                    \
+        {                               \
+            {                           \
+                /* .size = */ (size),   \
+                /* .flags = */ (enum fuse_buf_flags)0,\
+                /* .mem = */ 0,         \
+                /* .fd = */ -1,         \
+                /* .pos = */ 0,         \
+            }                           \
+        }                               \
+    })
+
 struct fuse_session;
 struct fuse_chan;
 struct fuse_pollhandle;
@@ -87,6 +137,10 @@ FSP_FUSE_API int FSP_FUSE_API_NAME(fsp_fuse_parse_cmdline)(struct fsp_fuse_env *
     char **mountpoint, int *multithreaded, int *foreground);
 FSP_FUSE_API int32_t FSP_FUSE_API_NAME(fsp_fuse_ntstatus_from_errno)(struct fsp_fuse_env *env,
     int err);
+FSP_FUSE_API size_t FSP_FUSE_API_NAME(fsp_fuse_buf_size)(struct fsp_fuse_env *env,
+    const struct fuse_bufvec *bufv);
+FSP_FUSE_API fuse_ssize_t FSP_FUSE_API_NAME(fsp_fuse_buf_copy)(struct fsp_fuse_env *env,
+    struct fuse_bufvec *dst, struct fuse_bufvec *src, enum fuse_buf_copy_flags flags);
 
 FSP_FUSE_SYM(
 int fuse_version(void),
@@ -117,6 +171,21 @@ int fuse_parse_cmdline(struct fuse_args *args,
         (fsp_fuse_env(), args, mountpoint, multithreaded, foreground);
 })
 
+FSP_FUSE_SYM(
+size_t fuse_buf_size(const struct fuse_bufvec *bufv),
+{
+    return FSP_FUSE_API_CALL(fsp_fuse_buf_size)
+        (fsp_fuse_env(), bufv);
+})
+
+FSP_FUSE_SYM(
+fuse_ssize_t fuse_buf_copy(struct fuse_bufvec *dst, struct fuse_bufvec *src,
+    enum fuse_buf_copy_flags flags),
+{
+    return FSP_FUSE_API_CALL(fsp_fuse_buf_copy)
+        (fsp_fuse_env(), dst, src, flags);
+})
+
 FSP_FUSE_SYM(
 void fuse_pollhandle_destroy(struct fuse_pollhandle *ph),
 {
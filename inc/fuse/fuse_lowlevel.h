@@ -0,0 +1,326 @@
+/**
+ * @file fuse/fuse_lowlevel.h
+ * WinFsp FUSE low-level compatible API.
+ *
+ * This file is derived from libfuse/include/fuse_lowlevel.h:
+ *     FUSE: Filesystem in Userspace
+ *     Copyright (C) 2001-2007  Miklos Szeredi <miklos@szeredi.hu>
+ *
+ * @copyright 2015-2016 Bill Zissimopoulos
+ */
+/*
+ * This file is part of WinFsp.
+ *
+ * You can redistribute it and/or modify it under the terms of the
+ * GNU Affero General Public License version 3 as published by the
+ * Free Software Foundation.
+ *
+ * Licensees holding a valid commercial license may use this file in
+ * accordance with the commercial license agreement provided with the
+ * software.
+ */
+
+#ifndef FUSE_LOWLEVEL_H_
+#define FUSE_LOWLEVEL_H_
+
+#include "fuse.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * The low-level API identifies files by node ID (inode number) rather than by path.
+ * WinFsp translates paths to node ID's using a node table that caches the results of
+ * lookups; a path that has been seen recently is resolved without calling the file
+ * system. The file system is told to forget a node ID (with the number of lookups that
+ * returned it) when the node table no longer uses it.
+ *
+ * Differences from libfuse:
+ *
+ * - Requests must be replied to before the operation returns; asynchronous replies are
+ * not supported. An operation that returns without replying fails with EIO.
+ * - The fuse_entry_param attr_timeout and entry_timeout fields are ignored. Metadata
+ * caching is controlled by the FileInfoTimeout option.
+ * - There are no fuse_session/fuse_chan objects beyond what is needed to mount: a
+ * struct fuse_session is a struct fuse and the session functions map to the fuse_loop,
+ * fuse_loop_mt, fuse_exit and fuse_destroy functions.
+ */
+
+#define FUSE_ROOT_ID                    1
+
+#define FUSE_SET_ATTR_MODE              (1 << 0)
+#define FUSE_SET_ATTR_UID               (1 << 1)
+#define FUSE_SET_ATTR_GID               (1 << 2)
+#define FUSE_SET_ATTR_SIZE              (1 << 3)
+#define FUSE_SET_ATTR_ATIME             (1 << 4)
+#define FUSE_SET_ATTR_MTIME             (1 << 5)
+
+typedef struct fuse_req *fuse_req_t;
+
+struct fuse_entry_param
+{
+    fuse_ino_t ino;
+    uint64_t generation;
+    struct fuse_stat attr;
+    double attr_timeout;
+    double entry_timeout;
+};
+
+struct fuse_ctx
+{
+    fuse_uid_t uid;
+    fuse_gid_t gid;
+    fuse_pid_t pid;
+    fuse_mode_t umask;
+};
+
+struct fuse_lowlevel_ops
+{
+    void (*init)(void *userdata, struct fuse_conn_info *conn);
+    void (*destroy)(void *userdata);
+    void (*lookup)(fuse_req_t req, fuse_ino_t parent, const char *name);
+    void (*forget)(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup);
+    void (*getattr)(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
+    void (*setattr)(fuse_req_t req, fuse_ino_t ino, struct fuse_stat *attr, int to_set,
+        struct fuse_file_info *fi);
+    void (*readlink)(fuse_req_t req, fuse_ino_t ino);
+    void (*mknod)(fuse_req_t req, fuse_ino_t parent, const char *name,
+        fuse_mode_t mode, fuse_dev_t rdev);
+    void (*mkdir)(fuse_req_t req, fuse_ino_t parent, const char *name, fuse_mode_t mode);
+    void (*unlink)(fuse_req_t req, fuse_ino_t parent, const char *name);
+    void (*rmdir)(fuse_req_t req, fuse_ino_t parent, const char *name);
+    void (*symlink)(fuse_req_t req, const char *link, fuse_ino_t parent, const char *name);
+    void (*rename)(fuse_req_t req, fuse_ino_t parent, const char *name,
+        fuse_ino_t newparent, const char *newname);
+    void (*link)(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent, const char *newname);
+    void (*open)(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
+    void (*read)(fuse_req_t req, fuse_ino_t ino, size_t size, fuse_off_t off,
+        struct fuse_file_info *fi);
+    void (*write)(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, fuse_off_t off,
+        struct fuse_file_info *fi);
+    void (*flush)(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
+    void (*release)(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
+    void (*fsync)(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi);
+    void (*opendir)(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
+    void (*readdir)(fuse_req_t req, fuse_ino_t ino, size_t size, fuse_off_t off,
+        struct fuse_file_info *fi);
+    void (*releasedir)(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
+    void (*fsyncdir)(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi);
+    void (*statfs)(fuse_req_t req, fuse_ino_t ino);
+    void (*setxattr)(fuse_req_t req, fuse_ino_t ino, const char *name,
+        const char *value, size_t size, int flags);
+    void (*getxattr)(fuse_req_t req, fuse_ino_t ino, const char *name, size_t size);
+    void (*listxattr)(fuse_req_t req, fuse_ino_t ino, size_t size);
+    void (*removexattr)(fuse_req_t req, fuse_ino_t ino, const char *name);
+    void (*access)(fuse_req_t req, fuse_ino_t ino, int mask);
+    void (*create)(fuse_req_t req, fuse_ino_t parent, const char *name,
+        fuse_mode_t mode, struct fuse_file_info *fi);
+    void (*getlk)(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi,
+        struct fuse_flock *lock);
+    void (*setlk)(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi,
+        struct fuse_flock *lock, int sleep);
+    void (*bmap)(fuse_req_t req, fuse_ino_t ino, size_t blocksize, uint64_t idx);
+    void (*ioctl)(fuse_req_t req, fuse_ino_t ino, int cmd, void *arg,
+        struct fuse_file_info *fi, unsigned flags,
+        const void *in_buf, size_t in_bufsz, size_t out_bufsz);
+    void (*poll)(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi,
+        struct fuse_pollhandle *ph);
+    void (*write_buf)(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv,
+        fuse_off_t off, struct fuse_file_info *fi);
+};
+
+FSP_FUSE_API struct fuse_session *FSP_FUSE_API_NAME(fsp_fuse_lowlevel_new)(struct fsp_fuse_env *env,
+    struct fuse_args *args,
+    const struct fuse_lowlevel_ops *op, size_t op_size, void *userdata);
+FSP_FUSE_API void FSP_FUSE_API_NAME(fsp_fuse_session_add_chan)(struct fsp_fuse_env *env,
+    struct fuse_session *se, struct fuse_chan *ch);
+FSP_FUSE_API int FSP_FUSE_API_NAME(fsp_fuse_reply_err)(struct fsp_fuse_env *env,
+    fuse_req_t req, int err);
+FSP_FUSE_API int FSP_FUSE_API_NAME(fsp_fuse_reply_entry)(struct fsp_fuse_env *env,
+    fuse_req_t req, const struct fuse_entry_param *e);
+FSP_FUSE_API int FSP_FUSE_API_NAME(fsp_fuse_reply_create)(struct fsp_fuse_env *env,
+    fuse_req_t req, const struct fuse_entry_param *e, const struct fuse_file_info *fi);
+FSP_FUSE_API int FSP_FUSE_API_NAME(fsp_fuse_reply_attr)(struct fsp_fuse_env *env,
+    fuse_req_t req, const struct fuse_stat *attr, double attr_timeout);
+FSP_FUSE_API int FSP_FUSE_API_NAME(fsp_fuse_reply_readlink)(struct fsp_fuse_env *env,
+    fuse_req_t req, const char *link);
+FSP_FUSE_API int FSP_FUSE_API_NAME(fsp_fuse_reply_open)(struct fsp_fuse_env *env,
+    fuse_req_t req, const struct fuse_file_info *fi);
+FSP_FUSE_API int FSP_FUSE_API_NAME(fsp_fuse_reply_write)(struct fsp_fuse_env *env,
+    fuse_req_t req, size_t count);
+FSP_FUSE_API int FSP_FUSE_API_NAME(fsp_fuse_reply_buf)(struct fsp_fuse_env *env,
+    fuse_req_t req, const char *buf, size_t size);
+FSP_FUSE_API int FSP_FUSE_API_NAME(fsp_fuse_reply_data)(struct fsp_fuse_env *env,
+    fuse_req_t req, struct fuse_bufvec *bufv, enum fuse_buf_copy_flags flags);
+FSP_FUSE_API int FSP_FUSE_API_NAME(fsp_fuse_reply_statfs)(struct fsp_fuse_env *env,
+    fuse_req_t req, const struct fuse_statvfs *stbuf);
+FSP_FUSE_API size_t FSP_FUSE_API_NAME(fsp_fuse_add_direntry)(struct fsp_fuse_env *env,
+    fuse_req_t req, char *buf, size_t bufsize,
+    const char *name, const struct fuse_stat *stbuf, fuse_off_t off);
+FSP_FUSE_API void *FSP_FUSE_API_NAME(fsp_fuse_req_userdata)(struct fsp_fuse_env *env,
+    fuse_req_t req);
+FSP_FUSE_API const struct fuse_ctx *FSP_FUSE_API_NAME(fsp_fuse_req_ctx)(struct fsp_fuse_env *env,
+    fuse_req_t req);
+
+FSP_FUSE_SYM(
+struct fuse_session *fuse_lowlevel_new(struct fuse_args *args,
+    const struct fuse_lowlevel_ops *op, size_t op_size, void *userdata),
+{
+    return FSP_FUSE_API_CALL(fsp_fuse_lowlevel_new)
+        (fsp_fuse_env(), args, op, op_size, userdata);
+})
+
+FSP_FUSE_SYM(
+void fuse_session_add_chan(struct fuse_session *se, struct fuse_chan *ch),
+{
+    FSP_FUSE_API_CALL(fsp_fuse_session_add_chan)
+        (fsp_fuse_env(), se, ch);
+})
+
+FSP_FUSE_SYM(
+void fuse_session_remove_chan(struct fuse_chan *ch),
+{
+    (void)ch;
+})
+
+FSP_FUSE_SYM(
+void fuse_session_destroy(struct fuse_session *se),
+{
+    FSP_FUSE_API_CALL(fsp_fuse_destroy)
+        (fsp_fuse_env(), (struct fuse *)se);
+})
+
+FSP_FUSE_SYM(
+int fuse_session_loop(struct fuse_session *se),
+{
+    return FSP_FUSE_API_CALL(fsp_fuse_loop)
+        (fsp_fuse_env(), (struct fuse *)se);
+})
+
+FSP_FUSE_SYM(
+int fuse_session_loop_mt(struct fuse_session *se),
+{
+    return FSP_FUSE_API_CALL(fsp_fuse_loop_mt)
+        (fsp_fuse_env(), (struct fuse *)se);
+})
+
+FSP_FUSE_SYM(
+void fuse_session_exit(struct fuse_session *se),
+{
+    FSP_FUSE_API_CALL(fsp_fuse_exit)
+        (fsp_fuse_env(), (struct fuse *)se);
+})
+
+FSP_FUSE_SYM(
+int fuse_reply_err(fuse_req_t req, int err),
+{
+    return FSP_FUSE_API_CALL(fsp_fuse_reply_err)
+        (fsp_fuse_env(), req, err);
+})
+
+FSP_FUSE_SYM(
+void fuse_reply_none(fuse_req_t req),
+{
+    FSP_FUSE_API_CALL(fsp_fuse_reply_err)
+        (fsp_fuse_env(), req, 0);
+})
+
+FSP_FUSE_SYM(
+int fuse_reply_entry(fuse_req_t req, const struct fuse_entry_param *e),
+{
+    return FSP_FUSE_API_CALL(fsp_fuse_reply_entry)
+        (fsp_fuse_env(), req, e);
+})
+
+FSP_FUSE_SYM(
+int fuse_reply_create(fuse_req_t req, const struct fuse_entry_param *e,
+    const struct fuse_file_info *fi),
+{
+    return FSP_FUSE_API_CALL(fsp_fuse_reply_create)
+        (fsp_fuse_env(), req, e, fi);
+})
+
+FSP_FUSE_SYM(
+int fuse_reply_attr(fuse_req_t req, const struct fuse_stat *attr, double attr_timeout),
+{
+    return FSP_FUSE_API_CALL(fsp_fuse_reply_attr)
+        (fsp_fuse_env(), req, attr, attr_timeout);
+})
+
+FSP_FUSE_SYM(
+int fuse_reply_readlink(fuse_req_t req, const char *link),
+{
+    return FSP_FUSE_API_CALL(fsp_fuse_reply_readlink)
+        (fsp_fuse_env(), req, link);
+})
+
+FSP_FUSE_SYM(
+int fuse_reply_open(fuse_req_t req, const struct fuse_file_info *fi),
+{
+    return FSP_FUSE_API_CALL(fsp_fuse_reply_open)
+        (fsp_fuse_env(), req, fi);
+})
+
+FSP_FUSE_SYM(
+int fuse_reply_write(fuse_req_t req, size_t count),
+{
+    return FSP_FUSE_API_CALL(fsp_fuse_reply_write)
+        (fsp_fuse_env(), req, count);
+})
+
+FSP_FUSE_SYM(
+int fuse_reply_buf(fuse_req_t req, const char *buf, size_t size),
+{
+    return FSP_FUSE_API_CALL(fsp_fuse_reply_buf)
+        (fsp_fuse_env(), req, buf, size);
+})
+
+FSP_FUSE_SYM(
+int fuse_reply_data(fuse_req_t req, struct fuse_bufvec *bufv, enum fuse_buf_copy_flags flags),
+{
+    return FSP_FUSE_API_CALL(fsp_fuse_reply_data)
+        (fsp_fuse_env(), req, bufv, flags);
+})
+
+FSP_FUSE_SYM(
+int fuse_reply_statfs(fuse_req_t req, const struct fuse_statvfs *stbuf),
+{
+    return FSP_FUSE_API_CALL(fsp_fuse_reply_statfs)
+        (fsp_fuse_env(), req, stbuf);
+})
+
+FSP_FUSE_SYM(
+size_t fuse_add_direntry(fuse_req_t req, char *buf, size_t bufsize,
+    const char *name, const struct fuse_stat *stbuf, fuse_off_t off),
+{
+    return FSP_FUSE_API_CALL(fsp_fuse_add_direntry)
+        (fsp_fuse_env(), req, buf, bufsize, name, stbuf, off);
+})
+
+FSP_FUSE_SYM(
+void *fuse_req_userdata(fuse_req_t req),
+{
+    return FSP_FUSE_API_CALL(fsp_fuse_req_userdata)
+        (fsp_fuse_env(), req);
+})
+
+FSP_FUSE_SYM(
+const struct fuse_ctx *fuse_req_ctx(fuse_req_t req),
+{
+    return FSP_FUSE_API_CALL(fsp_fuse_req_ctx)
+        (fsp_fuse_env(), req);
+})
+
+FSP_FUSE_SYM(
+int fuse_req_interrupted(fuse_req_t req),
+{
+    (void)req;
+    return 0;
+})
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -67,6 +67,10 @@ extern "C" {
 
 #if defined(_WIN64) || defined(_WIN32)
 
+#if !defined(WINFSP_DLL_INTERNAL)
+#include <io.h>
+#endif
+
 typedef uint32_t fuse_uid_t;
 typedef uint32_t fuse_gid_t;
 typedef int32_t fuse_pid_t;
@@ -76,6 +80,7 @@ typedef uint64_t fuse_ino_t;
 typedef uint32_t fuse_mode_t;
 typedef uint16_t fuse_nlink_t;
 typedef int64_t fuse_off_t;
+typedef intptr_t fuse_ssize_t;
 
 #if defined(_WIN64)
 typedef uint64_t fuse_fsblkcnt_t;
@@ -177,6 +182,7 @@ struct fuse_flock
         MemAlloc, MemFree,              \
         fsp_fuse_daemonize,             \
         fsp_fuse_set_signal_handlers,   \
+        0, 0,                           \
     }
 #else
 #define FSP_FUSE_ENV_INIT               \
@@ -185,6 +191,8 @@ struct fuse_flock
         malloc, free,                   \
         fsp_fuse_daemonize,             \
         fsp_fuse_set_signal_handlers,   \
+        fsp_fuse_fdread,                \
+        fsp_fuse_fdwrite,               \
     }
 #endif
 
@@ -196,6 +204,7 @@ struct fuse_flock
 #include <sys/stat.h>
 #include <sys/statvfs.h>
 #include <sys/types.h>
+#include <unistd.h>
 #include <utime.h>
 
 #define fuse_uid_t                      uid_t
@@ -207,6 +216,7 @@ struct fuse_flock
 #define fuse_mode_t                     mode_t
 #define fuse_nlink_t                    nlink_t
 #define fuse_off_t                      off_t
+#define fuse_ssize_t                    ssize_t
 
 #define fuse_fsblkcnt_t                 fsblkcnt_t
 #define fuse_fsfilcnt_t                 fsfilcnt_t
@@ -226,6 +236,8 @@ struct fuse_flock
         malloc, free,                   \
         fsp_fuse_daemonize,             \
         fsp_fuse_set_signal_handlers,   \
+        fsp_fuse_fdread,                \
+        fsp_fuse_fdwrite,               \
     }
 
 /*
@@ -244,7 +256,9 @@ struct fsp_fuse_env
     void (*memfree)(void *);
     int (*daemonize)(int);
     int (*set_signal_handlers)(void *);
-    void (*reserved[4])();
+    fuse_ssize_t (*fdread)(int, void *, size_t, fuse_off_t);
+    fuse_ssize_t (*fdwrite)(int, const void *, size_t, fuse_off_t);
+    void (*reserved[2])();
 };
 
 FSP_FUSE_API void FSP_FUSE_API_NAME(fsp_fuse_signal_handler)(int sig);
@@ -263,6 +277,38 @@ static inline int fsp_fuse_set_signal_handlers(void *se)
     return 0;
 }
 
+/*
+ * The fdread/fdwrite functions give the WinFsp DLL access to file descriptors
+ * (fd-backed struct fuse_buf) of the environment of the file system. A negative
+ * offset means the current file position.
+ */
+
+#if !defined(WINFSP_DLL_INTERNAL)
+static inline fuse_ssize_t fsp_fuse_fdread(int fd, void *buf, size_t size, fuse_off_t off)
+{
+    int bytes;
+
+    if (0 <= off && -1 == _lseeki64(fd, off, 0/*SEEK_SET*/))
+        return -errno;
+    if (size > 0x7fffffff)
+        size = 0x7fffffff;
+    bytes = _read(fd, buf, (unsigned)size);
+    return -1 != bytes ? bytes : -errno;
+}
+
+static inline fuse_ssize_t fsp_fuse_fdwrite(int fd, const void *buf, size_t size, fuse_off_t off)
+{
+    int bytes;
+
+    if (0 <= off && -1 == _lseeki64(fd, off, 0/*SEEK_SET*/))
+        return -errno;
+    if (size > 0x7fffffff)
+        size = 0x7fffffff;
+    bytes = _write(fd, buf, (unsigned)size);
+    return -1 != bytes ? bytes : -errno;
+}
+#endif
+
 #elif defined(__CYGWIN__)
 
 static inline int fsp_fuse_daemonize(int foreground)
@@ -348,6 +394,18 @@ static inline int fsp_fuse_set_signal_handlers(void *se)
 #undef FSP_FUSE_SET_SIGNAL_HANDLER
 }
 
+static inline fuse_ssize_t fsp_fuse_fdread(int fd, void *buf, size_t size, fuse_off_t off)
+{
+    ssize_t bytes = 0 <= off ? pread(fd, buf, size, off) : read(fd, buf, size);
+    return -1 != bytes ? bytes : -errno;
+}
+
+static inline fuse_ssize_t fsp_fuse_fdwrite(int fd, const void *buf, size_t size, fuse_off_t off)
+{
+    ssize_t bytes = 0 <= off ? pwrite(fd, buf, size, off) : write(fd, buf, size);
+    return -1 != bytes ? bytes : -errno;
+}
+
 #endif
 
 
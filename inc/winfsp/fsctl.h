@@ -64,6 +64,11 @@ extern const __declspec(selectany) GUID FspFsvrtDeviceClassGuid =
 #define FSP_FSCTL_TRANSACT_BATCH_BUFFER_SIZEMIN 16384
 #define FSP_FSCTL_TRANSACT_BUFFER_SIZEMIN       FSP_FSCTL_TRANSACT_REQ_SIZEMAX
 
+/* ExtendedPayload volumes: message Size is UINT16; 64: size for internal request header */
+#define FSP_FSCTL_TRANSACT_EXT_REQ_SIZEMAX      (65536 - 64)
+#define FSP_FSCTL_TRANSACT_EXT_RSP_SIZEMAX      (65536 - 64)
+#define FSP_FSCTL_TRANSACT_EXT_BUFFER_SIZEMIN   FSP_FSCTL_TRANSACT_EXT_REQ_SIZEMAX
+
 /* marshalling */
 #pragma warning(push)
 #pragma warning(disable:4200)           /* zero-sized array in struct/union */
@@ -129,6 +134,10 @@ typedef struct
     UINT32 HardLinks:1;                 /* unimplemented; set to 0 */
     UINT32 ExtendedAttributes:1;        /* unimplemented; set to 0 */
     UINT32 ReadOnlyVolume:1;
+    /* kernel-mode flags */
+    UINT32 NegativeNameCache:1;         /* cache names not found for FileInfoTimeout */
+    UINT32 ExtendedPayload:1;           /* requests/responses up to FSP_FSCTL_TRANSACT_EXT_*_SIZEMAX */
+    UINT32 AdaptiveWakeup:1;            /* spin before sleeping; wake transact threads LIFO */
     WCHAR Prefix[FSP_FSCTL_VOLUME_PREFIX_SIZE / sizeof(WCHAR)]; /* UNC prefix (\Server\Share) */
 } FSP_FSCTL_VOLUME_PARAMS;
 typedef struct
@@ -591,11 +591,29 @@ typedef struct _FSP_FILE_SYSTEM_INTERFACE
 static_assert(sizeof(FSP_FILE_SYSTEM_INTERFACE) == 64 * sizeof(NTSTATUS (*)()),
     "FSP_FILE_SYSTEM_INTERFACE must have 64 entries.");
 #endif
+/*
+ * Operation guard strategies:
+ *
+ * - FINE: namespace operations are guarded by a single exclusive-shared lock; file I/O is not.
+ * - COARSE: all operations are mutually exclusive.
+ * - STRIPED: namespace operations are guarded per directory. Operations in different
+ *   directories may run concurrently; renames and SetVolumeLabel exclude all namespace
+ *   operations. Use only with file systems that tolerate concurrent namespace changes in
+ *   different directories.
+ * - NONE: no operations are guarded; the file system does its own locking.
+ */
 typedef enum
 {
     FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY_FINE = 0,
     FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY_COARSE,
+    FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY_STRIPED,
+    FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY_NONE,
 } FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY;
+enum
+{
+    FSP_FILE_SYSTEM_DISPATCHER_BATCH    = 0x00000001,
+    FSP_FILE_SYSTEM_DISPATCHER_EXECUTOR = 0x00000002,
+};
 typedef struct _FSP_FILE_SYSTEM
 {
     UINT16 Version;
@@ -613,6 +631,12 @@ typedef struct _FSP_FILE_SYSTEM
     UINT32 DebugLog;
     FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY OpGuardStrategy;
     SRWLOCK OpGuardLock;
+    ULONG DispatcherFlags;
+    PVOID Statistics;
+    PVOID Trace;
+    PVOID SecurityCache;
+    SRWLOCK OpGuardStripes[64];
+    ULONG RequestSizeMax, ResponseSizeMax;
 } FSP_FILE_SYSTEM;
 /**
  * Create a file system object.
@@ -620,6 +644,8 @@ typedef struct _FSP_FILE_SYSTEM
  * @param DevicePath
  *     The name of the control device for this file system. This must be either
  *     FSP_FSCTL_DISK_DEVICE_NAME or FSP_FSCTL_NET_DEVICE_NAME.
+ *     A value of NULL creates a file system that is detached from the FSD. A detached file
+ *     system cannot be mounted or started, but it can be used with FspFileSystemReplayTrace.
  * @param VolumeParams
  *     Volume parameters for the newly created file system.
  * @param Interface
@@ -680,6 +706,35 @@ FSP_API VOID FspFileSystemRemoveMountPoint(FSP_FILE_SYSTEM *FileSystem);
  *     STATUS_SUCCESS on error code.
  */
 FSP_API NTSTATUS FspFileSystemStartDispatcher(FSP_FILE_SYSTEM *FileSystem, ULONG ThreadCount);
+/**
+ * Start the file system dispatcher with additional options.
+ *
+ * This function is similar to FspFileSystemStartDispatcher but allows the selection of the
+ * dispatcher mode. When FSP_FILE_SYSTEM_DISPATCHER_BATCH is specified each dispatcher thread
+ * receives multiple requests from the FSD with a single transact call and returns all their
+ * responses together with the next transact call. This reduces the number of round-trips to
+ * the FSD for file systems that receive many small requests.
+ *
+ * When FSP_FILE_SYSTEM_DISPATCHER_EXECUTOR is specified a small number of I/O threads fetch
+ * requests from the FSD and queue them to worker threads that execute them. Idle workers steal
+ * requests from busy workers, so that a slow operation does not delay the fetching of further
+ * requests. Workers send their responses using FspFileSystemSendResponse.
+ *
+ * @param FileSystem
+ *     The file system object.
+ * @param ThreadCount
+ *     The number of threads for the file system dispatcher. A value of 0 will create a default
+ *     number of threads and should be chosen in most cases. When using
+ *     FSP_FILE_SYSTEM_DISPATCHER_EXECUTOR this is the number of worker threads.
+ * @param Flags
+ *     Dispatcher flags. One of 0, FSP_FILE_SYSTEM_DISPATCHER_BATCH or
+ *     FSP_FILE_SYSTEM_DISPATCHER_EXECUTOR. Undefined or conflicting flags are rejected with
+ *     STATUS_INVALID_PARAMETER.
+ * @return
+ *     STATUS_SUCCESS on error code.
+ */
+FSP_API NTSTATUS FspFileSystemStartDispatcherEx(FSP_FILE_SYSTEM *FileSystem, ULONG ThreadCount,
+    ULONG Flags);
 /**
  * Stop the file system dispatcher.
  *
@@ -812,6 +867,196 @@ FSP_API NTSTATUS FspFileSystemOpQuerySecurity(FSP_FILE_SYSTEM *FileSystem,
 FSP_API NTSTATUS FspFileSystemOpSetSecurity(FSP_FILE_SYSTEM *FileSystem,
     FSP_FSCTL_TRANSACT_REQ *Request, FSP_FSCTL_TRANSACT_RSP *Response);
 
+/*
+ * Statistics
+ */
+enum
+{
+    FspFileSystemStatisticsBucketCount = 4 + 62 * 4, /* covers all 64-bit values */
+};
+typedef struct
+{
+    UINT64 Count;                       /* number of operations */
+    UINT64 ErrorCount;                  /* operations completed with an error status */
+    UINT64 PendingCount;                /* operations completed with STATUS_PENDING */
+    UINT64 BytesTransferred;            /* Read/Write/QueryDirectory data; request data for Transact */
+    UINT64 TotalTime;                   /* total time spent (nanoseconds) */
+    UINT64 Histogram[FspFileSystemStatisticsBucketCount]; /* see FspFileSystemStatisticsBucketIndex */
+} FSP_FILE_SYSTEM_OPERATION_STATISTICS;
+typedef struct
+{
+    FSP_FILE_SYSTEM_OPERATION_STATISTICS Operations[FspFsctlTransactKindCount];
+    FSP_FILE_SYSTEM_OPERATION_STATISTICS Transact; /* time spent waiting for requests */
+} FSP_FILE_SYSTEM_STATISTICS;
+/**
+ * Enable the collection of file system statistics.
+ *
+ * When statistics are enabled the dispatcher counts the requests of every kind, the errors
+ * and the bytes transferred, and records the time spent in each file system operation and
+ * in each transact call in log-bucketed histograms. Statistics are kept per thread and are
+ * merged when retrieved using FspFileSystemGetStatistics.
+ *
+ * This function must be called prior to starting the file system dispatcher.
+ *
+ * @param FileSystem
+ *     The file system object.
+ * @return
+ *     STATUS_SUCCESS on error code.
+ */
+FSP_API NTSTATUS FspFileSystemEnableStatistics(FSP_FILE_SYSTEM *FileSystem);
+/**
+ * Get file system statistics.
+ *
+ * @param FileSystem
+ *     The file system object.
+ * @param Statistics [out]
+ *     Pointer to a structure that will receive the merged statistics.
+ * @return
+ *     STATUS_SUCCESS on error code. STATUS_INVALID_DEVICE_REQUEST if statistics have not been
+ *     enabled.
+ */
+FSP_API NTSTATUS FspFileSystemGetStatistics(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FILE_SYSTEM_STATISTICS *Statistics);
+/*
+ * Histogram buckets have a precision of 2 bits: values 0-3 have a bucket each and every
+ * power of 2 above that is split into 4 buckets. The relative error is therefore at most 25%.
+ */
+static inline
+ULONG FspFileSystemStatisticsBucketIndex(UINT64 Value)
+{
+    ULONG Msb;
+
+    if (4 > Value)
+        return (ULONG)Value;
+
+    if (0 != (ULONG)(Value >> 32))
+    {
+        BitScanReverse(&Msb, (ULONG)(Value >> 32));
+        Msb += 32;
+    }
+    else
+        BitScanReverse(&Msb, (ULONG)Value);
+
+    return (Msb - 1) * 4 + (ULONG)((Value >> (Msb - 2)) & 3);
+}
+static inline
+UINT64 FspFileSystemStatisticsBucketValue(ULONG Index)
+{
+    /* lowest value that maps to the bucket */
+    if (4 > Index)
+        return Index;
+
+    return (UINT64)(4 | (Index & 3)) << (Index / 4 - 1);
+}
+static inline
+UINT64 FspFileSystemStatisticsPercentile(const FSP_FILE_SYSTEM_OPERATION_STATISTICS *Statistics,
+    ULONG Percent)
+{
+    UINT64 Count, Target;
+    ULONG Index;
+
+    Count = 0;
+    for (Index = 0; FspFileSystemStatisticsBucketCount > Index; Index++)
+        Count += Statistics->Histogram[Index];
+    if (0 == Count)
+        return 0;
+
+    Target = (Count * Percent + 99) / 100;
+    Count = 0;
+    for (Index = 0; FspFileSystemStatisticsBucketCount > Index; Index++)
+    {
+        Count += Statistics->Histogram[Index];
+        if (Count >= Target && 0 != Statistics->Histogram[Index])
+            break;
+    }
+
+    /* highest value that maps to the bucket */
+    return FspFileSystemStatisticsBucketCount - 1 > Index ?
+        FspFileSystemStatisticsBucketValue(Index + 1) - 1 : (UINT64)-1;
+}
+
+/*
+ * Tracing
+ */
+enum
+{
+    FspFileSystemTraceRequestKind = 1,
+    FspFileSystemTraceResponseKind,
+    FspFileSystemTraceWrapKind,         /* padding up to the end of the ring */
+};
+#pragma warning(push)
+#pragma warning(disable:4200)           /* zero-sized array in struct/union */
+typedef struct
+{
+    UINT8 Signature[8];                 /* "WFSPTRC" */
+    UINT32 Version;                     /* sizeof(FSP_FILE_SYSTEM_TRACE_HEADER) */
+    UINT32 Reserved;
+    UINT64 Frequency;                   /* timestamp ticks per second */
+    UINT64 DataSize;                    /* size of ring data that follows the header */
+    UINT64 Head;                        /* ring offset of next record to write */
+    UINT64 Tail;                        /* ring offset of oldest record */
+    UINT64 Used;                        /* ring bytes used by records */
+} FSP_FILE_SYSTEM_TRACE_HEADER;
+typedef struct
+{
+    UINT32 Size;                        /* record size including header; multiple of 8 */
+    UINT16 Kind;                        /* FspFileSystemTrace*Kind */
+    UINT16 Reserved;
+    UINT32 ThreadId;
+    UINT32 Reserved2;
+    UINT64 Timestamp;                   /* see FSP_FILE_SYSTEM_TRACE_HEADER::Frequency */
+    FSP_FSCTL_DECLSPEC_ALIGN UINT8 Data[]; /* FSP_FSCTL_TRANSACT_REQ or FSP_FSCTL_TRANSACT_RSP */
+} FSP_FILE_SYSTEM_TRACE_RECORD;
+#pragma warning(pop)
+/**
+ * Start recording a binary trace of file system requests and responses.
+ *
+ * When tracing is enabled the dispatcher appends every request it receives and every response
+ * it sends to a trace file, together with a timestamp and the id of the dispatcher thread. The
+ * trace file is memory mapped and is used as a ring: when it fills up the oldest records are
+ * discarded. The trace file is closed when the file system object is deleted.
+ *
+ * Traces may be replayed using FspFileSystemReplayTrace.
+ *
+ * This function must be called prior to starting the file system dispatcher.
+ *
+ * @param FileSystem
+ *     The file system object.
+ * @param TraceFileName
+ *     The name of the trace file. An existing file will be overwritten.
+ * @param TraceSize
+ *     The size of the trace ring in bytes. A value of 0 will use a default size.
+ * @return
+ *     STATUS_SUCCESS on error code.
+ */
+FSP_API NTSTATUS FspFileSystemStartTrace(FSP_FILE_SYSTEM *FileSystem,
+    PWSTR TraceFileName, ULONG TraceSize);
+/**
+ * Replay a trace recorded with FspFileSystemStartTrace.
+ *
+ * The recorded requests are executed in order against the file system operations, without
+ * involvement of the FSD. File contexts are translated from the recorded Create responses to
+ * the ones returned during the replay; requests for files whose Create was not recorded are
+ * skipped. Read, Write and QueryDirectory requests use a private buffer, because the contents
+ * of user buffers are not recorded. Access checks are performed using the access token of the
+ * current process.
+ *
+ * The file system would normally be created with a NULL DevicePath, so that it is detached
+ * from the FSD. If statistics are enabled on the file system they are collected during the
+ * replay.
+ *
+ * @param FileSystem
+ *     The file system object.
+ * @param TraceFileName
+ *     The name of the trace file.
+ * @param PRequestCount [out]
+ *     Pointer to a ULONG that will receive the number of replayed requests. May be NULL.
+ * @return
+ *     STATUS_SUCCESS on error code. STATUS_FILE_CORRUPT_ERROR if the trace file is invalid.
+ */
+FSP_API NTSTATUS FspFileSystemReplayTrace(FSP_FILE_SYSTEM *FileSystem,
+    PWSTR TraceFileName, PULONG PRequestCount);
+
 /*
  * Helpers
  */
@@ -861,6 +1106,44 @@ FSP_API NTSTATUS FspSetSecurityDescriptor(FSP_FILE_SYSTEM *FileSystem,
     PSECURITY_DESCRIPTOR *PSecurityDescriptor);
 FSP_API VOID FspDeleteSecurityDescriptor(PSECURITY_DESCRIPTOR SecurityDescriptor,
     NTSTATUS (*CreateFunc)());
+/**
+ * Enable the security cache.
+ *
+ * When the security cache is enabled FspAccessCheckEx remembers the file attributes and
+ * security descriptors that it gets from GetSecurityByName, for the file being opened and
+ * for every directory that it checks for traverse access. Subsequent access checks on the
+ * same names do not call GetSecurityByName until the cached information expires.
+ *
+ * The cache invalidates a file and its descendants when the file is renamed or deleted,
+ * and the whole cache when security or file attributes are changed through the file system
+ * dispatcher. A file system that changes security or file attributes in any other way must
+ * call FspFileSystemInvalidateSecurityCache.
+ *
+ * This function must be called prior to starting the file system dispatcher.
+ *
+ * @param FileSystem
+ *     The file system object.
+ * @param Timeout
+ *     The time in milliseconds that cached information is considered valid. Must not be 0.
+ * @return
+ *     STATUS_SUCCESS on error code.
+ */
+FSP_API NTSTATUS FspFileSystemEnableSecurityCache(FSP_FILE_SYSTEM *FileSystem,
+    ULONG Timeout);
+/**
+ * Invalidate information in the security cache.
+ *
+ * It is safe to call this function when the security cache is not enabled.
+ *
+ * @param FileSystem
+ *     The file system object.
+ * @param FileName
+ *     The name of the file to invalidate. If the file is a directory all its descendants are
+ *     also invalidated. Names are compared without regard to case. A value of NULL invalidates
+ *     the whole cache.
+ */
+FSP_API VOID FspFileSystemInvalidateSecurityCache(FSP_FILE_SYSTEM *FileSystem,
+    PWSTR FileName);
 static inline
 NTSTATUS FspAccessCheck(FSP_FILE_SYSTEM *FileSystem,
     FSP_FSCTL_TRANSACT_REQ *Request,
@@ -887,6 +1170,11 @@ FSP_API NTSTATUS FspPosixMapSecurityDescriptorToPermissions(
     PUINT32 PUid, PUINT32 PGid, PUINT32 PMode);
 FSP_API NTSTATUS FspPosixMapWindowsToPosixPath(PWSTR WindowsPath, char **PPosixPath);
 FSP_API NTSTATUS FspPosixMapPosixToWindowsPath(const char *PosixPath, PWSTR *PWindowsPath);
+/* *PSize: buffer size in bytes on input; required size on output (STATUS_BUFFER_OVERFLOW) */
+FSP_API NTSTATUS FspPosixMapWindowsToPosixPathBuffer(PWSTR WindowsPath,
+    char *PosixPath, PULONG PSize);
+FSP_API NTSTATUS FspPosixMapPosixToWindowsPathBuffer(const char *PosixPath,
+    PWSTR WindowsPath, PULONG PSize);
 FSP_API VOID FspPosixDeletePath(void *Path);
 
 /*
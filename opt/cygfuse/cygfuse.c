@@ -62,6 +62,7 @@ static inline int cygfuse_daemon(int nochdir, int noclose)
 #define FSP_FUSE_SYM(proto, ...)        __attribute__ ((visibility("default"))) proto { __VA_ARGS__ }
 #include <fuse_common.h>
 #include <fuse.h>
+#include <fuse_lowlevel.h>
 #include <fuse_opt.h>
 
 #if defined(__LP64__)
@@ -116,6 +117,8 @@ static void *cygfuse_init_winfsp()
     CYGFUSE_GET_API(h, fsp_fuse_unmount);
     CYGFUSE_GET_API(h, fsp_fuse_parse_cmdline);
     CYGFUSE_GET_API(h, fsp_fuse_ntstatus_from_errno);
+    CYGFUSE_GET_API(h, fsp_fuse_buf_size);
+    CYGFUSE_GET_API(h, fsp_fuse_buf_copy);
 
     /* fuse.h */
     CYGFUSE_GET_API(h, fsp_fuse_main_real);
@@ -127,6 +130,23 @@ static void *cygfuse_init_winfsp()
     CYGFUSE_GET_API(h, fsp_fuse_exit);
     CYGFUSE_GET_API(h, fsp_fuse_get_context);
 
+    /* fuse_lowlevel.h */
+    CYGFUSE_GET_API(h, fsp_fuse_lowlevel_new);
+    CYGFUSE_GET_API(h, fsp_fuse_session_add_chan);
+    CYGFUSE_GET_API(h, fsp_fuse_reply_err);
+    CYGFUSE_GET_API(h, fsp_fuse_reply_entry);
+    CYGFUSE_GET_API(h, fsp_fuse_reply_create);
+    CYGFUSE_GET_API(h, fsp_fuse_reply_attr);
+    CYGFUSE_GET_API(h, fsp_fuse_reply_readlink);
+    CYGFUSE_GET_API(h, fsp_fuse_reply_open);
+    CYGFUSE_GET_API(h, fsp_fuse_reply_write);
+    CYGFUSE_GET_API(h, fsp_fuse_reply_buf);
+    CYGFUSE_GET_API(h, fsp_fuse_reply_data);
+    CYGFUSE_GET_API(h, fsp_fuse_reply_statfs);
+    CYGFUSE_GET_API(h, fsp_fuse_add_direntry);
+    CYGFUSE_GET_API(h, fsp_fuse_req_userdata);
+    CYGFUSE_GET_API(h, fsp_fuse_req_ctx);
+
     /* fuse_opt.h */
     CYGFUSE_GET_API(h, fsp_fuse_opt_parse);
     CYGFUSE_GET_API(h, fsp_fuse_opt_add_arg);
@@ -16,12 +16,41 @@
  */
 
 #include <dll/library.h>
+#include <shared/payload.h>
 
 enum
 {
     FspFileSystemDispatcherThreadCountMin = 2,
+    FspFileSystemDispatcherBatchBufferSize = 4 * FSP_FSCTL_TRANSACT_BATCH_BUFFER_SIZEMIN,
+    FspFileSystemExecutorIoThreadCount = 2,
 };
 
+#pragma warning(push)
+#pragma warning(disable:4200)           /* zero-sized array in struct/union */
+typedef struct
+{
+    LIST_ENTRY ListEntry;
+    FSP_FSCTL_DECLSPEC_ALIGN UINT8 RequestBuf[];
+} FSP_FILE_SYSTEM_EXECUTOR_ITEM;
+typedef struct _FSP_FILE_SYSTEM_EXECUTOR FSP_FILE_SYSTEM_EXECUTOR;
+typedef struct
+{
+    FSP_FILE_SYSTEM_EXECUTOR *Executor;
+    SRWLOCK Lock;
+    LIST_ENTRY ItemList;
+    HANDLE Thread;
+} FSP_FILE_SYSTEM_EXECUTOR_WORKER;
+typedef struct _FSP_FILE_SYSTEM_EXECUTOR
+{
+    FSP_FILE_SYSTEM *FileSystem;
+    HANDLE ItemSemaphore;
+    LONG Stopping;
+    LONG NextWorker;
+    ULONG WorkerCount;
+    FSP_FILE_SYSTEM_EXECUTOR_WORKER Workers[];
+} FSP_FILE_SYSTEM_EXECUTOR;
+#pragma warning(pop)
+
 static FSP_FILE_SYSTEM_INTERFACE FspFileSystemNullInterface;
 
 static INIT_ONCE FspFileSystemInitOnce = INIT_ONCE_STATIC_INIT;
@@ -75,14 +104,20 @@ FSP_API NTSTATUS FspFileSystemCreate(PWSTR DevicePath,
         return STATUS_INSUFFICIENT_RESOURCES;
     memset(FileSystem, 0, sizeof *FileSystem);
 
-    Result = FspFsctlCreateVolume(DevicePath, VolumeParams,
-        FileSystem->VolumeName, sizeof FileSystem->VolumeName,
-        &FileSystem->VolumeHandle);
-    if (!NT_SUCCESS(Result))
+    if (0 != DevicePath)
     {
-        MemFree(FileSystem);
-        return Result;
+        Result = FspFsctlCreateVolume(DevicePath, VolumeParams,
+            FileSystem->VolumeName, sizeof FileSystem->VolumeName,
+            &FileSystem->VolumeHandle);
+        if (!NT_SUCCESS(Result))
+        {
+            MemFree(FileSystem);
+            return Result;
+        }
     }
+    else
+        /* detached file system; see FspFileSystemReplayTrace */
+        FileSystem->VolumeHandle = INVALID_HANDLE_VALUE;
 
     FileSystem->Operations[FspFsctlTransactCreateKind] = FspFileSystemOpCreate;
     FileSystem->Operations[FspFsctlTransactOverwriteKind] = FspFileSystemOpOverwrite;
@@ -100,8 +135,16 @@ FSP_API NTSTATUS FspFileSystemCreate(PWSTR DevicePath,
     FileSystem->Operations[FspFsctlTransactSetSecurityKind] = FspFileSystemOpSetSecurity;
     FileSystem->Interface = Interface;
 
+    FileSystem->RequestSizeMax = FspPayloadRequestSizeMax(
+        0 != VolumeParams && VolumeParams->ExtendedPayload);
+    FileSystem->ResponseSizeMax = FspPayloadResponseSizeMax(
+        0 != VolumeParams && VolumeParams->ExtendedPayload);
+
     FileSystem->OpGuardStrategy = FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY_FINE;
     InitializeSRWLock(&FileSystem->OpGuardLock);
+    for (ULONG Index = 0;
+        sizeof FileSystem->OpGuardStripes / sizeof FileSystem->OpGuardStripes[0] > Index; Index++)
+        InitializeSRWLock(&FileSystem->OpGuardStripes[Index]);
     FileSystem->EnterOperation = FspFileSystemOpEnter;
     FileSystem->LeaveOperation = FspFileSystemOpLeave;
 
@@ -113,13 +156,17 @@ FSP_API NTSTATUS FspFileSystemCreate(PWSTR DevicePath,
 FSP_API VOID FspFileSystemDelete(FSP_FILE_SYSTEM *FileSystem)
 {
     FspFileSystemRemoveMountPoint(FileSystem);
-    CloseHandle(FileSystem->VolumeHandle);
+    if (INVALID_HANDLE_VALUE != FileSystem->VolumeHandle)
+        CloseHandle(FileSystem->VolumeHandle);
+    FspFileSystemStatisticsFinalize(FileSystem);
+    FspFileSystemTraceFinalize(FileSystem);
+    FspFileSystemSecurityCacheFinalize(FileSystem);
     MemFree(FileSystem);
 }
 
 FSP_API NTSTATUS FspFileSystemSetMountPoint(FSP_FILE_SYSTEM *FileSystem, PWSTR MountPoint)
 {
-    if (0 != FileSystem->MountPoint)
+    if (0 != FileSystem->MountPoint || INVALID_HANDLE_VALUE == FileSystem->VolumeHandle)
         return STATUS_INVALID_PARAMETER;
 
     NTSTATUS Result;
@@ -235,17 +282,100 @@ FSP_API VOID FspFileSystemRemoveMountPoint(FSP_FILE_SYSTEM *FileSystem)
     }
 }
 
+BOOLEAN FspFileSystemDispatchRequest(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FSCTL_TRANSACT_REQ *Request, FSP_FSCTL_TRANSACT_RSP *Response)
+{
+    SIZE_T ResponseSize;
+    UINT64 Timestamp = 0;
+
+    if (FileSystem->DebugLog)
+    {
+        if (FspFsctlTransactKindCount <= Request->Kind ||
+            (FileSystem->DebugLog & (1 << Request->Kind)))
+            FspDebugLogRequest(Request);
+    }
+    if (0 != FileSystem->Trace)
+        FspFileSystemTraceAdd(FileSystem, FspFileSystemTraceRequestKind, Request, Request->Size);
+
+    memset(Response, 0, sizeof *Response);
+    Response->Size = sizeof *Response;
+    Response->Kind = Request->Kind;
+    Response->Hint = Request->Hint;
+    if (0 != FileSystem->Statistics)
+        Timestamp = FspFileSystemStatisticsTimestamp();
+    if (FspFsctlTransactKindCount > Request->Kind && 0 != FileSystem->Operations[Request->Kind])
+    {
+        Response->IoStatus.Status =
+            FspFileSystemEnterOperation(FileSystem, Request, Response);
+        if (NT_SUCCESS(Response->IoStatus.Status))
+        {
+            Response->IoStatus.Status =
+                FileSystem->Operations[Request->Kind](FileSystem, Request, Response);
+            FspFileSystemLeaveOperation(FileSystem, Request, Response);
+        }
+    }
+    else
+        Response->IoStatus.Status = STATUS_INVALID_DEVICE_REQUEST;
+    if (0 != FileSystem->Statistics)
+        FspFileSystemStatisticsAddOperation(FileSystem, Request, Response, Timestamp);
+
+    if (FileSystem->DebugLog)
+    {
+        if (FspFsctlTransactKindCount <= Response->Kind ||
+            (FileSystem->DebugLog & (1 << Response->Kind)))
+            FspDebugLogResponse(Response);
+    }
+
+    ResponseSize = FSP_FSCTL_DEFAULT_ALIGN_UP(Response->Size);
+    if (FileSystem->ResponseSizeMax < ResponseSize/* should NOT happen */)
+    {
+        memset(Response, 0, sizeof *Response);
+        Response->Size = sizeof *Response;
+        Response->Kind = Request->Kind;
+        Response->Hint = Request->Hint;
+        Response->IoStatus.Status = STATUS_INVALID_DEVICE_REQUEST;
+    }
+    else if (STATUS_PENDING == Response->IoStatus.Status)
+        return FALSE;
+    else
+    {
+        memset((PUINT8)Response + Response->Size, 0, ResponseSize - Response->Size);
+        Response->Size = (UINT16)ResponseSize;
+    }
+
+    if (0 != FileSystem->Trace)
+        FspFileSystemTraceAdd(FileSystem, FspFileSystemTraceResponseKind, Response, Response->Size);
+
+    return TRUE;
+}
+
+static VOID FspFileSystemTransactResponse(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FSCTL_TRANSACT_RSP *Response)
+{
+    NTSTATUS Result;
+
+    Result = FspFsctlTransact(FileSystem->VolumeHandle,
+        Response, Response->Size, 0, 0, FALSE);
+    if (!NT_SUCCESS(Result))
+    {
+        FspFileSystemSetDispatcherResult(FileSystem, Result);
+
+        FspFsctlStop(FileSystem->VolumeHandle);
+    }
+}
+
 static DWORD WINAPI FspFileSystemDispatcherThread(PVOID FileSystem0)
 {
     FSP_FILE_SYSTEM *FileSystem = FileSystem0;
     NTSTATUS Result;
-    SIZE_T RequestSize, ResponseSize;
+    SIZE_T RequestSize;
     FSP_FSCTL_TRANSACT_REQ *Request = 0;
     FSP_FSCTL_TRANSACT_RSP *Response = 0;
     HANDLE DispatcherThread = 0;
+    UINT64 Timestamp = 0;
 
-    Request = MemAlloc(FSP_FSCTL_TRANSACT_BUFFER_SIZEMIN);
-    Response = MemAlloc(FSP_FSCTL_TRANSACT_RSP_SIZEMAX);
+    Request = MemAlloc(FileSystem->RequestSizeMax);
+    Response = MemAlloc(FileSystem->ResponseSizeMax);
     if (0 == Request || 0 == Response)
     {
         Result = STATUS_INSUFFICIENT_RESOURCES;
@@ -266,9 +396,13 @@ static DWORD WINAPI FspFileSystemDispatcherThread(PVOID FileSystem0)
     memset(Response, 0, sizeof *Response);
     for (;;)
     {
-        RequestSize = FSP_FSCTL_TRANSACT_BUFFER_SIZEMIN;
+        RequestSize = FileSystem->RequestSizeMax;
+        if (0 != FileSystem->Statistics)
+            Timestamp = FspFileSystemStatisticsTimestamp();
         Result = FspFsctlTransact(FileSystem->VolumeHandle,
             Response, Response->Size, Request, &RequestSize, FALSE);
+        if (0 != FileSystem->Statistics)
+            FspFileSystemStatisticsAddTransact(FileSystem, Result, RequestSize, Timestamp);
         if (!NT_SUCCESS(Result))
             goto exit;
 
@@ -276,67 +410,360 @@ static DWORD WINAPI FspFileSystemDispatcherThread(PVOID FileSystem0)
         if (0 == RequestSize)
             continue;
 
-        if (FileSystem->DebugLog)
+        if (!FspFileSystemDispatchRequest(FileSystem, Request, Response))
+            memset(Response, 0, sizeof *Response);
+    }
+
+exit:
+    MemFree(Response);
+    MemFree(Request);
+
+    FspFileSystemSetDispatcherResult(FileSystem, Result);
+
+    FspFsctlStop(FileSystem->VolumeHandle);
+
+    if (0 != DispatcherThread)
+    {
+        WaitForSingleObject(DispatcherThread, INFINITE);
+        CloseHandle(DispatcherThread);
+    }
+
+    return Result;
+}
+
+static DWORD WINAPI FspFileSystemBatchDispatcherThread(PVOID FileSystem0)
+{
+    FSP_FILE_SYSTEM *FileSystem = FileSystem0;
+    NTSTATUS Result;
+    SIZE_T BatchBufferSize, RequestBufSize;
+    PUINT8 RequestBuf = 0, ResponseBuf = 0;
+    PUINT8 RequestBufEnd, ResponseBufEnd;
+    FSP_FSCTL_TRANSACT_REQ *Request, *NextRequest;
+    FSP_FSCTL_TRANSACT_RSP *Response;
+    HANDLE DispatcherThread = 0;
+    UINT64 Timestamp = 0;
+
+    /* the FSD ends a batch when the largest request no longer fits; keep room for a full batch */
+    BatchBufferSize = FspFileSystemDispatcherBatchBufferSize +
+        FileSystem->RequestSizeMax - FSP_FSCTL_TRANSACT_REQ_SIZEMAX;
+    RequestBuf = MemAlloc(BatchBufferSize);
+    ResponseBuf = MemAlloc(BatchBufferSize);
+    if (0 == RequestBuf || 0 == ResponseBuf)
+    {
+        Result = STATUS_INSUFFICIENT_RESOURCES;
+        goto exit;
+    }
+
+    if (1 < FileSystem->DispatcherThreadCount)
+    {
+        FileSystem->DispatcherThreadCount--;
+        DispatcherThread = CreateThread(0, 0, FspFileSystemBatchDispatcherThread, FileSystem, 0, 0);
+        if (0 == DispatcherThread)
         {
-            if (FspFsctlTransactKindCount <= Request->Kind ||
-                (FileSystem->DebugLog & (1 << Request->Kind)))
-                FspDebugLogRequest(Request);
+            Result = FspNtStatusFromWin32(GetLastError());
+            goto exit;
         }
+    }
 
-        Response->Size = sizeof *Response;
-        Response->Kind = Request->Kind;
-        Response->Hint = Request->Hint;
-        if (FspFsctlTransactKindCount > Request->Kind && 0 != FileSystem->Operations[Request->Kind])
+    /*
+     * Responses to the requests of one batch are coalesced into ResponseBuf and are
+     * delivered to the FSD together with the transact that fetches the next batch.
+     * If ResponseBuf fills up before the batch is processed, the responses collected
+     * so far are flushed with a send-only transact.
+     */
+    ResponseBufEnd = ResponseBuf + BatchBufferSize;
+    Response = (PVOID)ResponseBuf;
+    for (;;)
+    {
+        RequestBufSize = BatchBufferSize;
+        if (0 != FileSystem->Statistics)
+            Timestamp = FspFileSystemStatisticsTimestamp();
+        Result = FspFsctlTransact(FileSystem->VolumeHandle,
+            ResponseBuf, (PUINT8)Response - ResponseBuf, RequestBuf, &RequestBufSize, TRUE);
+        if (0 != FileSystem->Statistics)
+            FspFileSystemStatisticsAddTransact(FileSystem, Result, RequestBufSize, Timestamp);
+        if (!NT_SUCCESS(Result))
+            goto exit;
+
+        Response = (PVOID)ResponseBuf;
+        RequestBufEnd = RequestBuf + RequestBufSize;
+        for (Request = (PVOID)RequestBuf;
+            0 != (NextRequest = FspFsctlTransactConsumeRequest(Request, RequestBufEnd));
+            Request = NextRequest)
         {
-            Response->IoStatus.Status =
-                FspFileSystemEnterOperation(FileSystem, Request, Response);
-            if (NT_SUCCESS(Response->IoStatus.Status))
+            if ((PUINT8)Response + FileSystem->ResponseSizeMax > ResponseBufEnd)
             {
-                Response->IoStatus.Status =
-                    FileSystem->Operations[Request->Kind](FileSystem, Request, Response);
-                FspFileSystemLeaveOperation(FileSystem, Request, Response);
+                Result = FspFsctlTransact(FileSystem->VolumeHandle,
+                    ResponseBuf, (PUINT8)Response - ResponseBuf, 0, 0, FALSE);
+                if (!NT_SUCCESS(Result))
+                    goto exit;
+
+                Response = (PVOID)ResponseBuf;
             }
+
+            if (FspFileSystemDispatchRequest(FileSystem, Request, Response))
+                Response = FspFsctlTransactProduceResponse(Response, Response->Size);
         }
-        else
-            Response->IoStatus.Status = STATUS_INVALID_DEVICE_REQUEST;
+    }
+
+exit:
+    MemFree(ResponseBuf);
+    MemFree(RequestBuf);
+
+    FspFileSystemSetDispatcherResult(FileSystem, Result);
+
+    FspFsctlStop(FileSystem->VolumeHandle);
 
-        if (FileSystem->DebugLog)
+    if (0 != DispatcherThread)
+    {
+        WaitForSingleObject(DispatcherThread, INFINITE);
+        CloseHandle(DispatcherThread);
+    }
+
+    return Result;
+}
+
+/*
+ * The executor decouples fetching requests from the FSD from executing them.
+ *
+ * A small number of I/O threads fetch batches of requests and distribute them
+ * round-robin to per-worker deques. Each worker executes requests from the head
+ * of its own deque; when its deque is empty it steals from the tail of the other
+ * deques. The item semaphore counts queued requests, so a worker that acquires it
+ * is guaranteed to find a request in some deque. Responses are sent back to the
+ * FSD directly by the workers.
+ */
+static VOID FspFileSystemExecutorPush(FSP_FILE_SYSTEM_EXECUTOR_WORKER *Worker,
+    FSP_FILE_SYSTEM_EXECUTOR_ITEM *Item)
+{
+    AcquireSRWLockExclusive(&Worker->Lock);
+    InsertTailList(&Worker->ItemList, &Item->ListEntry);
+    ReleaseSRWLockExclusive(&Worker->Lock);
+}
+
+static FSP_FILE_SYSTEM_EXECUTOR_ITEM *FspFileSystemExecutorPop(
+    FSP_FILE_SYSTEM_EXECUTOR_WORKER *Worker, BOOLEAN Steal)
+{
+    PLIST_ENTRY ListEntry;
+
+    AcquireSRWLockExclusive(&Worker->Lock);
+    ListEntry = Steal ? Worker->ItemList.Blink : Worker->ItemList.Flink;
+    if (&Worker->ItemList != ListEntry)
+        RemoveEntryList(ListEntry);
+    else
+        ListEntry = 0;
+    ReleaseSRWLockExclusive(&Worker->Lock);
+
+    return 0 != ListEntry ?
+        CONTAINING_RECORD(ListEntry, FSP_FILE_SYSTEM_EXECUTOR_ITEM, ListEntry) : 0;
+}
+
+static DWORD WINAPI FspFileSystemExecutorWorkerThread(PVOID Worker0)
+{
+    FSP_FILE_SYSTEM_EXECUTOR_WORKER *Worker = Worker0;
+    FSP_FILE_SYSTEM_EXECUTOR *Executor = Worker->Executor;
+    FSP_FILE_SYSTEM *FileSystem = Executor->FileSystem;
+    FSP_FILE_SYSTEM_EXECUTOR_ITEM *Item;
+    FSP_FSCTL_TRANSACT_RSP *Response;
+    ULONG Index, WorkerIndex;
+
+    Response = MemAlloc(FileSystem->ResponseSizeMax);
+    if (0 == Response)
+    {
+        FspFileSystemSetDispatcherResult(FileSystem, STATUS_INSUFFICIENT_RESOURCES);
+        FspFsctlStop(FileSystem->VolumeHandle);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    WorkerIndex = (ULONG)(Worker - Executor->Workers);
+    for (;;)
+    {
+        WaitForSingleObject(Executor->ItemSemaphore, INFINITE);
+        if (Executor->Stopping)
+            break;
+
+        Item = FspFileSystemExecutorPop(Worker, FALSE);
+        for (Index = 1; 0 == Item; Index++)
+            Item = FspFileSystemExecutorPop(
+                &Executor->Workers[(WorkerIndex + Index) % Executor->WorkerCount], TRUE);
+
+        if (FspFileSystemDispatchRequest(FileSystem, (PVOID)Item->RequestBuf, Response))
+            FspFileSystemTransactResponse(FileSystem, Response);
+
+        MemFree(Item);
+    }
+
+    MemFree(Response);
+
+    return STATUS_SUCCESS;
+}
+
+static DWORD WINAPI FspFileSystemExecutorIoThread(PVOID Executor0)
+{
+    FSP_FILE_SYSTEM_EXECUTOR *Executor = Executor0;
+    FSP_FILE_SYSTEM *FileSystem = Executor->FileSystem;
+    NTSTATUS Result;
+    SIZE_T BatchBufferSize, RequestBufSize;
+    PUINT8 RequestBuf = 0, RequestBufEnd;
+    FSP_FSCTL_TRANSACT_REQ *Request, *NextRequest;
+    FSP_FSCTL_TRANSACT_RSP *Response = 0;
+    FSP_FILE_SYSTEM_EXECUTOR_ITEM *Item;
+    ULONG WorkerIndex;
+    UINT64 Timestamp = 0;
+
+    /* see FspFileSystemBatchDispatcherThread */
+    BatchBufferSize = FspFileSystemDispatcherBatchBufferSize +
+        FileSystem->RequestSizeMax - FSP_FSCTL_TRANSACT_REQ_SIZEMAX;
+    RequestBuf = MemAlloc(BatchBufferSize);
+    Response = MemAlloc(FileSystem->ResponseSizeMax);
+    if (0 == RequestBuf || 0 == Response)
+    {
+        Result = STATUS_INSUFFICIENT_RESOURCES;
+        goto exit;
+    }
+
+    for (;;)
+    {
+        RequestBufSize = BatchBufferSize;
+        if (0 != FileSystem->Statistics)
+            Timestamp = FspFileSystemStatisticsTimestamp();
+        Result = FspFsctlTransact(FileSystem->VolumeHandle,
+            0, 0, RequestBuf, &RequestBufSize, TRUE);
+        if (0 != FileSystem->Statistics)
+            FspFileSystemStatisticsAddTransact(FileSystem, Result, RequestBufSize, Timestamp);
+        if (!NT_SUCCESS(Result))
+            goto exit;
+
+        RequestBufEnd = RequestBuf + RequestBufSize;
+        for (Request = (PVOID)RequestBuf;
+            0 != (NextRequest = FspFsctlTransactConsumeRequest(Request, RequestBufEnd));
+            Request = NextRequest)
         {
-            if (FspFsctlTransactKindCount <= Response->Kind ||
-                (FileSystem->DebugLog & (1 << Response->Kind)))
-                FspDebugLogResponse(Response);
+            Item = MemAlloc(sizeof *Item + Request->Size);
+            if (0 == Item)
+            {
+                /* cannot queue the request; execute it on this thread instead */
+                if (FspFileSystemDispatchRequest(FileSystem, Request, Response))
+                    FspFileSystemTransactResponse(FileSystem, Response);
+                continue;
+            }
+
+            memcpy(Item->RequestBuf, Request, Request->Size);
+
+            WorkerIndex = (ULONG)InterlockedIncrement(&Executor->NextWorker) %
+                Executor->WorkerCount;
+            FspFileSystemExecutorPush(&Executor->Workers[WorkerIndex], Item);
+            ReleaseSemaphore(Executor->ItemSemaphore, 1, 0);
         }
+    }
+
+exit:
+    MemFree(Response);
+    MemFree(RequestBuf);
+
+    FspFileSystemSetDispatcherResult(FileSystem, Result);
+
+    FspFsctlStop(FileSystem->VolumeHandle);
+
+    return Result;
+}
 
-        ResponseSize = FSP_FSCTL_DEFAULT_ALIGN_UP(Response->Size);
-        if (FSP_FSCTL_TRANSACT_RSP_SIZEMAX < ResponseSize/* should NOT happen */)
+static DWORD WINAPI FspFileSystemExecutorThread(PVOID FileSystem0)
+{
+    FSP_FILE_SYSTEM *FileSystem = FileSystem0;
+    FSP_FILE_SYSTEM_EXECUTOR *Executor = 0;
+    FSP_FILE_SYSTEM_EXECUTOR_WORKER *Worker;
+    FSP_FILE_SYSTEM_EXECUTOR_ITEM *Item;
+    HANDLE IoThreads[FspFileSystemExecutorIoThreadCount - 1] = { 0 };
+    ULONG WorkerCount = FileSystem->DispatcherThreadCount;
+    ULONG Index;
+    NTSTATUS Result;
+
+    Executor = MemAlloc(sizeof *Executor + WorkerCount * sizeof Executor->Workers[0]);
+    if (0 == Executor)
+    {
+        Result = STATUS_INSUFFICIENT_RESOURCES;
+        goto exit;
+    }
+    memset(Executor, 0, sizeof *Executor + WorkerCount * sizeof Executor->Workers[0]);
+    Executor->FileSystem = FileSystem;
+    Executor->WorkerCount = WorkerCount;
+    for (Index = 0; WorkerCount > Index; Index++)
+    {
+        Worker = &Executor->Workers[Index];
+        Worker->Executor = Executor;
+        InitializeSRWLock(&Worker->Lock);
+        Worker->ItemList.Flink = Worker->ItemList.Blink = &Worker->ItemList;
+    }
+
+    Executor->ItemSemaphore = CreateSemaphoreW(0, 0, MAXLONG, 0);
+    if (0 == Executor->ItemSemaphore)
+    {
+        Result = FspNtStatusFromWin32(GetLastError());
+        goto exit;
+    }
+
+    for (Index = 0; WorkerCount > Index; Index++)
+    {
+        Worker = &Executor->Workers[Index];
+        Worker->Thread = CreateThread(0, 0, FspFileSystemExecutorWorkerThread, Worker, 0, 0);
+        if (0 == Worker->Thread)
         {
-            memset(Response, 0, sizeof *Response);
-            Response->Size = sizeof *Response;
-            Response->Kind = Request->Kind;
-            Response->Hint = Request->Hint;
-            Response->IoStatus.Status = STATUS_INVALID_DEVICE_REQUEST;
+            Result = FspNtStatusFromWin32(GetLastError());
+            goto exit;
         }
-        else if (STATUS_PENDING == Response->IoStatus.Status)
-            memset(Response, 0, sizeof *Response);
-        else
+    }
+
+    for (Index = 0; FspFileSystemExecutorIoThreadCount - 1 > Index; Index++)
+    {
+        IoThreads[Index] = CreateThread(0, 0, FspFileSystemExecutorIoThread, Executor, 0, 0);
+        if (0 == IoThreads[Index])
         {
-            memset((PUINT8)Response + Response->Size, 0, ResponseSize - Response->Size);
-            Response->Size = (UINT16)ResponseSize;
+            Result = FspNtStatusFromWin32(GetLastError());
+            goto exit;
         }
     }
 
-exit:
-    MemFree(Response);
-    MemFree(Request);
+    Result = FspFileSystemExecutorIoThread(Executor);
 
+exit:
     FspFileSystemSetDispatcherResult(FileSystem, Result);
 
     FspFsctlStop(FileSystem->VolumeHandle);
 
-    if (0 != DispatcherThread)
+    for (Index = 0; FspFileSystemExecutorIoThreadCount - 1 > Index; Index++)
+        if (0 != IoThreads[Index])
+        {
+            WaitForSingleObject(IoThreads[Index], INFINITE);
+            CloseHandle(IoThreads[Index]);
+        }
+
+    if (0 != Executor)
     {
-        WaitForSingleObject(DispatcherThread, INFINITE);
-        CloseHandle(DispatcherThread);
+        if (0 != Executor->ItemSemaphore)
+        {
+            InterlockedExchange(&Executor->Stopping, 1);
+            ReleaseSemaphore(Executor->ItemSemaphore, WorkerCount, 0);
+        }
+
+        for (Index = 0; WorkerCount > Index; Index++)
+        {
+            Worker = &Executor->Workers[Index];
+            if (0 != Worker->Thread)
+            {
+                WaitForSingleObject(Worker->Thread, INFINITE);
+                CloseHandle(Worker->Thread);
+            }
+
+            /* requests that were never executed are cancelled by the FSD when it stops */
+            while (0 != (Item = FspFileSystemExecutorPop(Worker, FALSE)))
+                MemFree(Item);
+        }
+
+        if (0 != Executor->ItemSemaphore)
+            CloseHandle(Executor->ItemSemaphore);
+
+        MemFree(Executor);
     }
 
     return Result;
@@ -344,7 +771,19 @@ exit:
 
 FSP_API NTSTATUS FspFileSystemStartDispatcher(FSP_FILE_SYSTEM *FileSystem, ULONG ThreadCount)
 {
-    if (0 != FileSystem->DispatcherThread)
+    return FspFileSystemStartDispatcherEx(FileSystem, ThreadCount, 0);
+}
+
+FSP_API NTSTATUS FspFileSystemStartDispatcherEx(FSP_FILE_SYSTEM *FileSystem, ULONG ThreadCount,
+    ULONG Flags)
+{
+    if (0 != FileSystem->DispatcherThread || INVALID_HANDLE_VALUE == FileSystem->VolumeHandle)
+        return STATUS_INVALID_PARAMETER;
+
+    /* the dispatcher modes are mutually exclusive; reserve undefined flags for future use */
+    if (0 != (Flags & ~(FSP_FILE_SYSTEM_DISPATCHER_BATCH | FSP_FILE_SYSTEM_DISPATCHER_EXECUTOR)) ||
+        (FSP_FILE_SYSTEM_DISPATCHER_BATCH | FSP_FILE_SYSTEM_DISPATCHER_EXECUTOR) ==
+            (Flags & (FSP_FILE_SYSTEM_DISPATCHER_BATCH | FSP_FILE_SYSTEM_DISPATCHER_EXECUTOR)))
         return STATUS_INVALID_PARAMETER;
 
     if (0 == ThreadCount)
@@ -362,8 +801,12 @@ FSP_API NTSTATUS FspFileSystemStartDispatcher(FSP_FILE_SYSTEM *FileSystem, ULONG
         ThreadCount = FspFileSystemDispatcherThreadCountMin;
 
     FileSystem->DispatcherThreadCount = ThreadCount;
+    FileSystem->DispatcherFlags = Flags;
     FileSystem->DispatcherThread = CreateThread(0, 0,
-        FspFileSystemDispatcherThread, FileSystem, 0, 0);
+        (Flags & FSP_FILE_SYSTEM_DISPATCHER_EXECUTOR) ? FspFileSystemExecutorThread :
+        (Flags & FSP_FILE_SYSTEM_DISPATCHER_BATCH) ? FspFileSystemBatchDispatcherThread :
+            FspFileSystemDispatcherThread,
+        FileSystem, 0, 0);
     if (0 == FileSystem->DispatcherThread)
         return FspNtStatusFromWin32(GetLastError());
 
@@ -385,21 +828,14 @@ FSP_API VOID FspFileSystemStopDispatcher(FSP_FILE_SYSTEM *FileSystem)
 FSP_API VOID FspFileSystemSendResponse(FSP_FILE_SYSTEM *FileSystem,
     FSP_FSCTL_TRANSACT_RSP *Response)
 {
-    NTSTATUS Result;
-
     if (FileSystem->DebugLog)
     {
         if (FspFsctlTransactKindCount <= Response->Kind ||
             (FileSystem->DebugLog & (1 << Response->Kind)))
             FspDebugLogResponse(Response);
     }
+    if (0 != FileSystem->Trace)
+        FspFileSystemTraceAdd(FileSystem, FspFileSystemTraceResponseKind, Response, Response->Size);
 
-    Result = FspFsctlTransact(FileSystem->VolumeHandle,
-        Response, Response->Size, 0, 0, FALSE);
-    if (!NT_SUCCESS(Result))
-    {
-        FspFileSystemSetDispatcherResult(FileSystem, Result);
-
-        FspFsctlStop(FileSystem->VolumeHandle);
-    }
+    FspFileSystemTransactResponse(FileSystem, Response);
 }
@@ -19,7 +19,7 @@
 
 /*
  * The FspFileSystemOpEnter/FspFileSystemOpLeave functions guard against
- * concurrent accesses. Two concurrency models are provided:
+ * concurrent accesses. Four concurrency models are provided:
  *
  * 1. A fine-grained concurrency model where file system NAMESPACE accesses
  * are guarded using an exclusive-shared (read-write) lock. File I/O is not
@@ -35,8 +35,198 @@
  *
  * 2. A coarse-grained concurrency model where all file system accesses are
  * guarded by a mutually exclusive lock.
+ *
+ * 3. A striped concurrency model that applies the fine-grained rules per
+ * directory. Namespace accesses lock one or more stripes of a lock table;
+ * a stripe is selected by hashing the name of a directory, so that namespace
+ * changes in one directory do not block accesses to unrelated directories.
+ *
+ * The striped concurrency model locks the following directories:
+ *     - EXCL: Create: parent
+ *     - EXCL: Cleanup(Delete): parent, file (in case it is a directory)
+ *     - SHRD: Open: parent
+ *     - SHRD: SetInformation(Disposition): parent, file
+ *     - SHRD: ReadDirectory: file
+ *     - NONE: all other operations
+ * Multiple stripes are acquired in index order. SetVolumeLabel and
+ * SetInformation(Rename) acquire the volume lock and all stripes exclusive;
+ * GetVolumeInfo acquires the volume lock shared. A rename is not confined to
+ * its parent directories: renaming a directory changes the names of all files
+ * below it, so it must exclude namespace accesses anywhere in its subtree.
+ * (The request does not tell whether the renamed file is a directory.)
+ *
+ * Namespace accesses in different directories run concurrently. The striped
+ * model is therefore only suitable for file systems that keep a separate index
+ * per directory (or otherwise tolerate concurrent changes to different
+ * directories); a file system with a single path-keyed index must use the
+ * fine-grained model.
+ *
+ * Names are hashed with ASCII characters folded to upper case and all other
+ * characters treated as equal, so that names that differ only in case always
+ * hash to the same stripe, regardless of the case sensitivity of the file system.
+ *
+ * 4. No concurrency model. No file system accesses are guarded; the file system
+ * must do its own locking.
  */
 
+#define FspFileSystemOpGuardStripeCount \
+    (sizeof ((FSP_FILE_SYSTEM *)0)->OpGuardStripes / sizeof ((FSP_FILE_SYSTEM *)0)->OpGuardStripes[0])
+
+static inline
+ULONG FspFileSystemOpGuardStripe(PWSTR FileName, ULONG FileNameSize, BOOLEAN Parent)
+{
+    PWSTR EndP, P;
+    UINT32 Hash = 2166136261;
+    WCHAR C;
+
+    /* the name is bounded by its size; it need not be term-0 */
+    EndP = FileName;
+    while (FileName + FileNameSize / sizeof(WCHAR) > EndP && L'\0' != *EndP)
+        EndP++;
+    if (Parent)
+        /* hash the parent directory: everything up to the last backslash */
+        while (FileName < EndP && L'\\' != EndP[-1])
+            EndP--;
+    /* trailing backslashes are not part of a directory name; the root is the empty name */
+    while (FileName < EndP && L'\\' == EndP[-1])
+        EndP--;
+
+    for (P = FileName; EndP > P; P++)
+    {
+        C = *P;
+        if (L'a' <= C && C <= L'z')
+            C -= L'a' - L'A';
+        else if (0x80 <= C)
+            C = 0x80;
+        Hash = (Hash ^ C) * 16777619;
+    }
+
+    return Hash % FspFileSystemOpGuardStripeCount;
+}
+
+static ULONG FspFileSystemOpGuardStripes(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FSCTL_TRANSACT_REQ *Request, ULONG Stripes[2], PBOOLEAN PExclusive)
+{
+    PWSTR FileName = (PWSTR)(Request->Buffer + Request->FileName.Offset);
+    ULONG FileNameSize = Request->FileName.Size;
+    ULONG Count = 0, Stripe, I, J;
+
+    *PExclusive = FALSE;
+
+    /* requests without a file name do not access the namespace */
+    if (0 == FileNameSize)
+        return 0;
+
+    switch (Request->Kind)
+    {
+    case FspFsctlTransactCreateKind:
+        *PExclusive = FILE_OPEN != ((Request->Req.Create.CreateOptions >> 24) & 0xff);
+        Stripes[Count++] = FspFileSystemOpGuardStripe(FileName, FileNameSize, TRUE);
+        break;
+    case FspFsctlTransactCleanupKind:
+        if (!Request->Req.Cleanup.Delete)
+            return 0;
+        *PExclusive = TRUE;
+        Stripes[Count++] = FspFileSystemOpGuardStripe(FileName, FileNameSize, TRUE);
+        Stripes[Count++] = FspFileSystemOpGuardStripe(FileName, FileNameSize, FALSE);
+        break;
+    case FspFsctlTransactSetInformationKind:
+        switch (Request->Req.SetInformation.FileInformationClass)
+        {
+        case 13/*FileDispositionInformation*/:
+            Stripes[Count++] = FspFileSystemOpGuardStripe(FileName, FileNameSize, TRUE);
+            Stripes[Count++] = FspFileSystemOpGuardStripe(FileName, FileNameSize, FALSE);
+            break;
+        default:
+            return 0;
+        }
+        break;
+    case FspFsctlTransactQueryDirectoryKind:
+        /* the FSD sends the name of the directory being read */
+        Stripes[Count++] = FspFileSystemOpGuardStripe(FileName, FileNameSize, FALSE);
+        break;
+    default:
+        return 0;
+    }
+
+    /* sort and remove duplicates, so that stripes are acquired in a canonical order */
+    for (I = 1; Count > I; I++)
+    {
+        Stripe = Stripes[I];
+        for (J = I; 0 < J && Stripes[J - 1] > Stripe; J--)
+            Stripes[J] = Stripes[J - 1];
+        Stripes[J] = Stripe;
+    }
+    for (I = 1, J = 1; Count > I; I++)
+        if (Stripes[J - 1] != Stripes[I])
+            Stripes[J++] = Stripes[I];
+
+    return J;
+}
+
+static inline
+BOOLEAN FspFileSystemOpGuardStripesAll(FSP_FSCTL_TRANSACT_REQ *Request)
+{
+    return FspFsctlTransactSetVolumeInformationKind == Request->Kind ||
+        (FspFsctlTransactSetInformationKind == Request->Kind &&
+            10/*FileRenameInformation*/ == Request->Req.SetInformation.FileInformationClass);
+}
+
+static VOID FspFileSystemOpEnterStriped(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FSCTL_TRANSACT_REQ *Request)
+{
+    ULONG Stripes[2], Count, I;
+    BOOLEAN Exclusive;
+
+    if (FspFileSystemOpGuardStripesAll(Request))
+    {
+        AcquireSRWLockExclusive(&FileSystem->OpGuardLock);
+        for (I = 0; FspFileSystemOpGuardStripeCount > I; I++)
+            AcquireSRWLockExclusive(&FileSystem->OpGuardStripes[I]);
+        return;
+    }
+    if (FspFsctlTransactQueryVolumeInformationKind == Request->Kind)
+    {
+        AcquireSRWLockShared(&FileSystem->OpGuardLock);
+        return;
+    }
+
+    Count = FspFileSystemOpGuardStripes(FileSystem, Request, Stripes, &Exclusive);
+    for (I = 0; Count > I; I++)
+        if (Exclusive)
+            AcquireSRWLockExclusive(&FileSystem->OpGuardStripes[Stripes[I]]);
+        else
+            AcquireSRWLockShared(&FileSystem->OpGuardStripes[Stripes[I]]);
+}
+
+static VOID FspFileSystemOpLeaveStriped(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FSCTL_TRANSACT_REQ *Request)
+{
+    ULONG Stripes[2], Count, I;
+    BOOLEAN Exclusive;
+
+    if (FspFileSystemOpGuardStripesAll(Request))
+    {
+        for (I = FspFileSystemOpGuardStripeCount; 0 < I; I--)
+            ReleaseSRWLockExclusive(&FileSystem->OpGuardStripes[I - 1]);
+        ReleaseSRWLockExclusive(&FileSystem->OpGuardLock);
+        return;
+    }
+    if (FspFsctlTransactQueryVolumeInformationKind == Request->Kind)
+    {
+        ReleaseSRWLockShared(&FileSystem->OpGuardLock);
+        return;
+    }
+
+    /* recompute the stripes; operations must leave the request file names unchanged */
+    Count = FspFileSystemOpGuardStripes(FileSystem, Request, Stripes, &Exclusive);
+    for (I = Count; 0 < I; I--)
+        if (Exclusive)
+            ReleaseSRWLockExclusive(&FileSystem->OpGuardStripes[Stripes[I - 1]]);
+        else
+            ReleaseSRWLockShared(&FileSystem->OpGuardStripes[Stripes[I - 1]]);
+}
+
 FSP_API NTSTATUS FspFileSystemOpEnter(FSP_FILE_SYSTEM *FileSystem,
     FSP_FSCTL_TRANSACT_REQ *Request, FSP_FSCTL_TRANSACT_RSP *Response)
 {
@@ -67,6 +257,14 @@ FSP_API NTSTATUS FspFileSystemOpEnter(FSP_FILE_SYSTEM *FileSystem,
     case FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY_COARSE:
         AcquireSRWLockExclusive(&FileSystem->OpGuardLock);
         break;
+
+    case FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY_STRIPED:
+        FspFileSystemOpEnterStriped(FileSystem, Request);
+        break;
+
+    case FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY_NONE:
+        /* the file system does its own locking */
+        break;
     }
 
     return STATUS_SUCCESS;
@@ -102,6 +300,13 @@ FSP_API NTSTATUS FspFileSystemOpLeave(FSP_FILE_SYSTEM *FileSystem,
     case FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY_COARSE:
         ReleaseSRWLockExclusive(&FileSystem->OpGuardLock);
         break;
+
+    case FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY_STRIPED:
+        FspFileSystemOpLeaveStriped(FileSystem, Request);
+        break;
+
+    case FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY_NONE:
+        break;
     }
 
     return STATUS_SUCCESS;
@@ -557,6 +762,10 @@ FSP_API NTSTATUS FspFileSystemOpOverwrite(FSP_FILE_SYSTEM *FileSystem,
         return Result;
     }
 
+    /* the file may have become read-only; there is no file name to invalidate */
+    if (0 != (Request->Req.Overwrite.FileAttributes & FILE_ATTRIBUTE_READONLY))
+        FspFileSystemInvalidateSecurityCache(FileSystem, 0);
+
     memcpy(&Response->Rsp.Overwrite.FileInfo, &FileInfo, sizeof FileInfo);
     return STATUS_SUCCESS;
 }
@@ -570,6 +779,9 @@ FSP_API NTSTATUS FspFileSystemOpCleanup(FSP_FILE_SYSTEM *FileSystem,
             0 != Request->FileName.Size ? (PWSTR)Request->Buffer : 0,
             0 != Request->Req.Cleanup.Delete);
 
+    if (0 != Request->FileName.Size && Request->Req.Cleanup.Delete)
+        FspFileSystemInvalidateSecurityCache(FileSystem, (PWSTR)Request->Buffer);
+
     return STATUS_SUCCESS;
 }
 
@@ -688,6 +900,10 @@ FSP_API NTSTATUS FspFileSystemOpSetInformation(FSP_FILE_SYSTEM *FileSystem,
                 Request->Req.SetInformation.Info.Basic.LastAccessTime,
                 Request->Req.SetInformation.Info.Basic.LastWriteTime,
                 &FileInfo);
+        /* file attributes may have changed; there is no file name to invalidate */
+        if (NT_SUCCESS(Result) &&
+            INVALID_FILE_ATTRIBUTES != Request->Req.SetInformation.Info.Basic.FileAttributes)
+            FspFileSystemInvalidateSecurityCache(FileSystem, 0);
         break;
     case 19/*FileAllocationInformation*/:
         if (0 != FileSystem->Interface->SetFileSize)
@@ -738,6 +954,13 @@ FSP_API NTSTATUS FspFileSystemOpSetInformation(FSP_FILE_SYSTEM *FileSystem,
                 (PWSTR)Request->Buffer,
                 (PWSTR)(Request->Buffer + Request->Req.SetInformation.Info.Rename.NewFileName.Offset),
                 0 != Request->Req.SetInformation.Info.Rename.AccessToken);
+            if (NT_SUCCESS(Result))
+            {
+                FspFileSystemInvalidateSecurityCache(FileSystem,
+                    (PWSTR)Request->Buffer);
+                FspFileSystemInvalidateSecurityCache(FileSystem,
+                    (PWSTR)(Request->Buffer + Request->Req.SetInformation.Info.Rename.NewFileName.Offset));
+            }
         }
         break;
     }
@@ -828,7 +1051,7 @@ FSP_API NTSTATUS FspFileSystemOpQuerySecurity(FSP_FILE_SYSTEM *FileSystem,
     if (0 == FileSystem->Interface->GetSecurity)
         return STATUS_INVALID_DEVICE_REQUEST;
 
-    SecurityDescriptorSize = FSP_FSCTL_TRANSACT_RSP_SIZEMAX - sizeof *Response;
+    SecurityDescriptorSize = FileSystem->ResponseSizeMax - sizeof *Response;
     Result = FileSystem->Interface->GetSecurity(FileSystem, Request,
         (PVOID)Request->Req.QuerySecurity.UserContext,
         Response->Buffer, &SecurityDescriptorSize);
@@ -844,13 +1067,21 @@ FSP_API NTSTATUS FspFileSystemOpQuerySecurity(FSP_FILE_SYSTEM *FileSystem,
 FSP_API NTSTATUS FspFileSystemOpSetSecurity(FSP_FILE_SYSTEM *FileSystem,
     FSP_FSCTL_TRANSACT_REQ *Request, FSP_FSCTL_TRANSACT_RSP *Response)
 {
+    NTSTATUS Result;
+
     if (0 == FileSystem->Interface->SetSecurity)
         return STATUS_INVALID_DEVICE_REQUEST;
 
-    return FileSystem->Interface->SetSecurity(FileSystem, Request,
+    Result = FileSystem->Interface->SetSecurity(FileSystem, Request,
         (PVOID)Request->Req.SetSecurity.UserContext,
         Request->Req.SetSecurity.SecurityInformation,
         (PSECURITY_DESCRIPTOR)Request->Buffer);
+
+    /* there is no file name to invalidate */
+    if (NT_SUCCESS(Result))
+        FspFileSystemInvalidateSecurityCache(FileSystem, 0);
+
+    return Result;
 }
 
 FSP_API BOOLEAN FspFileSystemAddDirInfo(FSP_FSCTL_DIR_INFO *DirInfo,
@@ -19,6 +19,7 @@
 
 #define FSP_FUSE_SECTORSIZE_MIN         512
 #define FSP_FUSE_SECTORSIZE_MAX         4096
+#define FSP_FUSE_NODETABLE_MAX          65536
 
 struct fuse_chan
 {
@@ -33,14 +34,17 @@ struct fsp_fuse_core_opt_data
     struct fsp_fuse_env *env;
     int help, debug;
     int hard_remove,
-        use_ino, readdir_ino,
+        use_ino, readdir_ino, readdir_plus,
         set_umask, umask,
         set_uid, uid,
         set_gid, gid,
-        set_attr_timeout, attr_timeout;
+        set_attr_timeout, attr_timeout,
+        entry_timeout, negative_timeout;    /* timeouts in millis */
     int set_FileInfoTimeout;
     int CaseInsensitiveSearch, ReparsePoints,
-        NamedStreams, ReadOnlyVolume;
+        NamedStreams, ReadOnlyVolume, NegativeNameCache, ReaddirPrefetch;
+    unsigned ThreadCount;
+    int OpGuardStrategy;                /* FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY + 1 */
     FSP_FSCTL_VOLUME_PARAMS VolumeParams;
 };
 
@@ -58,6 +62,7 @@ static struct fuse_opt fsp_fuse_core_opts[] =
     FSP_FUSE_CORE_OPT("hard_remove", hard_remove, 1),
     FSP_FUSE_CORE_OPT("use_ino", use_ino, 1),
     FSP_FUSE_CORE_OPT("readdir_ino", readdir_ino, 1),
+    FSP_FUSE_CORE_OPT("readdir_plus", readdir_plus, 1),
     FUSE_OPT_KEY("direct_io", FUSE_OPT_KEY_DISCARD),
     FUSE_OPT_KEY("kernel_cache", FUSE_OPT_KEY_DISCARD),
     FUSE_OPT_KEY("auto_cache", FUSE_OPT_KEY_DISCARD),
@@ -68,11 +73,11 @@ static struct fuse_opt fsp_fuse_core_opts[] =
     FSP_FUSE_CORE_OPT("uid=%d", uid, 0),
     FSP_FUSE_CORE_OPT("gid=", set_gid, 1),
     FSP_FUSE_CORE_OPT("gid=%d", gid, 0),
-    FUSE_OPT_KEY("entry_timeout", FUSE_OPT_KEY_DISCARD),
+    FUSE_OPT_KEY("entry_timeout=", 'e'),
     FSP_FUSE_CORE_OPT("attr_timeout=", set_attr_timeout, 1),
-    FSP_FUSE_CORE_OPT("attr_timeout=%d", attr_timeout, 0),
+    FUSE_OPT_KEY("attr_timeout=", 'a'),
     FUSE_OPT_KEY("ac_attr_timeout", FUSE_OPT_KEY_DISCARD),
-    FUSE_OPT_KEY("negative_timeout", FUSE_OPT_KEY_DISCARD),
+    FUSE_OPT_KEY("negative_timeout=", 'n'),
     FUSE_OPT_KEY("noforget", FUSE_OPT_KEY_DISCARD),
     FUSE_OPT_KEY("intr", FUSE_OPT_KEY_DISCARD),
     FUSE_OPT_KEY("intr_signal=", FUSE_OPT_KEY_DISCARD),
@@ -94,6 +99,18 @@ static struct fuse_opt fsp_fuse_core_opts[] =
     FUSE_OPT_KEY("HardLinks", FUSE_OPT_KEY_DISCARD),
     FUSE_OPT_KEY("ExtendedAttributes", FUSE_OPT_KEY_DISCARD),
     FSP_FUSE_CORE_OPT("ReadOnlyVolume", ReadOnlyVolume, 1),
+    FSP_FUSE_CORE_OPT("NegativeNameCache", NegativeNameCache, 1),
+    FSP_FUSE_CORE_OPT("ReaddirPrefetch", ReaddirPrefetch, 1),
+    FSP_FUSE_CORE_OPT("ThreadCount=%u", ThreadCount, 0),
+    FSP_FUSE_CORE_OPT("OpGuardStrategy=fine", OpGuardStrategy,
+        1 + FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY_FINE),
+    FSP_FUSE_CORE_OPT("OpGuardStrategy=coarse", OpGuardStrategy,
+        1 + FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY_COARSE),
+    /* FUSE file systems are path-keyed (a single namespace index); striped is fine for them */
+    FSP_FUSE_CORE_OPT("OpGuardStrategy=striped", OpGuardStrategy,
+        1 + FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY_FINE),
+    FSP_FUSE_CORE_OPT("OpGuardStrategy=none", OpGuardStrategy,
+        1 + FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY_NONE),
     FUSE_OPT_KEY("--UNC=", 'U'),
     FUSE_OPT_KEY("--VolumePrefix=", 'U'),
 
@@ -285,21 +302,24 @@ static NTSTATUS fsp_fuse_svcstart(FSP_SERVICE *Service, ULONG argc, PWSTR *argv)
         //FUSE_CAP_EXPORT_SUPPORT |     /* not needed in Windows/WinFsp */
         FUSE_CAP_BIG_WRITES |
         FUSE_CAP_DONT_MASK;
-    if (0 != f->ops.init)
+    if (f->lowlevel)
+    {
+        if (0 != f->llops.init)
+            f->llops.init(f->data, &conn);
+    }
+    else if (0 != f->ops.init)
         context->private_data = f->data = f->ops.init(&conn);
     f->fsinit = TRUE;
-    if (0 != f->ops.statfs)
+    if (f->lowlevel ? 0 != f->llops.statfs : 0 != f->ops.statfs)
     {
         struct fuse_statvfs stbuf;
-        int err;
 
         memset(&stbuf, 0, sizeof stbuf);
-        err = f->ops.statfs("/", &stbuf);
-        if (0 != err)
-        {
-            Result = fsp_fuse_ntstatus_from_errno(f->env, err);
+        Result = f->lowlevel ?
+            fsp_fuse_ll_statfs(f, &stbuf) :
+            fsp_fuse_ntstatus_from_errno(f->env, f->ops.statfs("/", &stbuf));
+        if (!NT_SUCCESS(Result))
             goto fail;
-        }
 
         if (stbuf.f_frsize > FSP_FUSE_SECTORSIZE_MAX)
             stbuf.f_frsize = FSP_FUSE_SECTORSIZE_MAX;
@@ -308,18 +328,16 @@ static NTSTATUS fsp_fuse_svcstart(FSP_SERVICE *Service, ULONG argc, PWSTR *argv)
         if (0 == f->VolumeParams.MaxComponentLength)
             f->VolumeParams.MaxComponentLength = (UINT16)stbuf.f_namemax;
     }
-    if (0 != f->ops.getattr)
+    if (f->lowlevel ? 0 != f->llops.getattr : 0 != f->ops.getattr)
     {
         struct fuse_stat stbuf;
-        int err;
 
         memset(&stbuf, 0, sizeof stbuf);
-        err = f->ops.getattr("/", (void *)&stbuf);
-        if (0 != err)
-        {
-            Result = fsp_fuse_ntstatus_from_errno(f->env, err);
+        Result = f->lowlevel ?
+            fsp_fuse_ll_getattr(f, FUSE_ROOT_ID, 0, &stbuf) :
+            fsp_fuse_ntstatus_from_errno(f->env, f->ops.getattr("/", (void *)&stbuf));
+        if (!NT_SUCCESS(Result))
             goto fail;
-        }
 
         if (0 == f->VolumeParams.VolumeCreationTime)
         {
@@ -359,7 +377,7 @@ static NTSTATUS fsp_fuse_svcstart(FSP_SERVICE *Service, ULONG argc, PWSTR *argv)
     Result = FspFileSystemCreate(
         f->VolumeParams.Prefix[0] ?
             L"" FSP_FSCTL_NET_DEVICE_NAME : L"" FSP_FSCTL_DISK_DEVICE_NAME,
-        &f->VolumeParams, &fsp_fuse_intf,
+        &f->VolumeParams, f->lowlevel ? &fsp_fuse_ll_intf : &fsp_fuse_intf,
         &f->FileSystem);
     if (!NT_SUCCESS(Result))
     {
@@ -385,7 +403,7 @@ static NTSTATUS fsp_fuse_svcstart(FSP_SERVICE *Service, ULONG argc, PWSTR *argv)
         }
     }
 
-    Result = FspFileSystemStartDispatcher(f->FileSystem, 0);
+    Result = FspFileSystemStartDispatcher(f->FileSystem, f->ThreadCount);
     if (!NT_SUCCESS(Result))
     {
         FspServiceLog(EVENTLOG_ERROR_TYPE,
@@ -422,7 +440,12 @@ static void fsp_fuse_cleanup(struct fuse *f)
 
     if (f->fsinit)
     {
-        if (f->ops.destroy)
+        if (f->lowlevel)
+        {
+            if (f->llops.destroy)
+                f->llops.destroy(f->data);
+        }
+        else if (f->ops.destroy)
             f->ops.destroy(f->data);
         f->fsinit = FALSE;
     }
@@ -430,6 +453,34 @@ static void fsp_fuse_cleanup(struct fuse *f)
     f->Service = 0;
 }
 
+static int fsp_fuse_core_opt_timeout(const char *arg, int *ptimeout)
+{
+    /*
+     * Parse a timeout in seconds with an optional fraction (e.g. 0.5) into millis;
+     * negative timeouts disable caching. The DLL does not link the CRT, so this does
+     * not go through floating point.
+     */
+    const char *p = arg;
+    UINT64 timeout = 0, scale = 1000;
+    int negative, digits = 0;
+
+    negative = '-' == *p;
+    p += negative;
+
+    for (; '0' <= *p && '9' >= *p; p++, digits++)
+        if (INT_MAX / 1000 < (timeout = timeout * 10 + (*p - '0')))
+            return -1;
+    timeout *= 1000;
+    if ('.' == *p)
+        for (p++; '0' <= *p && '9' >= *p; p++, digits++)
+            timeout += (*p - '0') * (scale /= 10);
+    if (0 == digits || '\0' != *p)
+        return -1;
+
+    *ptimeout = negative ? 0 : (int)timeout;
+    return 0;
+}
+
 static int fsp_fuse_core_opt_proc(void *opt_data0, const char *arg, int key,
     struct fuse_args *outargs)
 {
@@ -449,6 +500,14 @@ static int fsp_fuse_core_opt_proc(void *opt_data0, const char *arg, int key,
             "    -o VolumeSerialNumber=N    32-bit wide\n"
             "    -o FileInfoTimeout=N       FileInfo/Security/VolumeInfo timeout (millisec)\n"
             "    -o CaseInsensitiveSearch   file system supports case-insensitive file names\n"
+            "    -o NegativeNameCache       cache names not found for FileInfoTimeout\n"
+            "    -o readdir_plus            stat data passed to readdir filler is complete\n"
+            "    -o ReaddirPrefetch         getattr directory entries in parallel (fuse_loop_mt)\n"
+            "    -o ThreadCount=N           dispatcher threads (deflt: number of processors)\n"
+            "    -o OpGuardStrategy=S       fine, coarse or none (file system locks)\n"
+            "                               (deflt: coarse if single-threaded, else fine)\n"
+            "    -o IrpCapacity=N           max number of pending requests (100-1000)\n"
+            "    -o TransactTimeout=N       dispatcher wait for requests (millisec; 1000-10000)\n"
             //"    -o ReparsePoints           file system supports reparse points\n"
             //"    -o NamedStreams            file system supports named streams\n"
             //"    -o ReadOnlyVolume          file system is read only\n"
@@ -461,6 +520,15 @@ static int fsp_fuse_core_opt_proc(void *opt_data0, const char *arg, int key,
             FUSE_MAJOR_VERSION, FUSE_MINOR_VERSION);
         opt_data->help = 1;
         return 1;
+    case 'a':
+        return fsp_fuse_core_opt_timeout(arg + sizeof "attr_timeout=" - 1,
+            &opt_data->attr_timeout);
+    case 'e':
+        return fsp_fuse_core_opt_timeout(arg + sizeof "entry_timeout=" - 1,
+            &opt_data->entry_timeout);
+    case 'n':
+        return fsp_fuse_core_opt_timeout(arg + sizeof "negative_timeout=" - 1,
+            &opt_data->negative_timeout);
     case 'U':
         if ('U' == arg[2])
             arg += sizeof "--UNC=" - 1;
@@ -473,18 +541,20 @@ static int fsp_fuse_core_opt_proc(void *opt_data0, const char *arg, int key,
     }
 }
 
-FSP_FUSE_API struct fuse *fsp_fuse_new(struct fsp_fuse_env *env,
-    struct fuse_chan *ch, struct fuse_args *args,
-    const struct fuse_operations *ops, size_t opsize, void *data)
+static struct fuse *fsp_fuse_new_common(struct fsp_fuse_env *env,
+    struct fuse_args *args,
+    const struct fuse_operations *ops, size_t opsize,
+    const struct fuse_lowlevel_ops *llops, size_t llopsize,
+    void *data)
 {
     struct fuse *f = 0;
     struct fsp_fuse_core_opt_data opt_data;
-    ULONG Size;
-    PWSTR ErrorMessage = L".";
     NTSTATUS Result;
 
     if (opsize > sizeof(struct fuse_operations))
         opsize = sizeof(struct fuse_operations);
+    if (llopsize > sizeof(struct fuse_lowlevel_ops))
+        llopsize = sizeof(struct fuse_lowlevel_ops);
 
     memset(&opt_data, 0, sizeof opt_data);
     opt_data.env = env;
@@ -495,12 +565,13 @@ FSP_FUSE_API struct fuse *fsp_fuse_new(struct fsp_fuse_env *env,
         return 0;
 
     if (!opt_data.set_FileInfoTimeout && opt_data.set_attr_timeout)
-        opt_data.VolumeParams.FileInfoTimeout = opt_data.set_attr_timeout * 1000;
+        opt_data.VolumeParams.FileInfoTimeout = opt_data.attr_timeout;
     opt_data.VolumeParams.CaseSensitiveSearch = !opt_data.CaseInsensitiveSearch;
     opt_data.VolumeParams.PersistentAcls = TRUE;
     opt_data.VolumeParams.ReparsePoints = !!opt_data.ReparsePoints;
     opt_data.VolumeParams.NamedStreams = !!opt_data.NamedStreams;
     opt_data.VolumeParams.ReadOnlyVolume = !!opt_data.ReadOnlyVolume;
+    opt_data.VolumeParams.NegativeNameCache = !!opt_data.NegativeNameCache;
 
     f = fsp_fuse_obj_alloc(env, sizeof *f);
     if (0 == f)
@@ -510,15 +581,69 @@ FSP_FUSE_API struct fuse *fsp_fuse_new(struct fsp_fuse_env *env,
     f->set_umask = opt_data.set_umask; f->umask = opt_data.umask;
     f->set_uid = opt_data.set_uid; f->uid = opt_data.uid;
     f->set_gid = opt_data.set_gid; f->gid = opt_data.gid;
-    memcpy(&f->ops, ops, opsize);
+    f->readdir_plus = opt_data.readdir_plus;
+    f->ReaddirPrefetch = opt_data.ReaddirPrefetch;
+    if (0 != ops)
+        memcpy(&f->ops, ops, opsize);
     f->data = data;
     f->DebugLog = opt_data.debug ? -1 : 0;
+    f->ThreadCount = opt_data.ThreadCount;
+    if (0 != opt_data.OpGuardStrategy)
+    {
+        f->set_OpGuardStrategy = 1;
+        f->OpGuardStrategy = opt_data.OpGuardStrategy - 1;
+    }
     memcpy(&f->VolumeParams, &opt_data.VolumeParams, sizeof opt_data.VolumeParams);
 
+    if (0 != llops)
+    {
+        /* the node table replaces the path keyed cache of the high-level API */
+        f->lowlevel = 1;
+        memcpy(&f->llops, llops, llopsize);
+
+        f->NodeTable = MemAlloc(sizeof *f->NodeTable);
+        if (0 == f->NodeTable)
+            goto fail;
+        FspNodeTableInitialize(f->NodeTable, FSP_FUSE_NODETABLE_MAX);
+        InitializeSRWLock(&f->NodeLock);
+    }
+    else
+    if (0 < opt_data.attr_timeout || 0 < opt_data.entry_timeout || 0 < opt_data.negative_timeout)
+    {
+        Result = fsp_fuse_cache_create(
+            opt_data.attr_timeout,
+            opt_data.entry_timeout,
+            opt_data.negative_timeout,
+            &f->cache);
+        if (!NT_SUCCESS(Result))
+            goto fail;
+    }
+
+    return f;
+
+fail:
+    FspServiceLog(EVENTLOG_ERROR_TYPE,
+        L"Cannot create " FSP_FUSE_LIBRARY_NAME " file system.");
+
+    if (0 != f)
+        fsp_fuse_destroy(env, f);
+
+    return 0;
+}
+
+static NTSTATUS fsp_fuse_set_chan(struct fuse *f, struct fuse_chan *ch)
+{
+    ULONG Size;
+    PWSTR ErrorMessage = L".";
+    NTSTATUS Result;
+
     Size = (lstrlenW(ch->MountPoint) + 1) * sizeof(WCHAR);
-    f->MountPoint = fsp_fuse_obj_alloc(env, Size);
+    f->MountPoint = fsp_fuse_obj_alloc(f->env, Size);
     if (0 == f->MountPoint)
+    {
+        Result = STATUS_INSUFFICIENT_RESOURCES;
         goto fail;
+    }
     memcpy(f->MountPoint, ch->MountPoint, Size);
 
     Result = fsp_fuse_preflight(f);
@@ -550,17 +675,56 @@ FSP_FUSE_API struct fuse *fsp_fuse_new(struct fsp_fuse_env *env,
         goto fail;
     }
 
-    return f;
+    return STATUS_SUCCESS;
 
 fail:
     FspServiceLog(EVENTLOG_ERROR_TYPE,
         L"Cannot create " FSP_FUSE_LIBRARY_NAME " file system%s",
         ErrorMessage);
 
-    if (0 != f)
+    if (0 != f->MountPoint)
+    {
+        fsp_fuse_obj_free(f->MountPoint);
+        f->MountPoint = 0;
+    }
+
+    return Result;
+}
+
+FSP_FUSE_API struct fuse *fsp_fuse_new(struct fsp_fuse_env *env,
+    struct fuse_chan *ch, struct fuse_args *args,
+    const struct fuse_operations *ops, size_t opsize, void *data)
+{
+    struct fuse *f;
+
+    f = fsp_fuse_new_common(env, args, ops, opsize, 0, 0, data);
+    if (0 == f)
+        return 0;
+
+    if (!NT_SUCCESS(fsp_fuse_set_chan(f, ch)))
+    {
         fsp_fuse_destroy(env, f);
+        return 0;
+    }
 
-    return 0;
+    return f;
+}
+
+FSP_FUSE_API struct fuse_session *fsp_fuse_lowlevel_new(struct fsp_fuse_env *env,
+    struct fuse_args *args,
+    const struct fuse_lowlevel_ops *op, size_t op_size, void *userdata)
+{
+    return (struct fuse_session *)fsp_fuse_new_common(env, args, 0, 0, op, op_size, userdata);
+}
+
+FSP_FUSE_API void fsp_fuse_session_add_chan(struct fsp_fuse_env *env,
+    struct fuse_session *se, struct fuse_chan *ch)
+{
+    struct fuse *f = (struct fuse *)se;
+
+    /* on failure the mount point remains unset and the session loop fails */
+    if (0 == f->MountPoint)
+        fsp_fuse_set_chan(f, ch);
 }
 
 FSP_FUSE_API void fsp_fuse_destroy(struct fsp_fuse_env *env,
@@ -568,7 +732,17 @@ FSP_FUSE_API void fsp_fuse_destroy(struct fsp_fuse_env *env,
 {
     fsp_fuse_cleanup(f);
 
-    fsp_fuse_obj_free(f->MountPoint);
+    if (0 != f->cache)
+        fsp_fuse_cache_delete(f->cache);
+
+    if (0 != f->NodeTable)
+    {
+        fsp_fuse_ll_delete_nodes(f);
+        MemFree(f->NodeTable);
+    }
+
+    if (0 != f->MountPoint)
+        fsp_fuse_obj_free(f->MountPoint);
 
     fsp_fuse_obj_free(f);
 }
@@ -576,7 +750,10 @@ FSP_FUSE_API void fsp_fuse_destroy(struct fsp_fuse_env *env,
 FSP_FUSE_API int fsp_fuse_loop(struct fsp_fuse_env *env,
     struct fuse *f)
 {
-    f->OpGuardStrategy = FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY_COARSE;
+    if (0 == f->MountPoint)
+        return -1;
+    if (!f->set_OpGuardStrategy)
+        f->OpGuardStrategy = FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY_COARSE;
     return 0 == FspServiceRunEx(FspDiagIdent(), fsp_fuse_svcstart, fsp_fuse_svcstop, 0, f) ?
         0 : -1;
 }
@@ -584,7 +761,10 @@ FSP_FUSE_API int fsp_fuse_loop(struct fsp_fuse_env *env,
 FSP_FUSE_API int fsp_fuse_loop_mt(struct fsp_fuse_env *env,
     struct fuse *f)
 {
-    f->OpGuardStrategy = FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY_FINE;
+    if (0 == f->MountPoint)
+        return -1;
+    if (!f->set_OpGuardStrategy)
+        f->OpGuardStrategy = FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY_FINE;
     return 0 == FspServiceRunEx(FspDiagIdent(), fsp_fuse_svcstart, fsp_fuse_svcstop, 0, f) ?
         0 : -1;
 }
@@ -0,0 +1,249 @@
+/**
+ * @file dll/fuse/fuse_buf.c
+ *
+ * @copyright 2015-2016 Bill Zissimopoulos
+ */
+/*
+ * This file is part of WinFsp.
+ *
+ * You can redistribute it and/or modify it under the terms of the
+ * GNU Affero General Public License version 3 as published by the
+ * Free Software Foundation.
+ *
+ * Licensees holding a valid commercial license may use this file in
+ * accordance with the commercial license agreement provided with the
+ * software.
+ */
+
+#include <dll/fuse/library.h>
+
+/*
+ * A struct fuse_bufvec describes data that lives in memory or in a file descriptor
+ * of the file system's environment. Memory segments are copied directly; fd segments
+ * are read or written through the env->fdread/fdwrite callbacks, because the WinFsp DLL
+ * does not share a C runtime (or a Cygwin fd table) with the file system.
+ *
+ * Errors generated here use errno values that are the same on Windows and Cygwin
+ * (EINVAL, ENOMEM), because the caller maps them using the environment's errno table.
+ */
+
+#define FSP_FUSE_BUF_BOUNCE_SIZE        (64 * 1024)
+
+static inline struct fuse_buf *fsp_fuse_bufvec_current(struct fuse_bufvec *bufv)
+{
+    return bufv->count > bufv->idx ? &bufv->buf[bufv->idx] : 0;
+}
+
+static inline BOOLEAN fsp_fuse_bufvec_advance(struct fuse_bufvec *bufv, size_t len)
+{
+    struct fuse_buf *buf = fsp_fuse_bufvec_current(bufv);
+
+    bufv->off += len;
+    if (bufv->off == buf->size)
+    {
+        bufv->idx++;
+        bufv->off = 0;
+        if (bufv->count <= bufv->idx)
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+static fuse_ssize_t fsp_fuse_buf_fdread(struct fsp_fuse_env *env,
+    const struct fuse_buf *buf, size_t off, void *mem, size_t len)
+{
+    fuse_ssize_t bytes, copied = 0;
+
+    if (0 == env->fdread)
+        return -EINVAL;
+
+    while (0 < len)
+    {
+        bytes = env->fdread(buf->fd, mem, len,
+            (buf->flags & FUSE_BUF_FD_SEEK) ? buf->pos + (fuse_off_t)off : -1);
+        if (0 > bytes)
+            return 0 == copied ? bytes : copied;
+        if (0 == bytes)
+            break;
+
+        copied += bytes;
+        if (!(buf->flags & FUSE_BUF_FD_RETRY))
+            break;
+        off += bytes;
+        mem = (PUINT8)mem + bytes;
+        len -= bytes;
+    }
+
+    return copied;
+}
+
+static fuse_ssize_t fsp_fuse_buf_fdwrite(struct fsp_fuse_env *env,
+    const struct fuse_buf *buf, size_t off, const void *mem, size_t len)
+{
+    fuse_ssize_t bytes, copied = 0;
+
+    if (0 == env->fdwrite)
+        return -EINVAL;
+
+    while (0 < len)
+    {
+        bytes = env->fdwrite(buf->fd, mem, len,
+            (buf->flags & FUSE_BUF_FD_SEEK) ? buf->pos + (fuse_off_t)off : -1);
+        if (0 > bytes)
+            return 0 == copied ? bytes : copied;
+        if (0 == bytes)
+            break;
+
+        copied += bytes;
+        if (!(buf->flags & FUSE_BUF_FD_RETRY))
+            break;
+        off += bytes;
+        mem = (const UINT8 *)mem + bytes;
+        len -= bytes;
+    }
+
+    return copied;
+}
+
+static fuse_ssize_t fsp_fuse_buf_copy_fd(struct fsp_fuse_env *env,
+    const struct fuse_buf *dst, size_t dstoff,
+    const struct fuse_buf *src, size_t srcoff,
+    size_t len)
+{
+    PVOID Bounce;
+    fuse_ssize_t rbytes, wbytes, copied = 0;
+    size_t chunk;
+
+    Bounce = MemAlloc(FSP_FUSE_BUF_BOUNCE_SIZE);
+    if (0 == Bounce)
+        return -ENOMEM;
+
+    while (0 < len)
+    {
+        chunk = FSP_FUSE_BUF_BOUNCE_SIZE < len ? FSP_FUSE_BUF_BOUNCE_SIZE : len;
+
+        rbytes = fsp_fuse_buf_fdread(env, src, srcoff, Bounce, chunk);
+        if (0 >= rbytes)
+        {
+            if (0 > rbytes && 0 == copied)
+                copied = rbytes;
+            break;
+        }
+
+        wbytes = fsp_fuse_buf_fdwrite(env, dst, dstoff, Bounce, rbytes);
+        if (0 >= wbytes)
+        {
+            if (0 > wbytes && 0 == copied)
+                copied = wbytes;
+            break;
+        }
+
+        copied += wbytes;
+        if (wbytes < rbytes || (size_t)rbytes < chunk)
+            break;
+        srcoff += wbytes;
+        dstoff += wbytes;
+        len -= wbytes;
+    }
+
+    MemFree(Bounce);
+
+    return copied;
+}
+
+static fuse_ssize_t fsp_fuse_buf_copy_one(struct fsp_fuse_env *env,
+    const struct fuse_buf *dst, size_t dstoff,
+    const struct fuse_buf *src, size_t srcoff,
+    size_t len)
+{
+    BOOLEAN DstIsFd = !!(dst->flags & FUSE_BUF_IS_FD);
+    BOOLEAN SrcIsFd = !!(src->flags & FUSE_BUF_IS_FD);
+
+    if (0 == len)
+        return 0;
+
+    if (!DstIsFd && !SrcIsFd)
+    {
+        PUINT8 DstMem = (PUINT8)dst->mem + dstoff;
+        PUINT8 SrcMem = (PUINT8)src->mem + srcoff;
+
+        if (DstMem + len <= SrcMem || SrcMem + len <= DstMem)
+            memcpy(DstMem, SrcMem, len);
+        else if (DstMem != SrcMem)
+            RtlMoveMemory(DstMem, SrcMem, len);
+
+        return len;
+    }
+    else if (!DstIsFd)
+        return fsp_fuse_buf_fdread(env, src, srcoff, (PUINT8)dst->mem + dstoff, len);
+    else if (!SrcIsFd)
+        return fsp_fuse_buf_fdwrite(env, dst, dstoff, (PUINT8)src->mem + srcoff, len);
+    else
+        return fsp_fuse_buf_copy_fd(env, dst, dstoff, src, srcoff, len);
+}
+
+FSP_FUSE_API size_t fsp_fuse_buf_size(struct fsp_fuse_env *env,
+    const struct fuse_bufvec *bufv)
+{
+    size_t size = 0;
+
+    for (size_t i = 0; bufv->count > i; i++)
+    {
+        if ((size_t)-1 == bufv->buf[i].size)
+            return (size_t)-1;
+        size += bufv->buf[i].size;
+    }
+
+    return size;
+}
+
+FSP_FUSE_API fuse_ssize_t fsp_fuse_buf_copy(struct fsp_fuse_env *env,
+    struct fuse_bufvec *dstv, struct fuse_bufvec *srcv, enum fuse_buf_copy_flags flags)
+{
+    struct fuse_buf *dst, *src;
+    size_t dstlen, srclen, len;
+    fuse_ssize_t bytes, copied = 0;
+    BOOLEAN dstmore, srcmore;
+
+    /* splice flags are meaningless on Windows and are ignored */
+
+    if (dstv == srcv)
+        return fsp_fuse_buf_size(env, dstv);
+
+    for (;;)
+    {
+        dst = fsp_fuse_bufvec_current(dstv);
+        src = fsp_fuse_bufvec_current(srcv);
+        if (0 == dst || 0 == src)
+            break;
+
+        dstlen = dst->size - dstv->off;
+        srclen = src->size - srcv->off;
+        len = dstlen < srclen ? dstlen : srclen;
+
+        bytes = fsp_fuse_buf_copy_one(env, dst, dstv->off, src, srcv->off, len);
+        if (0 > bytes)
+            return 0 == copied ? bytes : copied;
+
+        copied += bytes;
+        dstmore = fsp_fuse_bufvec_advance(dstv, bytes);
+        srcmore = fsp_fuse_bufvec_advance(srcv, bytes);
+        if (!dstmore || !srcmore || (size_t)bytes < len)
+            break;
+    }
+
+    return copied;
+}
+
+VOID fsp_fuse_buf_free(struct fsp_fuse_env *env, struct fuse_bufvec *bufv)
+{
+    /* as in libfuse: a bufvec returned by read_buf owns its memory segments */
+    if (0 != bufv)
+    {
+        for (size_t i = 0; bufv->count > i; i++)
+            if (0 != bufv->buf[i].mem)
+                env->memfree(bufv->buf[i].mem);
+        env->memfree(bufv);
+    }
+}
@@ -0,0 +1,185 @@
+/**
+ * @file dll/fuse/fuse_cache.c
+ *
+ * @copyright 2015-2016 Bill Zissimopoulos
+ */
+/*
+ * This file is part of WinFsp.
+ *
+ * You can redistribute it and/or modify it under the terms of the
+ * GNU Affero General Public License version 3 as published by the
+ * Free Software Foundation.
+ *
+ * Licensees holding a valid commercial license may use this file in
+ * accordance with the commercial license agreement provided with the
+ * software.
+ */
+
+#include <dll/fuse/library.h>
+#include <shared/attrcache.h>
+
+/*
+ * FUSE attribute cache
+ *
+ * The attribute cache implements the libfuse attr_timeout, entry_timeout and
+ * negative_timeout options for the high-level API. It is an attribute cache
+ * table (see shared/attrcache.h) protected by a single SRW lock; entries are
+ * allocated here and the entries that the table removes are freed after the
+ * lock has been released.
+ */
+
+#define FSP_FUSE_CACHE_CAPACITY         16384
+
+struct fsp_fuse_cache
+{
+    SRWLOCK Lock;
+    FSP_ATTR_CACHE_TABLE Table;
+};
+
+static VOID fsp_fuse_cache_free_list(FSP_ATTR_CACHE_ENTRY *FreeList)
+{
+    FSP_ATTR_CACHE_ENTRY *Entry, *NextEntry;
+
+    for (Entry = FreeList; 0 != Entry; Entry = NextEntry)
+    {
+        NextEntry = Entry->DictNext;
+        MemFree(Entry);
+    }
+}
+
+NTSTATUS fsp_fuse_cache_create(UINT32 AttrTimeout, UINT32 EntryTimeout, UINT32 NegativeTimeout,
+    struct fsp_fuse_cache **pcache)
+{
+    struct fsp_fuse_cache *cache;
+
+    *pcache = 0;
+
+    cache = MemAlloc(sizeof *cache);
+    if (0 == cache)
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    InitializeSRWLock(&cache->Lock);
+    FspAttrCacheTableInitialize(&cache->Table, FSP_FUSE_CACHE_CAPACITY,
+        AttrTimeout, EntryTimeout, NegativeTimeout);
+
+    *pcache = cache;
+
+    return STATUS_SUCCESS;
+}
+
+VOID fsp_fuse_cache_delete(struct fsp_fuse_cache *cache)
+{
+    FspAttrCacheTableClear(&cache->Table);
+    fsp_fuse_cache_free_list(FspAttrCacheTableTakeFreeList(&cache->Table));
+    MemFree(cache);
+}
+
+BOOLEAN fsp_fuse_cache_lookup(struct fsp_fuse_cache *cache,
+    const char *PosixPath, BOOLEAN IsOpen, PUINT64 PToken,
+    NTSTATUS *PResult, PUINT32 PUid, PUINT32 PGid, PUINT32 PMode,
+    FSP_FSCTL_FILE_INFO *FileInfo)
+{
+    FSP_ATTR_CACHE_ENTRY *Entry;
+    BOOLEAN Found = FALSE;
+
+    AcquireSRWLockShared(&cache->Lock);
+
+    Entry = FspAttrCacheTableLookup(&cache->Table, PosixPath, lstrlenA(PosixPath), IsOpen,
+        GetTickCount64(), PToken);
+    if (0 != Entry)
+    {
+        *PResult = Entry->Result;
+        *PUid = Entry->Uid;
+        *PGid = Entry->Gid;
+        *PMode = Entry->Mode;
+        memcpy(FileInfo, &Entry->FileInfo, sizeof Entry->FileInfo);
+        Found = TRUE;
+    }
+
+    ReleaseSRWLockShared(&cache->Lock);
+
+    return Found;
+}
+
+VOID fsp_fuse_cache_insert(struct fsp_fuse_cache *cache,
+    const char *PosixPath, UINT64 Token,
+    NTSTATUS Result, UINT32 Uid, UINT32 Gid, UINT32 Mode,
+    FSP_FSCTL_FILE_INFO *FileInfo)
+{
+    FSP_ATTR_CACHE_ENTRY *Entry, *FreeList;
+    ULONG PathLength = lstrlenA(PosixPath);
+    BOOLEAN Inserted;
+
+    if (!NT_SUCCESS(Result) &&
+        (STATUS_OBJECT_NAME_NOT_FOUND != Result || 0 == cache->Table.NegativeTimeout))
+        return;
+
+    Entry = MemAlloc(sizeof *Entry + PathLength + 1);
+    if (0 == Entry)
+        return;
+
+    Entry->InsertTime = GetTickCount64();
+    Entry->PathLength = PathLength;
+    Entry->Result = Result;
+    Entry->Uid = Uid;
+    Entry->Gid = Gid;
+    Entry->Mode = Mode;
+    if (NT_SUCCESS(Result))
+        memcpy(&Entry->FileInfo, FileInfo, sizeof Entry->FileInfo);
+    else
+        memset(&Entry->FileInfo, 0, sizeof Entry->FileInfo);
+    memcpy(Entry->Path, PosixPath, PathLength + 1);
+
+    AcquireSRWLockExclusive(&cache->Lock);
+    Inserted = FspAttrCacheTableInsert(&cache->Table, Entry, Token);
+    FreeList = FspAttrCacheTableTakeFreeList(&cache->Table);
+    ReleaseSRWLockExclusive(&cache->Lock);
+
+    if (!Inserted)
+        MemFree(Entry);
+    fsp_fuse_cache_free_list(FreeList);
+}
+
+VOID fsp_fuse_cache_update_size(struct fsp_fuse_cache *cache,
+    const char *PosixPath, UINT64 FileSize, UINT64 AllocationSize)
+{
+    AcquireSRWLockExclusive(&cache->Lock);
+    FspAttrCacheTableUpdateSize(&cache->Table, PosixPath, lstrlenA(PosixPath),
+        FileSize, AllocationSize);
+    ReleaseSRWLockExclusive(&cache->Lock);
+}
+
+VOID fsp_fuse_cache_invalidate(struct fsp_fuse_cache *cache,
+    const char *PosixPath, BOOLEAN Parent)
+{
+    FSP_ATTR_CACHE_ENTRY *FreeList;
+    ULONG PathLength = lstrlenA(PosixPath), ParentLength = 0;
+
+    if (Parent)
+    {
+        for (ULONG I = 0; PathLength > I; I++)
+            if ('/' == PosixPath[I])
+                ParentLength = 0 != I ? I : 1;
+    }
+
+    AcquireSRWLockExclusive(&cache->Lock);
+    FspAttrCacheTableInvalidate(&cache->Table, PosixPath, PathLength);
+    if (0 != ParentLength)
+        FspAttrCacheTableInvalidate(&cache->Table, PosixPath, ParentLength);
+    FreeList = FspAttrCacheTableTakeFreeList(&cache->Table);
+    ReleaseSRWLockExclusive(&cache->Lock);
+
+    fsp_fuse_cache_free_list(FreeList);
+}
+
+VOID fsp_fuse_cache_invalidate_all(struct fsp_fuse_cache *cache)
+{
+    FSP_ATTR_CACHE_ENTRY *FreeList;
+
+    AcquireSRWLockExclusive(&cache->Lock);
+    FspAttrCacheTableInvalidateAll(&cache->Table);
+    FreeList = FspAttrCacheTableTakeFreeList(&cache->Table);
+    ReleaseSRWLockExclusive(&cache->Lock);
+
+    fsp_fuse_cache_free_list(FreeList);
+}
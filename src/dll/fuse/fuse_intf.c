@@ -183,27 +183,15 @@ NTSTATUS fsp_fuse_op_leave(FSP_FILE_SYSTEM *FileSystem,
     return STATUS_SUCCESS;
 }
 
-static NTSTATUS fsp_fuse_intf_GetFileInfoEx(FSP_FILE_SYSTEM *FileSystem,
-    const char *PosixPath, struct fuse_file_info *fi,
+VOID fsp_fuse_intf_GetFileInfoFromStat(struct fuse *f,
+    const struct fuse_stat *stbuf0,
     PUINT32 PUid, PUINT32 PGid, PUINT32 PMode,
     FSP_FSCTL_FILE_INFO *FileInfo)
 {
-    struct fuse *f = FileSystem->UserContext;
     UINT64 AllocationUnit;
     struct fuse_stat stbuf;
-    int err;
-
-    memset(&stbuf, 0, sizeof stbuf);
-
-    if (0 != f->ops.fgetattr && 0 != fi && -1 != fi->fh)
-        err = f->ops.fgetattr(PosixPath, (void *)&stbuf, fi);
-    else if (0 != f->ops.getattr)
-        err = f->ops.getattr(PosixPath, (void *)&stbuf);
-    else
-        return STATUS_INVALID_DEVICE_REQUEST;
 
-    if (0 != err)
-        return fsp_fuse_ntstatus_from_errno(f->env, err);
+    memcpy(&stbuf, stbuf0, sizeof stbuf);
 
     if (f->set_umask)
         stbuf.st_mode = (stbuf.st_mode & 0170000) | (0777 & ~f->umask);
@@ -236,48 +224,73 @@ static NTSTATUS fsp_fuse_intf_GetFileInfoEx(FSP_FILE_SYSTEM *FileSystem,
         Int32x32To64(stbuf.st_ctim.tv_sec, 10000000) + 116444736000000000 +
         stbuf.st_ctim.tv_nsec / 100;
     FileInfo->IndexNumber = stbuf.st_ino;
+}
+
+static NTSTATUS fsp_fuse_intf_GetFileInfoEx(FSP_FILE_SYSTEM *FileSystem,
+    const char *PosixPath, struct fuse_file_info *fi,
+    PUINT32 PUid, PUINT32 PGid, PUINT32 PMode,
+    FSP_FSCTL_FILE_INFO *FileInfo)
+{
+    struct fuse *f = FileSystem->UserContext;
+    struct fuse_stat stbuf;
+    UINT64 Token;
+    int err;
+    NTSTATUS Result;
+
+    if (0 != f->cache &&
+        fsp_fuse_cache_lookup(f->cache, PosixPath, 0 != fi, &Token,
+            &Result, PUid, PGid, PMode, FileInfo))
+        return Result;
+
+    memset(&stbuf, 0, sizeof stbuf);
+
+    if (0 != f->ops.fgetattr && 0 != fi && -1 != fi->fh)
+        err = f->ops.fgetattr(PosixPath, (void *)&stbuf, fi);
+    else if (0 != f->ops.getattr)
+        err = f->ops.getattr(PosixPath, (void *)&stbuf);
+    else
+        return STATUS_INVALID_DEVICE_REQUEST;
+
+    if (0 != err)
+    {
+        Result = fsp_fuse_ntstatus_from_errno(f->env, err);
+        if (0 != f->cache)
+            fsp_fuse_cache_insert(f->cache, PosixPath, Token, Result, 0, 0, 0, 0);
+        return Result;
+    }
+
+    fsp_fuse_intf_GetFileInfoFromStat(f, &stbuf, PUid, PGid, PMode, FileInfo);
+
+    if (0 != f->cache)
+        fsp_fuse_cache_insert(f->cache, PosixPath, Token, STATUS_SUCCESS,
+            *PUid, *PGid, *PMode, FileInfo);
 
     return STATUS_SUCCESS;
 }
 
-static NTSTATUS fsp_fuse_intf_GetSecurityEx(FSP_FILE_SYSTEM *FileSystem,
-    const char *PosixPath, struct fuse_file_info *fi,
-    PUINT32 PFileAttributes,
+NTSTATUS fsp_fuse_intf_GetSecurityFromPermissions(UINT32 Uid, UINT32 Gid, UINT32 Mode,
     PSECURITY_DESCRIPTOR SecurityDescriptorBuf, SIZE_T *PSecurityDescriptorSize)
 {
-    struct fuse *f = FileSystem->UserContext;
-    UINT32 Uid, Gid, Mode;
-    FSP_FSCTL_FILE_INFO FileInfo;
     PSECURITY_DESCRIPTOR SecurityDescriptor = 0;
     SIZE_T SecurityDescriptorSize;
     NTSTATUS Result;
 
-    Result = fsp_fuse_intf_GetFileInfoEx(FileSystem, PosixPath, fi, &Uid, &Gid, &Mode, &FileInfo);
+    Result = FspPosixMapPermissionsToSecurityDescriptor(Uid, Gid, Mode, &SecurityDescriptor);
     if (!NT_SUCCESS(Result))
         goto exit;
 
-    if (0 != PSecurityDescriptorSize)
-    {
-        Result = FspPosixMapPermissionsToSecurityDescriptor(Uid, Gid, Mode, &SecurityDescriptor);
-        if (!NT_SUCCESS(Result))
-            goto exit;
-
-        SecurityDescriptorSize = GetSecurityDescriptorLength(SecurityDescriptor);
-
-        if (SecurityDescriptorSize > *PSecurityDescriptorSize)
-        {
-            *PSecurityDescriptorSize = SecurityDescriptorSize;
-            Result = STATUS_BUFFER_OVERFLOW;
-            goto exit;
-        }
+    SecurityDescriptorSize = GetSecurityDescriptorLength(SecurityDescriptor);
 
+    if (SecurityDescriptorSize > *PSecurityDescriptorSize)
+    {
         *PSecurityDescriptorSize = SecurityDescriptorSize;
-        if (0 != SecurityDescriptorBuf)
-            memcpy(SecurityDescriptorBuf, SecurityDescriptor, SecurityDescriptorSize);
+        Result = STATUS_BUFFER_OVERFLOW;
+        goto exit;
     }
 
-    if (0 != PFileAttributes)
-        *PFileAttributes = FileInfo.FileAttributes;
+    *PSecurityDescriptorSize = SecurityDescriptorSize;
+    if (0 != SecurityDescriptorBuf)
+        memcpy(SecurityDescriptorBuf, SecurityDescriptor, SecurityDescriptorSize);
 
     Result = STATUS_SUCCESS;
 
@@ -289,6 +302,33 @@ exit:
     return Result;
 }
 
+static NTSTATUS fsp_fuse_intf_GetSecurityEx(FSP_FILE_SYSTEM *FileSystem,
+    const char *PosixPath, struct fuse_file_info *fi,
+    PUINT32 PFileAttributes,
+    PSECURITY_DESCRIPTOR SecurityDescriptorBuf, SIZE_T *PSecurityDescriptorSize)
+{
+    UINT32 Uid, Gid, Mode;
+    FSP_FSCTL_FILE_INFO FileInfo;
+    NTSTATUS Result;
+
+    Result = fsp_fuse_intf_GetFileInfoEx(FileSystem, PosixPath, fi, &Uid, &Gid, &Mode, &FileInfo);
+    if (!NT_SUCCESS(Result))
+        return Result;
+
+    if (0 != PSecurityDescriptorSize)
+    {
+        Result = fsp_fuse_intf_GetSecurityFromPermissions(Uid, Gid, Mode,
+            SecurityDescriptorBuf, PSecurityDescriptorSize);
+        if (!NT_SUCCESS(Result))
+            return Result;
+    }
+
+    if (0 != PFileAttributes)
+        *PFileAttributes = FileInfo.FileAttributes;
+
+    return STATUS_SUCCESS;
+}
+
 static NTSTATUS fsp_fuse_intf_GetVolumeInfo(FSP_FILE_SYSTEM *FileSystem,
     FSP_FSCTL_TRANSACT_REQ *Request,
     FSP_FSCTL_VOLUME_INFO *VolumeInfo)
@@ -330,10 +370,17 @@ static NTSTATUS fsp_fuse_intf_GetSecurityByName(FSP_FILE_SYSTEM *FileSystem,
     PSECURITY_DESCRIPTOR SecurityDescriptorBuf, SIZE_T *PSecurityDescriptorSize)
 {
     struct fuse *f = FileSystem->UserContext;
-    char *PosixPath = 0;
+    char PosixPathBuf[512], *PosixPath = PosixPathBuf;
+    ULONG Size = sizeof PosixPathBuf;
     NTSTATUS Result;
 
-    Result = FspPosixMapWindowsToPosixPath(FileName, &PosixPath);
+    /* this is called for every open (and for every directory on the path on traverse checks) */
+    Result = FspPosixMapWindowsToPosixPathBuffer(FileName, PosixPath, &Size);
+    if (STATUS_BUFFER_OVERFLOW == Result)
+    {
+        PosixPath = 0;
+        Result = FspPosixMapWindowsToPosixPath(FileName, &PosixPath);
+    }
     if (!NT_SUCCESS(Result))
         goto exit;
 
@@ -345,7 +392,7 @@ static NTSTATUS fsp_fuse_intf_GetSecurityByName(FSP_FILE_SYSTEM *FileSystem,
     Result = STATUS_SUCCESS;
 
 exit:
-    if (0 != PosixPath)
+    if (0 != PosixPath && PosixPathBuf != PosixPath)
         FspPosixDeletePath(PosixPath);
 
     return Result;
@@ -445,10 +492,15 @@ static NTSTATUS fsp_fuse_intf_Create(FSP_FILE_SYSTEM *FileSystem,
 
     Opened = TRUE;
 
+    if (0 != f->cache)
+        fsp_fuse_cache_invalidate(f->cache, contexthdr->PosixPath, TRUE);
+
     if (Uid != context->uid || Gid != context->gid)
         if (0 != f->ops.chown)
         {
             err = f->ops.chown(contexthdr->PosixPath, Uid, Gid);
+            if (0 != f->cache)
+                fsp_fuse_cache_invalidate(f->cache, contexthdr->PosixPath, FALSE);
             if (0 != err)
             {
                 Result = fsp_fuse_ntstatus_from_errno(f->env, err);
@@ -634,6 +686,8 @@ static NTSTATUS fsp_fuse_intf_Overwrite(FSP_FILE_SYSTEM *FileSystem,
     }
     else
         Result = STATUS_INVALID_DEVICE_REQUEST;
+    if (0 != f->cache)
+        fsp_fuse_cache_invalidate(f->cache, filedesc->PosixPath, FALSE);
     if (!NT_SUCCESS(Result))
         return Result;
 
@@ -677,6 +731,9 @@ static VOID fsp_fuse_intf_Cleanup(FSP_FILE_SYSTEM *FileSystem,
             if (0 != f->ops.unlink)
                 f->ops.unlink(filedesc->PosixPath);
         }
+
+    if (Delete && 0 != f->cache)
+        fsp_fuse_cache_invalidate(f->cache, filedesc->PosixPath, TRUE);
 }
 
 static VOID fsp_fuse_intf_Close(FSP_FILE_SYSTEM *FileSystem,
@@ -719,26 +776,44 @@ static NTSTATUS fsp_fuse_intf_Read(FSP_FILE_SYSTEM *FileSystem,
     struct fsp_fuse_file_desc *filedesc =
         (PVOID)(UINT_PTR)Request->Req.Read.UserContext2;
     struct fuse_file_info fi;
-    int bytes;
+    struct fuse_bufvec *bufv, dstv;
+    fuse_ssize_t bytes;
     NTSTATUS Result;
 
-    if (0 == f->ops.read)
+    if (0 == f->ops.read && 0 == f->ops.read_buf)
         return STATUS_INVALID_DEVICE_REQUEST;
 
     memset(&fi, 0, sizeof fi);
     fi.flags = filedesc->OpenFlags;
     fi.fh = filedesc->FileHandle;
 
-    bytes = f->ops.read(filedesc->PosixPath, Buffer, Length, Offset, &fi);
+    if (0 != f->ops.read_buf)
+    {
+        /* gather the file system's buffers directly into the transact buffer */
+        memset(&dstv, 0, sizeof dstv);
+        dstv.count = 1;
+        dstv.buf[0].size = Length;
+        dstv.buf[0].mem = Buffer;
+        dstv.buf[0].fd = -1;
+
+        bufv = 0;
+        bytes = f->ops.read_buf(filedesc->PosixPath, &bufv, Length, Offset, &fi);
+        if (0 <= bytes)
+            bytes = 0 != bufv ? fsp_fuse_buf_copy(f->env, &dstv, bufv, 0) : 0;
+        fsp_fuse_buf_free(f->env, bufv);
+    }
+    else
+        bytes = f->ops.read(filedesc->PosixPath, Buffer, Length, Offset, &fi);
+
     if (0 < bytes)
     {
-        *PBytesTransferred = bytes;
+        *PBytesTransferred = (ULONG)bytes;
         Result = STATUS_SUCCESS;
     }
     else if (0 == bytes)
         Result = STATUS_END_OF_FILE;
     else
-        Result = fsp_fuse_ntstatus_from_errno(f->env, bytes);
+        Result = fsp_fuse_ntstatus_from_errno(f->env, (int)bytes);
 
     return Result;
 }
@@ -754,12 +829,13 @@ static NTSTATUS fsp_fuse_intf_Write(FSP_FILE_SYSTEM *FileSystem,
         (PVOID)(UINT_PTR)Request->Req.Write.UserContext2;
     UINT32 Uid, Gid, Mode;
     struct fuse_file_info fi;
+    struct fuse_bufvec srcv;
     FSP_FSCTL_FILE_INFO FileInfoBuf;
     UINT64 EndOffset, AllocationUnit;
     int bytes;
     NTSTATUS Result;
 
-    if (0 == f->ops.write)
+    if (0 == f->ops.write && 0 == f->ops.write_buf)
         return STATUS_INVALID_DEVICE_REQUEST;
 
     memset(&fi, 0, sizeof fi);
@@ -786,7 +862,19 @@ static NTSTATUS fsp_fuse_intf_Write(FSP_FILE_SYSTEM *FileSystem,
         EndOffset = Offset + Length;
     }
 
-    bytes = f->ops.write(filedesc->PosixPath, Buffer, (size_t)(EndOffset - Offset), Offset, &fi);
+    if (0 != f->ops.write_buf)
+    {
+        /* hand the transact buffer to the file system without copying it */
+        memset(&srcv, 0, sizeof srcv);
+        srcv.count = 1;
+        srcv.buf[0].size = (size_t)(EndOffset - Offset);
+        srcv.buf[0].mem = Buffer;
+        srcv.buf[0].fd = -1;
+
+        bytes = f->ops.write_buf(filedesc->PosixPath, &srcv, Offset, &fi);
+    }
+    else
+        bytes = f->ops.write(filedesc->PosixPath, Buffer, (size_t)(EndOffset - Offset), Offset, &fi);
     if (0 > bytes)
         return fsp_fuse_ntstatus_from_errno(f->env, bytes);
 
@@ -794,10 +882,15 @@ static NTSTATUS fsp_fuse_intf_Write(FSP_FILE_SYSTEM *FileSystem,
 
     AllocationUnit = (UINT64)f->VolumeParams.SectorSize *
         (UINT64)f->VolumeParams.SectorsPerAllocationUnit;
-    FileInfoBuf.FileSize = Offset + bytes;
+    if (FileInfoBuf.FileSize < Offset + bytes)
+        FileInfoBuf.FileSize = Offset + bytes;
     FileInfoBuf.AllocationSize =
         (FileInfoBuf.FileSize + AllocationUnit - 1) / AllocationUnit * AllocationUnit;
 
+    if (0 != f->cache)
+        fsp_fuse_cache_update_size(f->cache, filedesc->PosixPath,
+            FileInfoBuf.FileSize, FileInfoBuf.AllocationSize);
+
 success:
     memcpy(FileInfo, &FileInfoBuf, sizeof FileInfoBuf);
 
@@ -934,6 +1027,8 @@ static NTSTATUS fsp_fuse_intf_SetBasicInfo(FSP_FILE_SYSTEM *FileSystem,
         err = f->ops.utime(filedesc->PosixPath, &timbuf);
         Result = fsp_fuse_ntstatus_from_errno(f->env, err);
     }
+    if (0 != f->cache)
+        fsp_fuse_cache_invalidate(f->cache, filedesc->PosixPath, FALSE);
     if (!NT_SUCCESS(Result))
         return Result;
 
@@ -986,6 +1081,8 @@ static NTSTATUS fsp_fuse_intf_SetFileSize(FSP_FILE_SYSTEM *FileSystem,
             err = f->ops.truncate(filedesc->PosixPath, NewSize);
             Result = fsp_fuse_ntstatus_from_errno(f->env, err);
         }
+        if (0 != f->cache)
+            fsp_fuse_cache_invalidate(f->cache, filedesc->PosixPath, FALSE);
         if (!NT_SUCCESS(Result))
             return Result;
 
@@ -1091,6 +1188,19 @@ static NTSTATUS fsp_fuse_intf_Rename(FSP_FILE_SYSTEM *FileSystem,
     }
 
     err = f->ops.rename(filedesc->PosixPath, contexthdr->PosixPath);
+
+    if (0 != f->cache)
+    {
+        if (filedesc->IsDirectory)
+            /* the cache is keyed by path; all descendants have been renamed too */
+            fsp_fuse_cache_invalidate_all(f->cache);
+        else
+        {
+            fsp_fuse_cache_invalidate(f->cache, filedesc->PosixPath, TRUE);
+            fsp_fuse_cache_invalidate(f->cache, contexthdr->PosixPath, TRUE);
+        }
+    }
+
     return fsp_fuse_ntstatus_from_errno(f->env, err);
 }
 
@@ -1178,6 +1288,9 @@ static NTSTATUS fsp_fuse_intf_SetSecurity(FSP_FILE_SYSTEM *FileSystem,
     Result = STATUS_SUCCESS;
 
 exit:
+    if (0 != f->cache)
+        fsp_fuse_cache_invalidate(f->cache, filedesc->PosixPath, FALSE);
+
     if (0 != NewSecurityDescriptor)
         FspDeleteSecurityDescriptor(NewSecurityDescriptor,
             FspSetSecurityDescriptor);
@@ -1233,6 +1346,13 @@ int fsp_fuse_intf_AddDirInfo(void *buf, const char *name,
 
     di->Size = (UINT16)(sizeof(struct fsp_fuse_dirinfo) + len + 1);
     di->FileInfoValid = FALSE;
+    if (0 != stbuf && 0 != dh->f)
+    {
+        /* readdir_plus: the file system promises that the stat data is complete */
+        UINT32 Uid, Gid, Mode;
+        fsp_fuse_intf_GetFileInfoFromStat(dh->f, stbuf, &Uid, &Gid, &Mode, &di->FileInfo);
+        di->FileInfoValid = TRUE;
+    }
     di->NextOffset = 0 != off ? off : dh->BytesTransferred;
     memcpy(di->PosixNameBuf, name, len);
     di->PosixNameBuf[len] = '\0';
@@ -1246,6 +1366,198 @@ int fsp_fuse_intf_AddDirInfoOld(fuse_dirh_t dh, const char *name,
     return fsp_fuse_intf_AddDirInfo(dh, name, 0, 0) ? -ENOMEM : 0;
 }
 
+/*
+ * Directory entries that come without (authoritative) stat data require a getattr
+ * each. When the ReaddirPrefetch option is set and the file system is multithreaded
+ * (i.e. not under the COARSE operation guard) we issue the getattr's for the entries
+ * that are about to be returned in parallel, using the system thread pool. Each worker
+ * thread assumes the FUSE context of the thread that is reading the directory for the
+ * duration of the prefetch and then gets its own context back.
+ *
+ * Prefetching is best effort: entries whose getattr fails are left alone and the
+ * (serial) ReadDirectory loop retries them and reports the error.
+ */
+#define FSP_FUSE_INTF_PREFETCH_WORKERS  8
+#define FSP_FUSE_INTF_PREFETCH_MAX      1024
+
+struct fsp_fuse_intf_prefetch
+{
+    FSP_FILE_SYSTEM *FileSystem;
+    struct fuse_context *context;
+    const char *DirPath;
+    struct fsp_fuse_dirinfo **Entries;
+    LONG Count, Index;
+    LONG Workers;
+    HANDLE Event;
+};
+
+static VOID fsp_fuse_intf_PrefetchFileInfo(struct fsp_fuse_intf_prefetch *Prefetch)
+{
+    struct fuse *f = Prefetch->FileSystem->UserContext;
+    struct fuse_context *context, SavedContext;
+    struct fsp_fuse_dirinfo *di;
+    UINT32 Uid, Gid, Mode;
+    char *PosixPath, *PosixName;
+    ULONG Size;
+    LONG Index;
+    NTSTATUS Result;
+
+    context = fsp_fuse_get_context(f->env);
+    if (0 == context)
+        return;
+
+    Size = lstrlenA(Prefetch->DirPath);
+    PosixPath = MemAlloc(Size + 1 + 255 + 1);
+    if (0 == PosixPath)
+        return;
+
+    /* a thread pool thread may be running other FUSE code; save its context */
+    memcpy(&SavedContext, context, sizeof SavedContext);
+    if (context != Prefetch->context)
+        memcpy(context, Prefetch->context, sizeof *context);
+
+    memcpy(PosixPath, Prefetch->DirPath, Size);
+    if (1 < Size)
+        /* if not root */
+        PosixPath[Size++] = '/';
+    PosixName = PosixPath + Size;
+
+    while (Prefetch->Count > (Index = InterlockedIncrement(&Prefetch->Index) - 1))
+    {
+        di = Prefetch->Entries[Index];
+
+        Size = lstrlenA(di->PosixNameBuf);
+        if (Size > 255)
+            Size = 255;
+        memcpy(PosixName, di->PosixNameBuf, Size);
+        PosixName[Size] = '\0';
+
+        Result = fsp_fuse_intf_GetFileInfoEx(Prefetch->FileSystem, PosixPath, 0,
+            &Uid, &Gid, &Mode, &di->FileInfo);
+        if (NT_SUCCESS(Result))
+            di->FileInfoValid = TRUE;
+    }
+
+    memcpy(context, &SavedContext, sizeof *context);
+
+    MemFree(PosixPath);
+}
+
+static VOID CALLBACK fsp_fuse_intf_PrefetchWork(PTP_CALLBACK_INSTANCE Instance, PVOID Context)
+{
+    struct fsp_fuse_intf_prefetch *Prefetch = Context;
+
+    fsp_fuse_intf_PrefetchFileInfo(Prefetch);
+
+    if (0 == InterlockedDecrement(&Prefetch->Workers))
+        SetEvent(Prefetch->Event);
+}
+
+static VOID fsp_fuse_intf_Prefetch(FSP_FILE_SYSTEM *FileSystem,
+    const char *DirPath, struct fsp_fuse_dirinfo *di, PUINT8 diend, ULONG Length)
+{
+    struct fuse *f = FileSystem->UserContext;
+    struct fsp_fuse_intf_prefetch Prefetch;
+    struct fsp_fuse_dirinfo *Entries[FSP_FUSE_INTF_PREFETCH_MAX];
+    ULONG Size, Workers;
+
+    memset(&Prefetch, 0, sizeof Prefetch);
+
+    /* collect entries without stat data that (are estimated to) fit in the output buffer */
+    for (Size = 0;
+        (PUINT8)di + sizeof(di->Size) <= diend &&
+            FSP_FUSE_INTF_PREFETCH_MAX > Prefetch.Count && Length > Size;
+        di = (PVOID)((PUINT8)di + FSP_FSCTL_DEFAULT_ALIGN_UP(di->Size)))
+    {
+        if (sizeof(struct fsp_fuse_dirinfo) > di->Size)
+            break;
+
+        Size += FSP_FSCTL_DEFAULT_ALIGN_UP(sizeof(FSP_FSCTL_DIR_INFO) +
+            (di->Size - sizeof(struct fsp_fuse_dirinfo)) * sizeof(WCHAR));
+
+        if (di->FileInfoValid ||
+            ('.' == di->PosixNameBuf[0] && '\0' == di->PosixNameBuf[1]) ||
+            ('.' == di->PosixNameBuf[0] && '.' == di->PosixNameBuf[1] && '\0' == di->PosixNameBuf[2]))
+            continue;
+
+        Entries[Prefetch.Count++] = di;
+    }
+
+    if (2 > Prefetch.Count)
+        return;
+
+    Prefetch.FileSystem = FileSystem;
+    Prefetch.context = fsp_fuse_get_context(f->env);
+    Prefetch.DirPath = DirPath;
+    Prefetch.Entries = Entries;
+    Prefetch.Event = CreateEventW(0, TRUE, FALSE, 0);
+    if (0 == Prefetch.context || 0 == Prefetch.Event)
+        goto exit;
+
+    /* the current thread is a worker too; it also covers any submission failures */
+    Prefetch.Workers = 1;
+    for (Workers = 1;
+        FSP_FUSE_INTF_PREFETCH_WORKERS > Workers && (ULONG)Prefetch.Count > Workers;
+        Workers++)
+    {
+        InterlockedIncrement(&Prefetch.Workers);
+        if (!TrySubmitThreadpoolCallback(fsp_fuse_intf_PrefetchWork, &Prefetch, 0))
+        {
+            InterlockedDecrement(&Prefetch.Workers);
+            break;
+        }
+    }
+
+    fsp_fuse_intf_PrefetchWork(0, &Prefetch);
+    WaitForSingleObject(Prefetch.Event, INFINITE);
+
+exit:
+    if (0 != Prefetch.Event)
+        CloseHandle(Prefetch.Event);
+}
+
+NTSTATUS fsp_fuse_intf_AddFileDirInfo(struct fsp_fuse_dirinfo *di,
+    PVOID Buffer, ULONG Length, PULONG PBytesTransferred, PBOOLEAN PAdded)
+{
+    union
+    {
+        FSP_FSCTL_DIR_INFO V;
+        UINT8 B[sizeof(FSP_FSCTL_DIR_INFO) + 256 * sizeof(WCHAR)]; /* 255 + term-0 */
+    } DirInfoBuf;
+    FSP_FSCTL_DIR_INFO *DirInfo = &DirInfoBuf.V;
+    PWSTR FileName = 0;
+    ULONG Size;
+    NTSTATUS Result;
+
+    memcpy(&DirInfo->FileInfo, &di->FileInfo, sizeof di->FileInfo);
+
+    /* convert directly into the directory info; only overlong names need an allocation */
+    Size = 256 * sizeof(WCHAR);
+    Result = FspPosixMapPosixToWindowsPathBuffer(di->PosixNameBuf, DirInfo->FileNameBuf, &Size);
+    if (STATUS_BUFFER_OVERFLOW == Result)
+    {
+        Result = FspPosixMapPosixToWindowsPath(di->PosixNameBuf, &FileName);
+        if (!NT_SUCCESS(Result))
+            return Result;
+
+        Size = 256 * sizeof(WCHAR);
+        memcpy(DirInfo->FileNameBuf, FileName, Size);
+
+        FspPosixDeletePath(FileName);
+    }
+    else if (!NT_SUCCESS(Result))
+        return Result;
+    Size -= sizeof(WCHAR); /* term-0 */
+
+    memset(DirInfo->Padding, 0, sizeof DirInfo->Padding);
+    DirInfo->Size = (UINT16)(sizeof(FSP_FSCTL_DIR_INFO) + Size);
+    DirInfo->NextOffset = di->NextOffset;
+
+    *PAdded = FspFileSystemAddDirInfo(DirInfo, Buffer, Length, PBytesTransferred);
+
+    return STATUS_SUCCESS;
+}
+
 static NTSTATUS fsp_fuse_intf_ReadDirectory(FSP_FILE_SYSTEM *FileSystem,
     FSP_FSCTL_TRANSACT_REQ *Request,
     PVOID FileNode, PVOID Buffer, UINT64 Offset, ULONG Length,
@@ -1259,20 +1571,16 @@ static NTSTATUS fsp_fuse_intf_ReadDirectory(FSP_FILE_SYSTEM *FileSystem,
     struct fuse_dirhandle dh;
     struct fsp_fuse_dirinfo *di;
     PUINT8 diend;
-    union
-    {
-        FSP_FSCTL_DIR_INFO V;
-        UINT8 B[sizeof(FSP_FSCTL_DIR_INFO) + 255 * sizeof(WCHAR)];
-    } DirInfoBuf;
-    FSP_FSCTL_DIR_INFO *DirInfo = &DirInfoBuf.V;
     UINT32 Uid, Gid, Mode;
     char *PosixPath = 0, *PosixName, *PosixPathEnd, SavedPathChar;
-    PWSTR FileName = 0;
     ULONG Size;
+    BOOLEAN Added;
     int err;
     NTSTATUS Result;
 
     memset(&dh, 0, sizeof dh);
+    if (f->readdir_plus)
+        dh.f = f;
 
     if (0 == filedesc->DirBuffer)
     {
@@ -1323,6 +1631,10 @@ static NTSTATUS fsp_fuse_intf_ReadDirectory(FSP_FILE_SYSTEM *FileSystem,
         diend = (PUINT8)filedesc->DirBuffer + filedesc->DirBufferSize;
     }
 
+    if (f->ReaddirPrefetch &&
+        FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY_COARSE != f->OpGuardStrategy)
+        fsp_fuse_intf_Prefetch(FileSystem, filedesc->PosixPath, di, diend, Length);
+
     for (;
         (PUINT8)di + sizeof(di->Size) <= diend;
         di = (PVOID)((PUINT8)di + FSP_FSCTL_DEFAULT_ALIGN_UP(di->Size)))
@@ -1387,25 +1699,11 @@ static NTSTATUS fsp_fuse_intf_ReadDirectory(FSP_FILE_SYSTEM *FileSystem,
 
             di->FileInfoValid = TRUE;
         }
-        memcpy(&DirInfo->FileInfo, &di->FileInfo, sizeof di->FileInfo);
 
-        Result = FspPosixMapPosixToWindowsPath(di->PosixNameBuf, &FileName);
+        Result = fsp_fuse_intf_AddFileDirInfo(di, Buffer, Length, PBytesTransferred, &Added);
         if (!NT_SUCCESS(Result))
             goto exit;
-
-        Size = lstrlenW(FileName);
-        if (Size > 255)
-            Size = 255;
-        Size *= sizeof(WCHAR);
-        memcpy(DirInfo->FileNameBuf, FileName, Size);
-
-        FspPosixDeletePath(FileName);
-
-        memset(DirInfo->Padding, 0, sizeof DirInfo->Padding);
-        DirInfo->Size = (UINT16)(sizeof(FSP_FSCTL_DIR_INFO) + Size);
-        DirInfo->NextOffset = di->NextOffset;
-
-        if (!FspFileSystemAddDirInfo(DirInfo, Buffer, Length, PBytesTransferred))
+        if (!Added)
             break;
     }
 
@@ -0,0 +1,1779 @@
+/**
+ * @file dll/fuse/fuse_lowlevel.c
+ *
+ * @copyright 2015-2016 Bill Zissimopoulos
+ */
+/*
+ * This file is part of WinFsp.
+ *
+ * You can redistribute it and/or modify it under the terms of the
+ * GNU Affero General Public License version 3 as published by the
+ * Free Software Foundation.
+ *
+ * Licensees holding a valid commercial license may use this file in
+ * accordance with the commercial license agreement provided with the
+ * software.
+ */
+
+#include <dll/fuse/library.h>
+
+/*
+ * A low-level file system identifies files by node ID. WinFsp requests come with paths,
+ * which are resolved to node ID's using the node table (see shared/nodetab.h). The node
+ * table is protected by the NodeLock, which is never held while calling the file system;
+ * nodes that are in use are referenced instead. An open file references its node, so that
+ * operations on open files need not resolve paths at all.
+ *
+ * Requests are replied to synchronously: a struct fuse_req lives on the stack of the
+ * operation that calls the file system and the fuse_reply_* functions copy their results
+ * to where the operation wants them.
+ */
+
+/* requests */
+
+static VOID fsp_fuse_ll_req_init(struct fuse *f, struct fuse_req *req)
+{
+    struct fuse_context *context = fsp_fuse_get_context(f->env);
+
+    memset(req, 0, sizeof *req);
+    req->f = f;
+    if (0 != context)
+    {
+        req->ctx.uid = context->uid;
+        req->ctx.gid = context->gid;
+        req->ctx.pid = context->pid;
+        req->ctx.umask = context->umask;
+    }
+}
+
+static NTSTATUS fsp_fuse_ll_req_result(struct fuse_req *req)
+{
+    /* a request that has not been replied to has failed */
+    return fsp_fuse_ntstatus_from_errno(req->f->env, req->replied ? req->err : EIO);
+}
+
+FSP_FUSE_API int fsp_fuse_reply_err(struct fsp_fuse_env *env,
+    fuse_req_t req, int err)
+{
+    req->replied = 1;
+    req->err = err;
+    return 0;
+}
+
+FSP_FUSE_API int fsp_fuse_reply_entry(struct fsp_fuse_env *env,
+    fuse_req_t req, const struct fuse_entry_param *e)
+{
+    req->replied = 1;
+    req->err = 0 != req->entry ? 0 : EIO;
+    if (0 != req->entry)
+        memcpy(req->entry, e, sizeof *e);
+    return 0;
+}
+
+FSP_FUSE_API int fsp_fuse_reply_create(struct fsp_fuse_env *env,
+    fuse_req_t req, const struct fuse_entry_param *e, const struct fuse_file_info *fi)
+{
+    req->replied = 1;
+    req->err = 0 != req->entry && 0 != req->fi ? 0 : EIO;
+    if (0 != req->entry)
+        memcpy(req->entry, e, sizeof *e);
+    if (0 != req->fi && fi != req->fi)
+        memcpy(req->fi, fi, sizeof *fi);
+    return 0;
+}
+
+FSP_FUSE_API int fsp_fuse_reply_attr(struct fsp_fuse_env *env,
+    fuse_req_t req, const struct fuse_stat *attr, double attr_timeout)
+{
+    req->replied = 1;
+    req->err = 0 != req->attr ? 0 : EIO;
+    if (0 != req->attr)
+        memcpy(req->attr, attr, sizeof *attr);
+    return 0;
+}
+
+FSP_FUSE_API int fsp_fuse_reply_readlink(struct fsp_fuse_env *env,
+    fuse_req_t req, const char *link)
+{
+    ULONG Size = lstrlenA(link) + 1;
+
+    req->replied = 1;
+    req->err = 0 != req->Buffer && Size <= req->Length ? 0 : EIO;
+    if (0 == req->err)
+    {
+        memcpy(req->Buffer, link, Size);
+        req->BytesTransferred = Size;
+    }
+    return 0;
+}
+
+FSP_FUSE_API int fsp_fuse_reply_open(struct fsp_fuse_env *env,
+    fuse_req_t req, const struct fuse_file_info *fi)
+{
+    req->replied = 1;
+    req->err = 0 != req->fi ? 0 : EIO;
+    if (0 != req->fi && fi != req->fi)
+        memcpy(req->fi, fi, sizeof *fi);
+    return 0;
+}
+
+FSP_FUSE_API int fsp_fuse_reply_write(struct fsp_fuse_env *env,
+    fuse_req_t req, size_t count)
+{
+    req->replied = 1;
+    req->err = 0;
+    req->BytesTransferred = (ULONG)count;
+    return 0;
+}
+
+FSP_FUSE_API int fsp_fuse_reply_buf(struct fsp_fuse_env *env,
+    fuse_req_t req, const char *buf, size_t size)
+{
+    req->replied = 1;
+    req->err = 0 != req->Buffer || 0 == size ? 0 : EIO;
+    if (0 == req->err)
+    {
+        if (size > req->Length)
+            size = req->Length;
+        if (0 != size)
+            memcpy(req->Buffer, buf, size);
+        req->BytesTransferred = (ULONG)size;
+    }
+    return 0;
+}
+
+FSP_FUSE_API int fsp_fuse_reply_data(struct fsp_fuse_env *env,
+    fuse_req_t req, struct fuse_bufvec *bufv, enum fuse_buf_copy_flags flags)
+{
+    struct fuse_bufvec dstv;
+    fuse_ssize_t bytes;
+
+    req->replied = 1;
+    req->err = 0 != req->Buffer ? 0 : EIO;
+    if (0 == req->err)
+    {
+        /* gather the file system's buffers directly into the transact buffer */
+        memset(&dstv, 0, sizeof dstv);
+        dstv.count = 1;
+        dstv.buf[0].size = req->Length;
+        dstv.buf[0].mem = req->Buffer;
+        dstv.buf[0].fd = -1;
+
+        bytes = fsp_fuse_buf_copy(env, &dstv, bufv, flags);
+        if (0 <= bytes)
+            req->BytesTransferred = (ULONG)bytes;
+        else
+            req->err = (int)-bytes;
+    }
+    return 0;
+}
+
+FSP_FUSE_API int fsp_fuse_reply_statfs(struct fsp_fuse_env *env,
+    fuse_req_t req, const struct fuse_statvfs *stbuf)
+{
+    req->replied = 1;
+    req->err = 0 != req->stbuf ? 0 : EIO;
+    if (0 != req->stbuf)
+        memcpy(req->stbuf, stbuf, sizeof *stbuf);
+    return 0;
+}
+
+FSP_FUSE_API size_t fsp_fuse_add_direntry(struct fsp_fuse_env *env,
+    fuse_req_t req, char *buf, size_t bufsize,
+    const char *name, const struct fuse_stat *stbuf, fuse_off_t off)
+{
+    struct fsp_fuse_dirinfo *di = (PVOID)buf;
+    ULONG len, xfersize;
+
+    len = lstrlenA(name);
+    if (len > 255)
+        len = 255;
+
+    /* as in libfuse: return the size of the entry; add it only if it fits */
+    xfersize = FSP_FSCTL_DEFAULT_ALIGN_UP(sizeof(struct fsp_fuse_dirinfo) + len + 1);
+    if (0 == buf || xfersize > bufsize)
+        return xfersize;
+
+    di->Size = (UINT16)(sizeof(struct fsp_fuse_dirinfo) + len + 1);
+    di->FileInfoValid = FALSE;
+    if (0 != stbuf && req->f->readdir_plus)
+    {
+        /* readdir_plus: the file system promises that the stat data is complete */
+        UINT32 Uid, Gid, Mode;
+        fsp_fuse_intf_GetFileInfoFromStat(req->f, stbuf, &Uid, &Gid, &Mode, &di->FileInfo);
+        di->FileInfoValid = TRUE;
+    }
+    di->NextOffset = off;
+    memcpy(di->PosixNameBuf, name, len);
+    di->PosixNameBuf[len] = '\0';
+
+    return xfersize;
+}
+
+FSP_FUSE_API void *fsp_fuse_req_userdata(struct fsp_fuse_env *env,
+    fuse_req_t req)
+{
+    return req->f->data;
+}
+
+FSP_FUSE_API const struct fuse_ctx *fsp_fuse_req_ctx(struct fsp_fuse_env *env,
+    fuse_req_t req)
+{
+    return &req->ctx;
+}
+
+/* file system calls */
+
+NTSTATUS fsp_fuse_ll_statfs(struct fuse *f, struct fuse_statvfs *stbuf)
+{
+    struct fuse_req req;
+
+    if (0 == f->llops.statfs)
+        return STATUS_INVALID_DEVICE_REQUEST;
+
+    memset(stbuf, 0, sizeof *stbuf);
+    fsp_fuse_ll_req_init(f, &req);
+    req.stbuf = stbuf;
+    f->llops.statfs(&req, FUSE_ROOT_ID);
+
+    return fsp_fuse_ll_req_result(&req);
+}
+
+NTSTATUS fsp_fuse_ll_getattr(struct fuse *f, fuse_ino_t ino, struct fuse_file_info *fi,
+    struct fuse_stat *stbuf)
+{
+    struct fuse_req req;
+    NTSTATUS Result;
+
+    if (0 == f->llops.getattr)
+        return STATUS_INVALID_DEVICE_REQUEST;
+
+    memset(stbuf, 0, sizeof *stbuf);
+    fsp_fuse_ll_req_init(f, &req);
+    req.attr = stbuf;
+    f->llops.getattr(&req, ino, fi);
+
+    Result = fsp_fuse_ll_req_result(&req);
+    if (NT_SUCCESS(Result) && 0 == stbuf->st_ino)
+        stbuf->st_ino = ino;
+
+    return Result;
+}
+
+static NTSTATUS fsp_fuse_ll_setattr(struct fuse *f, fuse_ino_t ino,
+    struct fuse_stat *attr, int to_set, struct fuse_file_info *fi,
+    struct fuse_stat *stbuf)
+{
+    struct fuse_req req;
+    NTSTATUS Result;
+
+    if (0 == f->llops.setattr)
+        return STATUS_INVALID_DEVICE_REQUEST;
+
+    memset(stbuf, 0, sizeof *stbuf);
+    fsp_fuse_ll_req_init(f, &req);
+    req.attr = stbuf;
+    f->llops.setattr(&req, ino, attr, to_set, fi);
+
+    Result = fsp_fuse_ll_req_result(&req);
+    if (NT_SUCCESS(Result) && 0 == stbuf->st_ino)
+        stbuf->st_ino = ino;
+
+    return Result;
+}
+
+static VOID fsp_fuse_ll_forget(struct fuse *f, fuse_ino_t ino, UINT64 nlookup)
+{
+    struct fuse_req req;
+
+    if (0 == f->llops.forget || 0 == nlookup)
+        return;
+
+    fsp_fuse_ll_req_init(f, &req);
+    f->llops.forget(&req, ino, nlookup);
+}
+
+static VOID fsp_fuse_ll_release(struct fuse *f, BOOLEAN IsDirectory, fuse_ino_t ino,
+    struct fuse_file_info *fi)
+{
+    struct fuse_req req;
+
+    fsp_fuse_ll_req_init(f, &req);
+    if (IsDirectory)
+    {
+        if (0 != f->llops.releasedir)
+            f->llops.releasedir(&req, ino, fi);
+    }
+    else
+    {
+        if (0 != f->llops.release)
+            f->llops.release(&req, ino, fi);
+    }
+}
+
+/* node table */
+
+struct fsp_fuse_ll_lookup_context
+{
+    struct fuse *f;
+    fuse_ino_t ino;                     /* node ID of the last lookup (0 if none) */
+    struct fuse_stat attr;              /* attributes of the last lookup */
+};
+
+static VOID fsp_fuse_ll_lock(struct fuse *f)
+{
+    AcquireSRWLockExclusive(&f->NodeLock);
+}
+
+static VOID fsp_fuse_ll_unlock(struct fuse *f)
+{
+    FSP_NODE_TABLE_NODE *ForgetList, *Node;
+    FSP_NODE_TABLE_ENTRY *FreeList, *Entry;
+
+    ForgetList = FspNodeTableTakeForgetList(f->NodeTable);
+    FreeList = FspNodeTableTakeFreeList(f->NodeTable);
+    ReleaseSRWLockExclusive(&f->NodeLock);
+
+    /* tell the file system outside the lock */
+    while (0 != (Node = ForgetList))
+    {
+        ForgetList = Node->DictNext;
+        fsp_fuse_ll_forget(f, Node->Ino, Node->LookupCount);
+        MemFree(Node);
+    }
+    while (0 != (Entry = FreeList))
+    {
+        FreeList = Entry->DictNext;
+        MemFree(Entry);
+    }
+}
+
+static NTSTATUS fsp_fuse_ll_new_node(struct fuse *f,
+    const char *Name, ULONG NameLength, fuse_ino_t ino,
+    FSP_NODE_TABLE_ENTRY **PEntry, FSP_NODE_TABLE_NODE **PNode)
+{
+    FSP_NODE_TABLE_ENTRY *Entry;
+    FSP_NODE_TABLE_NODE *Node;
+
+    Entry = MemAlloc(sizeof *Entry + NameLength);
+    Node = MemAlloc(sizeof *Node);
+    if (0 == Entry || 0 == Node)
+    {
+        MemFree(Node);
+        MemFree(Entry);
+
+        /* the node ID cannot be remembered; give the lookup back */
+        fsp_fuse_ll_forget(f, ino, 1);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    memset(Node, 0, sizeof *Node);
+    Node->Ino = ino;
+    memset(Entry, 0, sizeof *Entry);
+    memcpy(Entry->Name, Name, NameLength);
+    Entry->NameLength = NameLength;
+
+    *PEntry = Entry;
+    *PNode = Node;
+
+    return STATUS_SUCCESS;
+}
+
+static FSP_NODE_TABLE_NODE *fsp_fuse_ll_insert_node(struct fuse *f,
+    FSP_NODE_TABLE_NODE *Parent, FSP_NODE_TABLE_ENTRY *Entry, FSP_NODE_TABLE_NODE *Node)
+{
+    FSP_NODE_TABLE_NODE *Resident;
+
+    /* must be called with the NodeLock held */
+    Resident = FspNodeTableInsert(f->NodeTable, Parent, Entry, Node);
+    if (Resident != Node)
+        MemFree(Node);
+
+    return Resident;
+}
+
+static NTSTATUS fsp_fuse_ll_insert(struct fuse *f,
+    FSP_NODE_TABLE_NODE *Parent, const char *Name, fuse_ino_t ino,
+    FSP_NODE_TABLE_NODE **PNode)
+{
+    FSP_NODE_TABLE_ENTRY *Entry;
+    FSP_NODE_TABLE_NODE *Node;
+    NTSTATUS Result;
+
+    /* insert the result of a create, mkdir, etc.; if PNode is not 0 the node is referenced */
+    Result = fsp_fuse_ll_new_node(f, Name, lstrlenA(Name), ino, &Entry, &Node);
+    if (!NT_SUCCESS(Result))
+        return Result;
+
+    fsp_fuse_ll_lock(f);
+    Node = fsp_fuse_ll_insert_node(f, Parent, Entry, Node);
+    if (0 != PNode)
+    {
+        FspNodeTableReference(f->NodeTable, Node);
+        *PNode = Node;
+    }
+    fsp_fuse_ll_unlock(f);
+
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS fsp_fuse_ll_lookup(PVOID Context0,
+    FSP_NODE_TABLE_NODE *Parent, const char *Name, ULONG NameLength,
+    FSP_NODE_TABLE_NODE **PNode)
+{
+    struct fsp_fuse_ll_lookup_context *Context = Context0;
+    struct fuse *f = Context->f;
+    char NameBuf[256];
+    struct fuse_entry_param e;
+    struct fuse_req req;
+    FSP_NODE_TABLE_ENTRY *Entry;
+    FSP_NODE_TABLE_NODE *Node;
+    NTSTATUS Result;
+
+    /*
+     * Called by FspNodeTableResolve with the NodeLock held and Parent referenced.
+     * The lock is dropped while the file system is working; it is held on return.
+     */
+
+    if (0 == f->llops.lookup)
+        return STATUS_INVALID_DEVICE_REQUEST;
+
+    if (255 < NameLength)
+        return STATUS_OBJECT_NAME_INVALID;
+    memcpy(NameBuf, Name, NameLength);
+    NameBuf[NameLength] = '\0';
+
+    fsp_fuse_ll_unlock(f);
+
+    memset(&e, 0, sizeof e);
+    fsp_fuse_ll_req_init(f, &req);
+    req.entry = &e;
+    f->llops.lookup(&req, Parent->Ino, NameBuf);
+
+    Result = fsp_fuse_ll_req_result(&req);
+    if (NT_SUCCESS(Result) && 0 == e.ino)
+        /* negative entry */
+        Result = STATUS_OBJECT_NAME_NOT_FOUND;
+    if (NT_SUCCESS(Result))
+        Result = fsp_fuse_ll_new_node(f, NameBuf, NameLength, e.ino, &Entry, &Node);
+
+    fsp_fuse_ll_lock(f);
+
+    if (!NT_SUCCESS(Result))
+        return Result;
+
+    *PNode = fsp_fuse_ll_insert_node(f, Parent, Entry, Node);
+
+    /* remember the attributes so that the caller need not ask for them again */
+    Context->ino = e.ino;
+    memcpy(&Context->attr, &e.attr, sizeof e.attr);
+    if (0 == Context->attr.st_ino)
+        Context->attr.st_ino = e.ino;
+
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS fsp_fuse_ll_resolve(struct fuse *f, const char *PosixPath, BOOLEAN ResolveParent,
+    struct fsp_fuse_ll_lookup_context *Context,
+    FSP_NODE_TABLE_NODE **PNode, const char **PName)
+{
+    NTSTATUS Result;
+
+    memset(Context, 0, sizeof *Context);
+    Context->f = f;
+
+    fsp_fuse_ll_lock(f);
+    Result = FspNodeTableResolve(f->NodeTable, PosixPath, ResolveParent,
+        fsp_fuse_ll_lookup, Context, PNode, PName);
+    fsp_fuse_ll_unlock(f);
+
+    return Result;
+}
+
+static VOID fsp_fuse_ll_dereference(struct fuse *f, FSP_NODE_TABLE_NODE *Node)
+{
+    fsp_fuse_ll_lock(f);
+    FspNodeTableDereference(f->NodeTable, Node);
+    fsp_fuse_ll_unlock(f);
+}
+
+static VOID fsp_fuse_ll_unbind(struct fuse *f, FSP_NODE_TABLE_NODE *Parent, const char *Name)
+{
+    FSP_NODE_TABLE_ENTRY *Entry;
+    ULONG NameLength = lstrlenA(Name);
+
+    /* the name is gone from the file system (unlink, rmdir, rename) */
+    fsp_fuse_ll_lock(f);
+    Entry = FspNodeTableFindEntry(f->NodeTable, Parent, Name, NameLength,
+        FspNodeTableNameHash(Parent->Ino, Name, NameLength));
+    if (0 != Entry)
+        FspNodeTableRemove(f->NodeTable, Entry);
+    fsp_fuse_ll_unlock(f);
+}
+
+VOID fsp_fuse_ll_delete_nodes(struct fuse *f)
+{
+    FSP_NODE_TABLE *Table = f->NodeTable;
+    FSP_NODE_TABLE_NODE *Node, *NextNode;
+    FSP_NODE_TABLE_ENTRY *Entry, *NextEntry;
+    ULONG Index;
+
+    /* the file system is gone; nothing is forgotten */
+    for (Index = 0; FspNodeTableBucketCount > Index; Index++)
+    {
+        for (Entry = Table->EntryBuckets[Index]; 0 != Entry; Entry = NextEntry)
+        {
+            NextEntry = Entry->DictNext;
+            MemFree(Entry);
+        }
+        for (Node = Table->NodeBuckets[Index]; 0 != Node; Node = NextNode)
+        {
+            NextNode = Node->DictNext;
+            if (&Table->Root != Node)
+                MemFree(Node);
+        }
+    }
+    for (Entry = FspNodeTableTakeFreeList(Table); 0 != Entry; Entry = NextEntry)
+    {
+        NextEntry = Entry->DictNext;
+        MemFree(Entry);
+    }
+    for (Node = FspNodeTableTakeForgetList(Table); 0 != Node; Node = NextNode)
+    {
+        NextNode = Node->DictNext;
+        MemFree(Node);
+    }
+}
+
+/* file system interface */
+
+static NTSTATUS fsp_fuse_ll_GetFileInfoEx(FSP_FILE_SYSTEM *FileSystem,
+    fuse_ino_t ino, struct fuse_file_info *fi,
+    PUINT32 PUid, PUINT32 PGid, PUINT32 PMode,
+    FSP_FSCTL_FILE_INFO *FileInfo)
+{
+    struct fuse *f = FileSystem->UserContext;
+    struct fuse_stat stbuf;
+    NTSTATUS Result;
+
+    Result = fsp_fuse_ll_getattr(f, ino, fi, &stbuf);
+    if (!NT_SUCCESS(Result))
+        return Result;
+
+    fsp_fuse_intf_GetFileInfoFromStat(f, &stbuf, PUid, PGid, PMode, FileInfo);
+
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS fsp_fuse_ll_GetFileInfoResolved(FSP_FILE_SYSTEM *FileSystem,
+    struct fsp_fuse_ll_lookup_context *Context, FSP_NODE_TABLE_NODE *Node,
+    PUINT32 PUid, PUINT32 PGid, PUINT32 PMode,
+    FSP_FSCTL_FILE_INFO *FileInfo)
+{
+    struct fuse *f = FileSystem->UserContext;
+
+    /* a node that was just looked up comes with its attributes */
+    if (0 != Context->ino && Node->Ino == Context->ino)
+    {
+        fsp_fuse_intf_GetFileInfoFromStat(f, &Context->attr, PUid, PGid, PMode, FileInfo);
+        return STATUS_SUCCESS;
+    }
+
+    return fsp_fuse_ll_GetFileInfoEx(FileSystem, Node->Ino, 0, PUid, PGid, PMode, FileInfo);
+}
+
+static NTSTATUS fsp_fuse_ll_GetVolumeInfo(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FSCTL_TRANSACT_REQ *Request,
+    FSP_FSCTL_VOLUME_INFO *VolumeInfo)
+{
+    struct fuse *f = FileSystem->UserContext;
+    struct fuse_statvfs stbuf;
+    NTSTATUS Result;
+
+    Result = fsp_fuse_ll_statfs(f, &stbuf);
+    if (!NT_SUCCESS(Result))
+        return Result;
+
+    VolumeInfo->TotalSize = (UINT64)stbuf.f_blocks * (UINT64)stbuf.f_frsize;
+    VolumeInfo->FreeSize = (UINT64)stbuf.f_bfree * (UINT64)stbuf.f_frsize;
+    VolumeInfo->VolumeLabelLength = 0;
+    VolumeInfo->VolumeLabel[0] = L'\0';
+
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS fsp_fuse_ll_SetVolumeLabel(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FSCTL_TRANSACT_REQ *Request,
+    PWSTR VolumeLabel,
+    FSP_FSCTL_VOLUME_INFO *VolumeInfo)
+{
+    /* see fsp_fuse_intf_SetVolumeLabel */
+    return STATUS_INVALID_PARAMETER;
+}
+
+static NTSTATUS fsp_fuse_ll_GetSecurityByName(FSP_FILE_SYSTEM *FileSystem,
+    PWSTR FileName, PUINT32 PFileAttributes,
+    PSECURITY_DESCRIPTOR SecurityDescriptorBuf, SIZE_T *PSecurityDescriptorSize)
+{
+    struct fuse *f = FileSystem->UserContext;
+    char PosixPathBuf[512], *PosixPath = PosixPathBuf;
+    ULONG Size = sizeof PosixPathBuf;
+    struct fsp_fuse_ll_lookup_context Context;
+    FSP_NODE_TABLE_NODE *Node = 0;
+    UINT32 Uid, Gid, Mode;
+    FSP_FSCTL_FILE_INFO FileInfo;
+    NTSTATUS Result;
+
+    Result = FspPosixMapWindowsToPosixPathBuffer(FileName, PosixPath, &Size);
+    if (STATUS_BUFFER_OVERFLOW == Result)
+    {
+        PosixPath = 0;
+        Result = FspPosixMapWindowsToPosixPath(FileName, &PosixPath);
+    }
+    if (!NT_SUCCESS(Result))
+        goto exit;
+
+    Result = fsp_fuse_ll_resolve(f, PosixPath, FALSE, &Context, &Node, 0);
+    if (!NT_SUCCESS(Result))
+        goto exit;
+
+    Result = fsp_fuse_ll_GetFileInfoResolved(FileSystem, &Context, Node,
+        &Uid, &Gid, &Mode, &FileInfo);
+    if (!NT_SUCCESS(Result))
+        goto exit;
+
+    if (0 != PSecurityDescriptorSize)
+    {
+        Result = fsp_fuse_intf_GetSecurityFromPermissions(Uid, Gid, Mode,
+            SecurityDescriptorBuf, PSecurityDescriptorSize);
+        if (!NT_SUCCESS(Result))
+            goto exit;
+    }
+
+    if (0 != PFileAttributes)
+        *PFileAttributes = FileInfo.FileAttributes;
+
+    Result = STATUS_SUCCESS;
+
+exit:
+    if (0 != Node)
+        fsp_fuse_ll_dereference(f, Node);
+
+    if (0 != PosixPath && PosixPathBuf != PosixPath)
+        FspPosixDeletePath(PosixPath);
+
+    return Result;
+}
+
+static NTSTATUS fsp_fuse_ll_Create(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FSCTL_TRANSACT_REQ *Request,
+    PWSTR FileName, BOOLEAN CaseSensitive, UINT32 CreateOptions,
+    UINT32 FileAttributes, PSECURITY_DESCRIPTOR SecurityDescriptor, UINT64 AllocationSize,
+    PVOID *PFileNode, FSP_FSCTL_FILE_INFO *FileInfo)
+{
+    struct fuse *f = FileSystem->UserContext;
+    struct fuse_context *context = fsp_fuse_get_context(f->env);
+    struct fsp_fuse_context_header *contexthdr = FSP_FUSE_HDR_FROM_CONTEXT(context);
+    struct fsp_fuse_ll_lookup_context Context;
+    UINT32 Uid, Gid, Mode;
+    struct fsp_fuse_file_desc *filedesc = 0;
+    struct fuse_file_info fi;
+    struct fuse_entry_param e;
+    struct fuse_stat stbuf;
+    struct fuse_req req;
+    FSP_NODE_TABLE_NODE *Parent = 0, *Node = 0;
+    const char *Name;
+    BOOLEAN Opened = FALSE;
+    NTSTATUS Result;
+
+    filedesc = MemAlloc(sizeof *filedesc);
+    if (0 == filedesc)
+    {
+        Result = STATUS_INSUFFICIENT_RESOURCES;
+        goto exit;
+    }
+
+    Uid = context->uid;
+    Gid = context->gid;
+    Mode = 0777;
+    if (0 != SecurityDescriptor)
+    {
+        Result = FspPosixMapSecurityDescriptorToPermissions(SecurityDescriptor,
+            &Uid, &Gid, &Mode);
+        if (!NT_SUCCESS(Result))
+            goto exit;
+    }
+    Mode &= ~context->umask;
+
+    memset(&fi, 0, sizeof fi);
+    if ('C' == f->env->environment) /* Cygwin */
+        fi.flags = 0x0200 | 2 /*O_CREAT|O_RDWR*/;
+    else
+        fi.flags = 0x0100 | 2 /*O_CREAT|O_RDWR*/;
+
+    Result = fsp_fuse_ll_resolve(f, contexthdr->PosixPath, TRUE, &Context, &Parent, &Name);
+    if (!NT_SUCCESS(Result))
+        goto exit;
+    if (255 < lstrlenA(Name))
+    {
+        Result = STATUS_OBJECT_NAME_INVALID;
+        goto exit;
+    }
+
+    memset(&e, 0, sizeof e);
+    if (CreateOptions & FILE_DIRECTORY_FILE)
+    {
+        if (0 != f->llops.mkdir)
+        {
+            fsp_fuse_ll_req_init(f, &req);
+            req.entry = &e;
+            f->llops.mkdir(&req, Parent->Ino, Name, Mode);
+            Result = fsp_fuse_ll_req_result(&req);
+            if (!NT_SUCCESS(Result))
+                goto exit;
+
+            Result = fsp_fuse_ll_insert(f, Parent, Name, e.ino, &Node);
+            if (!NT_SUCCESS(Result))
+                goto exit;
+
+            if (0 != f->llops.opendir)
+            {
+                fsp_fuse_ll_req_init(f, &req);
+                req.fi = &fi;
+                f->llops.opendir(&req, Node->Ino, &fi);
+                Result = fsp_fuse_ll_req_result(&req);
+            }
+            else
+                Result = STATUS_SUCCESS;
+        }
+        else
+            Result = STATUS_INVALID_DEVICE_REQUEST;
+    }
+    else
+    {
+        if (0 != f->llops.create)
+        {
+            fsp_fuse_ll_req_init(f, &req);
+            req.entry = &e;
+            req.fi = &fi;
+            f->llops.create(&req, Parent->Ino, Name, 0100000 | Mode, &fi);
+            Result = fsp_fuse_ll_req_result(&req);
+            if (!NT_SUCCESS(Result))
+                goto exit;
+
+            Result = fsp_fuse_ll_insert(f, Parent, Name, e.ino, &Node);
+            if (!NT_SUCCESS(Result))
+            {
+                fsp_fuse_ll_release(f, FALSE, e.ino, &fi);
+                goto exit;
+            }
+        }
+        else if (0 != f->llops.mknod)
+        {
+            fsp_fuse_ll_req_init(f, &req);
+            req.entry = &e;
+            f->llops.mknod(&req, Parent->Ino, Name, 0100000 | Mode, 0);
+            Result = fsp_fuse_ll_req_result(&req);
+            if (!NT_SUCCESS(Result))
+                goto exit;
+
+            Result = fsp_fuse_ll_insert(f, Parent, Name, e.ino, &Node);
+            if (!NT_SUCCESS(Result))
+                goto exit;
+
+            if (0 != f->llops.open)
+            {
+                fsp_fuse_ll_req_init(f, &req);
+                req.fi = &fi;
+                f->llops.open(&req, Node->Ino, &fi);
+                Result = fsp_fuse_ll_req_result(&req);
+            }
+            else
+                Result = STATUS_SUCCESS;
+        }
+        else
+            Result = STATUS_INVALID_DEVICE_REQUEST;
+    }
+    if (!NT_SUCCESS(Result))
+        goto exit;
+
+    Opened = TRUE;
+
+    if (0 == e.attr.st_ino)
+        e.attr.st_ino = e.ino;
+
+    if (Uid != context->uid || Gid != context->gid)
+        if (0 != f->llops.setattr)
+        {
+            memset(&stbuf, 0, sizeof stbuf);
+            stbuf.st_uid = Uid;
+            stbuf.st_gid = Gid;
+            Result = fsp_fuse_ll_setattr(f, Node->Ino,
+                &stbuf, FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID, &fi, &e.attr);
+            if (!NT_SUCCESS(Result))
+                goto exit;
+        }
+
+    /*
+     * Ignore fuse_file_info::direct_io, fuse_file_info::keep_cache
+     * and fuse_file_info::nonseekable; see fsp_fuse_intf_Create.
+     */
+
+    fsp_fuse_intf_GetFileInfoFromStat(f, &e.attr, &Uid, &Gid, &Mode, FileInfo);
+    *PFileNode = 0;
+
+    filedesc->PosixPath = contexthdr->PosixPath;
+    filedesc->IsDirectory = !!(FileInfo->FileAttributes & FILE_ATTRIBUTE_DIRECTORY);
+    filedesc->OpenFlags = fi.flags;
+    filedesc->FileHandle = fi.fh;
+    filedesc->DirBuffer = 0;
+    filedesc->DirBufferSize = 0;
+    filedesc->Node = Node;
+    contexthdr->PosixPath = 0;
+    contexthdr->Response->Rsp.Create.Opened.UserContext2 = (UINT64)(UINT_PTR)filedesc;
+    Node = 0;
+
+    Result = STATUS_SUCCESS;
+
+exit:
+    if (!NT_SUCCESS(Result))
+    {
+        if (Opened)
+            fsp_fuse_ll_release(f, !!(CreateOptions & FILE_DIRECTORY_FILE), Node->Ino, &fi);
+
+        MemFree(filedesc);
+    }
+
+    if (0 != Node)
+        fsp_fuse_ll_dereference(f, Node);
+
+    if (0 != Parent)
+        fsp_fuse_ll_dereference(f, Parent);
+
+    return Result;
+}
+
+static NTSTATUS fsp_fuse_ll_Open(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FSCTL_TRANSACT_REQ *Request,
+    PWSTR FileName, BOOLEAN CaseSensitive, UINT32 CreateOptions,
+    PVOID *PFileNode, FSP_FSCTL_FILE_INFO *FileInfo)
+{
+    struct fuse *f = FileSystem->UserContext;
+    struct fuse_context *context = fsp_fuse_get_context(f->env);
+    struct fsp_fuse_context_header *contexthdr = FSP_FUSE_HDR_FROM_CONTEXT(context);
+    struct fsp_fuse_ll_lookup_context Context;
+    UINT32 Uid, Gid, Mode;
+    FSP_FSCTL_FILE_INFO FileInfoBuf;
+    struct fsp_fuse_file_desc *filedesc = 0;
+    struct fuse_file_info fi;
+    struct fuse_req req;
+    FSP_NODE_TABLE_NODE *Node = 0;
+    NTSTATUS Result;
+
+    Result = fsp_fuse_ll_resolve(f, contexthdr->PosixPath, FALSE, &Context, &Node, 0);
+    if (!NT_SUCCESS(Result))
+        goto exit;
+
+    Result = fsp_fuse_ll_GetFileInfoResolved(FileSystem, &Context, Node,
+        &Uid, &Gid, &Mode, &FileInfoBuf);
+    if (!NT_SUCCESS(Result))
+        goto exit;
+
+    filedesc = MemAlloc(sizeof *filedesc);
+    if (0 == filedesc)
+    {
+        Result = STATUS_INSUFFICIENT_RESOURCES;
+        goto exit;
+    }
+
+    memset(&fi, 0, sizeof fi);
+    switch (Request->Req.Create.DesiredAccess & (FILE_READ_DATA | FILE_WRITE_DATA))
+    {
+    default:
+    case FILE_READ_DATA:
+        fi.flags = 0/*O_RDONLY*/;
+        break;
+    case FILE_WRITE_DATA:
+        fi.flags = 1/*O_WRONLY*/;
+        break;
+    case FILE_READ_DATA | FILE_WRITE_DATA:
+        fi.flags = 2/*O_RDWR*/;
+        break;
+    }
+
+    /* as in libfuse a file system without open/opendir allows all opens */
+    Result = STATUS_SUCCESS;
+    fsp_fuse_ll_req_init(f, &req);
+    req.fi = &fi;
+    if (FileInfoBuf.FileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+    {
+        if (0 != f->llops.opendir)
+        {
+            f->llops.opendir(&req, Node->Ino, &fi);
+            Result = fsp_fuse_ll_req_result(&req);
+        }
+    }
+    else
+    {
+        if (0 != f->llops.open)
+        {
+            f->llops.open(&req, Node->Ino, &fi);
+            Result = fsp_fuse_ll_req_result(&req);
+        }
+    }
+    if (!NT_SUCCESS(Result))
+        goto exit;
+
+    *PFileNode = 0;
+    memcpy(FileInfo, &FileInfoBuf, sizeof FileInfoBuf);
+
+    filedesc->PosixPath = contexthdr->PosixPath;
+    filedesc->IsDirectory = !!(FileInfoBuf.FileAttributes & FILE_ATTRIBUTE_DIRECTORY);
+    filedesc->OpenFlags = fi.flags;
+    filedesc->FileHandle = fi.fh;
+    filedesc->DirBuffer = 0;
+    filedesc->DirBufferSize = 0;
+    filedesc->Node = Node;
+    contexthdr->PosixPath = 0;
+    contexthdr->Response->Rsp.Create.Opened.UserContext2 = (UINT64)(UINT_PTR)filedesc;
+    Node = 0;
+
+    Result = STATUS_SUCCESS;
+
+exit:
+    if (!NT_SUCCESS(Result))
+        MemFree(filedesc);
+
+    if (0 != Node)
+        fsp_fuse_ll_dereference(f, Node);
+
+    return Result;
+}
+
+static NTSTATUS fsp_fuse_ll_Overwrite(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FSCTL_TRANSACT_REQ *Request,
+    PVOID FileNode, UINT32 FileAttributes, BOOLEAN ReplaceFileAttributes,
+    FSP_FSCTL_FILE_INFO *FileInfo)
+{
+    struct fuse *f = FileSystem->UserContext;
+    struct fsp_fuse_file_desc *filedesc =
+        (PVOID)(UINT_PTR)Request->Req.Overwrite.UserContext2;
+    UINT32 Uid, Gid, Mode;
+    struct fuse_file_info fi;
+    struct fuse_stat attr, stbuf;
+    NTSTATUS Result;
+
+    memset(&fi, 0, sizeof fi);
+    fi.flags = filedesc->OpenFlags;
+    fi.fh = filedesc->FileHandle;
+
+    memset(&attr, 0, sizeof attr);
+    attr.st_size = 0;
+    Result = fsp_fuse_ll_setattr(f, filedesc->Node->Ino, &attr, FUSE_SET_ATTR_SIZE, &fi, &stbuf);
+    if (!NT_SUCCESS(Result))
+        return Result;
+
+    fsp_fuse_intf_GetFileInfoFromStat(f, &stbuf, &Uid, &Gid, &Mode, FileInfo);
+
+    return STATUS_SUCCESS;
+}
+
+static VOID fsp_fuse_ll_Cleanup(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FSCTL_TRANSACT_REQ *Request,
+    PVOID FileNode, PWSTR FileName, BOOLEAN Delete)
+{
+    struct fuse *f = FileSystem->UserContext;
+    struct fsp_fuse_file_desc *filedesc =
+        (PVOID)(UINT_PTR)Request->Req.Cleanup.UserContext2;
+    struct fsp_fuse_ll_lookup_context Context;
+    struct fuse_req req;
+    FSP_NODE_TABLE_NODE *Parent;
+    const char *Name;
+
+    /* see fsp_fuse_intf_Cleanup */
+
+    if (!Delete)
+        return;
+
+    if (!NT_SUCCESS(fsp_fuse_ll_resolve(f, filedesc->PosixPath, TRUE, &Context, &Parent, &Name)))
+        return;
+
+    fsp_fuse_ll_req_init(f, &req);
+    if (filedesc->IsDirectory)
+    {
+        if (0 != f->llops.rmdir)
+            f->llops.rmdir(&req, Parent->Ino, Name);
+    }
+    else
+    {
+        if (0 != f->llops.unlink)
+            f->llops.unlink(&req, Parent->Ino, Name);
+    }
+
+    if (NT_SUCCESS(fsp_fuse_ll_req_result(&req)))
+        fsp_fuse_ll_unbind(f, Parent, Name);
+
+    fsp_fuse_ll_dereference(f, Parent);
+}
+
+static VOID fsp_fuse_ll_Close(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FSCTL_TRANSACT_REQ *Request,
+    PVOID FileNode)
+{
+    struct fuse *f = FileSystem->UserContext;
+    struct fsp_fuse_file_desc *filedesc =
+        (PVOID)(UINT_PTR)Request->Req.Close.UserContext2;
+    struct fuse_file_info fi;
+    struct fuse_req req;
+
+    memset(&fi, 0, sizeof fi);
+    fi.flags = filedesc->OpenFlags;
+    fi.fh = filedesc->FileHandle;
+
+    if (!filedesc->IsDirectory && 0 != f->llops.flush)
+    {
+        fsp_fuse_ll_req_init(f, &req);
+        f->llops.flush(&req, filedesc->Node->Ino, &fi);
+    }
+    fsp_fuse_ll_release(f, filedesc->IsDirectory, filedesc->Node->Ino, &fi);
+
+    fsp_fuse_ll_dereference(f, filedesc->Node);
+
+    MemFree(filedesc->DirBuffer);
+    MemFree(filedesc->PosixPath);
+    MemFree(filedesc);
+}
+
+static NTSTATUS fsp_fuse_ll_Read(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FSCTL_TRANSACT_REQ *Request,
+    PVOID FileNode, PVOID Buffer, UINT64 Offset, ULONG Length,
+    PULONG PBytesTransferred)
+{
+    struct fuse *f = FileSystem->UserContext;
+    struct fsp_fuse_file_desc *filedesc =
+        (PVOID)(UINT_PTR)Request->Req.Read.UserContext2;
+    struct fuse_file_info fi;
+    struct fuse_req req;
+    NTSTATUS Result;
+
+    if (0 == f->llops.read)
+        return STATUS_INVALID_DEVICE_REQUEST;
+
+    memset(&fi, 0, sizeof fi);
+    fi.flags = filedesc->OpenFlags;
+    fi.fh = filedesc->FileHandle;
+
+    /* fuse_reply_buf and fuse_reply_data copy straight into the transact buffer */
+    fsp_fuse_ll_req_init(f, &req);
+    req.Buffer = Buffer;
+    req.Length = Length;
+    f->llops.read(&req, filedesc->Node->Ino, Length, Offset, &fi);
+
+    Result = fsp_fuse_ll_req_result(&req);
+    if (!NT_SUCCESS(Result))
+        return Result;
+
+    if (0 == req.BytesTransferred)
+        return STATUS_END_OF_FILE;
+
+    *PBytesTransferred = req.BytesTransferred;
+
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS fsp_fuse_ll_Write(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FSCTL_TRANSACT_REQ *Request,
+    PVOID FileNode, PVOID Buffer, UINT64 Offset, ULONG Length,
+    BOOLEAN WriteToEndOfFile, BOOLEAN ConstrainedIo,
+    PULONG PBytesTransferred, FSP_FSCTL_FILE_INFO *FileInfo)
+{
+    struct fuse *f = FileSystem->UserContext;
+    struct fsp_fuse_file_desc *filedesc =
+        (PVOID)(UINT_PTR)Request->Req.Write.UserContext2;
+    UINT32 Uid, Gid, Mode;
+    struct fuse_file_info fi;
+    struct fuse_req req;
+    struct fuse_bufvec srcv;
+    FSP_FSCTL_FILE_INFO FileInfoBuf;
+    UINT64 EndOffset, AllocationUnit;
+    NTSTATUS Result;
+
+    if (0 == f->llops.write && 0 == f->llops.write_buf)
+        return STATUS_INVALID_DEVICE_REQUEST;
+
+    memset(&fi, 0, sizeof fi);
+    fi.flags = filedesc->OpenFlags;
+    fi.fh = filedesc->FileHandle;
+
+    Result = fsp_fuse_ll_GetFileInfoEx(FileSystem, filedesc->Node->Ino, &fi,
+        &Uid, &Gid, &Mode, &FileInfoBuf);
+    if (!NT_SUCCESS(Result))
+        return Result;
+
+    if (ConstrainedIo)
+    {
+        if (Offset >= FileInfoBuf.FileSize)
+            goto success;
+        EndOffset = Offset + Length;
+        if (EndOffset > FileInfoBuf.FileSize)
+            EndOffset = FileInfoBuf.FileSize;
+    }
+    else
+    {
+        if (WriteToEndOfFile)
+            Offset = FileInfoBuf.FileSize;
+        EndOffset = Offset + Length;
+    }
+
+    fsp_fuse_ll_req_init(f, &req);
+    if (0 != f->llops.write_buf)
+    {
+        /* hand the transact buffer to the file system without copying it */
+        memset(&srcv, 0, sizeof srcv);
+        srcv.count = 1;
+        srcv.buf[0].size = (size_t)(EndOffset - Offset);
+        srcv.buf[0].mem = Buffer;
+        srcv.buf[0].fd = -1;
+
+        f->llops.write_buf(&req, filedesc->Node->Ino, &srcv, Offset, &fi);
+    }
+    else
+        f->llops.write(&req, filedesc->Node->Ino, Buffer, (size_t)(EndOffset - Offset), Offset, &fi);
+    Result = fsp_fuse_ll_req_result(&req);
+    if (!NT_SUCCESS(Result))
+        return Result;
+
+    *PBytesTransferred = req.BytesTransferred;
+
+    AllocationUnit = (UINT64)f->VolumeParams.SectorSize *
+        (UINT64)f->VolumeParams.SectorsPerAllocationUnit;
+    if (FileInfoBuf.FileSize < Offset + req.BytesTransferred)
+        FileInfoBuf.FileSize = Offset + req.BytesTransferred;
+    FileInfoBuf.AllocationSize =
+        (FileInfoBuf.FileSize + AllocationUnit - 1) / AllocationUnit * AllocationUnit;
+
+success:
+    memcpy(FileInfo, &FileInfoBuf, sizeof FileInfoBuf);
+
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS fsp_fuse_ll_Flush(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FSCTL_TRANSACT_REQ *Request,
+    PVOID FileNode)
+{
+    struct fuse *f = FileSystem->UserContext;
+    struct fsp_fuse_file_desc *filedesc =
+        (PVOID)(UINT_PTR)Request->Req.FlushBuffers.UserContext2;
+    struct fuse_file_info fi;
+    struct fuse_req req;
+    NTSTATUS Result;
+
+    if (0 == filedesc)
+        return STATUS_SUCCESS; /* FUSE cannot flush volumes */
+
+    memset(&fi, 0, sizeof fi);
+    fi.flags = filedesc->OpenFlags;
+    fi.fh = filedesc->FileHandle;
+
+    Result = STATUS_SUCCESS; /* just say success, if fs does not support fsync */
+    fsp_fuse_ll_req_init(f, &req);
+    if (filedesc->IsDirectory)
+    {
+        if (0 != f->llops.fsyncdir)
+        {
+            f->llops.fsyncdir(&req, filedesc->Node->Ino, 0, &fi);
+            Result = fsp_fuse_ll_req_result(&req);
+        }
+    }
+    else
+    {
+        if (0 != f->llops.fsync)
+        {
+            f->llops.fsync(&req, filedesc->Node->Ino, 0, &fi);
+            Result = fsp_fuse_ll_req_result(&req);
+        }
+    }
+
+    return Result;
+}
+
+static NTSTATUS fsp_fuse_ll_GetFileInfo(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FSCTL_TRANSACT_REQ *Request,
+    PVOID FileNode,
+    FSP_FSCTL_FILE_INFO *FileInfo)
+{
+    struct fsp_fuse_file_desc *filedesc =
+        (PVOID)(UINT_PTR)Request->Req.QueryInformation.UserContext2;
+    UINT32 Uid, Gid, Mode;
+    struct fuse_file_info fi;
+
+    memset(&fi, 0, sizeof fi);
+    fi.flags = filedesc->OpenFlags;
+    fi.fh = filedesc->FileHandle;
+
+    return fsp_fuse_ll_GetFileInfoEx(FileSystem, filedesc->Node->Ino, &fi,
+        &Uid, &Gid, &Mode, FileInfo);
+}
+
+static NTSTATUS fsp_fuse_ll_SetBasicInfo(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FSCTL_TRANSACT_REQ *Request,
+    PVOID FileNode, UINT32 FileAttributes,
+    UINT64 CreationTime, UINT64 LastAccessTime, UINT64 LastWriteTime,
+    FSP_FSCTL_FILE_INFO *FileInfo)
+{
+    struct fuse *f = FileSystem->UserContext;
+    struct fsp_fuse_file_desc *filedesc =
+        (PVOID)(UINT_PTR)Request->Req.SetInformation.UserContext2;
+    UINT32 Uid, Gid, Mode;
+    struct fuse_file_info fi;
+    struct fuse_stat attr, stbuf;
+    int to_set = 0;
+    NTSTATUS Result;
+
+    if (0 == f->llops.setattr)
+        return STATUS_SUCCESS; /* liar! */
+
+    /* no way to set FileAttributes, CreationTime! */
+    if (0 == LastAccessTime && 0 == LastWriteTime)
+        return STATUS_SUCCESS;
+
+    memset(&fi, 0, sizeof fi);
+    fi.flags = filedesc->OpenFlags;
+    fi.fh = filedesc->FileHandle;
+
+    /* UNIX epoch in 100-ns intervals */
+    memset(&attr, 0, sizeof attr);
+    if (0 != LastAccessTime)
+    {
+        LastAccessTime -= 116444736000000000;
+#if defined(_WIN64)
+        attr.st_atim.tv_sec = (int64_t)(LastAccessTime / 10000000);
+        attr.st_atim.tv_nsec = (int64_t)(LastAccessTime % 10000000) * 100;
+#else
+        attr.st_atim.tv_sec = (int32_t)(LastAccessTime / 10000000);
+        attr.st_atim.tv_nsec = (int32_t)(LastAccessTime % 10000000) * 100;
+#endif
+        to_set |= FUSE_SET_ATTR_ATIME;
+    }
+    if (0 != LastWriteTime)
+    {
+        LastWriteTime -= 116444736000000000;
+#if defined(_WIN64)
+        attr.st_mtim.tv_sec = (int64_t)(LastWriteTime / 10000000);
+        attr.st_mtim.tv_nsec = (int64_t)(LastWriteTime % 10000000) * 100;
+#else
+        attr.st_mtim.tv_sec = (int32_t)(LastWriteTime / 10000000);
+        attr.st_mtim.tv_nsec = (int32_t)(LastWriteTime % 10000000) * 100;
+#endif
+        to_set |= FUSE_SET_ATTR_MTIME;
+    }
+
+    Result = fsp_fuse_ll_setattr(f, filedesc->Node->Ino, &attr, to_set, &fi, &stbuf);
+    if (!NT_SUCCESS(Result))
+        return Result;
+
+    fsp_fuse_intf_GetFileInfoFromStat(f, &stbuf, &Uid, &Gid, &Mode, FileInfo);
+
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS fsp_fuse_ll_SetFileSize(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FSCTL_TRANSACT_REQ *Request,
+    PVOID FileNode, UINT64 NewSize, BOOLEAN SetAllocationSize,
+    FSP_FSCTL_FILE_INFO *FileInfo)
+{
+    struct fuse *f = FileSystem->UserContext;
+    struct fsp_fuse_file_desc *filedesc =
+        (PVOID)(UINT_PTR)Request->Req.SetInformation.UserContext2;
+    UINT32 Uid, Gid, Mode;
+    struct fuse_file_info fi;
+    struct fuse_stat attr, stbuf;
+    FSP_FSCTL_FILE_INFO FileInfoBuf;
+    NTSTATUS Result;
+
+    if (0 == f->llops.setattr)
+        return STATUS_INVALID_DEVICE_REQUEST;
+
+    memset(&fi, 0, sizeof fi);
+    fi.flags = filedesc->OpenFlags;
+    fi.fh = filedesc->FileHandle;
+
+    Result = fsp_fuse_ll_GetFileInfoEx(FileSystem, filedesc->Node->Ino, &fi,
+        &Uid, &Gid, &Mode, &FileInfoBuf);
+    if (!NT_SUCCESS(Result))
+        return Result;
+
+    if (!SetAllocationSize || FileInfoBuf.FileSize > NewSize)
+    {
+        /* see fsp_fuse_intf_SetFileSize */
+        memset(&attr, 0, sizeof attr);
+        attr.st_size = NewSize;
+        Result = fsp_fuse_ll_setattr(f, filedesc->Node->Ino,
+            &attr, FUSE_SET_ATTR_SIZE, &fi, &stbuf);
+        if (!NT_SUCCESS(Result))
+            return Result;
+
+        fsp_fuse_intf_GetFileInfoFromStat(f, &stbuf, &Uid, &Gid, &Mode, &FileInfoBuf);
+    }
+
+    memcpy(FileInfo, &FileInfoBuf, sizeof FileInfoBuf);
+
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS fsp_fuse_ll_readdir(struct fuse *f, struct fsp_fuse_file_desc *filedesc,
+    PVOID *PBuffer, PULONG PSize)
+{
+    struct fuse_file_info fi;
+    struct fuse_req req;
+    struct fsp_fuse_dirinfo *di;
+    PUINT8 Buffer = 0, NewBuffer, diend;
+    ULONG Length = 0, Size = 0, NewLength;
+    fuse_off_t Offset = 0, NextOffset;
+    NTSTATUS Result;
+
+    /*
+     * Read the whole directory: ask for more entries starting at the offset of the
+     * last entry received until the file system has no more. The offsets are then
+     * replaced by buffer offsets, as fsp_fuse_intf_ReadDirectory expects.
+     */
+
+    if (0 == f->llops.readdir)
+        return STATUS_INVALID_DEVICE_REQUEST;
+
+    memset(&fi, 0, sizeof fi);
+    fi.flags = filedesc->OpenFlags;
+    fi.fh = filedesc->FileHandle;
+
+    for (;;)
+    {
+        if (Length - Size < 16 * 1024)
+        {
+            NewLength = 0 == Length ? 16 * 1024 : Length * 2;
+            if (NewLength > 16 * 1024 * 1024)
+                break;
+
+            NewBuffer = MemAlloc(NewLength);
+            if (0 == NewBuffer)
+            {
+                Result = STATUS_INSUFFICIENT_RESOURCES;
+                goto exit;
+            }
+
+            if (0 != Size)
+                memcpy(NewBuffer, Buffer, Size);
+            MemFree(Buffer);
+
+            Buffer = NewBuffer;
+            Length = NewLength;
+        }
+
+        fsp_fuse_ll_req_init(f, &req);
+        req.Buffer = Buffer + Size;
+        req.Length = Length - Size;
+        f->llops.readdir(&req, filedesc->Node->Ino, req.Length, Offset, &fi);
+        Result = fsp_fuse_ll_req_result(&req);
+        if (!NT_SUCCESS(Result))
+            goto exit;
+
+        if (0 == req.BytesTransferred)
+            break;
+
+        NextOffset = 0;
+        diend = Buffer + Size + req.BytesTransferred;
+        for (di = (PVOID)(Buffer + Size);
+            (PUINT8)di + sizeof(struct fsp_fuse_dirinfo) <= diend &&
+                sizeof(struct fsp_fuse_dirinfo) <= di->Size &&
+                (PUINT8)di + FSP_FSCTL_DEFAULT_ALIGN_UP(di->Size) <= diend;
+            di = (PVOID)((PUINT8)di + FSP_FSCTL_DEFAULT_ALIGN_UP(di->Size)))
+        {
+            NextOffset = di->NextOffset;
+            di->NextOffset = (PUINT8)di + FSP_FSCTL_DEFAULT_ALIGN_UP(di->Size) - Buffer;
+        }
+        Size = (ULONG)((PUINT8)di - Buffer);
+
+        if (0 == NextOffset || Offset == NextOffset)
+            break;
+        Offset = NextOffset;
+    }
+
+    *PBuffer = Buffer;
+    *PSize = Size;
+    Buffer = 0;
+
+    Result = STATUS_SUCCESS;
+
+exit:
+    MemFree(Buffer);
+
+    return Result;
+}
+
+static NTSTATUS fsp_fuse_ll_CanDelete(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FSCTL_TRANSACT_REQ *Request,
+    PVOID FileNode, PWSTR FileName)
+{
+    struct fuse *f = FileSystem->UserContext;
+    struct fsp_fuse_file_desc *filedesc =
+        (PVOID)(UINT_PTR)Request->Req.SetInformation.UserContext2;
+    struct fsp_fuse_dirinfo *di;
+    PVOID Buffer = 0;
+    ULONG Size = 0;
+    PUINT8 diend;
+    NTSTATUS Result;
+
+    if (!filedesc->IsDirectory)
+        return STATUS_SUCCESS;
+
+    /* check that directory is empty! */
+
+    Result = fsp_fuse_ll_readdir(f, filedesc, &Buffer, &Size);
+    if (STATUS_INVALID_DEVICE_REQUEST == Result)
+        return STATUS_SUCCESS;
+    if (!NT_SUCCESS(Result))
+        return Result;
+
+    diend = (PUINT8)Buffer + Size;
+    for (di = Buffer;
+        (PUINT8)di < diend;
+        di = (PVOID)((PUINT8)di + FSP_FSCTL_DEFAULT_ALIGN_UP(di->Size)))
+    {
+        if ('.' == di->PosixNameBuf[0] && ('\0' == di->PosixNameBuf[1] ||
+            ('.' == di->PosixNameBuf[1] && '\0' == di->PosixNameBuf[2])))
+            continue;
+
+        Result = STATUS_DIRECTORY_NOT_EMPTY;
+        break;
+    }
+
+    MemFree(Buffer);
+
+    return Result;
+}
+
+static NTSTATUS fsp_fuse_ll_Rename(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FSCTL_TRANSACT_REQ *Request,
+    PVOID FileNode,
+    PWSTR FileName, PWSTR NewFileName, BOOLEAN ReplaceIfExists)
+{
+    struct fuse *f = FileSystem->UserContext;
+    struct fuse_context *context = fsp_fuse_get_context(f->env);
+    struct fsp_fuse_context_header *contexthdr = FSP_FUSE_HDR_FROM_CONTEXT(context);
+    struct fsp_fuse_file_desc *filedesc =
+        (PVOID)(UINT_PTR)Request->Req.SetInformation.UserContext2;
+    struct fsp_fuse_ll_lookup_context Context;
+    UINT32 Uid, Gid, Mode;
+    FSP_FSCTL_FILE_INFO FileInfoBuf;
+    struct fuse_req req;
+    FSP_NODE_TABLE_NODE *Node = 0, *Parent = 0, *NewParent = 0;
+    const char *Name, *NewName;
+    char *PosixPath;
+    NTSTATUS Result;
+
+    if (0 == f->llops.rename)
+        return STATUS_INVALID_DEVICE_REQUEST;
+
+    Result = fsp_fuse_ll_resolve(f, contexthdr->PosixPath, FALSE, &Context, &Node, 0);
+    if (NT_SUCCESS(Result))
+    {
+        Result = fsp_fuse_ll_GetFileInfoResolved(FileSystem, &Context, Node,
+            &Uid, &Gid, &Mode, &FileInfoBuf);
+        fsp_fuse_ll_dereference(f, Node);
+    }
+    if (!NT_SUCCESS(Result) &&
+        STATUS_OBJECT_NAME_NOT_FOUND != Result &&
+        STATUS_OBJECT_PATH_NOT_FOUND != Result)
+        return Result;
+
+    if (NT_SUCCESS(Result))
+    {
+        if (!ReplaceIfExists)
+            return STATUS_OBJECT_NAME_COLLISION;
+
+        if (FileInfoBuf.FileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+            return STATUS_ACCESS_DENIED;
+    }
+
+    Result = fsp_fuse_ll_resolve(f, filedesc->PosixPath, TRUE, &Context, &Parent, &Name);
+    if (!NT_SUCCESS(Result))
+        goto exit;
+
+    Result = fsp_fuse_ll_resolve(f, contexthdr->PosixPath, TRUE, &Context, &NewParent, &NewName);
+    if (!NT_SUCCESS(Result))
+        goto exit;
+
+    fsp_fuse_ll_req_init(f, &req);
+    f->llops.rename(&req, Parent->Ino, Name, NewParent->Ino, NewName);
+    Result = fsp_fuse_ll_req_result(&req);
+    if (!NT_SUCCESS(Result))
+        goto exit;
+
+    /*
+     * Both names are gone from the table; the renamed node keeps its node ID and the
+     * entries of its children (which are keyed by node ID rather than path) remain valid.
+     */
+    fsp_fuse_ll_unbind(f, Parent, Name);
+    fsp_fuse_ll_unbind(f, NewParent, NewName);
+
+    /* the open file now has the new path; the old one is freed on leaving the operation */
+    PosixPath = filedesc->PosixPath;
+    filedesc->PosixPath = contexthdr->PosixPath;
+    contexthdr->PosixPath = PosixPath;
+
+    Result = STATUS_SUCCESS;
+
+exit:
+    if (0 != NewParent)
+        fsp_fuse_ll_dereference(f, NewParent);
+
+    if (0 != Parent)
+        fsp_fuse_ll_dereference(f, Parent);
+
+    return Result;
+}
+
+static NTSTATUS fsp_fuse_ll_GetSecurity(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FSCTL_TRANSACT_REQ *Request,
+    PVOID FileNode,
+    PSECURITY_DESCRIPTOR SecurityDescriptorBuf, SIZE_T *PSecurityDescriptorSize)
+{
+    struct fsp_fuse_file_desc *filedesc =
+        (PVOID)(UINT_PTR)Request->Req.QuerySecurity.UserContext2;
+    struct fuse_file_info fi;
+    UINT32 Uid, Gid, Mode;
+    FSP_FSCTL_FILE_INFO FileInfo;
+    NTSTATUS Result;
+
+    memset(&fi, 0, sizeof fi);
+    fi.flags = filedesc->OpenFlags;
+    fi.fh = filedesc->FileHandle;
+
+    Result = fsp_fuse_ll_GetFileInfoEx(FileSystem, filedesc->Node->Ino, &fi,
+        &Uid, &Gid, &Mode, &FileInfo);
+    if (!NT_SUCCESS(Result))
+        return Result;
+
+    return fsp_fuse_intf_GetSecurityFromPermissions(Uid, Gid, Mode,
+        SecurityDescriptorBuf, PSecurityDescriptorSize);
+}
+
+static NTSTATUS fsp_fuse_ll_SetSecurity(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FSCTL_TRANSACT_REQ *Request,
+    PVOID FileNode,
+    SECURITY_INFORMATION SecurityInformation, PSECURITY_DESCRIPTOR Ignored)
+{
+    struct fuse *f = FileSystem->UserContext;
+    struct fsp_fuse_file_desc *filedesc =
+        (PVOID)(UINT_PTR)Request->Req.SetSecurity.UserContext2;
+    struct fuse_file_info fi;
+    UINT32 Uid, Gid, Mode, NewUid, NewGid, NewMode;
+    FSP_FSCTL_FILE_INFO FileInfo;
+    PSECURITY_DESCRIPTOR SecurityDescriptor = 0, NewSecurityDescriptor = 0;
+    struct fuse_stat attr, stbuf;
+    NTSTATUS Result;
+
+    if (0 == f->llops.setattr)
+        return STATUS_INVALID_DEVICE_REQUEST;
+
+    memset(&fi, 0, sizeof fi);
+    fi.flags = filedesc->OpenFlags;
+    fi.fh = filedesc->FileHandle;
+
+    Result = fsp_fuse_ll_GetFileInfoEx(FileSystem, filedesc->Node->Ino, &fi,
+        &Uid, &Gid, &Mode, &FileInfo);
+    if (!NT_SUCCESS(Result))
+        goto exit;
+
+    Result = FspPosixMapPermissionsToSecurityDescriptor(Uid, Gid, Mode, &SecurityDescriptor);
+    if (!NT_SUCCESS(Result))
+        goto exit;
+
+    Result = FspSetSecurityDescriptor(FileSystem, Request, SecurityDescriptor,
+        &NewSecurityDescriptor);
+    if (!NT_SUCCESS(Result))
+        goto exit;
+
+    Result = FspPosixMapSecurityDescriptorToPermissions(NewSecurityDescriptor,
+        &NewUid, &NewGid, &NewMode);
+    if (!NT_SUCCESS(Result))
+        goto exit;
+
+    memset(&attr, 0, sizeof attr);
+    attr.st_mode = NewMode;
+    attr.st_uid = NewUid;
+    attr.st_gid = NewGid;
+
+    if (NewMode != Mode)
+    {
+        Result = fsp_fuse_ll_setattr(f, filedesc->Node->Ino,
+            &attr, FUSE_SET_ATTR_MODE, &fi, &stbuf);
+        if (!NT_SUCCESS(Result))
+            goto exit;
+    }
+
+    if (NewUid != Uid || NewGid != Gid)
+    {
+        Result = fsp_fuse_ll_setattr(f, filedesc->Node->Ino,
+            &attr, FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID, &fi, &stbuf);
+        if (!NT_SUCCESS(Result))
+            goto exit;
+    }
+
+    Result = STATUS_SUCCESS;
+
+exit:
+    if (0 != NewSecurityDescriptor)
+        FspDeleteSecurityDescriptor(NewSecurityDescriptor,
+            FspSetSecurityDescriptor);
+
+    if (0 != SecurityDescriptor)
+        FspDeleteSecurityDescriptor(SecurityDescriptor,
+            FspPosixMapPermissionsToSecurityDescriptor);
+
+    return Result;
+}
+
+static NTSTATUS fsp_fuse_ll_GetDirInfo(FSP_FILE_SYSTEM *FileSystem,
+    struct fsp_fuse_file_desc *filedesc, struct fsp_fuse_dirinfo *di,
+    FSP_NODE_TABLE_NODE **PDotDot)
+{
+    struct fuse *f = FileSystem->UserContext;
+    struct fsp_fuse_ll_lookup_context Context;
+    FSP_NODE_TABLE_ENTRY *Entry;
+    FSP_NODE_TABLE_NODE *Node;
+    const char *Name;
+    ULONG NameLength;
+    fuse_ino_t ino;
+    UINT32 Uid, Gid, Mode;
+    NTSTATUS Result;
+
+    if ('.' == di->PosixNameBuf[0] && '\0' == di->PosixNameBuf[1])
+        ino = filedesc->Node->Ino;
+    else
+    if ('.' == di->PosixNameBuf[0] && '.' == di->PosixNameBuf[1] && '\0' == di->PosixNameBuf[2])
+    {
+        if (0 == *PDotDot)
+        {
+            Result = fsp_fuse_ll_resolve(f, filedesc->PosixPath, TRUE, &Context, PDotDot, &Name);
+            if (!NT_SUCCESS(Result))
+                return Result;
+        }
+        ino = (*PDotDot)->Ino;
+    }
+    else
+    {
+        /* a name in the table is a getattr; a name that is not is a lookup (with attributes) */
+        memset(&Context, 0, sizeof Context);
+        Context.f = f;
+        NameLength = lstrlenA(di->PosixNameBuf);
+
+        fsp_fuse_ll_lock(f);
+        Entry = FspNodeTableLookup(f->NodeTable, filedesc->Node, di->PosixNameBuf, NameLength);
+        if (0 != Entry)
+        {
+            ino = Entry->Node->Ino;
+            Result = STATUS_SUCCESS;
+        }
+        else
+        {
+            ino = 0;
+            Result = fsp_fuse_ll_lookup(&Context, filedesc->Node,
+                di->PosixNameBuf, NameLength, &Node);
+        }
+        fsp_fuse_ll_unlock(f);
+        if (!NT_SUCCESS(Result))
+            return Result;
+
+        if (0 == ino)
+        {
+            fsp_fuse_intf_GetFileInfoFromStat(f, &Context.attr, &Uid, &Gid, &Mode, &di->FileInfo);
+            return STATUS_SUCCESS;
+        }
+    }
+
+    return fsp_fuse_ll_GetFileInfoEx(FileSystem, ino, 0, &Uid, &Gid, &Mode, &di->FileInfo);
+}
+
+static NTSTATUS fsp_fuse_ll_ReadDirectory(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FSCTL_TRANSACT_REQ *Request,
+    PVOID FileNode, PVOID Buffer, UINT64 Offset, ULONG Length,
+    PWSTR Pattern,
+    PULONG PBytesTransferred)
+{
+    struct fuse *f = FileSystem->UserContext;
+    struct fsp_fuse_file_desc *filedesc =
+        (PVOID)(UINT_PTR)Request->Req.QueryDirectory.UserContext2;
+    struct fsp_fuse_dirinfo *di;
+    PUINT8 diend;
+    FSP_NODE_TABLE_NODE *DotDot = 0;
+    BOOLEAN Added;
+    NTSTATUS Result;
+
+    if (0 == filedesc->DirBuffer)
+    {
+        Result = fsp_fuse_ll_readdir(f, filedesc, &filedesc->DirBuffer, &filedesc->DirBufferSize);
+        if (!NT_SUCCESS(Result))
+            goto exit;
+    }
+
+    di = (PVOID)((PUINT8)filedesc->DirBuffer + Offset);
+    diend = (PUINT8)filedesc->DirBuffer + filedesc->DirBufferSize;
+
+    for (;
+        (PUINT8)di + sizeof(di->Size) <= diend;
+        di = (PVOID)((PUINT8)di + FSP_FSCTL_DEFAULT_ALIGN_UP(di->Size)))
+    {
+        if (sizeof(struct fsp_fuse_dirinfo) > di->Size)
+            break;
+
+        if (!di->FileInfoValid)
+        {
+            Result = fsp_fuse_ll_GetDirInfo(FileSystem, filedesc, di, &DotDot);
+            if (!NT_SUCCESS(Result))
+                goto exit;
+
+            di->FileInfoValid = TRUE;
+        }
+
+        Result = fsp_fuse_intf_AddFileDirInfo(di, Buffer, Length, PBytesTransferred, &Added);
+        if (!NT_SUCCESS(Result))
+            goto exit;
+        if (!Added)
+            break;
+    }
+
+    if ((PUINT8)di + sizeof(di->Size) > diend)
+        FspFileSystemAddDirInfo(0, Buffer, Length, PBytesTransferred);
+
+    Result = STATUS_SUCCESS;
+
+exit:
+    if (0 != DotDot)
+        fsp_fuse_ll_dereference(f, DotDot);
+
+    return Result;
+}
+
+FSP_FILE_SYSTEM_INTERFACE fsp_fuse_ll_intf =
+{
+    fsp_fuse_ll_GetVolumeInfo,
+    fsp_fuse_ll_SetVolumeLabel,
+    fsp_fuse_ll_GetSecurityByName,
+    fsp_fuse_ll_Create,
+    fsp_fuse_ll_Open,
+    fsp_fuse_ll_Overwrite,
+    fsp_fuse_ll_Cleanup,
+    fsp_fuse_ll_Close,
+    fsp_fuse_ll_Read,
+    fsp_fuse_ll_Write,
+    fsp_fuse_ll_Flush,
+    fsp_fuse_ll_GetFileInfo,
+    fsp_fuse_ll_SetBasicInfo,
+    fsp_fuse_ll_SetFileSize,
+    fsp_fuse_ll_CanDelete,
+    fsp_fuse_ll_Rename,
+    fsp_fuse_ll_GetSecurity,
+    fsp_fuse_ll_SetSecurity,
+    fsp_fuse_ll_ReadDirectory,
+};
@@ -20,7 +20,9 @@
 
 #include <dll/library.h>
 #include <fuse/fuse.h>
+#include <fuse/fuse_lowlevel.h>
 #include <fuse/fuse_opt.h>
+#include <shared/nodetab.h>
 
 #define FSP_FUSE_LIBRARY_NAME           LIBRARY_NAME "-FUSE"
 
@@ -35,9 +37,18 @@ struct fuse
     int set_umask, umask;
     int set_uid, uid;
     int set_gid, gid;
+    int readdir_plus;
+    int ReaddirPrefetch;
+    struct fsp_fuse_cache *cache;
     struct fuse_operations ops;
     void *data;
+    int lowlevel;
+    struct fuse_lowlevel_ops llops;
+    FSP_NODE_TABLE *NodeTable;          /* lowlevel only */
+    SRWLOCK NodeLock;
     UINT32 DebugLog;
+    ULONG ThreadCount;
+    int set_OpGuardStrategy;
     FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY OpGuardStrategy;
     FSP_FSCTL_VOLUME_PARAMS VolumeParams;
     PWSTR MountPoint;
@@ -62,10 +73,26 @@ struct fsp_fuse_file_desc
     UINT64 FileHandle;
     PVOID DirBuffer;
     ULONG DirBufferSize;
+    FSP_NODE_TABLE_NODE *Node;          /* lowlevel only; referenced */
+};
+
+struct fuse_req
+{
+    struct fuse *f;
+    struct fuse_ctx ctx;
+    int replied, err;
+    struct fuse_entry_param *entry;     /* fuse_reply_entry, fuse_reply_create */
+    struct fuse_stat *attr;             /* fuse_reply_attr */
+    struct fuse_file_info *fi;          /* fuse_reply_open, fuse_reply_create */
+    struct fuse_statvfs *stbuf;         /* fuse_reply_statfs */
+    PVOID Buffer;                       /* fuse_reply_buf, fuse_reply_readlink */
+    ULONG Length;
+    ULONG BytesTransferred;             /* also fuse_reply_write */
 };
 
 struct fuse_dirhandle
 {
+    struct fuse *f;                     /* non-0 if filler stat data is authoritative */
     PVOID Buffer;
     ULONG Length;
     ULONG BytesTransferred;
@@ -88,5 +115,39 @@ NTSTATUS fsp_fuse_op_leave(FSP_FILE_SYSTEM *FileSystem,
     FSP_FSCTL_TRANSACT_REQ *Request, FSP_FSCTL_TRANSACT_RSP *Response);
 
 extern FSP_FILE_SYSTEM_INTERFACE fsp_fuse_intf;
+extern FSP_FILE_SYSTEM_INTERFACE fsp_fuse_ll_intf;
+
+VOID fsp_fuse_intf_GetFileInfoFromStat(struct fuse *f,
+    const struct fuse_stat *stbuf0,
+    PUINT32 PUid, PUINT32 PGid, PUINT32 PMode,
+    FSP_FSCTL_FILE_INFO *FileInfo);
+NTSTATUS fsp_fuse_intf_GetSecurityFromPermissions(UINT32 Uid, UINT32 Gid, UINT32 Mode,
+    PSECURITY_DESCRIPTOR SecurityDescriptorBuf, SIZE_T *PSecurityDescriptorSize);
+NTSTATUS fsp_fuse_intf_AddFileDirInfo(struct fsp_fuse_dirinfo *di,
+    PVOID Buffer, ULONG Length, PULONG PBytesTransferred, PBOOLEAN PAdded);
+
+NTSTATUS fsp_fuse_ll_statfs(struct fuse *f, struct fuse_statvfs *stbuf);
+NTSTATUS fsp_fuse_ll_getattr(struct fuse *f, fuse_ino_t ino, struct fuse_file_info *fi,
+    struct fuse_stat *stbuf);
+VOID fsp_fuse_ll_delete_nodes(struct fuse *f);
+
+VOID fsp_fuse_buf_free(struct fsp_fuse_env *env, struct fuse_bufvec *bufv);
+
+NTSTATUS fsp_fuse_cache_create(UINT32 AttrTimeout, UINT32 EntryTimeout, UINT32 NegativeTimeout,
+    struct fsp_fuse_cache **pcache);
+VOID fsp_fuse_cache_delete(struct fsp_fuse_cache *cache);
+BOOLEAN fsp_fuse_cache_lookup(struct fsp_fuse_cache *cache,
+    const char *PosixPath, BOOLEAN IsOpen, PUINT64 PToken,
+    NTSTATUS *PResult, PUINT32 PUid, PUINT32 PGid, PUINT32 PMode,
+    FSP_FSCTL_FILE_INFO *FileInfo);
+VOID fsp_fuse_cache_insert(struct fsp_fuse_cache *cache,
+    const char *PosixPath, UINT64 Token,
+    NTSTATUS Result, UINT32 Uid, UINT32 Gid, UINT32 Mode,
+    FSP_FSCTL_FILE_INFO *FileInfo);
+VOID fsp_fuse_cache_update_size(struct fsp_fuse_cache *cache,
+    const char *PosixPath, UINT64 FileSize, UINT64 AllocationSize);
+VOID fsp_fuse_cache_invalidate(struct fsp_fuse_cache *cache,
+    const char *PosixPath, BOOLEAN Parent);
+VOID fsp_fuse_cache_invalidate_all(struct fsp_fuse_cache *cache);
 
 #endif
@@ -51,6 +51,26 @@ NTSTATUS FspEventLogUnregister(VOID);
 
 PWSTR FspDiagIdent(VOID);
 
+UINT64 FspFileSystemStatisticsTimestamp(VOID);
+VOID FspFileSystemStatisticsAddOperation(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FSCTL_TRANSACT_REQ *Request, FSP_FSCTL_TRANSACT_RSP *Response, UINT64 Timestamp);
+VOID FspFileSystemStatisticsAddTransact(FSP_FILE_SYSTEM *FileSystem,
+    NTSTATUS Result, SIZE_T RequestBufSize, UINT64 Timestamp);
+VOID FspFileSystemStatisticsFinalize(FSP_FILE_SYSTEM *FileSystem);
+VOID FspFileSystemTraceAdd(FSP_FILE_SYSTEM *FileSystem,
+    UINT16 Kind, PVOID Data, ULONG Size);
+VOID FspFileSystemTraceFinalize(FSP_FILE_SYSTEM *FileSystem);
+NTSTATUS FspFileSystemSecurityCacheLookup(FSP_FILE_SYSTEM *FileSystem,
+    PWSTR FileName, PUINT32 PFileAttributes,
+    PSECURITY_DESCRIPTOR SecurityDescriptor, SIZE_T *PSecurityDescriptorSize,
+    PUINT64 PGeneration);
+VOID FspFileSystemSecurityCacheInsert(FSP_FILE_SYSTEM *FileSystem,
+    PWSTR FileName, UINT64 Generation, UINT32 FileAttributes,
+    PSECURITY_DESCRIPTOR SecurityDescriptor, SIZE_T SecurityDescriptorSize);
+VOID FspFileSystemSecurityCacheFinalize(FSP_FILE_SYSTEM *FileSystem);
+BOOLEAN FspFileSystemDispatchRequest(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FSCTL_TRANSACT_REQ *Request, FSP_FSCTL_TRANSACT_RSP *Response);
+
 BOOL WINAPI FspServiceConsoleCtrlHandler(DWORD CtrlType);
 
 #endif
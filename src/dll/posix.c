@@ -53,6 +53,109 @@ static PISID FspAccountDomainSid, FspPrimaryDomainSid;
 #define FspUnmappedSid                  (&FspUnmappedSidBuf.V)
 #define FspUnmappedUid                  (65534)
 
+/*
+ * Mapping cache
+ *
+ * The SID to UID and the permissions to security descriptor mappings are pure
+ * functions (once the domain SIDs have been initialized). However they are used
+ * on every FUSE Create and GetSecurity request, so we remember their results.
+ *
+ * A cache is a fixed array of slots that point to immutable entries. A slot is
+ * filled at most once (using an interlocked compare exchange) and its entry is
+ * never replaced or freed while the DLL is loaded. Thus lookups need no locks or
+ * interlocked operations. The size of a cache is bounded by its slot count; when
+ * all the slots in the probe sequence of a key are taken the mapping is simply
+ * computed every time.
+ */
+#define FspPosixCacheProbeCount         8
+
+typedef struct
+{
+    UINT32 Hash;
+    ULONG KeySize, ValueSize;
+    UINT32 Buffer[];                    /* key followed by value; keys are DWORD multiples */
+} FSP_POSIX_CACHE_ENTRY;
+
+static FSP_POSIX_CACHE_ENTRY *volatile FspPosixSidToUidCache[256];
+static FSP_POSIX_CACHE_ENTRY *volatile FspPosixPermissionsCache[1024];
+
+static inline UINT32 FspPosixCacheHash(const VOID *Key, ULONG KeySize)
+{
+    /* FNV-1a */
+    UINT32 Hash = 2166136261;
+    for (const UINT8 *P = Key, *EndP = P + KeySize; EndP > P; P++)
+        Hash = (Hash ^ *P) * 16777619;
+    return Hash;
+}
+
+static inline BOOLEAN FspPosixCacheEntryMatch(FSP_POSIX_CACHE_ENTRY *Entry,
+    UINT32 Hash, const VOID *Key, ULONG KeySize)
+{
+    return Entry->Hash == Hash && Entry->KeySize == KeySize &&
+        0 == memcmp(Entry->Buffer, Key, KeySize);
+}
+
+static PVOID FspPosixCacheLookup(FSP_POSIX_CACHE_ENTRY *volatile *Cache, ULONG SlotCount,
+    const VOID *Key, ULONG KeySize, PULONG PValueSize)
+{
+    UINT32 Hash = FspPosixCacheHash(Key, KeySize);
+    FSP_POSIX_CACHE_ENTRY *Entry;
+
+    for (ULONG Index = 0; FspPosixCacheProbeCount > Index; Index++)
+    {
+        /* an entry is fully initialized before it is published; reads depend on the slot read */
+        Entry = Cache[(Hash + Index) & (SlotCount - 1)];
+        if (0 == Entry)
+            break;
+        if (FspPosixCacheEntryMatch(Entry, Hash, Key, KeySize))
+        {
+            if (0 != PValueSize)
+                *PValueSize = Entry->ValueSize;
+            return (PUINT8)Entry->Buffer + KeySize;
+        }
+    }
+
+    return 0;
+}
+
+static VOID FspPosixCacheInsert(FSP_POSIX_CACHE_ENTRY *volatile *Cache, ULONG SlotCount,
+    const VOID *Key, ULONG KeySize, const VOID *Value, ULONG ValueSize)
+{
+    UINT32 Hash = FspPosixCacheHash(Key, KeySize);
+    FSP_POSIX_CACHE_ENTRY *Entry, *SlotEntry;
+
+    Entry = MemAlloc(sizeof *Entry + KeySize + ValueSize);
+    if (0 == Entry)
+        return;
+
+    Entry->Hash = Hash;
+    Entry->KeySize = KeySize;
+    Entry->ValueSize = ValueSize;
+    memcpy(Entry->Buffer, Key, KeySize);
+    memcpy((PUINT8)Entry->Buffer + KeySize, Value, ValueSize);
+
+    for (ULONG Index = 0; FspPosixCacheProbeCount > Index; Index++)
+    {
+        SlotEntry = InterlockedCompareExchangePointer(
+            (PVOID volatile *)&Cache[(Hash + Index) & (SlotCount - 1)], Entry, 0);
+        if (0 == SlotEntry)
+            return;
+        if (FspPosixCacheEntryMatch(SlotEntry, Hash, Key, KeySize))
+            break; /* another thread inserted the same mapping */
+    }
+
+    MemFree(Entry);
+}
+
+static VOID FspPosixCacheFinalize(FSP_POSIX_CACHE_ENTRY *volatile *Cache, ULONG SlotCount)
+{
+    for (ULONG Index = 0; SlotCount > Index; Index++)
+    {
+        MemFree(Cache[Index]);
+        Cache[Index] = 0;
+    }
+}
+
 static BOOL WINAPI FspPosixInitialize(
     PINIT_ONCE InitOnce, PVOID Parameter, PVOID *Context)
 {
@@ -112,6 +215,11 @@ VOID FspPosixFinalize(BOOLEAN Dynamic)
 
     if (Dynamic)
     {
+        FspPosixCacheFinalize(FspPosixPermissionsCache,
+            sizeof FspPosixPermissionsCache / sizeof FspPosixPermissionsCache[0]);
+        FspPosixCacheFinalize(FspPosixSidToUidCache,
+            sizeof FspPosixSidToUidCache / sizeof FspPosixSidToUidCache[0]);
+
         MemFree(FspAccountDomainSid);
         MemFree(FspPrimaryDomainSid);
     }
@@ -239,12 +347,23 @@ FSP_API NTSTATUS FspPosixMapSidToUid(PSID Sid, PUINT32 PUid)
     BYTE Authority;
     BYTE Count;
     UINT32 SubAuthority0, Rid;
+    ULONG SidSize;
+    PUINT32 PCachedUid;
 
     *PUid = -1;
 
     if (!IsValidSid(Sid) || 0 == (Count = *GetSidSubAuthorityCount(Sid)))
         return STATUS_INVALID_SID;
 
+    SidSize = GetLengthSid(Sid);
+    PCachedUid = FspPosixCacheLookup(FspPosixSidToUidCache,
+        sizeof FspPosixSidToUidCache / sizeof FspPosixSidToUidCache[0], Sid, SidSize, 0);
+    if (0 != PCachedUid)
+    {
+        *PUid = *PCachedUid;
+        return STATUS_SUCCESS;
+    }
+
     Authority = GetSidIdentifierAuthority(Sid)->Value[5];
     SubAuthority0 = 2 <= Count ? *GetSidSubAuthority(Sid, 0) : 0;
     Rid = *GetSidSubAuthority(Sid, Count - 1);
@@ -339,6 +458,10 @@ FSP_API NTSTATUS FspPosixMapSidToUid(PSID Sid, PUINT32 PUid)
     if (-1 == *PUid)
         *PUid = FspUnmappedUid;
 
+    FspPosixCacheInsert(FspPosixSidToUidCache,
+        sizeof FspPosixSidToUidCache / sizeof FspPosixSidToUidCache[0],
+        Sid, SidSize, PUid, sizeof *PUid);
+
     return STATUS_SUCCESS;
 }
 
@@ -440,11 +563,32 @@ FSP_API NTSTATUS FspPosixMapPermissionsToSecurityDescriptor(
     PACL Acl = 0;
     SECURITY_DESCRIPTOR SecurityDescriptor;
     PSECURITY_DESCRIPTOR RelativeSecurityDescriptor = 0;
+    PSECURITY_DESCRIPTOR CachedSecurityDescriptor;
+    UINT32 Key[3];
     ULONG Size;
     NTSTATUS Result;
 
     *PSecurityDescriptor = 0;
 
+    /* only the permission, sticky and directory bits of Mode are used */
+    Key[0] = Uid;
+    Key[1] = Gid;
+    Key[2] = Mode & 0041777;
+    CachedSecurityDescriptor = FspPosixCacheLookup(FspPosixPermissionsCache,
+        sizeof FspPosixPermissionsCache / sizeof FspPosixPermissionsCache[0],
+        Key, sizeof Key, &Size);
+    if (0 != CachedSecurityDescriptor)
+    {
+        RelativeSecurityDescriptor = MemAlloc(Size);
+        if (0 == RelativeSecurityDescriptor)
+            return STATUS_INSUFFICIENT_RESOURCES;
+
+        memcpy(RelativeSecurityDescriptor, CachedSecurityDescriptor, Size);
+        *PSecurityDescriptor = RelativeSecurityDescriptor;
+
+        return STATUS_SUCCESS;
+    }
+
     Result = FspPosixMapUidToSid(Uid, &OwnerSid);
     if (!NT_SUCCESS(Result))
         goto exit;
@@ -569,6 +713,10 @@ FSP_API NTSTATUS FspPosixMapPermissionsToSecurityDescriptor(
     if (!MakeSelfRelativeSD(&SecurityDescriptor, RelativeSecurityDescriptor, &Size))
         goto lasterror;
 
+    FspPosixCacheInsert(FspPosixPermissionsCache,
+        sizeof FspPosixPermissionsCache / sizeof FspPosixPermissionsCache[0],
+        Key, sizeof Key, RelativeSecurityDescriptor, Size);
+
     *PSecurityDescriptor = RelativeSecurityDescriptor;
 
     Result = STATUS_SUCCESS;
@@ -805,110 +953,370 @@ static UINT32 FspPosixInvalidPathChars[4] =
     0x00000008,
 };
 
-FSP_API NTSTATUS FspPosixMapWindowsToPosixPath(PWSTR WindowsPath, char **PPosixPath)
-{
-    NTSTATUS Result;
-    ULONG Size;
-    char *PosixPath = 0, *p, *q;
+/*
+ * Path conversion
+ *
+ * Paths are converted between UTF-16 and UTF-8 in a single pass that also swaps
+ * the path separators and applies the private use area transformation, directly
+ * into a caller supplied buffer. Runs of ASCII characters are converted 8 (UTF-16
+ * to UTF-8) or 16 (UTF-8 to UTF-16) characters at a time using SSE2 when available.
+ * The vector loop never reads past the terminating NUL; it is bounded by the string
+ * length, which is cheap to compute compared to the conversion.
+ *
+ * Unpaired surrogates in UTF-16 are converted to U+FFFD, like WideCharToMultiByte
+ * does. Invalid UTF-8 is rare and its treatment by MultiByteToWideChar is hard to
+ * reproduce exactly, so in that case we let MultiByteToWideChar do the conversion.
+ */
 
-    *PPosixPath = 0;
+#if defined(_M_IX86) || defined(_M_X64)
+#include <emmintrin.h>
+#define FSP_POSIX_PATH_SSE2
+#endif
 
-    Size = WideCharToMultiByte(CP_UTF8, 0, WindowsPath, -1, 0, 0, 0, 0);
-    if (0 == Size)
-        goto lasterror;
+static inline BOOLEAN FspPosixIsInvalidPathChar(UINT32 c)
+{
+    return 128 > c && (FspPosixInvalidPathChars[c >> 5] & (0x80000000 >> (c & 0x1f)));
+}
 
-    PosixPath = MemAlloc(Size);
-    if (0 == PosixPath)
+static ULONG FspPosixWindowsToPosixPath(PWSTR WindowsPath, char *PosixPath, ULONG Size)
+{
+    /* returns the size required for the POSIX path; it is written only if it fits in Size */
+    const WCHAR *p = WindowsPath;
+    PUINT8 q = (PUINT8)PosixPath;
+    ULONG Count = 0, n;
+    UINT32 c, c2;
+#if defined(FSP_POSIX_PATH_SSE2)
+    const WCHAR *EndP = WindowsPath + lstrlenW(WindowsPath);
+#endif
+
+    for (;;)
     {
-        Result = STATUS_INSUFFICIENT_RESOURCES;
-        goto exit;
-    }
-
-    Size = WideCharToMultiByte(CP_UTF8, 0, WindowsPath, -1, PosixPath, Size, 0, 0);
-    if (0 == Size)
-        goto lasterror;
+#if defined(FSP_POSIX_PATH_SSE2)
+        while (8 <= EndP - p && Count + 8 <= Size)
+        {
+            __m128i Zero = _mm_setzero_si128();
+            __m128i v = _mm_loadu_si128((const __m128i *)p);
+            if (0xffff != _mm_movemask_epi8(
+                _mm_cmpeq_epi16(_mm_and_si128(v, _mm_set1_epi16((short)0xff80)), Zero)))
+                break;
+            __m128i Sep = _mm_cmpeq_epi16(v, _mm_set1_epi16(L'\\'));
+            v = _mm_or_si128(_mm_andnot_si128(Sep, v), _mm_and_si128(Sep, _mm_set1_epi16(L'/')));
+            _mm_storel_epi64((__m128i *)(q + Count), _mm_packus_epi16(v, v));
+            p += 8;
+            Count += 8;
+        }
+#endif
 
-    for (p = PosixPath, q = p; *p; p++)
-    {
-        unsigned char c = *p;
+        c = *p++;
+        if (128 > c)
+        {
+            if (Count + 1 <= Size)
+                q[Count] = L'\\' == c ? '/' : (UINT8)c;
+            Count++;
+            if (0 == c)
+                break;
+            continue;
+        }
 
-        if ('\\' == c)
-            *q++ = '/';
-        /* encode characters in the Unicode private use area: U+F0XX -> XX */
-        else if (0xef == c && 0x80 == (0xfc & p[1]) && 0x80 == (0xc0 & p[2]))
+        if (0x800 > c)
+            n = 2;
+        else if (0xd800 <= c && c <= 0xdfff)
         {
-            c = ((p[1] & 0x3) << 6) | (p[2] & 0x3f);
-            if (128 > c && (FspPosixInvalidPathChars[c >> 5] & (0x80000000 >> (c & 0x1f))))
-                *q++ = c, p += 2;
+            c2 = *p;
+            if (c <= 0xdbff && 0xdc00 <= c2 && c2 <= 0xdfff)
+            {
+                c = 0x10000 + ((c - 0xd800) << 10) + (c2 - 0xdc00);
+                p++;
+                n = 4;
+            }
             else
-                *q++ = *p++, *q++ = *p++, *q++ = *p;
+            {
+                c = 0xfffd;
+                n = 3;
+            }
+        }
+        /* decode characters in the Unicode private use area: U+F0XX -> XX */
+        else if (0xf000 == (c & 0xff80) && FspPosixIsInvalidPathChar(c & 0x7f))
+        {
+            if (Count + 1 <= Size)
+                q[Count] = (UINT8)(c & 0x7f);
+            Count++;
+            continue;
+        }
+        else
+            n = 3;
+
+        if (Count + n <= Size)
+        {
+            switch (n)
+            {
+            case 2:
+                q[Count + 0] = (UINT8)(0xc0 | (c >> 6));
+                q[Count + 1] = (UINT8)(0x80 | (c & 0x3f));
+                break;
+            case 3:
+                q[Count + 0] = (UINT8)(0xe0 | (c >> 12));
+                q[Count + 1] = (UINT8)(0x80 | ((c >> 6) & 0x3f));
+                q[Count + 2] = (UINT8)(0x80 | (c & 0x3f));
+                break;
+            case 4:
+                q[Count + 0] = (UINT8)(0xf0 | (c >> 18));
+                q[Count + 1] = (UINT8)(0x80 | ((c >> 12) & 0x3f));
+                q[Count + 2] = (UINT8)(0x80 | ((c >> 6) & 0x3f));
+                q[Count + 3] = (UINT8)(0x80 | (c & 0x3f));
+                break;
+            }
         }
         else
-            *q++ = c;
+            Size = 0; /* no more writes once we have run out of space */
+        Count += n;
     }
-    *q = '\0';
 
-    *PPosixPath = PosixPath;
+    return Count;
+}
 
-    Result = STATUS_SUCCESS;
+static ULONG FspPosixPosixToWindowsPath(const char *PosixPath, PWSTR WindowsPath, ULONG Size)
+{
+    /*
+     * Returns the size (in bytes) required for the Windows path; it is written only if
+     * it fits in Size. Returns 0 if the POSIX path is not valid UTF-8.
+     */
+    const UINT8 *p = (const UINT8 *)PosixPath;
+    PWSTR q = WindowsPath;
+    ULONG Count = 0, n;
+    UINT32 c;
+#if defined(FSP_POSIX_PATH_SSE2)
+    const UINT8 *EndP = p + lstrlenA(PosixPath);
+#endif
 
-exit:
-    if (!NT_SUCCESS(Result))
-        MemFree(PosixPath);
+    Size /= sizeof(WCHAR);
 
-    return Result;
+    for (;;)
+    {
+#if defined(FSP_POSIX_PATH_SSE2)
+        while (16 <= EndP - p && Count + 16 <= Size)
+        {
+            __m128i Zero = _mm_setzero_si128();
+            __m128i v = _mm_loadu_si128((const __m128i *)p);
+            if (0 != _mm_movemask_epi8(v))
+                break;
+            __m128i Invalid = _mm_or_si128(
+                _mm_or_si128(
+                    _mm_or_si128(_mm_cmplt_epi8(v, _mm_set1_epi8(32)), _mm_cmpeq_epi8(v, _mm_set1_epi8('<'))),
+                    _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('>')), _mm_cmpeq_epi8(v, _mm_set1_epi8(':')))),
+                _mm_or_si128(
+                    _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('"')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\\'))),
+                    _mm_or_si128(
+                        _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('|')), _mm_cmpeq_epi8(v, _mm_set1_epi8('?'))),
+                        _mm_cmpeq_epi8(v, _mm_set1_epi8('*')))));
+            __m128i Sep = _mm_cmpeq_epi8(v, _mm_set1_epi8('/'));
+            v = _mm_or_si128(_mm_andnot_si128(Sep, v), _mm_and_si128(Sep, _mm_set1_epi8('\\')));
+            __m128i Lo = _mm_unpacklo_epi8(v, Zero), Hi = _mm_unpackhi_epi8(v, Zero);
+            __m128i Pua = _mm_set1_epi16((short)0xf000);
+            Lo = _mm_or_si128(Lo, _mm_and_si128(_mm_unpacklo_epi8(Invalid, Invalid), Pua));
+            Hi = _mm_or_si128(Hi, _mm_and_si128(_mm_unpackhi_epi8(Invalid, Invalid), Pua));
+            _mm_storeu_si128((__m128i *)(q + Count), Lo);
+            _mm_storeu_si128((__m128i *)(q + Count + 8), Hi);
+            p += 16;
+            Count += 16;
+        }
+#endif
 
-lasterror:
-    Result = FspNtStatusFromWin32(GetLastError());
-    goto exit;
+        c = *p++;
+        if (128 > c)
+        {
+            if ('/' == c)
+                c = L'\\';
+            /* encode characters invalid for Windows filenames: XX -> U+F0XX */
+            else if (FspPosixIsInvalidPathChar(c))
+                c |= 0xf000;
+        }
+        else if (0xc2 <= c && c <= 0xdf)
+        {
+            if (0x80 != (p[0] & 0xc0))
+                return 0;
+            c = ((c & 0x1f) << 6) | (p[0] & 0x3f);
+            p += 1;
+        }
+        else if (0xe0 <= c && c <= 0xef)
+        {
+            if (0x80 != (p[0] & 0xc0) || 0x80 != (p[1] & 0xc0))
+                return 0;
+            c = ((c & 0x0f) << 12) | ((p[0] & 0x3f) << 6) | (p[1] & 0x3f);
+            if (0x800 > c || (0xd800 <= c && c <= 0xdfff))
+                return 0; /* overlong or surrogate */
+            p += 2;
+        }
+        else if (0xf0 <= c && c <= 0xf4)
+        {
+            if (0x80 != (p[0] & 0xc0) || 0x80 != (p[1] & 0xc0) || 0x80 != (p[2] & 0xc0))
+                return 0;
+            c = ((c & 0x07) << 18) | ((p[0] & 0x3f) << 12) | ((p[1] & 0x3f) << 6) | (p[2] & 0x3f);
+            if (0x10000 > c || 0x10ffff < c)
+                return 0; /* overlong or out of range */
+            p += 3;
+        }
+        else
+            return 0;
+
+        n = 0x10000 > c ? 1 : 2;
+        if (Count + n <= Size)
+        {
+            if (1 == n)
+                q[Count] = (WCHAR)c;
+            else
+            {
+                q[Count + 0] = (WCHAR)(0xd800 + ((c - 0x10000) >> 10));
+                q[Count + 1] = (WCHAR)(0xdc00 + ((c - 0x10000) & 0x3ff));
+            }
+        }
+        else
+            Size = 0; /* no more writes once we have run out of space */
+        Count += n;
+
+        if (0 == c)
+            break;
+    }
+
+    return Count * sizeof(WCHAR);
 }
 
-FSP_API NTSTATUS FspPosixMapPosixToWindowsPath(const char *PosixPath, PWSTR *PWindowsPath)
+static NTSTATUS FspPosixPosixToWindowsPathSlow(const char *PosixPath, PWSTR WindowsPath,
+    PULONG PSize)
 {
-    NTSTATUS Result;
     ULONG Size;
-    PWSTR WindowsPath = 0, p;
-
-    *PWindowsPath = 0;
+    PWSTR p;
+    WCHAR c;
 
     Size = MultiByteToWideChar(CP_UTF8, 0, PosixPath, -1, 0, 0);
     if (0 == Size)
-        goto lasterror;
+        return FspNtStatusFromWin32(GetLastError());
 
-    WindowsPath = MemAlloc(Size * sizeof(WCHAR));
-    if (0 == PosixPath)
+    if (Size * sizeof(WCHAR) > *PSize)
     {
-        Result = STATUS_INSUFFICIENT_RESOURCES;
-        goto exit;
+        *PSize = Size * sizeof(WCHAR);
+        return STATUS_BUFFER_OVERFLOW;
     }
 
     Size = MultiByteToWideChar(CP_UTF8, 0, PosixPath, -1, WindowsPath, Size);
     if (0 == Size)
-        goto lasterror;
+        return FspNtStatusFromWin32(GetLastError());
 
     for (p = WindowsPath; *p; p++)
     {
-        WCHAR c = *p;
+        c = *p;
 
         if (L'/' == c)
             *p = L'\\';
-        else if (128 > c && (FspPosixInvalidPathChars[c >> 5] & (0x80000000 >> (c & 0x1f))))
+        else if (FspPosixIsInvalidPathChar(c))
             *p |= 0xf000;
     }
 
-    *PWindowsPath = WindowsPath;
+    *PSize = Size * sizeof(WCHAR);
+    return STATUS_SUCCESS;
+}
 
-    Result = STATUS_SUCCESS;
+FSP_API NTSTATUS FspPosixMapWindowsToPosixPathBuffer(PWSTR WindowsPath,
+    char *PosixPath, PULONG PSize)
+{
+    ULONG Size;
 
-exit:
-    if (!NT_SUCCESS(Result))
-        MemFree(WindowsPath);
+    Size = FspPosixWindowsToPosixPath(WindowsPath, PosixPath, *PSize);
+    if (Size > *PSize)
+    {
+        *PSize = Size;
+        return STATUS_BUFFER_OVERFLOW;
+    }
 
-    return Result;
+    *PSize = Size;
+    return STATUS_SUCCESS;
+}
 
-lasterror:
-    Result = FspNtStatusFromWin32(GetLastError());
-    goto exit;
+FSP_API NTSTATUS FspPosixMapPosixToWindowsPathBuffer(const char *PosixPath,
+    PWSTR WindowsPath, PULONG PSize)
+{
+    ULONG Size;
+
+    Size = FspPosixPosixToWindowsPath(PosixPath, WindowsPath, *PSize);
+    if (0 == Size)
+        return FspPosixPosixToWindowsPathSlow(PosixPath, WindowsPath, PSize);
+    if (Size > *PSize)
+    {
+        *PSize = Size;
+        return STATUS_BUFFER_OVERFLOW;
+    }
+
+    *PSize = Size;
+    return STATUS_SUCCESS;
+}
+
+FSP_API NTSTATUS FspPosixMapWindowsToPosixPath(PWSTR WindowsPath, char **PPosixPath)
+{
+    NTSTATUS Result;
+    char Buffer[512], *PosixPath;
+    ULONG Size = sizeof Buffer;
+
+    *PPosixPath = 0;
+
+    /* convert on the stack; then allocate exactly what is needed */
+    Result = FspPosixMapWindowsToPosixPathBuffer(WindowsPath, Buffer, &Size);
+    if (!NT_SUCCESS(Result) && STATUS_BUFFER_OVERFLOW != Result)
+        return Result;
+
+    PosixPath = MemAlloc(Size);
+    if (0 == PosixPath)
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    if (STATUS_BUFFER_OVERFLOW == Result)
+    {
+        Result = FspPosixMapWindowsToPosixPathBuffer(WindowsPath, PosixPath, &Size);
+        if (!NT_SUCCESS(Result))
+        {
+            MemFree(PosixPath);
+            return Result;
+        }
+    }
+    else
+        memcpy(PosixPath, Buffer, Size);
+
+    *PPosixPath = PosixPath;
+
+    return STATUS_SUCCESS;
+}
+
+FSP_API NTSTATUS FspPosixMapPosixToWindowsPath(const char *PosixPath, PWSTR *PWindowsPath)
+{
+    NTSTATUS Result;
+    WCHAR Buffer[256];
+    PWSTR WindowsPath;
+    ULONG Size = sizeof Buffer;
+
+    *PWindowsPath = 0;
+
+    /* convert on the stack; then allocate exactly what is needed */
+    Result = FspPosixMapPosixToWindowsPathBuffer(PosixPath, Buffer, &Size);
+    if (!NT_SUCCESS(Result) && STATUS_BUFFER_OVERFLOW != Result)
+        return Result;
+
+    WindowsPath = MemAlloc(Size);
+    if (0 == WindowsPath)
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    if (STATUS_BUFFER_OVERFLOW == Result)
+    {
+        Result = FspPosixMapPosixToWindowsPathBuffer(PosixPath, WindowsPath, &Size);
+        if (!NT_SUCCESS(Result))
+        {
+            MemFree(WindowsPath);
+            return Result;
+        }
+    }
+    else
+        memcpy(WindowsPath, Buffer, Size);
+
+    *PWindowsPath = WindowsPath;
+
+    return STATUS_SUCCESS;
 }
 
 FSP_API VOID FspPosixDeletePath(void *Path)
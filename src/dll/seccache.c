@@ -0,0 +1,322 @@
+/**
+ * @file dll/seccache.c
+ *
+ * @copyright 2015-2016 Bill Zissimopoulos
+ */
+/*
+ * This file is part of WinFsp.
+ *
+ * You can redistribute it and/or modify it under the terms of the
+ * GNU Affero General Public License version 3 as published by the
+ * Free Software Foundation.
+ *
+ * Licensees holding a valid commercial license may use this file in
+ * accordance with the commercial license agreement provided with the
+ * software.
+ */
+
+#include <dll/library.h>
+
+/*
+ * Security Cache
+ *
+ * The security cache remembers the results of GetSecurityByName by file name:
+ * the file attributes and a copy of the security descriptor. FspAccessCheckEx
+ * consults it for the file being opened and for every directory that it checks
+ * for traverse access, so that a burst of opens below a deep directory does not
+ * ask the file system for the security of the same directories over and over.
+ *
+ * Entries expire after a timeout. The file system layer invalidates a file and
+ * all its descendants when it is renamed or deleted. Changes of security or file
+ * attributes invalidate the whole cache, because these requests do not carry a
+ * file name. A GetSecurityByName that races with an invalidation must not insert
+ * stale data; for this reason every invalidation increments a cache generation
+ * and an insert is ignored if the generation has changed since the lookup.
+ *
+ * Lookups compare file names exactly. Invalidations ignore case, so that they
+ * remove all cached variants of a name on a case insensitive file system. Names
+ * are hashed with ASCII characters folded to upper case and all other characters
+ * treated as equal, so that all case variants of a name share a bucket.
+ *
+ * The cache is a hash table with a single SRW lock. When it reaches its capacity
+ * it is simply emptied.
+ */
+
+enum
+{
+    FspFileSystemSecurityCacheBucketCount = 1024,
+    FspFileSystemSecurityCacheCapacity = 4096,
+};
+
+typedef struct _FSP_FILE_SYSTEM_SECURITY_CACHE_ITEM
+{
+    struct _FSP_FILE_SYSTEM_SECURITY_CACHE_ITEM *HashNext;
+    ULONG Hash;
+    UINT64 InsertTime;
+    UINT32 FileAttributes;
+    PSECURITY_DESCRIPTOR SecurityDescriptor;
+    ULONG SecurityDescriptorSize;
+    ULONG FileNameLength;               /* in characters; excluding terminating NUL */
+    WCHAR FileName[];
+} FSP_FILE_SYSTEM_SECURITY_CACHE_ITEM;
+
+typedef struct
+{
+    SRWLOCK Lock;
+    UINT64 Timeout;
+    UINT64 Generation;
+    ULONG Count;
+    FSP_FILE_SYSTEM_SECURITY_CACHE_ITEM *Buckets[FspFileSystemSecurityCacheBucketCount];
+} FSP_FILE_SYSTEM_SECURITY_CACHE;
+
+static inline
+ULONG FspFileSystemSecurityCacheHash(PWSTR FileName, ULONG FileNameLength)
+{
+    UINT32 Hash = 2166136261;
+    WCHAR C;
+
+    for (ULONG Index = 0; FileNameLength > Index; Index++)
+    {
+        C = FileName[Index];
+        if (L'a' <= C && C <= L'z')
+            C -= L'a' - L'A';
+        else if (0x80 <= C)
+            C = 0x80;
+        Hash = (Hash ^ C) * 16777619;
+    }
+
+    return Hash;
+}
+
+static inline
+BOOLEAN FspFileSystemSecurityCacheNameEqual(PWSTR FileName1, PWSTR FileName2, ULONG Length)
+{
+    return CSTR_EQUAL == CompareStringOrdinal(FileName1, Length, FileName2, Length, TRUE);
+}
+
+static FSP_FILE_SYSTEM_SECURITY_CACHE_ITEM **FspFileSystemSecurityCacheFind(
+    FSP_FILE_SYSTEM_SECURITY_CACHE *Cache,
+    PWSTR FileName, ULONG FileNameLength, ULONG Hash)
+{
+    FSP_FILE_SYSTEM_SECURITY_CACHE_ITEM **PItem;
+
+    for (PItem = &Cache->Buckets[Hash % FspFileSystemSecurityCacheBucketCount];
+        0 != *PItem; PItem = &(*PItem)->HashNext)
+        if ((*PItem)->Hash == Hash && (*PItem)->FileNameLength == FileNameLength &&
+            0 == memcmp((*PItem)->FileName, FileName, FileNameLength * sizeof(WCHAR)))
+            break;
+
+    return PItem;
+}
+
+static VOID FspFileSystemSecurityCacheClear(FSP_FILE_SYSTEM_SECURITY_CACHE *Cache)
+{
+    FSP_FILE_SYSTEM_SECURITY_CACHE_ITEM *Item, *NextItem;
+
+    for (ULONG Index = 0; FspFileSystemSecurityCacheBucketCount > Index; Index++)
+    {
+        for (Item = Cache->Buckets[Index]; 0 != Item; Item = NextItem)
+        {
+            NextItem = Item->HashNext;
+            MemFree(Item);
+        }
+        Cache->Buckets[Index] = 0;
+    }
+    Cache->Count = 0;
+}
+
+FSP_API NTSTATUS FspFileSystemEnableSecurityCache(FSP_FILE_SYSTEM *FileSystem,
+    ULONG Timeout)
+{
+    FSP_FILE_SYSTEM_SECURITY_CACHE *Cache;
+
+    if (0 != FileSystem->DispatcherThread || 0 == Timeout)
+        return STATUS_INVALID_PARAMETER;
+
+    if (0 != FileSystem->SecurityCache)
+        return STATUS_SUCCESS;
+
+    Cache = MemAlloc(sizeof *Cache);
+    if (0 == Cache)
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    memset(Cache, 0, sizeof *Cache);
+    InitializeSRWLock(&Cache->Lock);
+    Cache->Timeout = Timeout;
+
+    FileSystem->SecurityCache = Cache;
+
+    return STATUS_SUCCESS;
+}
+
+FSP_API VOID FspFileSystemInvalidateSecurityCache(FSP_FILE_SYSTEM *FileSystem,
+    PWSTR FileName)
+{
+    FSP_FILE_SYSTEM_SECURITY_CACHE *Cache = FileSystem->SecurityCache;
+    FSP_FILE_SYSTEM_SECURITY_CACHE_ITEM *Item, **PItem;
+    ULONG FileNameLength, Hash;
+    BOOLEAN Found, Descendants;
+
+    if (0 == Cache)
+        return;
+
+    FileNameLength = 0 != FileName ? lstrlenW(FileName) : 0;
+
+    AcquireSRWLockExclusive(&Cache->Lock);
+
+    Cache->Generation++;
+
+    if (0 == FileNameLength || (1 == FileNameLength && L'\\' == FileName[0]))
+    {
+        /* all files or the root directory and thus all its descendants */
+        FspFileSystemSecurityCacheClear(Cache);
+        goto exit;
+    }
+
+    /*
+     * Remove all case variants of the name. If none of them was cached we do not know
+     * whether the name is a directory and we must also look for descendants, which
+     * requires a scan of the whole table.
+     */
+    Found = Descendants = FALSE;
+    Hash = FspFileSystemSecurityCacheHash(FileName, FileNameLength);
+    for (PItem = &Cache->Buckets[Hash % FspFileSystemSecurityCacheBucketCount]; 0 != (Item = *PItem);)
+        if (Item->Hash == Hash && Item->FileNameLength == FileNameLength &&
+            FspFileSystemSecurityCacheNameEqual(Item->FileName, FileName, FileNameLength))
+        {
+            Found = TRUE;
+            if (0 != (Item->FileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+                Descendants = TRUE;
+            *PItem = Item->HashNext;
+            MemFree(Item);
+            Cache->Count--;
+        }
+        else
+            PItem = &Item->HashNext;
+    if (!Found)
+        Descendants = TRUE;
+
+    if (Descendants && 0 != Cache->Count)
+    {
+        for (ULONG Index = 0; FspFileSystemSecurityCacheBucketCount > Index; Index++)
+            for (PItem = &Cache->Buckets[Index]; 0 != (Item = *PItem);)
+                if (Item->FileNameLength > FileNameLength &&
+                    L'\\' == Item->FileName[FileNameLength] &&
+                    FspFileSystemSecurityCacheNameEqual(Item->FileName, FileName, FileNameLength))
+                {
+                    *PItem = Item->HashNext;
+                    MemFree(Item);
+                    Cache->Count--;
+                }
+                else
+                    PItem = &Item->HashNext;
+    }
+
+exit:
+    ReleaseSRWLockExclusive(&Cache->Lock);
+}
+
+NTSTATUS FspFileSystemSecurityCacheLookup(FSP_FILE_SYSTEM *FileSystem,
+    PWSTR FileName, PUINT32 PFileAttributes,
+    PSECURITY_DESCRIPTOR SecurityDescriptor, SIZE_T *PSecurityDescriptorSize,
+    PUINT64 PGeneration)
+{
+    FSP_FILE_SYSTEM_SECURITY_CACHE *Cache = FileSystem->SecurityCache;
+    FSP_FILE_SYSTEM_SECURITY_CACHE_ITEM *Item;
+    ULONG FileNameLength = lstrlenW(FileName);
+    ULONG Hash = FspFileSystemSecurityCacheHash(FileName, FileNameLength);
+    UINT64 Now = GetTickCount64();
+    NTSTATUS Result = STATUS_NOT_FOUND;
+
+    AcquireSRWLockShared(&Cache->Lock);
+
+    *PGeneration = Cache->Generation;
+
+    Item = *FspFileSystemSecurityCacheFind(Cache, FileName, FileNameLength, Hash);
+    if (0 != Item && Now - Item->InsertTime < Cache->Timeout)
+    {
+        if (Item->SecurityDescriptorSize > *PSecurityDescriptorSize)
+            Result = STATUS_BUFFER_OVERFLOW;
+        else
+        {
+            memcpy(SecurityDescriptor, Item->SecurityDescriptor, Item->SecurityDescriptorSize);
+            *PFileAttributes = Item->FileAttributes;
+            Result = STATUS_SUCCESS;
+        }
+        *PSecurityDescriptorSize = Item->SecurityDescriptorSize;
+    }
+
+    ReleaseSRWLockShared(&Cache->Lock);
+
+    return Result;
+}
+
+VOID FspFileSystemSecurityCacheInsert(FSP_FILE_SYSTEM *FileSystem,
+    PWSTR FileName, UINT64 Generation, UINT32 FileAttributes,
+    PSECURITY_DESCRIPTOR SecurityDescriptor, SIZE_T SecurityDescriptorSize)
+{
+    FSP_FILE_SYSTEM_SECURITY_CACHE *Cache = FileSystem->SecurityCache;
+    FSP_FILE_SYSTEM_SECURITY_CACHE_ITEM *Item, **PItem;
+    ULONG FileNameLength = lstrlenW(FileName);
+    ULONG Hash = FspFileSystemSecurityCacheHash(FileName, FileNameLength);
+    SIZE_T SecurityDescriptorOffset;
+
+    SecurityDescriptorOffset = FSP_FSCTL_DEFAULT_ALIGN_UP(
+        FIELD_OFFSET(FSP_FILE_SYSTEM_SECURITY_CACHE_ITEM, FileName) +
+        (FileNameLength + 1) * sizeof(WCHAR));
+    Item = MemAlloc(SecurityDescriptorOffset + SecurityDescriptorSize);
+    if (0 == Item)
+        return;
+
+    Item->Hash = Hash;
+    Item->InsertTime = GetTickCount64();
+    Item->FileAttributes = FileAttributes;
+    Item->SecurityDescriptor = (PUINT8)Item + SecurityDescriptorOffset;
+    Item->SecurityDescriptorSize = (ULONG)SecurityDescriptorSize;
+    Item->FileNameLength = FileNameLength;
+    memcpy(Item->FileName, FileName, (FileNameLength + 1) * sizeof(WCHAR));
+    memcpy(Item->SecurityDescriptor, SecurityDescriptor, SecurityDescriptorSize);
+
+    AcquireSRWLockExclusive(&Cache->Lock);
+
+    if (Cache->Generation != Generation)
+    {
+        /* an invalidation happened since the lookup; our data may be stale */
+        ReleaseSRWLockExclusive(&Cache->Lock);
+        MemFree(Item);
+        return;
+    }
+
+    PItem = FspFileSystemSecurityCacheFind(Cache, FileName, FileNameLength, Hash);
+    if (0 != *PItem)
+    {
+        Item->HashNext = (*PItem)->HashNext;
+        MemFree(*PItem);
+        *PItem = Item;
+    }
+    else
+    {
+        if (FspFileSystemSecurityCacheCapacity <= Cache->Count)
+        {
+            FspFileSystemSecurityCacheClear(Cache);
+            PItem = &Cache->Buckets[Hash % FspFileSystemSecurityCacheBucketCount];
+        }
+        Item->HashNext = 0;
+        *PItem = Item;
+        Cache->Count++;
+    }
+
+    ReleaseSRWLockExclusive(&Cache->Lock);
+}
+
+VOID FspFileSystemSecurityCacheFinalize(FSP_FILE_SYSTEM *FileSystem)
+{
+    FSP_FILE_SYSTEM_SECURITY_CACHE *Cache = FileSystem->SecurityCache;
+
+    if (0 == Cache)
+        return;
+
+    FspFileSystemSecurityCacheClear(Cache);
+    MemFree(Cache);
+    FileSystem->SecurityCache = 0;
+}
@@ -32,20 +32,50 @@ FSP_API PGENERIC_MAPPING FspGetFileGenericMapping(VOID)
 
 static NTSTATUS FspGetSecurityByName(FSP_FILE_SYSTEM *FileSystem,
     PWSTR FileName, PUINT32 PFileAttributes,
-    PSECURITY_DESCRIPTOR *PSecurityDescriptor, SIZE_T *PSecurityDescriptorSize)
+    PSECURITY_DESCRIPTOR *PSecurityDescriptor, SIZE_T *PSecurityDescriptorBufSize,
+    SIZE_T *PSecurityDescriptorSize, PVOID SecurityDescriptorBuf)
 {
+    /*
+     * The security descriptor buffer starts out as SecurityDescriptorBuf (on the
+     * caller's stack) and is replaced by a heap buffer if it is too small.
+     */
+
+    NTSTATUS Result;
+    UINT32 FileAttributes;
+    UINT64 Generation = 0;
+
     for (;;)
     {
-        NTSTATUS Result = FileSystem->Interface->GetSecurityByName(FileSystem,
-            FileName, PFileAttributes, *PSecurityDescriptor, PSecurityDescriptorSize);
+        *PSecurityDescriptorSize = *PSecurityDescriptorBufSize;
+
+        Result = STATUS_NOT_FOUND;
+        if (0 != FileSystem->SecurityCache)
+            Result = FspFileSystemSecurityCacheLookup(FileSystem,
+                FileName, &FileAttributes, *PSecurityDescriptor, PSecurityDescriptorSize,
+                &Generation);
+        if (STATUS_NOT_FOUND == Result)
+        {
+            Result = FileSystem->Interface->GetSecurityByName(FileSystem,
+                FileName, &FileAttributes, *PSecurityDescriptor, PSecurityDescriptorSize);
+            if (STATUS_SUCCESS == Result && 0 != FileSystem->SecurityCache)
+                FspFileSystemSecurityCacheInsert(FileSystem,
+                    FileName, Generation, FileAttributes, *PSecurityDescriptor, *PSecurityDescriptorSize);
+        }
         if (STATUS_BUFFER_OVERFLOW != Result)
-            return Result;
+            break;
 
-        MemFree(*PSecurityDescriptor);
+        if (SecurityDescriptorBuf != *PSecurityDescriptor)
+            MemFree(*PSecurityDescriptor);
         *PSecurityDescriptor = MemAlloc(*PSecurityDescriptorSize);
         if (0 == *PSecurityDescriptor)
             return STATUS_INSUFFICIENT_RESOURCES;
+        *PSecurityDescriptorBufSize = *PSecurityDescriptorSize;
     }
+
+    if (NT_SUCCESS(Result) && 0 != PFileAttributes)
+        *PFileAttributes = FileAttributes;
+
+    return Result;
 }
 
 FSP_API NTSTATUS FspAccessCheckEx(FSP_FILE_SYSTEM *FileSystem,
@@ -75,10 +105,11 @@ FSP_API NTSTATUS FspAccessCheckEx(FSP_FILE_SYSTEM *FileSystem,
 
     NTSTATUS Result;
     WCHAR Root[2] = L"\\", TraverseCheckRoot[2] = L"\\";
-    PWSTR FileName, Suffix, Prefix, Remain;
+    PWSTR FileName, Suffix, Prefix, Remain, Component;
     UINT32 FileAttributes;
-    PSECURITY_DESCRIPTOR SecurityDescriptor = 0;
-    SIZE_T SecurityDescriptorSize;
+    UINT8 SecurityDescriptorBuf[1024];
+    PSECURITY_DESCRIPTOR SecurityDescriptor = SecurityDescriptorBuf;
+    SIZE_T SecurityDescriptorBufSize = sizeof SecurityDescriptorBuf, SecurityDescriptorSize = 0;
     UINT8 PrivilegeSetBuf[sizeof(PRIVILEGE_SET) + 15 * sizeof(LUID_AND_ATTRIBUTES)];
     PPRIVILEGE_SET PrivilegeSet = (PVOID)PrivilegeSetBuf;
     DWORD PrivilegeSetLength = sizeof PrivilegeSetBuf;
@@ -90,31 +121,39 @@ FSP_API NTSTATUS FspAccessCheckEx(FSP_FILE_SYSTEM *FileSystem,
     else
         FileName = (PWSTR)Request->Buffer;
 
-    SecurityDescriptorSize = 1024;
-    SecurityDescriptor = MemAlloc(SecurityDescriptorSize);
-    if (0 == SecurityDescriptor)
-    {
-        Result = STATUS_INSUFFICIENT_RESOURCES;
-        goto exit;
-    }
-
     if (Request->Req.Create.UserMode &&
         AllowTraverseCheck && !Request->Req.Create.HasTraversePrivilege)
     {
+        /*
+         * Check traverse access for every directory on the path: the root directory
+         * and every prefix of FileName that ends right before a backslash that is
+         * followed by another path component.
+         */
         Remain = (PWSTR)FileName;
         for (;;)
         {
-            FspPathPrefix(Remain, &Prefix, &Remain, TraverseCheckRoot);
-            if (L'\0' == Remain[0])
-            {
-                FspPathCombine(FileName, Remain);
+            for (Component = Remain; L'\\' == *Component; Component++)
+                ;
+            if (L'\0' == *Component)
                 break;
+
+            if (FileName == Remain)
+                Prefix = TraverseCheckRoot;
+            else
+            {
+                *Remain = L'\0';
+                Prefix = FileName;
             }
 
             Result = FspGetSecurityByName(FileSystem, Prefix, 0,
-                &SecurityDescriptor, &SecurityDescriptorSize);
+                &SecurityDescriptor, &SecurityDescriptorBufSize, &SecurityDescriptorSize,
+                SecurityDescriptorBuf);
 
-            FspPathCombine(FileName, Remain);
+            if (FileName != Remain)
+                *Remain = L'\\';
+
+            for (Remain = Component; L'\0' != *Remain && L'\\' != *Remain; Remain++)
+                ;
 
             if (!NT_SUCCESS(Result))
             {
@@ -133,11 +172,15 @@ FSP_API NTSTATUS FspAccessCheckEx(FSP_FILE_SYSTEM *FileSystem,
                 if (!NT_SUCCESS(Result))
                     goto exit;
             }
+
+            if (L'\0' == *Remain)
+                break;
         }
     }
 
     Result = FspGetSecurityByName(FileSystem, FileName, &FileAttributes,
-        &SecurityDescriptor, &SecurityDescriptorSize);
+        &SecurityDescriptor, &SecurityDescriptorBufSize, &SecurityDescriptorSize,
+        SecurityDescriptorBuf);
     if (!NT_SUCCESS(Result))
         goto exit;
 
@@ -257,8 +300,26 @@ FSP_API NTSTATUS FspAccessCheckEx(FSP_FILE_SYSTEM *FileSystem,
 
 exit:
     if (0 != PSecurityDescriptor && 0 < SecurityDescriptorSize && NT_SUCCESS(Result))
-        *PSecurityDescriptor = SecurityDescriptor;
-    else
+    {
+        if (SecurityDescriptorBuf == SecurityDescriptor)
+        {
+            /* the caller frees the security descriptor; it cannot live on our stack */
+            SecurityDescriptor = MemAlloc(SecurityDescriptorSize);
+            if (0 != SecurityDescriptor)
+            {
+                memcpy(SecurityDescriptor, SecurityDescriptorBuf, SecurityDescriptorSize);
+                *PSecurityDescriptor = SecurityDescriptor;
+            }
+            else
+            {
+                *PGrantedAccess = 0;
+                Result = STATUS_INSUFFICIENT_RESOURCES;
+            }
+        }
+        else
+            *PSecurityDescriptor = SecurityDescriptor;
+    }
+    else if (SecurityDescriptorBuf != SecurityDescriptor)
         MemFree(SecurityDescriptor);
 
     if (CheckParentDirectory)
@@ -0,0 +1,172 @@
+/**
+ * @file dll/stats.c
+ *
+ * @copyright 2015-2016 Bill Zissimopoulos
+ */
+/*
+ * This file is part of WinFsp.
+ *
+ * You can redistribute it and/or modify it under the terms of the
+ * GNU Affero General Public License version 3 as published by the
+ * Free Software Foundation.
+ *
+ * Licensees holding a valid commercial license may use this file in
+ * accordance with the commercial license agreement provided with the
+ * software.
+ */
+
+#include <dll/library.h>
+
+enum
+{
+    FspFileSystemStatisticsShardCount = 8,
+};
+
+/*
+ * Statistics are kept in shards selected by the current thread id, so that
+ * dispatcher threads rarely update the same counters. Updates are still done
+ * using interlocked operations because more than one thread may map to the
+ * same shard. Shards are merged when the statistics are retrieved.
+ */
+typedef struct
+{
+    UINT64 Frequency;
+    FSP_FILE_SYSTEM_STATISTICS Shards[FspFileSystemStatisticsShardCount];
+} FSP_FILE_SYSTEM_STATISTICS_SHARDS;
+
+static inline FSP_FILE_SYSTEM_STATISTICS *FspFileSystemStatisticsShard(
+    FSP_FILE_SYSTEM_STATISTICS_SHARDS *Shards)
+{
+    /* thread ids are multiples of 4 */
+    return &Shards->Shards[(GetCurrentThreadId() >> 2) % FspFileSystemStatisticsShardCount];
+}
+
+static VOID FspFileSystemStatisticsAdd(FSP_FILE_SYSTEM_STATISTICS_SHARDS *Shards,
+    FSP_FILE_SYSTEM_OPERATION_STATISTICS *Statistics,
+    NTSTATUS Status, UINT64 BytesTransferred, UINT64 Timestamp)
+{
+    UINT64 Ticks, Time;
+
+    Ticks = FspFileSystemStatisticsTimestamp() - Timestamp;
+    Time = Ticks / Shards->Frequency * 1000000000 +
+        Ticks % Shards->Frequency * 1000000000 / Shards->Frequency;
+
+    InterlockedIncrement64((PLONG64)&Statistics->Count);
+    if (STATUS_PENDING == Status)
+        InterlockedIncrement64((PLONG64)&Statistics->PendingCount);
+    else if (!NT_SUCCESS(Status))
+        InterlockedIncrement64((PLONG64)&Statistics->ErrorCount);
+    if (0 != BytesTransferred)
+        InterlockedExchangeAdd64((PLONG64)&Statistics->BytesTransferred, BytesTransferred);
+    InterlockedExchangeAdd64((PLONG64)&Statistics->TotalTime, Time);
+    InterlockedIncrement64((PLONG64)&Statistics->Histogram[FspFileSystemStatisticsBucketIndex(Time)]);
+}
+
+UINT64 FspFileSystemStatisticsTimestamp(VOID)
+{
+    LARGE_INTEGER Counter;
+
+    QueryPerformanceCounter(&Counter);
+    return Counter.QuadPart;
+}
+
+VOID FspFileSystemStatisticsAddOperation(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FSCTL_TRANSACT_REQ *Request, FSP_FSCTL_TRANSACT_RSP *Response, UINT64 Timestamp)
+{
+    FSP_FILE_SYSTEM_STATISTICS_SHARDS *Shards = FileSystem->Statistics;
+    NTSTATUS Status = Response->IoStatus.Status;
+    UINT64 BytesTransferred = 0;
+
+    if (FspFsctlTransactKindCount <= Request->Kind)
+        return;
+
+    switch (Request->Kind)
+    {
+    case FspFsctlTransactReadKind:
+    case FspFsctlTransactWriteKind:
+    case FspFsctlTransactQueryDirectoryKind:
+        if (NT_SUCCESS(Status) && STATUS_PENDING != Status)
+            BytesTransferred = Response->IoStatus.Information;
+        break;
+    }
+
+    FspFileSystemStatisticsAdd(Shards,
+        &FspFileSystemStatisticsShard(Shards)->Operations[Request->Kind],
+        Status, BytesTransferred, Timestamp);
+}
+
+VOID FspFileSystemStatisticsAddTransact(FSP_FILE_SYSTEM *FileSystem,
+    NTSTATUS Result, SIZE_T RequestBufSize, UINT64 Timestamp)
+{
+    FSP_FILE_SYSTEM_STATISTICS_SHARDS *Shards = FileSystem->Statistics;
+
+    FspFileSystemStatisticsAdd(Shards,
+        &FspFileSystemStatisticsShard(Shards)->Transact,
+        Result, RequestBufSize, Timestamp);
+}
+
+VOID FspFileSystemStatisticsFinalize(FSP_FILE_SYSTEM *FileSystem)
+{
+    MemFree(FileSystem->Statistics);
+    FileSystem->Statistics = 0;
+}
+
+FSP_API NTSTATUS FspFileSystemEnableStatistics(FSP_FILE_SYSTEM *FileSystem)
+{
+    FSP_FILE_SYSTEM_STATISTICS_SHARDS *Shards;
+    LARGE_INTEGER Frequency;
+
+    if (0 != FileSystem->DispatcherThread)
+        return STATUS_INVALID_PARAMETER;
+
+    if (0 != FileSystem->Statistics)
+        return STATUS_SUCCESS;
+
+    if (!QueryPerformanceFrequency(&Frequency) || 0 == Frequency.QuadPart)
+        return FspNtStatusFromWin32(GetLastError());
+
+    Shards = MemAlloc(sizeof *Shards);
+    if (0 == Shards)
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    memset(Shards, 0, sizeof *Shards);
+    Shards->Frequency = Frequency.QuadPart;
+
+    FileSystem->Statistics = Shards;
+
+    return STATUS_SUCCESS;
+}
+
+static VOID FspFileSystemStatisticsMerge(FSP_FILE_SYSTEM_OPERATION_STATISTICS *Dst,
+    FSP_FILE_SYSTEM_OPERATION_STATISTICS *Src)
+{
+    Dst->Count += Src->Count;
+    Dst->ErrorCount += Src->ErrorCount;
+    Dst->PendingCount += Src->PendingCount;
+    Dst->BytesTransferred += Src->BytesTransferred;
+    Dst->TotalTime += Src->TotalTime;
+    for (ULONG Index = 0; FspFileSystemStatisticsBucketCount > Index; Index++)
+        Dst->Histogram[Index] += Src->Histogram[Index];
+}
+
+FSP_API NTSTATUS FspFileSystemGetStatistics(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FILE_SYSTEM_STATISTICS *Statistics)
+{
+    FSP_FILE_SYSTEM_STATISTICS_SHARDS *Shards = FileSystem->Statistics;
+
+    memset(Statistics, 0, sizeof *Statistics);
+
+    if (0 == Shards)
+        return STATUS_INVALID_DEVICE_REQUEST;
+
+    for (ULONG ShardIndex = 0; FspFileSystemStatisticsShardCount > ShardIndex; ShardIndex++)
+    {
+        FSP_FILE_SYSTEM_STATISTICS *Shard = &Shards->Shards[ShardIndex];
+
+        for (ULONG Kind = 0; FspFsctlTransactKindCount > Kind; Kind++)
+            FspFileSystemStatisticsMerge(&Statistics->Operations[Kind], &Shard->Operations[Kind]);
+        FspFileSystemStatisticsMerge(&Statistics->Transact, &Shard->Transact);
+    }
+
+    return STATUS_SUCCESS;
+}
@@ -0,0 +1,600 @@
+/**
+ * @file dll/trace.c
+ *
+ * @copyright 2015-2016 Bill Zissimopoulos
+ */
+/*
+ * This file is part of WinFsp.
+ *
+ * You can redistribute it and/or modify it under the terms of the
+ * GNU Affero General Public License version 3 as published by the
+ * Free Software Foundation.
+ *
+ * Licensees holding a valid commercial license may use this file in
+ * accordance with the commercial license agreement provided with the
+ * software.
+ */
+
+#include <dll/library.h>
+
+#define FSP_FILE_SYSTEM_TRACE_SIGNATURE "WFSPTRC"
+
+enum
+{
+    FspFileSystemTraceSizeDefault = 64 * 1024 * 1024,
+    FspFileSystemTraceSizeMin = 64 * 1024,
+    FspFileSystemTraceContextMapCapacityMin = 64,
+};
+
+typedef struct
+{
+    SRWLOCK Lock;
+    HANDLE File, Mapping;
+    FSP_FILE_SYSTEM_TRACE_HEADER *Header;
+    PUINT8 Data;
+} FSP_FILE_SYSTEM_TRACE;
+
+/*
+ * The trace file consists of a header followed by the ring data. Records are appended
+ * at Head and are discarded from Tail when there is not enough room for a new record.
+ * A record is never split: if it does not fit before the end of the ring, the space up
+ * to the end of the ring is filled with a Wrap record and the new record is placed at
+ * the start of the ring. The header is updated after every record, so that the trace
+ * remains readable even if the process terminates abruptly.
+ */
+static VOID FspFileSystemTraceMakeRoom(FSP_FILE_SYSTEM_TRACE *Trace, UINT64 Size)
+{
+    FSP_FILE_SYSTEM_TRACE_HEADER *Header = Trace->Header;
+    FSP_FILE_SYSTEM_TRACE_RECORD *Record;
+
+    while (Header->DataSize - Header->Used < Size)
+    {
+        Record = (PVOID)(Trace->Data + Header->Tail);
+        Header->Tail += Record->Size;
+        if (Header->DataSize == Header->Tail)
+            Header->Tail = 0;
+        Header->Used -= Record->Size;
+    }
+}
+
+VOID FspFileSystemTraceAdd(FSP_FILE_SYSTEM *FileSystem,
+    UINT16 Kind, PVOID Data, ULONG Size)
+{
+    FSP_FILE_SYSTEM_TRACE *Trace = FileSystem->Trace;
+    FSP_FILE_SYSTEM_TRACE_HEADER *Header = Trace->Header;
+    FSP_FILE_SYSTEM_TRACE_RECORD *Record;
+    LARGE_INTEGER Timestamp;
+    UINT64 RecordSize, PadSize;
+
+    RecordSize = FSP_FSCTL_DEFAULT_ALIGN_UP(sizeof *Record + Size);
+    if (Header->DataSize < RecordSize)
+        return;
+
+    QueryPerformanceCounter(&Timestamp);
+
+    AcquireSRWLockExclusive(&Trace->Lock);
+
+    PadSize = Header->DataSize - Header->Head;
+    if (PadSize < RecordSize)
+    {
+        FspFileSystemTraceMakeRoom(Trace, PadSize);
+        Record = (PVOID)(Trace->Data + Header->Head);
+        Record->Size = (UINT32)PadSize;
+        Record->Kind = FspFileSystemTraceWrapKind;
+        Header->Head = 0;
+        Header->Used += PadSize;
+    }
+
+    FspFileSystemTraceMakeRoom(Trace, RecordSize);
+    Record = (PVOID)(Trace->Data + Header->Head);
+    Record->Size = (UINT32)RecordSize;
+    Record->Kind = Kind;
+    Record->Reserved = 0;
+    Record->ThreadId = GetCurrentThreadId();
+    Record->Reserved2 = 0;
+    Record->Timestamp = Timestamp.QuadPart;
+    memcpy(Record->Data, Data, Size);
+    memset(Record->Data + Size, 0, (SIZE_T)(RecordSize - sizeof *Record - Size));
+    Header->Head += RecordSize;
+    if (Header->DataSize == Header->Head)
+        Header->Head = 0;
+    Header->Used += RecordSize;
+
+    ReleaseSRWLockExclusive(&Trace->Lock);
+}
+
+VOID FspFileSystemTraceFinalize(FSP_FILE_SYSTEM *FileSystem)
+{
+    FSP_FILE_SYSTEM_TRACE *Trace = FileSystem->Trace;
+
+    if (0 == Trace)
+        return;
+
+    FileSystem->Trace = 0;
+
+    if (0 != Trace->Header)
+    {
+        FlushViewOfFile(Trace->Header, 0);
+        UnmapViewOfFile(Trace->Header);
+    }
+    if (0 != Trace->Mapping)
+        CloseHandle(Trace->Mapping);
+    if (INVALID_HANDLE_VALUE != Trace->File)
+        CloseHandle(Trace->File);
+    MemFree(Trace);
+}
+
+FSP_API NTSTATUS FspFileSystemStartTrace(FSP_FILE_SYSTEM *FileSystem,
+    PWSTR TraceFileName, ULONG TraceSize)
+{
+    FSP_FILE_SYSTEM_TRACE *Trace;
+    FSP_FILE_SYSTEM_TRACE_HEADER *Header;
+    LARGE_INTEGER Frequency;
+    UINT64 FileSize;
+    NTSTATUS Result;
+
+    if (0 != FileSystem->DispatcherThread || 0 != FileSystem->Trace)
+        return STATUS_INVALID_PARAMETER;
+
+    if (0 == TraceSize)
+        TraceSize = FspFileSystemTraceSizeDefault;
+    if (FspFileSystemTraceSizeMin > TraceSize)
+        TraceSize = FspFileSystemTraceSizeMin;
+    TraceSize = FSP_FSCTL_ALIGN_UP(TraceSize, FspFileSystemTraceSizeMin);
+    FileSize = sizeof(FSP_FILE_SYSTEM_TRACE_HEADER) + (UINT64)TraceSize;
+
+    Trace = MemAlloc(sizeof *Trace);
+    if (0 == Trace)
+        return STATUS_INSUFFICIENT_RESOURCES;
+    memset(Trace, 0, sizeof *Trace);
+    InitializeSRWLock(&Trace->Lock);
+
+    Trace->File = CreateFileW(TraceFileName,
+        GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, 0, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, 0);
+    if (INVALID_HANDLE_VALUE == Trace->File)
+    {
+        Result = FspNtStatusFromWin32(GetLastError());
+        goto exit;
+    }
+
+    Trace->Mapping = CreateFileMappingW(Trace->File, 0, PAGE_READWRITE,
+        (DWORD)(FileSize >> 32), (DWORD)FileSize, 0);
+    if (0 == Trace->Mapping)
+    {
+        Result = FspNtStatusFromWin32(GetLastError());
+        goto exit;
+    }
+
+    Trace->Header = MapViewOfFile(Trace->Mapping, FILE_MAP_WRITE, 0, 0, (SIZE_T)FileSize);
+    if (0 == Trace->Header)
+    {
+        Result = FspNtStatusFromWin32(GetLastError());
+        goto exit;
+    }
+    Trace->Data = (PUINT8)(Trace->Header + 1);
+
+    QueryPerformanceFrequency(&Frequency);
+
+    Header = Trace->Header;
+    memset(Header, 0, sizeof *Header);
+    memcpy(Header->Signature, FSP_FILE_SYSTEM_TRACE_SIGNATURE, sizeof Header->Signature);
+    Header->Version = sizeof *Header;
+    Header->Frequency = Frequency.QuadPart;
+    Header->DataSize = TraceSize;
+
+    FileSystem->Trace = Trace;
+
+    Result = STATUS_SUCCESS;
+
+exit:
+    if (!NT_SUCCESS(Result))
+    {
+        FileSystem->Trace = Trace;
+        FspFileSystemTraceFinalize(FileSystem);
+    }
+
+    return Result;
+}
+
+/*
+ * During replay the file contexts found in recorded requests must be translated to the
+ * file contexts returned by the file system being replayed into. The translation is kept
+ * in a small open addressing hash table keyed by the recorded (UserContext, UserContext2)
+ * pair. A second table keyed by request Hint holds the contexts of replayed Create requests
+ * until the corresponding recorded Create response is encountered.
+ */
+typedef struct
+{
+    UINT64 Key[2];
+    UINT64 Value[2];
+    UINT32 State;                       /* 0: empty, 1: used, 2: deleted */
+} FSP_FILE_SYSTEM_TRACE_CONTEXT_ENTRY;
+typedef struct
+{
+    FSP_FILE_SYSTEM_TRACE_CONTEXT_ENTRY *Entries;
+    ULONG Capacity;                     /* power of 2 */
+    ULONG Count;                        /* used and deleted entries */
+} FSP_FILE_SYSTEM_TRACE_CONTEXT_MAP;
+
+static inline ULONG FspFileSystemTraceContextHash(UINT64 Key0, UINT64 Key1)
+{
+    UINT64 Hash = (Key0 ^ (Key1 * 0x9e3779b97f4a7c15ULL)) * 0xff51afd7ed558ccdULL;
+    return (ULONG)(Hash >> 32);
+}
+
+static FSP_FILE_SYSTEM_TRACE_CONTEXT_ENTRY *FspFileSystemTraceContextLookup(
+    FSP_FILE_SYSTEM_TRACE_CONTEXT_MAP *Map, UINT64 Key0, UINT64 Key1, BOOLEAN Insert)
+{
+    FSP_FILE_SYSTEM_TRACE_CONTEXT_ENTRY *Entry, *FreeEntry = 0;
+    ULONG Index;
+
+    if (0 == Map->Capacity)
+        return 0;
+
+    for (Index = FspFileSystemTraceContextHash(Key0, Key1) & (Map->Capacity - 1);;
+        Index = (Index + 1) & (Map->Capacity - 1))
+    {
+        Entry = &Map->Entries[Index];
+        if (1 == Entry->State)
+        {
+            if (Key0 == Entry->Key[0] && Key1 == Entry->Key[1])
+                return Entry;
+        }
+        else
+        {
+            if (0 == FreeEntry)
+                FreeEntry = Entry;
+            if (0 == Entry->State)
+                break;
+        }
+    }
+
+    return Insert ? FreeEntry : 0;
+}
+
+static NTSTATUS FspFileSystemTraceContextInsert(FSP_FILE_SYSTEM_TRACE_CONTEXT_MAP *Map,
+    UINT64 Key0, UINT64 Key1, UINT64 Value0, UINT64 Value1)
+{
+    FSP_FILE_SYSTEM_TRACE_CONTEXT_ENTRY *Entry;
+
+    if (Map->Count >= Map->Capacity / 4 * 3)
+    {
+        FSP_FILE_SYSTEM_TRACE_CONTEXT_MAP NewMap;
+        ULONG Index;
+
+        NewMap.Capacity = 0 != Map->Capacity ?
+            Map->Capacity * 2 : FspFileSystemTraceContextMapCapacityMin;
+        NewMap.Count = 0;
+        NewMap.Entries = MemAlloc(NewMap.Capacity * sizeof NewMap.Entries[0]);
+        if (0 == NewMap.Entries)
+            return STATUS_INSUFFICIENT_RESOURCES;
+        memset(NewMap.Entries, 0, NewMap.Capacity * sizeof NewMap.Entries[0]);
+
+        for (Index = 0; Map->Capacity > Index; Index++)
+            if (1 == Map->Entries[Index].State)
+            {
+                Entry = FspFileSystemTraceContextLookup(&NewMap,
+                    Map->Entries[Index].Key[0], Map->Entries[Index].Key[1], TRUE);
+                *Entry = Map->Entries[Index];
+                NewMap.Count++;
+            }
+
+        MemFree(Map->Entries);
+        *Map = NewMap;
+    }
+
+    Entry = FspFileSystemTraceContextLookup(Map, Key0, Key1, TRUE);
+    if (0 == Entry->State)
+        Map->Count++;
+    Entry->Key[0] = Key0;
+    Entry->Key[1] = Key1;
+    Entry->Value[0] = Value0;
+    Entry->Value[1] = Value1;
+    Entry->State = 1;
+
+    return STATUS_SUCCESS;
+}
+
+static BOOLEAN FspFileSystemTraceReplayRequest(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FSCTL_TRANSACT_REQ *Request, FSP_FSCTL_TRANSACT_RSP *Response,
+    FSP_FILE_SYSTEM_TRACE_CONTEXT_MAP *ContextMap, HANDLE AccessToken,
+    PVOID *PIoBuffer, PULONG PIoBufferSize)
+{
+    FSP_FILE_SYSTEM_TRACE_CONTEXT_ENTRY *Entry;
+    UINT64 *PUserContext = 0, *PUserContext2 = 0, *PAddress = 0, *PAccessToken = 0;
+    ULONG Length = 0;
+
+    switch (Request->Kind)
+    {
+    case FspFsctlTransactCreateKind:
+        PAccessToken = &Request->Req.Create.AccessToken;
+        break;
+    case FspFsctlTransactOverwriteKind:
+        PUserContext = &Request->Req.Overwrite.UserContext;
+        PUserContext2 = &Request->Req.Overwrite.UserContext2;
+        break;
+    case FspFsctlTransactCleanupKind:
+        PUserContext = &Request->Req.Cleanup.UserContext;
+        PUserContext2 = &Request->Req.Cleanup.UserContext2;
+        break;
+    case FspFsctlTransactCloseKind:
+        PUserContext = &Request->Req.Close.UserContext;
+        PUserContext2 = &Request->Req.Close.UserContext2;
+        break;
+    case FspFsctlTransactReadKind:
+        PUserContext = &Request->Req.Read.UserContext;
+        PUserContext2 = &Request->Req.Read.UserContext2;
+        PAddress = &Request->Req.Read.Address;
+        Length = Request->Req.Read.Length;
+        break;
+    case FspFsctlTransactWriteKind:
+        PUserContext = &Request->Req.Write.UserContext;
+        PUserContext2 = &Request->Req.Write.UserContext2;
+        PAddress = &Request->Req.Write.Address;
+        Length = Request->Req.Write.Length;
+        break;
+    case FspFsctlTransactQueryInformationKind:
+        PUserContext = &Request->Req.QueryInformation.UserContext;
+        PUserContext2 = &Request->Req.QueryInformation.UserContext2;
+        break;
+    case FspFsctlTransactSetInformationKind:
+        PUserContext = &Request->Req.SetInformation.UserContext;
+        PUserContext2 = &Request->Req.SetInformation.UserContext2;
+        if (10/*FileRenameInformation*/ == Request->Req.SetInformation.FileInformationClass)
+            PAccessToken = &Request->Req.SetInformation.Info.Rename.AccessToken;
+        break;
+    case FspFsctlTransactFlushBuffersKind:
+        PUserContext = &Request->Req.FlushBuffers.UserContext;
+        PUserContext2 = &Request->Req.FlushBuffers.UserContext2;
+        break;
+    case FspFsctlTransactQueryDirectoryKind:
+        PUserContext = &Request->Req.QueryDirectory.UserContext;
+        PUserContext2 = &Request->Req.QueryDirectory.UserContext2;
+        PAddress = &Request->Req.QueryDirectory.Address;
+        Length = Request->Req.QueryDirectory.Length;
+        break;
+    case FspFsctlTransactQuerySecurityKind:
+        PUserContext = &Request->Req.QuerySecurity.UserContext;
+        PUserContext2 = &Request->Req.QuerySecurity.UserContext2;
+        break;
+    case FspFsctlTransactSetSecurityKind:
+        PUserContext = &Request->Req.SetSecurity.UserContext;
+        PUserContext2 = &Request->Req.SetSecurity.UserContext2;
+        PAccessToken = &Request->Req.SetSecurity.AccessToken;
+        break;
+    }
+
+    if (0 != PUserContext)
+    {
+        /* the Create for this file was not recorded; the file context is unknown */
+        Entry = FspFileSystemTraceContextLookup(ContextMap, *PUserContext, *PUserContext2, FALSE);
+        if (0 == Entry)
+            return FALSE;
+
+        *PUserContext = Entry->Value[0];
+        *PUserContext2 = Entry->Value[1];
+
+        if (FspFsctlTransactCloseKind == Request->Kind)
+            Entry->State = 2;
+    }
+
+    if (0 != PAddress)
+    {
+        if (*PIoBufferSize < Length)
+        {
+            MemFree(*PIoBuffer);
+            *PIoBufferSize = 0;
+            *PIoBuffer = MemAlloc(Length);
+            if (0 == *PIoBuffer)
+                return FALSE;
+            *PIoBufferSize = Length;
+        }
+        *PAddress = (UINT64)(UINT_PTR)*PIoBuffer;
+    }
+
+    if (0 != PAccessToken && 0 != *PAccessToken)
+        *PAccessToken = (UINT64)(UINT_PTR)AccessToken;
+
+    FspFileSystemDispatchRequest(FileSystem, Request, Response);
+
+    return TRUE;
+}
+
+FSP_API NTSTATUS FspFileSystemReplayTrace(FSP_FILE_SYSTEM *FileSystem,
+    PWSTR TraceFileName, PULONG PRequestCount)
+{
+    HANDLE File = INVALID_HANDLE_VALUE, Mapping = 0;
+    HANDLE ProcessToken = 0, AccessToken = 0;
+    FSP_FILE_SYSTEM_TRACE_HEADER *Header = 0;
+    FSP_FILE_SYSTEM_TRACE_RECORD *Record;
+    FSP_FSCTL_TRANSACT_REQ *Request = 0;
+    FSP_FSCTL_TRANSACT_RSP *Response = 0, *RecordedResponse;
+    FSP_FILE_SYSTEM_TRACE_CONTEXT_MAP ContextMap = { 0 }, PendingMap = { 0 };
+    FSP_FILE_SYSTEM_TRACE_CONTEXT_ENTRY *Entry;
+    PUINT8 Data;
+    PVOID IoBuffer = 0;
+    ULONG IoBufferSize = 0, RequestCount = 0, DataSize = 0;
+    LARGE_INTEGER FileSize;
+    UINT64 Offset, Remain;
+    NTSTATUS Result;
+
+    if (0 != PRequestCount)
+        *PRequestCount = 0;
+
+    File = CreateFileW(TraceFileName,
+        GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, 0, OPEN_EXISTING, 0, 0);
+    if (INVALID_HANDLE_VALUE == File)
+    {
+        Result = FspNtStatusFromWin32(GetLastError());
+        goto exit;
+    }
+
+    if (!GetFileSizeEx(File, &FileSize))
+    {
+        Result = FspNtStatusFromWin32(GetLastError());
+        goto exit;
+    }
+    if (sizeof *Header > (UINT64)FileSize.QuadPart)
+    {
+        Result = STATUS_FILE_CORRUPT_ERROR;
+        goto exit;
+    }
+
+    Mapping = CreateFileMappingW(File, 0, PAGE_READONLY, 0, 0, 0);
+    if (0 == Mapping)
+    {
+        Result = FspNtStatusFromWin32(GetLastError());
+        goto exit;
+    }
+
+    Header = MapViewOfFile(Mapping, FILE_MAP_READ, 0, 0, 0);
+    if (0 == Header)
+    {
+        Result = FspNtStatusFromWin32(GetLastError());
+        goto exit;
+    }
+    Data = (PUINT8)(Header + 1);
+
+    if (0 != memcmp(Header->Signature, FSP_FILE_SYSTEM_TRACE_SIGNATURE, sizeof Header->Signature) ||
+        sizeof *Header != Header->Version ||
+        (UINT64)FileSize.QuadPart - sizeof *Header < Header->DataSize ||
+        0 != Header->DataSize % FSP_FSCTL_DEFAULT_ALIGNMENT ||
+        Header->DataSize < Header->Used ||
+        (0 != Header->DataSize && Header->DataSize <= Header->Tail))
+    {
+        Result = STATUS_FILE_CORRUPT_ERROR;
+        goto exit;
+    }
+
+    if (!OpenProcessToken(GetCurrentProcess(), TOKEN_QUERY | TOKEN_DUPLICATE, &ProcessToken) ||
+        !DuplicateToken(ProcessToken, SecurityImpersonation, &AccessToken))
+    {
+        Result = FspNtStatusFromWin32(GetLastError());
+        goto exit;
+    }
+
+    Request = MemAlloc(FileSystem->RequestSizeMax);
+    Response = MemAlloc(FileSystem->ResponseSizeMax);
+    if (0 == Request || 0 == Response)
+    {
+        Result = STATUS_INSUFFICIENT_RESOURCES;
+        goto exit;
+    }
+
+    for (Offset = Header->Tail, Remain = Header->Used; 0 != Remain;)
+    {
+        Record = (PVOID)(Data + Offset);
+        if (Header->DataSize - Offset < FSP_FSCTL_DEFAULT_ALIGNMENT ||
+            FSP_FSCTL_DEFAULT_ALIGNMENT > Record->Size ||
+            0 != Record->Size % FSP_FSCTL_DEFAULT_ALIGNMENT ||
+            Header->DataSize - Offset < Record->Size ||
+            Remain < Record->Size)
+        {
+            Result = STATUS_FILE_CORRUPT_ERROR;
+            goto exit;
+        }
+
+        if (FspFileSystemTraceRequestKind == Record->Kind ||
+            FspFileSystemTraceResponseKind == Record->Kind)
+        {
+            if (sizeof *Record + sizeof(UINT16) * 2 > Record->Size)
+            {
+                Result = STATUS_FILE_CORRUPT_ERROR;
+                goto exit;
+            }
+            DataSize = Record->Size - sizeof *Record;
+        }
+
+        switch (Record->Kind)
+        {
+        case FspFileSystemTraceRequestKind:
+            if (sizeof *Request > ((FSP_FSCTL_TRANSACT_REQ *)Record->Data)->Size ||
+                DataSize < ((FSP_FSCTL_TRANSACT_REQ *)Record->Data)->Size ||
+                FileSystem->RequestSizeMax < ((FSP_FSCTL_TRANSACT_REQ *)Record->Data)->Size)
+            {
+                Result = STATUS_FILE_CORRUPT_ERROR;
+                goto exit;
+            }
+
+            memcpy(Request, Record->Data, ((FSP_FSCTL_TRANSACT_REQ *)Record->Data)->Size);
+            if (!FspFileSystemTraceReplayRequest(FileSystem, Request, Response,
+                &ContextMap, AccessToken, &IoBuffer, &IoBufferSize))
+                break;
+
+            RequestCount++;
+
+            if (FspFsctlTransactCreateKind == Request->Kind &&
+                STATUS_PENDING != Response->IoStatus.Status &&
+                STATUS_REPARSE != Response->IoStatus.Status &&
+                NT_SUCCESS(Response->IoStatus.Status))
+            {
+                Result = FspFileSystemTraceContextInsert(&PendingMap, Request->Hint, 0,
+                    Response->Rsp.Create.Opened.UserContext,
+                    Response->Rsp.Create.Opened.UserContext2);
+                if (!NT_SUCCESS(Result))
+                    goto exit;
+            }
+            break;
+
+        case FspFileSystemTraceResponseKind:
+            RecordedResponse = (PVOID)Record->Data;
+            if (sizeof *RecordedResponse > RecordedResponse->Size ||
+                DataSize < RecordedResponse->Size)
+            {
+                Result = STATUS_FILE_CORRUPT_ERROR;
+                goto exit;
+            }
+
+            if (FspFsctlTransactCreateKind != RecordedResponse->Kind)
+                break;
+
+            Entry = FspFileSystemTraceContextLookup(&PendingMap, RecordedResponse->Hint, 0, FALSE);
+            if (0 == Entry)
+                break;
+            Entry->State = 2;
+
+            if (NT_SUCCESS(RecordedResponse->IoStatus.Status) &&
+                STATUS_REPARSE != RecordedResponse->IoStatus.Status)
+            {
+                Result = FspFileSystemTraceContextInsert(&ContextMap,
+                    RecordedResponse->Rsp.Create.Opened.UserContext,
+                    RecordedResponse->Rsp.Create.Opened.UserContext2,
+                    Entry->Value[0], Entry->Value[1]);
+                if (!NT_SUCCESS(Result))
+                    goto exit;
+            }
+            break;
+        }
+
+        Remain -= Record->Size;
+        Offset += Record->Size;
+        if (FspFileSystemTraceWrapKind == Record->Kind || Header->DataSize == Offset)
+            Offset = 0;
+    }
+
+    if (0 != PRequestCount)
+        *PRequestCount = RequestCount;
+
+    Result = STATUS_SUCCESS;
+
+exit:
+    MemFree(PendingMap.Entries);
+    MemFree(ContextMap.Entries);
+    MemFree(IoBuffer);
+    MemFree(Response);
+    MemFree(Request);
+
+    if (0 != AccessToken)
+        CloseHandle(AccessToken);
+    if (0 != ProcessToken)
+        CloseHandle(ProcessToken);
+
+    if (0 != Header)
+        UnmapViewOfFile(Header);
+    if (0 != Mapping)
+        CloseHandle(Mapping);
+    if (INVALID_HANDLE_VALUE != File)
+        CloseHandle(File);
+
+    return Result;
+}
@@ -0,0 +1,240 @@
+/**
+ * @file shared/attrcache.h
+ *
+ * @copyright 2015-2016 Bill Zissimopoulos
+ */
+/*
+ * This file is part of WinFsp.
+ *
+ * You can redistribute it and/or modify it under the terms of the
+ * GNU Affero General Public License version 3 as published by the
+ * Free Software Foundation.
+ *
+ * Licensees holding a valid commercial license may use this file in
+ * accordance with the commercial license agreement provided with the
+ * software.
+ */
+
+#ifndef WINFSP_SHARED_ATTRCACHE_H_INCLUDED
+#define WINFSP_SHARED_ATTRCACHE_H_INCLUDED
+
+/*
+ * Attribute Cache Table
+ *
+ * The attribute cache remembers the result of a FUSE getattr (converted to WinFsp
+ * FileInfo and POSIX uid/gid/mode) by POSIX path. It implements the libfuse attr_timeout,
+ * entry_timeout and negative_timeout options:
+ *
+ * - Lookups by name (no open file) are satisfied for EntryTimeout.
+ * - Lookups on an open file are satisfied for AttrTimeout.
+ * - Names that were not found are remembered for NegativeTimeout.
+ *
+ * The caller invalidates entries whenever it changes a file (create, truncate, setattr,
+ * rename, unlink); a write updates the cached file size instead, so that writes do not
+ * need a getattr. A getattr that races with an invalidation or a size update must not
+ * insert stale data. For this reason every bucket has a generation number that is
+ * incremented whenever an entry in it is invalidated or updated, and the table has a
+ * generation number that is incremented when all entries are invalidated (e.g. when a
+ * directory is renamed). Lookup returns the token (both generation numbers) for the path
+ * and an insert with that token is rejected if either has changed since. Changes to
+ * paths in other buckets do not affect each other.
+ *
+ * When the table reaches its capacity it is simply emptied. The attribute cache table
+ * never allocates or frees memory; entries are allocated by the caller and removed
+ * entries are returned to it in the free list. An FSP_ATTR_CACHE_TABLE is not
+ * synchronized; Lookup does not modify the table and may run under a shared lock.
+ */
+
+#define FspAttrCacheBucketCount         4096
+
+typedef struct _FSP_ATTR_CACHE_ENTRY
+{
+    struct _FSP_ATTR_CACHE_ENTRY *DictNext;
+    UINT64 InsertTime;
+    ULONG Hash;
+    ULONG PathLength;                   /* bytes; not including term-0 */
+    NTSTATUS Result;
+    UINT32 Uid, Gid, Mode;
+    FSP_FSCTL_FILE_INFO FileInfo;
+    char Path[];                        /* term-0 */
+} FSP_ATTR_CACHE_ENTRY;
+
+typedef struct
+{
+    FSP_ATTR_CACHE_ENTRY *Head;
+    ULONG Generation;
+} FSP_ATTR_CACHE_BUCKET;
+
+typedef struct
+{
+    UINT64 AttrTimeout, EntryTimeout, NegativeTimeout;
+    ULONG Capacity, EntryCount;
+    ULONG Generation;
+    UINT64 Rejects;
+    FSP_ATTR_CACHE_ENTRY *FreeList;     /* removed entries (linked through DictNext) */
+    FSP_ATTR_CACHE_BUCKET Buckets[FspAttrCacheBucketCount];
+} FSP_ATTR_CACHE_TABLE;
+
+static inline
+ULONG FspAttrCacheHashPath(const char *Path, ULONG PathLength)
+{
+    /* FNV-1a */
+    UINT32 Hash = 2166136261;
+    for (ULONG I = 0; PathLength > I; I++)
+    {
+        Hash ^= (UINT8)Path[I];
+        Hash *= 16777619;
+    }
+    return Hash;
+}
+static inline
+FSP_ATTR_CACHE_BUCKET *FspAttrCacheTableBucket(FSP_ATTR_CACHE_TABLE *Table, ULONG Hash)
+{
+    return &Table->Buckets[Hash % FspAttrCacheBucketCount];
+}
+static inline
+VOID FspAttrCacheTableInitialize(FSP_ATTR_CACHE_TABLE *Table, ULONG Capacity,
+    UINT64 AttrTimeout, UINT64 EntryTimeout, UINT64 NegativeTimeout)
+{
+    RtlZeroMemory(Table, sizeof *Table);
+    Table->Capacity = 0 != Capacity ? Capacity : 1;
+    Table->AttrTimeout = AttrTimeout;
+    Table->EntryTimeout = EntryTimeout;
+    Table->NegativeTimeout = NegativeTimeout;
+}
+static inline
+UINT64 FspAttrCacheTableToken(FSP_ATTR_CACHE_TABLE *Table, ULONG Hash)
+{
+    return ((UINT64)Table->Generation << 32) | FspAttrCacheTableBucket(Table, Hash)->Generation;
+}
+static inline
+FSP_ATTR_CACHE_ENTRY **FspAttrCacheTableFind(FSP_ATTR_CACHE_TABLE *Table,
+    const char *Path, ULONG PathLength, ULONG Hash)
+{
+    FSP_ATTR_CACHE_ENTRY **P;
+    for (P = &FspAttrCacheTableBucket(Table, Hash)->Head; 0 != *P; P = &(*P)->DictNext)
+        if ((*P)->Hash == Hash &&
+            (*P)->PathLength == PathLength && 0 == memcmp((*P)->Path, Path, PathLength))
+            break;
+    return P;
+}
+static inline
+VOID FspAttrCacheTableRemoveEntry(FSP_ATTR_CACHE_TABLE *Table, FSP_ATTR_CACHE_ENTRY **P)
+{
+    FSP_ATTR_CACHE_ENTRY *Entry = *P;
+    *P = Entry->DictNext;
+    Entry->DictNext = Table->FreeList;
+    Table->FreeList = Entry;
+    Table->EntryCount--;
+}
+static inline
+VOID FspAttrCacheTableClear(FSP_ATTR_CACHE_TABLE *Table)
+{
+    for (ULONG I = 0; FspAttrCacheBucketCount > I; I++)
+        while (0 != Table->Buckets[I].Head)
+            FspAttrCacheTableRemoveEntry(Table, &Table->Buckets[I].Head);
+}
+static inline
+FSP_ATTR_CACHE_ENTRY *FspAttrCacheTableLookup(FSP_ATTR_CACHE_TABLE *Table,
+    const char *Path, ULONG PathLength, BOOLEAN IsOpen, UINT64 CurrentTime, PUINT64 PToken)
+{
+    /*
+     * Return the entry for Path if it has not expired; otherwise return 0. In both cases
+     * return in *PToken the token that a subsequent insert for Path must provide.
+     */
+    ULONG Hash = FspAttrCacheHashPath(Path, PathLength);
+    FSP_ATTR_CACHE_ENTRY *Entry;
+    UINT64 Timeout;
+
+    *PToken = FspAttrCacheTableToken(Table, Hash);
+
+    Entry = *FspAttrCacheTableFind(Table, Path, PathLength, Hash);
+    if (0 != Entry)
+    {
+        if (NT_SUCCESS(Entry->Result))
+            Timeout = IsOpen ? Table->AttrTimeout : Table->EntryTimeout;
+        else
+            Timeout = Table->NegativeTimeout;
+        if (CurrentTime - Entry->InsertTime < Timeout)
+            return Entry;
+    }
+
+    return 0;
+}
+static inline
+BOOLEAN FspAttrCacheTableInsert(FSP_ATTR_CACHE_TABLE *Table, FSP_ATTR_CACHE_ENTRY *Entry,
+    UINT64 Token)
+{
+    /*
+     * The caller must fill in all fields of the Entry other than DictNext and Hash. If the
+     * token has changed since the lookup the Entry is rejected and remains the caller's.
+     */
+    FSP_ATTR_CACHE_ENTRY **P;
+
+    Entry->Hash = FspAttrCacheHashPath(Entry->Path, Entry->PathLength);
+    if (FspAttrCacheTableToken(Table, Entry->Hash) != Token)
+    {
+        /* an invalidation happened since the lookup; the data may be stale */
+        Table->Rejects++;
+        return FALSE;
+    }
+
+    P = FspAttrCacheTableFind(Table, Entry->Path, Entry->PathLength, Entry->Hash);
+    if (0 != *P)
+        FspAttrCacheTableRemoveEntry(Table, P);
+    else if (Table->Capacity <= Table->EntryCount)
+    {
+        FspAttrCacheTableClear(Table);
+        P = &FspAttrCacheTableBucket(Table, Entry->Hash)->Head;
+    }
+    Entry->DictNext = *P;
+    *P = Entry;
+    Table->EntryCount++;
+
+    return TRUE;
+}
+static inline
+VOID FspAttrCacheTableUpdateSize(FSP_ATTR_CACHE_TABLE *Table,
+    const char *Path, ULONG PathLength, UINT64 FileSize, UINT64 AllocationSize)
+{
+    /* a file grew; a concurrent getattr may have seen the old size and must not insert it */
+    ULONG Hash = FspAttrCacheHashPath(Path, PathLength);
+    FSP_ATTR_CACHE_ENTRY *Entry;
+
+    FspAttrCacheTableBucket(Table, Hash)->Generation++;
+
+    Entry = *FspAttrCacheTableFind(Table, Path, PathLength, Hash);
+    if (0 != Entry && NT_SUCCESS(Entry->Result) && Entry->FileInfo.FileSize < FileSize)
+    {
+        Entry->FileInfo.FileSize = FileSize;
+        Entry->FileInfo.AllocationSize = AllocationSize;
+    }
+}
+static inline
+VOID FspAttrCacheTableInvalidate(FSP_ATTR_CACHE_TABLE *Table,
+    const char *Path, ULONG PathLength)
+{
+    ULONG Hash = FspAttrCacheHashPath(Path, PathLength);
+    FSP_ATTR_CACHE_ENTRY **P;
+
+    FspAttrCacheTableBucket(Table, Hash)->Generation++;
+
+    P = FspAttrCacheTableFind(Table, Path, PathLength, Hash);
+    if (0 != *P)
+        FspAttrCacheTableRemoveEntry(Table, P);
+}
+static inline
+VOID FspAttrCacheTableInvalidateAll(FSP_ATTR_CACHE_TABLE *Table)
+{
+    Table->Generation++;
+    FspAttrCacheTableClear(Table);
+}
+static inline
+FSP_ATTR_CACHE_ENTRY *FspAttrCacheTableTakeFreeList(FSP_ATTR_CACHE_TABLE *Table)
+{
+    FSP_ATTR_CACHE_ENTRY *FreeList = Table->FreeList;
+    Table->FreeList = 0;
+    return FreeList;
+}
+
+#endif
@@ -0,0 +1,259 @@
+/**
+ * @file shared/dircache.h
+ *
+ * @copyright 2015-2016 Bill Zissimopoulos
+ */
+/*
+ * This file is part of WinFsp.
+ *
+ * You can redistribute it and/or modify it under the terms of the
+ * GNU Affero General Public License version 3 as published by the
+ * Free Software Foundation.
+ *
+ * Licensees holding a valid commercial license may use this file in
+ * accordance with the commercial license agreement provided with the
+ * software.
+ */
+
+#ifndef WINFSP_SHARED_DIRCACHE_H_INCLUDED
+#define WINFSP_SHARED_DIRCACHE_H_INCLUDED
+
+/*
+ * Directory Cache Pages
+ *
+ * A directory listing is cached as a sequence of pages. A page holds the FSP_FSCTL_DIR_INFO
+ * entries that the user mode file system returned for a single QueryDirectory request
+ * (in the same format, so that they can be copied to QueryDirectory buffers directly),
+ * preceded by a table of entry positions. A page that ends the directory also contains the
+ * end of directory marker (a DirInfo whose Size is less than sizeof(FSP_FSCTL_DIR_INFO)).
+ *
+ * Pages are listed in a page index in directory order: a page's Offset (the directory
+ * offset that it was read at) is the NextOffset of the previous page. A directory offset
+ * to resume an enumeration at is looked up in two steps: first the page whose range
+ * contains the offset, then the entry whose NextOffset is the offset. When the offsets
+ * that the user mode file system returns are increasing (e.g. byte positions) both steps
+ * are binary searches. Otherwise (e.g. when offsets are index numbers) a page is searched
+ * linearly and the caller has to remember (or search for) the page.
+ *
+ * Pages and page indexes are immutable once built; adding a page to a listing builds a
+ * new page index. This code never allocates memory and is not synchronized.
+ */
+
+typedef struct
+{
+    UINT64 Offset;                      /* directory offset the page was read at */
+    UINT64 NextOffset;                  /* directory offset after the last entry */
+    ULONG EntryCount;
+    BOOLEAN Sorted;                     /* entry offsets are increasing */
+    BOOLEAN EndOfDirectory;             /* page ends with the end of directory marker */
+    ULONG EntryPositions[];             /* entry positions (from the start of the page) */
+} FSP_DIR_CACHE_PAGE;
+
+typedef struct
+{
+    UINT64 Offset, NextOffset;
+    UINT64 ItemIndex;                   /* page identifier (e.g. meta cache item index) */
+    ULONG Size;
+    BOOLEAN Sorted;
+} FSP_DIR_CACHE_INDEX_ENTRY;
+
+typedef struct
+{
+    UINT64 Size;                        /* total size of all pages */
+    ULONG PageCount;
+    BOOLEAN Sorted;                     /* all pages are sorted */
+    BOOLEAN Complete;                   /* last page ends with the end of directory marker */
+    FSP_DIR_CACHE_INDEX_ENTRY Pages[];
+} FSP_DIR_CACHE_INDEX;
+
+static inline
+ULONG FspDirCachePageScan(PCVOID Buffer, ULONG Size,
+    PULONG PEntryCount, PULONG PEntriesSize, PBOOLEAN PEndOfDirectory)
+{
+    /*
+     * Scan a QueryDirectory response; return the size of the page that it becomes.
+     * Entries that do not fit in the response are ignored.
+     */
+    const FSP_FSCTL_DIR_INFO *DirInfo;
+    ULONG Position = 0, EntryCount = 0, EntriesSize = 0, HeaderSize;
+    BOOLEAN EndOfDirectory = FALSE;
+    while (Position + sizeof(DirInfo->Size) <= Size)
+    {
+        DirInfo = (const FSP_FSCTL_DIR_INFO *)((const UINT8 *)Buffer + Position);
+        if (sizeof(FSP_FSCTL_DIR_INFO) > DirInfo->Size)
+        {
+            EndOfDirectory = TRUE;
+            break;
+        }
+        if (Position + DirInfo->Size > Size)
+            break;
+        EntryCount++;
+        Position += FSP_FSCTL_DEFAULT_ALIGN_UP(DirInfo->Size);
+        EntriesSize = Position;
+    }
+    HeaderSize = FSP_FSCTL_DEFAULT_ALIGN_UP(
+        FIELD_OFFSET(FSP_DIR_CACHE_PAGE, EntryPositions) + EntryCount * sizeof(ULONG));
+    *PEntryCount = EntryCount;
+    *PEntriesSize = EntriesSize;
+    *PEndOfDirectory = EndOfDirectory;
+    return HeaderSize + EntriesSize +
+        (EndOfDirectory ? FSP_FSCTL_DEFAULT_ALIGN_UP(sizeof(DirInfo->Size)) : 0);
+}
+static inline
+VOID FspDirCachePageBuild(FSP_DIR_CACHE_PAGE *Page, UINT64 Offset, PCVOID Buffer,
+    ULONG EntryCount, ULONG EntriesSize, BOOLEAN EndOfDirectory)
+{
+    /* build a page from a response scanned by FspDirCachePageScan */
+    const FSP_FSCTL_DIR_INFO *DirInfo;
+    ULONG HeaderSize, Position = 0;
+    UINT64 NextOffset = Offset;
+    BOOLEAN Sorted = TRUE;
+    HeaderSize = FSP_FSCTL_DEFAULT_ALIGN_UP(
+        FIELD_OFFSET(FSP_DIR_CACHE_PAGE, EntryPositions) + EntryCount * sizeof(ULONG));
+    for (ULONG I = 0; EntryCount > I; I++)
+    {
+        DirInfo = (const FSP_FSCTL_DIR_INFO *)((const UINT8 *)Buffer + Position);
+        Page->EntryPositions[I] = HeaderSize + Position;
+        Sorted = Sorted && NextOffset < DirInfo->NextOffset;
+        NextOffset = DirInfo->NextOffset;
+        Position += FSP_FSCTL_DEFAULT_ALIGN_UP(DirInfo->Size);
+    }
+    Page->Offset = Offset;
+    Page->NextOffset = NextOffset;
+    Page->EntryCount = EntryCount;
+    Page->Sorted = Sorted;
+    Page->EndOfDirectory = EndOfDirectory;
+    RtlCopyMemory((PUINT8)Page + HeaderSize, Buffer, EntriesSize);
+    if (EndOfDirectory)
+        RtlZeroMemory((PUINT8)Page + HeaderSize + EntriesSize,
+            FSP_FSCTL_DEFAULT_ALIGN_UP(sizeof DirInfo->Size));
+}
+static inline
+FSP_FSCTL_DIR_INFO *FspDirCachePageEntry(const FSP_DIR_CACHE_PAGE *Page, ULONG Index)
+{
+    /* Index == EntryCount is the end of the entries (or the end of directory marker) */
+    if (Page->EntryCount > Index)
+        return (FSP_FSCTL_DIR_INFO *)((PUINT8)Page + Page->EntryPositions[Index]);
+    if (0 == Page->EntryCount)
+        return (FSP_FSCTL_DIR_INFO *)((PUINT8)Page + FSP_FSCTL_DEFAULT_ALIGN_UP(
+            FIELD_OFFSET(FSP_DIR_CACHE_PAGE, EntryPositions)));
+    return (FSP_FSCTL_DIR_INFO *)((PUINT8)Page + Page->EntryPositions[Page->EntryCount - 1] +
+        FSP_FSCTL_DEFAULT_ALIGN_UP(FspDirCachePageEntry(Page, Page->EntryCount - 1)->Size));
+}
+static inline
+ULONG FspDirCachePageFind(const FSP_DIR_CACHE_PAGE *Page, UINT64 DirectoryOffset)
+{
+    /*
+     * Return the index of the entry that follows DirectoryOffset (EntryCount if it is
+     * the last entry) or -1 if DirectoryOffset is not in this page.
+     */
+    if (Page->Offset == DirectoryOffset)
+        return 0;
+    if (Page->Sorted)
+    {
+        ULONG Lo = 0, Hi = Page->EntryCount, Mi;
+        UINT64 NextOffset;
+        while (Lo < Hi)
+        {
+            Mi = Lo + (Hi - Lo) / 2;
+            NextOffset = FspDirCachePageEntry(Page, Mi)->NextOffset;
+            if (NextOffset == DirectoryOffset)
+                return Mi + 1;
+            else if (NextOffset < DirectoryOffset)
+                Lo = Mi + 1;
+            else
+                Hi = Mi;
+        }
+    }
+    else
+    {
+        for (ULONG I = 0; Page->EntryCount > I; I++)
+            if (FspDirCachePageEntry(Page, I)->NextOffset == DirectoryOffset)
+                return I + 1;
+    }
+    return (ULONG)-1;
+}
+static inline
+ULONG FspDirCacheIndexSize(ULONG PageCount)
+{
+    return (ULONG)(FIELD_OFFSET(FSP_DIR_CACHE_INDEX, Pages) +
+        PageCount * sizeof(FSP_DIR_CACHE_INDEX_ENTRY));
+}
+static inline
+BOOLEAN FspDirCacheIndexCanAppend(const FSP_DIR_CACHE_INDEX *Index, UINT64 Offset,
+    ULONG PageSize, UINT64 SizeMax)
+{
+    /* can a page read at Offset be added to the listing? (Index == 0 for a new listing) */
+    if (0 == Index)
+        return 0 == Offset && PageSize <= SizeMax;
+    return !Index->Complete && 0 < Index->PageCount &&
+        Index->Pages[Index->PageCount - 1].NextOffset == Offset &&
+        Index->Size + PageSize <= SizeMax;
+}
+static inline
+VOID FspDirCacheIndexAppend(FSP_DIR_CACHE_INDEX *NewIndex, const FSP_DIR_CACHE_INDEX *Index,
+    const FSP_DIR_CACHE_PAGE *Page, ULONG PageSize, UINT64 ItemIndex)
+{
+    /* NewIndex must have room for FspDirCacheIndexSize(Index->PageCount + 1) bytes */
+    FSP_DIR_CACHE_INDEX_ENTRY *Entry;
+    if (0 != Index)
+        RtlCopyMemory(NewIndex, Index, FspDirCacheIndexSize(Index->PageCount));
+    else
+    {
+        RtlZeroMemory(NewIndex, sizeof *NewIndex);
+        NewIndex->Sorted = TRUE;
+    }
+    Entry = &NewIndex->Pages[NewIndex->PageCount++];
+    Entry->Offset = Page->Offset;
+    Entry->NextOffset = Page->NextOffset;
+    Entry->ItemIndex = ItemIndex;
+    Entry->Size = PageSize;
+    Entry->Sorted = Page->Sorted;
+    NewIndex->Size += PageSize;
+    NewIndex->Sorted = NewIndex->Sorted && Page->Sorted;
+    NewIndex->Complete = Page->EndOfDirectory;
+}
+static inline
+ULONG FspDirCacheIndexFind(const FSP_DIR_CACHE_INDEX *Index, UINT64 DirectoryOffset, ULONG Hint)
+{
+    /*
+     * Return the page that contains DirectoryOffset or PageCount if it is past the cached
+     * (incomplete) listing. If the listing is not sorted this is only a guess (Hint unless DirectoryOffset
+     * starts a page); the caller must verify it with FspDirCachePageFind and search the other
+     * pages if that fails.
+     */
+    ULONG PageCount = Index->PageCount;
+    if (0 == PageCount)
+        return 0;
+    if (0 == DirectoryOffset)
+        return 0;
+    if (!Index->Complete &&
+        Index->Pages[PageCount - 1].NextOffset == DirectoryOffset &&
+        Index->Pages[PageCount - 1].Offset != DirectoryOffset)
+        return PageCount;
+    if (Index->Sorted)
+    {
+        /* find the last page with Offset <= DirectoryOffset */
+        ULONG Lo = 0, Hi = PageCount, Mi;
+        while (Lo < Hi)
+        {
+            Mi = Lo + (Hi - Lo) / 2;
+            if (Index->Pages[Mi].Offset <= DirectoryOffset)
+                Lo = Mi + 1;
+            else
+                Hi = Mi;
+        }
+        if (0 == Lo || DirectoryOffset > Index->Pages[Lo - 1].NextOffset)
+            return PageCount;
+        return Lo - 1;
+    }
+    if (PageCount > Hint)
+    {
+        if (Index->Pages[Hint].NextOffset == DirectoryOffset && PageCount > Hint + 1)
+            return Hint + 1;
+        return Hint;
+    }
+    return 0;
+}
+
+#endif
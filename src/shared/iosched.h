@@ -0,0 +1,248 @@
+/**
+ * @file shared/iosched.h
+ *
+ * @copyright 2015-2016 Bill Zissimopoulos
+ */
+/*
+ * This file is part of WinFsp.
+ *
+ * You can redistribute it and/or modify it under the terms of the
+ * GNU Affero General Public License version 3 as published by the
+ * Free Software Foundation.
+ *
+ * Licensees holding a valid commercial license may use this file in
+ * accordance with the commercial license agreement provided with the
+ * software.
+ */
+
+#ifndef WINFSP_SHARED_IOSCHED_H_INCLUDED
+#define WINFSP_SHARED_IOSCHED_H_INCLUDED
+
+/*
+ * I/O Scheduler
+ *
+ * The I/O scheduler orders the entries of a queue so that a single source of requests
+ * cannot starve the others. Entries are split into classes (paging I/O, metadata, data)
+ * and the scheduler dequeues from the classes in weighted round-robin order: a class gets
+ * up to Weight consecutive dequeues and then the next non-empty class gets its turn.
+ *
+ * Within a class entries are further split into flows by a hash of their originating
+ * process, so that processes that hash to different flows get fair service (processes
+ * that collide share a flow, as in stochastic fairness queueing). Flows are served in
+ * deficit round-robin order: every time a flow comes to the head of the class's active
+ * flow ring its deficit is increased by Quantum; it is then served while the cost of its
+ * first entry does not exceed its deficit. Entries within a flow are kept in FIFO order.
+ * Costs are provided by the caller; e.g. a large write costs more than an open.
+ *
+ * Entries are LIST_ENTRY's, so that an IRP can be queued using its Tail.Overlay.ListEntry.
+ * The scheduler does not remember the class and flow of an entry: the caller must provide
+ * the same ones to Insert and Remove. Select chooses the next entry without removing it;
+ * the caller then removes it and the scheduler charges the entry's flow and class only if
+ * it is the one last selected (so that canceled entries are not charged). SelectNext
+ * continues a selection past an entry that the caller could not remove. This code never
+ * allocates memory and is not synchronized.
+ */
+
+enum
+{
+    FspIoSchedPagingClass = 0,          /* paging I/O and flushes */
+    FspIoSchedMetadataClass,            /* creates, cleanups, queries, directory listings, etc. */
+    FspIoSchedDataClass,                /* non-paging reads and writes */
+    FspIoSchedClassCount,
+    FspIoSchedFlowCount = 16,           /* per class; must be a power of 2 */
+};
+
+typedef struct
+{
+    LIST_ENTRY EntryList;               /* entries in FIFO order */
+    LIST_ENTRY ActiveLink;              /* link in the class's active flow ring when non-empty */
+    ULONG Deficit;
+    ULONG Count;
+} FSP_IO_SCHED_FLOW;
+
+typedef struct
+{
+    FSP_IO_SCHED_FLOW Flows[FspIoSchedFlowCount];
+    LIST_ENTRY ActiveFlowList;
+    BOOLEAN HeadCredited;               /* has the head flow received its quantum? */
+    ULONG Weight, Credit;
+    ULONG Count;
+} FSP_IO_SCHED_CLASS;
+
+typedef ULONG FSP_IO_SCHED_COST(PLIST_ENTRY Entry, PVOID Context);
+
+typedef struct
+{
+    FSP_IO_SCHED_CLASS Classes[FspIoSchedClassCount];
+    ULONG Quantum;
+    ULONG ClassIndex;                   /* class whose turn it is */
+    ULONG Count;
+    PLIST_ENTRY Selected;
+    ULONG SelectedCost;
+} FSP_IO_SCHED;
+
+static inline
+VOID FspIoSchedListInsertTail(PLIST_ENTRY Head, PLIST_ENTRY Entry)
+{
+    Entry->Flink = Head;
+    Entry->Blink = Head->Blink;
+    Head->Blink->Flink = Entry;
+    Head->Blink = Entry;
+}
+static inline
+VOID FspIoSchedListRemove(PLIST_ENTRY Entry)
+{
+    Entry->Blink->Flink = Entry->Flink;
+    Entry->Flink->Blink = Entry->Blink;
+}
+static inline
+VOID FspIoSchedInitialize(FSP_IO_SCHED *Sched, const ULONG Weights[FspIoSchedClassCount],
+    ULONG Quantum)
+{
+    RtlZeroMemory(Sched, sizeof *Sched);
+    for (ULONG C = 0; FspIoSchedClassCount > C; C++)
+    {
+        FSP_IO_SCHED_CLASS *Class = Sched->Classes + C;
+        for (ULONG F = 0; FspIoSchedFlowCount > F; F++)
+            Class->Flows[F].EntryList.Flink = Class->Flows[F].EntryList.Blink =
+                &Class->Flows[F].EntryList;
+        Class->ActiveFlowList.Flink = Class->ActiveFlowList.Blink = &Class->ActiveFlowList;
+        Class->Weight = 0 != Weights[C] ? Weights[C] : 1;
+    }
+    Sched->Quantum = 0 != Quantum ? Quantum : 1;
+    Sched->Classes[0].Credit = Sched->Classes[0].Weight;
+}
+static inline
+ULONG FspIoSchedCount(FSP_IO_SCHED *Sched)
+{
+    return Sched->Count;
+}
+static inline
+VOID FspIoSchedInsert(FSP_IO_SCHED *Sched, PLIST_ENTRY Entry, ULONG ClassIndex, ULONG FlowHash)
+{
+    FSP_IO_SCHED_CLASS *Class = Sched->Classes + ClassIndex;
+    FSP_IO_SCHED_FLOW *Flow = Class->Flows + (FlowHash & (FspIoSchedFlowCount - 1));
+    if (0 == Flow->Count++)
+    {
+        /* newly active flows go to the tail of the ring */
+        Flow->Deficit = 0;
+        FspIoSchedListInsertTail(&Class->ActiveFlowList, &Flow->ActiveLink);
+    }
+    FspIoSchedListInsertTail(&Flow->EntryList, Entry);
+    Class->Count++;
+    Sched->Count++;
+}
+static inline
+VOID FspIoSchedRemove(FSP_IO_SCHED *Sched, PLIST_ENTRY Entry, ULONG ClassIndex, ULONG FlowHash)
+{
+    FSP_IO_SCHED_CLASS *Class = Sched->Classes + ClassIndex;
+    FSP_IO_SCHED_FLOW *Flow = Class->Flows + (FlowHash & (FspIoSchedFlowCount - 1));
+    if (Sched->Selected == Entry)
+    {
+        Flow->Deficit -= Sched->SelectedCost;
+        if (0 != Class->Credit)
+            Class->Credit--;
+    }
+    Sched->Selected = 0;
+    FspIoSchedListRemove(Entry);
+    if (0 == --Flow->Count)
+    {
+        /* empty flows leave the ring and forfeit their deficit */
+        if (Class->ActiveFlowList.Flink == &Flow->ActiveLink)
+            Class->HeadCredited = FALSE;
+        FspIoSchedListRemove(&Flow->ActiveLink);
+        Flow->Deficit = 0;
+    }
+    Class->Count--;
+    Sched->Count--;
+}
+static inline
+PLIST_ENTRY FspIoSchedSelect(FSP_IO_SCHED *Sched, FSP_IO_SCHED_COST *Cost, PVOID Context)
+{
+    /*
+     * Choose the entry to dequeue next; return 0 if the scheduler is empty. Selecting
+     * again without removing the selected entry chooses the same entry.
+     */
+    FSP_IO_SCHED_CLASS *Class;
+    FSP_IO_SCHED_FLOW *Flow;
+    PLIST_ENTRY Entry;
+    ULONG EntryCost;
+
+    if (0 == Sched->Count)
+        return 0;
+
+    /* weighted round-robin across classes */
+    for (;;)
+    {
+        Class = Sched->Classes + Sched->ClassIndex;
+        if (0 != Class->Count && 0 != Class->Credit)
+            break;
+        Sched->ClassIndex = (Sched->ClassIndex + 1) % FspIoSchedClassCount;
+        Sched->Classes[Sched->ClassIndex].Credit = Sched->Classes[Sched->ClassIndex].Weight;
+    }
+
+    /* deficit round-robin across the flows of the class */
+    for (;;)
+    {
+        Flow = CONTAINING_RECORD(Class->ActiveFlowList.Flink, FSP_IO_SCHED_FLOW, ActiveLink);
+        if (!Class->HeadCredited)
+        {
+            Flow->Deficit += Sched->Quantum;
+            Class->HeadCredited = TRUE;
+        }
+        Entry = Flow->EntryList.Flink;
+        EntryCost = Cost(Entry, Context);
+        if (EntryCost <= Flow->Deficit)
+            break;
+        FspIoSchedListRemove(&Flow->ActiveLink);
+        FspIoSchedListInsertTail(&Class->ActiveFlowList, &Flow->ActiveLink);
+        Class->HeadCredited = FALSE;
+    }
+
+    Sched->Selected = Entry;
+    Sched->SelectedCost = EntryCost;
+    return Entry;
+}
+static inline
+PLIST_ENTRY FspIoSchedNext(FSP_IO_SCHED *Sched, PLIST_ENTRY Entry)
+{
+    /*
+     * Enumerate all entries regardless of scheduling order: return the entry after Entry
+     * or the first entry if Entry is 0; return 0 at the end.
+     */
+    ULONG C = 0, F = 0;
+    if (0 != Entry)
+    {
+        Entry = Entry->Flink;
+        if ((PUINT8)Entry < (PUINT8)Sched || (PUINT8)Entry >= (PUINT8)(Sched + 1))
+            return Entry;
+        /* Entry is the list head of a flow; continue with the flow after it */
+        for (; FspIoSchedClassCount > C; C++, F = 0)
+            for (; FspIoSchedFlowCount > F; F++)
+                if (&Sched->Classes[C].Flows[F].EntryList == Entry)
+                    goto found;
+    found:
+        F++;
+    }
+    for (; FspIoSchedClassCount > C; C++, F = 0)
+        for (; FspIoSchedFlowCount > F; F++)
+            if (0 != Sched->Classes[C].Flows[F].Count)
+                return Sched->Classes[C].Flows[F].EntryList.Flink;
+    return 0;
+}
+static inline
+PLIST_ENTRY FspIoSchedSelectNext(FSP_IO_SCHED *Sched, PLIST_ENTRY Entry)
+{
+    /*
+     * Continue a selection past Entry, which the caller could not remove (e.g. because it
+     * is being canceled): return the entry after Entry in enumeration order, wrapping around
+     * at the end, or 0 once the enumeration comes back to the entry last selected. Entries
+     * returned this way are not charged when removed.
+     */
+    Entry = FspIoSchedNext(Sched, Entry);
+    if (0 == Entry && 0 != Sched->Selected)
+        Entry = FspIoSchedNext(Sched, 0);
+    return Sched->Selected != Entry ? Entry : 0;
+}
+
+#endif
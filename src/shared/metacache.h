@@ -0,0 +1,218 @@
+/**
+ * @file shared/metacache.h
+ *
+ * @copyright 2015-2016 Bill Zissimopoulos
+ */
+/*
+ * This file is part of WinFsp.
+ *
+ * You can redistribute it and/or modify it under the terms of the
+ * GNU Affero General Public License version 3 as published by the
+ * Free Software Foundation.
+ *
+ * Licensees holding a valid commercial license may use this file in
+ * accordance with the commercial license agreement provided with the
+ * software.
+ */
+
+#ifndef WINFSP_SHARED_METACACHE_H_INCLUDED
+#define WINFSP_SHARED_METACACHE_H_INCLUDED
+
+/*
+ * Meta Cache Shard
+ *
+ * The meta cache keeps variable sized items (security descriptors, directory
+ * listings) that are identified by a 64-bit item index. The cache is split into
+ * FspMetaCacheShardCount shards; item indexes are handed out round robin, so an
+ * item's shard is simply its index modulo the shard count and concurrent users
+ * are spread over the shards (and their locks).
+ *
+ * An FSP_META_CACHE_SHARD is a hash table of items together with two lists:
+ *
+ * - The expiration list keeps items in insertion order. As all items in a cache
+ * have the same timeout, this is also expiration order.
+ * - The LRU list keeps items in the order they were last used. A lookup moves
+ * an item to the end of the list.
+ *
+ * A shard accounts for the total size of its items (including their headers)
+ * and evicts least recently used items when this exceeds the shard capacity.
+ * It also counts hits, misses, evictions and expirations.
+ *
+ * An item is a single allocation that contains the item buffer. A shard never
+ * allocates or frees memory; it returns removed items to the caller instead.
+ * This allows the same code to be used in kernel mode (under a spin lock) and in
+ * user mode. An FSP_META_CACHE_SHARD is not synchronized.
+ */
+
+#define FspMetaCacheShardCount          8   /* must be a power of 2 */
+#define FspMetaCacheShardBucketCount    61
+
+typedef struct _FSP_META_CACHE_LINK
+{
+    struct _FSP_META_CACHE_LINK *Next, *Prev;
+} FSP_META_CACHE_LINK;
+
+typedef struct _FSP_META_CACHE_ITEM
+{
+    FSP_META_CACHE_LINK ExpirationLink, LruLink;
+    struct _FSP_META_CACHE_ITEM *DictNext;
+    UINT64 ItemIndex;
+    UINT64 ExpirationTime;
+    LONG RefCount;
+    ULONG Size;
+    __declspec(align(MEMORY_ALLOCATION_ALIGNMENT)) UINT8 Buffer[];
+} FSP_META_CACHE_ITEM;
+
+typedef struct
+{
+    UINT64 Hits, Misses, Evictions, Expirations;
+    ULONG ItemCount;
+    UINT64 ItemSize;
+} FSP_META_CACHE_STATISTICS;
+
+typedef struct
+{
+    UINT64 Capacity, ItemSize;
+    ULONG ItemCount;
+    UINT64 Hits, Misses, Evictions, Expirations;
+    FSP_META_CACHE_LINK ExpirationList, LruList;
+    FSP_META_CACHE_ITEM *ItemBuckets[FspMetaCacheShardBucketCount];
+} FSP_META_CACHE_SHARD;
+
+static inline
+VOID FspMetaCacheLinkInitialize(FSP_META_CACHE_LINK *Head)
+{
+    Head->Next = Head->Prev = Head;
+}
+static inline
+VOID FspMetaCacheLinkInsertTail(FSP_META_CACHE_LINK *Head, FSP_META_CACHE_LINK *Link)
+{
+    Link->Next = Head;
+    Link->Prev = Head->Prev;
+    Head->Prev->Next = Link;
+    Head->Prev = Link;
+}
+static inline
+VOID FspMetaCacheLinkRemove(FSP_META_CACHE_LINK *Link)
+{
+    Link->Prev->Next = Link->Next;
+    Link->Next->Prev = Link->Prev;
+}
+
+static inline
+ULONG FspMetaCacheShardIndex(UINT64 ItemIndex)
+{
+    return (ULONG)(ItemIndex & (FspMetaCacheShardCount - 1));
+}
+static inline
+ULONG FspMetaCacheItemChargeSize(ULONG Size)
+{
+    /* the size an item is charged against the capacity: its whole allocation */
+    return (ULONG)(sizeof(FSP_META_CACHE_ITEM) + Size);
+}
+static inline
+FSP_META_CACHE_ITEM **FspMetaCacheShardBucket(FSP_META_CACHE_SHARD *Shard, UINT64 ItemIndex)
+{
+    return &Shard->ItemBuckets[(ItemIndex / FspMetaCacheShardCount) % FspMetaCacheShardBucketCount];
+}
+static inline
+VOID FspMetaCacheShardInitialize(FSP_META_CACHE_SHARD *Shard, UINT64 Capacity)
+{
+    RtlZeroMemory(Shard, sizeof *Shard);
+    Shard->Capacity = Capacity;
+    FspMetaCacheLinkInitialize(&Shard->ExpirationList);
+    FspMetaCacheLinkInitialize(&Shard->LruList);
+}
+static inline
+FSP_META_CACHE_ITEM *FspMetaCacheShardLookup(FSP_META_CACHE_SHARD *Shard, UINT64 ItemIndex)
+{
+    for (FSP_META_CACHE_ITEM *Item = *FspMetaCacheShardBucket(Shard, ItemIndex);
+        0 != Item; Item = Item->DictNext)
+        if (Item->ItemIndex == ItemIndex)
+        {
+            /* most recently used: move to the end of the LRU list */
+            FspMetaCacheLinkRemove(&Item->LruLink);
+            FspMetaCacheLinkInsertTail(&Shard->LruList, &Item->LruLink);
+            Shard->Hits++;
+            return Item;
+        }
+    Shard->Misses++;
+    return 0;
+}
+static inline
+VOID FspMetaCacheShardInsert(FSP_META_CACHE_SHARD *Shard, FSP_META_CACHE_ITEM *Item)
+{
+    /* Item->ItemIndex must not already be in the shard */
+    FSP_META_CACHE_ITEM **PBucket = FspMetaCacheShardBucket(Shard, Item->ItemIndex);
+    Item->DictNext = *PBucket;
+    *PBucket = Item;
+    FspMetaCacheLinkInsertTail(&Shard->ExpirationList, &Item->ExpirationLink);
+    FspMetaCacheLinkInsertTail(&Shard->LruList, &Item->LruLink);
+    Shard->ItemSize += FspMetaCacheItemChargeSize(Item->Size);
+    Shard->ItemCount++;
+}
+static inline
+VOID FspMetaCacheShardRemoveItem(FSP_META_CACHE_SHARD *Shard, FSP_META_CACHE_ITEM *Item)
+{
+    for (FSP_META_CACHE_ITEM **P = FspMetaCacheShardBucket(Shard, Item->ItemIndex); *P; P = &(*P)->DictNext)
+        if (*P == Item)
+        {
+            *P = Item->DictNext;
+            break;
+        }
+    FspMetaCacheLinkRemove(&Item->ExpirationLink);
+    FspMetaCacheLinkRemove(&Item->LruLink);
+    Shard->ItemSize -= FspMetaCacheItemChargeSize(Item->Size);
+    Shard->ItemCount--;
+}
+static inline
+FSP_META_CACHE_ITEM *FspMetaCacheShardRemove(FSP_META_CACHE_SHARD *Shard, UINT64 ItemIndex)
+{
+    for (FSP_META_CACHE_ITEM *Item = *FspMetaCacheShardBucket(Shard, ItemIndex);
+        0 != Item; Item = Item->DictNext)
+        if (Item->ItemIndex == ItemIndex)
+        {
+            FspMetaCacheShardRemoveItem(Shard, Item);
+            return Item;
+        }
+    return 0;
+}
+static inline
+FSP_META_CACHE_ITEM *FspMetaCacheShardRemoveExpired(FSP_META_CACHE_SHARD *Shard, UINT64 CurrentTime)
+{
+    /* remove the oldest item if it has expired (CurrentTime == -1 removes any item) */
+    FSP_META_CACHE_ITEM *Item;
+    if (&Shard->ExpirationList == Shard->ExpirationList.Next)
+        return 0;
+    Item = CONTAINING_RECORD(Shard->ExpirationList.Next, FSP_META_CACHE_ITEM, ExpirationLink);
+    if (CurrentTime < Item->ExpirationTime)
+        return 0;
+    FspMetaCacheShardRemoveItem(Shard, Item);
+    Shard->Expirations++;
+    return Item;
+}
+static inline
+FSP_META_CACHE_ITEM *FspMetaCacheShardRemoveOverCapacity(FSP_META_CACHE_SHARD *Shard)
+{
+    /* remove the least recently used item if the shard is over capacity */
+    FSP_META_CACHE_ITEM *Item;
+    if (Shard->Capacity >= Shard->ItemSize || &Shard->LruList == Shard->LruList.Next)
+        return 0;
+    Item = CONTAINING_RECORD(Shard->LruList.Next, FSP_META_CACHE_ITEM, LruLink);
+    FspMetaCacheShardRemoveItem(Shard, Item);
+    Shard->Evictions++;
+    return Item;
+}
+static inline
+VOID FspMetaCacheShardAddStatistics(FSP_META_CACHE_SHARD *Shard,
+    FSP_META_CACHE_STATISTICS *Statistics)
+{
+    Statistics->Hits += Shard->Hits;
+    Statistics->Misses += Shard->Misses;
+    Statistics->Evictions += Shard->Evictions;
+    Statistics->Expirations += Shard->Expirations;
+    Statistics->ItemCount += Shard->ItemCount;
+    Statistics->ItemSize += Shard->ItemSize;
+}
+
+#endif
@@ -0,0 +1,263 @@
+/**
+ * @file shared/negcache.h
+ *
+ * @copyright 2015-2016 Bill Zissimopoulos
+ */
+/*
+ * This file is part of WinFsp.
+ *
+ * You can redistribute it and/or modify it under the terms of the
+ * GNU Affero General Public License version 3 as published by the
+ * Free Software Foundation.
+ *
+ * Licensees holding a valid commercial license may use this file in
+ * accordance with the commercial license agreement provided with the
+ * software.
+ */
+
+#ifndef WINFSP_SHARED_NEGCACHE_H_INCLUDED
+#define WINFSP_SHARED_NEGCACHE_H_INCLUDED
+
+/*
+ * Negative Name Cache Table
+ *
+ * The negative name cache remembers file names that the user mode file system has
+ * reported as not found, so that repeated opens of such names can be failed without
+ * a round trip to user mode. Entries are identified by their full path name; each
+ * entry also records a hash of its parent directory path.
+ *
+ * Entries are not removed when a directory changes; they are invalidated through
+ * generation numbers instead:
+ *
+ * - Parent directory hashes map to one of FspNegCacheGenerationCount generation
+ * numbers. Invalidating a parent (because a name was added, removed or renamed in it)
+ * increments its generation number.
+ * - A table wide generation number is incremented to invalidate all entries (e.g.
+ * when a directory is renamed and all names below it change).
+ *
+ * An entry is valid only while both generation numbers (together the "token") are the
+ * same as when the entry was inserted. The token for a name must be captured BEFORE
+ * the user mode file system is asked about the name and passed to the insert when it
+ * answers. If the parent was invalidated in the meantime (e.g. a concurrent create
+ * added the name) the insert is rejected, so a create racing a probe for the same
+ * name can never leave a stale entry behind.
+ *
+ * Entries expire in insertion order (all entries in a table have the same timeout) and
+ * the oldest entries are removed when the table goes over capacity. Like the meta cache
+ * the table never allocates or frees memory; entries are allocated by the caller and
+ * removed entries are returned to it. An FSP_NEG_CACHE_TABLE is not synchronized.
+ */
+
+#if !defined(FspNegCacheUpcaseChar)
+#define FspNegCacheUpcaseChar(c)        RtlUpcaseUnicodeChar(c)
+#endif
+
+#define FspNegCacheBucketCount          251
+#define FspNegCacheGenerationCount      256 /* must be a power of 2 */
+
+typedef struct _FSP_NEG_CACHE_LINK
+{
+    struct _FSP_NEG_CACHE_LINK *Next, *Prev;
+} FSP_NEG_CACHE_LINK;
+
+typedef struct _FSP_NEG_CACHE_ENTRY
+{
+    FSP_NEG_CACHE_LINK ExpirationLink;
+    struct _FSP_NEG_CACHE_ENTRY *DictNext;
+    UINT64 ExpirationTime;
+    UINT64 Token;
+    ULONG Hash, ParentHash;
+    USHORT NameLength;                  /* bytes */
+    WCHAR Name[];
+} FSP_NEG_CACHE_ENTRY;
+
+typedef struct
+{
+    ULONG Capacity, EntryCount;
+    BOOLEAN CaseInsensitive;
+    ULONG Generation;
+    ULONG ParentGenerations[FspNegCacheGenerationCount];
+    UINT64 Hits, Misses, Rejects;
+    FSP_NEG_CACHE_LINK ExpirationList;
+    FSP_NEG_CACHE_ENTRY *EntryBuckets[FspNegCacheBucketCount];
+} FSP_NEG_CACHE_TABLE;
+
+static inline
+VOID FspNegCacheHashName(BOOLEAN CaseInsensitive, PCWSTR Name, USHORT NameLength,
+    PULONG PHash, PULONG PParentHash)
+{
+    /*
+     * FNV-1a over the (upcased) name. The parent hash is the hash of the name up to its
+     * last backslash; so "\a\b" and "\a\c" share their parent hash with "\a\d:stream".
+     */
+    ULONG Hash = 2166136261, ParentHash = Hash;
+    WCHAR c;
+    for (PCWSTR P = Name, EndP = Name + NameLength / sizeof(WCHAR); EndP > P; P++)
+    {
+        c = *P;
+        if (L'\\' == c)
+            ParentHash = Hash;
+        if (CaseInsensitive)
+            c = FspNegCacheUpcaseChar(c);
+        Hash = (Hash ^ c) * 16777619;
+    }
+    *PHash = Hash;
+    if (0 != PParentHash)
+        *PParentHash = ParentHash;
+}
+static inline
+BOOLEAN FspNegCacheNameEqual(BOOLEAN CaseInsensitive,
+    PCWSTR Name1, PCWSTR Name2, USHORT NameLength)
+{
+    if (!CaseInsensitive)
+        return RtlEqualMemory(Name1, Name2, NameLength);
+    for (ULONG I = 0, N = NameLength / sizeof(WCHAR); N > I; I++)
+        if (Name1[I] != Name2[I] &&
+            FspNegCacheUpcaseChar(Name1[I]) != FspNegCacheUpcaseChar(Name2[I]))
+            return FALSE;
+    return TRUE;
+}
+static inline
+VOID FspNegCacheTableInitialize(FSP_NEG_CACHE_TABLE *Table, ULONG Capacity, BOOLEAN CaseInsensitive)
+{
+    RtlZeroMemory(Table, sizeof *Table);
+    Table->Capacity = Capacity;
+    Table->CaseInsensitive = CaseInsensitive;
+    Table->ExpirationList.Next = Table->ExpirationList.Prev = &Table->ExpirationList;
+}
+static inline
+UINT64 FspNegCacheTableToken(FSP_NEG_CACHE_TABLE *Table, ULONG ParentHash)
+{
+    return ((UINT64)Table->Generation << 32) |
+        Table->ParentGenerations[ParentHash & (FspNegCacheGenerationCount - 1)];
+}
+static inline
+UINT64 FspNegCacheTableGetToken(FSP_NEG_CACHE_TABLE *Table, PCWSTR Name, USHORT NameLength)
+{
+    ULONG Hash, ParentHash;
+    FspNegCacheHashName(Table->CaseInsensitive, Name, NameLength, &Hash, &ParentHash);
+    return FspNegCacheTableToken(Table, ParentHash);
+}
+static inline
+FSP_NEG_CACHE_ENTRY **FspNegCacheTableBucket(FSP_NEG_CACHE_TABLE *Table, ULONG Hash)
+{
+    return &Table->EntryBuckets[Hash % FspNegCacheBucketCount];
+}
+static inline
+FSP_NEG_CACHE_ENTRY **FspNegCacheTableFind(FSP_NEG_CACHE_TABLE *Table,
+    ULONG Hash, PCWSTR Name, USHORT NameLength)
+{
+    FSP_NEG_CACHE_ENTRY **P;
+    for (P = FspNegCacheTableBucket(Table, Hash); *P; P = &(*P)->DictNext)
+        if ((*P)->Hash == Hash && (*P)->NameLength == NameLength &&
+            FspNegCacheNameEqual(Table->CaseInsensitive, (*P)->Name, Name, NameLength))
+            break;
+    return P;
+}
+static inline
+VOID FspNegCacheTableRemoveEntry(FSP_NEG_CACHE_TABLE *Table, FSP_NEG_CACHE_ENTRY **P)
+{
+    FSP_NEG_CACHE_ENTRY *Entry = *P;
+    *P = Entry->DictNext;
+    Entry->ExpirationLink.Prev->Next = Entry->ExpirationLink.Next;
+    Entry->ExpirationLink.Next->Prev = Entry->ExpirationLink.Prev;
+    Table->EntryCount--;
+}
+static inline
+BOOLEAN FspNegCacheTableLookup(FSP_NEG_CACHE_TABLE *Table, PCWSTR Name, USHORT NameLength,
+    UINT64 CurrentTime)
+{
+    /* is Name known not to exist? */
+    FSP_NEG_CACHE_ENTRY *Entry;
+    ULONG Hash;
+    FspNegCacheHashName(Table->CaseInsensitive, Name, NameLength, &Hash, 0);
+    Entry = *FspNegCacheTableFind(Table, Hash, Name, NameLength);
+    if (0 != Entry && CurrentTime < Entry->ExpirationTime &&
+        Entry->Token == FspNegCacheTableToken(Table, Entry->ParentHash))
+    {
+        Table->Hits++;
+        return TRUE;
+    }
+    Table->Misses++;
+    return FALSE;
+}
+static inline
+FSP_NEG_CACHE_ENTRY *FspNegCacheTableInsert(FSP_NEG_CACHE_TABLE *Table, FSP_NEG_CACHE_ENTRY *Entry,
+    UINT64 Token)
+{
+    /*
+     * Entry->Name, NameLength and ExpirationTime must be set by the caller. Token must have
+     * been captured (FspNegCacheTableGetToken) before the name was looked up in user mode.
+     *
+     * Returns an entry that the caller must free: Entry itself if it was rejected because
+     * its token is stale, an older entry for the same name that it replaced, or NULL.
+     */
+    FSP_NEG_CACHE_ENTRY **P, *OldEntry = 0;
+    FspNegCacheHashName(Table->CaseInsensitive, Entry->Name, Entry->NameLength,
+        &Entry->Hash, &Entry->ParentHash);
+    if (Token != FspNegCacheTableToken(Table, Entry->ParentHash))
+    {
+        Table->Rejects++;
+        return Entry;
+    }
+    Entry->Token = Token;
+    P = FspNegCacheTableFind(Table, Entry->Hash, Entry->Name, Entry->NameLength);
+    if (0 != *P)
+    {
+        OldEntry = *P;
+        FspNegCacheTableRemoveEntry(Table, P);
+    }
+    P = FspNegCacheTableBucket(Table, Entry->Hash);
+    Entry->DictNext = *P;
+    *P = Entry;
+    Entry->ExpirationLink.Next = &Table->ExpirationList;
+    Entry->ExpirationLink.Prev = Table->ExpirationList.Prev;
+    Table->ExpirationList.Prev->Next = &Entry->ExpirationLink;
+    Table->ExpirationList.Prev = &Entry->ExpirationLink;
+    Table->EntryCount++;
+    return OldEntry;
+}
+static inline
+VOID FspNegCacheTableInvalidateParent(FSP_NEG_CACHE_TABLE *Table, PCWSTR Name, USHORT NameLength)
+{
+    /* invalidate all entries that share their parent directory with Name */
+    ULONG Hash, ParentHash;
+    FspNegCacheHashName(Table->CaseInsensitive, Name, NameLength, &Hash, &ParentHash);
+    Table->ParentGenerations[ParentHash & (FspNegCacheGenerationCount - 1)]++;
+}
+static inline
+VOID FspNegCacheTableInvalidate(FSP_NEG_CACHE_TABLE *Table)
+{
+    Table->Generation++;
+}
+static inline
+FSP_NEG_CACHE_ENTRY *FspNegCacheTableRemoveOldest(FSP_NEG_CACHE_TABLE *Table)
+{
+    FSP_NEG_CACHE_ENTRY *Entry = CONTAINING_RECORD(Table->ExpirationList.Next,
+        FSP_NEG_CACHE_ENTRY, ExpirationLink);
+    FSP_NEG_CACHE_ENTRY **P;
+    for (P = FspNegCacheTableBucket(Table, Entry->Hash); *P != Entry; P = &(*P)->DictNext)
+        ;
+    FspNegCacheTableRemoveEntry(Table, P);
+    return Entry;
+}
+static inline
+FSP_NEG_CACHE_ENTRY *FspNegCacheTableRemoveExpired(FSP_NEG_CACHE_TABLE *Table, UINT64 CurrentTime)
+{
+    /* remove the oldest entry if it has expired (CurrentTime == -1 removes any entry) */
+    if (&Table->ExpirationList == Table->ExpirationList.Next ||
+        CurrentTime < CONTAINING_RECORD(Table->ExpirationList.Next,
+            FSP_NEG_CACHE_ENTRY, ExpirationLink)->ExpirationTime)
+        return 0;
+    return FspNegCacheTableRemoveOldest(Table);
+}
+static inline
+FSP_NEG_CACHE_ENTRY *FspNegCacheTableRemoveOverCapacity(FSP_NEG_CACHE_TABLE *Table)
+{
+    /* remove the oldest entry if the table is over capacity */
+    if (Table->Capacity >= Table->EntryCount)
+        return 0;
+    return FspNegCacheTableRemoveOldest(Table);
+}
+
+#endif
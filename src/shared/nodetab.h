@@ -0,0 +1,387 @@
+/**
+ * @file shared/nodetab.h
+ *
+ * @copyright 2015-2016 Bill Zissimopoulos
+ */
+/*
+ * This file is part of WinFsp.
+ *
+ * You can redistribute it and/or modify it under the terms of the
+ * GNU Affero General Public License version 3 as published by the
+ * Free Software Foundation.
+ *
+ * Licensees holding a valid commercial license may use this file in
+ * accordance with the commercial license agreement provided with the
+ * software.
+ */
+
+#ifndef WINFSP_SHARED_NODETAB_H_INCLUDED
+#define WINFSP_SHARED_NODETAB_H_INCLUDED
+
+/*
+ * Node Table
+ *
+ * The node table maps the paths that WinFsp works with to the node ID's (inode numbers)
+ * of a file system that identifies its files by node ID, such as a FUSE low-level file
+ * system. It plays the role of the dentry and inode caches of an OS kernel and it keeps
+ * two kinds of objects:
+ *
+ * - A node represents a node ID that the file system has returned from a lookup (or a
+ * create, mkdir, etc.). The node counts these lookups; when the node is no longer used the
+ * caller must tell the file system to forget the node ID together with its lookup count.
+ * The root node (node ID 1) is part of the table and is never forgotten.
+ *
+ * - An entry is a name in a directory; it maps (parent node, name) to a node. A node
+ * may have multiple entries (hard links) or none (e.g. a file that is open but has been
+ * renamed or deleted).
+ *
+ * A node stays in the table while it is referenced (by open files and requests that are
+ * in progress), named by an entry or while it has entries in it (so that a node ID that
+ * is the parent of an entry cannot be forgotten and reused by the file system). Entries
+ * are kept in LRU order and the least recently used entries of nodes without entries
+ * of their own (leaves) are evicted when there are more than MaxEntryCount entries.
+ *
+ * Resolve translates a path by walking it one component at a time, from the root node.
+ * A component that is in the table is a hit; otherwise the caller's Lookup callback asks
+ * the file system and inserts the result. Path resolution of paths that have been seen
+ * recently therefore never reaches the file system.
+ *
+ * The node table never allocates or frees memory. Nodes and entries are allocated by the
+ * caller and returned to it in the forget list and the free list when they are removed;
+ * the caller must take these lists and dispose of their items (typically after dropping
+ * its lock). An FSP_NODE_TABLE is not synchronized.
+ */
+
+#define FspNodeTableBucketCount         4093
+#define FspNodeTableRootIno             1
+
+typedef struct _FSP_NODE_TABLE_LINK
+{
+    struct _FSP_NODE_TABLE_LINK *Next, *Prev;
+} FSP_NODE_TABLE_LINK;
+
+typedef struct _FSP_NODE_TABLE_NODE
+{
+    struct _FSP_NODE_TABLE_NODE *DictNext;
+    UINT64 Ino;
+    UINT64 LookupCount;                 /* lookups that the file system must be told to forget */
+    ULONG RefCount;                     /* open files and requests in progress */
+    ULONG EntryCount;                   /* entries that name the node */
+    ULONG ChildCount;                   /* entries in the node (as a directory) */
+} FSP_NODE_TABLE_NODE;
+
+typedef struct _FSP_NODE_TABLE_ENTRY
+{
+    FSP_NODE_TABLE_LINK LruLink;
+    struct _FSP_NODE_TABLE_ENTRY *DictNext;
+    FSP_NODE_TABLE_NODE *Parent, *Node;
+    ULONG Hash;
+    ULONG NameLength;
+    char Name[];                        /* not term-0 */
+} FSP_NODE_TABLE_ENTRY;
+
+typedef NTSTATUS FSP_NODE_TABLE_LOOKUP(PVOID Context,
+    FSP_NODE_TABLE_NODE *Parent, const char *Name, ULONG NameLength,
+    FSP_NODE_TABLE_NODE **PNode);
+
+typedef struct
+{
+    FSP_NODE_TABLE_NODE Root;
+    ULONG MaxEntryCount, EntryCount, NodeCount;
+    UINT64 Hits, Misses, Evictions;
+    FSP_NODE_TABLE_LINK LruList;
+    FSP_NODE_TABLE_NODE *ForgetList;    /* removed nodes (linked through DictNext) */
+    FSP_NODE_TABLE_ENTRY *FreeList;     /* removed entries (linked through DictNext) */
+    FSP_NODE_TABLE_NODE *NodeBuckets[FspNodeTableBucketCount];
+    FSP_NODE_TABLE_ENTRY *EntryBuckets[FspNodeTableBucketCount];
+} FSP_NODE_TABLE;
+
+static inline
+VOID FspNodeTableLinkInsertTail(FSP_NODE_TABLE_LINK *Head, FSP_NODE_TABLE_LINK *Link)
+{
+    Link->Next = Head;
+    Link->Prev = Head->Prev;
+    Head->Prev->Next = Link;
+    Head->Prev = Link;
+}
+static inline
+VOID FspNodeTableLinkRemove(FSP_NODE_TABLE_LINK *Link)
+{
+    Link->Prev->Next = Link->Next;
+    Link->Next->Prev = Link->Prev;
+}
+
+static inline
+ULONG FspNodeTableNameHash(UINT64 ParentIno, const char *Name, ULONG NameLength)
+{
+    /* FNV-1a over the name, seeded with the parent node ID */
+    UINT32 Hash = 2166136261 ^ (UINT32)ParentIno ^ (UINT32)(ParentIno >> 32);
+    for (ULONG I = 0; NameLength > I; I++)
+    {
+        Hash ^= (UINT8)Name[I];
+        Hash *= 16777619;
+    }
+    return Hash;
+}
+static inline
+FSP_NODE_TABLE_NODE **FspNodeTableNodeBucket(FSP_NODE_TABLE *Table, UINT64 Ino)
+{
+    return &Table->NodeBuckets[Ino % FspNodeTableBucketCount];
+}
+static inline
+VOID FspNodeTableInitialize(FSP_NODE_TABLE *Table, ULONG MaxEntryCount)
+{
+    RtlZeroMemory(Table, sizeof *Table);
+    Table->MaxEntryCount = 0 != MaxEntryCount ? MaxEntryCount : 1;
+    Table->LruList.Next = Table->LruList.Prev = &Table->LruList;
+    Table->Root.Ino = FspNodeTableRootIno;
+    Table->Root.RefCount = 1;           /* the root node is never removed */
+    *FspNodeTableNodeBucket(Table, FspNodeTableRootIno) = &Table->Root;
+    Table->NodeCount = 1;
+}
+static inline
+FSP_NODE_TABLE_NODE *FspNodeTableGetNode(FSP_NODE_TABLE *Table, UINT64 Ino)
+{
+    for (FSP_NODE_TABLE_NODE *Node = *FspNodeTableNodeBucket(Table, Ino);
+        0 != Node; Node = Node->DictNext)
+        if (Node->Ino == Ino)
+            return Node;
+    return 0;
+}
+static inline
+VOID FspNodeTableReap(FSP_NODE_TABLE *Table, FSP_NODE_TABLE_NODE *Node)
+{
+    FSP_NODE_TABLE_NODE **P;
+    if (0 != Node->RefCount || 0 != Node->EntryCount || 0 != Node->ChildCount)
+        return;
+    for (P = FspNodeTableNodeBucket(Table, Node->Ino); Node != *P; P = &(*P)->DictNext)
+        ;
+    *P = Node->DictNext;
+    Node->DictNext = Table->ForgetList;
+    Table->ForgetList = Node;
+    Table->NodeCount--;
+}
+static inline
+VOID FspNodeTableReference(FSP_NODE_TABLE *Table, FSP_NODE_TABLE_NODE *Node)
+{
+    Node->RefCount++;
+}
+static inline
+VOID FspNodeTableDereference(FSP_NODE_TABLE *Table, FSP_NODE_TABLE_NODE *Node)
+{
+    Node->RefCount--;
+    FspNodeTableReap(Table, Node);
+}
+static inline
+FSP_NODE_TABLE_ENTRY *FspNodeTableFindEntry(FSP_NODE_TABLE *Table,
+    FSP_NODE_TABLE_NODE *Parent, const char *Name, ULONG NameLength, ULONG Hash)
+{
+    for (FSP_NODE_TABLE_ENTRY *Entry = Table->EntryBuckets[Hash % FspNodeTableBucketCount];
+        0 != Entry; Entry = Entry->DictNext)
+        if (Entry->Hash == Hash && Entry->Parent == Parent &&
+            Entry->NameLength == NameLength && 0 == memcmp(Entry->Name, Name, NameLength))
+            return Entry;
+    return 0;
+}
+static inline
+FSP_NODE_TABLE_ENTRY *FspNodeTableLookup(FSP_NODE_TABLE *Table,
+    FSP_NODE_TABLE_NODE *Parent, const char *Name, ULONG NameLength)
+{
+    FSP_NODE_TABLE_ENTRY *Entry = FspNodeTableFindEntry(Table, Parent, Name, NameLength,
+        FspNodeTableNameHash(Parent->Ino, Name, NameLength));
+    if (0 != Entry)
+    {
+        /* most recently used: move to the end of the LRU list */
+        FspNodeTableLinkRemove(&Entry->LruLink);
+        FspNodeTableLinkInsertTail(&Table->LruList, &Entry->LruLink);
+        Table->Hits++;
+    }
+    else
+        Table->Misses++;
+    return Entry;
+}
+static inline
+VOID FspNodeTableRemove(FSP_NODE_TABLE *Table, FSP_NODE_TABLE_ENTRY *Entry)
+{
+    /* remove an entry, e.g. after an unlink, rmdir or rename */
+    FSP_NODE_TABLE_ENTRY **P;
+    for (P = &Table->EntryBuckets[Entry->Hash % FspNodeTableBucketCount];
+        Entry != *P; P = &(*P)->DictNext)
+        ;
+    *P = Entry->DictNext;
+    FspNodeTableLinkRemove(&Entry->LruLink);
+    Entry->DictNext = Table->FreeList;
+    Table->FreeList = Entry;
+    Table->EntryCount--;
+    Entry->Node->EntryCount--;
+    Entry->Parent->ChildCount--;
+    FspNodeTableReap(Table, Entry->Node);
+    FspNodeTableReap(Table, Entry->Parent);
+}
+static inline
+VOID FspNodeTableEvict(FSP_NODE_TABLE *Table, ULONG MaxEntryCount)
+{
+    /*
+     * Evict least recently used entries until there are at most MaxEntryCount entries.
+     * Entries of directories that have entries in them are moved to the end of the
+     * LRU list instead; their turn comes when their directory becomes a leaf.
+     */
+    FSP_NODE_TABLE_ENTRY *Entry;
+    ULONG ScanCount = Table->EntryCount;
+    while (Table->EntryCount > MaxEntryCount && 0 < ScanCount--)
+    {
+        Entry = CONTAINING_RECORD(Table->LruList.Next, FSP_NODE_TABLE_ENTRY, LruLink);
+        if (0 != Entry->Node->ChildCount)
+        {
+            FspNodeTableLinkRemove(&Entry->LruLink);
+            FspNodeTableLinkInsertTail(&Table->LruList, &Entry->LruLink);
+            continue;
+        }
+        FspNodeTableRemove(Table, Entry);
+        Table->Evictions++;
+    }
+}
+static inline
+FSP_NODE_TABLE_NODE *FspNodeTableInsert(FSP_NODE_TABLE *Table,
+    FSP_NODE_TABLE_NODE *Parent, FSP_NODE_TABLE_ENTRY *Entry, FSP_NODE_TABLE_NODE *Node)
+{
+    /*
+     * The file system has returned Node->Ino for the name Entry->Name in Parent: insert
+     * Entry and Node (only Node->Ino and Entry->Name/NameLength need be initialized) and
+     * account for one lookup. If the node ID is already in the table the existing node
+     * is used instead and the caller must free Node; the resident node is returned. If
+     * the name is already in the table the old entry is removed (or the new entry is not
+     * used if they are the same); unused entries go to the free list.
+     */
+    FSP_NODE_TABLE_NODE *Resident;
+    FSP_NODE_TABLE_ENTRY *OldEntry;
+
+    /* evict first, so that the new entry and its node cannot be evicted */
+    if (Table->EntryCount >= Table->MaxEntryCount)
+        FspNodeTableEvict(Table, Table->MaxEntryCount - 1);
+
+    Resident = FspNodeTableGetNode(Table, Node->Ino);
+    if (0 == Resident)
+    {
+        Resident = Node;
+        Resident->LookupCount = 0;
+        Resident->RefCount = 0;
+        Resident->EntryCount = 0;
+        Resident->ChildCount = 0;
+        Resident->DictNext = *FspNodeTableNodeBucket(Table, Resident->Ino);
+        *FspNodeTableNodeBucket(Table, Resident->Ino) = Resident;
+        Table->NodeCount++;
+    }
+    Resident->LookupCount++;
+
+    Entry->Hash = FspNodeTableNameHash(Parent->Ino, Entry->Name, Entry->NameLength);
+    OldEntry = FspNodeTableFindEntry(Table, Parent, Entry->Name, Entry->NameLength, Entry->Hash);
+    if (0 != OldEntry)
+    {
+        if (OldEntry->Node == Resident)
+        {
+            Entry->DictNext = Table->FreeList;
+            Table->FreeList = Entry;
+            return Resident;
+        }
+        /* keep Parent and Resident in the table while the old entry is removed */
+        Parent->RefCount++;
+        Resident->RefCount++;
+        FspNodeTableRemove(Table, OldEntry);
+        Resident->RefCount--;
+        Parent->RefCount--;
+    }
+
+    Entry->Parent = Parent;
+    Entry->Node = Resident;
+    Entry->DictNext = Table->EntryBuckets[Entry->Hash % FspNodeTableBucketCount];
+    Table->EntryBuckets[Entry->Hash % FspNodeTableBucketCount] = Entry;
+    FspNodeTableLinkInsertTail(&Table->LruList, &Entry->LruLink);
+    Table->EntryCount++;
+    Resident->EntryCount++;
+    Parent->ChildCount++;
+
+    return Resident;
+}
+static inline
+const char *FspNodeTableNextComponent(const char *Path, PULONG PLength)
+{
+    /* skip slashes; return the next path component (and its length) or 0 at the end */
+    const char *End;
+    while ('/' == *Path)
+        Path++;
+    if ('\0' == *Path)
+        return 0;
+    for (End = Path; '\0' != *End && '/' != *End; End++)
+        ;
+    *PLength = (ULONG)(End - Path);
+    return Path;
+}
+static inline
+NTSTATUS FspNodeTableResolve(FSP_NODE_TABLE *Table, const char *Path, BOOLEAN ResolveParent,
+    FSP_NODE_TABLE_LOOKUP *Lookup, PVOID Context,
+    FSP_NODE_TABLE_NODE **PNode, const char **PName)
+{
+    /*
+     * Resolve Path to a node; if ResolveParent is TRUE resolve the parent of the last
+     * path component instead and return the last component in *PName (an empty name if
+     * Path is the root). Lookup is called for each component that is not in the table:
+     * it must ask the file system and Insert the result (and may drop and reacquire the
+     * caller's lock while the file system is working; the parent node is referenced).
+     * On success the node is returned referenced and the caller must Dereference it.
+     */
+    FSP_NODE_TABLE_NODE *Node = &Table->Root, *Child;
+    FSP_NODE_TABLE_ENTRY *Entry;
+    const char *Name, *NextName;
+    ULONG NameLength, NextNameLength;
+    NTSTATUS Result;
+
+    FspNodeTableReference(Table, Node);
+    Name = FspNodeTableNextComponent(Path, &NameLength);
+    for (; 0 != Name; Name = NextName, NameLength = NextNameLength)
+    {
+        NextName = FspNodeTableNextComponent(Name + NameLength, &NextNameLength);
+        if (ResolveParent && 0 == NextName)
+            break;
+
+        Entry = FspNodeTableLookup(Table, Node, Name, NameLength);
+        if (0 != Entry)
+            Child = Entry->Node;
+        else
+        {
+            Result = Lookup(Context, Node, Name, NameLength, &Child);
+            if (!NT_SUCCESS(Result))
+            {
+                FspNodeTableDereference(Table, Node);
+                /* a missing directory on the way is a missing path */
+                return 0 != NextName && STATUS_OBJECT_NAME_NOT_FOUND == Result ?
+                    STATUS_OBJECT_PATH_NOT_FOUND : Result;
+            }
+        }
+
+        FspNodeTableReference(Table, Child);
+        FspNodeTableDereference(Table, Node);
+        Node = Child;
+    }
+
+    *PNode = Node;
+    if (0 != PName)
+        *PName = 0 != Name ? Name : Path + strlen(Path);
+    return STATUS_SUCCESS;
+}
+static inline
+FSP_NODE_TABLE_NODE *FspNodeTableTakeForgetList(FSP_NODE_TABLE *Table)
+{
+    FSP_NODE_TABLE_NODE *List = Table->ForgetList;
+    Table->ForgetList = 0;
+    return List;
+}
+static inline
+FSP_NODE_TABLE_ENTRY *FspNodeTableTakeFreeList(FSP_NODE_TABLE *Table)
+{
+    FSP_NODE_TABLE_ENTRY *List = Table->FreeList;
+    Table->FreeList = 0;
+    return List;
+}
+
+#endif
@@ -0,0 +1,66 @@
+/**
+ * @file shared/payload.h
+ *
+ * @copyright 2015-2016 Bill Zissimopoulos
+ */
+/*
+ * This file is part of WinFsp.
+ *
+ * You can redistribute it and/or modify it under the terms of the
+ * GNU Affero General Public License version 3 as published by the
+ * Free Software Foundation.
+ *
+ * Licensees holding a valid commercial license may use this file in
+ * accordance with the commercial license agreement provided with the
+ * software.
+ */
+
+#ifndef WINFSP_SHARED_PAYLOAD_H_INCLUDED
+#define WINFSP_SHARED_PAYLOAD_H_INCLUDED
+
+/*
+ * Transact Message Size Limits
+ *
+ * A transact message (request or response) consists of a fixed part followed by a variable
+ * Buffer; the FSP_FSCTL_TRANSACT_BUF's in the fixed part refer to data in the Buffer by
+ * offset and size. A message is normally limited to FSP_FSCTL_TRANSACT_{REQ,RSP}_SIZEMAX
+ * bytes, so that it fits in a page together with its internal header. When a volume is
+ * created with the ExtendedPayload volume parameter the limit is raised to
+ * FSP_FSCTL_TRANSACT_EXT_{REQ,RSP}_SIZEMAX bytes; messages keep their layout and are still
+ * transferred in the regular transact buffer. Large security descriptors and long file names
+ * then travel in a single round trip rather than being rejected or truncated.
+ *
+ * Unpack resolves a BUF of a received message; it validates the BUF against the message
+ * size and must be used for messages that come from the other side of the transact
+ * interface. This code never allocates memory and is not synchronized.
+ */
+
+static inline
+ULONG FspPayloadRequestSizeMax(BOOLEAN ExtendedPayload)
+{
+    return ExtendedPayload ? FSP_FSCTL_TRANSACT_EXT_REQ_SIZEMAX : FSP_FSCTL_TRANSACT_REQ_SIZEMAX;
+}
+static inline
+ULONG FspPayloadResponseSizeMax(BOOLEAN ExtendedPayload)
+{
+    return ExtendedPayload ? FSP_FSCTL_TRANSACT_EXT_RSP_SIZEMAX : FSP_FSCTL_TRANSACT_RSP_SIZEMAX;
+}
+static inline
+PVOID FspPayloadUnpack(PUINT8 Message, ULONG MessageSize, ULONG BufferOffset,
+    const FSP_FSCTL_TRANSACT_BUF *Buf)
+{
+    /* return the data that Buf refers to or 0 if it is not contained in the message */
+    if (BufferOffset > MessageSize ||
+        (ULONG)Buf->Offset + Buf->Size > MessageSize - BufferOffset)
+        return 0;
+    return Message + BufferOffset + Buf->Offset;
+}
+static inline
+PVOID FspPayloadResponseUnpack(const FSP_FSCTL_TRANSACT_RSP *Response,
+    const FSP_FSCTL_TRANSACT_BUF *Buf)
+{
+    return FspPayloadUnpack((PUINT8)Response, Response->Size,
+        FIELD_OFFSET(FSP_FSCTL_TRANSACT_RSP, Buffer), Buf);
+}
+
+#endif
@@ -0,0 +1,200 @@
+/**
+ * @file shared/ptrset.h
+ *
+ * @copyright 2015-2016 Bill Zissimopoulos
+ */
+/*
+ * This file is part of WinFsp.
+ *
+ * You can redistribute it and/or modify it under the terms of the
+ * GNU Affero General Public License version 3 as published by the
+ * Free Software Foundation.
+ *
+ * Licensees holding a valid commercial license may use this file in
+ * accordance with the commercial license agreement provided with the
+ * software.
+ */
+
+#ifndef WINFSP_SHARED_PTRSET_H_INCLUDED
+#define WINFSP_SHARED_PTRSET_H_INCLUDED
+
+/*
+ * Pointer Set
+ *
+ * An FSP_PTRSET is an open addressing hash set of (non-NULL) pointers. It uses
+ * linear probing with Robin Hood insertion: an entry that is further away from
+ * its home slot displaces one that is closer to its own. This keeps probe
+ * sequences short and allows lookups for absent keys to terminate early, as
+ * soon as they meet an entry that is closer to home than the key would be.
+ * Removal uses backward shift deletion, so there are no tombstones.
+ *
+ * The set keeps all its keys in a single array of slots, which is much more
+ * cache friendly than chaining through the entries themselves. The set never
+ * allocates memory; the slot array is supplied by the caller, which also
+ * decides when to grow (see FspPtrSetGrowSlotCount and FspPtrSetRehash). This
+ * allows the same code to be used in kernel mode (under a spin lock) and in
+ * user mode.
+ *
+ * The slot count must be a power of 2. An FSP_PTRSET is not synchronized.
+ */
+
+/* hash mix */
+/* Based on the MurmurHash3 fmix32/fmix64 function:
+ * See: https://code.google.com/p/smhasher/source/browse/trunk/MurmurHash3.cpp?r=152#68
+ */
+static inline
+UINT32 FspHashMix32(UINT32 h)
+{
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    return h;
+}
+static inline
+UINT64 FspHashMix64(UINT64 k)
+{
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
+static inline
+ULONG FspHashMixPointer(PVOID Pointer)
+{
+#if _WIN64
+    return (ULONG)FspHashMix64((UINT64)Pointer);
+#else
+    return (ULONG)FspHashMix32((UINT32)Pointer);
+#endif
+}
+
+/* pointer set */
+#define FspPtrSetMinimumSlotCount       16
+typedef struct
+{
+    ULONG Mask;                         /* slot count - 1 */
+    ULONG Count;
+    PVOID *Slots;
+} FSP_PTRSET;
+static inline
+ULONG FspPtrSetDistance(FSP_PTRSET *Set, PVOID Key, ULONG Index)
+{
+    return (Index - FspHashMixPointer(Key)) & Set->Mask;
+}
+static inline
+VOID FspPtrSetInitialize(FSP_PTRSET *Set, PVOID *Slots, ULONG SlotCount)
+{
+    /* SlotCount must be a power of 2 */
+    for (ULONG Index = 0; SlotCount > Index; Index++)
+        Slots[Index] = 0;
+    Set->Mask = SlotCount - 1;
+    Set->Count = 0;
+    Set->Slots = Slots;
+}
+static inline
+ULONG FspPtrSetCount(FSP_PTRSET *Set)
+{
+    return Set->Count;
+}
+static inline
+ULONG FspPtrSetSlotCount(FSP_PTRSET *Set)
+{
+    return Set->Mask + 1;
+}
+static inline
+BOOLEAN FspPtrSetFindIndex(FSP_PTRSET *Set, PVOID Key, PULONG PIndex)
+{
+    ULONG Index = FspHashMixPointer(Key) & Set->Mask;
+    for (ULONG Distance = 0;; Distance++)
+    {
+        PVOID Slot = Set->Slots[Index];
+        if (0 == Slot)
+            return FALSE;
+        if (Slot == Key)
+        {
+            *PIndex = Index;
+            return TRUE;
+        }
+        if (FspPtrSetDistance(Set, Slot, Index) < Distance)
+            return FALSE;
+        Index = (Index + 1) & Set->Mask;
+    }
+}
+static inline
+PVOID FspPtrSetFind(FSP_PTRSET *Set, PVOID Key)
+{
+    ULONG Index;
+    return FspPtrSetFindIndex(Set, Key, &Index) ? Key : 0;
+}
+static inline
+BOOLEAN FspPtrSetInsert(FSP_PTRSET *Set, PVOID Key)
+{
+    /* Key must not be NULL and must not already be in the set */
+    if (Set->Count >= Set->Mask)
+        return FALSE; /* always keep at least one free slot */
+    ULONG Index = FspHashMixPointer(Key) & Set->Mask;
+    for (ULONG Distance = 0;; Distance++)
+    {
+        PVOID Slot = Set->Slots[Index];
+        if (0 == Slot)
+        {
+            Set->Slots[Index] = Key;
+            Set->Count++;
+            return TRUE;
+        }
+        ULONG SlotDistance = FspPtrSetDistance(Set, Slot, Index);
+        if (SlotDistance < Distance)
+        {
+            /* rob the rich: the resident is closer to home than we are; take its slot */
+            Set->Slots[Index] = Key;
+            Key = Slot;
+            Distance = SlotDistance;
+        }
+        Index = (Index + 1) & Set->Mask;
+    }
+}
+static inline
+BOOLEAN FspPtrSetRemove(FSP_PTRSET *Set, PVOID Key)
+{
+    ULONG Index, NextIndex;
+    if (!FspPtrSetFindIndex(Set, Key, &Index))
+        return FALSE;
+    for (;;)
+    {
+        /* backward shift entries that are not in their home slot */
+        NextIndex = (Index + 1) & Set->Mask;
+        PVOID Slot = Set->Slots[NextIndex];
+        if (0 == Slot || 0 == FspPtrSetDistance(Set, Slot, NextIndex))
+            break;
+        Set->Slots[Index] = Slot;
+        Index = NextIndex;
+    }
+    Set->Slots[Index] = 0;
+    Set->Count--;
+    return TRUE;
+}
+static inline
+ULONG FspPtrSetGrowSlotCount(FSP_PTRSET *Set)
+{
+    /* return the slot count to grow to when the set is over 3/4 full; 0 otherwise */
+    ULONG SlotCount = Set->Mask + 1;
+    return SlotCount / 4 * 3 <= Set->Count && 0 != SlotCount * 2 ? SlotCount * 2 : 0;
+}
+static inline
+PVOID *FspPtrSetRehash(FSP_PTRSET *Set, PVOID *Slots, ULONG SlotCount)
+{
+    /* move all keys to the new Slots (SlotCount must be larger than Count); returns old slots */
+    PVOID *OldSlots = Set->Slots;
+    ULONG OldSlotCount = Set->Mask + 1;
+    FspPtrSetInitialize(Set, Slots, SlotCount);
+    for (ULONG Index = 0; OldSlotCount > Index; Index++)
+        if (0 != OldSlots[Index])
+            FspPtrSetInsert(Set, OldSlots[Index]);
+    return OldSlots;
+}
+
+#endif
@@ -0,0 +1,146 @@
+/**
+ * @file shared/rangelock.h
+ *
+ * @copyright 2015-2016 Bill Zissimopoulos
+ */
+/*
+ * This file is part of WinFsp.
+ *
+ * You can redistribute it and/or modify it under the terms of the
+ * GNU Affero General Public License version 3 as published by the
+ * Free Software Foundation.
+ *
+ * Licensees holding a valid commercial license may use this file in
+ * accordance with the commercial license agreement provided with the
+ * software.
+ */
+
+#ifndef WINFSP_SHARED_RANGELOCK_H_INCLUDED
+#define WINFSP_SHARED_RANGELOCK_H_INCLUDED
+
+/*
+ * Byte Range Lock
+ *
+ * A range lock serializes I/O requests to overlapping byte ranges of a file, while letting
+ * requests to non-overlapping ranges proceed concurrently. A request locks its range shared
+ * (reads) or exclusive (writes); two entries conflict when their ranges overlap and at least
+ * one of them is exclusive. Empty ranges never conflict.
+ *
+ * Entries are kept in a single list in arrival order; both granted and waiting entries are
+ * in the list. An entry is granted only if it does not conflict with any entry that arrived
+ * before it, whether that entry was granted or is still waiting. So requests are granted in
+ * FIFO order among overlapping ranges and a stream of reads cannot starve a write.
+ *
+ * The list is searched linearly; it holds the I/O requests that are in flight for a single
+ * file, which are few. Like the other shared structures the range lock never allocates
+ * memory (entries are provided by the caller) and is not synchronized.
+ */
+
+typedef struct _FSP_RANGE_LOCK_LINK
+{
+    struct _FSP_RANGE_LOCK_LINK *Next, *Prev;
+} FSP_RANGE_LOCK_LINK;
+
+typedef struct _FSP_RANGE_LOCK_ENTRY
+{
+    FSP_RANGE_LOCK_LINK Link;
+    struct _FSP_RANGE_LOCK_ENTRY *GrantNext;
+    UINT64 Offset, EndOffset;           /* [Offset, EndOffset) */
+    BOOLEAN Exclusive;
+    BOOLEAN Granted;
+} FSP_RANGE_LOCK_ENTRY;
+
+typedef struct
+{
+    FSP_RANGE_LOCK_LINK EntryList;
+    ULONG GrantedCount, WaitingCount;
+    UINT64 Acquires, Conflicts;
+} FSP_RANGE_LOCK;
+
+static inline
+VOID FspRangeLockInitialize(FSP_RANGE_LOCK *Lock)
+{
+    RtlZeroMemory(Lock, sizeof *Lock);
+    Lock->EntryList.Next = Lock->EntryList.Prev = &Lock->EntryList;
+}
+static inline
+VOID FspRangeLockEntryInitialize(FSP_RANGE_LOCK_ENTRY *Entry,
+    UINT64 Offset, UINT64 Length, BOOLEAN Exclusive)
+{
+    RtlZeroMemory(Entry, sizeof *Entry);
+    Entry->Offset = Offset;
+    Entry->EndOffset = Offset + Length >= Offset ? Offset + Length : (UINT64)-1LL;
+    Entry->Exclusive = Exclusive;
+}
+static inline
+BOOLEAN FspRangeLockConflict(const FSP_RANGE_LOCK_ENTRY *Entry1, const FSP_RANGE_LOCK_ENTRY *Entry2)
+{
+    return (Entry1->Exclusive || Entry2->Exclusive) &&
+        Entry1->Offset < Entry1->EndOffset && Entry2->Offset < Entry2->EndOffset &&
+        Entry1->Offset < Entry2->EndOffset && Entry2->Offset < Entry1->EndOffset;
+}
+static inline
+BOOLEAN FspRangeLockConflictBefore(FSP_RANGE_LOCK *Lock, FSP_RANGE_LOCK_ENTRY *Entry)
+{
+    /* does Entry conflict with any entry that arrived before it? */
+    for (FSP_RANGE_LOCK_LINK *Link = Lock->EntryList.Next; &Entry->Link != Link; Link = Link->Next)
+        if (FspRangeLockConflict(Entry, CONTAINING_RECORD(Link, FSP_RANGE_LOCK_ENTRY, Link)))
+            return TRUE;
+    return FALSE;
+}
+static inline
+BOOLEAN FspRangeLockAcquire(FSP_RANGE_LOCK *Lock, FSP_RANGE_LOCK_ENTRY *Entry)
+{
+    /*
+     * Add Entry to the lock; return TRUE if it was granted. Otherwise the entry is waiting:
+     * the caller must either wait until a release grants it or withdraw it with
+     * FspRangeLockRelease.
+     */
+    Entry->Link.Next = &Lock->EntryList;
+    Entry->Link.Prev = Lock->EntryList.Prev;
+    Lock->EntryList.Prev->Next = &Entry->Link;
+    Lock->EntryList.Prev = &Entry->Link;
+    Entry->GrantNext = 0;
+    Entry->Granted = !FspRangeLockConflictBefore(Lock, Entry);
+    if (Entry->Granted)
+        Lock->GrantedCount++;
+    else
+    {
+        Lock->WaitingCount++;
+        Lock->Conflicts++;
+    }
+    Lock->Acquires++;
+    return Entry->Granted;
+}
+static inline
+FSP_RANGE_LOCK_ENTRY *FspRangeLockRelease(FSP_RANGE_LOCK *Lock, FSP_RANGE_LOCK_ENTRY *Entry)
+{
+    /*
+     * Remove a granted or waiting Entry from the lock. Return the waiting entries that this
+     * grants (linked through GrantNext); the caller must wake their owners.
+     */
+    FSP_RANGE_LOCK_ENTRY *GrantedEntry, *GrantList = 0, **P = &GrantList;
+    Entry->Link.Prev->Next = Entry->Link.Next;
+    Entry->Link.Next->Prev = Entry->Link.Prev;
+    if (Entry->Granted)
+        Lock->GrantedCount--;
+    else
+        Lock->WaitingCount--;
+    if (0 == Lock->WaitingCount)
+        return 0;
+    for (FSP_RANGE_LOCK_LINK *Link = Lock->EntryList.Next; &Lock->EntryList != Link; Link = Link->Next)
+    {
+        GrantedEntry = CONTAINING_RECORD(Link, FSP_RANGE_LOCK_ENTRY, Link);
+        if (GrantedEntry->Granted || FspRangeLockConflictBefore(Lock, GrantedEntry))
+            continue;
+        GrantedEntry->Granted = TRUE;
+        Lock->GrantedCount++;
+        Lock->WaitingCount--;
+        *P = GrantedEntry;
+        P = &GrantedEntry->GrantNext;
+    }
+    *P = 0;
+    return GrantList;
+}
+
+#endif
@@ -0,0 +1,163 @@
+/**
+ * @file shared/wakeq.h
+ *
+ * @copyright 2015-2016 Bill Zissimopoulos
+ */
+/*
+ * This file is part of WinFsp.
+ *
+ * You can redistribute it and/or modify it under the terms of the
+ * GNU Affero General Public License version 3 as published by the
+ * Free Software Foundation.
+ *
+ * Licensees holding a valid commercial license may use this file in
+ * accordance with the commercial license agreement provided with the
+ * software.
+ */
+
+#ifndef WINFSP_SHARED_WAKEQ_H_INCLUDED
+#define WINFSP_SHARED_WAKEQ_H_INCLUDED
+
+/*
+ * Wake Queue
+ *
+ * A wake queue decides when the threads that wait for work items should sleep and which of
+ * them to wake when work arrives. It implements the following policy:
+ *
+ * - Spin: a thread that finds no work may poll for work for a while before it goes to sleep.
+ * Only one thread spins at a time; this is the thread that came back for work most recently
+ * and is most likely to be cache hot. The spin budget adapts: it doubles when a spin finds
+ * work and halves when it does not, between SpinMin and SpinMax.
+ *
+ * - LIFO: sleeping threads (waiters) are kept in a stack and the most recent waiter is woken
+ * first. Under light load a few hot threads do all the work and the others stay asleep.
+ *
+ * - Batch: when work arrives enough waiters are woken to handle all work items that have not
+ * been claimed yet. A work item is claimed by a spinning thread or by a waiter that has been
+ * woken but has not come back for work yet.
+ *
+ * The wake queue only makes decisions. The caller owns the lock, the work items and the
+ * sleep/wake primitive; a waiter is typically embedded in a structure with an event that
+ * the caller sets for each waiter returned by Signal. This code never allocates memory and
+ * is not synchronized.
+ */
+
+typedef struct _FSP_WAKE_QUEUE_WAITER
+{
+    struct _FSP_WAKE_QUEUE_WAITER *Next;
+    BOOLEAN Waiting;                    /* in the waiter stack (not woken yet) */
+} FSP_WAKE_QUEUE_WAITER;
+
+typedef struct
+{
+    FSP_WAKE_QUEUE_WAITER *WaiterStack;
+    ULONG WaiterCount, WokenCount;
+    BOOLEAN Spinning;
+    ULONG Spin, SpinMin, SpinMax;
+    UINT64 Spins, SpinHits, Sleeps, Wakes;
+} FSP_WAKE_QUEUE;
+
+static inline
+VOID FspWakeQueueInitialize(FSP_WAKE_QUEUE *WakeQueue, ULONG SpinMin, ULONG SpinMax)
+{
+    /* a SpinMax of 0 disables spinning */
+    RtlZeroMemory(WakeQueue, sizeof *WakeQueue);
+    if (0 == SpinMin)
+        SpinMin = 1;
+    if (SpinMin > SpinMax)
+        SpinMin = SpinMax;
+    WakeQueue->SpinMin = SpinMin;
+    WakeQueue->SpinMax = SpinMax;
+    WakeQueue->Spin = SpinMin + (SpinMax - SpinMin) / 4;
+}
+static inline
+ULONG FspWakeQueueSpinBegin(FSP_WAKE_QUEUE *WakeQueue)
+{
+    /*
+     * Return how long the calling thread should poll for work before it goes to sleep;
+     * return 0 if it should not spin. If the return value is not 0 the caller must call
+     * FspWakeQueueSpinEnd when it stops spinning.
+     */
+    if (WakeQueue->Spinning || 0 == WakeQueue->Spin)
+        return 0;
+    WakeQueue->Spinning = TRUE;
+    WakeQueue->Spins++;
+    return WakeQueue->Spin;
+}
+static inline
+VOID FspWakeQueueSpinEnd(FSP_WAKE_QUEUE *WakeQueue, BOOLEAN Found)
+{
+    WakeQueue->Spinning = FALSE;
+    if (Found)
+    {
+        WakeQueue->SpinHits++;
+        WakeQueue->Spin = WakeQueue->SpinMax / 2 > WakeQueue->Spin ?
+            WakeQueue->Spin * 2 : WakeQueue->SpinMax;
+    }
+    else
+        WakeQueue->Spin = WakeQueue->SpinMin * 2 < WakeQueue->Spin ?
+            WakeQueue->Spin / 2 : WakeQueue->SpinMin;
+}
+static inline
+VOID FspWakeQueueWait(FSP_WAKE_QUEUE *WakeQueue, FSP_WAKE_QUEUE_WAITER *Waiter)
+{
+    /* the calling thread is about to sleep; it must call FspWakeQueueWaitEnd when it wakes */
+    Waiter->Next = WakeQueue->WaiterStack;
+    Waiter->Waiting = TRUE;
+    WakeQueue->WaiterStack = Waiter;
+    WakeQueue->WaiterCount++;
+    WakeQueue->Sleeps++;
+}
+static inline
+BOOLEAN FspWakeQueueWaitEnd(FSP_WAKE_QUEUE *WakeQueue, FSP_WAKE_QUEUE_WAITER *Waiter)
+{
+    /*
+     * The calling thread woke up. Return TRUE if it was woken by Signal; otherwise its wait
+     * timed out or was canceled and the waiter is removed from the waiter stack.
+     */
+    FSP_WAKE_QUEUE_WAITER **P;
+    if (!Waiter->Waiting)
+    {
+        WakeQueue->WokenCount--;
+        return TRUE;
+    }
+    for (P = &WakeQueue->WaiterStack; Waiter != *P; P = &(*P)->Next)
+        ;
+    *P = Waiter->Next;
+    Waiter->Waiting = FALSE;
+    WakeQueue->WaiterCount--;
+    return FALSE;
+}
+static inline
+FSP_WAKE_QUEUE_WAITER *FspWakeQueueSignal(FSP_WAKE_QUEUE *WakeQueue, ULONG WorkCount)
+{
+    /*
+     * There are WorkCount work items available. Return the waiters that must be woken
+     * (linked through Next, most recent waiter first). The caller must read a waiter's
+     * Next before it wakes the waiter.
+     */
+    FSP_WAKE_QUEUE_WAITER *WakeList = 0, **P = &WakeList, *Waiter;
+    ULONG ClaimCount = WakeQueue->WokenCount + WakeQueue->Spinning;
+    while (0 != WakeQueue->WaiterStack && ClaimCount < WorkCount)
+    {
+        Waiter = WakeQueue->WaiterStack;
+        WakeQueue->WaiterStack = Waiter->Next;
+        WakeQueue->WaiterCount--;
+        WakeQueue->WokenCount++;
+        WakeQueue->Wakes++;
+        Waiter->Waiting = FALSE;
+        *P = Waiter;
+        P = &Waiter->Next;
+        ClaimCount++;
+    }
+    *P = 0;
+    return WakeList;
+}
+static inline
+FSP_WAKE_QUEUE_WAITER *FspWakeQueueSignalAll(FSP_WAKE_QUEUE *WakeQueue)
+{
+    /* wake all waiters; used when the work source is stopped */
+    return FspWakeQueueSignal(WakeQueue, (ULONG)-1);
+}
+
+#endif
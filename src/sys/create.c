@@ -317,6 +317,17 @@ static NTSTATUS FspFsvolCreateNoLock(
         return STATUS_CANNOT_DELETE;
     }
 
+    /* fail opens of names that are known not to exist */
+    if (0 != FsvolDeviceExtension->NegCache &&
+        (FILE_OPEN == CreateDisposition || FILE_OVERWRITE == CreateDisposition) &&
+        !FlagOn(Flags, SL_OPEN_TARGET_DIRECTORY) &&
+        HasTraversePrivilege &&
+        FspNegCacheLookup(FsvolDeviceExtension->NegCache, &FileNode->FileName))
+    {
+        FspFileNodeDereference(FileNode);
+        return STATUS_OBJECT_NAME_NOT_FOUND;
+    }
+
     Result = FspFileDescCreate(&FileDesc);
     if (!NT_SUCCESS(Result))
     {
@@ -324,9 +335,16 @@ static NTSTATUS FspFsvolCreateNoLock(
         return Result;
     }
 
+    /*
+     * Capture the negative name cache token before the request goes to user mode.
+     * If the user-mode file system reports the name as not found, the name is only
+     * cached if nothing changed in its parent directory in the meantime.
+     */
+    FileDesc->NegCacheToken = FspNegCacheGetToken(FsvolDeviceExtension->NegCache, &FileNode->FileName);
+
     /* create the user-mode file system request */
-    Result = FspIopCreateRequestEx(Irp, &FileNode->FileName, SecurityDescriptorSize,
-        FspFsvolCreateRequestFini, &Request);
+    Result = FspIopCreateRequestPayloadEx(Irp, &FileNode->FileName, SecurityDescriptorSize,
+        FspFsvolCreateRequestFini, FsvolDeviceExtension->VolumeParams.ExtendedPayload, &Request);
     if (!NT_SUCCESS(Result))
     {
         FspFileDescDelete(FileDesc);
@@ -492,6 +510,18 @@ NTSTATUS FspFsvolCreateComplete(
         /* did the user-mode file system sent us a failure code? */
         if (!NT_SUCCESS(Response->IoStatus.Status))
         {
+            /*
+             * Remember names that were not found. Case-sensitive opens on a case-insensitive
+             * volume are not cached: they do not tell us that no other case variant exists.
+             */
+            if (STATUS_OBJECT_NAME_NOT_FOUND == Response->IoStatus.Status &&
+                !Request->Req.Create.OpenTargetDirectory &&
+                FileDesc->HasTraversePrivilege &&
+                (!Request->Req.Create.CaseSensitive ||
+                    FsvolDeviceExtension->VolumeParams.CaseSensitiveSearch))
+                FspNegCacheInsert(FsvolDeviceExtension->NegCache, &FileNode->FileName,
+                    FileDesc->NegCacheToken);
+
             Irp->IoStatus.Information = 0;
             Result = Response->IoStatus.Status;
             FSP_RETURN();
@@ -562,6 +592,13 @@ NTSTATUS FspFsvolCreateComplete(
             FspUnicodePathSuffix(&FileNode->FileName, &FileNode->FileName, &Suffix);
         }
 
+        /*
+         * The file now exists even if we fail to open it below; make sure that the
+         * negative name cache does not claim otherwise.
+         */
+        if (FILE_CREATED == Response->IoStatus.Information)
+            FspNegCacheInvalidateParent(FsvolDeviceExtension->NegCache, &FileNode->FileName);
+
         /* populate the FileNode/FileDesc fields from the Response */
         FileNode->UserContext = Response->Rsp.Create.Opened.UserContext;
         FileNode->IndexNumber = Response->Rsp.Create.Opened.FileInfo.IndexNumber;
@@ -295,7 +295,7 @@ static NTSTATUS FspFsvolDeviceInit(PDEVICE_OBJECT DeviceObject)
     NTSTATUS Result;
     FSP_FSVOL_DEVICE_EXTENSION *FsvolDeviceExtension = FspFsvolDeviceExtension(DeviceObject);
     LARGE_INTEGER IrpTimeout;
-    LARGE_INTEGER SecurityTimeout, DirInfoTimeout;
+    LARGE_INTEGER SecurityTimeout, DirInfoTimeout, NegTimeout;
 
     /*
      * Volume device initialization is a mess, because of the different ways of
@@ -321,7 +321,8 @@ static NTSTATUS FspFsvolDeviceInit(PDEVICE_OBJECT DeviceObject)
     IrpTimeout.QuadPart = FsvolDeviceExtension->VolumeParams.IrpTimeout * 10000ULL;
         /* convert millis to nanos */
     Result = FspIoqCreate(
-        FsvolDeviceExtension->VolumeParams.IrpCapacity, &IrpTimeout, FspIopCompleteCanceledIrp,
+        FsvolDeviceExtension->VolumeParams.IrpCapacity, &IrpTimeout,
+        !!FsvolDeviceExtension->VolumeParams.AdaptiveWakeup, FspIopCompleteCanceledIrp,
         &FsvolDeviceExtension->Ioq);
     if (!NT_SUCCESS(Result))
         return Result;
@@ -341,12 +342,26 @@ static NTSTATUS FspFsvolDeviceInit(PDEVICE_OBJECT DeviceObject)
     DirInfoTimeout.QuadPart = FspTimeoutFromMillis(FsvolDeviceExtension->VolumeParams.FileInfoTimeout);
         /* convert millis to nanos */
     Result = FspMetaCacheCreate(
-        FspFsvolDeviceDirInfoCacheCapacity, FspFsvolDeviceDirInfoCacheItemSizeMax, &DirInfoTimeout,
+        FspFsvolDeviceDirInfoCacheCapacity, FspFsvolDeviceDirInfoCachePageSizeMax, &DirInfoTimeout,
         &FsvolDeviceExtension->DirInfoCache);
     if (!NT_SUCCESS(Result))
         return Result;
     FsvolDeviceExtension->InitDoneDir = 1;
 
+    /* create our negative name cache (if requested) */
+    if (FsvolDeviceExtension->VolumeParams.NegativeNameCache)
+    {
+        NegTimeout.QuadPart = FspTimeoutFromMillis(FsvolDeviceExtension->VolumeParams.FileInfoTimeout);
+            /* convert millis to nanos */
+        Result = FspNegCacheCreate(
+            FspFsvolDeviceNegCacheCapacity, !FsvolDeviceExtension->VolumeParams.CaseSensitiveSearch,
+            &NegTimeout,
+            &FsvolDeviceExtension->NegCache);
+        if (!NT_SUCCESS(Result))
+            return Result;
+        FsvolDeviceExtension->InitDoneNeg = 1;
+    }
+
     /* initialize the FSRTL Notify mechanism */
     Result = FspNotifyInitializeSync(&FsvolDeviceExtension->NotifySync);
     if (!NT_SUCCESS(Result))
@@ -406,6 +421,10 @@ static VOID FspFsvolDeviceFini(PDEVICE_OBJECT DeviceObject)
         FspNotifyUninitializeSync(&FsvolDeviceExtension->NotifySync);
     }
 
+    /* delete the negative name cache */
+    if (FsvolDeviceExtension->InitDoneNeg)
+        FspNegCacheDelete(FsvolDeviceExtension->NegCache);
+
     /* delete the directory meta cache */
     if (FsvolDeviceExtension->InitDoneDir)
         FspMetaCacheDelete(FsvolDeviceExtension->DirInfoCache);
@@ -484,6 +503,7 @@ static VOID FspFsvolDeviceExpirationRoutine(PVOID Context)
     InterruptTime = KeQueryInterruptTime();
     FspMetaCacheInvalidateExpired(FsvolDeviceExtension->SecurityCache, InterruptTime);
     FspMetaCacheInvalidateExpired(FsvolDeviceExtension->DirInfoCache, InterruptTime);
+    FspNegCacheInvalidateExpired(FsvolDeviceExtension->NegCache, InterruptTime);
     FspIoqRemoveExpired(FsvolDeviceExtension->Ioq, InterruptTime);
 
     KeAcquireSpinLock(&FsvolDeviceExtension->ExpirationLock, &Irql);
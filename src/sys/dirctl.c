@@ -26,7 +26,7 @@ static NTSTATUS FspFsvolQueryDirectoryCopy(
 static NTSTATUS FspFsvolQueryDirectoryCopyCache(
     FSP_FILE_DESC *FileDesc, BOOLEAN ResetCache,
     FILE_INFORMATION_CLASS FileInformationClass, BOOLEAN ReturnSingleEntry,
-    FSP_FSCTL_DIR_INFO *DirInfo, ULONG DirInfoSize,
+    const FSP_DIR_CACHE_INDEX *Index,
     PVOID DestBuf, PULONG PDestLen);
 static NTSTATUS FspFsvolQueryDirectoryCopyInPlace(
     FSP_FILE_DESC *FileDesc,
@@ -267,7 +267,7 @@ static NTSTATUS FspFsvolQueryDirectoryCopy(
 static NTSTATUS FspFsvolQueryDirectoryCopyCache(
     FSP_FILE_DESC *FileDesc, BOOLEAN ResetCache,
     FILE_INFORMATION_CLASS FileInformationClass, BOOLEAN ReturnSingleEntry,
-    FSP_FSCTL_DIR_INFO *DirInfo, ULONG DirInfoSize,
+    const FSP_DIR_CACHE_INDEX *Index,
     PVOID DestBuf, PULONG PDestLen)
 {
     /* FileNode/FileDesc assumed acquired exclusive (Main or Full) */
@@ -275,34 +275,73 @@ static NTSTATUS FspFsvolQueryDirectoryCopyCache(
     PAGED_CODE();
 
     FSP_FILE_NODE *FileNode = FileDesc->FileNode;
-
-    if (ResetCache || FileDesc->DirInfo != FileNode->NonPaged->DirInfo)
-        FileDesc->DirInfoCacheHint = 0; /* reset the DirInfo hint if anything looks fishy! */
-
-    FileDesc->DirInfo = FileNode->NonPaged->DirInfo;
-
-    NTSTATUS Result;
+    NTSTATUS Result = STATUS_SUCCESS;
     BOOLEAN CaseInsensitive = !FileDesc->CaseSensitive;
     PUNICODE_STRING DirectoryPattern = &FileDesc->DirectoryPattern;
     UINT64 DirectoryOffset = FileDesc->DirectoryOffset;
-    PUINT8 DirInfoBgn = (PUINT8)DirInfo;
-    PUINT8 DirInfoEnd = (PUINT8)DirInfo + DirInfoSize;
+    const FSP_DIR_CACHE_PAGE *Page = 0;
+    ULONG PageNumber, PageSize, EntryNumber = (ULONG)-1;
+    FSP_FSCTL_DIR_INFO *DirInfo;
+    ULONG DestLen = 0;
 
-    DirInfo = (PVOID)(DirInfoBgn + FileDesc->DirInfoCacheHint);
-    DirInfoSize = (ULONG)(DirInfoEnd - (PUINT8)DirInfo);
+    if (ResetCache)
+        FileDesc->DirInfoCacheHint = 0;
 
-    Result = FspFsvolQueryDirectoryCopy(DirectoryPattern, CaseInsensitive,
-        0 != FileDesc->DirInfoCacheHint ? 0 : DirectoryOffset, &DirectoryOffset,
-        FileInformationClass, ReturnSingleEntry,
-        &DirInfo, DirInfoSize,
-        DestBuf, PDestLen);
+    /*
+     * Find the page and entry to resume at. The page index can only point to the right page
+     * when the listing is sorted (by NextOffset); else it starts at the page that the last
+     * query ended in (DirInfoCacheHint) and we try the other pages if needed.
+     */
+    PageNumber = FspDirCacheIndexFind(Index, DirectoryOffset, FileDesc->DirInfoCacheHint);
+    for (ULONG Count = 0; Index->PageCount > PageNumber && Index->PageCount > Count; Count++)
+    {
+        if (!FspFileNodeReferenceDirInfoPage(FileNode, Index->Pages[PageNumber].ItemIndex,
+            (PCVOID *)&Page, &PageSize))
+            break;
+        EntryNumber = FspDirCachePageFind(Page, DirectoryOffset);
+        if ((ULONG)-1 != EntryNumber || Index->Sorted)
+            break;
+        FspFileNodeDereferenceDirInfo(Page);
+        Page = 0;
+        PageNumber = (PageNumber + 1) % Index->PageCount;
+    }
+
+    /* copy from the page; if nothing in it matches continue with the next page */
+    while (0 != Page && (ULONG)-1 != EntryNumber)
+    {
+        DirInfo = FspDirCachePageEntry(Page, EntryNumber);
+        DestLen = *PDestLen;
+        Result = FspFsvolQueryDirectoryCopy(DirectoryPattern, CaseInsensitive,
+            0, &DirectoryOffset,
+            FileInformationClass, ReturnSingleEntry,
+            &DirInfo, (ULONG)((PUINT8)Page + PageSize - (PUINT8)DirInfo),
+            DestBuf, &DestLen);
+
+        FspFileNodeDereferenceDirInfo(Page);
+        Page = 0;
+
+        if (!NT_SUCCESS(Result) || 0 != DestLen || Index->PageCount <= PageNumber + 1)
+            break;
+
+        PageNumber++;
+        EntryNumber = 0;
+        if (!FspFileNodeReferenceDirInfoPage(FileNode, Index->Pages[PageNumber].ItemIndex,
+            (PCVOID *)&Page, &PageSize))
+            Page = 0;
+    }
+
+    if (0 != Page)
+        FspFileNodeDereferenceDirInfo(Page);
+
+    /* if the offset was not found in the cache DestLen is 0 and we go to user mode */
+    *PDestLen = DestLen;
 
     if (NT_SUCCESS(Result))
     {
-        if (0 != *PDestLen)
+        if (0 != DestLen)
             FileDesc->DirectoryHasSuchFile = TRUE;
         FileDesc->DirectoryOffset = DirectoryOffset;
-        FileDesc->DirInfoCacheHint = (ULONG)((PUINT8)DirInfo - DirInfoBgn);
+        FileDesc->DirInfoCacheHint = PageNumber;
     }
     else if (STATUS_NO_MORE_FILES == Result && !FileDesc->DirectoryHasSuchFile)
         Result = STATUS_NO_SUCH_FILE;
@@ -394,9 +433,10 @@ static NTSTATUS FspFsvolQueryDirectoryRetry(
      *
      *   - If the FileInfoTimeout is non-zero, then the directory maintains a
      *     DirInfo meta cache that can be used to fulfill IRP requests without
-     *     reaching out to user mode. In this case we want the SystemBufferLength
-     *     to be FspFsvolDeviceDirInfoCacheItemSizeMax so that we read up to the
-     *     cache size maximum.
+     *     reaching out to user mode. The cache is a listing of pages, each one
+     *     read by a single request at the offset where the previous one ended.
+     *     In this case we want the SystemBufferLength to be
+     *     FspFsvolDeviceDirInfoCacheItemSizeMax so that we read full pages.
      *
      *   - If the requested DirectoryPattern (stored in FileDesc) is not the "*"
      *     (MatchAll) pattern, then we want to read as many entries as possible
@@ -410,11 +450,8 @@ static NTSTATUS FspFsvolQueryDirectoryRetry(
      *     the SystemBufferLength to the requested (IRP) length as it is actually
      *     counter-productive to try to read more than we need.
      */
-#define GetSystemBufferLengthMaybeCached()\
-    (0 != FsvolDeviceExtension->VolumeParams.FileInfoTimeout && 0 == FileDesc->DirectoryOffset) ||\
-    FspFileDescDirectoryPatternMatchAll != FileDesc->DirectoryPattern.Buffer ?\
-        FspFsvolDeviceDirInfoCacheItemSizeMax : Length
-#define GetSystemBufferLengthNonCached()\
+#define GetSystemBufferLength()\
+    0 != FsvolDeviceExtension->VolumeParams.FileInfoTimeout ||\
     FspFileDescDirectoryPatternMatchAll != FileDesc->DirectoryPattern.Buffer ?\
         FspFsvolDeviceDirInfoCacheItemSizeMax : Length
 #define GetSystemBufferLengthBestGuess()\
@@ -438,7 +475,6 @@ static NTSTATUS FspFsvolQueryDirectoryRetry(
     ULONG Length = IrpSp->Parameters.QueryDirectory.Length;
     ULONG SystemBufferLength;
     PVOID DirInfoBuffer;
-    ULONG DirInfoSize;
     FSP_FSCTL_TRANSACT_REQ *Request = FspIrpRequest(Irp);
     BOOLEAN Success;
 
@@ -501,15 +537,12 @@ static NTSTATUS FspFsvolQueryDirectoryRetry(
     }
 
     /* see if the required information is still in the cache and valid! */
-    if (FspFileNodeReferenceDirInfo(FileNode, &DirInfoBuffer, &DirInfoSize))
+    if (FspFileNodeReferenceDirInfo(FileNode, &DirInfoBuffer, 0))
     {
-        if (0 == SystemBufferLength)
-            SystemBufferLength = GetSystemBufferLengthNonCached();
-
         Result = FspFsvolQueryDirectoryCopyCache(FileDesc,
             IndexSpecified || RestartScan,
             FileInformationClass, ReturnSingleEntry,
-            DirInfoBuffer, DirInfoSize, Buffer, &Length);
+            DirInfoBuffer, Buffer, &Length);
 
         FspFileNodeDereferenceDirInfo(DirInfoBuffer);
 
@@ -519,13 +552,14 @@ static NTSTATUS FspFsvolQueryDirectoryRetry(
             Irp->IoStatus.Information = Length;
             return Result;
         }
-    }
-    else
-    {
-        if (0 == SystemBufferLength)
-            SystemBufferLength = GetSystemBufferLengthMaybeCached();
+
+        /* restore the requested length that the cache copy has overwritten */
+        Length = IrpSp->Parameters.QueryDirectory.Length;
     }
 
+    if (0 == SystemBufferLength)
+        SystemBufferLength = GetSystemBufferLength();
+
     FspFileNodeConvertExclusiveToShared(FileNode, Full);
 
     /* buffer the user buffer! */
@@ -537,8 +571,8 @@ static NTSTATUS FspFsvolQueryDirectoryRetry(
         return Result;
     }
 
-    /* create request */
-    Result = FspIopCreateRequestEx(Irp, 0,
+    /* create request; the directory name lets the file system guard its namespace */
+    Result = FspIopCreateRequestEx(Irp, &FileNode->FileName,
         FspFileDescDirectoryPatternMatchAll != FileDesc->DirectoryPattern.Buffer ?
             FileDesc->DirectoryPattern.Length + sizeof(WCHAR) : 0,
         FspFsvolQueryDirectoryRequestFini, &Request);
@@ -571,8 +605,7 @@ static NTSTATUS FspFsvolQueryDirectoryRetry(
     return FSP_STATUS_IOQ_POST;
 
 #undef GetSystemBufferLengthBestGuess
-#undef GetSystemBufferLengthNonCached
-#undef GetSystemBufferLengthMaybeCached
+#undef GetSystemBufferLength
 }
 
 static NTSTATUS FspFsvolQueryDirectory(
@@ -874,17 +907,17 @@ NTSTATUS FspFsvolDirectoryControlComplete(
         FSP_RETURN();
     }
 
-    if (0 == FileDesc->DirectoryOffset &&
-        FspFileNodeTrySetDirInfo(FileNode,
+    if (FspFileNodeTrySetDirInfo(FileNode,
+            FileDesc->DirectoryOffset,
             Irp->AssociatedIrp.SystemBuffer,
             (ULONG)Response->IoStatus.Information,
             DirInfoChangeNumber) &&
-        FspFileNodeReferenceDirInfo(FileNode, &DirInfoBuffer, &DirInfoSize))
+        FspFileNodeReferenceDirInfo(FileNode, &DirInfoBuffer, 0))
     {
         Result = FspFsvolQueryDirectoryCopyCache(FileDesc,
-            TRUE,
+            0 == FileDesc->DirectoryOffset,
             FileInformationClass, ReturnSingleEntry,
-            DirInfoBuffer, DirInfoSize, Buffer, &Length);
+            DirInfoBuffer, Buffer, &Length);
 
         FspFileNodeDereferenceDirInfo(DirInfoBuffer);
     }
@@ -354,39 +354,16 @@ VOID FspPropagateTopFlags(PIRP Irp, PIRP TopLevelIrp);
 #define FspAllocNonPagedExternal(Size)  ExAllocatePoolWithTag(NonPagedPool, Size, FSP_ALLOC_EXTERNAL_TAG)
 #define FspFreeExternal(Pointer)        ExFreePool(Pointer)
 
-/* hash mix */
-/* Based on the MurmurHash3 fmix32/fmix64 function:
- * See: https://code.google.com/p/smhasher/source/browse/trunk/MurmurHash3.cpp?r=152#68
- */
-static inline
-UINT32 FspHashMix32(UINT32 h)
-{
-    h ^= h >> 16;
-    h *= 0x85ebca6b;
-    h ^= h >> 13;
-    h *= 0xc2b2ae35;
-    h ^= h >> 16;
-    return h;
-}
-static inline
-UINT64 FspHashMix64(UINT64 k)
-{
-    k ^= k >> 33;
-    k *= 0xff51afd7ed558ccdULL;
-    k ^= k >> 33;
-    k *= 0xc4ceb9fe1a85ec53ULL;
-    k ^= k >> 33;
-    return k;
-}
-static inline
-ULONG FspHashMixPointer(PVOID Pointer)
-{
-#if _WIN64
-    return (ULONG)FspHashMix64((UINT64)Pointer);
-#else
-    return (ULONG)FspHashMix32((UINT32)Pointer);
-#endif
-}
+/* hash mix, pointer set, meta cache shard, negative name cache table, dir cache pages, range lock,
+ * payload, I/O scheduler, wake queue */
+#include <shared/ptrset.h>
+#include <shared/metacache.h>
+#include <shared/negcache.h>
+#include <shared/dircache.h>
+#include <shared/rangelock.h>
+#include <shared/payload.h>
+#include <shared/iosched.h>
+#include <shared/wakeq.h>
 
 /* timeouts */
 #define FspTimeoutInfinity32            ((UINT32)-1L)
@@ -531,8 +508,8 @@ NTSTATUS FspIrpHookNext(PDEVICE_OBJECT DeviceObject, PIRP Irp, PVOID Context);
 #define FspIrpTimestampInfinity         ((ULONG)-1L)
 #define FspIrpTimestamp(Irp)            \
     (*(ULONG *)&(Irp)->Tail.Overlay.DriverContext[0])
-#define FspIrpDictNext(Irp)             \
-    (*(PIRP *)&(Irp)->Tail.Overlay.DriverContext[1])
+#define FspIrpRangeLockEntry(Irp)       \
+    (*(PVOID *)&(Irp)->Tail.Overlay.DriverContext[1])
 static inline
 FSP_FSCTL_TRANSACT_REQ *FspIrpRequest(PIRP Irp)
 {
@@ -579,17 +556,21 @@ typedef struct
 {
     KSPIN_LOCK SpinLock;
     BOOLEAN Stopped;
+    BOOLEAN AdaptiveWakeup;
     KEVENT PendingIrpEvent;
-    LIST_ENTRY PendingIrpList, ProcessIrpList, RetriedIrpList;
+    FSP_WAKE_QUEUE PendingWakeQueue;
+    FSP_IO_SCHED PendingIrpSched;
+    LIST_ENTRY ProcessIrpList, RetriedIrpList;
     IO_CSQ PendingIoCsq, ProcessIoCsq, RetriedIoCsq;
     ULONG IrpTimeout;
     ULONG PendingIrpCapacity, PendingIrpCount, ProcessIrpCount, RetriedIrpCount;
     VOID (*CompleteCanceledIrp)(PIRP Irp);
-    ULONG ProcessIrpBucketCount;
-    PVOID ProcessIrpBuckets[];
+    FSP_PTRSET ProcessIrpSet;
+    PVOID ProcessIrpSlots[];
 } FSP_IOQ;
 NTSTATUS FspIoqCreate(
-    ULONG IrpCapacity, PLARGE_INTEGER IrpTimeout, VOID (*CompleteCanceledIrp)(PIRP Irp),
+    ULONG IrpCapacity, PLARGE_INTEGER IrpTimeout, BOOLEAN AdaptiveWakeup,
+    VOID (*CompleteCanceledIrp)(PIRP Irp),
     FSP_IOQ **PIoq);
 VOID FspIoqDelete(FSP_IOQ *Ioq);
 VOID FspIoqStop(FSP_IOQ *Ioq);
@@ -609,26 +590,49 @@ ULONG FspIoqRetriedIrpCount(FSP_IOQ *Ioq);
 /* meta cache */
 typedef struct
 {
-    KSPIN_LOCK SpinLock;
+    DECLSPEC_CACHEALIGN KSPIN_LOCK SpinLock;
+    FSP_META_CACHE_SHARD Shard;
+} FSP_META_CACHE_LOCKED_SHARD;
+typedef struct
+{
     UINT64 MetaTimeout;
-    ULONG MetaCapacity, ItemCount;
     ULONG ItemSizeMax;
-    UINT64 ItemIndex;
-    LIST_ENTRY ItemList;
-    ULONG ItemBucketCount;
-    PVOID ItemBuckets[];
+    LONG64 volatile ItemIndex;
+    FSP_META_CACHE_LOCKED_SHARD Shards[FspMetaCacheShardCount];
 } FSP_META_CACHE;
 NTSTATUS FspMetaCacheCreate(
     ULONG MetaCapacity, ULONG ItemSizeMax, PLARGE_INTEGER MetaTimeout,
     FSP_META_CACHE **PMetaCache);
 VOID FspMetaCacheDelete(FSP_META_CACHE *MetaCache);
+VOID FspMetaCacheGetStatistics(FSP_META_CACHE *MetaCache, FSP_META_CACHE_STATISTICS *Statistics);
 VOID FspMetaCacheInvalidateExpired(FSP_META_CACHE *MetaCache, UINT64 ExpirationTime);
 BOOLEAN FspMetaCacheReferenceItemBuffer(FSP_META_CACHE *MetaCache, UINT64 ItemIndex,
     PCVOID *PBuffer, PULONG PSize);
 VOID FspMetaCacheDereferenceItemBuffer(PCVOID Buffer);
+PVOID FspMetaCacheAllocateItemBuffer(FSP_META_CACHE *MetaCache, ULONG Size);
+VOID FspMetaCacheFreeItemBuffer(PVOID Buffer);
+UINT64 FspMetaCacheAddItemBuffer(FSP_META_CACHE *MetaCache, PVOID Buffer);
 UINT64 FspMetaCacheAddItem(FSP_META_CACHE *MetaCache, PCVOID Buffer, ULONG Size);
 VOID FspMetaCacheInvalidateItem(FSP_META_CACHE *MetaCache, UINT64 ItemIndex);
 
+/* negative name cache */
+typedef struct
+{
+    FAST_MUTEX Mutex;
+    UINT64 NegTimeout;
+    FSP_NEG_CACHE_TABLE Table;
+} FSP_NEG_CACHE;
+NTSTATUS FspNegCacheCreate(
+    ULONG NegCapacity, BOOLEAN CaseInsensitive, PLARGE_INTEGER NegTimeout,
+    FSP_NEG_CACHE **PNegCache);
+VOID FspNegCacheDelete(FSP_NEG_CACHE *NegCache);
+VOID FspNegCacheInvalidateExpired(FSP_NEG_CACHE *NegCache, UINT64 ExpirationTime);
+UINT64 FspNegCacheGetToken(FSP_NEG_CACHE *NegCache, PUNICODE_STRING FileName);
+BOOLEAN FspNegCacheLookup(FSP_NEG_CACHE *NegCache, PUNICODE_STRING FileName);
+VOID FspNegCacheInsert(FSP_NEG_CACHE *NegCache, PUNICODE_STRING FileName, UINT64 Token);
+VOID FspNegCacheInvalidateParent(FSP_NEG_CACHE *NegCache, PUNICODE_STRING FileName);
+VOID FspNegCacheInvalidate(FSP_NEG_CACHE *NegCache);
+
 /* I/O processing */
 #define FSP_FSCTL_WORK                  \
     CTL_CODE(FILE_DEVICE_FILE_SYSTEM, 0x800 + 'W', METHOD_NEITHER, FILE_ANY_ACCESS)
@@ -638,6 +642,7 @@ enum
 {
     FspIopRequestMustSucceed            = 0x01,
     FspIopRequestNonPaged               = 0x02,
+    FspIopRequestExtendedPayload        = 0x04,
 };
 #define FspIopCreateRequest(I, F, E, P) \
     FspIopCreateRequestFunnel(I, F, E, 0, 0, P)
@@ -647,6 +652,8 @@ enum
     FspIopCreateRequestFunnel(I, F, E, RF, 0, P)
 #define FspIopCreateRequestMustSucceedEx(I, F, E, RF, P)\
     FspIopCreateRequestFunnel(I, F, E, RF, FspIopRequestMustSucceed, P)
+#define FspIopCreateRequestPayloadEx(I, F, E, RF, X, P)\
+    FspIopCreateRequestFunnel(I, F, E, RF, (X) ? FspIopRequestExtendedPayload : 0, P)
 #define FspIopCreateRequestWorkItem(I, E, RF, P)\
     FspIopCreateRequestFunnel(I, 0, E, RF, FspIopRequestNonPaged, P)
 #define FspIopRequestContext(Request, I)\
@@ -714,10 +721,14 @@ VOID FspWqPostIrpWorkItem(PIRP Irp);
 /* device management */
 enum
 {
-    FspFsvolDeviceSecurityCacheCapacity = 100,
+    FspFsvolDeviceSecurityCacheCapacity = 128 * 1024,   /* bytes */
     FspFsvolDeviceSecurityCacheItemSizeMax = 4096,
-    FspFsvolDeviceDirInfoCacheCapacity = 100,
+    FspFsvolDeviceDirInfoCacheCapacity = 4 * 1024 * 1024, /* bytes */
     FspFsvolDeviceDirInfoCacheItemSizeMax = FSP_FSCTL_ALIGN_UP(16384, PAGE_SIZE),
+    FspFsvolDeviceDirInfoCachePageSizeMax =
+        FspFsvolDeviceDirInfoCacheItemSizeMax + FspFsvolDeviceDirInfoCacheItemSizeMax / 16,
+    FspFsvolDeviceDirInfoCacheDirectorySizeMax = FspFsvolDeviceDirInfoCacheCapacity / 2,
+    FspFsvolDeviceNegCacheCapacity = 1024,              /* entries */
 };
 typedef struct
 {
@@ -744,7 +755,7 @@ typedef struct
 typedef struct
 {
     FSP_DEVICE_EXTENSION Base;
-    UINT32 InitDoneFsvrt:1, InitDoneIoq:1, InitDoneSec:1, InitDoneDir:1,
+    UINT32 InitDoneFsvrt:1, InitDoneIoq:1, InitDoneSec:1, InitDoneDir:1, InitDoneNeg:1,
         InitDoneCtxTab:1, InitDoneTimer:1, InitDoneInfo:1, InitDoneNotify:1;
     PDEVICE_OBJECT FsctlDeviceObject;
     PDEVICE_OBJECT FsvrtDeviceObject;
@@ -756,6 +767,7 @@ typedef struct
     FSP_IOQ *Ioq;
     FSP_META_CACHE *SecurityCache;
     FSP_META_CACHE *DirInfoCache;
+    FSP_NEG_CACHE *NegCache;
     KSPIN_LOCK ExpirationLock;
     WORK_QUEUE_ITEM ExpirationWorkItem;
     BOOLEAN ExpirationInProgress;
@@ -880,6 +892,8 @@ typedef struct
     SECTION_OBJECT_POINTERS SectionObjectPointers;
     KSPIN_LOCK DirInfoSpinLock;
     UINT64 DirInfo;                     /* allows to invalidate DirInfo w/o resources acquired */
+    KSPIN_LOCK RangeLockSpinLock;
+    FSP_RANGE_LOCK RangeLock;           /* non-cached I/O with FileNode acquired shared */
 } FSP_FILE_NODE_NONPAGED;
 typedef struct
 {
@@ -935,10 +949,10 @@ typedef struct
     BOOLEAN HasTraversePrivilege;
     BOOLEAN DeleteOnClose;
     BOOLEAN DirectoryHasSuchFile;
+    UINT64 NegCacheToken;
     UNICODE_STRING DirectoryPattern;
     UINT64 DirectoryOffset;
-    UINT64 DirInfo;
-    ULONG DirInfoCacheHint;
+    ULONG DirInfoCacheHint;             /* DirInfo cache page number */
 } FSP_FILE_DESC;
 NTSTATUS FspFileNodeCopyList(PDEVICE_OBJECT DeviceObject,
     FSP_FILE_NODE ***PFileNodes, PULONG PFileNodeCount);
@@ -966,6 +980,9 @@ VOID FspFileNodeConvertExclusiveToSharedF(FSP_FILE_NODE *FileNode, ULONG Flags);
 VOID FspFileNodeSetOwnerF(FSP_FILE_NODE *FileNode, ULONG Flags, PVOID Owner);
 VOID FspFileNodeReleaseF(FSP_FILE_NODE *FileNode, ULONG Flags);
 VOID FspFileNodeReleaseOwnerF(FSP_FILE_NODE *FileNode, ULONG Flags, PVOID Owner);
+NTSTATUS FspFileNodeAcquireRange(FSP_FILE_NODE *FileNode, PIRP Irp,
+    UINT64 Offset, ULONG Length, BOOLEAN Exclusive, BOOLEAN Wait);
+VOID FspFileNodeReleaseRange(FSP_FILE_NODE *FileNode, PIRP Irp);
 FSP_FILE_NODE *FspFileNodeOpen(FSP_FILE_NODE *FileNode, PFILE_OBJECT FileObject,
     UINT32 GrantedAccess, UINT32 ShareAccess, NTSTATUS *PResult);
 VOID FspFileNodeCleanup(FSP_FILE_NODE *FileNode, PFILE_OBJECT FileObject,
@@ -983,13 +1000,16 @@ VOID FspFileNodeSetFileInfo(FSP_FILE_NODE *FileNode, PFILE_OBJECT CcFileObject,
     const FSP_FSCTL_FILE_INFO *FileInfo);
 BOOLEAN FspFileNodeTrySetFileInfo(FSP_FILE_NODE *FileNode, PFILE_OBJECT CcFileObject,
     const FSP_FSCTL_FILE_INFO *FileInfo, ULONG InfoChangeNumber);
+VOID FspFileNodeInvalidateFileInfo(FSP_FILE_NODE *FileNode);
 BOOLEAN FspFileNodeReferenceSecurity(FSP_FILE_NODE *FileNode, PCVOID *PBuffer, PULONG PSize);
 VOID FspFileNodeSetSecurity(FSP_FILE_NODE *FileNode, PCVOID Buffer, ULONG Size);
 BOOLEAN FspFileNodeTrySetSecurity(FSP_FILE_NODE *FileNode, PCVOID Buffer, ULONG Size,
     ULONG SecurityChangeNumber);
 BOOLEAN FspFileNodeReferenceDirInfo(FSP_FILE_NODE *FileNode, PCVOID *PBuffer, PULONG PSize);
-VOID FspFileNodeSetDirInfo(FSP_FILE_NODE *FileNode, PCVOID Buffer, ULONG Size);
-BOOLEAN FspFileNodeTrySetDirInfo(FSP_FILE_NODE *FileNode, PCVOID Buffer, ULONG Size,
+BOOLEAN FspFileNodeReferenceDirInfoPage(FSP_FILE_NODE *FileNode, UINT64 PageItemIndex,
+    PCVOID *PBuffer, PULONG PSize);
+BOOLEAN FspFileNodeSetDirInfo(FSP_FILE_NODE *FileNode, UINT64 Offset, PCVOID Buffer, ULONG Size);
+BOOLEAN FspFileNodeTrySetDirInfo(FSP_FILE_NODE *FileNode, UINT64 Offset, PCVOID Buffer, ULONG Size,
     ULONG DirInfoChangeNumber);
 VOID FspFileNodeNotifyChange(FSP_FILE_NODE *FileNode, ULONG Filter, ULONG Action);
 NTSTATUS FspFileNodeProcessLockIrp(FSP_FILE_NODE *FileNode, PIRP Irp);
@@ -31,6 +31,11 @@ VOID FspFileNodeConvertExclusiveToSharedF(FSP_FILE_NODE *FileNode, ULONG Flags);
 VOID FspFileNodeSetOwnerF(FSP_FILE_NODE *FileNode, ULONG Flags, PVOID Owner);
 VOID FspFileNodeReleaseF(FSP_FILE_NODE *FileNode, ULONG Flags);
 VOID FspFileNodeReleaseOwnerF(FSP_FILE_NODE *FileNode, ULONG Flags, PVOID Owner);
+NTSTATUS FspFileNodeAcquireRange(FSP_FILE_NODE *FileNode, PIRP Irp,
+    UINT64 Offset, ULONG Length, BOOLEAN Exclusive, BOOLEAN Wait);
+static VOID FspFileNodeReleaseRangeEntry(FSP_FILE_NODE *FileNode,
+    FSP_RANGE_LOCK_ENTRY *RangeEntry);
+VOID FspFileNodeReleaseRange(FSP_FILE_NODE *FileNode, PIRP Irp);
 FSP_FILE_NODE *FspFileNodeOpen(FSP_FILE_NODE *FileNode, PFILE_OBJECT FileObject,
     UINT32 GrantedAccess, UINT32 ShareAccess, NTSTATUS *PResult);
 VOID FspFileNodeCleanup(FSP_FILE_NODE *FileNode, PFILE_OBJECT FileObject,
@@ -48,13 +53,20 @@ VOID FspFileNodeSetFileInfo(FSP_FILE_NODE *FileNode, PFILE_OBJECT CcFileObject,
     const FSP_FSCTL_FILE_INFO *FileInfo);
 BOOLEAN FspFileNodeTrySetFileInfo(FSP_FILE_NODE *FileNode, PFILE_OBJECT CcFileObject,
     const FSP_FSCTL_FILE_INFO *FileInfo, ULONG InfoChangeNumber);
+VOID FspFileNodeInvalidateFileInfo(FSP_FILE_NODE *FileNode);
 BOOLEAN FspFileNodeReferenceSecurity(FSP_FILE_NODE *FileNode, PCVOID *PBuffer, PULONG PSize);
 VOID FspFileNodeSetSecurity(FSP_FILE_NODE *FileNode, PCVOID Buffer, ULONG Size);
 BOOLEAN FspFileNodeTrySetSecurity(FSP_FILE_NODE *FileNode, PCVOID Buffer, ULONG Size,
     ULONG SecurityChangeNumber);
+static UINT64 FspFileNodeAddDirInfoPage(FSP_FSVOL_DEVICE_EXTENSION *FsvolDeviceExtension,
+    UINT64 DirInfo, UINT64 Offset, PCVOID Buffer, ULONG Size);
+static VOID FspFileNodeInvalidateDirInfoItems(FSP_FSVOL_DEVICE_EXTENSION *FsvolDeviceExtension,
+    UINT64 DirInfo, BOOLEAN InvalidatePages);
 BOOLEAN FspFileNodeReferenceDirInfo(FSP_FILE_NODE *FileNode, PCVOID *PBuffer, PULONG PSize);
-VOID FspFileNodeSetDirInfo(FSP_FILE_NODE *FileNode, PCVOID Buffer, ULONG Size);
-BOOLEAN FspFileNodeTrySetDirInfo(FSP_FILE_NODE *FileNode, PCVOID Buffer, ULONG Size,
+BOOLEAN FspFileNodeReferenceDirInfoPage(FSP_FILE_NODE *FileNode, UINT64 PageItemIndex,
+    PCVOID *PBuffer, PULONG PSize);
+BOOLEAN FspFileNodeSetDirInfo(FSP_FILE_NODE *FileNode, UINT64 Offset, PCVOID Buffer, ULONG Size);
+BOOLEAN FspFileNodeTrySetDirInfo(FSP_FILE_NODE *FileNode, UINT64 Offset, PCVOID Buffer, ULONG Size,
     ULONG DirInfoChangeNumber);
 static VOID FspFileNodeInvalidateDirInfo(FSP_FILE_NODE *FileNode);
 VOID FspFileNodeNotifyChange(FSP_FILE_NODE *FileNode,
@@ -79,6 +91,9 @@ NTSTATUS FspFileDescResetDirectoryPattern(FSP_FILE_DESC *FileDesc,
 #pragma alloc_text(PAGE, FspFileNodeSetOwnerF)
 #pragma alloc_text(PAGE, FspFileNodeReleaseF)
 #pragma alloc_text(PAGE, FspFileNodeReleaseOwnerF)
+// !#pragma alloc_text(PAGE, FspFileNodeAcquireRange)
+// !#pragma alloc_text(PAGE, FspFileNodeReleaseRangeEntry)
+// !#pragma alloc_text(PAGE, FspFileNodeReleaseRange)
 #pragma alloc_text(PAGE, FspFileNodeOpen)
 #pragma alloc_text(PAGE, FspFileNodeCleanup)
 #pragma alloc_text(PAGE, FspFileNodeCleanupComplete)
@@ -90,10 +105,14 @@ NTSTATUS FspFileDescResetDirectoryPattern(FSP_FILE_DESC *FileDesc,
 #pragma alloc_text(PAGE, FspFileNodeTryGetFileInfo)
 #pragma alloc_text(PAGE, FspFileNodeSetFileInfo)
 #pragma alloc_text(PAGE, FspFileNodeTrySetFileInfo)
+#pragma alloc_text(PAGE, FspFileNodeInvalidateFileInfo)
 #pragma alloc_text(PAGE, FspFileNodeReferenceSecurity)
 #pragma alloc_text(PAGE, FspFileNodeSetSecurity)
 #pragma alloc_text(PAGE, FspFileNodeTrySetSecurity)
+// !#pragma alloc_text(PAGE, FspFileNodeAddDirInfoPage)
+// !#pragma alloc_text(PAGE, FspFileNodeInvalidateDirInfoItems)
 // !#pragma alloc_text(PAGE, FspFileNodeReferenceDirInfo)
+// !#pragma alloc_text(PAGE, FspFileNodeReferenceDirInfoPage)
 // !#pragma alloc_text(PAGE, FspFileNodeSetDirInfo)
 // !#pragma alloc_text(PAGE, FspFileNodeTrySetDirInfo)
 // !#pragma alloc_text(PAGE, FspFileNodeInvalidateDirInfo)
@@ -177,6 +196,8 @@ NTSTATUS FspFileNodeCreate(PDEVICE_OBJECT DeviceObject,
     ExInitializeResourceLite(&NonPaged->PagingIoResource);
     ExInitializeFastMutex(&NonPaged->HeaderFastMutex);
     KeInitializeSpinLock(&NonPaged->DirInfoSpinLock);
+    KeInitializeSpinLock(&NonPaged->RangeLockSpinLock);
+    FspRangeLockInitialize(&NonPaged->RangeLock);
 
     RtlZeroMemory(FileNode, sizeof *FileNode + ExtraSize);
     FileNode->Header.NodeTypeCode = FspFileNodeFileKind;
@@ -207,11 +228,14 @@ VOID FspFileNodeDelete(FSP_FILE_NODE *FileNode)
     FSP_FSVOL_DEVICE_EXTENSION *FsvolDeviceExtension =
         FspFsvolDeviceExtension(FileNode->FsvolDeviceObject);
 
+    ASSERT(0 == FileNode->NonPaged->RangeLock.GrantedCount &&
+        0 == FileNode->NonPaged->RangeLock.WaitingCount);
+
     FsRtlUninitializeFileLock(&FileNode->FileLock);
 
     FsRtlTeardownPerStreamContexts(&FileNode->Header);
 
-    FspMetaCacheInvalidateItem(FsvolDeviceExtension->DirInfoCache, FileNode->NonPaged->DirInfo);
+    FspFileNodeInvalidateDirInfoItems(FsvolDeviceExtension, FileNode->NonPaged->DirInfo, TRUE);
     FspMetaCacheInvalidateItem(FsvolDeviceExtension->SecurityCache, FileNode->Security);
 
     FspDeviceDereference(FileNode->FsvolDeviceObject);
@@ -396,6 +420,94 @@ VOID FspFileNodeReleaseOwnerF(FSP_FILE_NODE *FileNode, ULONG Flags, PVOID Owner)
     FSP_FILE_NODE_CLR_FLAGS();
 }
 
+typedef struct
+{
+    FSP_RANGE_LOCK_ENTRY Base;
+    KEVENT GrantedEvent;
+} FSP_FILE_NODE_RANGE_ENTRY;
+
+NTSTATUS FspFileNodeAcquireRange(FSP_FILE_NODE *FileNode, PIRP Irp,
+    UINT64 Offset, ULONG Length, BOOLEAN Exclusive, BOOLEAN Wait)
+{
+    /*
+     * Acquire a byte range lock for a non-cached I/O that runs with the FileNode acquired
+     * shared. The range lock entry is kept in the IRP until FspFileNodeReleaseRange.
+     * Returns STATUS_CANT_WAIT if the range is locked and Wait is FALSE.
+     */
+
+    // !PAGED_CODE();
+
+    FSP_FILE_NODE_NONPAGED *NonPaged = FileNode->NonPaged;
+    FSP_FILE_NODE_RANGE_ENTRY *RangeEntry;
+    KIRQL Irql;
+    BOOLEAN Granted;
+
+    FspIrpRangeLockEntry(Irp) = 0;
+
+    RangeEntry = FspAllocNonPaged(sizeof *RangeEntry);
+    if (0 == RangeEntry)
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    FspRangeLockEntryInitialize(&RangeEntry->Base, Offset, Length, Exclusive);
+    KeInitializeEvent(&RangeEntry->GrantedEvent, NotificationEvent, FALSE);
+
+    KeAcquireSpinLock(&NonPaged->RangeLockSpinLock, &Irql);
+    Granted = FspRangeLockAcquire(&NonPaged->RangeLock, &RangeEntry->Base);
+    KeReleaseSpinLock(&NonPaged->RangeLockSpinLock, Irql);
+
+    if (!Granted)
+    {
+        if (!Wait)
+        {
+            /* withdraw the entry; this may grant entries that were waiting behind it */
+            FspFileNodeReleaseRangeEntry(FileNode, &RangeEntry->Base);
+            FspFree(RangeEntry);
+            return STATUS_CANT_WAIT;
+        }
+
+        KeWaitForSingleObject(&RangeEntry->GrantedEvent, Executive, KernelMode, FALSE, 0);
+    }
+
+    FspIrpRangeLockEntry(Irp) = RangeEntry;
+
+    return STATUS_SUCCESS;
+}
+
+static VOID FspFileNodeReleaseRangeEntry(FSP_FILE_NODE *FileNode,
+    FSP_RANGE_LOCK_ENTRY *RangeEntry)
+{
+    // !PAGED_CODE();
+
+    FSP_FILE_NODE_NONPAGED *NonPaged = FileNode->NonPaged;
+    FSP_RANGE_LOCK_ENTRY *GrantedEntry, *NextEntry;
+    KIRQL Irql;
+
+    KeAcquireSpinLock(&NonPaged->RangeLockSpinLock, &Irql);
+    GrantedEntry = FspRangeLockRelease(&NonPaged->RangeLock, RangeEntry);
+    for (; 0 != GrantedEntry; GrantedEntry = NextEntry)
+    {
+        NextEntry = GrantedEntry->GrantNext;
+        KeSetEvent(&CONTAINING_RECORD(GrantedEntry, FSP_FILE_NODE_RANGE_ENTRY, Base)->GrantedEvent,
+            1, FALSE);
+    }
+    KeReleaseSpinLock(&NonPaged->RangeLockSpinLock, Irql);
+}
+
+VOID FspFileNodeReleaseRange(FSP_FILE_NODE *FileNode, PIRP Irp)
+{
+    // !PAGED_CODE();
+
+    FSP_FILE_NODE_RANGE_ENTRY *RangeEntry = FspIrpRangeLockEntry(Irp);
+
+    if (0 == RangeEntry)
+        return;
+
+    FspIrpRangeLockEntry(Irp) = 0;
+
+    FspFileNodeReleaseRangeEntry(FileNode, &RangeEntry->Base);
+    FspFree(RangeEntry);
+}
+
 FSP_FILE_NODE *FspFileNodeOpen(FSP_FILE_NODE *FileNode, PFILE_OBJECT FileObject,
     UINT32 GrantedAccess, UINT32 ShareAccess, NTSTATUS *PResult)
 {
@@ -803,6 +915,20 @@ BOOLEAN FspFileNodeTrySetFileInfo(FSP_FILE_NODE *FileNode, PFILE_OBJECT CcFileOb
     return TRUE;
 }
 
+VOID FspFileNodeInvalidateFileInfo(FSP_FILE_NODE *FileNode)
+{
+    /*
+     * Unlike FspFileNodeSetFileInfo this may be called with the FileNode acquired shared
+     * (by concurrent non-cached writes). It expires the cached file info so that the next
+     * query goes to user mode.
+     */
+
+    PAGED_CODE();
+
+    InterlockedExchange64((PLONG64)&FileNode->InfoExpirationTime, 0);
+    InterlockedIncrement((PLONG)&FileNode->InfoChangeNumber);
+}
+
 BOOLEAN FspFileNodeReferenceSecurity(FSP_FILE_NODE *FileNode, PCVOID *PBuffer, PULONG PSize)
 {
     PAGED_CODE();
@@ -839,6 +965,82 @@ BOOLEAN FspFileNodeTrySetSecurity(FSP_FILE_NODE *FileNode, PCVOID Buffer, ULONG
     return TRUE;
 }
 
+/*
+ * The DirInfo of a directory is a listing of DirInfo cache pages (see shared/dircache.h).
+ * NonPaged->DirInfo is the meta cache item of the listing's page index; each page is an
+ * item of its own. A page index is never modified: adding a page to a listing adds a new
+ * page index item and invalidates the old one.
+ */
+
+static UINT64 FspFileNodeAddDirInfoPage(FSP_FSVOL_DEVICE_EXTENSION *FsvolDeviceExtension,
+    UINT64 DirInfo, UINT64 Offset, PCVOID Buffer, ULONG Size)
+{
+    // !PAGED_CODE();
+
+    FSP_META_CACHE *DirInfoCache = FsvolDeviceExtension->DirInfoCache;
+    const FSP_DIR_CACHE_INDEX *Index = 0;
+    FSP_DIR_CACHE_INDEX *NewIndex = 0;
+    FSP_DIR_CACHE_PAGE *Page = 0;
+    ULONG PageSize, EntryCount, EntriesSize;
+    BOOLEAN EndOfDirectory;
+    UINT64 NewDirInfo = 0;
+
+    /* a response read at offset 0 starts a new listing; other responses continue it */
+    if (0 != Offset &&
+        !FspMetaCacheReferenceItemBuffer(DirInfoCache, DirInfo, (PCVOID *)&Index, 0))
+        return 0;
+
+    PageSize = FspDirCachePageScan(Buffer, Size, &EntryCount, &EntriesSize, &EndOfDirectory);
+    if ((0 == EntryCount && !EndOfDirectory) ||
+        !FspDirCacheIndexCanAppend(Index, Offset, PageSize,
+            FspFsvolDeviceDirInfoCacheDirectorySizeMax))
+        goto exit;
+
+    Page = FspMetaCacheAllocateItemBuffer(DirInfoCache, PageSize);
+    NewIndex = FspMetaCacheAllocateItemBuffer(DirInfoCache,
+        FspDirCacheIndexSize(0 != Index ? Index->PageCount + 1 : 1));
+    if (0 == Page || 0 == NewIndex)
+        goto exit;
+
+    /* the page may be evicted as soon as it is added; so add it to the new index first */
+    FspDirCachePageBuild(Page, Offset, Buffer, EntryCount, EntriesSize, EndOfDirectory);
+    FspDirCacheIndexAppend(NewIndex, Index, Page, PageSize, 0);
+    NewIndex->Pages[NewIndex->PageCount - 1].ItemIndex =
+        FspMetaCacheAddItemBuffer(DirInfoCache, Page);
+    NewDirInfo = FspMetaCacheAddItemBuffer(DirInfoCache, NewIndex);
+    Page = 0;
+    NewIndex = 0;
+
+exit:
+    if (0 != NewIndex)
+        FspMetaCacheFreeItemBuffer(NewIndex);
+    if (0 != Page)
+        FspMetaCacheFreeItemBuffer(Page);
+    if (0 != Index)
+        FspMetaCacheDereferenceItemBuffer(Index);
+
+    return NewDirInfo;
+}
+
+static VOID FspFileNodeInvalidateDirInfoItems(FSP_FSVOL_DEVICE_EXTENSION *FsvolDeviceExtension,
+    UINT64 DirInfo, BOOLEAN InvalidatePages)
+{
+    // !PAGED_CODE();
+
+    FSP_META_CACHE *DirInfoCache = FsvolDeviceExtension->DirInfoCache;
+    const FSP_DIR_CACHE_INDEX *Index;
+
+    if (InvalidatePages &&
+        FspMetaCacheReferenceItemBuffer(DirInfoCache, DirInfo, (PCVOID *)&Index, 0))
+    {
+        for (ULONG I = 0; Index->PageCount > I; I++)
+            FspMetaCacheInvalidateItem(DirInfoCache, Index->Pages[I].ItemIndex);
+        FspMetaCacheDereferenceItemBuffer(Index);
+    }
+
+    FspMetaCacheInvalidateItem(DirInfoCache, DirInfo);
+}
+
 BOOLEAN FspFileNodeReferenceDirInfo(FSP_FILE_NODE *FileNode, PCVOID *PBuffer, PULONG PSize)
 {
     // !PAGED_CODE();
@@ -846,40 +1048,80 @@ BOOLEAN FspFileNodeReferenceDirInfo(FSP_FILE_NODE *FileNode, PCVOID *PBuffer, PU
     FSP_FSVOL_DEVICE_EXTENSION *FsvolDeviceExtension =
         FspFsvolDeviceExtension(FileNode->FsvolDeviceObject);
     FSP_FILE_NODE_NONPAGED *NonPaged = FileNode->NonPaged;
+    KIRQL Irql;
     UINT64 DirInfo;
 
-    /* no need to acquire the DirInfoSpinLock as the FileNode is acquired */
+    /* acquire the DirInfoSpinLock to protect against concurrent FspFileNodeInvalidateDirInfo */
+    KeAcquireSpinLock(&NonPaged->DirInfoSpinLock, &Irql);
     DirInfo = NonPaged->DirInfo;
+    KeReleaseSpinLock(&NonPaged->DirInfoSpinLock, Irql);
 
     return FspMetaCacheReferenceItemBuffer(FsvolDeviceExtension->DirInfoCache,
         DirInfo, PBuffer, PSize);
 }
 
-VOID FspFileNodeSetDirInfo(FSP_FILE_NODE *FileNode, PCVOID Buffer, ULONG Size)
+BOOLEAN FspFileNodeReferenceDirInfoPage(FSP_FILE_NODE *FileNode, UINT64 PageItemIndex,
+    PCVOID *PBuffer, PULONG PSize)
 {
     // !PAGED_CODE();
 
+    FSP_FSVOL_DEVICE_EXTENSION *FsvolDeviceExtension =
+        FspFsvolDeviceExtension(FileNode->FsvolDeviceObject);
+
+    return FspMetaCacheReferenceItemBuffer(FsvolDeviceExtension->DirInfoCache,
+        PageItemIndex, PBuffer, PSize);
+}
+
+BOOLEAN FspFileNodeSetDirInfo(FSP_FILE_NODE *FileNode, UINT64 Offset, PCVOID Buffer, ULONG Size)
+{
+    /*
+     * Buffer is a QueryDirectory response read at directory Offset. If Offset is 0 the
+     * response replaces the directory listing; otherwise it is added to the listing if it
+     * continues it. If Buffer is NULL the listing is invalidated.
+     */
+
+    // !PAGED_CODE();
+
     FSP_FSVOL_DEVICE_EXTENSION *FsvolDeviceExtension =
         FspFsvolDeviceExtension(FileNode->FsvolDeviceObject);
     FSP_FILE_NODE_NONPAGED *NonPaged = FileNode->NonPaged;
     KIRQL Irql;
-    UINT64 DirInfo;
+    UINT64 DirInfo, NewDirInfo;
+    BOOLEAN Replaced;
 
-    /* no need to acquire the DirInfoSpinLock as the FileNode is acquired */
+    /* acquire the DirInfoSpinLock to protect against concurrent FspFileNodeInvalidateDirInfo */
+    KeAcquireSpinLock(&NonPaged->DirInfoSpinLock, &Irql);
     DirInfo = NonPaged->DirInfo;
+    KeReleaseSpinLock(&NonPaged->DirInfoSpinLock, Irql);
 
-    FspMetaCacheInvalidateItem(FsvolDeviceExtension->DirInfoCache, DirInfo);
-    DirInfo = 0 != Buffer ?
-        FspMetaCacheAddItem(FsvolDeviceExtension->DirInfoCache, Buffer, Size) : 0;
-    FileNode->DirInfoChangeNumber++;
+    NewDirInfo = 0 != Buffer ?
+        FspFileNodeAddDirInfoPage(FsvolDeviceExtension, DirInfo, Offset, Buffer, Size) : 0;
+    if (0 != Buffer && 0 != Offset && 0 == NewDirInfo)
+        return FALSE;
 
-    /* acquire the DirInfoSpinLock to protect against concurrent FspFileNodeInvalidateDirInfo */
+    /*
+     * Swap in the new listing unless the old one was invalidated in the meantime; in that
+     * case the new listing may have been read before the directory changed.
+     */
     KeAcquireSpinLock(&NonPaged->DirInfoSpinLock, &Irql);
-    NonPaged->DirInfo = DirInfo;
+    Replaced = NonPaged->DirInfo == DirInfo;
+    if (Replaced)
+        NonPaged->DirInfo = NewDirInfo;
     KeReleaseSpinLock(&NonPaged->DirInfoSpinLock, Irql);
+
+    if (Replaced)
+    {
+        /* appending keeps the pages of the old listing */
+        FspFileNodeInvalidateDirInfoItems(FsvolDeviceExtension, DirInfo, 0 == Offset);
+        FileNode->DirInfoChangeNumber++;
+    }
+    else
+        FspFileNodeInvalidateDirInfoItems(FsvolDeviceExtension, NewDirInfo, TRUE);
+
+    return Replaced && 0 != NewDirInfo;
 }
 
-BOOLEAN FspFileNodeTrySetDirInfo(FSP_FILE_NODE *FileNode, PCVOID Buffer, ULONG Size,
+BOOLEAN FspFileNodeTrySetDirInfo(FSP_FILE_NODE *FileNode, UINT64 Offset, PCVOID Buffer, ULONG Size,
     ULONG DirInfoChangeNumber)
 {
     // !PAGED_CODE();
@@ -887,8 +1129,7 @@ BOOLEAN FspFileNodeTrySetDirInfo(FSP_FILE_NODE *FileNode, PCVOID Buffer, ULONG S
     if (FileNode->DirInfoChangeNumber != DirInfoChangeNumber)
         return FALSE;
 
-    FspFileNodeSetDirInfo(FileNode, Buffer, Size);
-    return TRUE;
+    return FspFileNodeSetDirInfo(FileNode, Offset, Buffer, Size);
 }
 
 static VOID FspFileNodeInvalidateDirInfo(FSP_FILE_NODE *FileNode)
@@ -904,9 +1145,10 @@ static VOID FspFileNodeInvalidateDirInfo(FSP_FILE_NODE *FileNode)
     /* acquire the DirInfoSpinLock to protect against concurrent FspFileNodeSetDirInfo */
     KeAcquireSpinLock(&NonPaged->DirInfoSpinLock, &Irql);
     DirInfo = NonPaged->DirInfo;
+    NonPaged->DirInfo = 0;
     KeReleaseSpinLock(&NonPaged->DirInfoSpinLock, Irql);
 
-    FspMetaCacheInvalidateItem(FsvolDeviceExtension->DirInfoCache, DirInfo);
+    FspFileNodeInvalidateDirInfoItems(FsvolDeviceExtension, DirInfo, TRUE);
 }
 
 VOID FspFileNodeNotifyChange(FSP_FILE_NODE *FileNode,
@@ -932,6 +1174,12 @@ VOID FspFileNodeNotifyChange(FSP_FILE_NODE *FileNode,
     case FILE_ACTION_RENAMED_NEW_NAME:
         FspFsvolDeviceInvalidateVolumeInfo(FsvolDeviceObject);
 
+        /* a renamed directory changes all names below it; else only the parent changes */
+        if (FILE_ACTION_RENAMED_NEW_NAME == Action && FileNode->IsDirectory)
+            FspNegCacheInvalidate(FsvolDeviceExtension->NegCache);
+        else
+            FspNegCacheInvalidateParent(FsvolDeviceExtension->NegCache, &FileNode->FileName);
+
         FspFsvolDeviceLockContextTable(FsvolDeviceObject);
         ParentNode = FspFsvolDeviceLookupContextByName(FsvolDeviceObject, &Parent);
         if (0 != ParentNode)
@@ -905,9 +905,10 @@ static NTSTATUS FspFsvolSetRenameInformation(
     NewFileName.Length = NewFileName.MaximumLength =
         Remain.Length + AppendBackslash * sizeof(WCHAR) + Suffix.Length;
 
-    Result = FspIopCreateRequestEx(Irp, &FileNode->FileName,
+    Result = FspIopCreateRequestPayloadEx(Irp, &FileNode->FileName,
         NewFileName.Length + sizeof(WCHAR),
-        FspFsvolSetInformationRequestFini, &Request);
+        FspFsvolSetInformationRequestFini,
+        FspFsvolDeviceExtension(FsvolDeviceObject)->VolumeParams.ExtendedPayload, &Request);
     if (!NT_SUCCESS(Result))
         goto unlock_exit;
 
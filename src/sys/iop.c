@@ -68,7 +68,8 @@ NTSTATUS FspIopCreateRequestFunnel(
     if (0 != FileName)
         ExtraSize += FSP_FSCTL_DEFAULT_ALIGN_UP(FileName->Length + sizeof(WCHAR));
 
-    if (FSP_FSCTL_TRANSACT_REQ_SIZEMAX < sizeof *Request + ExtraSize)
+    if (FspPayloadRequestSizeMax(FlagOn(Flags, FspIopRequestExtendedPayload)) <
+        sizeof *Request + ExtraSize)
         return STATUS_INVALID_PARAMETER;
 
     if (FlagOn(Flags, FspIopRequestMustSucceed))
@@ -34,6 +34,13 @@
  * marshalled back to us and will be then removed from the Processing queue
  * and completed.
  *
+ * The Pending queue is not strictly FIFO. Pending IRP's are dequeued by class
+ * (paging I/O and flushes, metadata, data) in weighted round-robin order and by
+ * originating process within a class in deficit round-robin order (see the I/O
+ * scheduler in shared/iosched.h). This way a process that streams large writes
+ * cannot starve opens and directory listings from other processes, and paging
+ * I/O does not wait behind user I/O.
+ *
  *
  * IRP State Diagram
  *                                 +--------------------+
@@ -118,6 +125,26 @@
  * To deal with the second problem we simply call FspIoqPendingResetSynch after
  * a WaitForSingleObject call if the IRP dequeueing fails; this ensures that the
  * event is in the correst state.
+ *
+ *
+ * Adaptive Wakeup
+ *
+ * The auto-reset event wakes a single thread per signal, but every IRP that
+ * arrives while all threads sleep still pays for a full sleep/wake and the
+ * thread that is woken is not necessarily one whose stack and data are in the
+ * cache. When a volume is created with the AdaptiveWakeup volume parameter the
+ * FSP_IOQ uses a wake queue (shared/wakeq.h) instead of the PendingIrpEvent:
+ *
+ * - The thread that most recently came back for an IRP polls the pending queue
+ * for a few microseconds before it goes to sleep; the polling time adapts to
+ * how often polling finds an IRP.
+ * - Each sleeping thread waits on its own event and threads are woken in LIFO
+ * order, so that hot threads stay hot.
+ * - When K IRP's arrive K threads are woken (less any threads that are polling
+ * or already woken), rather than one thread per SetEvent that may be lost.
+ *
+ * The wake queue is manipulated under the FSP_IOQ lock and a woken thread that
+ * does not receive an IRP simply returns to the caller, which retries.
  */
 
 /*
@@ -176,16 +203,85 @@ static PIRP FspCsqRemoveNextIrp(PIO_CSQ Csq, PVOID PeekContext)
 #define FspCsqRemoveNextIrp(Q, C)       IoCsqRemoveNextIrp(Q, C)
 #endif
 
+/*
+ * The Process dictionary starts with a page worth of slots allocated together
+ * with the FSP_IOQ and grows (doubles) as needed; it never shrinks.
+ */
+#define FspIoqProcessInitialSlotCount   (PAGE_SIZE / sizeof(PVOID))
+
 #define InterruptTimeToSecFactor        10000000ULL
 #define ConvertInterruptTimeToSec(Time) ((ULONG)((Time) / InterruptTimeToSecFactor))
 #define QueryInterruptTimeInSec()       ConvertInterruptTimeToSec(KeQueryInterruptTime())
 
+/*
+ * Adaptive wakeup spins for 2-64 microseconds before sleeping.
+ */
+#define FspIoqSpinMin                   2
+#define FspIoqSpinMax                   64
+
 typedef struct
 {
     PVOID IrpHint;
     ULONG ExpirationTime;
 } FSP_IOQ_PEEK_CONTEXT;
 
+typedef struct
+{
+    FSP_WAKE_QUEUE_WAITER Waiter;
+    KEVENT Event;
+} FSP_IOQ_WAITER;
+
+/*
+ * Pending IRP's are scheduled by class and originating process (see shared/iosched.h).
+ * An IRP's class, flow and cost are computed from the IRP and its request; they are
+ * computed again when the IRP is removed, so they must not change while it is pending.
+ */
+static const ULONG FspIoqPendingClassWeights[FspIoSchedClassCount] = { 4, 2, 1 };
+#define FspIoqPendingQuantum            4
+#define FspIoqPendingCostUnit           (64 * 1024)
+#define FspIoqPendingCostMax            256
+
+static inline VOID FspIoqPendingClassify(PIRP Irp, PULONG PClass, PULONG PFlowHash)
+{
+    FSP_FSCTL_TRANSACT_REQ *Request = FspIrpRequest(Irp);
+    *PFlowHash = FspHashMixPointer(IoGetRequestorProcess(Irp));
+    switch (0 != Request ? Request->Kind : FspFsctlTransactReservedKind)
+    {
+    case FspFsctlTransactReadKind:
+    case FspFsctlTransactWriteKind:
+        *PClass = FlagOn(Irp->Flags, IRP_PAGING_IO) ?
+            FspIoSchedPagingClass : FspIoSchedDataClass;
+        break;
+    case FspFsctlTransactFlushBuffersKind:
+        *PClass = FspIoSchedPagingClass;
+        break;
+    default:
+        *PClass = FspIoSchedMetadataClass;
+        break;
+    }
+}
+
+static ULONG FspIoqPendingCost(PLIST_ENTRY Entry, PVOID Context)
+{
+    /* reads and writes cost one unit plus one unit per 64K transferred */
+    PIRP Irp = CONTAINING_RECORD(Entry, IRP, Tail.Overlay.ListEntry);
+    FSP_FSCTL_TRANSACT_REQ *Request = FspIrpRequest(Irp);
+    ULONG Length;
+    switch (0 != Request ? Request->Kind : FspFsctlTransactReservedKind)
+    {
+    case FspFsctlTransactReadKind:
+        Length = Request->Req.Read.Length;
+        break;
+    case FspFsctlTransactWriteKind:
+        Length = Request->Req.Write.Length;
+        break;
+    default:
+        return 1;
+    }
+    Length /= FspIoqPendingCostUnit;
+    return 1 + (FspIoqPendingCostMax > Length ? Length : FspIoqPendingCostMax);
+}
+
 static inline VOID FspIoqPendingResetSynch(FSP_IOQ *Ioq)
 {
     /*
@@ -200,6 +296,23 @@ static inline VOID FspIoqPendingResetSynch(FSP_IOQ *Ioq)
         KeClearEvent(&Ioq->PendingIrpEvent);
 }
 
+static inline VOID FspIoqPendingWake(FSP_IOQ *Ioq, BOOLEAN All)
+{
+    /*
+     * Wake the threads chosen by the wake queue. Must be called under the FSP_IOQ lock,
+     * which keeps the woken waiters alive until we are done with them.
+     */
+    FSP_WAKE_QUEUE_WAITER *Waiter, *NextWaiter;
+    Waiter = All ?
+        FspWakeQueueSignalAll(&Ioq->PendingWakeQueue) :
+        FspWakeQueueSignal(&Ioq->PendingWakeQueue, Ioq->PendingIrpCount);
+    for (; 0 != Waiter; Waiter = NextWaiter)
+    {
+        NextWaiter = Waiter->Next;
+        KeSetEvent(&CONTAINING_RECORD(Waiter, FSP_IOQ_WAITER, Waiter)->Event, 1, FALSE);
+    }
+}
+
 static NTSTATUS FspIoqPendingInsertIrpEx(PIO_CSQ IoCsq, PIRP Irp, PVOID InsertContext)
 {
     FSP_IOQ *Ioq = CONTAINING_RECORD(IoCsq, FSP_IOQ, PendingIoCsq);
@@ -207,18 +320,25 @@ static NTSTATUS FspIoqPendingInsertIrpEx(PIO_CSQ IoCsq, PIRP Irp, PVOID InsertCo
         return STATUS_CANCELLED;
     if (!InsertContext && Ioq->PendingIrpCapacity <= Ioq->PendingIrpCount)
         return STATUS_INSUFFICIENT_RESOURCES;
+    ULONG Class, FlowHash;
+    FspIoqPendingClassify(Irp, &Class, &FlowHash);
     Ioq->PendingIrpCount++;
-    InsertTailList(&Ioq->PendingIrpList, &Irp->Tail.Overlay.ListEntry);
-    KeSetEvent(&Ioq->PendingIrpEvent, 1, FALSE);
-        /* equivalent to FspIoqPendingResetSynch(Ioq) */
+    FspIoSchedInsert(&Ioq->PendingIrpSched, &Irp->Tail.Overlay.ListEntry, Class, FlowHash);
+    if (Ioq->AdaptiveWakeup)
+        FspIoqPendingWake(Ioq, FALSE);
+    else
+        KeSetEvent(&Ioq->PendingIrpEvent, 1, FALSE);
+            /* equivalent to FspIoqPendingResetSynch(Ioq) */
     return STATUS_SUCCESS;
 }
 
 static VOID FspIoqPendingRemoveIrp(PIO_CSQ IoCsq, PIRP Irp)
 {
     FSP_IOQ *Ioq = CONTAINING_RECORD(IoCsq, FSP_IOQ, PendingIoCsq);
+    ULONG Class, FlowHash;
+    FspIoqPendingClassify(Irp, &Class, &FlowHash);
     Ioq->PendingIrpCount--;
-    RemoveEntryList(&Irp->Tail.Overlay.ListEntry);
+    FspIoSchedRemove(&Ioq->PendingIrpSched, &Irp->Tail.Overlay.ListEntry, Class, FlowHash);
     FspIoqPendingResetSynch(Ioq);
 }
 
@@ -227,33 +347,28 @@ static PIRP FspIoqPendingPeekNextIrp(PIO_CSQ IoCsq, PIRP Irp, PVOID PeekContext)
     FSP_IOQ *Ioq = CONTAINING_RECORD(IoCsq, FSP_IOQ, PendingIoCsq);
     if (PeekContext && Ioq->Stopped)
         return 0;
-    PLIST_ENTRY Head = &Ioq->PendingIrpList;
-    PLIST_ENTRY Entry = 0 == Irp ? Head->Flink : Irp->Tail.Overlay.ListEntry.Flink;
-    if (Head == Entry)
-        return 0;
-    Irp = CONTAINING_RECORD(Entry, IRP, Tail.Overlay.ListEntry);
+    PLIST_ENTRY Entry;
     if (!PeekContext)
-        return Irp;
-    PVOID IrpHint = ((FSP_IOQ_PEEK_CONTEXT *)PeekContext)->IrpHint;
-    if (0 == IrpHint)
     {
-        ULONG ExpirationTime = ((FSP_IOQ_PEEK_CONTEXT *)PeekContext)->ExpirationTime;
-        for (;;)
-        {
-            if (FspIrpTimestampInfinity != FspIrpTimestamp(Irp))
-                return FspIrpTimestamp(Irp) <= ExpirationTime ? Irp : 0;
-            Entry = Entry->Flink;
-            if (Head == Entry)
-                return 0;
-            Irp = CONTAINING_RECORD(Entry, IRP, Tail.Overlay.ListEntry);
-        }
-    }
-    else
-    {
-        if (Irp == IrpHint)
-            return 0;
-        return Irp;
+        Entry = FspIoSchedNext(&Ioq->PendingIrpSched, 0 == Irp ? 0 : &Irp->Tail.Overlay.ListEntry);
+        return 0 != Entry ? CONTAINING_RECORD(Entry, IRP, Tail.Overlay.ListEntry) : 0;
     }
+    PVOID IrpHint = ((FSP_IOQ_PEEK_CONTEXT *)PeekContext)->IrpHint;
+    ASSERT(0 != IrpHint);
+        /* expired IRP's are removed by FspIoqPendingRemoveExpired */
+    /*
+     * IoCsqRemoveNextIrp peeks again with the IRP it could not remove (because it is being
+     * canceled); selecting again would return the same IRP, so continue past it instead.
+     */
+    Entry = 0 == Irp ?
+        FspIoSchedSelect(&Ioq->PendingIrpSched, FspIoqPendingCost, 0) :
+        FspIoSchedSelectNext(&Ioq->PendingIrpSched, &Irp->Tail.Overlay.ListEntry);
+    if (0 == Entry)
+        return 0;
+    Irp = CONTAINING_RECORD(Entry, IRP, Tail.Overlay.ListEntry);
+    if (Irp == IrpHint)
+        return 0;
+    return Irp;
 }
 
 _IRQL_raises_(DISPATCH_LEVEL)
@@ -281,33 +396,19 @@ static NTSTATUS FspIoqProcessInsertIrpEx(PIO_CSQ IoCsq, PIRP Irp, PVOID InsertCo
     FSP_IOQ *Ioq = CONTAINING_RECORD(IoCsq, FSP_IOQ, ProcessIoCsq);
     if (Ioq->Stopped)
         return STATUS_CANCELLED;
+    ASSERT(0 == FspPtrSetFind(&Ioq->ProcessIrpSet, Irp));
+    if (!FspPtrSetInsert(&Ioq->ProcessIrpSet, Irp))
+        return STATUS_INSUFFICIENT_RESOURCES;
     Ioq->ProcessIrpCount++;
     InsertTailList(&Ioq->ProcessIrpList, &Irp->Tail.Overlay.ListEntry);
-    ULONG Index = FspHashMixPointer(Irp) % Ioq->ProcessIrpBucketCount;
-#if DBG
-    for (PIRP IrpX = Ioq->ProcessIrpBuckets[Index]; IrpX; IrpX = FspIrpDictNext(IrpX))
-        ASSERT(IrpX != Irp);
-#endif
-    ASSERT(0 == FspIrpDictNext(Irp));
-    FspIrpDictNext(Irp) = Ioq->ProcessIrpBuckets[Index];
-    Ioq->ProcessIrpBuckets[Index] = Irp;
     return STATUS_SUCCESS;
 }
 
 static VOID FspIoqProcessRemoveIrp(PIO_CSQ IoCsq, PIRP Irp)
 {
     FSP_IOQ *Ioq = CONTAINING_RECORD(IoCsq, FSP_IOQ, ProcessIoCsq);
-    ULONG Index = FspHashMixPointer(Irp) % Ioq->ProcessIrpBucketCount;
-    for (PIRP *PIrp = (PIRP *)&Ioq->ProcessIrpBuckets[Index];; PIrp = &FspIrpDictNext(*PIrp))
-    {
-        ASSERT(0 != *PIrp);
-        if (*PIrp == Irp)
-        {
-            *PIrp = FspIrpDictNext(Irp);
-            FspIrpDictNext(Irp) = 0;
-            break;
-        }
-    }
+    ASSERT(0 != FspPtrSetFind(&Ioq->ProcessIrpSet, Irp));
+    FspPtrSetRemove(&Ioq->ProcessIrpSet, Irp);
     Ioq->ProcessIrpCount--;
     RemoveEntryList(&Irp->Tail.Overlay.ListEntry);
 }
@@ -340,14 +441,42 @@ static PIRP FspIoqProcessPeekNextIrp(PIO_CSQ IoCsq, PIRP Irp, PVOID PeekContext)
     }
     else
     {
-        ULONG Index = FspHashMixPointer(IrpHint) % Ioq->ProcessIrpBucketCount;
-        for (Irp = Ioq->ProcessIrpBuckets[Index]; Irp; Irp = FspIrpDictNext(Irp))
-            if (Irp == IrpHint)
-                return Irp;
-        return 0;
+        return FspPtrSetFind(&Ioq->ProcessIrpSet, IrpHint);
     }
 }
 
+static VOID FspIoqProcessReserve(FSP_IOQ *Ioq)
+{
+    /*
+     * Grow the Process dictionary before it gets too full. Allocation is done outside
+     * the spin lock. If it fails we keep using the current dictionary, which continues
+     * to accept IRP's (at an increased load factor) until it is completely full.
+     *
+     * The first check is done without the lock; it is only a hint and is repeated
+     * under the lock before the dictionary is actually replaced.
+     */
+    PVOID *Slots, *OldSlots = 0;
+    ULONG SlotCount;
+    KIRQL Irql;
+    SlotCount = FspPtrSetGrowSlotCount(&Ioq->ProcessIrpSet);
+    if (0 == SlotCount)
+        return;
+    Slots = FspAllocNonPaged(SlotCount * sizeof Slots[0]);
+    if (0 == Slots)
+        return;
+    KeAcquireSpinLock(&Ioq->SpinLock, &Irql);
+    if (FspPtrSetSlotCount(&Ioq->ProcessIrpSet) < SlotCount)
+    {
+        OldSlots = FspPtrSetRehash(&Ioq->ProcessIrpSet, Slots, SlotCount);
+        Slots = 0;
+    }
+    KeReleaseSpinLock(&Ioq->SpinLock, Irql);
+    if (0 != Slots)
+        FspFree(Slots);
+    if (0 != OldSlots && Ioq->ProcessIrpSlots != OldSlots)
+        FspFree(OldSlots);
+}
+
 _IRQL_raises_(DISPATCH_LEVEL)
 static VOID FspIoqProcessAcquireLock(PIO_CSQ IoCsq, _At_(*PIrql, _IRQL_saves_) PKIRQL PIrql)
 {
@@ -440,7 +569,8 @@ static VOID FspIoqRetriedCompleteCanceledIrp(PIO_CSQ IoCsq, PIRP Irp)
 }
 
 NTSTATUS FspIoqCreate(
-    ULONG IrpCapacity, PLARGE_INTEGER IrpTimeout, VOID (*CompleteCanceledIrp)(PIRP Irp),
+    ULONG IrpCapacity, PLARGE_INTEGER IrpTimeout, BOOLEAN AdaptiveWakeup,
+    VOID (*CompleteCanceledIrp)(PIRP Irp),
     FSP_IOQ **PIoq)
 {
     ASSERT(0 != CompleteCanceledIrp);
@@ -448,15 +578,17 @@ NTSTATUS FspIoqCreate(
     *PIoq = 0;
 
     FSP_IOQ *Ioq;
-    ULONG BucketCount = (PAGE_SIZE - sizeof *Ioq) / sizeof Ioq->ProcessIrpBuckets[0];
-    Ioq = FspAllocNonPaged(PAGE_SIZE);
+    ULONG SlotCount = FspIoqProcessInitialSlotCount;
+    Ioq = FspAllocNonPaged(sizeof *Ioq + SlotCount * sizeof Ioq->ProcessIrpSlots[0]);
     if (0 == Ioq)
         return STATUS_INSUFFICIENT_RESOURCES;
-    RtlZeroMemory(Ioq, PAGE_SIZE);
+    RtlZeroMemory(Ioq, sizeof *Ioq);
 
     KeInitializeSpinLock(&Ioq->SpinLock);
     KeInitializeEvent(&Ioq->PendingIrpEvent, SynchronizationEvent, FALSE);
-    InitializeListHead(&Ioq->PendingIrpList);
+    FspWakeQueueInitialize(&Ioq->PendingWakeQueue, FspIoqSpinMin,
+        1 < KeQueryActiveProcessorCount(0) ? FspIoqSpinMax : 0);
+        /* spinning is pointless on a single processor */
     InitializeListHead(&Ioq->ProcessIrpList);
     InitializeListHead(&Ioq->RetriedIrpList);
     IoCsqInitializeEx(&Ioq->PendingIoCsq,
@@ -483,8 +615,10 @@ NTSTATUS FspIoqCreate(
     Ioq->IrpTimeout = ConvertInterruptTimeToSec(IrpTimeout->QuadPart + InterruptTimeToSecFactor - 1);
         /* convert to seconds (and round up) */
     Ioq->PendingIrpCapacity = IrpCapacity;
+    Ioq->AdaptiveWakeup = AdaptiveWakeup;
+    FspIoSchedInitialize(&Ioq->PendingIrpSched, FspIoqPendingClassWeights, FspIoqPendingQuantum);
     Ioq->CompleteCanceledIrp = CompleteCanceledIrp;
-    Ioq->ProcessIrpBucketCount = BucketCount;
+    FspPtrSetInitialize(&Ioq->ProcessIrpSet, Ioq->ProcessIrpSlots, SlotCount);
 
     *PIoq = Ioq;
 
@@ -494,6 +628,8 @@ NTSTATUS FspIoqCreate(
 VOID FspIoqDelete(FSP_IOQ *Ioq)
 {
     FspIoqStop(Ioq);
+    if (Ioq->ProcessIrpSlots != Ioq->ProcessIrpSet.Slots)
+        FspFree(Ioq->ProcessIrpSet.Slots);
     FspFree(Ioq);
 }
 
@@ -505,6 +641,7 @@ VOID FspIoqStop(FSP_IOQ *Ioq)
     /* we are being stopped, permanently wake up waiters */
     KeSetEvent(&Ioq->PendingIrpEvent, 1, FALSE);
         /* equivalent to FspIoqPendingResetSynch(Ioq) */
+    FspIoqPendingWake(Ioq, TRUE);
     KeReleaseSpinLock(&Ioq->SpinLock, Irql);
     PIRP Irp;
     while (0 != (Irp = IoCsqRemoveNextIrp(&Ioq->PendingIoCsq, 0)))
@@ -525,15 +662,51 @@ BOOLEAN FspIoqStopped(FSP_IOQ *Ioq)
     return Result;
 }
 
+static VOID FspIoqPendingRemoveExpired(FSP_IOQ *Ioq, ULONG ExpirationTime)
+{
+    /*
+     * The pending queue is not in arrival order, so expired IRP's may be anywhere in it.
+     * Remove all of them in a single pass, rather than with IoCsqRemoveNextIrp which would
+     * rescan the queue from the start for every IRP, and complete them after releasing the
+     * lock. Modelled after IoCsqRemoveNextIrp: an IRP whose cancel routine is gone is being
+     * canceled and is left to the cancel routine.
+     */
+    LIST_ENTRY ExpiredList;
+    PLIST_ENTRY Entry, NextEntry;
+    PIRP Irp;
+    KIRQL Irql;
+    InitializeListHead(&ExpiredList);
+    KeAcquireSpinLock(&Ioq->SpinLock, &Irql);
+    Entry = !Ioq->Stopped ? FspIoSchedNext(&Ioq->PendingIrpSched, 0) : 0;
+    for (; 0 != Entry; Entry = NextEntry)
+    {
+        NextEntry = FspIoSchedNext(&Ioq->PendingIrpSched, Entry);
+        Irp = CONTAINING_RECORD(Entry, IRP, Tail.Overlay.ListEntry);
+        if (FspIrpTimestampInfinity == FspIrpTimestamp(Irp) ||
+            FspIrpTimestamp(Irp) > ExpirationTime)
+            continue;
+        if (0 == IoSetCancelRoutine(Irp, 0))
+            continue;
+        FspIoqPendingRemoveIrp(&Ioq->PendingIoCsq, Irp);
+        Irp->Tail.Overlay.DriverContext[3] = 0;
+        InsertTailList(&ExpiredList, &Irp->Tail.Overlay.ListEntry);
+    }
+    KeReleaseSpinLock(&Ioq->SpinLock, Irql);
+    while (!IsListEmpty(&ExpiredList))
+    {
+        Entry = RemoveHeadList(&ExpiredList);
+        Ioq->CompleteCanceledIrp(CONTAINING_RECORD(Entry, IRP, Tail.Overlay.ListEntry));
+    }
+}
+
 VOID FspIoqRemoveExpired(FSP_IOQ *Ioq, UINT64 InterruptTime)
 {
     FSP_IOQ_PEEK_CONTEXT PeekContext;
     PeekContext.IrpHint = 0;
     PeekContext.ExpirationTime = ConvertInterruptTimeToSec(InterruptTime);
-    PIRP Irp;
-    while (0 != (Irp = IoCsqRemoveNextIrp(&Ioq->PendingIoCsq, &PeekContext)))
-        Ioq->CompleteCanceledIrp(Irp);
+    FspIoqPendingRemoveExpired(Ioq, PeekContext.ExpirationTime);
 #if !defined(FSP_IOQ_PROCESS_NO_CANCEL)
+    PIRP Irp;
     while (0 != (Irp = FspCsqRemoveNextIrp(&Ioq->ProcessIoCsq, &PeekContext)))
         Ioq->CompleteCanceledIrp(Irp);
     while (0 != (Irp = FspCsqRemoveNextIrp(&Ioq->RetryIoCsq, &PeekContext)))
@@ -561,6 +734,69 @@ BOOLEAN FspIoqPostIrpEx(FSP_IOQ *Ioq, PIRP Irp, BOOLEAN BestEffort, NTSTATUS *PR
     }
 }
 
+static PIRP FspIoqNextPendingIrpAdaptive(FSP_IOQ *Ioq, FSP_IOQ_PEEK_CONTEXT *PeekContext,
+    PLARGE_INTEGER Timeout, PIRP CancellableIrp)
+{
+    FSP_IOQ_WAITER Waiter;
+    PIRP PendingIrp;
+    ULONG Spin;
+    BOOLEAN Woken;
+    NTSTATUS Result;
+    KIRQL Irql;
+
+    /* the most recently active thread polls the pending queue before going to sleep */
+    KeAcquireSpinLock(&Ioq->SpinLock, &Irql);
+    Spin = 0 == Ioq->PendingIrpCount && !Ioq->Stopped ?
+        FspWakeQueueSpinBegin(&Ioq->PendingWakeQueue) : 0;
+    KeReleaseSpinLock(&Ioq->SpinLock, Irql);
+    for (ULONG I = 0; Spin > I; I++)
+    {
+        if (0 != *(volatile ULONG *)&Ioq->PendingIrpCount || *(volatile BOOLEAN *)&Ioq->Stopped)
+            break;
+        KeStallExecutionProcessor(1);
+    }
+    PendingIrp = IoCsqRemoveNextIrp(&Ioq->PendingIoCsq, PeekContext);
+    if (0 != Spin)
+    {
+        KeAcquireSpinLock(&Ioq->SpinLock, &Irql);
+        FspWakeQueueSpinEnd(&Ioq->PendingWakeQueue, 0 != PendingIrp);
+        /* IRP's that arrived while we were spinning may need a thread */
+        FspIoqPendingWake(Ioq, FALSE);
+        KeReleaseSpinLock(&Ioq->SpinLock, Irql);
+    }
+    if (0 != PendingIrp)
+        return PendingIrp;
+
+    /* go to sleep on our own event, unless IRP's arrived in the meantime */
+    KeInitializeEvent(&Waiter.Event, NotificationEvent, FALSE);
+    KeAcquireSpinLock(&Ioq->SpinLock, &Irql);
+    if (0 != Ioq->PendingIrpCount || Ioq->Stopped)
+    {
+        KeReleaseSpinLock(&Ioq->SpinLock, Irql);
+        return IoCsqRemoveNextIrp(&Ioq->PendingIoCsq, PeekContext);
+    }
+    FspWakeQueueWait(&Ioq->PendingWakeQueue, &Waiter.Waiter);
+    KeReleaseSpinLock(&Ioq->SpinLock, Irql);
+
+    Result = FsRtlCancellableWaitForSingleObject(&Waiter.Event, Timeout, CancellableIrp);
+
+    KeAcquireSpinLock(&Ioq->SpinLock, &Irql);
+    Woken = FspWakeQueueWaitEnd(&Ioq->PendingWakeQueue, &Waiter.Waiter);
+    if (Woken && (STATUS_CANCELLED == Result || STATUS_THREAD_IS_TERMINATING == Result))
+        /* we were woken but are not going to take an IRP; pass the wakeup on */
+        FspIoqPendingWake(Ioq, FALSE);
+    KeReleaseSpinLock(&Ioq->SpinLock, Irql);
+
+    if (STATUS_CANCELLED == Result || STATUS_THREAD_IS_TERMINATING == Result)
+        return FspIoqCancelled;
+    if (!Woken)
+    {
+        ASSERT(STATUS_TIMEOUT == Result);
+        return FspIoqTimeout;
+    }
+    return IoCsqRemoveNextIrp(&Ioq->PendingIoCsq, PeekContext);
+}
+
 PIRP FspIoqNextPendingIrp(FSP_IOQ *Ioq, PIRP BoundaryIrp, PLARGE_INTEGER Timeout,
     PIRP CancellableIrp)
 {
@@ -569,7 +805,9 @@ PIRP FspIoqNextPendingIrp(FSP_IOQ *Ioq, PIRP BoundaryIrp, PLARGE_INTEGER Timeout
     PIRP PendingIrp;
     PeekContext.IrpHint = 0 != BoundaryIrp ? BoundaryIrp : (PVOID)1;
     PeekContext.ExpirationTime = 0;
-    if (0 != Timeout)
+    if (0 != Timeout && Ioq->AdaptiveWakeup)
+        PendingIrp = FspIoqNextPendingIrpAdaptive(Ioq, &PeekContext, Timeout, CancellableIrp);
+    else if (0 != Timeout)
     {
         NTSTATUS Result;
         Result = FsRtlCancellableWaitForSingleObject(&Ioq->PendingIrpEvent, Timeout,
@@ -618,6 +856,7 @@ BOOLEAN FspIoqStartProcessingIrp(FSP_IOQ *Ioq, PIRP Irp)
     if (FspIrpTimestampInfinity != FspIrpTimestamp(Irp))
         FspIrpTimestamp(Irp) = QueryInterruptTimeInSec() + Ioq->IrpTimeout;
 #endif
+    FspIoqProcessReserve(Ioq);
     Result = FspCsqInsertIrpEx(&Ioq->ProcessIoCsq, Irp, 0, 0);
     return NT_SUCCESS(Result);
 }
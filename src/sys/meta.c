@@ -17,22 +17,11 @@
 
 #include <sys/driver.h>
 
-typedef struct _FSP_META_CACHE_ITEM
-{
-    LIST_ENTRY ListEntry;
-    struct _FSP_META_CACHE_ITEM *DictNext;
-    PVOID ItemBuffer;
-    UINT64 ItemIndex;
-    UINT64 ExpirationTime;
-    LONG RefCount;
-} FSP_META_CACHE_ITEM;
-
-typedef struct
-{
-    PVOID Item;
-    ULONG Size;
-    __declspec(align(MEMORY_ALLOCATION_ALIGNMENT)) UINT8 Buffer[];
-} FSP_META_CACHE_ITEM_BUFFER;
+/*
+ * The meta cache is split into shards (see shared/metacache.h), each with its own
+ * spin lock. An item is a single nonpaged allocation that contains its buffer; the
+ * cache capacity is in bytes and is divided evenly among the shards.
+ */
 
 static inline VOID FspMetaCacheDereferenceItem(FSP_META_CACHE_ITEM *Item)
 {
@@ -40,75 +29,18 @@ static inline VOID FspMetaCacheDereferenceItem(FSP_META_CACHE_ITEM *Item)
     if (0 == RefCount)
     {
         /* if we ever need to add a finalizer for meta items it should go here */
-        FspFree(Item->ItemBuffer);
         FspFree(Item);
     }
 }
 
-static inline FSP_META_CACHE_ITEM *FspMetaCacheLookupIndexedItemAtDpcLevel(FSP_META_CACHE *MetaCache,
-    UINT64 ItemIndex)
+static inline VOID FspMetaCacheDereferenceItemList(FSP_META_CACHE_ITEM *Item)
 {
-    FSP_META_CACHE_ITEM *Item = 0;
-    ULONG HashIndex = ItemIndex % MetaCache->ItemBucketCount;
-    for (FSP_META_CACHE_ITEM *ItemX = MetaCache->ItemBuckets[HashIndex]; ItemX; ItemX = ItemX->DictNext)
-        if (ItemX->ItemIndex == ItemIndex)
-        {
-            Item = ItemX;
-            break;
-        }
-    return Item;
-}
-
-static inline VOID FspMetaCacheAddItemAtDpcLevel(FSP_META_CACHE *MetaCache, FSP_META_CACHE_ITEM *Item)
-{
-    ULONG HashIndex = Item->ItemIndex % MetaCache->ItemBucketCount;
-#if DBG
-    for (FSP_META_CACHE_ITEM *ItemX = MetaCache->ItemBuckets[HashIndex]; ItemX; ItemX = ItemX->DictNext)
-        ASSERT(ItemX->ItemIndex != Item->ItemIndex);
-#endif
-    Item->DictNext = MetaCache->ItemBuckets[HashIndex];
-    MetaCache->ItemBuckets[HashIndex] = Item;
-    InsertTailList(&MetaCache->ItemList, &Item->ListEntry);
-    MetaCache->ItemCount++;
-}
-
-static inline FSP_META_CACHE_ITEM *FspMetaCacheRemoveIndexedItemAtDpcLevel(FSP_META_CACHE *MetaCache,
-    UINT64 ItemIndex)
-{
-    FSP_META_CACHE_ITEM *Item = 0;
-    ULONG HashIndex = ItemIndex % MetaCache->ItemBucketCount;
-    for (FSP_META_CACHE_ITEM **P = (PVOID)&MetaCache->ItemBuckets[HashIndex]; *P; P = &(*P)->DictNext)
-        if ((*P)->ItemIndex == ItemIndex)
-        {
-            Item = *P;
-            *P = (*P)->DictNext;
-            RemoveEntryList(&Item->ListEntry);
-            MetaCache->ItemCount--;
-            break;
-        }
-    return Item;
-}
-
-static inline FSP_META_CACHE_ITEM *FspMetaCacheRemoveExpiredItemAtDpcLevel(FSP_META_CACHE *MetaCache,
-    UINT64 ExpirationTime)
-{
-    PLIST_ENTRY Head = &MetaCache->ItemList;
-    PLIST_ENTRY Entry = Head->Flink;
-    if (Head == Entry)
-        return 0;
-    FSP_META_CACHE_ITEM *Item = CONTAINING_RECORD(Entry, FSP_META_CACHE_ITEM, ListEntry);
-    if (!FspExpirationTimeValid2(Item->ExpirationTime, ExpirationTime))
-        return 0;
-    ULONG HashIndex = Item->ItemIndex % MetaCache->ItemBucketCount;
-    for (FSP_META_CACHE_ITEM **P = (PVOID)&MetaCache->ItemBuckets[HashIndex]; *P; P = &(*P)->DictNext)
-        if (*P == Item)
-        {
-            *P = (*P)->DictNext;
-            break;
-        }
-    RemoveEntryList(&Item->ListEntry);
-    MetaCache->ItemCount--;
-    return Item;
+    /* dereference a list of removed items (linked through DictNext) */
+    for (FSP_META_CACHE_ITEM *NextItem; 0 != Item; Item = NextItem)
+    {
+        NextItem = Item->DictNext;
+        FspMetaCacheDereferenceItem(Item);
+    }
 }
 
 NTSTATUS FspMetaCacheCreate(
@@ -119,17 +51,18 @@ NTSTATUS FspMetaCacheCreate(
     if (0 == MetaCapacity || 0 == ItemSizeMax || 0 == MetaTimeout->QuadPart)
         return STATUS_SUCCESS;
     FSP_META_CACHE *MetaCache;
-    ULONG BucketCount = (PAGE_SIZE - sizeof *MetaCache) / sizeof MetaCache->ItemBuckets[0];
-    MetaCache = FspAllocNonPaged(PAGE_SIZE);
+    MetaCache = FspAllocNonPaged(sizeof *MetaCache);
     if (0 == MetaCache)
         return STATUS_INSUFFICIENT_RESOURCES;
-    RtlZeroMemory(MetaCache, PAGE_SIZE);
-    KeInitializeSpinLock(&MetaCache->SpinLock);
-    InitializeListHead(&MetaCache->ItemList);
-    MetaCache->MetaCapacity = MetaCapacity;
-    MetaCache->ItemSizeMax = ItemSizeMax;
+    RtlZeroMemory(MetaCache, sizeof *MetaCache);
     MetaCache->MetaTimeout = MetaTimeout->QuadPart;
-    MetaCache->ItemBucketCount = BucketCount;
+    MetaCache->ItemSizeMax = ItemSizeMax;
+    for (ULONG Index = 0; FspMetaCacheShardCount > Index; Index++)
+    {
+        KeInitializeSpinLock(&MetaCache->Shards[Index].SpinLock);
+        FspMetaCacheShardInitialize(&MetaCache->Shards[Index].Shard,
+            MetaCapacity / FspMetaCacheShardCount);
+    }
     *PMetaCache = MetaCache;
     return STATUS_SUCCESS;
 }
@@ -138,6 +71,12 @@ VOID FspMetaCacheDelete(FSP_META_CACHE *MetaCache)
 {
     if (0 == MetaCache)
         return;
+#if DBG
+    FSP_META_CACHE_STATISTICS Statistics;
+    FspMetaCacheGetStatistics(MetaCache, &Statistics);
+    DEBUGLOG("hits=%llu misses=%llu evictions=%llu expirations=%llu",
+        Statistics.Hits, Statistics.Misses, Statistics.Evictions, Statistics.Expirations);
+#endif
     FspMetaCacheInvalidateExpired(MetaCache, (UINT64)-1LL);
     FspFree(MetaCache);
 }
@@ -146,16 +85,37 @@ VOID FspMetaCacheInvalidateExpired(FSP_META_CACHE *MetaCache, UINT64 ExpirationT
 {
     if (0 == MetaCache)
         return;
-    FSP_META_CACHE_ITEM *Item;
+    FSP_META_CACHE_LOCKED_SHARD *LockedShard;
+    FSP_META_CACHE_ITEM *Item, *ItemList;
     KIRQL Irql;
-    for (;;)
+    for (ULONG Index = 0; FspMetaCacheShardCount > Index; Index++)
     {
-        KeAcquireSpinLock(&MetaCache->SpinLock, &Irql);
-        Item = FspMetaCacheRemoveExpiredItemAtDpcLevel(MetaCache, ExpirationTime);
-        KeReleaseSpinLock(&MetaCache->SpinLock, Irql);
-        if (0 == Item)
-            break;
-        FspMetaCacheDereferenceItem(Item);
+        LockedShard = &MetaCache->Shards[Index];
+        ItemList = 0;
+        KeAcquireSpinLock(&LockedShard->SpinLock, &Irql);
+        while (0 != (Item = FspMetaCacheShardRemoveExpired(&LockedShard->Shard, ExpirationTime)))
+        {
+            Item->DictNext = ItemList;
+            ItemList = Item;
+        }
+        KeReleaseSpinLock(&LockedShard->SpinLock, Irql);
+        FspMetaCacheDereferenceItemList(ItemList);
+    }
+}
+
+VOID FspMetaCacheGetStatistics(FSP_META_CACHE *MetaCache, FSP_META_CACHE_STATISTICS *Statistics)
+{
+    RtlZeroMemory(Statistics, sizeof *Statistics);
+    if (0 == MetaCache)
+        return;
+    FSP_META_CACHE_LOCKED_SHARD *LockedShard;
+    KIRQL Irql;
+    for (ULONG Index = 0; FspMetaCacheShardCount > Index; Index++)
+    {
+        LockedShard = &MetaCache->Shards[Index];
+        KeAcquireSpinLock(&LockedShard->SpinLock, &Irql);
+        FspMetaCacheShardAddStatistics(&LockedShard->Shard, Statistics);
+        KeReleaseSpinLock(&LockedShard->SpinLock, Irql);
     }
 }
 
@@ -167,78 +127,100 @@ BOOLEAN FspMetaCacheReferenceItemBuffer(FSP_META_CACHE *MetaCache, UINT64 ItemIn
         *PSize = 0;
     if (0 == MetaCache || 0 == ItemIndex)
         return FALSE;
+    FSP_META_CACHE_LOCKED_SHARD *LockedShard = &MetaCache->Shards[FspMetaCacheShardIndex(ItemIndex)];
     FSP_META_CACHE_ITEM *Item = 0;
-    FSP_META_CACHE_ITEM_BUFFER *ItemBuffer;
     KIRQL Irql;
-    KeAcquireSpinLock(&MetaCache->SpinLock, &Irql);
-    Item = FspMetaCacheLookupIndexedItemAtDpcLevel(MetaCache, ItemIndex);
+    KeAcquireSpinLock(&LockedShard->SpinLock, &Irql);
+    Item = FspMetaCacheShardLookup(&LockedShard->Shard, ItemIndex);
     if (0 == Item)
     {
-        KeReleaseSpinLock(&MetaCache->SpinLock, Irql);
+        KeReleaseSpinLock(&LockedShard->SpinLock, Irql);
         return FALSE;
     }
     InterlockedIncrement(&Item->RefCount);
-    KeReleaseSpinLock(&MetaCache->SpinLock, Irql);
-    ItemBuffer = Item->ItemBuffer;
-    *PBuffer = ItemBuffer->Buffer;
+    KeReleaseSpinLock(&LockedShard->SpinLock, Irql);
+    *PBuffer = Item->Buffer;
     if (0 != PSize)
-        *PSize = ItemBuffer->Size;
+        *PSize = Item->Size;
     return TRUE;
 }
 
 VOID FspMetaCacheDereferenceItemBuffer(PCVOID Buffer)
 {
-    FSP_META_CACHE_ITEM_BUFFER *ItemBuffer = (PVOID)((PUINT8)Buffer - sizeof *ItemBuffer);
-    FspMetaCacheDereferenceItem(ItemBuffer->Item);
+    FSP_META_CACHE_ITEM *Item = CONTAINING_RECORD(Buffer, FSP_META_CACHE_ITEM, Buffer);
+    FspMetaCacheDereferenceItem(Item);
 }
 
-UINT64 FspMetaCacheAddItem(FSP_META_CACHE *MetaCache, PCVOID Buffer, ULONG Size)
+PVOID FspMetaCacheAllocateItemBuffer(FSP_META_CACHE *MetaCache, ULONG Size)
 {
+    /*
+     * Allocate an item buffer that the caller fills in place and then adds to the cache
+     * (FspMetaCacheAddItemBuffer) or frees (FspMetaCacheFreeItemBuffer).
+     */
     if (0 == MetaCache)
         return 0;
     FSP_META_CACHE_ITEM *Item;
-    FSP_META_CACHE_ITEM_BUFFER *ItemBuffer;
-    UINT64 ItemIndex = 0;
-    KIRQL Irql;
-    if (sizeof *ItemBuffer + Size > MetaCache->ItemSizeMax)
+    if (Size > MetaCache->ItemSizeMax)
         return 0;
-    Item = FspAllocNonPaged(sizeof *Item);
+    Item = FspAllocNonPaged(sizeof *Item + Size);
     if (0 == Item)
         return 0;
-    ItemBuffer = FspAlloc(sizeof *ItemBuffer + Size);
-    if (0 == ItemBuffer)
-    {
-        FspFree(Item);
-        return 0;
-    }
     RtlZeroMemory(Item, sizeof *Item);
-    RtlZeroMemory(ItemBuffer, sizeof *ItemBuffer);
-    Item->ItemBuffer = ItemBuffer;
-    Item->ExpirationTime = FspExpirationTimeFromTimeout(MetaCache->MetaTimeout);
     Item->RefCount = 1;
-    ItemBuffer->Item = Item;
-    ItemBuffer->Size = Size;
-    RtlCopyMemory(ItemBuffer->Buffer, Buffer, Size);
-    KeAcquireSpinLock(&MetaCache->SpinLock, &Irql);
-    if (MetaCache->ItemCount >= MetaCache->MetaCapacity)
-        FspMetaCacheRemoveExpiredItemAtDpcLevel(MetaCache, (UINT64)-1LL);
-    ItemIndex = MetaCache->ItemIndex;
-    ItemIndex = (UINT64)-1LL == ItemIndex ? 1 : ItemIndex + 1;
-    MetaCache->ItemIndex = Item->ItemIndex = ItemIndex;
-    FspMetaCacheAddItemAtDpcLevel(MetaCache, Item);
-    KeReleaseSpinLock(&MetaCache->SpinLock, Irql);
+    Item->Size = Size;
+    return Item->Buffer;
+}
+
+VOID FspMetaCacheFreeItemBuffer(PVOID Buffer)
+{
+    FSP_META_CACHE_ITEM *Item = CONTAINING_RECORD(Buffer, FSP_META_CACHE_ITEM, Buffer);
+    FspFree(Item);
+}
+
+UINT64 FspMetaCacheAddItemBuffer(FSP_META_CACHE *MetaCache, PVOID Buffer)
+{
+    FSP_META_CACHE_ITEM *Item = CONTAINING_RECORD(Buffer, FSP_META_CACHE_ITEM, Buffer);
+    FSP_META_CACHE_LOCKED_SHARD *LockedShard;
+    FSP_META_CACHE_ITEM *EvictedItem, *ItemList = 0;
+    UINT64 ItemIndex = 0;
+    KIRQL Irql;
+    Item->ExpirationTime = FspExpirationTimeFromTimeout(MetaCache->MetaTimeout);
+    do
+        ItemIndex = (UINT64)InterlockedIncrement64(&MetaCache->ItemIndex);
+    while (0 == ItemIndex);
+    Item->ItemIndex = ItemIndex;
+    LockedShard = &MetaCache->Shards[FspMetaCacheShardIndex(ItemIndex)];
+    KeAcquireSpinLock(&LockedShard->SpinLock, &Irql);
+    FspMetaCacheShardInsert(&LockedShard->Shard, Item);
+    while (0 != (EvictedItem = FspMetaCacheShardRemoveOverCapacity(&LockedShard->Shard)))
+    {
+        EvictedItem->DictNext = ItemList;
+        ItemList = EvictedItem;
+    }
+    KeReleaseSpinLock(&LockedShard->SpinLock, Irql);
+    FspMetaCacheDereferenceItemList(ItemList);
     return ItemIndex;
 }
 
+UINT64 FspMetaCacheAddItem(FSP_META_CACHE *MetaCache, PCVOID Buffer, ULONG Size)
+{
+    PVOID ItemBuffer = FspMetaCacheAllocateItemBuffer(MetaCache, Size);
+    if (0 == ItemBuffer)
+        return 0;
+    RtlCopyMemory(ItemBuffer, Buffer, Size);
+    return FspMetaCacheAddItemBuffer(MetaCache, ItemBuffer);
+}
+
 VOID FspMetaCacheInvalidateItem(FSP_META_CACHE *MetaCache, UINT64 ItemIndex)
 {
     if (0 == MetaCache || 0 == ItemIndex)
         return;
+    FSP_META_CACHE_LOCKED_SHARD *LockedShard = &MetaCache->Shards[FspMetaCacheShardIndex(ItemIndex)];
     FSP_META_CACHE_ITEM *Item;
     KIRQL Irql;
-    KeAcquireSpinLock(&MetaCache->SpinLock, &Irql);
-    Item = FspMetaCacheRemoveIndexedItemAtDpcLevel(MetaCache, ItemIndex);
-    KeReleaseSpinLock(&MetaCache->SpinLock, Irql);
+    KeAcquireSpinLock(&LockedShard->SpinLock, &Irql);
+    Item = FspMetaCacheShardRemove(&LockedShard->Shard, ItemIndex);
+    KeReleaseSpinLock(&LockedShard->SpinLock, Irql);
     if (0 != Item)
         FspMetaCacheDereferenceItem(Item);
 }
@@ -0,0 +1,174 @@
+/**
+ * @file sys/negcache.c
+ *
+ * @copyright 2015-2016 Bill Zissimopoulos
+ */
+/*
+ * This file is part of WinFsp.
+ *
+ * You can redistribute it and/or modify it under the terms of the
+ * GNU Affero General Public License version 3 as published by the
+ * Free Software Foundation.
+ *
+ * Licensees holding a valid commercial license may use this file in
+ * accordance with the commercial license agreement provided with the
+ * software.
+ */
+
+#include <sys/driver.h>
+
+/*
+ * The negative name cache is a single table (see shared/negcache.h) protected by a
+ * fast mutex. It is only used at PASSIVE_LEVEL (Create, change notifications and the
+ * volume expiration work item), so its entries are paged allocations.
+ */
+
+NTSTATUS FspNegCacheCreate(
+    ULONG NegCapacity, BOOLEAN CaseInsensitive, PLARGE_INTEGER NegTimeout,
+    FSP_NEG_CACHE **PNegCache);
+VOID FspNegCacheDelete(FSP_NEG_CACHE *NegCache);
+VOID FspNegCacheInvalidateExpired(FSP_NEG_CACHE *NegCache, UINT64 ExpirationTime);
+UINT64 FspNegCacheGetToken(FSP_NEG_CACHE *NegCache, PUNICODE_STRING FileName);
+BOOLEAN FspNegCacheLookup(FSP_NEG_CACHE *NegCache, PUNICODE_STRING FileName);
+VOID FspNegCacheInsert(FSP_NEG_CACHE *NegCache, PUNICODE_STRING FileName, UINT64 Token);
+VOID FspNegCacheInvalidateParent(FSP_NEG_CACHE *NegCache, PUNICODE_STRING FileName);
+VOID FspNegCacheInvalidate(FSP_NEG_CACHE *NegCache);
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text(PAGE, FspNegCacheCreate)
+#pragma alloc_text(PAGE, FspNegCacheDelete)
+#pragma alloc_text(PAGE, FspNegCacheInvalidateExpired)
+#pragma alloc_text(PAGE, FspNegCacheGetToken)
+#pragma alloc_text(PAGE, FspNegCacheLookup)
+#pragma alloc_text(PAGE, FspNegCacheInsert)
+#pragma alloc_text(PAGE, FspNegCacheInvalidateParent)
+#pragma alloc_text(PAGE, FspNegCacheInvalidate)
+#endif
+
+NTSTATUS FspNegCacheCreate(
+    ULONG NegCapacity, BOOLEAN CaseInsensitive, PLARGE_INTEGER NegTimeout,
+    FSP_NEG_CACHE **PNegCache)
+{
+    PAGED_CODE();
+
+    *PNegCache = 0;
+    if (0 == NegCapacity || 0 == NegTimeout->QuadPart)
+        return STATUS_SUCCESS;
+    FSP_NEG_CACHE *NegCache;
+    NegCache = FspAllocNonPaged(sizeof *NegCache);
+    if (0 == NegCache)
+        return STATUS_INSUFFICIENT_RESOURCES;
+    RtlZeroMemory(NegCache, sizeof *NegCache);
+    ExInitializeFastMutex(&NegCache->Mutex);
+    NegCache->NegTimeout = NegTimeout->QuadPart;
+    FspNegCacheTableInitialize(&NegCache->Table, NegCapacity, CaseInsensitive);
+    *PNegCache = NegCache;
+    return STATUS_SUCCESS;
+}
+
+VOID FspNegCacheDelete(FSP_NEG_CACHE *NegCache)
+{
+    PAGED_CODE();
+
+    if (0 == NegCache)
+        return;
+    DEBUGLOG("hits=%llu misses=%llu rejects=%llu",
+        NegCache->Table.Hits, NegCache->Table.Misses, NegCache->Table.Rejects);
+    FspNegCacheInvalidateExpired(NegCache, (UINT64)-1LL);
+    FspFree(NegCache);
+}
+
+VOID FspNegCacheInvalidateExpired(FSP_NEG_CACHE *NegCache, UINT64 ExpirationTime)
+{
+    PAGED_CODE();
+
+    if (0 == NegCache)
+        return;
+    FSP_NEG_CACHE_ENTRY *Entry, *EntryList = 0;
+    ExAcquireFastMutex(&NegCache->Mutex);
+    while (0 != (Entry = FspNegCacheTableRemoveExpired(&NegCache->Table, ExpirationTime)))
+    {
+        Entry->DictNext = EntryList;
+        EntryList = Entry;
+    }
+    ExReleaseFastMutex(&NegCache->Mutex);
+    for (FSP_NEG_CACHE_ENTRY *NextEntry; 0 != EntryList; EntryList = NextEntry)
+    {
+        NextEntry = EntryList->DictNext;
+        FspFree(EntryList);
+    }
+}
+
+UINT64 FspNegCacheGetToken(FSP_NEG_CACHE *NegCache, PUNICODE_STRING FileName)
+{
+    PAGED_CODE();
+
+    if (0 == NegCache)
+        return 0;
+    UINT64 Token;
+    ExAcquireFastMutex(&NegCache->Mutex);
+    Token = FspNegCacheTableGetToken(&NegCache->Table, FileName->Buffer, FileName->Length);
+    ExReleaseFastMutex(&NegCache->Mutex);
+    return Token;
+}
+
+BOOLEAN FspNegCacheLookup(FSP_NEG_CACHE *NegCache, PUNICODE_STRING FileName)
+{
+    PAGED_CODE();
+
+    if (0 == NegCache)
+        return FALSE;
+    UINT64 InterruptTime = KeQueryInterruptTime();
+    BOOLEAN Result;
+    ExAcquireFastMutex(&NegCache->Mutex);
+    Result = FspNegCacheTableLookup(&NegCache->Table, FileName->Buffer, FileName->Length,
+        InterruptTime);
+    ExReleaseFastMutex(&NegCache->Mutex);
+    return Result;
+}
+
+VOID FspNegCacheInsert(FSP_NEG_CACHE *NegCache, PUNICODE_STRING FileName, UINT64 Token)
+{
+    PAGED_CODE();
+
+    if (0 == NegCache)
+        return;
+    FSP_NEG_CACHE_ENTRY *Entry, *OldEntry, *EvictedEntry;
+    Entry = FspAlloc(sizeof *Entry + FileName->Length);
+    if (0 == Entry)
+        return;
+    RtlZeroMemory(Entry, sizeof *Entry);
+    Entry->ExpirationTime = FspExpirationTimeFromTimeout(NegCache->NegTimeout);
+    Entry->NameLength = FileName->Length;
+    RtlCopyMemory(Entry->Name, FileName->Buffer, FileName->Length);
+    ExAcquireFastMutex(&NegCache->Mutex);
+    OldEntry = FspNegCacheTableInsert(&NegCache->Table, Entry, Token);
+    EvictedEntry = FspNegCacheTableRemoveOverCapacity(&NegCache->Table);
+    ExReleaseFastMutex(&NegCache->Mutex);
+    if (0 != OldEntry)
+        FspFree(OldEntry);
+    if (0 != EvictedEntry)
+        FspFree(EvictedEntry);
+}
+
+VOID FspNegCacheInvalidateParent(FSP_NEG_CACHE *NegCache, PUNICODE_STRING FileName)
+{
+    PAGED_CODE();
+
+    if (0 == NegCache)
+        return;
+    ExAcquireFastMutex(&NegCache->Mutex);
+    FspNegCacheTableInvalidateParent(&NegCache->Table, FileName->Buffer, FileName->Length);
+    ExReleaseFastMutex(&NegCache->Mutex);
+}
+
+VOID FspNegCacheInvalidate(FSP_NEG_CACHE *NegCache)
+{
+    PAGED_CODE();
+
+    if (0 == NegCache)
+        return;
+    ExAcquireFastMutex(&NegCache->Mutex);
+    FspNegCacheTableInvalidate(&NegCache->Table);
+    ExReleaseFastMutex(&NegCache->Mutex);
+}
@@ -219,6 +219,7 @@ static NTSTATUS FspFsvolReadNonCached(
     ULONG ReadKey = IrpSp->Parameters.Read.Key;
     BOOLEAN PagingIo = BooleanFlagOn(Irp->Flags, IRP_PAGING_IO);
     FSP_FSCTL_TRANSACT_REQ *Request;
+    BOOLEAN FlushCache;
     BOOLEAN Success;
 
     ASSERT(FileNode == FileDesc->FileNode);
@@ -232,9 +233,15 @@ static NTSTATUS FspFsvolReadNonCached(
     if (!NT_SUCCESS(Result))
         return Result;
 
-    /* acquire FileNode exclusive Full */
-    Success = DEBUGTEST(90) &&
-        FspFileNodeTryAcquireExclusiveF(FileNode, FspFileNodeAcquireFull, CanWait);
+    /*
+     * Acquire FileNode exclusive Full if the file is cached (and must be flushed), shared
+     * Full otherwise. A cached write acquires the FileNode exclusive, so a cache section
+     * that is created after this check can only contain clean pages.
+     */
+    FlushCache = !PagingIo && 0 != FileObject->SectionObjectPointer->DataSectionObject;
+    Success = DEBUGTEST(90) && (FlushCache ?
+        FspFileNodeTryAcquireExclusiveF(FileNode, FspFileNodeAcquireFull, CanWait) :
+        FspFileNodeTryAcquireSharedF(FileNode, FspFileNodeAcquireFull, CanWait));
     if (!Success)
         return FspWqRepostIrpWorkItem(Irp, FspFsvolReadNonCached, 0);
 
@@ -246,7 +253,7 @@ static NTSTATUS FspFsvolReadNonCached(
     }
 
     /* if this is a non-cached transfer on a cached file then flush the file */
-    if (!PagingIo && 0 != FileObject->SectionObjectPointer->DataSectionObject)
+    if (FlushCache)
     {
         if (!CanWait)
         {
@@ -266,7 +273,18 @@ static NTSTATUS FspFsvolReadNonCached(
     }
 
     /* convert FileNode to shared */
-    FspFileNodeConvertExclusiveToShared(FileNode, Full);
+    if (FlushCache)
+        FspFileNodeConvertExclusiveToShared(FileNode, Full);
+
+    /* lock the byte range shared; concurrent non-cached writes lock their ranges exclusive */
+    Result = FspFileNodeAcquireRange(FileNode, Irp, ReadOffset.QuadPart, ReadLength, FALSE, CanWait);
+    if (!NT_SUCCESS(Result))
+    {
+        FspFileNodeRelease(FileNode, Full);
+        if (STATUS_CANT_WAIT == Result)
+            return FspWqRepostIrpWorkItem(Irp, FspFsvolReadNonCached, 0);
+        return Result;
+    }
 
     /* delete any work item if present! */
     FspIrpDeleteRequest(Irp);
@@ -275,6 +293,7 @@ static NTSTATUS FspFsvolReadNonCached(
     Result = FspIopCreateRequestEx(Irp, 0, 0, FspFsvolReadNonCachedRequestFini, &Request);
     if (!NT_SUCCESS(Result))
     {
+        FspFileNodeReleaseRange(FileNode, Irp);
         FspFileNodeRelease(FileNode, Full);
         return Result;
     }
@@ -418,6 +437,7 @@ static VOID FspFsvolReadNonCachedRequestFini(FSP_FSCTL_TRANSACT_REQ *Request, PV
         PIO_STACK_LOCATION IrpSp = IoGetCurrentIrpStackLocation(Irp);
         FSP_FILE_NODE *FileNode = IrpSp->FileObject->FsContext;
 
+        FspFileNodeReleaseRange(FileNode, Irp);
         FspFileNodeReleaseOwner(FileNode, Full, Request);
     }
 }
@@ -130,15 +130,16 @@ NTSTATUS FspFsvolQuerySecurityComplete(
     PVOID Buffer = Irp->AssociatedIrp.SystemBuffer;
     ULONG Length = IrpSp->Parameters.QuerySecurity.Length;
     PVOID SecurityBuffer = 0;
+    PVOID SecurityDescriptor = FspPayloadResponseUnpack(Response,
+        &Response->Rsp.QuerySecurity.SecurityDescriptor);
     FSP_FSCTL_TRANSACT_REQ *Request = FspIrpRequest(Irp);
     BOOLEAN Success;
 
     if (0 != FspIopRequestContext(Request, RequestFileNode))
     {
         /* check that the security descriptor we got back is valid */
-        if (Response->Buffer + Response->Rsp.QuerySecurity.SecurityDescriptor.Size >
-                (PUINT8)Response + Response->Size ||
-            !RtlValidRelativeSecurityDescriptor((PVOID)Response->Buffer,
+        if (0 == SecurityDescriptor ||
+            !RtlValidRelativeSecurityDescriptor(SecurityDescriptor,
                 Response->Rsp.QuerySecurity.SecurityDescriptor.Size, 0))
         {
             Irp->IoStatus.Information = 0;
@@ -160,7 +161,7 @@ NTSTATUS FspFsvolQuerySecurityComplete(
     }
 
     Success = !FspFileNodeTrySetSecurity(FileNode,
-        Response->Buffer, Response->Rsp.QuerySecurity.SecurityDescriptor.Size,
+        SecurityDescriptor, Response->Rsp.QuerySecurity.SecurityDescriptor.Size,
         (ULONG)(UINT_PTR)FspIopRequestContext(Request, RequestSecurityChangeNumber));
     Success = Success && FspFileNodeReferenceSecurity(FileNode, &SecurityBuffer, 0);
     FspFileNodeRelease(FileNode, Main);
@@ -171,7 +172,7 @@ NTSTATUS FspFsvolQuerySecurityComplete(
     }
     else
     {
-        SecurityBuffer = (PVOID)Response->Buffer;
+        SecurityBuffer = SecurityDescriptor;
         Result = FspQuerySecurityDescriptorInfo(SecurityInformation, Buffer, &Length, SecurityBuffer);
     }
 
@@ -221,8 +222,8 @@ static NTSTATUS FspFsvolSetSecurity(
 
     FSP_FSCTL_TRANSACT_REQ *Request;
 
-    Result = FspIopCreateRequestEx(Irp, 0, SecurityDescriptorSize, FspFsvolSetSecurityRequestFini,
-        &Request);
+    Result = FspIopCreateRequestPayloadEx(Irp, 0, SecurityDescriptorSize, FspFsvolSetSecurityRequestFini,
+        FspFsvolDeviceExtension(DeviceObject)->VolumeParams.ExtendedPayload, &Request);
     if (!NT_SUCCESS(Result))
     {
         FspFileNodeRelease(FileNode, Full);
@@ -657,6 +657,7 @@ NTSTATUS FspVolumeTransact(
     ULONG OutputBufferLength = IrpSp->Parameters.FileSystemControl.OutputBufferLength;
     PVOID InputBuffer = Irp->AssociatedIrp.SystemBuffer;
     PVOID OutputBuffer = 0;
+    ULONG RequestSizeMax;
     if (0 != InputBufferLength &&
         FSP_FSCTL_DEFAULT_ALIGN_UP(sizeof(FSP_FSCTL_TRANSACT_RSP)) > InputBufferLength)
         return STATUS_INVALID_PARAMETER;
@@ -666,6 +667,11 @@ NTSTATUS FspVolumeTransact(
         (FSP_FSCTL_TRANSACT_BATCH == ControlCode &&
             FSP_FSCTL_TRANSACT_BATCH_BUFFER_SIZEMIN > OutputBufferLength)))
         return STATUS_BUFFER_TOO_SMALL;
+    /* ExtendedPayload volumes must be able to receive the largest request */
+    RequestSizeMax = FspPayloadRequestSizeMax(
+        FspFsvolDeviceExtension(FsvolDeviceObject)->VolumeParams.ExtendedPayload);
+    if (0 != OutputBufferLength && RequestSizeMax > OutputBufferLength)
+        return STATUS_BUFFER_TOO_SMALL;
 
     if (!FspDeviceReference(FsvolDeviceObject))
         return STATUS_CANCELLED;
@@ -787,7 +793,7 @@ NTSTATUS FspVolumeTransact(
     RepostedIrp = 0;
     Request = OutputBuffer;
     BufferEnd = (PUINT8)OutputBuffer + OutputBufferLength;
-    ASSERT(FspFsctlTransactCanProduceRequest(Request, BufferEnd));
+    ASSERT((PUINT8)Request + RequestSizeMax <= BufferEnd);
     LoopCount = FspIoqPendingIrpCount(FsvolDeviceExtension->Ioq);
     for (;;)
     {
@@ -809,28 +815,37 @@ NTSTATUS FspVolumeTransact(
         else
         {
             RtlCopyMemory(Request, PendingIrpRequest, PendingIrpRequest->Size);
-            Request = FspFsctlTransactProduceRequest(Request, PendingIrpRequest->Size);
 
             if (!FspIoqStartProcessingIrp(FsvolDeviceExtension->Ioq, PendingIrp))
             {
+                if (FspIoqStopped(FsvolDeviceExtension->Ioq))
+                {
+                    /*
+                     * The Ioq was stopped. Abandon everything and return STATUS_CANCELLED.
+                     * Any IRP's in the Pending and Process queues of the Ioq will be
+                     * cancelled during FspIoqStop(). We must also cancel the PendingIrp
+                     * we have in our hands.
+                     */
+                    FspIopCompleteCanceledIrp(PendingIrp);
+                    Result = STATUS_CANCELLED;
+                    goto exit;
+                }
+
                 /*
-                 * This can only happen if the Ioq was stopped. Abandon everything
-                 * and return STATUS_CANCELLED. Any IRP's in the Pending and Process
-                 * queues of the Ioq will be cancelled during FspIoqStop(). We must
-                 * also cancel the PendingIrp we have in our hands.
+                 * The Process dictionary is full and could not be grown. Fail this IRP
+                 * only; the request we copied is not produced and will be overwritten.
                  */
-                ASSERT(FspIoqStopped(FsvolDeviceExtension->Ioq));
-                FspIopCompleteCanceledIrp(PendingIrp);
-                Result = STATUS_CANCELLED;
-                goto exit;
+                FspIopCompleteIrp(PendingIrp, STATUS_INSUFFICIENT_RESOURCES);
             }
+            else
+                Request = FspFsctlTransactProduceRequest(Request, PendingIrpRequest->Size);
 
             /* are we doing single request or batch mode? */
             if (FSP_FSCTL_TRANSACT == ControlCode)
                 break;
 
             /* check that we have enough space before pulling the next pending IRP off the queue */
-            if (!FspFsctlTransactCanProduceRequest(Request, BufferEnd))
+            if ((PUINT8)Request + RequestSizeMax > BufferEnd)
                 break;
         }
         
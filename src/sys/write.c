@@ -270,6 +270,7 @@ static NTSTATUS FspFsvolWriteNonCached(
         FILE_WRITE_TO_END_OF_FILE == WriteOffset.LowPart && -1L == WriteOffset.HighPart;
     BOOLEAN PagingIo = BooleanFlagOn(Irp->Flags, IRP_PAGING_IO);
     FSP_FSCTL_TRANSACT_REQ *Request;
+    BOOLEAN ConcurrentIo;
     BOOLEAN Success;
 
     ASSERT(FileNode == FileDesc->FileNode);
@@ -291,11 +292,39 @@ static NTSTATUS FspFsvolWriteNonCached(
     if (!NT_SUCCESS(Result))
         return Result;
 
-    /* acquire FileNode exclusive Full */
-    Success = DEBUGTEST(90) &&
-        FspFileNodeTryAcquireExclusiveF(FileNode, FspFileNodeAcquireFull, CanWait);
-    if (!Success)
-        return FspWqRepostIrpWorkItem(Irp, FspFsvolWriteNonCached, 0);
+    /*
+     * A write that does not change the file size to a file that is not cached acquires
+     * FileNode shared Full and locks its byte range exclusive; it runs concurrently with
+     * non-cached reads and writes to other ranges. All other writes (paging I/O, writes
+     * to a cached file, writes that may extend the file) acquire FileNode exclusive Full.
+     */
+    ConcurrentIo = !PagingIo && !WriteToEndOfFile && 0 <= WriteOffset.QuadPart &&
+        0 == FileObject->SectionObjectPointer->DataSectionObject &&
+        (UINT64)WriteOffset.QuadPart + WriteLength <= (UINT64)FileNode->Header.FileSize.QuadPart;
+    if (ConcurrentIo)
+    {
+        /* acquire FileNode shared Full */
+        Success = DEBUGTEST(90) &&
+            FspFileNodeTryAcquireSharedF(FileNode, FspFileNodeAcquireFull, CanWait);
+        if (!Success)
+            return FspWqRepostIrpWorkItem(Irp, FspFsvolWriteNonCached, 0);
+
+        /* recheck now that the file size cannot change */
+        if (0 != FileObject->SectionObjectPointer->DataSectionObject ||
+            (UINT64)WriteOffset.QuadPart + WriteLength > (UINT64)FileNode->Header.FileSize.QuadPart)
+        {
+            FspFileNodeRelease(FileNode, Full);
+            ConcurrentIo = FALSE;
+        }
+    }
+    if (!ConcurrentIo)
+    {
+        /* acquire FileNode exclusive Full */
+        Success = DEBUGTEST(90) &&
+            FspFileNodeTryAcquireExclusiveF(FileNode, FspFileNodeAcquireFull, CanWait);
+        if (!Success)
+            return FspWqRepostIrpWorkItem(Irp, FspFsvolWriteNonCached, 0);
+    }
 
     /* check the file locks */
     if (!PagingIo && !FsRtlCheckLockForWriteAccess(&FileNode->FileLock, Irp))
@@ -324,6 +353,22 @@ static NTSTATUS FspFsvolWriteNonCached(
         }
     }
 
+    /* lock the byte range exclusive */
+    if (ConcurrentIo)
+    {
+        Result = FspFileNodeAcquireRange(FileNode, Irp,
+            WriteOffset.QuadPart, WriteLength, TRUE, CanWait);
+        if (!NT_SUCCESS(Result))
+        {
+            FspFileNodeRelease(FileNode, Full);
+            if (STATUS_CANT_WAIT == Result)
+                return FspWqRepostIrpWorkItem(Irp, FspFsvolWriteNonCached, 0);
+            return Result;
+        }
+    }
+    else
+        FspIrpRangeLockEntry(Irp) = 0;
+
     /* delete any work item if present! */
     FspIrpDeleteRequest(Irp);
 
@@ -331,6 +376,7 @@ static NTSTATUS FspFsvolWriteNonCached(
     Result = FspIopCreateRequestEx(Irp, 0, 0, FspFsvolWriteNonCachedRequestFini, &Request);
     if (!NT_SUCCESS(Result))
     {
+        FspFileNodeReleaseRange(FileNode, Irp);
         FspFileNodeRelease(FileNode, Full);
         return Result;
     }
@@ -417,11 +463,16 @@ NTSTATUS FspFsvolWriteComplete(
     {
         UINT64 OriginalFileSize = FileNode->Header.FileSize.QuadPart;
 
-        /* update file info */
-        FspFileNodeSetFileInfo(FileNode, FileObject, &Response->Rsp.Write.FileInfo);
+        /* update file info; a concurrent write holds FileNode shared and does not change its size */
+        if (0 == FspIrpRangeLockEntry(Irp))
+        {
+            FspFileNodeSetFileInfo(FileNode, FileObject, &Response->Rsp.Write.FileInfo);
 
-        if (OriginalFileSize != Response->Rsp.Write.FileInfo.FileSize)
-            FspFileNodeNotifyChange(FileNode, FILE_NOTIFY_CHANGE_SIZE, FILE_ACTION_MODIFIED);
+            if (OriginalFileSize != Response->Rsp.Write.FileInfo.FileSize)
+                FspFileNodeNotifyChange(FileNode, FILE_NOTIFY_CHANGE_SIZE, FILE_ACTION_MODIFIED);
+        }
+        else
+            FspFileNodeInvalidateFileInfo(FileNode);
 
         /* update the current file offset if synchronous I/O (and not paging I/O) */
         if (SynchronousIo && !PagingIo)
@@ -483,6 +534,7 @@ static VOID FspFsvolWriteNonCachedRequestFini(FSP_FSCTL_TRANSACT_REQ *Request, P
         PIO_STACK_LOCATION IrpSp = IoGetCurrentIrpStackLocation(Irp);
         FSP_FILE_NODE *FileNode = IrpSp->FileObject->FsContext;
 
+        FspFileNodeReleaseRange(FileNode, Irp);
         FspFileNodeReleaseOwner(FileNode, Full, Request);
     }
 }
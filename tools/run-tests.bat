@@ -25,7 +25,7 @@ cd P: >nul 2>nul || (echo === Unable to find drive P: >&2 & goto fail)
 
 set testpass=0
 set testfail=0
-for %%f in (winfsp-tests-x64 winfsp-tests-x86 :fsx-memfs-x64 :fsx-memfs-x86 :winfstest-memfs-x64 :winfstest-memfs-x86) do (
+for %%f in (winfsp-tests-x64 :winfsp-tests-x64-negative-name-cache :winfsp-tests-x64-adaptive-wakeup winfsp-tests-x86 :fsx-memfs-x64 :fsx-memfs-x86 :winfstest-memfs-x64 :winfstest-memfs-x86) do (
     echo === Running %%f
 
     if defined APPVEYOR (
@@ -70,6 +70,16 @@ exit /b 0
 :fail
 exit /b 1
 
+:winfsp-tests-x64-negative-name-cache
+winfsp-tests-x64 --negative-name-cache
+if errorlevel 1 goto fail
+exit /b 0
+
+:winfsp-tests-x64-adaptive-wakeup
+winfsp-tests-x64 --adaptive-wakeup
+if errorlevel 1 goto fail
+exit /b 0
+
 :fsx-memfs-x64
 M:
 "%ProjRoot%\ext\test\fstools\src\fsx\fsx.exe" -N 5000 test xxxxxx
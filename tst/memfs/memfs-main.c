@@ -26,6 +26,7 @@
 
 #define argtos(v)                       if (arge > ++argp) v = *argp; else goto usage
 #define argtol(v)                       if (arge > ++argp) v = wcstol_deflt(*argp, v); else goto usage
+#define argtoll(v)                      if (arge > ++argp) v = wcstoull_deflt(*argp, v); else goto usage
 
 static ULONG wcstol_deflt(wchar_t *w, ULONG deflt)
 {
@@ -34,6 +35,13 @@ static ULONG wcstol_deflt(wchar_t *w, ULONG deflt)
     return L'\0' != w[0] && L'\0' == *endp ? ul : deflt;
 }
 
+static UINT64 wcstoull_deflt(wchar_t *w, UINT64 deflt)
+{
+    wchar_t *endp;
+    UINT64 ull = _wcstoui64(w, &endp, 0);
+    return L'\0' != w[0] && L'\0' == *endp ? ull : deflt;
+}
+
 NTSTATUS SvcStart(FSP_SERVICE *Service, ULONG argc, PWSTR *argv)
 {
     wchar_t **argp, **arge;
@@ -41,10 +49,11 @@ NTSTATUS SvcStart(FSP_SERVICE *Service, ULONG argc, PWSTR *argv)
     ULONG Flags = MemfsDisk;
     ULONG FileInfoTimeout = INFINITE;
     ULONG MaxFileNodes = 1024;
-    ULONG MaxFileSize = 16 * 1024 * 1024;
+    UINT64 MaxFileSize = 16 * 1024 * 1024;
     PWSTR MountPoint = 0;
     PWSTR VolumePrefix = 0;
     PWSTR RootSddl = 0;
+    PWSTR TraceFileName = 0;
     MEMFS *Memfs = 0;
     NTSTATUS Result;
 
@@ -56,12 +65,18 @@ NTSTATUS SvcStart(FSP_SERVICE *Service, ULONG argc, PWSTR *argv)
         {
         case L'?':
             goto usage;
+        case L'c':
+            Flags |= MemfsConcurrent;
+            break;
         case L'd':
             argtol(DebugFlags);
             break;
         case L'm':
             argtos(MountPoint);
             break;
+        case L'N':
+            Flags |= MemfsNegativeNameCache;
+            break;
         case L'n':
             argtol(MaxFileNodes);
             break;
@@ -69,7 +84,10 @@ NTSTATUS SvcStart(FSP_SERVICE *Service, ULONG argc, PWSTR *argv)
             argtos(RootSddl);
             break;
         case L's':
-            argtol(MaxFileSize);
+            argtoll(MaxFileSize);
+            break;
+        case L'T':
+            argtos(TraceFileName);
             break;
         case L't':
             argtol(FileInfoTimeout);
@@ -77,7 +95,10 @@ NTSTATUS SvcStart(FSP_SERVICE *Service, ULONG argc, PWSTR *argv)
         case L'u':
             argtos(VolumePrefix);
             if (0 != VolumePrefix && L'\0' != VolumePrefix[0])
-                Flags = MemfsNet;
+                Flags |= MemfsNet;
+            break;
+        case L'W':
+            Flags |= MemfsAdaptiveWakeup;
             break;
         default:
             goto usage;
@@ -87,7 +108,7 @@ NTSTATUS SvcStart(FSP_SERVICE *Service, ULONG argc, PWSTR *argv)
     if (arge > argp)
         goto usage;
 
-    if (MemfsDisk == Flags && 0 == MountPoint)
+    if (0 == (Flags & MemfsNet) && 0 == MountPoint)
         goto usage;
 
     Result = MemfsCreate(Flags, FileInfoTimeout, MaxFileNodes, MaxFileSize, VolumePrefix, RootSddl,
@@ -100,6 +121,16 @@ NTSTATUS SvcStart(FSP_SERVICE *Service, ULONG argc, PWSTR *argv)
 
     FspFileSystemSetDebugLog(MemfsFileSystem(Memfs), DebugFlags);
 
+    if (0 != TraceFileName)
+    {
+        Result = FspFileSystemStartTrace(MemfsFileSystem(Memfs), TraceFileName, 0);
+        if (!NT_SUCCESS(Result))
+        {
+            fail(L"cannot start trace %s", TraceFileName);
+            goto exit;
+        }
+    }
+
     if (0 != MountPoint && L'\0' != MountPoint[0])
     {
         Result = FspFileSystemSetMountPoint(MemfsFileSystem(Memfs),
@@ -120,8 +151,11 @@ NTSTATUS SvcStart(FSP_SERVICE *Service, ULONG argc, PWSTR *argv)
 
     MountPoint = FspFileSystemMountPoint(MemfsFileSystem(Memfs));
 
-    info(L"%s -t %ld -n %ld -s %ld%s%s%s%s%s%s",
-        L"" PROGNAME, FileInfoTimeout, MaxFileNodes, MaxFileSize,
+    info(L"%s%s%s%s -t %ld -n %ld -s %I64u%s%s%s%s%s%s",
+        L"" PROGNAME, (Flags & MemfsConcurrent) ? L" -c" : L"",
+        (Flags & MemfsNegativeNameCache) ? L" -N" : L"",
+        (Flags & MemfsAdaptiveWakeup) ? L" -W" : L"",
+        FileInfoTimeout, MaxFileNodes, MaxFileSize,
         RootSddl ? L" -S " : L"", RootSddl ? RootSddl : L"",
         0 != VolumePrefix && L'\0' != VolumePrefix[0] ? L" -u " : L"",
             0 != VolumePrefix && L'\0' != VolumePrefix[0] ? VolumePrefix : L"",
@@ -141,15 +175,21 @@ usage:
         "usage: %s OPTIONS\n"
         "\n"
         "options:\n"
+        "    -c                  [concurrent: no operation guard; per file locking]\n"
+        "    -N                  [negative name cache: FSD caches names not found]\n"
+        "    -W                  [adaptive wakeup: FSD wakes dispatcher threads adaptively]\n"
         "    -d DebugFlags       [-1: enable all debug logs]\n"
         "    -t FileInfoTimeout  [millis]\n"
         "    -n MaxFileNodes\n"
         "    -s MaxFileSize      [bytes]\n"
         "    -S RootSddl         [file rights: FA, etc; NO generic rights: GA, etc.]\n"
         "    -u \\Server\\Share    [UNC prefix (single backslash)]\n"
-        "    -m MountPoint       [X:|* (required if no UNC prefix)]\n";
+        "    -m MountPoint       [X:|* (required if no UNC prefix)]\n"
+        "    -T TraceFile        [record requests to binary trace file]\n"
+        "\n"
+        "usage: %s -r TraceFile  [replay trace file without the FSD]\n";
 
-    fail(usage, L"" PROGNAME);
+    fail(usage, L"" PROGNAME, L"" PROGNAME);
 
     return STATUS_UNSUCCESSFUL;
 }
@@ -164,7 +204,80 @@ NTSTATUS SvcStop(FSP_SERVICE *Service)
     return STATUS_SUCCESS;
 }
 
+static int Replay(PWSTR TraceFileName)
+{
+    static PWSTR KindNames[FspFsctlTransactKindCount] =
+    {
+        L"Reserved", L"Create", L"Overwrite", L"Cleanup", L"Close", L"Read", L"Write",
+        L"QueryInformation", L"SetInformation", L"QueryEa", L"SetEa", L"FlushBuffers",
+        L"QueryVolumeInformation", L"SetVolumeInformation", L"QueryDirectory",
+        L"FileSystemControl", L"DeviceControl", L"Shutdown", L"LockControl",
+        L"QuerySecurity", L"SetSecurity",
+    };
+    MEMFS *Memfs = 0;
+    FSP_FILE_SYSTEM_STATISTICS *Statistics = 0;
+    FSP_FILE_SYSTEM_OPERATION_STATISTICS *OpStatistics;
+    ULONG RequestCount, Kind;
+    NTSTATUS Result;
+
+    Result = MemfsCreate(MemfsDetached, INFINITE, 1024 * 1024, 1024 * 1024 * 1024, 0, 0, &Memfs);
+    if (!NT_SUCCESS(Result))
+    {
+        fail(L"cannot create MEMFS");
+        goto exit;
+    }
+
+    Result = FspFileSystemEnableStatistics(MemfsFileSystem(Memfs));
+    if (!NT_SUCCESS(Result))
+        goto exit;
+
+    Result = FspFileSystemReplayTrace(MemfsFileSystem(Memfs), TraceFileName, &RequestCount);
+    if (!NT_SUCCESS(Result))
+    {
+        fail(L"cannot replay trace %s (Status=%lx)", TraceFileName, Result);
+        goto exit;
+    }
+
+    Statistics = malloc(sizeof *Statistics);
+    if (0 == Statistics)
+    {
+        Result = STATUS_INSUFFICIENT_RESOURCES;
+        goto exit;
+    }
+
+    Result = FspFileSystemGetStatistics(MemfsFileSystem(Memfs), Statistics);
+    if (!NT_SUCCESS(Result))
+        goto exit;
+
+    info(L"%s: replayed %lu requests", TraceFileName, RequestCount);
+    for (Kind = 0; FspFsctlTransactKindCount > Kind; Kind++)
+    {
+        OpStatistics = &Statistics->Operations[Kind];
+        if (0 == OpStatistics->Count)
+            continue;
+        info(L"%-24s count=%I64u errors=%I64u mean=%I64uns p50=%I64uns p99=%I64uns",
+            0 != KindNames[Kind] ? KindNames[Kind] : L"Unknown",
+            OpStatistics->Count,
+            OpStatistics->ErrorCount,
+            OpStatistics->TotalTime / OpStatistics->Count,
+            FspFileSystemStatisticsPercentile(OpStatistics, 50),
+            FspFileSystemStatisticsPercentile(OpStatistics, 99));
+    }
+
+    Result = STATUS_SUCCESS;
+
+exit:
+    free(Statistics);
+    if (0 != Memfs)
+        MemfsDelete(Memfs);
+
+    return NT_SUCCESS(Result) ? 0 : 1;
+}
+
 int wmain(int argc, wchar_t **argv)
 {
+    if (3 == argc && L'-' == argv[1][0] && L'r' == argv[1][1] && L'\0' == argv[1][2])
+        return Replay(argv[2]);
+
     return FspServiceRun(L"" PROGNAME, SvcStart, SvcStop, 0);
 }
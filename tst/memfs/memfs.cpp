@@ -19,6 +19,7 @@
 #include "memfs.h"
 #include <sddl.h>
 #include <map>
+#include <unordered_map>
 #include <cassert>
 
 /*
@@ -31,6 +32,7 @@
 
 #define MEMFS_SECTOR_SIZE               512
 #define MEMFS_SECTORS_PER_ALLOCATION_UNIT 1
+#define MEMFS_PAGE_SIZE                 (64 * 1024)
 
 static inline
 UINT64 MemfsGetSystemTime(VOID)
@@ -46,86 +48,558 @@ int MemfsFileNameCompare(PWSTR a, PWSTR b)
     return wcscmp(a, b);
 }
 
+typedef struct _MEMFS_FILE_NODE MEMFS_FILE_NODE;
+
+struct MEMFS_FILE_NODE_LESS
+{
+    bool operator()(PWSTR a, PWSTR b) const
+    {
+        return 0 > MemfsFileNameCompare(a, b);
+    }
+};
+typedef std::map<PWSTR, MEMFS_FILE_NODE *, MEMFS_FILE_NODE_LESS> MEMFS_FILE_NODE_CHILD_MAP;
+
+/*
+ * File nodes are carved out of large slabs and recycled through a free list. This avoids
+ * the per allocation overhead of the heap for what is by far the most common allocation.
+ */
+#define MEMFS_SLAB_SIZE                 (64 * 1024)
+
+typedef struct _MEMFS_SLAB
+{
+    SRWLOCK Lock;
+    SIZE_T ItemSize;
+    PVOID FreeList;
+    PVOID SlabList;
+} MEMFS_SLAB;
+
 static inline
-BOOLEAN MemfsFileNameHasPrefix(PWSTR a, PWSTR b)
+VOID MemfsSlabInitialize(MEMFS_SLAB *Slab, SIZE_T ItemSize)
 {
-    return 0 == wcsncmp(a, b, wcslen(b));
+    InitializeSRWLock(&Slab->Lock);
+    Slab->ItemSize = (ItemSize + MEMORY_ALLOCATION_ALIGNMENT - 1) &
+        ~(SIZE_T)(MEMORY_ALLOCATION_ALIGNMENT - 1);
+    Slab->FreeList = 0;
+    Slab->SlabList = 0;
 }
 
-typedef struct _MEMFS_FILE_NODE
+static inline
+VOID MemfsSlabFinalize(MEMFS_SLAB *Slab)
 {
-    WCHAR FileName[MAX_PATH];
-    FSP_FSCTL_FILE_INFO FileInfo;
-    SIZE_T FileSecuritySize;
-    PVOID FileSecurity;
-    PVOID FileData;
+    PVOID Block, NextBlock;
+
+    for (Block = Slab->SlabList; 0 != Block; Block = NextBlock)
+    {
+        NextBlock = *(PVOID *)Block;
+        free(Block);
+    }
+    Slab->FreeList = 0;
+    Slab->SlabList = 0;
+}
+
+static inline
+PVOID MemfsSlabAlloc(MEMFS_SLAB *Slab)
+{
+    PUINT8 Block, Item;
+    PVOID Result;
+
+    AcquireSRWLockExclusive(&Slab->Lock);
+
+    if (0 == Slab->FreeList)
+    {
+        /* the first MEMORY_ALLOCATION_ALIGNMENT bytes of a slab link it to the slab list */
+        Block = (PUINT8)malloc(MEMFS_SLAB_SIZE);
+        if (0 == Block)
+        {
+            ReleaseSRWLockExclusive(&Slab->Lock);
+            return 0;
+        }
+        *(PVOID *)Block = Slab->SlabList;
+        Slab->SlabList = Block;
+        for (Item = Block + MEMORY_ALLOCATION_ALIGNMENT;
+            Block + MEMFS_SLAB_SIZE >= Item + Slab->ItemSize;
+            Item += Slab->ItemSize)
+        {
+            *(PVOID *)Item = Slab->FreeList;
+            Slab->FreeList = Item;
+        }
+    }
+
+    Result = Slab->FreeList;
+    Slab->FreeList = *(PVOID *)Result;
+
+    ReleaseSRWLockExclusive(&Slab->Lock);
+
+    return Result;
+}
+
+static inline
+VOID MemfsSlabFree(MEMFS_SLAB *Slab, PVOID Item)
+{
+    AcquireSRWLockExclusive(&Slab->Lock);
+    *(PVOID *)Item = Slab->FreeList;
+    Slab->FreeList = Item;
+    ReleaseSRWLockExclusive(&Slab->Lock);
+}
+
+/*
+ * File names and security descriptors are interned in reference counted blob pools.
+ * Identical blobs are stored only once: files with the same name in different directories
+ * share a single name and files that inherit the same ACL share a single security
+ * descriptor. Interned blobs are immutable; a change interns the new value and releases
+ * the old one.
+ */
+typedef struct _MEMFS_BLOB
+{
+    struct _MEMFS_BLOB *HashNext;
+    ULONG Hash;
     ULONG RefCount;
-} MEMFS_FILE_NODE;
+    SIZE_T Size;
+    UINT8 Data[];
+} MEMFS_BLOB;
 
-struct MEMFS_FILE_NODE_LESS
+typedef struct _MEMFS_BLOB_POOL
 {
-    bool operator()(PWSTR a, PWSTR b) const
+    SRWLOCK Lock;
+    MEMFS_BLOB **Buckets;
+    ULONG BucketCount;                  /* power of 2 */
+    ULONG Count;
+} MEMFS_BLOB_POOL;
+
+static inline
+VOID MemfsBlobPoolInitialize(MEMFS_BLOB_POOL *Pool)
+{
+    InitializeSRWLock(&Pool->Lock);
+    Pool->Buckets = 0;
+    Pool->BucketCount = 0;
+    Pool->Count = 0;
+}
+
+static inline
+VOID MemfsBlobPoolFinalize(MEMFS_BLOB_POOL *Pool)
+{
+    MEMFS_BLOB *Blob, *NextBlob;
+
+    for (ULONG Index = 0; Pool->BucketCount > Index; Index++)
+        for (Blob = Pool->Buckets[Index]; 0 != Blob; Blob = NextBlob)
+        {
+            NextBlob = Blob->HashNext;
+            free(Blob);
+        }
+    free(Pool->Buckets);
+    Pool->Buckets = 0;
+    Pool->BucketCount = 0;
+    Pool->Count = 0;
+}
+
+static inline
+ULONG MemfsBlobHash(PVOID Data, SIZE_T Size)
+{
+    /* FNV-1a */
+    PUINT8 P = (PUINT8)Data, EndP = P + Size;
+    ULONG Hash = 2166136261;
+    for (; EndP > P; P++)
+        Hash = (Hash ^ *P) * 16777619;
+    return Hash;
+}
+
+static inline
+SIZE_T MemfsBlobSize(PVOID Data)
+{
+    return 0 != Data ? CONTAINING_RECORD(Data, MEMFS_BLOB, Data)->Size : 0;
+}
+
+static inline
+PVOID MemfsBlobPoolIntern(MEMFS_BLOB_POOL *Pool, PVOID Data, SIZE_T Size)
+{
+    ULONG Hash = MemfsBlobHash(Data, Size);
+    MEMFS_BLOB *Blob, *NextBlob, **Buckets;
+    ULONG BucketCount;
+
+    AcquireSRWLockExclusive(&Pool->Lock);
+
+    if (0 != Pool->BucketCount)
+        for (Blob = Pool->Buckets[Hash & (Pool->BucketCount - 1)]; 0 != Blob; Blob = Blob->HashNext)
+            if (Hash == Blob->Hash && Size == Blob->Size && 0 == memcmp(Blob->Data, Data, Size))
+            {
+                Blob->RefCount++;
+                goto exit;
+            }
+
+    if (Pool->Count >= Pool->BucketCount)
     {
-        return 0 > MemfsFileNameCompare(a, b);
+        BucketCount = 0 != Pool->BucketCount ? Pool->BucketCount * 2 : 64;
+        Buckets = (MEMFS_BLOB **)calloc(BucketCount, sizeof Buckets[0]);
+        if (0 == Buckets)
+        {
+            Blob = 0;
+            goto exit;
+        }
+        for (ULONG Index = 0; Pool->BucketCount > Index; Index++)
+            for (Blob = Pool->Buckets[Index]; 0 != Blob; Blob = NextBlob)
+            {
+                NextBlob = Blob->HashNext;
+                Blob->HashNext = Buckets[Blob->Hash & (BucketCount - 1)];
+                Buckets[Blob->Hash & (BucketCount - 1)] = Blob;
+            }
+        free(Pool->Buckets);
+        Pool->Buckets = Buckets;
+        Pool->BucketCount = BucketCount;
     }
-};
-typedef std::map<PWSTR, MEMFS_FILE_NODE *, MEMFS_FILE_NODE_LESS> MEMFS_FILE_NODE_MAP;
+
+    Blob = (MEMFS_BLOB *)malloc(FIELD_OFFSET(MEMFS_BLOB, Data) + Size);
+    if (0 == Blob)
+        goto exit;
+    Blob->Hash = Hash;
+    Blob->RefCount = 1;
+    Blob->Size = Size;
+    memcpy(Blob->Data, Data, Size);
+    Blob->HashNext = Pool->Buckets[Hash & (Pool->BucketCount - 1)];
+    Pool->Buckets[Hash & (Pool->BucketCount - 1)] = Blob;
+    Pool->Count++;
+
+exit:
+    ReleaseSRWLockExclusive(&Pool->Lock);
+
+    return 0 != Blob ? Blob->Data : 0;
+}
+
+static inline
+VOID MemfsBlobPoolRelease(MEMFS_BLOB_POOL *Pool, PVOID Data)
+{
+    MEMFS_BLOB *Blob, **PBlob;
+
+    if (0 == Data)
+        return;
+
+    Blob = CONTAINING_RECORD(Data, MEMFS_BLOB, Data);
+
+    AcquireSRWLockExclusive(&Pool->Lock);
+
+    if (0 == --Blob->RefCount)
+    {
+        for (PBlob = &Pool->Buckets[Blob->Hash & (Pool->BucketCount - 1)]; Blob != *PBlob;
+            PBlob = &(*PBlob)->HashNext)
+            ;
+        *PBlob = Blob->HashNext;
+        Pool->Count--;
+        free(Blob);
+    }
+
+    ReleaseSRWLockExclusive(&Pool->Lock);
+}
+
+typedef struct _MEMFS_FILE_NODE
+{
+    PWSTR FileName;                     /* interned last path component; empty for the root */
+    FSP_FSCTL_FILE_INFO FileInfo;
+    PVOID FileSecurity;                 /* interned; size is MemfsBlobSize(FileSecurity) */
+    PVOID *FileData;                    /* page table; see MemfsFileNodeSetPageCount */
+    SIZE_T FileDataCapacity;            /* number of page table entries */
+    LONG RefCount;                      /* interlocked; see MemfsFileNodeDereference */
+    SRWLOCK Lock;                       /* see MEMFS_FILE_NODE_MAP */
+    MEMFS_FILE_NODE *Parent;            /* 0 for the root and for nodes not in the map */
+    MEMFS_FILE_NODE_CHILD_MAP *Children; /* directories only; created on first insert */
+} MEMFS_FILE_NODE;
+
+#define MEMFS_INDEX_STRIPE_COUNT        64
+
+typedef struct _MEMFS_INDEX_STRIPE
+{
+    SRWLOCK Lock;
+    std::unordered_map<UINT64, MEMFS_FILE_NODE *> IndexMap;
+} MEMFS_INDEX_STRIPE;
+
+/*
+ * The file node map is a tree of directory nodes. Every directory keeps its children
+ * in an ordered map keyed by name, so that lookups are O(depth), directory listings
+ * are O(children) and renames only move a single node. A second map from index
+ * number to node allows ReadDirectory to resume a listing without a linear scan.
+ *
+ * The map does not rely on the operation guard and may be accessed concurrently:
+ *
+ * - Every node has a reader-writer lock that protects its file info, data and security
+ *   and for directories its children. The Parent and FileName of a node change only
+ *   with both the parent and the node locked exclusive.
+ * - Locks are acquired parent before child. Lookups couple shared locks down the path,
+ *   so that operations in unrelated directories proceed in parallel.
+ * - Renames serialize on the RenameLock, which Cleanup(Delete) takes shared. This keeps
+ *   the shape of the tree stable during a rename, so that it can lock an ancestor
+ *   directory before its descendant.
+ * - The index map is striped by index number. Stripe locks are never held while
+ *   acquiring another lock.
+ * - The map holds a reference on every node in it. Nodes are freed when their last
+ *   reference is released, which is never done while holding a node lock.
+ */
+typedef struct _MEMFS_FILE_NODE_MAP
+{
+    MEMFS_FILE_NODE *RootNode;
+    SRWLOCK RenameLock;
+    LONG Count;
+    MEMFS_INDEX_STRIPE IndexStripes[MEMFS_INDEX_STRIPE_COUNT];
+    MEMFS_SLAB FileNodeSlab;
+    MEMFS_BLOB_POOL FileNamePool;
+    MEMFS_BLOB_POOL FileSecurityPool;
+} MEMFS_FILE_NODE_MAP;
 
 typedef struct _MEMFS
 {
     FSP_FILE_SYSTEM *FileSystem;
     MEMFS_FILE_NODE_MAP *FileNodeMap;
     ULONG MaxFileNodes;
-    ULONG MaxFileSize;
+    UINT64 MaxFileSize;
+    SRWLOCK VolumeLabelLock;
     UINT16 VolumeLabelLength;
     WCHAR VolumeLabel[32];
 } MEMFS;
 
 static inline
-NTSTATUS MemfsFileNodeCreate(PWSTR FileName, MEMFS_FILE_NODE **PFileNode)
+NTSTATUS MemfsFileNodeCreate(MEMFS_FILE_NODE_MAP *FileNodeMap, PWSTR FileName,
+    MEMFS_FILE_NODE **PFileNode)
 {
-    static UINT64 IndexNumber = 1;
+    static LONG64 IndexNumber = 0;
     MEMFS_FILE_NODE *FileNode;
+    SIZE_T FileNameLength;
 
     *PFileNode = 0;
 
-    if (MAX_PATH <= wcslen(FileName))
+    FileNameLength = wcslen(FileName);
+    if (MAX_PATH <= FileNameLength)
         return STATUS_OBJECT_NAME_INVALID;
 
-    FileNode = (MEMFS_FILE_NODE *)malloc(sizeof *FileNode);
+    FileNode = (MEMFS_FILE_NODE *)MemfsSlabAlloc(&FileNodeMap->FileNodeSlab);
     if (0 == FileNode)
         return STATUS_INSUFFICIENT_RESOURCES;
 
     memset(FileNode, 0, sizeof *FileNode);
-    wcscpy_s(FileNode->FileName, sizeof FileNode->FileName / sizeof(WCHAR), FileName);
+    InitializeSRWLock(&FileNode->Lock);
+    FileNode->FileName = (PWSTR)MemfsBlobPoolIntern(&FileNodeMap->FileNamePool,
+        FileName, (FileNameLength + 1) * sizeof(WCHAR));
+    if (0 == FileNode->FileName)
+    {
+        MemfsSlabFree(&FileNodeMap->FileNodeSlab, FileNode);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
     FileNode->FileInfo.CreationTime =
     FileNode->FileInfo.LastAccessTime =
     FileNode->FileInfo.LastWriteTime =
     FileNode->FileInfo.ChangeTime = MemfsGetSystemTime();
-    FileNode->FileInfo.IndexNumber = IndexNumber++;
+    FileNode->FileInfo.IndexNumber = InterlockedIncrement64(&IndexNumber);
 
     *PFileNode = FileNode;
 
     return STATUS_SUCCESS;
 }
 
+/*
+ * File data is kept in fixed size pages referenced from a page table. Pages are allocated
+ * only when written; missing pages are holes that read as zeros. The page table covers the
+ * allocation size of the file and grows geometrically, so that extending a file never copies
+ * file data. Bytes past the end of file in allocated pages are kept zero, so that extending
+ * the file size needs no zero filling.
+ */
+static inline
+NTSTATUS MemfsFileNodeSetPageCount(MEMFS_FILE_NODE *FileNode, UINT64 AllocationSize)
+{
+    SIZE_T PageCount = (SIZE_T)((AllocationSize + MEMFS_PAGE_SIZE - 1) / MEMFS_PAGE_SIZE);
+    SIZE_T Index, Capacity;
+    PVOID *FileData;
+
+    if (0 == PageCount)
+    {
+        for (Index = 0; FileNode->FileDataCapacity > Index; Index++)
+            free(FileNode->FileData[Index]);
+        free(FileNode->FileData);
+        FileNode->FileData = 0;
+        FileNode->FileDataCapacity = 0;
+        return STATUS_SUCCESS;
+    }
+
+    if (FileNode->FileDataCapacity < PageCount)
+    {
+        Capacity = FileNode->FileDataCapacity * 2;
+        if (Capacity < PageCount)
+            Capacity = PageCount;
+        FileData = (PVOID *)realloc(FileNode->FileData, Capacity * sizeof FileData[0]);
+        if (0 == FileData)
+            return STATUS_INSUFFICIENT_RESOURCES;
+        memset(FileData + FileNode->FileDataCapacity, 0,
+            (Capacity - FileNode->FileDataCapacity) * sizeof FileData[0]);
+        FileNode->FileData = FileData;
+        FileNode->FileDataCapacity = Capacity;
+    }
+    else
+    {
+        for (Index = PageCount; FileNode->FileDataCapacity > Index; Index++)
+        {
+            free(FileNode->FileData[Index]);
+            FileNode->FileData[Index] = 0;
+        }
+    }
+
+    return STATUS_SUCCESS;
+}
+
+static inline
+VOID MemfsFileNodeTruncateData(MEMFS_FILE_NODE *FileNode, UINT64 FileSize, UINT64 NewFileSize)
+{
+    SIZE_T Index, EndIndex;
+
+    Index = (SIZE_T)(NewFileSize / MEMFS_PAGE_SIZE);
+    EndIndex = (SIZE_T)((FileSize + MEMFS_PAGE_SIZE - 1) / MEMFS_PAGE_SIZE);
+    if (EndIndex > FileNode->FileDataCapacity)
+        EndIndex = FileNode->FileDataCapacity;
+
+    if (0 != NewFileSize % MEMFS_PAGE_SIZE && Index < EndIndex)
+    {
+        if (0 != FileNode->FileData[Index])
+            memset((PUINT8)FileNode->FileData[Index] + NewFileSize % MEMFS_PAGE_SIZE, 0,
+                MEMFS_PAGE_SIZE - NewFileSize % MEMFS_PAGE_SIZE);
+        Index++;
+    }
+
+    for (; EndIndex > Index; Index++)
+    {
+        free(FileNode->FileData[Index]);
+        FileNode->FileData[Index] = 0;
+    }
+}
+
+static inline
+VOID MemfsFileNodeReadData(MEMFS_FILE_NODE *FileNode, PVOID Buffer, UINT64 Offset, ULONG Length)
+{
+    PUINT8 P = (PUINT8)Buffer;
+    SIZE_T Index;
+    ULONG PageOffset, PageLength;
+
+    while (0 < Length)
+    {
+        Index = (SIZE_T)(Offset / MEMFS_PAGE_SIZE);
+        PageOffset = (ULONG)(Offset % MEMFS_PAGE_SIZE);
+        PageLength = MEMFS_PAGE_SIZE - PageOffset;
+        if (PageLength > Length)
+            PageLength = Length;
+
+        if (FileNode->FileDataCapacity > Index && 0 != FileNode->FileData[Index])
+            memcpy(P, (PUINT8)FileNode->FileData[Index] + PageOffset, PageLength);
+        else
+            memset(P, 0, PageLength);
+
+        P += PageLength;
+        Offset += PageLength;
+        Length -= PageLength;
+    }
+}
+
+static inline
+NTSTATUS MemfsFileNodeWriteData(MEMFS_FILE_NODE *FileNode, PVOID Buffer, UINT64 Offset, ULONG Length)
+{
+    PUINT8 P = (PUINT8)Buffer;
+    SIZE_T Index;
+    ULONG PageOffset, PageLength;
+
+    while (0 < Length)
+    {
+        Index = (SIZE_T)(Offset / MEMFS_PAGE_SIZE);
+        PageOffset = (ULONG)(Offset % MEMFS_PAGE_SIZE);
+        PageLength = MEMFS_PAGE_SIZE - PageOffset;
+        if (PageLength > Length)
+            PageLength = Length;
+
+        /* writes are always within the allocation size, which the page table covers */
+        assert(FileNode->FileDataCapacity > Index);
+        if (0 == FileNode->FileData[Index])
+        {
+            FileNode->FileData[Index] = malloc(MEMFS_PAGE_SIZE);
+            if (0 == FileNode->FileData[Index])
+                return STATUS_INSUFFICIENT_RESOURCES;
+            memset(FileNode->FileData[Index], 0, MEMFS_PAGE_SIZE);
+        }
+        memcpy((PUINT8)FileNode->FileData[Index] + PageOffset, P, PageLength);
+
+        P += PageLength;
+        Offset += PageLength;
+        Length -= PageLength;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+static inline
+VOID MemfsFileNodeDelete(MEMFS_FILE_NODE_MAP *FileNodeMap, MEMFS_FILE_NODE *FileNode)
+{
+    delete FileNode->Children;
+    MemfsFileNodeSetPageCount(FileNode, 0);
+    MemfsBlobPoolRelease(&FileNodeMap->FileSecurityPool, FileNode->FileSecurity);
+    MemfsBlobPoolRelease(&FileNodeMap->FileNamePool, FileNode->FileName);
+    MemfsSlabFree(&FileNodeMap->FileNodeSlab, FileNode);
+}
+
+static inline
+VOID MemfsFileNodeReference(MEMFS_FILE_NODE *FileNode)
+{
+    InterlockedIncrement(&FileNode->RefCount);
+}
+
 static inline
-VOID MemfsFileNodeDelete(MEMFS_FILE_NODE *FileNode)
+VOID MemfsFileNodeDereference(MEMFS_FILE_NODE_MAP *FileNodeMap, MEMFS_FILE_NODE *FileNode)
 {
-    free(FileNode->FileData);
-    free(FileNode->FileSecurity);
-    free(FileNode);
+    if (0 == InterlockedDecrement(&FileNode->RefCount))
+        MemfsFileNodeDelete(FileNodeMap, FileNode);
+}
+
+static inline
+NTSTATUS MemfsFileNodeSetSecurity(MEMFS_FILE_NODE_MAP *FileNodeMap, MEMFS_FILE_NODE *FileNode,
+    PSECURITY_DESCRIPTOR SecurityDescriptor)
+{
+    PVOID FileSecurity = 0;
+
+    if (0 != SecurityDescriptor)
+    {
+        FileSecurity = MemfsBlobPoolIntern(&FileNodeMap->FileSecurityPool,
+            SecurityDescriptor, GetSecurityDescriptorLength(SecurityDescriptor));
+        if (0 == FileSecurity)
+            return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    MemfsBlobPoolRelease(&FileNodeMap->FileSecurityPool, FileNode->FileSecurity);
+    FileNode->FileSecurity = FileSecurity;
+
+    return STATUS_SUCCESS;
+}
+
+static inline
+BOOLEAN MemfsFileNodeHasName(MEMFS_FILE_NODE *FileNode, PWSTR FileName)
+{
+    BOOLEAN Result;
+    WCHAR Root[2] = L"\\";
+    PWSTR Remain, Suffix;
+    FspPathSuffix(FileName, &Remain, &Suffix, Root);
+    Result = 0 == MemfsFileNameCompare(Suffix, FileNode->FileName);
+    FspPathCombine(FileName, Suffix);
+    return Result;
+}
+
+static inline
+VOID MemfsFileNodeMapDump0(MEMFS_FILE_NODE *FileNode, ULONG Depth)
+{
+    FspDebugLog("%c %04lx %6lu %3lu %S\n",
+        FILE_ATTRIBUTE_DIRECTORY & FileNode->FileInfo.FileAttributes ? 'd' : 'f',
+        (ULONG)FileNode->FileInfo.FileAttributes,
+        (ULONG)FileNode->FileInfo.FileSize,
+        Depth,
+        0 != FileNode->Parent ? FileNode->FileName : L"\\");
+    if (0 != FileNode->Children)
+        for (MEMFS_FILE_NODE_CHILD_MAP::iterator p = FileNode->Children->begin(), q = FileNode->Children->end();
+            p != q; ++p)
+            MemfsFileNodeMapDump0(p->second, Depth + 1);
 }
 
 static inline
 VOID MemfsFileNodeMapDump(MEMFS_FILE_NODE_MAP *FileNodeMap)
 {
-    for (MEMFS_FILE_NODE_MAP::iterator p = FileNodeMap->begin(), q = FileNodeMap->end(); p != q; ++p)
-        FspDebugLog("%c %04lx %6lu %S\n",
-            FILE_ATTRIBUTE_DIRECTORY & p->second->FileInfo.FileAttributes ? 'd' : 'f',
-            (ULONG)p->second->FileInfo.FileAttributes,
-            (ULONG)p->second->FileInfo.FileSize,
-            p->second->FileName);
+    if (0 != FileNodeMap->RootNode)
+        MemfsFileNodeMapDump0(FileNodeMap->RootNode, 0);
 }
 
 static inline
@@ -135,6 +609,14 @@ NTSTATUS MemfsFileNodeMapCreate(MEMFS_FILE_NODE_MAP **PFileNodeMap)
     try
     {
         *PFileNodeMap = new MEMFS_FILE_NODE_MAP;
+        (*PFileNodeMap)->RootNode = 0;
+        InitializeSRWLock(&(*PFileNodeMap)->RenameLock);
+        (*PFileNodeMap)->Count = 0;
+        for (ULONG Index = 0; MEMFS_INDEX_STRIPE_COUNT > Index; Index++)
+            InitializeSRWLock(&(*PFileNodeMap)->IndexStripes[Index].Lock);
+        MemfsSlabInitialize(&(*PFileNodeMap)->FileNodeSlab, sizeof(MEMFS_FILE_NODE));
+        MemfsBlobPoolInitialize(&(*PFileNodeMap)->FileNamePool);
+        MemfsBlobPoolInitialize(&(*PFileNodeMap)->FileSecurityPool);
         return STATUS_SUCCESS;
     }
     catch (...)
@@ -146,135 +628,319 @@ NTSTATUS MemfsFileNodeMapCreate(MEMFS_FILE_NODE_MAP **PFileNodeMap)
 static inline
 VOID MemfsFileNodeMapDelete(MEMFS_FILE_NODE_MAP *FileNodeMap)
 {
-    for (MEMFS_FILE_NODE_MAP::iterator p = FileNodeMap->begin(), q = FileNodeMap->end(); p != q; ++p)
-        MemfsFileNodeDelete(p->second);
+    MEMFS_FILE_NODE *FileNode, *ChildNode;
 
+    /* delete the tree bottom-up without recursion; trees may be deep */
+    for (FileNode = FileNodeMap->RootNode; 0 != FileNode;)
+    {
+        if (0 != FileNode->Children && !FileNode->Children->empty())
+        {
+            ChildNode = FileNode->Children->begin()->second;
+            FileNode->Children->erase(FileNode->Children->begin());
+            FileNode = ChildNode;
+        }
+        else
+        {
+            ChildNode = FileNode;
+            FileNode = FileNode->Parent;
+            MemfsFileNodeDelete(FileNodeMap, ChildNode);
+        }
+    }
+
+    MemfsBlobPoolFinalize(&FileNodeMap->FileSecurityPool);
+    MemfsBlobPoolFinalize(&FileNodeMap->FileNamePool);
+    MemfsSlabFinalize(&FileNodeMap->FileNodeSlab);
     delete FileNodeMap;
 }
 
 static inline
 SIZE_T MemfsFileNodeMapCount(MEMFS_FILE_NODE_MAP *FileNodeMap)
 {
-    return FileNodeMap->size();
+    return (SIZE_T)FileNodeMap->Count;
+}
+
+/*
+ * Look up a path. Both the node and its parent directory are returned referenced; either
+ * may be 0. The parent is 0 when an intermediate component does not exist.
+ */
+static inline
+MEMFS_FILE_NODE *MemfsFileNodeMapLookup(MEMFS_FILE_NODE_MAP *FileNodeMap, PWSTR FileName,
+    MEMFS_FILE_NODE **PParentNode)
+{
+    MEMFS_FILE_NODE *FileNode = FileNodeMap->RootNode, *ChildNode;
+    MEMFS_FILE_NODE_CHILD_MAP::iterator iter;
+    PWSTR Name, Pointer;
+    WCHAR Separator;
+
+    AcquireSRWLockShared(&FileNode->Lock);
+
+    /* walk the path one component at a time; components are terminated in place */
+    for (Pointer = FileName; L'\\' == *Pointer; Pointer++)
+        ;
+    if (L'\0' == *Pointer)
+    {
+        MemfsFileNodeReference(FileNode);
+        MemfsFileNodeReference(FileNode);
+        ReleaseSRWLockShared(&FileNode->Lock);
+        *PParentNode = FileNode;
+        return FileNode;
+    }
+
+    for (;;)
+    {
+        for (Name = Pointer; L'\0' != *Pointer && L'\\' != *Pointer; Pointer++)
+            ;
+        Separator = *Pointer;
+        *Pointer = L'\0';
+        ChildNode = 0;
+        if (0 != FileNode->Children)
+        {
+            iter = FileNode->Children->find(Name);
+            if (FileNode->Children->end() != iter)
+                ChildNode = iter->second;
+        }
+        *Pointer = Separator;
+        for (; L'\\' == *Pointer; Pointer++)
+            ;
+
+        if (L'\0' == *Pointer)
+        {
+            if (0 != ChildNode)
+                MemfsFileNodeReference(ChildNode);
+            MemfsFileNodeReference(FileNode);
+            ReleaseSRWLockShared(&FileNode->Lock);
+            *PParentNode = FileNode;
+            return ChildNode;
+        }
+        if (0 == ChildNode)
+        {
+            ReleaseSRWLockShared(&FileNode->Lock);
+            *PParentNode = 0;
+            return 0;
+        }
+
+        AcquireSRWLockShared(&ChildNode->Lock);
+        ReleaseSRWLockShared(&FileNode->Lock);
+        FileNode = ChildNode;
+    }
+}
+
+static inline
+NTSTATUS MemfsFileNodeMapParentResult(MEMFS_FILE_NODE *ParentNode, NTSTATUS Result)
+{
+    if (0 == ParentNode)
+        return STATUS_OBJECT_PATH_NOT_FOUND;
+    if (0 == (ParentNode->FileInfo.FileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+        return STATUS_NOT_A_DIRECTORY;
+    return Result;
 }
 
 static inline
-MEMFS_FILE_NODE *MemfsFileNodeMapGet(MEMFS_FILE_NODE_MAP *FileNodeMap, PWSTR FileName)
+VOID MemfsFileNodeMapLookupRelease(MEMFS_FILE_NODE_MAP *FileNodeMap,
+    MEMFS_FILE_NODE *FileNode, MEMFS_FILE_NODE *ParentNode)
 {
-    MEMFS_FILE_NODE_MAP::iterator iter = FileNodeMap->find(FileName);
-    if (iter == FileNodeMap->end())
-        return 0;
-    return iter->second;
+    if (0 != FileNode)
+        MemfsFileNodeDereference(FileNodeMap, FileNode);
+    if (0 != ParentNode)
+        MemfsFileNodeDereference(FileNodeMap, ParentNode);
 }
 
 static inline
-MEMFS_FILE_NODE *MemfsFileNodeMapGetParent(MEMFS_FILE_NODE_MAP *FileNodeMap, PWSTR FileName0,
-    PNTSTATUS PResult)
+MEMFS_FILE_NODE *MemfsFileNodeMapGetNodeParent(MEMFS_FILE_NODE_MAP *FileNodeMap,
+    MEMFS_FILE_NODE *FileNode)
 {
-    WCHAR Root[2] = L"\\";
-    PWSTR Remain, Suffix;
-    WCHAR FileName[MAX_PATH];
-    wcscpy_s(FileName, sizeof FileName / sizeof(WCHAR), FileName0);
-    FspPathSuffix(FileName, &Remain, &Suffix, Root);
-    MEMFS_FILE_NODE_MAP::iterator iter = FileNodeMap->find(Remain);
-    FspPathCombine(FileName, Suffix);
-    if (iter == FileNodeMap->end())
+    /* the root is its own parent; nodes removed from the map have no parent */
+    return FileNodeMap->RootNode == FileNode ? FileNode : FileNode->Parent;
+}
+
+static inline
+BOOLEAN MemfsFileNodeMapIsAttached(MEMFS_FILE_NODE_MAP *FileNodeMap, MEMFS_FILE_NODE *FileNode)
+{
+    return FileNodeMap->RootNode == FileNode || 0 != FileNode->Parent;
+}
+
+static inline
+MEMFS_INDEX_STRIPE *MemfsFileNodeMapIndexStripe(MEMFS_FILE_NODE_MAP *FileNodeMap,
+    UINT64 IndexNumber)
+{
+    return &FileNodeMap->IndexStripes[IndexNumber % MEMFS_INDEX_STRIPE_COUNT];
+}
+
+/*
+ * Insert a node below ParentNode, which the caller must hold locked exclusive. A ParentNode
+ * of 0 inserts the root.
+ */
+static inline
+NTSTATUS MemfsFileNodeMapInsert(MEMFS_FILE_NODE_MAP *FileNodeMap,
+    MEMFS_FILE_NODE *ParentNode, MEMFS_FILE_NODE *FileNode,
+    PBOOLEAN PInserted)
+{
+    MEMFS_INDEX_STRIPE *Stripe =
+        MemfsFileNodeMapIndexStripe(FileNodeMap, FileNode->FileInfo.IndexNumber);
+    NTSTATUS Result = STATUS_SUCCESS;
+
+    *PInserted = 0;
+
+    try
     {
-        *PResult = STATUS_OBJECT_PATH_NOT_FOUND;
-        return 0;
+        if (0 == ParentNode)
+        {
+            if (0 != FileNodeMap->RootNode)
+                return STATUS_SUCCESS;
+        }
+        else
+        {
+            if (0 == ParentNode->Children)
+                ParentNode->Children = new MEMFS_FILE_NODE_CHILD_MAP;
+            if (!ParentNode->Children->insert(
+                MEMFS_FILE_NODE_CHILD_MAP::value_type(FileNode->FileName, FileNode)).second)
+                return STATUS_SUCCESS;
+        }
     }
-    if (0 == (iter->second->FileInfo.FileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+    catch (...)
     {
-        *PResult = STATUS_NOT_A_DIRECTORY;
-        return 0;
+        return STATUS_INSUFFICIENT_RESOURCES;
     }
-    return iter->second;
+
+    AcquireSRWLockExclusive(&Stripe->Lock);
+    try
+    {
+        Stripe->IndexMap.insert(std::make_pair(FileNode->FileInfo.IndexNumber, FileNode));
+    }
+    catch (...)
+    {
+        Result = STATUS_INSUFFICIENT_RESOURCES;
+    }
+    ReleaseSRWLockExclusive(&Stripe->Lock);
+
+    if (!NT_SUCCESS(Result))
+    {
+        if (0 != ParentNode)
+            ParentNode->Children->erase(FileNode->FileName);
+        return Result;
+    }
+
+    if (0 == ParentNode)
+        FileNodeMap->RootNode = FileNode;
+    else
+        FileNode->Parent = ParentNode;
+    InterlockedIncrement(&FileNodeMap->Count);
+    MemfsFileNodeReference(FileNode);
+    *PInserted = 1;
+
+    return STATUS_SUCCESS;
+}
+
+/*
+ * Remove a node from the map. The caller must hold the node and its parent locked exclusive.
+ * On TRUE return the caller owns the reference of the map and must release it once the node
+ * is unlocked.
+ */
+static inline
+BOOLEAN MemfsFileNodeMapRemove(MEMFS_FILE_NODE_MAP *FileNodeMap, MEMFS_FILE_NODE *FileNode)
+{
+    MEMFS_INDEX_STRIPE *Stripe =
+        MemfsFileNodeMapIndexStripe(FileNodeMap, FileNode->FileInfo.IndexNumber);
+
+    if (0 == FileNode->Parent)
+        return FALSE; /* already removed (e.g. replaced by a rename) */
+
+    FileNode->Parent->Children->erase(FileNode->FileName);
+    FileNode->Parent = 0;
+
+    AcquireSRWLockExclusive(&Stripe->Lock);
+    Stripe->IndexMap.erase(FileNode->FileInfo.IndexNumber);
+    ReleaseSRWLockExclusive(&Stripe->Lock);
+
+    InterlockedDecrement(&FileNodeMap->Count);
+
+    return TRUE;
 }
 
+/*
+ * Move a node below NewParentNode under a new name. The caller must hold the node as well
+ * as its old and new parents locked exclusive. Returns the old name, which the caller must
+ * release.
+ */
 static inline
-NTSTATUS MemfsFileNodeMapInsert(MEMFS_FILE_NODE_MAP *FileNodeMap, MEMFS_FILE_NODE *FileNode,
-    PBOOLEAN PInserted)
+PWSTR MemfsFileNodeMapMove(MEMFS_FILE_NODE_MAP *FileNodeMap, MEMFS_FILE_NODE *FileNode,
+    MEMFS_FILE_NODE *NewParentNode, PWSTR NewFileName)
 {
-    *PInserted = 0;
+    PWSTR FileName = FileNode->FileName;
+
+    FileNode->Parent->Children->erase(FileName);
+    FileNode->FileName = NewFileName;
     try
     {
-        *PInserted = FileNodeMap->insert(MEMFS_FILE_NODE_MAP::value_type(FileNode->FileName, FileNode)).second;
-        if (*PInserted)
-            FileNode->RefCount++;
-        return STATUS_SUCCESS;
+        if (0 == NewParentNode->Children)
+            NewParentNode->Children = new MEMFS_FILE_NODE_CHILD_MAP;
+        NewParentNode->Children->insert(
+            MEMFS_FILE_NODE_CHILD_MAP::value_type(FileNode->FileName, FileNode));
     }
     catch (...)
     {
-        return STATUS_INSUFFICIENT_RESOURCES;
+        FspDebugLog(__FUNCTION__ ": cannot insert into FileNodeMap; aborting\n");
+        abort();
     }
+    FileNode->Parent = NewParentNode;
+
+    return FileName;
 }
 
 static inline
-VOID MemfsFileNodeMapRemove(MEMFS_FILE_NODE_MAP *FileNodeMap, MEMFS_FILE_NODE *FileNode)
+BOOLEAN MemfsFileNodeMapIsAncestor(MEMFS_FILE_NODE_MAP *FileNodeMap,
+    MEMFS_FILE_NODE *AncestorNode, MEMFS_FILE_NODE *FileNode)
 {
-    --FileNode->RefCount;
-    FileNodeMap->erase(FileNode->FileName);
+    /* stable only while holding the RenameLock */
+    for (; 0 != FileNode; FileNode = FileNode->Parent)
+        if (AncestorNode == FileNode)
+            return TRUE;
+    return FALSE;
 }
 
 static inline
 BOOLEAN MemfsFileNodeMapHasChild(MEMFS_FILE_NODE_MAP *FileNodeMap, MEMFS_FILE_NODE *FileNode)
 {
-    BOOLEAN Result;
-    WCHAR Root[2] = L"\\";
-    PWSTR Remain, Suffix;
-    MEMFS_FILE_NODE_MAP::iterator iter = FileNodeMap->upper_bound(FileNode->FileName);
-    if (iter == FileNodeMap->end())
-        return FALSE;
-    FspPathSuffix(iter->second->FileName, &Remain, &Suffix, Root);
-    Result = 0 == MemfsFileNameCompare(Remain, FileNode->FileName);
-    FspPathCombine(iter->second->FileName, Suffix);
-    return Result;
+    return 0 != FileNode->Children && !FileNode->Children->empty();
 }
 
 static inline
 BOOLEAN MemfsFileNodeMapEnumerateChildren(MEMFS_FILE_NODE_MAP *FileNodeMap, MEMFS_FILE_NODE *FileNode,
-    BOOLEAN (*EnumFn)(MEMFS_FILE_NODE *, PVOID), PVOID Context)
+    PWSTR Marker, BOOLEAN (*EnumFn)(MEMFS_FILE_NODE *, PVOID), PVOID Context)
 {
-    WCHAR Root[2] = L"\\";
-    PWSTR Remain, Suffix;
-    MEMFS_FILE_NODE_MAP::iterator iter = FileNodeMap->upper_bound(FileNode->FileName);
-    BOOLEAN Equal;
-    for (; FileNodeMap->end() != iter; ++iter)
-    {
-        if (!MemfsFileNameHasPrefix(iter->second->FileName, FileNode->FileName))
-            break;
-        FspPathSuffix(iter->second->FileName, &Remain, &Suffix, Root);
-        Equal = 0 == MemfsFileNameCompare(Remain, FileNode->FileName);
-        FspPathCombine(iter->second->FileName, Suffix);
-        if (Equal)
-        {
-            if (!EnumFn(iter->second, Context))
-                return FALSE;
-        }
-    }
+    if (0 == FileNode->Children)
+        return TRUE;
+    MEMFS_FILE_NODE_CHILD_MAP::iterator iter = 0 != Marker ?
+        FileNode->Children->upper_bound(Marker) : FileNode->Children->begin();
+    for (; FileNode->Children->end() != iter; ++iter)
+        if (!EnumFn(iter->second, Context))
+            return FALSE;
     return TRUE;
 }
 
+/*
+ * Get a child of ParentNode by index number. The caller must hold ParentNode locked.
+ */
 static inline
-BOOLEAN MemfsFileNodeMapEnumerateDescendants(MEMFS_FILE_NODE_MAP *FileNodeMap, MEMFS_FILE_NODE *FileNode,
-    BOOLEAN (*EnumFn)(MEMFS_FILE_NODE *, PVOID), PVOID Context)
+MEMFS_FILE_NODE *MemfsFileNodeMapGetChildByIndexNumber(MEMFS_FILE_NODE_MAP *FileNodeMap,
+    MEMFS_FILE_NODE *ParentNode, UINT64 IndexNumber)
 {
-    WCHAR Root[2] = L"\\";
-    MEMFS_FILE_NODE_MAP::iterator iter = FileNodeMap->lower_bound(FileNode->FileName);
-    for (; FileNodeMap->end() != iter; ++iter)
-    {
-        if (!MemfsFileNameHasPrefix(iter->second->FileName, FileNode->FileName))
-            break;
-        if (!EnumFn(iter->second, Context))
-            return FALSE;
-    }
-    return TRUE;
+    MEMFS_INDEX_STRIPE *Stripe = MemfsFileNodeMapIndexStripe(FileNodeMap, IndexNumber);
+    MEMFS_FILE_NODE *FileNode = 0;
+
+    AcquireSRWLockShared(&Stripe->Lock);
+    std::unordered_map<UINT64, MEMFS_FILE_NODE *>::iterator iter =
+        Stripe->IndexMap.find(IndexNumber);
+    if (Stripe->IndexMap.end() != iter && ParentNode == iter->second->Parent)
+        FileNode = iter->second;
+    ReleaseSRWLockShared(&Stripe->Lock);
+
+    return FileNode;
 }
 
-static NTSTATUS SetFileSize(FSP_FILE_SYSTEM *FileSystem,
-    FSP_FSCTL_TRANSACT_REQ *Request,
-    PVOID FileNode0, UINT64 NewSize, BOOLEAN SetAllocationSize,
-    FSP_FSCTL_FILE_INFO *FileInfo);
+
+static NTSTATUS MemfsFileNodeSetFileSize(MEMFS *Memfs, MEMFS_FILE_NODE *FileNode,
+    UINT64 NewSize, BOOLEAN SetAllocationSize);
 
 static NTSTATUS GetVolumeInfo(FSP_FILE_SYSTEM *FileSystem,
     FSP_FSCTL_TRANSACT_REQ *Request,
@@ -285,8 +951,10 @@ static NTSTATUS GetVolumeInfo(FSP_FILE_SYSTEM *FileSystem,
     VolumeInfo->TotalSize = Memfs->MaxFileNodes * (UINT64)Memfs->MaxFileSize;
     VolumeInfo->FreeSize = (Memfs->MaxFileNodes - MemfsFileNodeMapCount(Memfs->FileNodeMap)) *
         (UINT64)Memfs->MaxFileSize;
+    AcquireSRWLockShared(&Memfs->VolumeLabelLock);
     VolumeInfo->VolumeLabelLength = Memfs->VolumeLabelLength;
     memcpy(VolumeInfo->VolumeLabel, Memfs->VolumeLabel, Memfs->VolumeLabelLength);
+    ReleaseSRWLockShared(&Memfs->VolumeLabelLock);
 
     return STATUS_SUCCESS;
 }
@@ -298,6 +966,7 @@ static NTSTATUS SetVolumeLabel(FSP_FILE_SYSTEM *FileSystem,
 {
     MEMFS *Memfs = (MEMFS *)FileSystem->UserContext;
 
+    AcquireSRWLockExclusive(&Memfs->VolumeLabelLock);
     Memfs->VolumeLabelLength = (UINT16)(wcslen(VolumeLabel) * sizeof(WCHAR));
     if (Memfs->VolumeLabelLength > sizeof Memfs->VolumeLabel)
         Memfs->VolumeLabelLength = sizeof Memfs->VolumeLabel;
@@ -308,6 +977,7 @@ static NTSTATUS SetVolumeLabel(FSP_FILE_SYSTEM *FileSystem,
         (Memfs->MaxFileNodes - MemfsFileNodeMapCount(Memfs->FileNodeMap)) * Memfs->MaxFileSize;
     VolumeInfo->VolumeLabelLength = Memfs->VolumeLabelLength;
     memcpy(VolumeInfo->VolumeLabel, Memfs->VolumeLabel, Memfs->VolumeLabelLength);
+    ReleaseSRWLockExclusive(&Memfs->VolumeLabelLock);
 
     return STATUS_SUCCESS;
 }
@@ -317,34 +987,39 @@ static NTSTATUS GetSecurityByName(FSP_FILE_SYSTEM *FileSystem,
     PSECURITY_DESCRIPTOR SecurityDescriptor, SIZE_T *PSecurityDescriptorSize)
 {
     MEMFS *Memfs = (MEMFS *)FileSystem->UserContext;
-    MEMFS_FILE_NODE *FileNode;
+    MEMFS_FILE_NODE *FileNode, *ParentNode;
     NTSTATUS Result;
 
-    FileNode = MemfsFileNodeMapGet(Memfs->FileNodeMap, FileName);
+    FileNode = MemfsFileNodeMapLookup(Memfs->FileNodeMap, FileName, &ParentNode);
     if (0 == FileNode)
     {
-        Result = STATUS_OBJECT_NAME_NOT_FOUND;
-        MemfsFileNodeMapGetParent(Memfs->FileNodeMap, FileName, &Result);
-        return Result;
+        Result = MemfsFileNodeMapParentResult(ParentNode, STATUS_OBJECT_NAME_NOT_FOUND);
+        goto exit;
     }
 
+    AcquireSRWLockShared(&FileNode->Lock);
+
     if (0 != PFileAttributes)
         *PFileAttributes = FileNode->FileInfo.FileAttributes;
 
+    Result = STATUS_SUCCESS;
     if (0 != PSecurityDescriptorSize)
     {
-        if (FileNode->FileSecuritySize > *PSecurityDescriptorSize)
-        {
-            *PSecurityDescriptorSize = FileNode->FileSecuritySize;
-            return STATUS_BUFFER_OVERFLOW;
-        }
+        SIZE_T FileSecuritySize = MemfsBlobSize(FileNode->FileSecurity);
 
-        *PSecurityDescriptorSize = FileNode->FileSecuritySize;
-        if (0 != SecurityDescriptor)
-            memcpy(SecurityDescriptor, FileNode->FileSecurity, FileNode->FileSecuritySize);
+        if (FileSecuritySize > *PSecurityDescriptorSize)
+            Result = STATUS_BUFFER_OVERFLOW;
+        else if (0 != SecurityDescriptor)
+            memcpy(SecurityDescriptor, FileNode->FileSecurity, FileSecuritySize);
+        *PSecurityDescriptorSize = FileSecuritySize;
     }
 
-    return STATUS_SUCCESS;
+    ReleaseSRWLockShared(&FileNode->Lock);
+
+exit:
+    MemfsFileNodeMapLookupRelease(Memfs->FileNodeMap, FileNode, ParentNode);
+
+    return Result;
 }
 
 static NTSTATUS Create(FSP_FILE_SYSTEM *FileSystem,
@@ -354,70 +1029,90 @@ static NTSTATUS Create(FSP_FILE_SYSTEM *FileSystem,
     PVOID *PFileNode, FSP_FSCTL_FILE_INFO *FileInfo)
 {
     MEMFS *Memfs = (MEMFS *)FileSystem->UserContext;
-    MEMFS_FILE_NODE *FileNode;
+    MEMFS_FILE_NODE *FileNode, *ParentNode;
+    WCHAR Root[2] = L"\\";
+    PWSTR Remain, Suffix;
     NTSTATUS Result;
     BOOLEAN Inserted;
 
     if (CreateOptions & FILE_DIRECTORY_FILE)
         AllocationSize = 0;
 
-    FileNode = MemfsFileNodeMapGet(Memfs->FileNodeMap, FileName);
+    FileNode = MemfsFileNodeMapLookup(Memfs->FileNodeMap, FileName, &ParentNode);
     if (0 != FileNode)
+    {
+        MemfsFileNodeMapLookupRelease(Memfs->FileNodeMap, FileNode, ParentNode);
         return STATUS_OBJECT_NAME_COLLISION;
+    }
 
-    if (!MemfsFileNodeMapGetParent(Memfs->FileNodeMap, FileName, &Result))
-        return Result;
+    Result = MemfsFileNodeMapParentResult(ParentNode, STATUS_SUCCESS);
+    if (!NT_SUCCESS(Result))
+        goto exit;
 
     if (MemfsFileNodeMapCount(Memfs->FileNodeMap) >= Memfs->MaxFileNodes)
-        return STATUS_CANNOT_MAKE;
+    {
+        Result = STATUS_CANNOT_MAKE;
+        goto exit;
+    }
 
     if (AllocationSize > Memfs->MaxFileSize)
-        return STATUS_DISK_FULL;
+    {
+        Result = STATUS_DISK_FULL;
+        goto exit;
+    }
 
-    Result = MemfsFileNodeCreate(FileName, &FileNode);
+    FspPathSuffix(FileName, &Remain, &Suffix, Root);
+    Result = MemfsFileNodeCreate(Memfs->FileNodeMap, Suffix, &FileNode);
+    FspPathCombine(FileName, Suffix);
     if (!NT_SUCCESS(Result))
-        return Result;
+        goto exit;
 
     FileNode->FileInfo.FileAttributes = (FileAttributes & FILE_ATTRIBUTE_DIRECTORY) ?
         FileAttributes : FileAttributes | FILE_ATTRIBUTE_ARCHIVE;
 
-    if (0 != SecurityDescriptor)
+    Result = MemfsFileNodeSetSecurity(Memfs->FileNodeMap, FileNode, SecurityDescriptor);
+    if (!NT_SUCCESS(Result))
     {
-        FileNode->FileSecuritySize = GetSecurityDescriptorLength(SecurityDescriptor);
-        FileNode->FileSecurity = (PSECURITY_DESCRIPTOR)malloc(FileNode->FileSecuritySize);
-        if (0 == FileNode->FileSecurity)
-        {
-            MemfsFileNodeDelete(FileNode);
-            return STATUS_INSUFFICIENT_RESOURCES;
-        }
-        memcpy(FileNode->FileSecurity, SecurityDescriptor, FileNode->FileSecuritySize);
+        MemfsFileNodeDelete(Memfs->FileNodeMap, FileNode);
+        goto exit;
     }
 
     FileNode->FileInfo.AllocationSize = AllocationSize;
-    if (0 != FileNode->FileInfo.AllocationSize)
+    Result = MemfsFileNodeSetPageCount(FileNode, AllocationSize);
+    if (!NT_SUCCESS(Result))
     {
-        FileNode->FileData = malloc((size_t)FileNode->FileInfo.AllocationSize);
-        if (0 == FileNode->FileData)
-        {
-            MemfsFileNodeDelete(FileNode);
-            return STATUS_INSUFFICIENT_RESOURCES;
-        }
+        MemfsFileNodeDelete(Memfs->FileNodeMap, FileNode);
+        goto exit;
+    }
+
+    AcquireSRWLockExclusive(&ParentNode->Lock);
+    if (MemfsFileNodeMapIsAttached(Memfs->FileNodeMap, ParentNode))
+        Result = MemfsFileNodeMapInsert(Memfs->FileNodeMap, ParentNode, FileNode, &Inserted);
+    else
+    {
+        /* the parent directory was deleted after the lookup */
+        Result = STATUS_OBJECT_PATH_NOT_FOUND;
+        Inserted = FALSE;
     }
+    if (NT_SUCCESS(Result) && Inserted)
+    {
+        MemfsFileNodeReference(FileNode);
+        *PFileNode = FileNode;
+        *FileInfo = FileNode->FileInfo;
+    }
+    ReleaseSRWLockExclusive(&ParentNode->Lock);
 
-    Result = MemfsFileNodeMapInsert(Memfs->FileNodeMap, FileNode, &Inserted);
     if (!NT_SUCCESS(Result) || !Inserted)
     {
-        MemfsFileNodeDelete(FileNode);
+        MemfsFileNodeDelete(Memfs->FileNodeMap, FileNode);
         if (NT_SUCCESS(Result))
-            Result = STATUS_OBJECT_NAME_COLLISION; /* should not happen! */
-        return Result;
+            Result = STATUS_OBJECT_NAME_COLLISION; /* created by a concurrent Create */
     }
 
-    FileNode->RefCount++;
-    *PFileNode = FileNode;
-    *FileInfo = FileNode->FileInfo;
+exit:
+    MemfsFileNodeMapLookupRelease(Memfs->FileNodeMap, 0, ParentNode);
 
-    return STATUS_SUCCESS;
+    return Result;
 }
 
 static NTSTATUS Open(FSP_FILE_SYSTEM *FileSystem,
@@ -426,16 +1121,19 @@ static NTSTATUS Open(FSP_FILE_SYSTEM *FileSystem,
     PVOID *PFileNode, FSP_FSCTL_FILE_INFO *FileInfo)
 {
     MEMFS *Memfs = (MEMFS *)FileSystem->UserContext;
-    MEMFS_FILE_NODE *FileNode;
+    MEMFS_FILE_NODE *FileNode, *ParentNode;
     NTSTATUS Result;
 
-    FileNode = MemfsFileNodeMapGet(Memfs->FileNodeMap, FileName);
+    FileNode = MemfsFileNodeMapLookup(Memfs->FileNodeMap, FileName, &ParentNode);
     if (0 == FileNode)
     {
-        Result = STATUS_OBJECT_NAME_NOT_FOUND;
-        MemfsFileNodeMapGetParent(Memfs->FileNodeMap, FileName, &Result);
+        Result = MemfsFileNodeMapParentResult(ParentNode, STATUS_OBJECT_NAME_NOT_FOUND);
+        MemfsFileNodeMapLookupRelease(Memfs->FileNodeMap, 0, ParentNode);
         return Result;
     }
+    MemfsFileNodeDereference(Memfs->FileNodeMap, ParentNode);
+
+    AcquireSRWLockExclusive(&FileNode->Lock);
 
     /*
      * NTFS and FastFat do this at Cleanup time, but we are going to cheat.
@@ -451,10 +1149,13 @@ static NTSTATUS Open(FSP_FILE_SYSTEM *FileSystem,
         Request->Req.Create.DesiredAccess & (FILE_WRITE_DATA | FILE_APPEND_DATA))
         FileNode->FileInfo.FileAttributes |= FILE_ATTRIBUTE_ARCHIVE;
 
-    FileNode->RefCount++;
-    *PFileNode = FileNode;
     *FileInfo = FileNode->FileInfo;
 
+    ReleaseSRWLockExclusive(&FileNode->Lock);
+
+    /* the reference from the lookup becomes the reference of the open file */
+    *PFileNode = FileNode;
+
     return STATUS_SUCCESS;
 }
 
@@ -463,20 +1164,24 @@ NTSTATUS Overwrite(FSP_FILE_SYSTEM *FileSystem,
     PVOID FileNode0, UINT32 FileAttributes, BOOLEAN ReplaceFileAttributes,
     FSP_FSCTL_FILE_INFO *FileInfo)
 {
-    MEMFS *Memfs = (MEMFS *)FileSystem->UserContext;
     MEMFS_FILE_NODE *FileNode = (MEMFS_FILE_NODE *)FileNode0;
 
+    AcquireSRWLockExclusive(&FileNode->Lock);
+
     if (ReplaceFileAttributes)
         FileNode->FileInfo.FileAttributes = FileAttributes | FILE_ATTRIBUTE_ARCHIVE;
     else
         FileNode->FileInfo.FileAttributes |= FileAttributes | FILE_ATTRIBUTE_ARCHIVE;
 
+    MemfsFileNodeTruncateData(FileNode, FileNode->FileInfo.FileSize, 0);
     FileNode->FileInfo.FileSize = 0;
     FileNode->FileInfo.LastWriteTime =
     FileNode->FileInfo.LastAccessTime = MemfsGetSystemTime();
 
     *FileInfo = FileNode->FileInfo;
 
+    ReleaseSRWLockExclusive(&FileNode->Lock);
+
     return STATUS_SUCCESS;
 }
 
@@ -486,11 +1191,37 @@ static VOID Cleanup(FSP_FILE_SYSTEM *FileSystem,
 {
     MEMFS *Memfs = (MEMFS *)FileSystem->UserContext;
     MEMFS_FILE_NODE *FileNode = (MEMFS_FILE_NODE *)FileNode0;
+    MEMFS_FILE_NODE *ParentNode;
+    BOOLEAN Removed = FALSE;
+
+    if (!Delete)
+        return;
+
+    AcquireSRWLockShared(&Memfs->FileNodeMap->RenameLock);
+
+    AcquireSRWLockShared(&FileNode->Lock);
+    assert(0 == FileName || MemfsFileNodeHasName(FileNode, FileName));
+    ParentNode = FileNode->Parent;
+    if (0 != ParentNode)
+        MemfsFileNodeReference(ParentNode);
+    ReleaseSRWLockShared(&FileNode->Lock);
+
+    if (0 != ParentNode)
+    {
+        AcquireSRWLockExclusive(&ParentNode->Lock);
+        AcquireSRWLockExclusive(&FileNode->Lock);
+        if (ParentNode == FileNode->Parent &&
+            !MemfsFileNodeMapHasChild(Memfs->FileNodeMap, FileNode))
+            Removed = MemfsFileNodeMapRemove(Memfs->FileNodeMap, FileNode);
+        ReleaseSRWLockExclusive(&FileNode->Lock);
+        ReleaseSRWLockExclusive(&ParentNode->Lock);
+        MemfsFileNodeDereference(Memfs->FileNodeMap, ParentNode);
+    }
 
-    assert(0 == FileName || 0 == wcscmp(FileNode->FileName, FileName));
+    ReleaseSRWLockShared(&Memfs->FileNodeMap->RenameLock);
 
-    if (Delete && !MemfsFileNodeMapHasChild(Memfs->FileNodeMap, FileNode))
-        MemfsFileNodeMapRemove(Memfs->FileNodeMap, FileNode);
+    if (Removed)
+        MemfsFileNodeDereference(Memfs->FileNodeMap, FileNode);
 }
 
 static VOID Close(FSP_FILE_SYSTEM *FileSystem,
@@ -500,8 +1231,7 @@ static VOID Close(FSP_FILE_SYSTEM *FileSystem,
     MEMFS *Memfs = (MEMFS *)FileSystem->UserContext;
     MEMFS_FILE_NODE *FileNode = (MEMFS_FILE_NODE *)FileNode0;
 
-    if (0 == --FileNode->RefCount)
-        MemfsFileNodeDelete(FileNode);
+    MemfsFileNodeDereference(Memfs->FileNodeMap, FileNode);
 }
 
 static NTSTATUS Read(FSP_FILE_SYSTEM *FileSystem,
@@ -512,14 +1242,21 @@ static NTSTATUS Read(FSP_FILE_SYSTEM *FileSystem,
     MEMFS_FILE_NODE *FileNode = (MEMFS_FILE_NODE *)FileNode0;
     UINT64 EndOffset;
 
+    AcquireSRWLockShared(&FileNode->Lock);
+
     if (Offset >= FileNode->FileInfo.FileSize)
+    {
+        ReleaseSRWLockShared(&FileNode->Lock);
         return STATUS_END_OF_FILE;
+    }
 
     EndOffset = Offset + Length;
     if (EndOffset > FileNode->FileInfo.FileSize)
         EndOffset = FileNode->FileInfo.FileSize;
 
-    memcpy(Buffer, (PUINT8)FileNode->FileData + Offset, (size_t)(EndOffset - Offset));
+    MemfsFileNodeReadData(FileNode, Buffer, Offset, (ULONG)(EndOffset - Offset));
+
+    ReleaseSRWLockShared(&FileNode->Lock);
 
     *PBytesTransferred = (ULONG)(EndOffset - Offset);
 
@@ -547,13 +1284,20 @@ static NTSTATUS Write(FSP_FILE_SYSTEM *FileSystem,
         }
 #endif
 
+    MEMFS *Memfs = (MEMFS *)FileSystem->UserContext;
     MEMFS_FILE_NODE *FileNode = (MEMFS_FILE_NODE *)FileNode0;
     UINT64 EndOffset;
+    NTSTATUS Result;
+
+    AcquireSRWLockExclusive(&FileNode->Lock);
 
     if (ConstrainedIo)
     {
         if (Offset >= FileNode->FileInfo.FileSize)
-            return STATUS_SUCCESS;
+        {
+            Result = STATUS_SUCCESS;
+            goto exit;
+        }
         EndOffset = Offset + Length;
         if (EndOffset > FileNode->FileInfo.FileSize)
             EndOffset = FileNode->FileInfo.FileSize;
@@ -564,15 +1308,24 @@ static NTSTATUS Write(FSP_FILE_SYSTEM *FileSystem,
             Offset = FileNode->FileInfo.FileSize;
         EndOffset = Offset + Length;
         if (EndOffset > FileNode->FileInfo.FileSize)
-            SetFileSize(FileSystem, Request, FileNode, EndOffset, FALSE, FileInfo);
+        {
+            Result = MemfsFileNodeSetFileSize(Memfs, FileNode, EndOffset, FALSE);
+            if (!NT_SUCCESS(Result))
+                goto exit;
+        }
     }
 
-    memcpy((PUINT8)FileNode->FileData + Offset, Buffer, (size_t)(EndOffset - Offset));
+    Result = MemfsFileNodeWriteData(FileNode, Buffer, Offset, (ULONG)(EndOffset - Offset));
+    if (!NT_SUCCESS(Result))
+        goto exit;
 
     *PBytesTransferred = (ULONG)(EndOffset - Offset);
     *FileInfo = FileNode->FileInfo;
 
-    return STATUS_SUCCESS;
+exit:
+    ReleaseSRWLockExclusive(&FileNode->Lock);
+
+    return Result;
 }
 
 NTSTATUS Flush(FSP_FILE_SYSTEM *FileSystem,
@@ -590,7 +1343,9 @@ static NTSTATUS GetFileInfo(FSP_FILE_SYSTEM *FileSystem,
 {
     MEMFS_FILE_NODE *FileNode = (MEMFS_FILE_NODE *)FileNode0;
 
+    AcquireSRWLockShared(&FileNode->Lock);
     *FileInfo = FileNode->FileInfo;
+    ReleaseSRWLockShared(&FileNode->Lock);
 
     return STATUS_SUCCESS;
 }
@@ -603,6 +1358,8 @@ static NTSTATUS SetBasicInfo(FSP_FILE_SYSTEM *FileSystem,
 {
     MEMFS_FILE_NODE *FileNode = (MEMFS_FILE_NODE *)FileNode0;
 
+    AcquireSRWLockExclusive(&FileNode->Lock);
+
     if (INVALID_FILE_ATTRIBUTES != FileAttributes)
         FileNode->FileInfo.FileAttributes = FileAttributes;
     if (0 != CreationTime)
@@ -614,17 +1371,14 @@ static NTSTATUS SetBasicInfo(FSP_FILE_SYSTEM *FileSystem,
 
     *FileInfo = FileNode->FileInfo;
 
+    ReleaseSRWLockExclusive(&FileNode->Lock);
+
     return STATUS_SUCCESS;
 }
 
-static NTSTATUS SetFileSize(FSP_FILE_SYSTEM *FileSystem,
-    FSP_FSCTL_TRANSACT_REQ *Request,
-    PVOID FileNode0, UINT64 NewSize, BOOLEAN SetAllocationSize,
-    FSP_FSCTL_FILE_INFO *FileInfo)
+static NTSTATUS MemfsFileNodeSetFileSize(MEMFS *Memfs, MEMFS_FILE_NODE *FileNode,
+    UINT64 NewSize, BOOLEAN SetAllocationSize)
 {
-    MEMFS *Memfs = (MEMFS *)FileSystem->UserContext;
-    MEMFS_FILE_NODE *FileNode = (MEMFS_FILE_NODE *)FileNode0;
-
     if (SetAllocationSize)
     {
         if (FileNode->FileInfo.AllocationSize != NewSize)
@@ -632,15 +1386,17 @@ static NTSTATUS SetFileSize(FSP_FILE_SYSTEM *FileSystem,
             if (NewSize > Memfs->MaxFileSize)
                 return STATUS_DISK_FULL;
 
-            PVOID FileData = realloc(FileNode->FileData, (size_t)NewSize);
-            if (0 == FileData && 0 != NewSize)
-                return STATUS_INSUFFICIENT_RESOURCES;
+            if (FileNode->FileInfo.FileSize > NewSize)
+            {
+                MemfsFileNodeTruncateData(FileNode, FileNode->FileInfo.FileSize, NewSize);
+                FileNode->FileInfo.FileSize = NewSize;
+            }
 
-            FileNode->FileData = FileData;
+            NTSTATUS Result = MemfsFileNodeSetPageCount(FileNode, NewSize);
+            if (!NT_SUCCESS(Result))
+                return Result;
 
             FileNode->FileInfo.AllocationSize = NewSize;
-            if (FileNode->FileInfo.FileSize > NewSize)
-                FileNode->FileInfo.FileSize = NewSize;
         }
     }
     else
@@ -652,53 +1408,58 @@ static NTSTATUS SetFileSize(FSP_FILE_SYSTEM *FileSystem,
                 UINT64 AllocationUnit = MEMFS_SECTOR_SIZE * MEMFS_SECTORS_PER_ALLOCATION_UNIT;
                 UINT64 AllocationSize = (NewSize + AllocationUnit - 1) / AllocationUnit * AllocationUnit;
 
-                NTSTATUS Result = SetFileSize(FileSystem, Request, FileNode, AllocationSize, TRUE,
-                    FileInfo);
+                NTSTATUS Result = MemfsFileNodeSetFileSize(Memfs, FileNode, AllocationSize, TRUE);
                 if (!NT_SUCCESS(Result))
                     return Result;
             }
 
-            if (FileNode->FileInfo.FileSize < NewSize)
-                memset((PUINT8)FileNode->FileData + FileNode->FileInfo.FileSize, 0,
-                    (size_t)(NewSize - FileNode->FileInfo.FileSize));
+            if (FileNode->FileInfo.FileSize > NewSize)
+                MemfsFileNodeTruncateData(FileNode, FileNode->FileInfo.FileSize, NewSize);
             FileNode->FileInfo.FileSize = NewSize;
         }
     }
 
-    *FileInfo = FileNode->FileInfo;
-
     return STATUS_SUCCESS;
 }
 
-static NTSTATUS CanDelete(FSP_FILE_SYSTEM *FileSystem,
+static NTSTATUS SetFileSize(FSP_FILE_SYSTEM *FileSystem,
     FSP_FSCTL_TRANSACT_REQ *Request,
-    PVOID FileNode0, PWSTR FileName)
+    PVOID FileNode0, UINT64 NewSize, BOOLEAN SetAllocationSize,
+    FSP_FSCTL_FILE_INFO *FileInfo)
 {
     MEMFS *Memfs = (MEMFS *)FileSystem->UserContext;
     MEMFS_FILE_NODE *FileNode = (MEMFS_FILE_NODE *)FileNode0;
+    NTSTATUS Result;
 
-    assert(0 == FileName || 0 == wcscmp(FileNode->FileName, FileName));
+    AcquireSRWLockExclusive(&FileNode->Lock);
 
-    if (MemfsFileNodeMapHasChild(Memfs->FileNodeMap, FileNode))
-        return STATUS_DIRECTORY_NOT_EMPTY;
+    Result = MemfsFileNodeSetFileSize(Memfs, FileNode, NewSize, SetAllocationSize);
+    if (NT_SUCCESS(Result))
+        *FileInfo = FileNode->FileInfo;
 
-    return STATUS_SUCCESS;
+    ReleaseSRWLockExclusive(&FileNode->Lock);
+
+    return Result;
 }
 
-typedef struct _MEMFS_RENAME_CONTEXT
+static NTSTATUS CanDelete(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FSCTL_TRANSACT_REQ *Request,
+    PVOID FileNode0, PWSTR FileName)
 {
-    MEMFS_FILE_NODE **FileNodes;
-    ULONG Count;
-} MEMFS_RENAME_CONTEXT;
+    MEMFS *Memfs = (MEMFS *)FileSystem->UserContext;
+    MEMFS_FILE_NODE *FileNode = (MEMFS_FILE_NODE *)FileNode0;
+    NTSTATUS Result = STATUS_SUCCESS;
 
-static BOOLEAN RenameEnumFn(MEMFS_FILE_NODE *FileNode, PVOID Context0)
-{
-    MEMFS_RENAME_CONTEXT *Context = (MEMFS_RENAME_CONTEXT *)Context0;
+    AcquireSRWLockShared(&FileNode->Lock);
 
-    Context->FileNodes[Context->Count++] = FileNode;
-    FileNode->RefCount++;
+    assert(0 == FileName || MemfsFileNodeHasName(FileNode, FileName));
 
-    return TRUE;
+    if (MemfsFileNodeMapHasChild(Memfs->FileNodeMap, FileNode))
+        Result = STATUS_DIRECTORY_NOT_EMPTY;
+
+    ReleaseSRWLockShared(&FileNode->Lock);
+
+    return Result;
 }
 
 static NTSTATUS Rename(FSP_FILE_SYSTEM *FileSystem,
@@ -708,86 +1469,119 @@ static NTSTATUS Rename(FSP_FILE_SYSTEM *FileSystem,
 {
     MEMFS *Memfs = (MEMFS *)FileSystem->UserContext;
     MEMFS_FILE_NODE *FileNode = (MEMFS_FILE_NODE *)FileNode0;
-    MEMFS_FILE_NODE *NewFileNode, *DescendantFileNode;
-    MEMFS_RENAME_CONTEXT Context = { 0 };
-    ULONG Index, FileNameLen, NewFileNameLen;
-    BOOLEAN Inserted;
+    MEMFS_FILE_NODE *ParentNode, *NewFileNode, *NewParentNode, *LockNode[2];
+    MEMFS_FILE_NODE_CHILD_MAP::iterator iter;
+    WCHAR Root[2] = L"\\";
+    PWSTR Remain, Suffix, NewName;
+    SIZE_T SuffixLength;
+    BOOLEAN Removed = FALSE;
     NTSTATUS Result;
 
-    assert(0 == FileName || 0 == wcscmp(FileNode->FileName, FileName));
+    FspPathSuffix(NewFileName, &Remain, &Suffix, Root);
+    SuffixLength = wcslen(Suffix);
+    if (MAX_PATH <= SuffixLength)
+    {
+        FspPathCombine(NewFileName, Suffix);
+        return STATUS_OBJECT_NAME_INVALID;
+    }
+    NewName = (PWSTR)MemfsBlobPoolIntern(&Memfs->FileNodeMap->FileNamePool,
+        Suffix, (SuffixLength + 1) * sizeof(WCHAR));
+    FspPathCombine(NewFileName, Suffix);
+    if (0 == NewName)
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    /* with the RenameLock held no node can change parents except through this rename */
+    AcquireSRWLockExclusive(&Memfs->FileNodeMap->RenameLock);
 
-    NewFileNode = MemfsFileNodeMapGet(Memfs->FileNodeMap, NewFileName);
-    if (0 != NewFileNode)
+    assert(0 == FileName || MemfsFileNodeHasName(FileNode, FileName));
+
+    NewFileNode = MemfsFileNodeMapLookup(Memfs->FileNodeMap, NewFileName, &NewParentNode);
+    if (FileNode == NewFileNode)
     {
-        if (!ReplaceIfExists)
-        {
-            Result = STATUS_OBJECT_NAME_COLLISION;
-            goto exit;
-        }
+        Result = STATUS_SUCCESS;
+        goto exit;
+    }
 
-        if (NewFileNode->FileInfo.FileAttributes & FILE_ATTRIBUTE_DIRECTORY)
-        {
-            Result = STATUS_ACCESS_DENIED;
-            goto exit;
-        }
+    Result = MemfsFileNodeMapParentResult(NewParentNode, STATUS_SUCCESS);
+    if (!NT_SUCCESS(Result))
+        goto exit;
+
+    ParentNode = FileNode->Parent;
+    if (0 == ParentNode || !MemfsFileNodeMapIsAttached(Memfs->FileNodeMap, NewParentNode))
+    {
+        Result = STATUS_OBJECT_PATH_NOT_FOUND;
+        goto exit;
     }
 
-    Context.FileNodes = (MEMFS_FILE_NODE **)malloc(Memfs->MaxFileNodes * sizeof Context.FileNodes[0]);
-    if (0 == Context.FileNodes)
+    /* a directory cannot be moved below itself */
+    if (MemfsFileNodeMapIsAncestor(Memfs->FileNodeMap, FileNode, NewParentNode))
     {
-        Result = STATUS_INSUFFICIENT_RESOURCES;
+        Result = STATUS_INVALID_PARAMETER;
         goto exit;
     }
 
-    MemfsFileNodeMapEnumerateDescendants(Memfs->FileNodeMap, FileNode, RenameEnumFn, &Context);
+    /* the lookup above may be stale; the target is looked up again with the new parent locked */
+    if (0 != NewFileNode)
+        MemfsFileNodeDereference(Memfs->FileNodeMap, NewFileNode);
+    NewFileNode = 0;
 
-    FileNameLen = (ULONG)wcslen(FileNode->FileName);
-    NewFileNameLen = (ULONG)wcslen(NewFileName);
-    for (Index = 0; Context.Count > Index; Index++)
+    /* lock the parents ancestor first (or in address order if unrelated), then the nodes */
+    if (MemfsFileNodeMapIsAncestor(Memfs->FileNodeMap, ParentNode, NewParentNode) ||
+        (!MemfsFileNodeMapIsAncestor(Memfs->FileNodeMap, NewParentNode, ParentNode) &&
+            ParentNode < NewParentNode))
     {
-        DescendantFileNode = Context.FileNodes[Index];
-        assert(MemfsFileNameHasPrefix(DescendantFileNode->FileName, FileNode->FileName));
-        if (MAX_PATH <= wcslen(DescendantFileNode->FileName) - FileNameLen + NewFileNameLen)
-        {
-            Result = STATUS_OBJECT_NAME_INVALID;
-            goto exit;
-        }
+        LockNode[0] = ParentNode;
+        LockNode[1] = NewParentNode;
+    }
+    else
+    {
+        LockNode[0] = NewParentNode;
+        LockNode[1] = ParentNode;
     }
+    AcquireSRWLockExclusive(&LockNode[0]->Lock);
+    if (LockNode[0] != LockNode[1])
+        AcquireSRWLockExclusive(&LockNode[1]->Lock);
 
-    if (0 != NewFileNode)
+    if (0 != NewParentNode->Children)
     {
-        NewFileNode->RefCount++;
-        MemfsFileNodeMapRemove(Memfs->FileNodeMap, NewFileNode);
-        if (0 == --NewFileNode->RefCount)
-            MemfsFileNodeDelete(NewFileNode);
+        iter = NewParentNode->Children->find(NewName);
+        if (NewParentNode->Children->end() != iter)
+            NewFileNode = iter->second;
     }
 
-    for (Index = 0; Context.Count > Index; Index++)
+    if (FileNode == NewFileNode)
+        Result = STATUS_SUCCESS;
+    else if (0 != NewFileNode && !ReplaceIfExists)
+        Result = STATUS_OBJECT_NAME_COLLISION;
+    else if (0 != NewFileNode && (NewFileNode->FileInfo.FileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+        Result = STATUS_ACCESS_DENIED;
+    else
     {
-        DescendantFileNode = Context.FileNodes[Index];
-        MemfsFileNodeMapRemove(Memfs->FileNodeMap, DescendantFileNode);
-        memmove(DescendantFileNode->FileName + NewFileNameLen,
-            DescendantFileNode->FileName + FileNameLen,
-            (wcslen(DescendantFileNode->FileName) + 1 - FileNameLen) * sizeof(WCHAR));
-        memcpy(DescendantFileNode->FileName, NewFileName, NewFileNameLen * sizeof(WCHAR));
-        Result = MemfsFileNodeMapInsert(Memfs->FileNodeMap, DescendantFileNode, &Inserted);
-        if (!NT_SUCCESS(Result))
+        if (0 != NewFileNode)
         {
-            FspDebugLog(__FUNCTION__ ": cannot insert into FileNodeMap; aborting\n");
-            abort();
+            AcquireSRWLockExclusive(&NewFileNode->Lock);
+            Removed = MemfsFileNodeMapRemove(Memfs->FileNodeMap, NewFileNode);
+            ReleaseSRWLockExclusive(&NewFileNode->Lock);
         }
-        assert(Inserted);
+
+        /* only the renamed node moves; its descendants are unaffected */
+        AcquireSRWLockExclusive(&FileNode->Lock);
+        NewName = MemfsFileNodeMapMove(Memfs->FileNodeMap, FileNode, NewParentNode, NewName);
+        ReleaseSRWLockExclusive(&FileNode->Lock);
+        Result = STATUS_SUCCESS;
     }
+    NewFileNode = Removed ? NewFileNode : 0;
 
-    Result = STATUS_SUCCESS;
+    if (LockNode[0] != LockNode[1])
+        ReleaseSRWLockExclusive(&LockNode[1]->Lock);
+    ReleaseSRWLockExclusive(&LockNode[0]->Lock);
 
 exit:
-    for (Index = 0; Context.Count > Index; Index++)
-    {
-        DescendantFileNode = Context.FileNodes[Index];
-        DescendantFileNode->RefCount--;
-    }
-    free(Context.FileNodes);
+    ReleaseSRWLockExclusive(&Memfs->FileNodeMap->RenameLock);
+
+    /* release the unused new name or the old name of a renamed node */
+    MemfsBlobPoolRelease(&Memfs->FileNodeMap->FileNamePool, NewName);
+    MemfsFileNodeMapLookupRelease(Memfs->FileNodeMap, NewFileNode, NewParentNode);
 
     return Result;
 }
@@ -798,18 +1592,21 @@ static NTSTATUS GetSecurity(FSP_FILE_SYSTEM *FileSystem,
     PSECURITY_DESCRIPTOR SecurityDescriptor, SIZE_T *PSecurityDescriptorSize)
 {
     MEMFS_FILE_NODE *FileNode = (MEMFS_FILE_NODE *)FileNode0;
+    SIZE_T FileSecuritySize;
+    NTSTATUS Result = STATUS_SUCCESS;
 
-    if (FileNode->FileSecuritySize > *PSecurityDescriptorSize)
-    {
-        *PSecurityDescriptorSize = FileNode->FileSecuritySize;
-        return STATUS_BUFFER_OVERFLOW;
-    }
+    AcquireSRWLockShared(&FileNode->Lock);
 
-    *PSecurityDescriptorSize = FileNode->FileSecuritySize;
-    if (0 != SecurityDescriptor)
-        memcpy(SecurityDescriptor, FileNode->FileSecurity, FileNode->FileSecuritySize);
+    FileSecuritySize = MemfsBlobSize(FileNode->FileSecurity);
+    if (FileSecuritySize > *PSecurityDescriptorSize)
+        Result = STATUS_BUFFER_OVERFLOW;
+    else if (0 != SecurityDescriptor)
+        memcpy(SecurityDescriptor, FileNode->FileSecurity, FileSecuritySize);
+    *PSecurityDescriptorSize = FileSecuritySize;
 
-    return STATUS_SUCCESS;
+    ReleaseSRWLockShared(&FileNode->Lock);
+
+    return Result;
 }
 
 static NTSTATUS SetSecurity(FSP_FILE_SYSTEM *FileSystem,
@@ -817,61 +1614,43 @@ static NTSTATUS SetSecurity(FSP_FILE_SYSTEM *FileSystem,
     PVOID FileNode0,
     SECURITY_INFORMATION SecurityInformation, PSECURITY_DESCRIPTOR SecurityDescriptor)
 {
+    MEMFS *Memfs = (MEMFS *)FileSystem->UserContext;
     MEMFS_FILE_NODE *FileNode = (MEMFS_FILE_NODE *)FileNode0;
-    PSECURITY_DESCRIPTOR NewSecurityDescriptor, FileSecurity;
-    SIZE_T FileSecuritySize;
+    PSECURITY_DESCRIPTOR NewSecurityDescriptor;
     NTSTATUS Result;
 
+    AcquireSRWLockExclusive(&FileNode->Lock);
+
     Result = FspSetSecurityDescriptor(FileSystem, Request, FileNode->FileSecurity,
         &NewSecurityDescriptor);
-    if (!NT_SUCCESS(Result))
-        return Result;
-
-    FileSecuritySize = GetSecurityDescriptorLength(NewSecurityDescriptor);
-    FileSecurity = (PSECURITY_DESCRIPTOR)malloc(FileSecuritySize);
-    if (0 == FileSecurity)
+    if (NT_SUCCESS(Result))
     {
+        Result = MemfsFileNodeSetSecurity(Memfs->FileNodeMap, FileNode, NewSecurityDescriptor);
         FspDeleteSecurityDescriptor(NewSecurityDescriptor, (NTSTATUS (*)())FspSetSecurityDescriptor);
-        return STATUS_INSUFFICIENT_RESOURCES;
     }
-    memcpy(FileSecurity, NewSecurityDescriptor, FileSecuritySize);
-    FspDeleteSecurityDescriptor(NewSecurityDescriptor, (NTSTATUS (*)())FspSetSecurityDescriptor);
 
-    free(FileNode->FileSecurity);
-    FileNode->FileSecuritySize = FileSecuritySize;
-    FileNode->FileSecurity = FileSecurity;
+    ReleaseSRWLockExclusive(&FileNode->Lock);
 
-    return STATUS_SUCCESS;
+    return Result;
 }
 
 typedef struct _MEMFS_READ_DIRECTORY_CONTEXT
 {
     PVOID Buffer;
-    UINT64 Offset;
     ULONG Length;
     PULONG PBytesTransferred;
-    BOOLEAN OffsetFound;
 } MEMFS_READ_DIRECTORY_CONTEXT;
 
-static BOOLEAN AddDirInfo(MEMFS_FILE_NODE *FileNode, PWSTR FileName,
+static BOOLEAN AddDirInfo(FSP_FSCTL_FILE_INFO *FileInfo, PWSTR FileName,
     PVOID Buffer, ULONG Length, PULONG PBytesTransferred)
 {
-    UINT8 DirInfoBuf[sizeof(FSP_FSCTL_DIR_INFO) + sizeof FileNode->FileName];
+    UINT8 DirInfoBuf[sizeof(FSP_FSCTL_DIR_INFO) + MAX_PATH * sizeof(WCHAR)];
     FSP_FSCTL_DIR_INFO *DirInfo = (FSP_FSCTL_DIR_INFO *)DirInfoBuf;
-    WCHAR Root[2] = L"\\";
-    PWSTR Remain, Suffix;
-
-    if (0 == FileName)
-    {
-        FspPathSuffix(FileNode->FileName, &Remain, &Suffix, Root);
-        FileName = Suffix;
-        FspPathCombine(FileNode->FileName, Suffix);
-    }
 
     memset(DirInfo->Padding, 0, sizeof DirInfo->Padding);
     DirInfo->Size = (UINT16)(sizeof(FSP_FSCTL_DIR_INFO) + wcslen(FileName) * sizeof(WCHAR));
-    DirInfo->FileInfo = FileNode->FileInfo;
-    DirInfo->NextOffset = FileNode->FileInfo.IndexNumber;
+    DirInfo->FileInfo = *FileInfo;
+    DirInfo->NextOffset = FileInfo->IndexNumber;
     memcpy(DirInfo->FileNameBuf, FileName, DirInfo->Size - sizeof(FSP_FSCTL_DIR_INFO));
 
     return FspFileSystemAddDirInfo(DirInfo, Buffer, Length, PBytesTransferred);
@@ -880,14 +1659,14 @@ static BOOLEAN AddDirInfo(MEMFS_FILE_NODE *FileNode, PWSTR FileName,
 static BOOLEAN ReadDirectoryEnumFn(MEMFS_FILE_NODE *FileNode, PVOID Context0)
 {
     MEMFS_READ_DIRECTORY_CONTEXT *Context = (MEMFS_READ_DIRECTORY_CONTEXT *)Context0;
+    FSP_FSCTL_FILE_INFO FileInfo;
 
-    if (0 != Context->Offset && !Context->OffsetFound)
-    {
-        Context->OffsetFound = FileNode->FileInfo.IndexNumber == Context->Offset;
-        return TRUE;
-    }
+    /* the child name is stable while its parent is locked */
+    AcquireSRWLockShared(&FileNode->Lock);
+    FileInfo = FileNode->FileInfo;
+    ReleaseSRWLockShared(&FileNode->Lock);
 
-    return AddDirInfo(FileNode, 0,
+    return AddDirInfo(&FileInfo, FileNode->FileName,
         Context->Buffer, Context->Length, Context->PBytesTransferred);
 }
 
@@ -899,34 +1678,76 @@ static NTSTATUS ReadDirectory(FSP_FILE_SYSTEM *FileSystem,
 {
     MEMFS *Memfs = (MEMFS *)FileSystem->UserContext;
     MEMFS_FILE_NODE *FileNode = (MEMFS_FILE_NODE *)FileNode0;
-    MEMFS_FILE_NODE *ParentNode;
+    MEMFS_FILE_NODE *ParentNode, *MarkerNode;
     MEMFS_READ_DIRECTORY_CONTEXT Context;
-    NTSTATUS Result;
-
-    ParentNode = MemfsFileNodeMapGetParent(Memfs->FileNodeMap, FileNode->FileName, &Result);
-    if (0 == ParentNode)
-        return Result;
+    FSP_FSCTL_FILE_INFO ParentInfo;
+    UINT64 ParentIndexNumber;
+    BOOLEAN AddDotDot;
+    PWSTR Marker = 0;
 
     Context.Buffer = Buffer;
-    Context.Offset = Offset;
     Context.Length = Length;
     Context.PBytesTransferred = PBytesTransferred;
-    Context.OffsetFound = FALSE;
 
-    if (0 == Offset)
-        if (!AddDirInfo(FileNode, L".", Buffer, Length, PBytesTransferred))
-            return STATUS_SUCCESS;
-    if (0 == Offset || FileNode->FileInfo.IndexNumber == Offset)
+    /*
+     * The Offset is the index number of the last entry returned: 0 to start the listing,
+     * the index number of this directory after ".", that of the parent after "..", or that
+     * of the child after which the listing continues.
+     */
+    AddDotDot = 0 == Offset || FileNode->FileInfo.IndexNumber == Offset;
+
+    /* the parent must be locked before the directory; get its file info first */
+    AcquireSRWLockShared(&FileNode->Lock);
+    ParentNode = MemfsFileNodeMapGetNodeParent(Memfs->FileNodeMap, FileNode);
+    if (0 != ParentNode)
+    {
+        ParentIndexNumber = ParentNode->FileInfo.IndexNumber;
+        if (AddDotDot && FileNode != ParentNode)
+            MemfsFileNodeReference(ParentNode);
+    }
+    ReleaseSRWLockShared(&FileNode->Lock);
+    if (0 == ParentNode)
+        return STATUS_OBJECT_PATH_NOT_FOUND;
+    if (AddDotDot && FileNode != ParentNode)
     {
-        Context.OffsetFound = FileNode->FileInfo.IndexNumber == Context.Offset;
+        AcquireSRWLockShared(&ParentNode->Lock);
+        ParentInfo = ParentNode->FileInfo;
+        ReleaseSRWLockShared(&ParentNode->Lock);
+        MemfsFileNodeDereference(Memfs->FileNodeMap, ParentNode);
+    }
+
+    AcquireSRWLockShared(&FileNode->Lock);
 
-        if (!AddDirInfo(ParentNode, L"..", Buffer, Length, PBytesTransferred))
-            return STATUS_SUCCESS;
+    if (FileNode == ParentNode)
+        ParentInfo = FileNode->FileInfo;
+
+    if (0 == Offset)
+        if (!AddDirInfo(&FileNode->FileInfo, L".", Buffer, Length, PBytesTransferred))
+            goto exit;
+    if (AddDotDot)
+    {
+        if (!AddDirInfo(&ParentInfo, L"..", Buffer, Length, PBytesTransferred))
+            goto exit;
+    }
+    else if (ParentIndexNumber != Offset)
+    {
+        MarkerNode = MemfsFileNodeMapGetChildByIndexNumber(Memfs->FileNodeMap, FileNode, Offset);
+        if (0 == MarkerNode)
+        {
+            /* the child we stopped at is gone; end the listing */
+            FspFileSystemAddDirInfo(0, Buffer, Length, PBytesTransferred);
+            goto exit;
+        }
+        Marker = MarkerNode->FileName;
     }
 
-    if (MemfsFileNodeMapEnumerateChildren(Memfs->FileNodeMap, FileNode, ReadDirectoryEnumFn, &Context))
+    if (MemfsFileNodeMapEnumerateChildren(Memfs->FileNodeMap, FileNode, Marker,
+        ReadDirectoryEnumFn, &Context))
         FspFileSystemAddDirInfo(0, Buffer, Length, PBytesTransferred);
 
+exit:
+    ReleaseSRWLockShared(&FileNode->Lock);
+
     return STATUS_SUCCESS;
 }
 
@@ -957,14 +1778,14 @@ NTSTATUS MemfsCreate(
     ULONG Flags,
     ULONG FileInfoTimeout,
     ULONG MaxFileNodes,
-    ULONG MaxFileSize,
+    UINT64 MaxFileSize,
     PWSTR VolumePrefix,
     PWSTR RootSddl,
     MEMFS **PMemfs)
 {
     NTSTATUS Result;
     FSP_FSCTL_VOLUME_PARAMS VolumeParams;
-    PWSTR DevicePath = (Flags & MemfsNet) ?
+    PWSTR DevicePath = (Flags & MemfsDetached) ? 0 : (Flags & MemfsNet) ?
         L"" FSP_FSCTL_NET_DEVICE_NAME : L"" FSP_FSCTL_DISK_DEVICE_NAME;
     UINT64 AllocationUnit;
     MEMFS *Memfs;
@@ -991,7 +1812,7 @@ NTSTATUS MemfsCreate(
     memset(Memfs, 0, sizeof *Memfs);
     Memfs->MaxFileNodes = MaxFileNodes;
     AllocationUnit = MEMFS_SECTOR_SIZE * MEMFS_SECTORS_PER_ALLOCATION_UNIT;
-    Memfs->MaxFileSize = (ULONG)((MaxFileSize + AllocationUnit - 1) / AllocationUnit * AllocationUnit);
+    Memfs->MaxFileSize = (MaxFileSize + AllocationUnit - 1) / AllocationUnit * AllocationUnit;
 
     Result = MemfsFileNodeMapCreate(&Memfs->FileNodeMap);
     if (!NT_SUCCESS(Result))
@@ -1011,6 +1832,9 @@ NTSTATUS MemfsCreate(
     VolumeParams.CasePreservedNames = 1;
     VolumeParams.UnicodeOnDisk = 1;
     VolumeParams.PersistentAcls = 1;
+    VolumeParams.NegativeNameCache = !!(Flags & MemfsNegativeNameCache);
+    VolumeParams.ExtendedPayload = !!(Flags & MemfsExtendedPayload);
+    VolumeParams.AdaptiveWakeup = !!(Flags & MemfsAdaptiveWakeup);
     if (0 != VolumePrefix)
         wcscpy_s(VolumeParams.Prefix, sizeof VolumeParams.Prefix / sizeof(WCHAR), VolumePrefix);
 
@@ -1024,6 +1848,7 @@ NTSTATUS MemfsCreate(
     }
 
     Memfs->FileSystem->UserContext = Memfs;
+    InitializeSRWLock(&Memfs->VolumeLabelLock);
     Memfs->VolumeLabelLength = sizeof L"MEMFS" - sizeof(WCHAR);
     memcpy(Memfs->VolumeLabel, L"MEMFS", Memfs->VolumeLabelLength);
 
@@ -1032,11 +1857,15 @@ NTSTATUS MemfsCreate(
         FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY_COARSE);
 #endif
 
+    /* the file node map does its own locking; let operations run without the guard */
+    if (Flags & MemfsConcurrent)
+        FspFileSystemSetOperationGuard(Memfs->FileSystem, 0, 0);
+
     /*
      * Create root directory.
      */
 
-    Result = MemfsFileNodeCreate(L"\\", &RootNode);
+    Result = MemfsFileNodeCreate(Memfs->FileNodeMap, L"", &RootNode);
     if (!NT_SUCCESS(Result))
     {
         MemfsDelete(Memfs);
@@ -1046,21 +1875,19 @@ NTSTATUS MemfsCreate(
 
     RootNode->FileInfo.FileAttributes = FILE_ATTRIBUTE_DIRECTORY;
 
-    RootNode->FileSecurity = malloc(RootSecuritySize);
-    if (0 == RootNode->FileSecurity)
+    Result = MemfsFileNodeSetSecurity(Memfs->FileNodeMap, RootNode, RootSecurity);
+    if (!NT_SUCCESS(Result))
     {
-        MemfsFileNodeDelete(RootNode);
+        MemfsFileNodeDelete(Memfs->FileNodeMap, RootNode);
         MemfsDelete(Memfs);
         LocalFree(RootSecurity);
-        return STATUS_INSUFFICIENT_RESOURCES;
+        return Result;
     }
-    RootNode->FileSecuritySize = RootSecuritySize;
-    memcpy(RootNode->FileSecurity, RootSecurity, RootSecuritySize);
 
-    Result = MemfsFileNodeMapInsert(Memfs->FileNodeMap, RootNode, &Inserted);
+    Result = MemfsFileNodeMapInsert(Memfs->FileNodeMap, 0, RootNode, &Inserted);
     if (!NT_SUCCESS(Result))
     {
-        MemfsFileNodeDelete(RootNode);
+        MemfsFileNodeDelete(Memfs->FileNodeMap, RootNode);
         MemfsDelete(Memfs);
         LocalFree(RootSecurity);
         return Result;
@@ -30,13 +30,18 @@ enum
 {
     MemfsDisk                           = 0x00,
     MemfsNet                            = 0x01,
+    MemfsDetached                       = 0x02, /* not attached to the FSD; for trace replay */
+    MemfsConcurrent                     = 0x04, /* no operation guard; memfs locks per file */
+    MemfsNegativeNameCache              = 0x08, /* FSD caches names not found */
+    MemfsExtendedPayload                = 0x10, /* requests/responses up to 64 KiB */
+    MemfsAdaptiveWakeup                 = 0x20, /* FSD wakes dispatcher threads adaptively */
 };
 
 NTSTATUS MemfsCreate(
     ULONG Flags,
     ULONG FileInfoTimeout,
     ULONG MaxFileNodes,
-    ULONG MaxFileSize,
+    UINT64 MaxFileSize,
     PWSTR VolumePrefix,
     PWSTR RootSddl,
     MEMFS **PMemfs);
@@ -0,0 +1,307 @@
+#include <winfsp/winfsp.h>
+#include <shared/attrcache.h>
+#include <tlib/testsuite.h>
+#include <process.h>
+
+static FSP_ATTR_CACHE_ENTRY *attrcache_entry(const char *Path, NTSTATUS Result,
+    UINT64 InsertTime, UINT64 FileSize)
+{
+    FSP_ATTR_CACHE_ENTRY *Entry;
+    ULONG PathLength = (ULONG)strlen(Path);
+
+    Entry = malloc(sizeof *Entry + PathLength + 1);
+    ASSERT(0 != Entry);
+    memset(Entry, 0, sizeof *Entry);
+    Entry->InsertTime = InsertTime;
+    Entry->PathLength = PathLength;
+    Entry->Result = Result;
+    Entry->Mode = 0100644;
+    Entry->FileInfo.FileSize = FileSize;
+    memcpy(Entry->Path, Path, PathLength + 1);
+
+    return Entry;
+}
+
+static void attrcache_free(FSP_ATTR_CACHE_TABLE *Table)
+{
+    FSP_ATTR_CACHE_ENTRY *Entry, *NextEntry;
+
+    for (Entry = FspAttrCacheTableTakeFreeList(Table); 0 != Entry; Entry = NextEntry)
+    {
+        NextEntry = Entry->DictNext;
+        free(Entry);
+    }
+}
+
+static FSP_ATTR_CACHE_ENTRY *attrcache_lookup(FSP_ATTR_CACHE_TABLE *Table,
+    const char *Path, BOOLEAN IsOpen, UINT64 CurrentTime, PUINT64 PToken)
+{
+    return FspAttrCacheTableLookup(Table, Path, (ULONG)strlen(Path), IsOpen, CurrentTime, PToken);
+}
+
+static BOOLEAN attrcache_insert(FSP_ATTR_CACHE_TABLE *Table, const char *Path,
+    NTSTATUS Result, UINT64 InsertTime, UINT64 FileSize, UINT64 Token)
+{
+    FSP_ATTR_CACHE_ENTRY *Entry = attrcache_entry(Path, Result, InsertTime, FileSize);
+    BOOLEAN Inserted = FspAttrCacheTableInsert(Table, Entry, Token);
+    if (!Inserted)
+        free(Entry);
+    attrcache_free(Table);
+    return Inserted;
+}
+
+static void attrcache_invalidate(FSP_ATTR_CACHE_TABLE *Table, const char *Path)
+{
+    FspAttrCacheTableInvalidate(Table, Path, (ULONG)strlen(Path));
+    attrcache_free(Table);
+}
+
+static ULONG attrcache_bucket(const char *Path)
+{
+    return FspAttrCacheHashPath(Path, (ULONG)strlen(Path)) % FspAttrCacheBucketCount;
+}
+
+void attrcache_test(void)
+{
+    FSP_ATTR_CACHE_TABLE Table;
+    FSP_ATTR_CACHE_ENTRY *Entry;
+    UINT64 Token, Token2;
+    char Path[64];
+
+    ASSERT(attrcache_bucket("/a/b") != attrcache_bucket("/a/c"));
+
+    FspAttrCacheTableInitialize(&Table, 4, 1000, 2000, 500);
+
+    /* miss, insert, hit */
+    ASSERT(0 == attrcache_lookup(&Table, "/a/b", FALSE, 100, &Token));
+    ASSERT(attrcache_insert(&Table, "/a/b", STATUS_SUCCESS, 100, 42, Token));
+    Entry = attrcache_lookup(&Table, "/a/b", FALSE, 100, &Token);
+    ASSERT(0 != Entry);
+    ASSERT(STATUS_SUCCESS == Entry->Result);
+    ASSERT(42 == Entry->FileInfo.FileSize);
+    ASSERT(0100644 == Entry->Mode);
+    ASSERT(0 == attrcache_lookup(&Table, "/a", FALSE, 100, &Token));
+    ASSERT(0 == attrcache_lookup(&Table, "/a/b/c", FALSE, 100, &Token));
+
+    /* lookups by name use EntryTimeout, lookups on an open file use AttrTimeout */
+    ASSERT(0 != attrcache_lookup(&Table, "/a/b", FALSE, 100 + 1999, &Token));
+    ASSERT(0 == attrcache_lookup(&Table, "/a/b", FALSE, 100 + 2000, &Token));
+    ASSERT(0 != attrcache_lookup(&Table, "/a/b", TRUE, 100 + 999, &Token));
+    ASSERT(0 == attrcache_lookup(&Table, "/a/b", TRUE, 100 + 1000, &Token));
+
+    /* names not found use NegativeTimeout */
+    ASSERT(0 == attrcache_lookup(&Table, "/a/c", FALSE, 100, &Token));
+    ASSERT(attrcache_insert(&Table, "/a/c", STATUS_OBJECT_NAME_NOT_FOUND, 100, 0, Token));
+    Entry = attrcache_lookup(&Table, "/a/c", FALSE, 100 + 499, &Token);
+    ASSERT(0 != Entry && STATUS_OBJECT_NAME_NOT_FOUND == Entry->Result);
+    ASSERT(0 == attrcache_lookup(&Table, "/a/c", FALSE, 100 + 500, &Token));
+
+    /* an insert replaces an existing entry */
+    ASSERT(0 != attrcache_lookup(&Table, "/a/b", FALSE, 200, &Token));
+    ASSERT(attrcache_insert(&Table, "/a/b", STATUS_SUCCESS, 200, 43, Token));
+    ASSERT(2 == Table.EntryCount);
+    Entry = attrcache_lookup(&Table, "/a/b", FALSE, 200, &Token);
+    ASSERT(0 != Entry && 43 == Entry->FileInfo.FileSize);
+
+    /* a size update grows the cached size and rejects inserts for the same path */
+    ASSERT(0 != attrcache_lookup(&Table, "/a/b", FALSE, 200, &Token));
+    FspAttrCacheTableUpdateSize(&Table, "/a/b", 4, 4096, 4096);
+    Entry = attrcache_lookup(&Table, "/a/b", FALSE, 200, &Token2);
+    ASSERT(0 != Entry && 4096 == Entry->FileInfo.FileSize && 4096 == Entry->FileInfo.AllocationSize);
+    ASSERT(Token != Token2);
+    ASSERT(!attrcache_insert(&Table, "/a/b", STATUS_SUCCESS, 200, 43, Token));
+    FspAttrCacheTableUpdateSize(&Table, "/a/b", 4, 100, 4096);
+    Entry = attrcache_lookup(&Table, "/a/b", FALSE, 200, &Token2);
+    ASSERT(0 != Entry && 4096 == Entry->FileInfo.FileSize);
+    ASSERT(1 == Table.Rejects);
+
+    /* ... but not inserts for paths in other buckets */
+    ASSERT(0 == attrcache_lookup(&Table, "/a/c", FALSE, 700, &Token));
+    FspAttrCacheTableUpdateSize(&Table, "/a/b", 4, 8192, 8192);
+    attrcache_invalidate(&Table, "/a/b");
+    ASSERT(0 == attrcache_lookup(&Table, "/a/b", FALSE, 200, &Token2));
+    ASSERT(attrcache_insert(&Table, "/a/c", STATUS_SUCCESS, 200, 1, Token));
+    ASSERT(0 != attrcache_lookup(&Table, "/a/c", FALSE, 200, &Token));
+    ASSERT(1 == Table.Rejects);
+
+    /* invalidating a path removes it and rejects inserts for it */
+    attrcache_invalidate(&Table, "/a/c");
+    ASSERT(0 == attrcache_lookup(&Table, "/a/c", FALSE, 200, &Token2));
+    ASSERT(!attrcache_insert(&Table, "/a/c", STATUS_SUCCESS, 200, 1, Token));
+    ASSERT(attrcache_insert(&Table, "/a/c", STATUS_SUCCESS, 200, 1, Token2));
+
+    /* invalidating all paths rejects all inserts */
+    ASSERT(0 == attrcache_lookup(&Table, "/a/b", FALSE, 200, &Token));
+    FspAttrCacheTableInvalidateAll(&Table);
+    attrcache_free(&Table);
+    ASSERT(0 == Table.EntryCount);
+    ASSERT(0 == attrcache_lookup(&Table, "/a/c", FALSE, 200, &Token2));
+    ASSERT(!attrcache_insert(&Table, "/a/b", STATUS_SUCCESS, 200, 1, Token));
+    ASSERT(3 == Table.Rejects);
+
+    /* the table is emptied when it reaches its capacity */
+    for (ULONG I = 0; 4 > I; I++)
+    {
+        sprintf(Path, "/f%lu", I);
+        ASSERT(0 == attrcache_lookup(&Table, Path, FALSE, 300, &Token));
+        ASSERT(attrcache_insert(&Table, Path, STATUS_SUCCESS, 300, I, Token));
+    }
+    ASSERT(4 == Table.EntryCount);
+    ASSERT(0 == attrcache_lookup(&Table, "/f4", FALSE, 300, &Token));
+    ASSERT(attrcache_insert(&Table, "/f4", STATUS_SUCCESS, 300, 4, Token));
+    ASSERT(1 == Table.EntryCount);
+    ASSERT(0 == attrcache_lookup(&Table, "/f0", FALSE, 300, &Token));
+    ASSERT(0 != attrcache_lookup(&Table, "/f4", FALSE, 300, &Token));
+
+    FspAttrCacheTableClear(&Table);
+    attrcache_free(&Table);
+}
+
+/*
+ * Writer threads grow files and update the cached size the way the FUSE layer does after
+ * a write: the file system changes the size and then the cache is updated. Getattr threads
+ * do what a FUSE getattr does: lookup and, on a miss, ask the file system and insert the
+ * result. Once a size update has completed, a lookup must never return a smaller size.
+ * Files that are never written are in buckets of their own and their inserts must never
+ * be rejected.
+ */
+#define attrcache_race_count            16
+static struct
+{
+    SRWLOCK Lock;
+    FSP_ATTR_CACHE_TABLE Table;
+    char Paths[2 * attrcache_race_count][32];
+    LONG64 volatile Sizes[attrcache_race_count];
+    LONG64 volatile Committed[attrcache_race_count];
+    LONG volatile Done;
+    LONG volatile Errors;
+    LONG volatile Hits, Inserts, StaticRejects;
+} attrcache_race;
+
+static unsigned __stdcall attrcache_race_getattr(void *Data)
+{
+    ULONG Seed = (ULONG)(UINT_PTR)Data;
+    FSP_ATTR_CACHE_ENTRY *Entry;
+    const char *Path;
+    UINT64 Token, Committed, FileSize = 0;
+    BOOLEAN Hit, Inserted;
+    ULONG I;
+
+    while (!attrcache_race.Done)
+    {
+        Seed = Seed * 1103515245 + 12345;
+        I = (Seed >> 16) % (2 * attrcache_race_count);
+        Path = attrcache_race.Paths[I];
+        Committed = attrcache_race_count > I ? attrcache_race.Committed[I] : 0;
+
+        AcquireSRWLockShared(&attrcache_race.Lock);
+        Entry = attrcache_lookup(&attrcache_race.Table, Path, TRUE, 0, &Token);
+        Hit = 0 != Entry;
+        if (Hit)
+            FileSize = Entry->FileInfo.FileSize;
+        ReleaseSRWLockShared(&attrcache_race.Lock);
+
+        if (Hit)
+        {
+            if (FileSize < Committed)
+                InterlockedIncrement(&attrcache_race.Errors);
+            InterlockedIncrement(&attrcache_race.Hits);
+            continue;
+        }
+
+        /* the getattr is in the file system */
+        FileSize = attrcache_race_count > I ? attrcache_race.Sizes[I] : 0;
+        if (0 == (Seed >> 8) % 4)
+            SwitchToThread();
+        Entry = attrcache_entry(Path, STATUS_SUCCESS, 0, FileSize);
+
+        AcquireSRWLockExclusive(&attrcache_race.Lock);
+        Inserted = FspAttrCacheTableInsert(&attrcache_race.Table, Entry, Token);
+        if (!Inserted)
+            free(Entry);
+        attrcache_free(&attrcache_race.Table);
+        ReleaseSRWLockExclusive(&attrcache_race.Lock);
+
+        if (Inserted)
+            InterlockedIncrement(&attrcache_race.Inserts);
+        else if (attrcache_race_count <= I)
+            InterlockedIncrement(&attrcache_race.StaticRejects);
+    }
+
+    return 0;
+}
+
+static unsigned __stdcall attrcache_race_writer(void *Data)
+{
+    const char *Path;
+
+    for (ULONG K = 1; 200 >= K; K++)
+        for (ULONG I = 0; attrcache_race_count > I; I++)
+        {
+            Path = attrcache_race.Paths[I];
+            InterlockedExchange64(&attrcache_race.Sizes[I], K * 100);
+
+            AcquireSRWLockExclusive(&attrcache_race.Lock);
+            FspAttrCacheTableUpdateSize(&attrcache_race.Table, Path, (ULONG)strlen(Path),
+                K * 100, K * 4096);
+            ReleaseSRWLockExclusive(&attrcache_race.Lock);
+
+            InterlockedExchange64(&attrcache_race.Committed[I], K * 100);
+
+            if (0 == I % 4)
+                SwitchToThread();
+        }
+
+    return 0;
+}
+
+void attrcache_race_test(void)
+{
+    HANDLE Threads[5];
+    FSP_ATTR_CACHE_ENTRY *Entry;
+    UINT64 Token;
+
+    memset(&attrcache_race, 0, sizeof attrcache_race);
+    InitializeSRWLock(&attrcache_race.Lock);
+    FspAttrCacheTableInitialize(&attrcache_race.Table, 4 * attrcache_race_count,
+        (UINT64)-1LL, (UINT64)-1LL, (UINT64)-1LL);
+
+    for (ULONG I = 0; 2 * attrcache_race_count > I; I++)
+        sprintf(attrcache_race.Paths[I], attrcache_race_count > I ? "/dir/file%lu" : "/dir/static%lu",
+            I % attrcache_race_count);
+    for (ULONG I = 0; attrcache_race_count > I; I++)
+        for (ULONG J = attrcache_race_count; 2 * attrcache_race_count > J; J++)
+            ASSERT(attrcache_bucket(attrcache_race.Paths[I]) != attrcache_bucket(attrcache_race.Paths[J]));
+
+    for (ULONG I = 0; 4 > I; I++)
+    {
+        Threads[I] = (HANDLE)_beginthreadex(0, 0, attrcache_race_getattr, (void *)(UINT_PTR)(I + 1), 0, 0);
+        ASSERT(0 != Threads[I]);
+    }
+    Threads[4] = (HANDLE)_beginthreadex(0, 0, attrcache_race_writer, 0, 0, 0);
+    ASSERT(0 != Threads[4]);
+    WaitForSingleObject(Threads[4], INFINITE);
+    InterlockedExchange(&attrcache_race.Done, 1);
+    WaitForMultipleObjects(4, Threads, TRUE, INFINITE);
+    for (ULONG I = 0; 5 > I; I++)
+        CloseHandle(Threads[I]);
+
+    ASSERT(0 == attrcache_race.Errors);
+    ASSERT(0 == attrcache_race.StaticRejects);
+    ASSERT(0 < attrcache_race.Hits);
+    ASSERT(0 < attrcache_race.Inserts);
+    for (ULONG I = 0; attrcache_race_count > I; I++)
+    {
+        Entry = attrcache_lookup(&attrcache_race.Table, attrcache_race.Paths[I], TRUE, 0, &Token);
+        ASSERT(0 == Entry || 200 * 100 == Entry->FileInfo.FileSize);
+    }
+
+    FspAttrCacheTableClear(&attrcache_race.Table);
+    attrcache_free(&attrcache_race.Table);
+}
+
+void attrcache_tests(void)
+{
+    TEST(attrcache_test);
+    TEST(attrcache_race_test);
+}
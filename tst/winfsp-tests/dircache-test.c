@@ -0,0 +1,312 @@
+#include <winfsp/winfsp.h>
+#include <shared/dircache.h>
+#include <tlib/testsuite.h>
+
+/*
+ * A directory listing of EntryCount entries ("file00000", "file00001", ...) as a user mode
+ * file system would return it: with byte positions as offsets (sorted) or with offsets that
+ * are unrelated to listing order such as index numbers (unsorted).
+ */
+static UINT64 dircache_entry_offset(ULONG I, BOOLEAN Sorted)
+{
+    return Sorted ? (I + 1) * 100 : (UINT64)(I * 7919 % 100003) + 1;
+}
+
+static ULONG dircache_response(PVOID Buffer, ULONG Length,
+    ULONG EntryCount, BOOLEAN Sorted, UINT64 Offset, PULONG PFirst)
+{
+    /* fill a QueryDirectory response read at Offset; *PFirst is the entry at Offset */
+    FSP_FSCTL_DIR_INFO *DirInfo;
+    ULONG I = *PFirst, Position = 0, Size;
+    WCHAR FileName[16];
+
+    ASSERT(0 == I || dircache_entry_offset(I - 1, Sorted) == Offset);
+    for (; EntryCount > I; I++)
+    {
+        Size = (ULONG)(sizeof(FSP_FSCTL_DIR_INFO) +
+            wsprintfW(FileName, L"file%05lu", I) * sizeof(WCHAR));
+        if (Position + FSP_FSCTL_DEFAULT_ALIGN_UP(Size) > Length)
+            break;
+        DirInfo = (FSP_FSCTL_DIR_INFO *)((PUINT8)Buffer + Position);
+        memset(DirInfo, 0, sizeof *DirInfo);
+        DirInfo->Size = (UINT16)Size;
+        DirInfo->FileInfo.IndexNumber = I;
+        DirInfo->NextOffset = dircache_entry_offset(I, Sorted);
+        memcpy(DirInfo->FileNameBuf, FileName, Size - sizeof(FSP_FSCTL_DIR_INFO));
+        Position += FSP_FSCTL_DEFAULT_ALIGN_UP(Size);
+    }
+    if (EntryCount == I && Position + sizeof(UINT16) <= Length)
+    {
+        *(PUINT16)((PUINT8)Buffer + Position) = 0;
+        Position += sizeof(UINT16);
+    }
+    *PFirst = I;
+
+    return Position;
+}
+
+typedef struct
+{
+    FSP_DIR_CACHE_INDEX *Index;
+    FSP_DIR_CACHE_PAGE **Pages;         /* by ItemIndex - 1 */
+} DIRCACHE_LISTING;
+
+static BOOLEAN dircache_listing_add(DIRCACHE_LISTING *Listing, UINT64 Offset,
+    PVOID Buffer, ULONG Size, UINT64 SizeMax)
+{
+    /* add a response to the listing the way the FSD does */
+    FSP_DIR_CACHE_INDEX *NewIndex;
+    FSP_DIR_CACHE_PAGE *Page;
+    ULONG PageSize, EntryCount, EntriesSize, PageCount;
+    BOOLEAN EndOfDirectory;
+
+    PageSize = FspDirCachePageScan(Buffer, Size, &EntryCount, &EntriesSize, &EndOfDirectory);
+    if ((0 == EntryCount && !EndOfDirectory) ||
+        !FspDirCacheIndexCanAppend(Listing->Index, Offset, PageSize, SizeMax))
+        return FALSE;
+
+    PageCount = 0 != Listing->Index ? Listing->Index->PageCount : 0;
+    Page = malloc(PageSize);
+    NewIndex = malloc(FspDirCacheIndexSize(PageCount + 1));
+    Listing->Pages = realloc(Listing->Pages, (PageCount + 1) * sizeof *Listing->Pages);
+    ASSERT(0 != Page && 0 != NewIndex && 0 != Listing->Pages);
+
+    FspDirCachePageBuild(Page, Offset, Buffer, EntryCount, EntriesSize, EndOfDirectory);
+    FspDirCacheIndexAppend(NewIndex, Listing->Index, Page, PageSize, PageCount + 1);
+    Listing->Pages[PageCount] = Page;
+    free(Listing->Index);
+    Listing->Index = NewIndex;
+
+    return TRUE;
+}
+
+static void dircache_listing_read(DIRCACHE_LISTING *Listing, ULONG EntryCount, BOOLEAN Sorted,
+    ULONG Length)
+{
+    /* read the whole directory in responses of Length bytes */
+    PVOID Buffer = malloc(Length);
+    UINT64 Offset = 0;
+    ULONG First = 0, Size;
+
+    ASSERT(0 != Buffer);
+    memset(Listing, 0, sizeof *Listing);
+    for (;;)
+    {
+        Size = dircache_response(Buffer, Length, EntryCount, Sorted, Offset, &First);
+        ASSERT(dircache_listing_add(Listing, Offset, Buffer, Size, (UINT64)-1LL));
+        if (Listing->Index->Complete)
+            break;
+        Offset = Listing->Index->Pages[Listing->Index->PageCount - 1].NextOffset;
+    }
+    free(Buffer);
+}
+
+static void dircache_listing_free(DIRCACHE_LISTING *Listing)
+{
+    for (ULONG I = 0; 0 != Listing->Index && Listing->Index->PageCount > I; I++)
+        free(Listing->Pages[I]);
+    free(Listing->Pages);
+    free(Listing->Index);
+}
+
+static FSP_FSCTL_DIR_INFO *dircache_listing_find(DIRCACHE_LISTING *Listing,
+    UINT64 DirectoryOffset, PULONG PHint)
+{
+    /* find the entry that follows DirectoryOffset the way QueryDirectory does */
+    FSP_DIR_CACHE_INDEX *Index = Listing->Index;
+    FSP_DIR_CACHE_PAGE *Page;
+    ULONG PageNumber, EntryNumber;
+
+    PageNumber = FspDirCacheIndexFind(Index, DirectoryOffset, *PHint);
+    for (ULONG Count = 0; Index->PageCount > PageNumber && Index->PageCount > Count; Count++)
+    {
+        Page = Listing->Pages[Index->Pages[PageNumber].ItemIndex - 1];
+        EntryNumber = FspDirCachePageFind(Page, DirectoryOffset);
+        if ((ULONG)-1 != EntryNumber)
+        {
+            /* the end of a page that does not end the directory is the next page */
+            if (Page->EntryCount == EntryNumber && !Page->EndOfDirectory)
+            {
+                if (Index->PageCount <= PageNumber + 1)
+                    return 0;
+                PageNumber++;
+                Page = Listing->Pages[Index->Pages[PageNumber].ItemIndex - 1];
+                EntryNumber = 0;
+            }
+            *PHint = PageNumber;
+            return FspDirCachePageEntry(Page, EntryNumber);
+        }
+        if (Index->Sorted)
+            break;
+        PageNumber = (PageNumber + 1) % Index->PageCount;
+    }
+
+    return 0;
+}
+
+static void dircache_dotest(ULONG EntryCount, BOOLEAN Sorted)
+{
+    DIRCACHE_LISTING Listing;
+    FSP_FSCTL_DIR_INFO *DirInfo;
+    UINT64 DirectoryOffset;
+    ULONG Hint = 0, EntryTotal = 0;
+    WCHAR FileName[16];
+
+    dircache_listing_read(&Listing, EntryCount, Sorted, 16384);
+    ASSERT(1 < Listing.Index->PageCount);
+    ASSERT(Sorted == Listing.Index->Sorted);
+    ASSERT(Listing.Index->Complete);
+    ASSERT(0 == Listing.Index->Pages[0].Offset);
+    for (ULONG I = 1; Listing.Index->PageCount > I; I++)
+        ASSERT(Listing.Index->Pages[I - 1].NextOffset == Listing.Index->Pages[I].Offset);
+    for (ULONG I = 0; Listing.Index->PageCount > I; I++)
+    {
+        /* as in the FSD: a page is at most 1/16 bigger than the response it was built from */
+        ASSERT(16384 + 16384 / 16 >= Listing.Index->Pages[I].Size);
+        EntryTotal += Listing.Pages[I]->EntryCount;
+    }
+    ASSERT(EntryCount == EntryTotal);
+
+    /* resume after every entry */
+    DirectoryOffset = 0;
+    for (ULONG I = 0; EntryCount > I; I++)
+    {
+        DirInfo = dircache_listing_find(&Listing, DirectoryOffset, &Hint);
+        ASSERT(0 != DirInfo);
+        ASSERT(sizeof(FSP_FSCTL_DIR_INFO) <= DirInfo->Size);
+        ASSERT(I == DirInfo->FileInfo.IndexNumber);
+        ASSERT(0 == memcmp(DirInfo->FileNameBuf, FileName,
+            wsprintfW(FileName, L"file%05lu", I) * sizeof(WCHAR)));
+        DirectoryOffset = DirInfo->NextOffset;
+    }
+    DirInfo = dircache_listing_find(&Listing, DirectoryOffset, &Hint);
+    ASSERT(0 != DirInfo && sizeof(FSP_FSCTL_DIR_INFO) > DirInfo->Size);
+
+    /* resume at random entries (e.g. from another handle or SL_INDEX_SPECIFIED) */
+    for (ULONG I = 0; EntryCount > I; I += 97)
+    {
+        Hint = 0;
+        DirInfo = dircache_listing_find(&Listing, dircache_entry_offset(I, Sorted), &Hint);
+        ASSERT(0 != DirInfo);
+        ASSERT(I + 1 == EntryCount || I + 1 == DirInfo->FileInfo.IndexNumber);
+    }
+
+    /* an offset that is not in the listing */
+    ASSERT(0 == dircache_listing_find(&Listing, 50, &Hint));
+
+    dircache_listing_free(&Listing);
+}
+
+void dircache_test(void)
+{
+    DIRCACHE_LISTING Listing;
+    UINT8 Buffer[4096];
+    ULONG First = 0, Size;
+
+    dircache_dotest(1000, TRUE);
+    dircache_dotest(1000, FALSE);
+
+    /* an incomplete listing; resuming past it misses */
+    memset(&Listing, 0, sizeof Listing);
+    Size = dircache_response(Buffer, sizeof Buffer, 1000, TRUE, 0, &First);
+    ASSERT(!dircache_listing_add(&Listing, 100, Buffer, Size, (UINT64)-1LL));
+    ASSERT(dircache_listing_add(&Listing, 0, Buffer, Size, (UINT64)-1LL));
+    ASSERT(!Listing.Index->Complete);
+    ASSERT(Listing.Index->PageCount ==
+        FspDirCacheIndexFind(Listing.Index, Listing.Index->Pages[0].NextOffset, 0));
+    ASSERT(0 == FspDirCacheIndexFind(Listing.Index, Listing.Index->Pages[0].NextOffset - 100, 0));
+
+    /* a response that does not continue the listing or goes over budget is not added */
+    Size = dircache_response(Buffer, sizeof Buffer, 1000, TRUE,
+        Listing.Index->Pages[0].NextOffset, &First);
+    ASSERT(!dircache_listing_add(&Listing, Listing.Index->Pages[0].NextOffset + 100,
+        Buffer, Size, (UINT64)-1LL));
+    ASSERT(!dircache_listing_add(&Listing, Listing.Index->Pages[0].NextOffset,
+        Buffer, Size, Listing.Index->Size + 100));
+    ASSERT(dircache_listing_add(&Listing, Listing.Index->Pages[0].NextOffset,
+        Buffer, Size, (UINT64)-1LL));
+    ASSERT(2 == Listing.Index->PageCount);
+
+    dircache_listing_free(&Listing);
+
+    /* an empty directory */
+    memset(&Listing, 0, sizeof Listing);
+    First = 0;
+    Size = dircache_response(Buffer, sizeof Buffer, 0, TRUE, 0, &First);
+    ASSERT(dircache_listing_add(&Listing, 0, Buffer, Size, (UINT64)-1LL));
+    ASSERT(Listing.Index->Complete);
+    ASSERT(0 == Listing.Pages[0]->EntryCount);
+    ASSERT(0 == FspDirCacheIndexFind(Listing.Index, 0, 0));
+    ASSERT(sizeof(FSP_FSCTL_DIR_INFO) > FspDirCachePageEntry(Listing.Pages[0], 0)->Size);
+    dircache_listing_free(&Listing);
+}
+
+static void dircache_bench_dotest(ULONG EntryCount, BOOLEAN Sorted, ULONG ResumeCount)
+{
+    /*
+     * benchmark: enumerate a directory, resuming every ResumeCount entries; compare the page
+     * index (and the page hint that the FSD keeps per handle) against a linear scan for the
+     * resume offset
+     */
+    DIRCACHE_LISTING Listing;
+    FSP_DIR_CACHE_PAGE *Page;
+    FSP_FSCTL_DIR_INFO *DirInfo;
+    UINT64 DirectoryOffset;
+    ULONG Hint, Resumes = 0;
+    LARGE_INTEGER Frequency, Start, End, Linear;
+
+    dircache_listing_read(&Listing, EntryCount, Sorted, 16384);
+
+    QueryPerformanceFrequency(&Frequency);
+    QueryPerformanceCounter(&Start);
+    DirectoryOffset = 0;
+    Hint = 0;
+    for (ULONG I = 0; EntryCount > I; I += ResumeCount, Resumes++)
+    {
+        DirInfo = dircache_listing_find(&Listing, DirectoryOffset, &Hint);
+        ASSERT(0 != DirInfo && I == DirInfo->FileInfo.IndexNumber);
+        DirectoryOffset = dircache_entry_offset(
+            I + ResumeCount < EntryCount ? I + ResumeCount - 1 : EntryCount - 1, Sorted);
+    }
+    QueryPerformanceCounter(&End);
+
+    Linear.QuadPart = End.QuadPart;
+    DirectoryOffset = 0;
+    for (ULONG I = 0; EntryCount > I; I += ResumeCount)
+    {
+        DirInfo = 0;
+        for (ULONG J = 0; Listing.Index->PageCount > J && 0 == DirInfo; J++)
+        {
+            Page = Listing.Pages[J];
+            for (ULONG K = 0; Page->EntryCount > K; K++)
+                if (0 == DirectoryOffset || FspDirCachePageEntry(Page, K)->NextOffset == DirectoryOffset)
+                {
+                    DirInfo = FspDirCachePageEntry(Page, 0 == DirectoryOffset ? 0 : K + 1);
+                    break;
+                }
+        }
+        ASSERT(0 != DirInfo);
+        DirectoryOffset = dircache_entry_offset(
+            I + ResumeCount < EntryCount ? I + ResumeCount - 1 : EntryCount - 1, Sorted);
+    }
+    QueryPerformanceCounter(&End);
+
+    tlib_printf("%s: %lu ns/resume (linear %lu ns/resume) ",
+        Sorted ? "sorted" : "unsorted",
+        (ULONG)((Linear.QuadPart - Start.QuadPart) * 1000000000 / (Frequency.QuadPart * Resumes)),
+        (ULONG)((End.QuadPart - Linear.QuadPart) * 1000000000 / (Frequency.QuadPart * Resumes)));
+
+    dircache_listing_free(&Listing);
+}
+
+void dircache_bench(void)
+{
+    dircache_bench_dotest(100000, TRUE, 64);
+    dircache_bench_dotest(100000, FALSE, 64);
+}
+
+void dircache_tests(void)
+{
+    TEST(dircache_test);
+    TEST_OPT(dircache_bench);
+}
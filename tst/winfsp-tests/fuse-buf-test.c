@@ -0,0 +1,321 @@
+#include <fuse/fuse_common.h>
+#include <tlib/testsuite.h>
+#include <fcntl.h>
+#include <io.h>
+#include <stdlib.h>
+#include <string.h>
+#include <windows.h>
+
+static struct fuse_bufvec *fuse_buf_alloc(size_t count)
+{
+    struct fuse_bufvec *bufv;
+
+    bufv = calloc(1, sizeof *bufv + (count - 1) * sizeof bufv->buf[0]);
+    ASSERT(0 != bufv);
+    bufv->count = count;
+    for (size_t i = 0; count > i; i++)
+        bufv->buf[i].fd = -1;
+
+    return bufv;
+}
+
+static void fuse_buf_size_test(void)
+{
+    struct fuse_bufvec *bufv;
+
+    bufv = fuse_buf_alloc(3);
+    bufv->buf[0].size = 3;
+    bufv->buf[1].size = 0;
+    bufv->buf[2].size = 7;
+    ASSERT(10 == fuse_buf_size(bufv));
+
+    bufv->buf[1].size = (size_t)-1;
+    ASSERT((size_t)-1 == fuse_buf_size(bufv));
+    free(bufv);
+
+    {
+        struct fuse_bufvec bufv0 = FUSE_BUFVEC_INIT(42);
+        ASSERT(1 == bufv0.count);
+        ASSERT(0 == bufv0.idx);
+        ASSERT(0 == bufv0.off);
+        ASSERT(42 == bufv0.buf[0].size);
+        ASSERT(0 == bufv0.buf[0].flags);
+        ASSERT(0 == bufv0.buf[0].mem);
+        ASSERT(-1 == bufv0.buf[0].fd);
+        ASSERT(42 == fuse_buf_size(&bufv0));
+    }
+}
+
+static void fuse_buf_copy_test(void)
+{
+    struct fuse_bufvec *srcv, *dstv;
+    char src0[] = "abc", src2[] = "defghij";
+    char dst0[4], dst1[10], flat[10];
+
+    /* gather segments of different sizes; empty segments are skipped */
+    srcv = fuse_buf_alloc(3);
+    srcv->buf[0].size = 3;
+    srcv->buf[0].mem = src0;
+    srcv->buf[1].size = 0;
+    srcv->buf[2].size = 7;
+    srcv->buf[2].mem = src2;
+    dstv = fuse_buf_alloc(2);
+    dstv->buf[0].size = sizeof dst0;
+    dstv->buf[0].mem = dst0;
+    dstv->buf[1].size = sizeof dst1;
+    dstv->buf[1].mem = dst1;
+    memset(dst0, 'x', sizeof dst0);
+    memset(dst1, 'x', sizeof dst1);
+    ASSERT(10 == fuse_buf_copy(dstv, srcv, 0));
+    ASSERT(0 == memcmp(dst0, "abcd", 4));
+    ASSERT(0 == memcmp(dst1, "efghijxxxx", 10));
+    ASSERT(3 == srcv->idx);
+    ASSERT(1 == dstv->idx && 6 == dstv->off);
+
+    /* the copy continues where the previous one left off */
+    srcv->idx = 0;
+    srcv->off = 0;
+    ASSERT(4 == fuse_buf_copy(dstv, srcv, 0));
+    ASSERT(0 == memcmp(dst1, "efghijabcd", 10));
+    ASSERT(2 == srcv->idx && 1 == srcv->off);
+    ASSERT(2 == dstv->idx);
+    ASSERT(0 == fuse_buf_copy(dstv, srcv, 0));
+    free(dstv);
+
+    /* short destination */
+    srcv->idx = 0;
+    srcv->off = 0;
+    dstv = fuse_buf_alloc(1);
+    dstv->buf[0].size = 5;
+    dstv->buf[0].mem = flat;
+    ASSERT(5 == fuse_buf_copy(dstv, srcv, 0));
+    ASSERT(0 == memcmp(flat, "abcde", 5));
+    ASSERT(2 == srcv->idx && 2 == srcv->off);
+    free(dstv);
+
+    /* copying a bufvec onto itself copies nothing */
+    srcv->idx = 0;
+    srcv->off = 0;
+    ASSERT(10 == fuse_buf_copy(srcv, srcv, 0));
+    ASSERT(0 == srcv->idx && 0 == srcv->off);
+    free(srcv);
+
+    /* overlapping memory */
+    memcpy(flat, "0123456789", 10);
+    srcv = fuse_buf_alloc(1);
+    srcv->buf[0].size = 6;
+    srcv->buf[0].mem = flat + 2;
+    dstv = fuse_buf_alloc(1);
+    dstv->buf[0].size = 6;
+    dstv->buf[0].mem = flat + 4;
+    ASSERT(6 == fuse_buf_copy(dstv, srcv, 0));
+    ASSERT(0 == memcmp(flat, "0123234567", 10));
+    free(dstv);
+    free(srcv);
+}
+
+static void fuse_buf_fd_test(void)
+{
+    struct fuse_bufvec *srcv, *dstv;
+    int fds[2], fds2[2];
+    char buf[16];
+
+    ASSERT(0 == _pipe(fds, 4096, _O_BINARY));
+    ASSERT(0 == _pipe(fds2, 4096, _O_BINARY));
+
+    /* fd to memory */
+    ASSERT(5 == _write(fds[1], "hello", 5));
+    srcv = fuse_buf_alloc(1);
+    srcv->buf[0].size = 5;
+    srcv->buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_RETRY;
+    srcv->buf[0].fd = fds[0];
+    dstv = fuse_buf_alloc(1);
+    dstv->buf[0].size = sizeof buf;
+    dstv->buf[0].mem = buf;
+    ASSERT(5 == fuse_buf_copy(dstv, srcv, 0));
+    ASSERT(0 == memcmp(buf, "hello", 5));
+    ASSERT(1 == srcv->idx);
+    ASSERT(0 == dstv->idx && 5 == dstv->off);
+    free(dstv);
+    free(srcv);
+
+    /* memory to fd */
+    srcv = fuse_buf_alloc(1);
+    srcv->buf[0].size = 5;
+    srcv->buf[0].mem = "world";
+    dstv = fuse_buf_alloc(1);
+    dstv->buf[0].size = 5;
+    dstv->buf[0].flags = FUSE_BUF_IS_FD;
+    dstv->buf[0].fd = fds[1];
+    ASSERT(5 == fuse_buf_copy(dstv, srcv, 0));
+    ASSERT(5 == _read(fds[0], buf, 5));
+    ASSERT(0 == memcmp(buf, "world", 5));
+    free(dstv);
+    free(srcv);
+
+    /* fd to fd */
+    ASSERT(8 == _write(fds[1], "12345678", 8));
+    srcv = fuse_buf_alloc(1);
+    srcv->buf[0].size = 8;
+    srcv->buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_RETRY;
+    srcv->buf[0].fd = fds[0];
+    dstv = fuse_buf_alloc(1);
+    dstv->buf[0].size = 8;
+    dstv->buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_RETRY;
+    dstv->buf[0].fd = fds2[1];
+    ASSERT(8 == fuse_buf_copy(dstv, srcv, 0));
+    ASSERT(8 == _read(fds2[0], buf, 8));
+    ASSERT(0 == memcmp(buf, "12345678", 8));
+    free(dstv);
+    free(srcv);
+
+    /* an environment without fd support fails the copy */
+    {
+        struct fsp_fuse_env env = *fsp_fuse_env();
+        env.fdread = 0;
+        ASSERT(5 == _write(fds[1], "hello", 5));
+        srcv = fuse_buf_alloc(1);
+        srcv->buf[0].size = 5;
+        srcv->buf[0].flags = FUSE_BUF_IS_FD;
+        srcv->buf[0].fd = fds[0];
+        dstv = fuse_buf_alloc(1);
+        dstv->buf[0].size = sizeof buf;
+        dstv->buf[0].mem = buf;
+        ASSERT(-EINVAL == FSP_FUSE_API_CALL(fsp_fuse_buf_copy)(&env, dstv, srcv, 0));
+        ASSERT(5 == _read(fds[0], buf, 5));
+        free(dstv);
+        free(srcv);
+    }
+
+    _close(fds2[1]);
+    _close(fds2[0]);
+    _close(fds[1]);
+    _close(fds[0]);
+}
+
+enum
+{
+    fuse_buf_bench_read,                /* read: file system copies into flat buffer */
+    fuse_buf_bench_read_buf_bounce,     /* read_buf flattened into a temporary buffer */
+    fuse_buf_bench_read_buf,            /* read_buf gathered into the request buffer */
+    fuse_buf_bench_write,               /* write: file system copies from flat buffer */
+    fuse_buf_bench_write_buf,           /* write_buf: request buffer handed over */
+};
+
+static void fuse_buf_bench_dotest(const char *Name, int Mode,
+    ULONG ChunkSize, ULONG RequestSize, ULONG TotalSize)
+{
+    /*
+     * benchmark: a file system keeps file data in ChunkSize chunks of its own memory;
+     * transfer TotalSize bytes in RequestSize requests and count the bytes copied by
+     * the file system and the FUSE layer for every MiB transferred
+     */
+    ULONG CacheSize = 16 * 1024 * 1024, ChunkCount = RequestSize / ChunkSize;
+    char *Cache, *Request, *Bounce;
+    struct fuse_bufvec *bufv, reqv;
+    UINT64 Copied = 0;
+    fuse_ssize_t Bytes;
+    LARGE_INTEGER Frequency, Start, End;
+
+    Cache = malloc(CacheSize);
+    Request = malloc(RequestSize);
+    Bounce = malloc(RequestSize);
+    ASSERT(0 != Cache && 0 != Request && 0 != Bounce);
+    for (ULONG I = 0; CacheSize > I; I++)
+        Cache[I] = (char)(I * 7 + I / 4093);
+
+    QueryPerformanceFrequency(&Frequency);
+    QueryPerformanceCounter(&Start);
+    for (ULONG Offset = 0; TotalSize > Offset; Offset += RequestSize)
+    {
+        char *Data = Cache + Offset % CacheSize;
+
+        reqv = FUSE_BUFVEC_INIT(RequestSize);
+        reqv.buf[0].mem = Request;
+
+        switch (Mode)
+        {
+        case fuse_buf_bench_read:
+            for (ULONG I = 0; ChunkCount > I; I++)
+                memcpy(Request + I * ChunkSize, Data + I * ChunkSize, ChunkSize);
+            Copied += RequestSize;
+            break;
+        case fuse_buf_bench_read_buf_bounce:
+        case fuse_buf_bench_read_buf:
+            /* the file system returns a bufvec that points to its chunks */
+            bufv = fuse_buf_alloc(ChunkCount);
+            for (ULONG I = 0; ChunkCount > I; I++)
+            {
+                bufv->buf[I].size = ChunkSize;
+                bufv->buf[I].mem = Data + I * ChunkSize;
+            }
+            if (fuse_buf_bench_read_buf_bounce == Mode)
+            {
+                struct fuse_bufvec bouncev = FUSE_BUFVEC_INIT(RequestSize);
+                bouncev.buf[0].mem = Bounce;
+                Bytes = fuse_buf_copy(&bouncev, bufv, 0);
+                ASSERT(RequestSize == Bytes);
+                memcpy(Request, Bounce, RequestSize);
+                Copied += Bytes + RequestSize;
+            }
+            else
+            {
+                Bytes = fuse_buf_copy(&reqv, bufv, 0);
+                ASSERT(RequestSize == Bytes);
+                Copied += Bytes;
+            }
+            free(bufv);
+            break;
+        case fuse_buf_bench_write:
+            for (ULONG I = 0; ChunkCount > I; I++)
+                memcpy(Data + I * ChunkSize, Request + I * ChunkSize, ChunkSize);
+            Copied += RequestSize;
+            break;
+        case fuse_buf_bench_write_buf:
+            /* the file system scatters the request buffer into its chunks */
+            bufv = fuse_buf_alloc(ChunkCount);
+            for (ULONG I = 0; ChunkCount > I; I++)
+            {
+                bufv->buf[I].size = ChunkSize;
+                bufv->buf[I].mem = Data + I * ChunkSize;
+            }
+            Bytes = fuse_buf_copy(bufv, &reqv, 0);
+            ASSERT(RequestSize == Bytes);
+            Copied += Bytes;
+            free(bufv);
+            break;
+        }
+    }
+    QueryPerformanceCounter(&End);
+
+    if (fuse_buf_bench_write > Mode)
+        ASSERT(0 == memcmp(Request, Cache + (TotalSize - RequestSize) % CacheSize, RequestSize));
+
+    tlib_printf("%s: copied=%lu bytes/MiB time=%lums ",
+        Name,
+        (ULONG)(Copied / (TotalSize / (1024 * 1024))),
+        (ULONG)((End.QuadPart - Start.QuadPart) * 1000 / Frequency.QuadPart));
+
+    free(Bounce);
+    free(Request);
+    free(Cache);
+}
+
+static void fuse_buf_bench(void)
+{
+    ULONG TotalSize = 1024 * 1024 * 1024;
+
+    fuse_buf_bench_dotest("read", fuse_buf_bench_read, 4096, 65536, TotalSize);
+    fuse_buf_bench_dotest("read_buf/bounce", fuse_buf_bench_read_buf_bounce, 4096, 65536, TotalSize);
+    fuse_buf_bench_dotest("read_buf", fuse_buf_bench_read_buf, 4096, 65536, TotalSize);
+    fuse_buf_bench_dotest("write", fuse_buf_bench_write, 4096, 65536, TotalSize);
+    fuse_buf_bench_dotest("write_buf", fuse_buf_bench_write_buf, 4096, 65536, TotalSize);
+}
+
+void fuse_buf_tests(void)
+{
+    TEST(fuse_buf_size_test);
+    TEST(fuse_buf_copy_test);
+    TEST(fuse_buf_fd_test);
+    TEST_OPT(fuse_buf_bench);
+}
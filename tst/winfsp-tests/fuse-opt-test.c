@@ -1,3 +1,4 @@
+#include <fuse/fuse.h>
 #include <fuse/fuse_opt.h>
 #include <tlib/testsuite.h>
 #include <stddef.h>
@@ -349,7 +350,20 @@ void fuse_opt_parse_test(void)
     free(data.esc);
 }
 
+void fuse_opt_lib_option_test(void)
+{
+    ASSERT(fuse_is_lib_option("ThreadCount=4"));
+    ASSERT(fuse_is_lib_option("OpGuardStrategy=fine"));
+    ASSERT(fuse_is_lib_option("OpGuardStrategy=coarse"));
+    ASSERT(fuse_is_lib_option("OpGuardStrategy=striped"));
+    ASSERT(fuse_is_lib_option("OpGuardStrategy=none"));
+    ASSERT(!fuse_is_lib_option("OpGuardStrategy=bogus"));
+    ASSERT(fuse_is_lib_option("IrpCapacity=100"));
+    ASSERT(fuse_is_lib_option("TransactTimeout=1000"));
+}
+
 void fuse_opt_tests(void)
 {
     TEST(fuse_opt_parse_test);
+    TEST(fuse_opt_lib_option_test);
 }
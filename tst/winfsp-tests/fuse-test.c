@@ -0,0 +1,210 @@
+#include <fuse/fuse.h>
+#include <fuse/fuse_opt.h>
+#include <tlib/testsuite.h>
+#include <process.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <windows.h>
+
+extern int WinFspDiskTests;
+
+#define fuse_readdir_count              100
+
+static struct
+{
+    LONG Getattr[fuse_readdir_count];
+    LONG ContextErrors;
+} fuse_readdir_data;
+
+static int fuse_readdir_getattr(const char *path, struct fuse_stat *stbuf)
+{
+    struct fuse_context *context = fuse_get_context();
+    unsigned long i;
+    char *endp;
+
+    /* getattr's issued on behalf of readdir must run in the reading thread's context */
+    if (0 == context || 0 == context->fuse || &fuse_readdir_data != context->private_data)
+        InterlockedIncrement(&fuse_readdir_data.ContextErrors);
+
+    memset(stbuf, 0, sizeof *stbuf);
+    if (0 == strcmp("/", path))
+    {
+        stbuf->st_mode = 0040000 | 0777;
+        stbuf->st_nlink = 2;
+        return 0;
+    }
+
+    if (0 != strncmp("/file", path, 5))
+        return -ENOENT;
+    i = strtoul(path + 5, &endp, 10);
+    if ('\0' != *endp || fuse_readdir_count <= i)
+        return -ENOENT;
+
+    InterlockedIncrement(&fuse_readdir_data.Getattr[i]);
+
+    stbuf->st_mode = 0100000 | 0666;
+    stbuf->st_nlink = 1;
+    stbuf->st_size = i;
+    return 0;
+}
+
+static int fuse_readdir_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+    fuse_off_t off, struct fuse_file_info *fi)
+{
+    struct fuse_stat stbuf;
+    char name[32];
+
+    if (0 != strcmp("/", path))
+        return -ENOENT;
+
+    filler(buf, ".", 0, 0);
+    filler(buf, "..", 0, 0);
+    for (unsigned long i = 0; fuse_readdir_count > i; i++)
+    {
+        /* stat data is only authoritative with readdir_plus */
+        memset(&stbuf, 0, sizeof stbuf);
+        stbuf.st_mode = 0100000 | 0666;
+        stbuf.st_nlink = 1;
+        sprintf(name, "file%lu", i);
+        filler(buf, name, &stbuf, 0);
+    }
+
+    return 0;
+}
+
+static unsigned __stdcall fuse_readdir_loop(void *f)
+{
+    return fuse_loop_mt(f);
+}
+
+static LONG fuse_readdir_pool_errors;
+static LONG fuse_readdir_pool_pending;
+static HANDLE fuse_readdir_pool_event;
+
+static VOID CALLBACK fuse_readdir_pool_work(PTP_CALLBACK_INSTANCE Instance, PVOID Context)
+{
+    struct fuse_context *context = fuse_get_context();
+
+    /* a thread pool thread that prefetched must not keep the file system's context */
+    if (0 == context || 0 != context->fuse || 0 != context->private_data)
+        InterlockedIncrement(&fuse_readdir_pool_errors);
+
+    Sleep(1);
+
+    if (0 == InterlockedDecrement(&fuse_readdir_pool_pending))
+        SetEvent(fuse_readdir_pool_event);
+}
+
+static void fuse_readdir_dotest(const char *opts, LONG ExpectGetattr, BOOLEAN CheckPool)
+{
+    static struct fuse_operations ops =
+    {
+        .getattr = fuse_readdir_getattr,
+        .readdir = fuse_readdir_readdir,
+    };
+    char *argv[] = { "winfsp-tests", "-o", (char *)opts, 0 };
+    struct fuse_args args = FUSE_ARGS_INIT(0 != opts ? 3 : 1, argv);
+    char mountpoint[3] = "?:";
+    WCHAR RootPath[] = L"?:\\", FilePath[] = L"?:\\*";
+    struct fuse_chan *ch;
+    struct fuse *f;
+    HANDLE Thread, Handle;
+    WIN32_FIND_DATAW FindData;
+    DWORD Drives;
+    ULONG Entries;
+    unsigned long i;
+    BOOL Success;
+
+    memset(&fuse_readdir_data, 0, sizeof fuse_readdir_data);
+
+    Drives = GetLogicalDrives();
+    for (mountpoint[0] = 'Z'; 'D' <= mountpoint[0]; mountpoint[0]--)
+        if (0 == (Drives & (1 << (mountpoint[0] - 'A'))))
+            break;
+    ASSERT('D' <= mountpoint[0]);
+    RootPath[0] = FilePath[0] = mountpoint[0];
+
+    ch = fuse_mount(mountpoint, &args);
+    ASSERT(0 != ch);
+    f = fuse_new(ch, &args, &ops, sizeof ops, &fuse_readdir_data);
+    ASSERT(0 != f);
+
+    Thread = (HANDLE)_beginthreadex(0, 0, fuse_readdir_loop, f, 0, 0);
+    ASSERT(0 != Thread);
+
+    /* wait for the file system to mount */
+    for (i = 0; 1000 > i; i++)
+    {
+        if (INVALID_FILE_ATTRIBUTES != GetFileAttributesW(RootPath))
+            break;
+        Sleep(10);
+    }
+    ASSERT(1000 > i);
+
+    Entries = 0;
+    Handle = FindFirstFileW(FilePath, &FindData);
+    ASSERT(INVALID_HANDLE_VALUE != Handle);
+    do
+    {
+        if (0 == wcsncmp(L"file", FindData.cFileName, 4))
+        {
+            i = wcstoul(FindData.cFileName + 4, 0, 10);
+            ASSERT(fuse_readdir_count > i);
+            ASSERT(i == FindData.nFileSizeLow);
+            Entries++;
+        }
+    } while (FindNextFileW(Handle, &FindData));
+    ASSERT(ERROR_NO_MORE_FILES == GetLastError());
+    Success = FindClose(Handle);
+    ASSERT(Success);
+
+    ASSERT(fuse_readdir_count == Entries);
+    for (i = 0; fuse_readdir_count > i; i++)
+        ASSERT(ExpectGetattr == fuse_readdir_data.Getattr[i]);
+    ASSERT(0 == fuse_readdir_data.ContextErrors);
+
+    if (CheckPool)
+    {
+        fuse_readdir_pool_errors = 0;
+        fuse_readdir_pool_pending = 64;
+        fuse_readdir_pool_event = CreateEventW(0, TRUE, FALSE, 0);
+        ASSERT(0 != fuse_readdir_pool_event);
+        for (i = 0; 64 > i; i++)
+        {
+            Success = TrySubmitThreadpoolCallback(fuse_readdir_pool_work, 0, 0);
+            ASSERT(Success);
+        }
+        WaitForSingleObject(fuse_readdir_pool_event, INFINITE);
+        CloseHandle(fuse_readdir_pool_event);
+        ASSERT(0 == fuse_readdir_pool_errors);
+    }
+
+    fuse_exit(f);
+    WaitForSingleObject(Thread, INFINITE);
+    CloseHandle(Thread);
+
+    fuse_destroy(f);
+    fuse_unmount(mountpoint, ch);
+    fuse_opt_free_args(&args);
+}
+
+static void fuse_readdir_test(void)
+{
+    if (WinFspDiskTests)
+    {
+        /* without readdir_plus every entry needs exactly one getattr */
+        fuse_readdir_dotest(0, 1, FALSE);
+        /* parallel getattr's are opt-in; they must not duplicate the serial ones */
+        fuse_readdir_dotest("ReaddirPrefetch", 1, TRUE);
+        fuse_readdir_dotest("ReaddirPrefetch,ThreadCount=1", 1, TRUE);
+        /* readdir_plus stat data is complete: no getattr's */
+        fuse_readdir_dotest("readdir_plus", 0, FALSE);
+        fuse_readdir_dotest("readdir_plus,ReaddirPrefetch", 0, FALSE);
+    }
+}
+
+void fuse_tests(void)
+{
+    TEST(fuse_readdir_test);
+}
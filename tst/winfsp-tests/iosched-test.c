@@ -0,0 +1,314 @@
+#include <winfsp/winfsp.h>
+#include <shared/iosched.h>
+#include <tlib/testsuite.h>
+
+typedef struct
+{
+    LIST_ENTRY ListEntry;
+    ULONG Class, Flow, Cost;
+    ULONG Id;
+    ULONG Arrival;
+} IOSCHED_TEST_ENTRY;
+
+static ULONG iosched_cost(PLIST_ENTRY Entry, PVOID Context)
+{
+    return CONTAINING_RECORD(Entry, IOSCHED_TEST_ENTRY, ListEntry)->Cost;
+}
+
+static void iosched_insert(FSP_IO_SCHED *Sched, IOSCHED_TEST_ENTRY *Entry,
+    ULONG Class, ULONG Flow, ULONG Cost, ULONG Id)
+{
+    Entry->Class = Class;
+    Entry->Flow = Flow;
+    Entry->Cost = Cost;
+    Entry->Id = Id;
+    FspIoSchedInsert(Sched, &Entry->ListEntry, Class, Flow);
+}
+
+static ULONG iosched_dequeue(FSP_IO_SCHED *Sched)
+{
+    PLIST_ENTRY ListEntry = FspIoSchedSelect(Sched, iosched_cost, 0);
+    IOSCHED_TEST_ENTRY *Entry;
+    if (0 == ListEntry)
+        return 0;
+    Entry = CONTAINING_RECORD(ListEntry, IOSCHED_TEST_ENTRY, ListEntry);
+    FspIoSchedRemove(Sched, ListEntry, Entry->Class, Entry->Flow);
+    return Entry->Id;
+}
+
+void iosched_test(void)
+{
+    static const ULONG Weights[FspIoSchedClassCount] = { 2, 1, 1 };
+    FSP_IO_SCHED Sched;
+    IOSCHED_TEST_ENTRY Entries[8];
+    PLIST_ENTRY ListEntry;
+    ULONG Count;
+
+    /* flows of a class are served round-robin; each flow is FIFO */
+    FspIoSchedInitialize(&Sched, Weights, 1);
+    ASSERT(0 == FspIoSchedSelect(&Sched, iosched_cost, 0));
+    ASSERT(0 == FspIoSchedNext(&Sched, 0));
+    iosched_insert(&Sched, &Entries[0], FspIoSchedMetadataClass, 1, 1, 11);
+    iosched_insert(&Sched, &Entries[1], FspIoSchedMetadataClass, 1, 1, 12);
+    iosched_insert(&Sched, &Entries[2], FspIoSchedMetadataClass, 1, 1, 13);
+    iosched_insert(&Sched, &Entries[3], FspIoSchedMetadataClass, 2, 1, 21);
+    ASSERT(4 == FspIoSchedCount(&Sched));
+    ASSERT(11 == iosched_dequeue(&Sched));
+    ASSERT(21 == iosched_dequeue(&Sched));
+    ASSERT(12 == iosched_dequeue(&Sched));
+    ASSERT(13 == iosched_dequeue(&Sched));
+    ASSERT(0 == iosched_dequeue(&Sched));
+
+    /* classes are served weighted round-robin */
+    FspIoSchedInitialize(&Sched, Weights, 1);
+    iosched_insert(&Sched, &Entries[0], FspIoSchedDataClass, 0, 1, 51);
+    iosched_insert(&Sched, &Entries[1], FspIoSchedDataClass, 0, 1, 52);
+    iosched_insert(&Sched, &Entries[2], FspIoSchedMetadataClass, 0, 1, 41);
+    iosched_insert(&Sched, &Entries[3], FspIoSchedPagingClass, 0, 1, 31);
+    iosched_insert(&Sched, &Entries[4], FspIoSchedPagingClass, 0, 1, 32);
+    iosched_insert(&Sched, &Entries[5], FspIoSchedPagingClass, 0, 1, 33);
+    iosched_insert(&Sched, &Entries[6], FspIoSchedPagingClass, 0, 1, 34);
+    ASSERT(31 == iosched_dequeue(&Sched));
+    ASSERT(32 == iosched_dequeue(&Sched));
+    ASSERT(41 == iosched_dequeue(&Sched));
+    ASSERT(51 == iosched_dequeue(&Sched));
+    ASSERT(33 == iosched_dequeue(&Sched));
+    ASSERT(34 == iosched_dequeue(&Sched));
+    ASSERT(52 == iosched_dequeue(&Sched));
+    ASSERT(0 == FspIoSchedCount(&Sched));
+
+    /* an expensive entry waits until its flow has accumulated enough deficit */
+    FspIoSchedInitialize(&Sched, Weights, 2);
+    iosched_insert(&Sched, &Entries[0], FspIoSchedDataClass, 1, 5, 11);
+    iosched_insert(&Sched, &Entries[1], FspIoSchedDataClass, 1, 1, 12);
+    iosched_insert(&Sched, &Entries[2], FspIoSchedDataClass, 2, 1, 21);
+    iosched_insert(&Sched, &Entries[3], FspIoSchedDataClass, 2, 1, 22);
+    iosched_insert(&Sched, &Entries[4], FspIoSchedDataClass, 2, 1, 23);
+    iosched_insert(&Sched, &Entries[5], FspIoSchedDataClass, 2, 1, 24);
+    ASSERT(21 == iosched_dequeue(&Sched));
+    ASSERT(22 == iosched_dequeue(&Sched));
+    ASSERT(23 == iosched_dequeue(&Sched));
+    ASSERT(24 == iosched_dequeue(&Sched));
+    ASSERT(11 == iosched_dequeue(&Sched));
+    ASSERT(12 == iosched_dequeue(&Sched));
+
+    /* selecting is repeatable; removing an entry that was not selected does not charge it */
+    FspIoSchedInitialize(&Sched, Weights, 1);
+    iosched_insert(&Sched, &Entries[0], FspIoSchedMetadataClass, 1, 1, 11);
+    iosched_insert(&Sched, &Entries[1], FspIoSchedMetadataClass, 1, 1, 12);
+    iosched_insert(&Sched, &Entries[2], FspIoSchedMetadataClass, 2, 1, 21);
+    ListEntry = FspIoSchedSelect(&Sched, iosched_cost, 0);
+    ASSERT(&Entries[0].ListEntry == ListEntry);
+    ASSERT(ListEntry == FspIoSchedSelect(&Sched, iosched_cost, 0));
+    FspIoSchedRemove(&Sched, &Entries[2].ListEntry, FspIoSchedMetadataClass, 2);
+    ASSERT(1 == Sched.Classes[FspIoSchedMetadataClass].Flows[1].Deficit);
+    ASSERT(11 == iosched_dequeue(&Sched));
+    ASSERT(0 == Sched.Classes[FspIoSchedMetadataClass].Flows[1].Deficit);
+    ASSERT(12 == iosched_dequeue(&Sched));
+
+    /* a selection continues past an entry that is not removed (e.g. because it is canceled) */
+    FspIoSchedInitialize(&Sched, Weights, 1);
+    iosched_insert(&Sched, &Entries[0], FspIoSchedMetadataClass, 2, 1, 21);
+    iosched_insert(&Sched, &Entries[1], FspIoSchedMetadataClass, 1, 1, 11);
+    iosched_insert(&Sched, &Entries[2], FspIoSchedMetadataClass, 1, 1, 12);
+    iosched_insert(&Sched, &Entries[3], FspIoSchedDataClass, 0, 1, 31);
+    ListEntry = FspIoSchedSelect(&Sched, iosched_cost, 0);
+    ASSERT(&Entries[0].ListEntry == ListEntry);
+    Count = 0;
+    while (0 != (ListEntry = FspIoSchedSelectNext(&Sched, ListEntry)))
+    {
+        /* every other entry exactly once, wrapping around at the end of the enumeration */
+        ASSERT(&Entries[0].ListEntry != ListEntry);
+        Count = Count * 100 + CONTAINING_RECORD(ListEntry, IOSCHED_TEST_ENTRY, ListEntry)->Id;
+    }
+    ASSERT(311112 == Count);
+    ListEntry = FspIoSchedSelectNext(&Sched, &Entries[0].ListEntry);
+    ASSERT(&Entries[3].ListEntry == ListEntry);
+    FspIoSchedRemove(&Sched, ListEntry, FspIoSchedDataClass, 0);
+    ASSERT(1 == Sched.Classes[FspIoSchedMetadataClass].Flows[2].Deficit);
+    ASSERT(21 == iosched_dequeue(&Sched));
+    ASSERT(11 == iosched_dequeue(&Sched));
+    ASSERT(12 == iosched_dequeue(&Sched));
+
+    /* enumeration visits every entry of every class and flow */
+    FspIoSchedInitialize(&Sched, Weights, 1);
+    for (ULONG I = 0; 8 > I; I++)
+        iosched_insert(&Sched, &Entries[I], I % FspIoSchedClassCount, I % 3 * 7, 1, I + 1);
+    Count = 0;
+    for (ListEntry = FspIoSchedNext(&Sched, 0); 0 != ListEntry;
+        ListEntry = FspIoSchedNext(&Sched, ListEntry))
+        Count += CONTAINING_RECORD(ListEntry, IOSCHED_TEST_ENTRY, ListEntry)->Id;
+    ASSERT(1 + 2 + 3 + 4 + 5 + 6 + 7 + 8 == Count);
+    for (Count = 0; 0 != iosched_dequeue(&Sched); Count++)
+        ;
+    ASSERT(8 == Count);
+    ASSERT(0 == FspIoSchedNext(&Sched, 0));
+}
+
+/*
+ * Deterministic simulation of a file system that serves one request at a time; a request
+ * occupies the file system for as many ticks as its cost. The load is a process streaming
+ * 1MB writes (64 outstanding), the lazy writer issuing 256K paging writes, a process
+ * issuing 4K reads (4 outstanding) and an interactive process opening files. We compare
+ * request latencies when the pending queue is FIFO and when it is scheduled.
+ */
+enum
+{
+    iosched_sim_writer = 0,
+    iosched_sim_lazy_writer,
+    iosched_sim_reader,
+    iosched_sim_opener,
+    iosched_sim_process_count,
+    iosched_sim_entry_count = 256,
+    iosched_sim_duration = 200000,
+};
+static struct
+{
+    IOSCHED_TEST_ENTRY Entries[iosched_sim_entry_count];
+    IOSCHED_TEST_ENTRY *FreeList[iosched_sim_entry_count];
+    ULONG FreeCount;
+    BOOLEAN Fifo;
+    FSP_IO_SCHED Sched;
+    LIST_ENTRY FifoList;
+    ULONG Completed[iosched_sim_process_count];
+    UINT64 TotalLatency[iosched_sim_process_count];
+    ULONG MaxLatency[iosched_sim_process_count];
+} iosched_sim;
+
+static void iosched_sim_submit(ULONG Process, ULONG Now)
+{
+    static const ULONG Classes[] =
+        { FspIoSchedDataClass, FspIoSchedPagingClass, FspIoSchedDataClass, FspIoSchedMetadataClass };
+    static const ULONG Costs[] = { 1 + 16, 1 + 4, 1, 1 };
+    IOSCHED_TEST_ENTRY *Entry;
+
+    ASSERT(0 != iosched_sim.FreeCount);
+    Entry = iosched_sim.FreeList[--iosched_sim.FreeCount];
+    Entry->Class = Classes[Process];
+    Entry->Flow = Process * 5;
+    Entry->Cost = Costs[Process];
+    Entry->Id = Process;
+    Entry->Arrival = Now;
+    if (iosched_sim.Fifo)
+        FspIoSchedListInsertTail(&iosched_sim.FifoList, &Entry->ListEntry);
+    else
+        FspIoSchedInsert(&iosched_sim.Sched, &Entry->ListEntry, Entry->Class, Entry->Flow);
+}
+
+static IOSCHED_TEST_ENTRY *iosched_sim_next(void)
+{
+    PLIST_ENTRY ListEntry;
+    IOSCHED_TEST_ENTRY *Entry;
+
+    if (iosched_sim.Fifo)
+    {
+        ListEntry = iosched_sim.FifoList.Flink;
+        if (&iosched_sim.FifoList == ListEntry)
+            return 0;
+        FspIoSchedListRemove(ListEntry);
+        return CONTAINING_RECORD(ListEntry, IOSCHED_TEST_ENTRY, ListEntry);
+    }
+
+    ListEntry = FspIoSchedSelect(&iosched_sim.Sched, iosched_cost, 0);
+    if (0 == ListEntry)
+        return 0;
+    Entry = CONTAINING_RECORD(ListEntry, IOSCHED_TEST_ENTRY, ListEntry);
+    FspIoSchedRemove(&iosched_sim.Sched, ListEntry, Entry->Class, Entry->Flow);
+    return Entry;
+}
+
+static void iosched_sim_run(BOOLEAN Fifo)
+{
+    static const ULONG Weights[FspIoSchedClassCount] = { 4, 2, 1 };
+    IOSCHED_TEST_ENTRY *Entry = 0;
+    ULONG Busy = 0, Latency;
+
+    memset(&iosched_sim, 0, sizeof iosched_sim);
+    for (ULONG I = 0; iosched_sim_entry_count > I; I++)
+        iosched_sim.FreeList[iosched_sim.FreeCount++] = &iosched_sim.Entries[I];
+    iosched_sim.Fifo = Fifo;
+    FspIoSchedInitialize(&iosched_sim.Sched, Weights, 4);
+    iosched_sim.FifoList.Flink = iosched_sim.FifoList.Blink = &iosched_sim.FifoList;
+
+    /* closed loop processes start with all their requests outstanding */
+    for (ULONG I = 0; 64 > I; I++)
+        iosched_sim_submit(iosched_sim_writer, 0);
+    for (ULONG I = 0; 4 > I; I++)
+        iosched_sim_submit(iosched_sim_reader, 0);
+
+    for (ULONG Now = 0; iosched_sim_duration > Now; Now++)
+    {
+        /* open loop processes */
+        if (0 == Now % 100)
+            iosched_sim_submit(iosched_sim_lazy_writer, Now);
+        if (0 == Now % 50)
+            iosched_sim_submit(iosched_sim_opener, Now);
+
+        if (0 != Entry && Busy == Now)
+        {
+            Latency = Now - Entry->Arrival;
+            iosched_sim.Completed[Entry->Id]++;
+            iosched_sim.TotalLatency[Entry->Id] += Latency;
+            if (iosched_sim.MaxLatency[Entry->Id] < Latency)
+                iosched_sim.MaxLatency[Entry->Id] = Latency;
+            iosched_sim.FreeList[iosched_sim.FreeCount++] = Entry;
+            if (iosched_sim_writer == Entry->Id || iosched_sim_reader == Entry->Id)
+                iosched_sim_submit(Entry->Id, Now);
+            Entry = 0;
+        }
+        if (0 == Entry)
+        {
+            Entry = iosched_sim_next();
+            if (0 != Entry)
+                Busy = Now + Entry->Cost;
+        }
+    }
+}
+
+static void iosched_sim_print(const char *Name)
+{
+    static const char *ProcessNames[] = { "writer", "lazy", "reader", "opener" };
+    tlib_printf("%s:", Name);
+    for (ULONG I = 0; iosched_sim_process_count > I; I++)
+        tlib_printf(" %s=%lu/%lu/%lu", ProcessNames[I],
+            iosched_sim.Completed[I],
+            (ULONG)(0 != iosched_sim.Completed[I] ?
+                iosched_sim.TotalLatency[I] / iosched_sim.Completed[I] : 0),
+            iosched_sim.MaxLatency[I]);
+    tlib_printf(" ");
+}
+
+void iosched_latency_test(void)
+{
+    /* completed/average latency/max latency (in ticks) per process */
+    ULONG FifoMaxLatency[iosched_sim_process_count], FifoCompleted[iosched_sim_process_count];
+
+    iosched_sim_run(TRUE);
+    iosched_sim_print("fifo");
+    memcpy(FifoMaxLatency, iosched_sim.MaxLatency, sizeof FifoMaxLatency);
+    memcpy(FifoCompleted, iosched_sim.Completed, sizeof FifoCompleted);
+
+    iosched_sim_run(FALSE);
+    iosched_sim_print("sched");
+
+    /*
+     * FIFO: every request waits behind the writer's 64 outstanding writes. Scheduled:
+     * an open waits for at most one turn of the paging and data classes and the writer
+     * and the reader share the time that the file system spends on data I/O.
+     */
+    ASSERT(1000 < FifoMaxLatency[iosched_sim_opener]);
+    ASSERT(1000 < FifoMaxLatency[iosched_sim_reader]);
+    ASSERT(4 * 5 + 17 + 17 >= iosched_sim.MaxLatency[iosched_sim_opener]);
+    ASSERT(100 > iosched_sim.MaxLatency[iosched_sim_reader]);
+    ASSERT(100 > iosched_sim.MaxLatency[iosched_sim_lazy_writer]);
+    ASSERT(FifoCompleted[iosched_sim_reader] * 10 < iosched_sim.Completed[iosched_sim_reader]);
+    ASSERT(iosched_sim_duration / 3 < iosched_sim.Completed[iosched_sim_writer] * 17);
+    ASSERT(iosched_sim_duration / 3 < iosched_sim.Completed[iosched_sim_reader]);
+    ASSERT(iosched_sim_duration / 50 - 1 <= iosched_sim.Completed[iosched_sim_opener]);
+}
+
+void iosched_tests(void)
+{
+    TEST(iosched_test);
+    TEST(iosched_latency_test);
+}
@@ -1,10 +1,13 @@
 #include <winfsp/winfsp.h>
 #include <tlib/testsuite.h>
 #include <process.h>
+#include <psapi.h>
+#include <strsafe.h>
 #include "memfs.h"
 
 extern int WinFspDiskTests;
 extern int WinFspNetTests;
+extern ULONG MemfsTestFlags;
 
 void *memfs_start_ex(ULONG Flags, ULONG FileInfoTimeout)
 {
@@ -14,8 +17,8 @@ void *memfs_start_ex(ULONG Flags, ULONG FileInfoTimeout)
     MEMFS *Memfs;
     NTSTATUS Result;
 
-    Result = MemfsCreate(Flags, FileInfoTimeout, 1024, 1024 * 1024,
-        MemfsNet == Flags ? L"\\memfs\\share" : 0, 0, &Memfs);
+    Result = MemfsCreate(Flags | MemfsTestFlags, FileInfoTimeout, 1024, 1024 * 1024,
+        (Flags & MemfsNet) ? L"\\memfs\\share" : 0, 0, &Memfs);
     ASSERT(NT_SUCCESS(Result));
     ASSERT(0 != Memfs);
 
@@ -63,7 +66,500 @@ void memfs_test(void)
         memfs_dotest(MemfsNet);
 }
 
+void memfs_dispatcher_dotest(ULONG Flags, PWSTR Prefix, ULONG DispatcherFlags)
+{
+    MEMFS *Memfs;
+    NTSTATUS Result;
+    HANDLE Handle;
+    BOOL Success;
+    WCHAR FilePath[MAX_PATH];
+    char Buffer[16];
+    DWORD BytesTransferred;
+
+    Result = MemfsCreate(Flags | MemfsTestFlags, 1000, 1024, 1024 * 1024,
+        (Flags & MemfsNet) ? L"\\memfs\\share" : 0, 0, &Memfs);
+    ASSERT(NT_SUCCESS(Result));
+    ASSERT(0 != Memfs);
+
+    Result = FspFileSystemStartDispatcherEx(MemfsFileSystem(Memfs), 0,
+        FSP_FILE_SYSTEM_DISPATCHER_BATCH | FSP_FILE_SYSTEM_DISPATCHER_EXECUTOR);
+    ASSERT(STATUS_INVALID_PARAMETER == Result);
+    Result = FspFileSystemStartDispatcherEx(MemfsFileSystem(Memfs), 0, 0x80000000);
+    ASSERT(STATUS_INVALID_PARAMETER == Result);
+
+    Result = FspFileSystemStartDispatcherEx(MemfsFileSystem(Memfs), 0, DispatcherFlags);
+    ASSERT(NT_SUCCESS(Result));
+
+    for (ULONG I = 0; 100 > I; I++)
+    {
+        StringCbPrintfW(FilePath, sizeof FilePath, L"%s%s\\file%u",
+            Prefix ? L"" : L"\\\\?\\GLOBALROOT", Prefix ? Prefix : MemfsFileSystem(Memfs)->VolumeName,
+            I);
+
+        Handle = CreateFileW(FilePath,
+            GENERIC_READ | GENERIC_WRITE, 0, 0, CREATE_NEW, FILE_FLAG_DELETE_ON_CLOSE, 0);
+        ASSERT(INVALID_HANDLE_VALUE != Handle);
+
+        Success = WriteFile(Handle, "Hello, world!", 13, &BytesTransferred, 0);
+        ASSERT(Success);
+        ASSERT(13 == BytesTransferred);
+
+        ASSERT(0 == SetFilePointer(Handle, 0, 0, FILE_BEGIN));
+
+        Success = ReadFile(Handle, Buffer, sizeof Buffer, &BytesTransferred, 0);
+        ASSERT(Success);
+        ASSERT(13 == BytesTransferred);
+        ASSERT(0 == memcmp(Buffer, "Hello, world!", 13));
+
+        Success = CloseHandle(Handle);
+        ASSERT(Success);
+
+        Handle = CreateFileW(FilePath,
+            GENERIC_READ, 0, 0, OPEN_EXISTING, 0, 0);
+        ASSERT(INVALID_HANDLE_VALUE == Handle);
+        ASSERT(ERROR_FILE_NOT_FOUND == GetLastError());
+    }
+
+    MemfsStop(Memfs);
+    MemfsDelete(Memfs);
+}
+
+void memfs_batch_test(void)
+{
+    if (WinFspDiskTests)
+        memfs_dispatcher_dotest(MemfsDisk, 0, FSP_FILE_SYSTEM_DISPATCHER_BATCH);
+    if (WinFspNetTests)
+        memfs_dispatcher_dotest(MemfsNet, L"\\\\memfs\\share", FSP_FILE_SYSTEM_DISPATCHER_BATCH);
+}
+
+void memfs_executor_test(void)
+{
+    if (WinFspDiskTests)
+        memfs_dispatcher_dotest(MemfsDisk, 0, FSP_FILE_SYSTEM_DISPATCHER_EXECUTOR);
+    if (WinFspNetTests)
+        memfs_dispatcher_dotest(MemfsNet, L"\\\\memfs\\share", FSP_FILE_SYSTEM_DISPATCHER_EXECUTOR);
+}
+
+void memfs_tree_dotest(ULONG Flags, PWSTR Prefix)
+{
+    void *memfs = memfs_start(Flags);
+
+    HANDLE Handle;
+    BOOL Success;
+    WCHAR Dir1Path[MAX_PATH];
+    WCHAR Dir2Path[MAX_PATH];
+    WCHAR SubDirPath[MAX_PATH];
+    WCHAR FilePath[MAX_PATH];
+    WIN32_FIND_DATAW FindData;
+    ULONG FileCount;
+
+    StringCbPrintfW(Dir1Path, sizeof Dir1Path, L"%s%s\\dir1",
+        Prefix ? L"" : L"\\\\?\\GLOBALROOT", Prefix ? Prefix : memfs_volumename(memfs));
+    StringCbPrintfW(Dir2Path, sizeof Dir2Path, L"%s%s\\dir2",
+        Prefix ? L"" : L"\\\\?\\GLOBALROOT", Prefix ? Prefix : memfs_volumename(memfs));
+
+    Success = CreateDirectoryW(Dir1Path, 0);
+    ASSERT(Success);
+    StringCbPrintfW(SubDirPath, sizeof SubDirPath, L"%s\\sub", Dir1Path);
+    Success = CreateDirectoryW(SubDirPath, 0);
+    ASSERT(Success);
+
+    for (ULONG I = 0; 100 > I; I++)
+    {
+        StringCbPrintfW(FilePath, sizeof FilePath, L"%s\\sub\\file%u", Dir1Path, I);
+        Handle = CreateFileW(FilePath,
+            GENERIC_READ | GENERIC_WRITE, 0, 0, CREATE_NEW, FILE_ATTRIBUTE_NORMAL, 0);
+        ASSERT(INVALID_HANDLE_VALUE != Handle);
+        Success = CloseHandle(Handle);
+        ASSERT(Success);
+    }
+
+    /* a file cannot be the parent of another file */
+    StringCbPrintfW(FilePath, sizeof FilePath, L"%s\\sub\\file0\\file", Dir1Path);
+    Handle = CreateFileW(FilePath,
+        GENERIC_READ | GENERIC_WRITE, 0, 0, CREATE_NEW, FILE_ATTRIBUTE_NORMAL, 0);
+    ASSERT(INVALID_HANDLE_VALUE == Handle);
+
+    /* a directory cannot be moved below itself */
+    StringCbPrintfW(FilePath, sizeof FilePath, L"%s\\sub\\dir1", Dir1Path);
+    Success = MoveFileExW(Dir1Path, FilePath, 0);
+    ASSERT(!Success);
+
+    Success = MoveFileExW(Dir1Path, Dir2Path, 0);
+    ASSERT(Success);
+
+    StringCbPrintfW(FilePath, sizeof FilePath, L"%s\\sub\\file42", Dir1Path);
+    Handle = CreateFileW(FilePath,
+        GENERIC_READ, 0, 0, OPEN_EXISTING, 0, 0);
+    ASSERT(INVALID_HANDLE_VALUE == Handle);
+    ASSERT(ERROR_PATH_NOT_FOUND == GetLastError());
+
+    StringCbPrintfW(FilePath, sizeof FilePath, L"%s\\sub\\file42", Dir2Path);
+    Handle = CreateFileW(FilePath,
+        GENERIC_READ, 0, 0, OPEN_EXISTING, 0, 0);
+    ASSERT(INVALID_HANDLE_VALUE != Handle);
+    Success = CloseHandle(Handle);
+    ASSERT(Success);
+
+    StringCbPrintfW(FilePath, sizeof FilePath, L"%s\\sub\\*", Dir2Path);
+    Handle = FindFirstFileW(FilePath, &FindData);
+    ASSERT(INVALID_HANDLE_VALUE != Handle);
+    FileCount = 0;
+    do
+    {
+        FileCount++;
+    } while (FindNextFileW(Handle, &FindData));
+    ASSERT(ERROR_NO_MORE_FILES == GetLastError());
+    ASSERT(102 == FileCount);
+    Success = FindClose(Handle);
+    ASSERT(Success);
+
+    StringCbPrintfW(SubDirPath, sizeof SubDirPath, L"%s\\sub", Dir2Path);
+    Success = RemoveDirectoryW(SubDirPath);
+    ASSERT(!Success);
+    ASSERT(ERROR_DIR_NOT_EMPTY == GetLastError());
+
+    for (ULONG I = 0; 100 > I; I++)
+    {
+        StringCbPrintfW(FilePath, sizeof FilePath, L"%s\\sub\\file%u", Dir2Path, I);
+        Success = DeleteFileW(FilePath);
+        ASSERT(Success);
+    }
+
+    Success = RemoveDirectoryW(SubDirPath);
+    ASSERT(Success);
+    Success = RemoveDirectoryW(Dir2Path);
+    ASSERT(Success);
+
+    memfs_stop(memfs);
+}
+
+void memfs_tree_test(void)
+{
+    if (WinFspDiskTests)
+        memfs_tree_dotest(MemfsDisk, 0);
+    if (WinFspNetTests)
+        memfs_tree_dotest(MemfsNet, L"\\\\memfs\\share");
+}
+
+void memfs_sparse_dotest(ULONG Flags, PWSTR Prefix)
+{
+    MEMFS *Memfs;
+    NTSTATUS Result;
+    HANDLE Handle;
+    BOOL Success;
+    WCHAR FilePath[MAX_PATH];
+    static char Zero[4096];
+    char Buffer[4096];
+    DWORD BytesTransferred;
+    LARGE_INTEGER Offset;
+
+    Result = MemfsCreate(Flags | MemfsTestFlags, 1000, 1024, 8ULL * 1024 * 1024 * 1024,
+        (Flags & MemfsNet) ? L"\\memfs\\share" : 0, 0, &Memfs);
+    ASSERT(NT_SUCCESS(Result));
+    ASSERT(0 != Memfs);
+
+    Result = MemfsStart(Memfs);
+    ASSERT(NT_SUCCESS(Result));
+
+    StringCbPrintfW(FilePath, sizeof FilePath, L"%s%s\\file0",
+        Prefix ? L"" : L"\\\\?\\GLOBALROOT", Prefix ? Prefix : MemfsFileSystem(Memfs)->VolumeName);
+
+    Handle = CreateFileW(FilePath,
+        GENERIC_READ | GENERIC_WRITE, 0, 0, CREATE_NEW, FILE_FLAG_DELETE_ON_CLOSE, 0);
+    ASSERT(INVALID_HANDLE_VALUE != Handle);
+
+    /* write past 4GB; everything before it is a hole */
+    Offset.QuadPart = 5LL * 1024 * 1024 * 1024 + 3;
+    Success = SetFilePointerEx(Handle, Offset, 0, FILE_BEGIN);
+    ASSERT(Success);
+    Success = WriteFile(Handle, "Hello, world!", 13, &BytesTransferred, 0);
+    ASSERT(Success);
+    ASSERT(13 == BytesTransferred);
+
+    Success = SetFilePointerEx(Handle, Offset, 0, FILE_BEGIN);
+    ASSERT(Success);
+    Success = ReadFile(Handle, Buffer, 13, &BytesTransferred, 0);
+    ASSERT(Success);
+    ASSERT(13 == BytesTransferred);
+    ASSERT(0 == memcmp(Buffer, "Hello, world!", 13));
+
+    Offset.QuadPart = 1024 * 1024 * 1024 - 1000;
+    Success = SetFilePointerEx(Handle, Offset, 0, FILE_BEGIN);
+    ASSERT(Success);
+    Success = ReadFile(Handle, Buffer, sizeof Buffer, &BytesTransferred, 0);
+    ASSERT(Success);
+    ASSERT(sizeof Buffer == BytesTransferred);
+    ASSERT(0 == memcmp(Buffer, Zero, sizeof Buffer));
+
+    /* truncate into the data and extend again; the truncated bytes must read as zeros */
+    Offset.QuadPart = 5LL * 1024 * 1024 * 1024 + 8;
+    Success = SetFilePointerEx(Handle, Offset, 0, FILE_BEGIN);
+    ASSERT(Success);
+    Success = SetEndOfFile(Handle);
+    ASSERT(Success);
+    Offset.QuadPart = 5LL * 1024 * 1024 * 1024 + 100000;
+    Success = SetFilePointerEx(Handle, Offset, 0, FILE_BEGIN);
+    ASSERT(Success);
+    Success = SetEndOfFile(Handle);
+    ASSERT(Success);
+
+    Offset.QuadPart = 5LL * 1024 * 1024 * 1024 + 3;
+    Success = SetFilePointerEx(Handle, Offset, 0, FILE_BEGIN);
+    ASSERT(Success);
+    Success = ReadFile(Handle, Buffer, 13, &BytesTransferred, 0);
+    ASSERT(Success);
+    ASSERT(13 == BytesTransferred);
+    ASSERT(0 == memcmp(Buffer, "Hello", 5));
+    ASSERT(0 == memcmp(Buffer + 5, Zero, 8));
+
+    Success = CloseHandle(Handle);
+    ASSERT(Success);
+
+    MemfsStop(Memfs);
+    MemfsDelete(Memfs);
+}
+
+void memfs_sparse_test(void)
+{
+    if (WinFspDiskTests)
+        memfs_sparse_dotest(MemfsDisk, 0);
+    if (WinFspNetTests)
+        memfs_sparse_dotest(MemfsNet, L"\\\\memfs\\share");
+}
+
+void memfs_footprint_dotest(ULONG Flags, PWSTR Prefix)
+{
+    MEMFS *Memfs;
+    NTSTATUS Result;
+    HANDLE Handle;
+    BOOL Success;
+    WCHAR DirPath[MAX_PATH];
+    WCHAR FilePath[MAX_PATH];
+    PROCESS_MEMORY_COUNTERS_EX Counters0, Counters1;
+    ULONG DirCount = 100, FileCount = 100;
+
+    Result = MemfsCreate(Flags | MemfsTestFlags, 1000, 2 * DirCount * (FileCount + 1), 1024 * 1024,
+        (Flags & MemfsNet) ? L"\\memfs\\share" : 0, 0, &Memfs);
+    ASSERT(NT_SUCCESS(Result));
+    ASSERT(0 != Memfs);
+
+    Result = MemfsStart(Memfs);
+    ASSERT(NT_SUCCESS(Result));
+
+    Success = GetProcessMemoryInfo(GetCurrentProcess(),
+        (PPROCESS_MEMORY_COUNTERS)&Counters0, sizeof Counters0);
+    ASSERT(Success);
+
+    /* same file names in every directory and inherited security throughout */
+    for (ULONG I = 0; DirCount > I; I++)
+    {
+        StringCbPrintfW(DirPath, sizeof DirPath, L"%s%s\\dir%u",
+            Prefix ? L"" : L"\\\\?\\GLOBALROOT", Prefix ? Prefix : MemfsFileSystem(Memfs)->VolumeName,
+            I);
+        Success = CreateDirectoryW(DirPath, 0);
+        ASSERT(Success);
+
+        for (ULONG J = 0; FileCount > J; J++)
+        {
+            StringCbPrintfW(FilePath, sizeof FilePath, L"%s\\file%u", DirPath, J);
+            Handle = CreateFileW(FilePath,
+                GENERIC_READ | GENERIC_WRITE, 0, 0, CREATE_NEW, FILE_ATTRIBUTE_NORMAL, 0);
+            ASSERT(INVALID_HANDLE_VALUE != Handle);
+            Success = CloseHandle(Handle);
+            ASSERT(Success);
+        }
+    }
+
+    Success = GetProcessMemoryInfo(GetCurrentProcess(),
+        (PPROCESS_MEMORY_COUNTERS)&Counters1, sizeof Counters1);
+    ASSERT(Success);
+
+    tlib_printf("%lu bytes/file ",
+        (ULONG)((Counters1.PrivateUsage - Counters0.PrivateUsage) / (DirCount * (FileCount + 1))));
+
+    MemfsStop(Memfs);
+    MemfsDelete(Memfs);
+}
+
+void memfs_footprint_test(void)
+{
+    /* benchmark: reports memfs private bytes per file */
+    if (WinFspDiskTests)
+        memfs_footprint_dotest(MemfsDisk, 0);
+    if (WinFspNetTests)
+        memfs_footprint_dotest(MemfsNet, L"\\\\memfs\\share");
+}
+
+struct memfs_concurrent_data
+{
+    PWSTR RootPath;
+    ULONG Index;
+    ULONG Iterations;
+};
+
+static unsigned __stdcall memfs_concurrent_dotest_thread(void *Data0)
+{
+    struct memfs_concurrent_data *Data = Data0;
+    HANDLE Handle;
+    WCHAR DirPath[MAX_PATH];
+    WCHAR FilePath[MAX_PATH];
+    WCHAR NewFilePath[MAX_PATH];
+
+    StringCbPrintfW(DirPath, sizeof DirPath, L"%s\\dir%u", Data->RootPath, Data->Index);
+    if (!CreateDirectoryW(DirPath, 0))
+        return GetLastError();
+
+    for (ULONG I = 0; Data->Iterations > I; I++)
+    {
+        /* create and stat in a private directory, then move to and delete from a shared one */
+        StringCbPrintfW(FilePath, sizeof FilePath, L"%s\\file%u", DirPath, I);
+        Handle = CreateFileW(FilePath,
+            GENERIC_READ | GENERIC_WRITE, 0, 0, CREATE_NEW, FILE_ATTRIBUTE_NORMAL, 0);
+        if (INVALID_HANDLE_VALUE == Handle)
+            return GetLastError();
+        CloseHandle(Handle);
+
+        if (INVALID_FILE_ATTRIBUTES == GetFileAttributesW(FilePath))
+            return GetLastError();
+
+        StringCbPrintfW(NewFilePath, sizeof NewFilePath, L"%s\\shared\\file%u.%u",
+            Data->RootPath, Data->Index, I);
+        if (!MoveFileExW(FilePath, NewFilePath, 0))
+            return GetLastError();
+
+        if (INVALID_FILE_ATTRIBUTES == GetFileAttributesW(NewFilePath))
+            return GetLastError();
+        if (INVALID_FILE_ATTRIBUTES != GetFileAttributesW(FilePath))
+            return ERROR_ALREADY_EXISTS;
+
+        if (!DeleteFileW(NewFilePath))
+            return GetLastError();
+    }
+
+    if (!RemoveDirectoryW(DirPath))
+        return GetLastError();
+
+    return 0;
+}
+
+ULONG memfs_concurrent_dotest(ULONG Flags, PWSTR Prefix, ULONG Iterations,
+    FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY GuardStrategy)
+{
+    MEMFS *Memfs;
+    NTSTATUS Result;
+    HANDLE Threads[8];
+    struct memfs_concurrent_data Data[8];
+    BOOL Success;
+    WCHAR RootPath[MAX_PATH];
+    WCHAR DirPath[MAX_PATH];
+    DWORD ExitCode;
+    ULONG Ticks;
+
+    Result = MemfsCreate(Flags, 1000, 1024, 1024 * 1024,
+        (Flags & MemfsNet) ? L"\\memfs\\share" : 0, 0, &Memfs);
+    ASSERT(NT_SUCCESS(Result));
+    ASSERT(0 != Memfs);
+
+    FspFileSystemSetOperationGuardStrategy(MemfsFileSystem(Memfs), GuardStrategy);
+
+    Result = MemfsStart(Memfs);
+    ASSERT(NT_SUCCESS(Result));
+
+    StringCbPrintfW(RootPath, sizeof RootPath, L"%s%s",
+        Prefix ? L"" : L"\\\\?\\GLOBALROOT", Prefix ? Prefix : MemfsFileSystem(Memfs)->VolumeName);
+    StringCbPrintfW(DirPath, sizeof DirPath, L"%s\\shared", RootPath);
+    Success = CreateDirectoryW(DirPath, 0);
+    ASSERT(Success);
+
+    Ticks = GetTickCount();
+
+    for (ULONG I = 0; sizeof Threads / sizeof Threads[0] > I; I++)
+    {
+        Data[I].RootPath = RootPath;
+        Data[I].Index = I;
+        Data[I].Iterations = Iterations;
+        Threads[I] = (HANDLE)_beginthreadex(0, 0, memfs_concurrent_dotest_thread, &Data[I], 0, 0);
+        ASSERT(0 != Threads[I]);
+    }
+
+    for (ULONG I = 0; sizeof Threads / sizeof Threads[0] > I; I++)
+    {
+        WaitForSingleObject(Threads[I], INFINITE);
+        GetExitCodeThread(Threads[I], &ExitCode);
+        CloseHandle(Threads[I]);
+
+        ASSERT(0 == ExitCode);
+    }
+
+    Ticks = GetTickCount() - Ticks;
+
+    Success = RemoveDirectoryW(DirPath);
+    ASSERT(Success);
+
+    MemfsStop(Memfs);
+    MemfsDelete(Memfs);
+
+    return Ticks;
+}
+
+void memfs_concurrent_test(void)
+{
+    if (WinFspDiskTests)
+        memfs_concurrent_dotest(MemfsDisk | MemfsConcurrent, 0, 100,
+            FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY_FINE);
+    if (WinFspNetTests)
+        memfs_concurrent_dotest(MemfsNet | MemfsConcurrent, L"\\\\memfs\\share", 100,
+            FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY_FINE);
+}
+
+void memfs_striped_test(void)
+{
+    if (WinFspDiskTests)
+        memfs_concurrent_dotest(MemfsDisk, 0, 100,
+            FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY_STRIPED);
+    if (WinFspNetTests)
+        memfs_concurrent_dotest(MemfsNet, L"\\\\memfs\\share", 100,
+            FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY_STRIPED);
+}
+
+static void memfs_concurrent_dobench(ULONG Flags, PWSTR Prefix)
+{
+    ULONG Iterations = 1000, Ticks[4];
+
+    Ticks[0] = memfs_concurrent_dotest(Flags, Prefix, Iterations,
+        FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY_COARSE);
+    Ticks[1] = memfs_concurrent_dotest(Flags, Prefix, Iterations,
+        FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY_FINE);
+    Ticks[2] = memfs_concurrent_dotest(Flags, Prefix, Iterations,
+        FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY_STRIPED);
+    Ticks[3] = memfs_concurrent_dotest(Flags | MemfsConcurrent, Prefix, Iterations,
+        FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY_FINE);
+
+    tlib_printf("%s coarse=%lu/s fine=%lu/s striped=%lu/s none=%lu/s ",
+        (Flags & MemfsNet) ? "net" : "disk",
+        8 * Iterations * 1000 / (Ticks[0] + 1), 8 * Iterations * 1000 / (Ticks[1] + 1),
+        8 * Iterations * 1000 / (Ticks[2] + 1), 8 * Iterations * 1000 / (Ticks[3] + 1));
+}
+
+void memfs_concurrent_bench(void)
+{
+    /* benchmark: reports create/stat/rename/unlink iterations per second with 8 threads */
+    if (WinFspDiskTests)
+        memfs_concurrent_dobench(MemfsDisk, 0);
+    if (WinFspNetTests)
+        memfs_concurrent_dobench(MemfsNet, L"\\\\memfs\\share");
+}
+
 void memfs_tests(void)
 {
     TEST(memfs_test);
+    TEST(memfs_batch_test);
+    TEST(memfs_executor_test);
+    TEST(memfs_tree_test);
+    TEST(memfs_sparse_test);
+    TEST_OPT(memfs_footprint_test);
+    TEST(memfs_concurrent_test);
+    TEST(memfs_striped_test);
+    TEST_OPT(memfs_concurrent_bench);
 }
@@ -0,0 +1,200 @@
+#include <winfsp/winfsp.h>
+#include <shared/metacache.h>
+#include <tlib/testsuite.h>
+#include <process.h>
+
+static FSP_META_CACHE_ITEM *metacache_item(UINT64 ItemIndex, UINT64 ExpirationTime, ULONG Size)
+{
+    FSP_META_CACHE_ITEM *Item;
+
+    Item = _aligned_malloc(sizeof *Item + Size, MEMORY_ALLOCATION_ALIGNMENT);
+    ASSERT(0 != Item);
+    memset(Item, 0, sizeof *Item);
+    Item->ItemIndex = ItemIndex;
+    Item->ExpirationTime = ExpirationTime;
+    Item->RefCount = 1;
+    Item->Size = Size;
+    memset(Item->Buffer, (UINT8)ItemIndex, Size);
+
+    return Item;
+}
+
+void metacache_test(void)
+{
+    FSP_META_CACHE_SHARD Shard;
+    FSP_META_CACHE_STATISTICS Statistics;
+    FSP_META_CACHE_ITEM *Item;
+    ULONG ItemSize = 100, ChargeSize = FspMetaCacheItemChargeSize(100);
+
+    ASSERT(0 == FspMetaCacheShardIndex(FspMetaCacheShardCount));
+    ASSERT(3 == FspMetaCacheShardIndex(FspMetaCacheShardCount * 1000 + 3));
+
+    /* the shard holds 10 items of ItemSize bytes */
+    FspMetaCacheShardInitialize(&Shard, 10 * ChargeSize);
+    ASSERT(0 == FspMetaCacheShardLookup(&Shard, 1));
+    ASSERT(0 == FspMetaCacheShardRemove(&Shard, 1));
+    ASSERT(0 == FspMetaCacheShardRemoveExpired(&Shard, (UINT64)-1LL));
+    ASSERT(0 == FspMetaCacheShardRemoveOverCapacity(&Shard));
+
+    /* many more items than buckets; indexes as handed out to a single shard */
+    for (UINT64 I = 1; 10 >= I; I++)
+    {
+        FspMetaCacheShardInsert(&Shard, metacache_item(I * FspMetaCacheShardCount, 1000 + I, ItemSize));
+        ASSERT(0 == FspMetaCacheShardRemoveOverCapacity(&Shard));
+    }
+    ASSERT(10 == Shard.ItemCount);
+    ASSERT(10 * ChargeSize == Shard.ItemSize);
+    for (UINT64 I = 1; 10 >= I; I++)
+    {
+        Item = FspMetaCacheShardLookup(&Shard, I * FspMetaCacheShardCount);
+        ASSERT(0 != Item);
+        ASSERT(I * FspMetaCacheShardCount == Item->ItemIndex);
+        ASSERT((UINT8)Item->ItemIndex == Item->Buffer[ItemSize - 1]);
+    }
+
+    /* use items 1 and 2; then going over capacity evicts items 3 and 4 (least recently used) */
+    ASSERT(0 != FspMetaCacheShardLookup(&Shard, 1 * FspMetaCacheShardCount));
+    ASSERT(0 != FspMetaCacheShardLookup(&Shard, 2 * FspMetaCacheShardCount));
+    FspMetaCacheShardInsert(&Shard, metacache_item(11 * FspMetaCacheShardCount, 1011, 2 * ItemSize));
+    Item = FspMetaCacheShardRemoveOverCapacity(&Shard);
+    ASSERT(0 != Item && 3 * FspMetaCacheShardCount == Item->ItemIndex);
+    _aligned_free(Item);
+    Item = FspMetaCacheShardRemoveOverCapacity(&Shard);
+    ASSERT(0 != Item && 4 * FspMetaCacheShardCount == Item->ItemIndex);
+    _aligned_free(Item);
+    ASSERT(0 == FspMetaCacheShardRemoveOverCapacity(&Shard));
+    ASSERT(0 != FspMetaCacheShardLookup(&Shard, 1 * FspMetaCacheShardCount));
+    ASSERT(0 == FspMetaCacheShardLookup(&Shard, 3 * FspMetaCacheShardCount));
+    ASSERT(9 == Shard.ItemCount);
+    ASSERT(Shard.Capacity >= Shard.ItemSize);
+
+    /* expiration is in insertion order regardless of use */
+    ASSERT(0 == FspMetaCacheShardRemoveExpired(&Shard, 1000));
+    Item = FspMetaCacheShardRemoveExpired(&Shard, 1002);
+    ASSERT(0 != Item && 1 * FspMetaCacheShardCount == Item->ItemIndex);
+    _aligned_free(Item);
+    Item = FspMetaCacheShardRemoveExpired(&Shard, 1002);
+    ASSERT(0 != Item && 2 * FspMetaCacheShardCount == Item->ItemIndex);
+    _aligned_free(Item);
+    Item = FspMetaCacheShardRemoveExpired(&Shard, 1002);
+    ASSERT(0 == Item);
+
+    /* explicit removal */
+    Item = FspMetaCacheShardRemove(&Shard, 7 * FspMetaCacheShardCount);
+    ASSERT(0 != Item && 7 * FspMetaCacheShardCount == Item->ItemIndex);
+    _aligned_free(Item);
+    ASSERT(0 == FspMetaCacheShardRemove(&Shard, 7 * FspMetaCacheShardCount));
+    ASSERT(0 == FspMetaCacheShardLookup(&Shard, 7 * FspMetaCacheShardCount));
+
+    memset(&Statistics, 0, sizeof Statistics);
+    FspMetaCacheShardAddStatistics(&Shard, &Statistics);
+    ASSERT(6 == Statistics.ItemCount);
+    ASSERT(5 * ChargeSize + FspMetaCacheItemChargeSize(2 * ItemSize) == Statistics.ItemSize);
+    ASSERT(13 == Statistics.Hits);
+    ASSERT(3 == Statistics.Misses);
+    ASSERT(2 == Statistics.Evictions);
+    ASSERT(2 == Statistics.Expirations);
+
+    while (0 != (Item = FspMetaCacheShardRemoveExpired(&Shard, (UINT64)-1LL)))
+        _aligned_free(Item);
+    ASSERT(0 == Shard.ItemCount);
+    ASSERT(0 == Shard.ItemSize);
+}
+
+static struct
+{
+    SRWLOCK Lock;
+    FSP_META_CACHE_SHARD Shard;
+    UINT8 Padding[64];
+} metacache_bench_shards[FspMetaCacheShardCount];
+static ULONG metacache_bench_shard_count;
+static LONG64 volatile metacache_bench_index;
+
+static unsigned __stdcall metacache_bench_thread(void *Data)
+{
+    /* each thread adds items and then looks them up repeatedly, as open files do */
+    UINT64 Indexes[64];
+    FSP_META_CACHE_ITEM *Item, *EvictedItem;
+    ULONG ShardIndex;
+
+    for (ULONG Round = 0; 100 > Round; Round++)
+    {
+        for (ULONG I = 0; 64 > I; I++)
+        {
+            Indexes[I] = (UINT64)InterlockedIncrement64(&metacache_bench_index);
+            Item = metacache_item(Indexes[I], (UINT64)-1LL, 128);
+            ShardIndex = (ULONG)(Indexes[I] % metacache_bench_shard_count);
+            AcquireSRWLockExclusive(&metacache_bench_shards[ShardIndex].Lock);
+            FspMetaCacheShardInsert(&metacache_bench_shards[ShardIndex].Shard, Item);
+            EvictedItem = FspMetaCacheShardRemoveOverCapacity(&metacache_bench_shards[ShardIndex].Shard);
+            ReleaseSRWLockExclusive(&metacache_bench_shards[ShardIndex].Lock);
+            if (0 != EvictedItem)
+                _aligned_free(EvictedItem);
+        }
+        for (ULONG J = 0; 100 > J; J++)
+            for (ULONG I = 0; 64 > I; I++)
+            {
+                ShardIndex = (ULONG)(Indexes[I] % metacache_bench_shard_count);
+                AcquireSRWLockExclusive(&metacache_bench_shards[ShardIndex].Lock);
+                FspMetaCacheShardLookup(&metacache_bench_shards[ShardIndex].Shard, Indexes[I]);
+                ReleaseSRWLockExclusive(&metacache_bench_shards[ShardIndex].Lock);
+            }
+    }
+
+    return 0;
+}
+
+static void metacache_bench_dotest(ULONG ShardCount)
+{
+    /* benchmark: 8 threads against a single shard (the old design) or all shards */
+    HANDLE Threads[8];
+    FSP_META_CACHE_STATISTICS Statistics;
+    FSP_META_CACHE_ITEM *Item;
+    LARGE_INTEGER Frequency, Start, End;
+
+    metacache_bench_shard_count = ShardCount;
+    for (ULONG I = 0; ShardCount > I; I++)
+    {
+        InitializeSRWLock(&metacache_bench_shards[I].Lock);
+        FspMetaCacheShardInitialize(&metacache_bench_shards[I].Shard,
+            1024 * 1024 / ShardCount);
+    }
+
+    QueryPerformanceFrequency(&Frequency);
+    QueryPerformanceCounter(&Start);
+    for (ULONG I = 0; 8 > I; I++)
+    {
+        Threads[I] = (HANDLE)_beginthreadex(0, 0, metacache_bench_thread, 0, 0, 0);
+        ASSERT(0 != Threads[I]);
+    }
+    WaitForMultipleObjects(8, Threads, TRUE, INFINITE);
+    QueryPerformanceCounter(&End);
+    for (ULONG I = 0; 8 > I; I++)
+        CloseHandle(Threads[I]);
+
+    memset(&Statistics, 0, sizeof Statistics);
+    for (ULONG I = 0; ShardCount > I; I++)
+    {
+        FspMetaCacheShardAddStatistics(&metacache_bench_shards[I].Shard, &Statistics);
+        while (0 != (Item = FspMetaCacheShardRemoveExpired(&metacache_bench_shards[I].Shard, (UINT64)-1LL)))
+            _aligned_free(Item);
+    }
+
+    tlib_printf("%lu shards: %lu ns/op %lu%% hits ",
+        ShardCount,
+        (ULONG)((End.QuadPart - Start.QuadPart) * 1000000000 /
+            (Frequency.QuadPart * (Statistics.Hits + Statistics.Misses))),
+        (ULONG)(Statistics.Hits * 100 / (Statistics.Hits + Statistics.Misses)));
+}
+
+void metacache_bench(void)
+{
+    metacache_bench_dotest(1);
+    metacache_bench_dotest(FspMetaCacheShardCount);
+}
+
+void metacache_tests(void)
+{
+    TEST(metacache_test);
+    TEST_OPT(metacache_bench);
+}
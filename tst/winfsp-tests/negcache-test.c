@@ -0,0 +1,308 @@
+#include <winfsp/winfsp.h>
+#include <wctype.h>
+#define FspNegCacheUpcaseChar(c)        ((WCHAR)towupper(c))
+#include <shared/negcache.h>
+#include <tlib/testsuite.h>
+#include <process.h>
+
+static FSP_NEG_CACHE_ENTRY *negcache_entry(PCWSTR Name, UINT64 ExpirationTime)
+{
+    FSP_NEG_CACHE_ENTRY *Entry;
+    USHORT NameLength = (USHORT)(wcslen(Name) * sizeof(WCHAR));
+
+    Entry = malloc(sizeof *Entry + NameLength);
+    ASSERT(0 != Entry);
+    memset(Entry, 0, sizeof *Entry);
+    Entry->ExpirationTime = ExpirationTime;
+    Entry->NameLength = NameLength;
+    memcpy(Entry->Name, Name, NameLength);
+
+    return Entry;
+}
+
+static UINT64 negcache_token(FSP_NEG_CACHE_TABLE *Table, PCWSTR Name)
+{
+    return FspNegCacheTableGetToken(Table, Name, (USHORT)(wcslen(Name) * sizeof(WCHAR)));
+}
+
+static BOOLEAN negcache_lookup(FSP_NEG_CACHE_TABLE *Table, PCWSTR Name, UINT64 CurrentTime)
+{
+    return FspNegCacheTableLookup(Table, Name, (USHORT)(wcslen(Name) * sizeof(WCHAR)), CurrentTime);
+}
+
+static FSP_NEG_CACHE_ENTRY *negcache_insert(FSP_NEG_CACHE_TABLE *Table, PCWSTR Name,
+    UINT64 ExpirationTime, UINT64 Token)
+{
+    return FspNegCacheTableInsert(Table, negcache_entry(Name, ExpirationTime), Token);
+}
+
+static void negcache_invalidate_parent(FSP_NEG_CACHE_TABLE *Table, PCWSTR Name)
+{
+    FspNegCacheTableInvalidateParent(Table, Name, (USHORT)(wcslen(Name) * sizeof(WCHAR)));
+}
+
+static ULONG negcache_parent_generation(PCWSTR Name)
+{
+    ULONG Hash, ParentHash;
+    FspNegCacheHashName(TRUE, Name, (USHORT)(wcslen(Name) * sizeof(WCHAR)), &Hash, &ParentHash);
+    return ParentHash & (FspNegCacheGenerationCount - 1);
+}
+
+void negcache_test(void)
+{
+    FSP_NEG_CACHE_TABLE Table;
+    FSP_NEG_CACHE_ENTRY *Entry;
+    UINT64 Token;
+
+    ASSERT(negcache_parent_generation(L"\\a\\b") == negcache_parent_generation(L"\\a\\c:stream"));
+    ASSERT(negcache_parent_generation(L"\\a\\b") == negcache_parent_generation(L"\\A\\B"));
+    ASSERT(negcache_parent_generation(L"\\a\\b") != negcache_parent_generation(L"\\d\\e"));
+    ASSERT(negcache_parent_generation(L"\\a") == negcache_parent_generation(L"\\d"));
+
+    FspNegCacheTableInitialize(&Table, 4, TRUE);
+    ASSERT(!negcache_lookup(&Table, L"\\a\\b", 0));
+    ASSERT(0 == FspNegCacheTableRemoveExpired(&Table, (UINT64)-1LL));
+    ASSERT(0 == FspNegCacheTableRemoveOverCapacity(&Table));
+
+    /* probe "\a\b" and "\d\e"; both are reported as not found */
+    Token = negcache_token(&Table, L"\\a\\b");
+    ASSERT(0 == negcache_insert(&Table, L"\\a\\b", 1000, Token));
+    Token = negcache_token(&Table, L"\\d\\e");
+    ASSERT(0 == negcache_insert(&Table, L"\\d\\e", 1001, Token));
+    ASSERT(2 == Table.EntryCount);
+    ASSERT(negcache_lookup(&Table, L"\\a\\b", 0));
+    ASSERT(negcache_lookup(&Table, L"\\A\\B", 0));
+    ASSERT(!negcache_lookup(&Table, L"\\a\\bb", 0));
+    ASSERT(!negcache_lookup(&Table, L"\\a", 0));
+    ASSERT(negcache_lookup(&Table, L"\\d\\e", 0));
+
+    /* a name is added to "\a": entries in "\a" are invalidated; entries in "\d" are not */
+    negcache_invalidate_parent(&Table, L"\\a\\c");
+    ASSERT(!negcache_lookup(&Table, L"\\a\\b", 0));
+    ASSERT(negcache_lookup(&Table, L"\\d\\e", 0));
+
+    /* probe "\a\b" again; this time "\a\b" is created while the probe is in user mode */
+    Token = negcache_token(&Table, L"\\a\\b");
+    negcache_invalidate_parent(&Table, L"\\a\\b");
+    Entry = negcache_insert(&Table, L"\\a\\b", 1002, Token);
+    ASSERT(0 != Entry && 4 == Entry->NameLength / sizeof(WCHAR));
+    free(Entry);
+    ASSERT(!negcache_lookup(&Table, L"\\a\\b", 0));
+    ASSERT(1 == Table.Rejects);
+
+    /* probe "\a\b" again; the stale entry for it is replaced */
+    Token = negcache_token(&Table, L"\\a\\b");
+    Entry = negcache_insert(&Table, L"\\A\\b", 1003, Token);
+    ASSERT(0 != Entry && 1000 == Entry->ExpirationTime);
+    free(Entry);
+    ASSERT(2 == Table.EntryCount);
+    ASSERT(negcache_lookup(&Table, L"\\a\\b", 0));
+
+    /* a directory is renamed: all entries are invalidated */
+    FspNegCacheTableInvalidate(&Table);
+    ASSERT(!negcache_lookup(&Table, L"\\a\\b", 0));
+    ASSERT(!negcache_lookup(&Table, L"\\d\\e", 0));
+    Token = negcache_token(&Table, L"\\d\\e");
+    Entry = negcache_insert(&Table, L"\\d\\e", 1004, Token);
+    ASSERT(0 != Entry && 1001 == Entry->ExpirationTime);
+    free(Entry);
+    ASSERT(negcache_lookup(&Table, L"\\d\\e", 0));
+
+    /* expiration */
+    ASSERT(!negcache_lookup(&Table, L"\\d\\e", 1004));
+    ASSERT(0 == FspNegCacheTableRemoveExpired(&Table, 1002));
+    Entry = FspNegCacheTableRemoveExpired(&Table, 1003);
+    ASSERT(0 != Entry && 1003 == Entry->ExpirationTime);
+    free(Entry);
+    ASSERT(0 == FspNegCacheTableRemoveExpired(&Table, 1003));
+    ASSERT(1 == Table.EntryCount);
+
+    /* capacity: the oldest entries are removed first */
+    for (ULONG I = 0; 4 > I; I++)
+    {
+        WCHAR Name[32];
+        wsprintfW(Name, L"\\f\\%lu", I);
+        Token = negcache_token(&Table, Name);
+        ASSERT(0 == negcache_insert(&Table, Name, 2000 + I, Token));
+    }
+    Entry = FspNegCacheTableRemoveOverCapacity(&Table);
+    ASSERT(0 != Entry && 1004 == Entry->ExpirationTime);
+    free(Entry);
+    ASSERT(0 == FspNegCacheTableRemoveOverCapacity(&Table));
+    ASSERT(negcache_lookup(&Table, L"\\f\\0", 0));
+
+    /* case-sensitive table */
+    while (0 != (Entry = FspNegCacheTableRemoveExpired(&Table, (UINT64)-1LL)))
+        free(Entry);
+    ASSERT(0 == Table.EntryCount);
+    FspNegCacheTableInitialize(&Table, 4, FALSE);
+    Token = negcache_token(&Table, L"\\a\\b");
+    ASSERT(0 == negcache_insert(&Table, L"\\a\\b", (UINT64)-1LL, Token));
+    ASSERT(negcache_lookup(&Table, L"\\a\\b", 0));
+    ASSERT(!negcache_lookup(&Table, L"\\A\\B", 0));
+    while (0 != (Entry = FspNegCacheTableRemoveExpired(&Table, (UINT64)-1LL)))
+        free(Entry);
+}
+
+/*
+ * Simulate create/probe races. A "file system" has negcache_race_count names in a single
+ * directory, none of which exist initially. Prober threads open random names the way the
+ * FSD does: capture a token, ask the file system, insert the name if it was not found.
+ * A creator thread creates the names one by one: the file system creates the name and
+ * then (when the create completes) the parent is invalidated. Once a create has completed,
+ * a lookup of its name must never hit.
+ */
+#define negcache_race_count             64
+static struct
+{
+    SRWLOCK Lock;
+    FSP_NEG_CACHE_TABLE Table;
+    LONG volatile Exists[negcache_race_count];
+    BOOLEAN Created[negcache_race_count];
+    LONG volatile Done;
+    LONG volatile Errors;
+    LONG volatile Hits;
+} negcache_race;
+
+static void negcache_race_name(ULONG I, PWSTR Name)
+{
+    wsprintfW(Name, L"\\dir\\file%lu", I);
+}
+
+static unsigned __stdcall negcache_race_prober(void *Data)
+{
+    ULONG Seed = (ULONG)(UINT_PTR)Data;
+    FSP_NEG_CACHE_ENTRY *Entry;
+    WCHAR Name[32];
+    UINT64 Token;
+    BOOLEAN Hit;
+    ULONG I;
+
+    while (!negcache_race.Done)
+    {
+        Seed = Seed * 1103515245 + 12345;
+        I = (Seed >> 16) % negcache_race_count;
+        negcache_race_name(I, Name);
+
+        AcquireSRWLockExclusive(&negcache_race.Lock);
+        Hit = negcache_lookup(&negcache_race.Table, Name, 0);
+        if (Hit && negcache_race.Created[I])
+            InterlockedIncrement(&negcache_race.Errors);
+        Token = negcache_token(&negcache_race.Table, Name);
+        ReleaseSRWLockExclusive(&negcache_race.Lock);
+
+        if (Hit)
+        {
+            InterlockedIncrement(&negcache_race.Hits);
+            continue;
+        }
+
+        /* the request is in user mode */
+        if (negcache_race.Exists[I])
+            continue;
+
+        Entry = negcache_entry(Name, (UINT64)-1LL);
+        AcquireSRWLockExclusive(&negcache_race.Lock);
+        Entry = FspNegCacheTableInsert(&negcache_race.Table, Entry, Token);
+        ReleaseSRWLockExclusive(&negcache_race.Lock);
+        if (0 != Entry)
+            free(Entry);
+    }
+
+    return 0;
+}
+
+static unsigned __stdcall negcache_race_creator(void *Data)
+{
+    WCHAR Name[32];
+
+    for (ULONG I = 0; negcache_race_count > I; I++)
+    {
+        Sleep(1);
+
+        negcache_race_name(I, Name);
+        InterlockedExchange(&negcache_race.Exists[I], 1);
+
+        AcquireSRWLockExclusive(&negcache_race.Lock);
+        negcache_invalidate_parent(&negcache_race.Table, Name);
+        negcache_race.Created[I] = TRUE;
+        ReleaseSRWLockExclusive(&negcache_race.Lock);
+    }
+
+    return 0;
+}
+
+void negcache_race_test(void)
+{
+    HANDLE Threads[5];
+    FSP_NEG_CACHE_ENTRY *Entry;
+    WCHAR Name[32];
+
+    memset(&negcache_race, 0, sizeof negcache_race);
+    InitializeSRWLock(&negcache_race.Lock);
+    FspNegCacheTableInitialize(&negcache_race.Table, 2 * negcache_race_count, TRUE);
+
+    for (ULONG I = 0; 4 > I; I++)
+    {
+        Threads[I] = (HANDLE)_beginthreadex(0, 0, negcache_race_prober, (void *)(UINT_PTR)(I + 1), 0, 0);
+        ASSERT(0 != Threads[I]);
+    }
+    Threads[4] = (HANDLE)_beginthreadex(0, 0, negcache_race_creator, 0, 0, 0);
+    ASSERT(0 != Threads[4]);
+    WaitForSingleObject(Threads[4], INFINITE);
+    InterlockedExchange(&negcache_race.Done, 1);
+    WaitForMultipleObjects(4, Threads, TRUE, INFINITE);
+    for (ULONG I = 0; 5 > I; I++)
+        CloseHandle(Threads[I]);
+
+    ASSERT(0 == negcache_race.Errors);
+    ASSERT(0 < negcache_race.Hits);
+    for (ULONG I = 0; negcache_race_count > I; I++)
+    {
+        negcache_race_name(I, Name);
+        ASSERT(!negcache_lookup(&negcache_race.Table, Name, 0));
+    }
+
+    while (0 != (Entry = FspNegCacheTableRemoveExpired(&negcache_race.Table, (UINT64)-1LL)))
+        free(Entry);
+}
+
+void negcache_bench(void)
+{
+    /* benchmark: lookups of typical path names in a full table */
+    FSP_NEG_CACHE_TABLE Table;
+    FSP_NEG_CACHE_ENTRY *Entry;
+    WCHAR Name[1024][64];
+    ULONG Hits = 0;
+    LARGE_INTEGER Frequency, Start, End;
+
+    FspNegCacheTableInitialize(&Table, 1024, TRUE);
+    for (ULONG I = 0; 1024 > I; I++)
+    {
+        wsprintfW(Name[I], L"\\Users\\user\\Projects\\project%lu\\packages\\module.%lu.dll",
+            I % 16, I);
+        Entry = negcache_insert(&Table, Name[I], (UINT64)-1LL, negcache_token(&Table, Name[I]));
+        ASSERT(0 == Entry);
+    }
+
+    QueryPerformanceFrequency(&Frequency);
+    QueryPerformanceCounter(&Start);
+    for (ULONG J = 0; 1000 > J; J++)
+        for (ULONG I = 0; 1024 > I; I++)
+            Hits += negcache_lookup(&Table, Name[I], 0);
+    QueryPerformanceCounter(&End);
+    ASSERT(1000 * 1024 == Hits);
+
+    tlib_printf("%lu ns/lookup ",
+        (ULONG)((End.QuadPart - Start.QuadPart) * 1000000000 / (Frequency.QuadPart * Hits)));
+
+    while (0 != (Entry = FspNegCacheTableRemoveExpired(&Table, (UINT64)-1LL)))
+        free(Entry);
+}
+
+void negcache_tests(void)
+{
+    TEST(negcache_test);
+    TEST(negcache_race_test);
+    TEST_OPT(negcache_bench);
+}
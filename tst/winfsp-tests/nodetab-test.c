@@ -0,0 +1,378 @@
+#include <winfsp/winfsp.h>
+#include <shared/nodetab.h>
+#include <tlib/testsuite.h>
+
+/*
+ * The backend is a file system that identifies files by node ID: a flat table of
+ * (parent node ID, name) -> node ID. It counts the lookups that it has answered
+ * and the lookups that it has been told to forget.
+ */
+typedef struct
+{
+    UINT64 ParentIno;
+    const char *Name;
+} NODETAB_BACKEND_FILE;
+
+static NODETAB_BACKEND_FILE *nodetab_backend_files;
+static ULONG nodetab_backend_count;
+static ULONG *nodetab_backend_index, nodetab_backend_index_size;
+static UINT64 nodetab_backend_lookups, nodetab_backend_forgets;
+
+static VOID nodetab_backend_init(NODETAB_BACKEND_FILE *Files, ULONG Count)
+{
+    ULONG H;
+
+    /* open addressing index, so that the backend is not what the benchmark measures */
+    nodetab_backend_files = Files;
+    nodetab_backend_count = Count;
+    nodetab_backend_index_size = Count * 2 + 1;
+    nodetab_backend_index = malloc(nodetab_backend_index_size * sizeof(ULONG));
+    ASSERT(0 != nodetab_backend_index);
+    memset(nodetab_backend_index, 0xff, nodetab_backend_index_size * sizeof(ULONG));
+    for (ULONG I = 0; Count > I; I++)
+    {
+        H = FspNodeTableNameHash(Files[I].ParentIno, Files[I].Name,
+            (ULONG)strlen(Files[I].Name)) % nodetab_backend_index_size;
+        while ((ULONG)-1 != nodetab_backend_index[H])
+            H = (H + 1) % nodetab_backend_index_size;
+        nodetab_backend_index[H] = I;
+    }
+    nodetab_backend_lookups = nodetab_backend_forgets = 0;
+}
+
+static VOID nodetab_backend_fini(VOID)
+{
+    free(nodetab_backend_index);
+    nodetab_backend_index = 0;
+}
+
+static NTSTATUS nodetab_backend_lookup(PVOID Context,
+    FSP_NODE_TABLE_NODE *Parent, const char *Name, ULONG NameLength,
+    FSP_NODE_TABLE_NODE **PNode)
+{
+    FSP_NODE_TABLE *Table = Context;
+    FSP_NODE_TABLE_ENTRY *Entry;
+    FSP_NODE_TABLE_NODE *Node, *Resident;
+    ULONG H, I;
+
+    H = FspNodeTableNameHash(Parent->Ino, Name, NameLength) % nodetab_backend_index_size;
+    for (; (ULONG)-1 != (I = nodetab_backend_index[H]); H = (H + 1) % nodetab_backend_index_size)
+        if (nodetab_backend_files[I].ParentIno == Parent->Ino &&
+            strlen(nodetab_backend_files[I].Name) == NameLength &&
+            0 == memcmp(nodetab_backend_files[I].Name, Name, NameLength))
+        {
+            nodetab_backend_lookups++;
+            Entry = malloc(sizeof *Entry + NameLength);
+            Node = malloc(sizeof *Node);
+            ASSERT(0 != Entry && 0 != Node);
+            memcpy(Entry->Name, Name, NameLength);
+            Entry->NameLength = NameLength;
+            Node->Ino = FspNodeTableRootIno + 1 + I;
+
+            Resident = FspNodeTableInsert(Table, Parent, Entry, Node);
+            if (Resident != Node)
+                free(Node);
+
+            *PNode = Resident;
+            return STATUS_SUCCESS;
+        }
+
+    return STATUS_OBJECT_NAME_NOT_FOUND;
+}
+
+static ULONG nodetab_backend_forget(FSP_NODE_TABLE *Table)
+{
+    FSP_NODE_TABLE_NODE *Node;
+    FSP_NODE_TABLE_ENTRY *Entry;
+    ULONG Count = 0;
+
+    while (0 != (Node = FspNodeTableTakeForgetList(Table)))
+        for (; 0 != Node; Count++)
+        {
+            FSP_NODE_TABLE_NODE *Next = Node->DictNext;
+            ASSERT(FspNodeTableRootIno != Node->Ino);
+            nodetab_backend_forgets += Node->LookupCount;
+            free(Node);
+            Node = Next;
+        }
+    while (0 != (Entry = FspNodeTableTakeFreeList(Table)))
+        for (; 0 != Entry;)
+        {
+            FSP_NODE_TABLE_ENTRY *Next = Entry->DictNext;
+            free(Entry);
+            Entry = Next;
+        }
+
+    return Count;
+}
+
+static UINT64 nodetab_resolve(FSP_NODE_TABLE *Table, const char *Path)
+{
+    FSP_NODE_TABLE_NODE *Node;
+    UINT64 Ino;
+
+    if (!NT_SUCCESS(FspNodeTableResolve(Table, Path, FALSE,
+        nodetab_backend_lookup, Table, &Node, 0)))
+        return 0;
+
+    Ino = Node->Ino;
+    FspNodeTableDereference(Table, Node);
+    return Ino;
+}
+
+static VOID nodetab_unbind(FSP_NODE_TABLE *Table, FSP_NODE_TABLE_NODE *Parent, const char *Name)
+{
+    FSP_NODE_TABLE_ENTRY *Entry;
+    ULONG NameLength = (ULONG)strlen(Name);
+
+    Entry = FspNodeTableFindEntry(Table, Parent, Name, NameLength,
+        FspNodeTableNameHash(Parent->Ino, Name, NameLength));
+    ASSERT(0 != Entry);
+    FspNodeTableRemove(Table, Entry);
+}
+
+static VOID nodetab_delete(FSP_NODE_TABLE *Table)
+{
+    FSP_NODE_TABLE_ENTRY *Entry;
+
+    /* evict everything that is not referenced; the backend must be told to forget it all */
+    while (Table->LruList.Next != &Table->LruList)
+    {
+        Entry = CONTAINING_RECORD(Table->LruList.Next, FSP_NODE_TABLE_ENTRY, LruLink);
+        FspNodeTableRemove(Table, Entry);
+    }
+    nodetab_backend_forget(Table);
+    ASSERT(0 == Table->EntryCount && 1 == Table->NodeCount);
+    free(Table);
+}
+
+void nodetab_test(void)
+{
+    static NODETAB_BACKEND_FILE Files[] =
+    {
+        /* 2 */ { 1, "a" },
+        /* 3 */ { 2, "b" },
+        /* 4 */ { 3, "c.txt" },
+        /* 5 */ { 1, "d.txt" },
+        /* 6 */ { 2, "e.txt" },
+    };
+    FSP_NODE_TABLE *Table;
+    FSP_NODE_TABLE_NODE *Node, *Parent, *NewNode;
+    FSP_NODE_TABLE_ENTRY *Entry;
+    const char *Name;
+
+    nodetab_backend_init(Files, sizeof Files / sizeof Files[0]);
+
+    Table = malloc(sizeof *Table);
+    ASSERT(0 != Table);
+    FspNodeTableInitialize(Table, 16);
+    ASSERT(1 == Table->NodeCount && 0 == Table->EntryCount);
+
+    /* the root is always there */
+    ASSERT(FspNodeTableRootIno == nodetab_resolve(Table, "/"));
+    ASSERT(0 == nodetab_backend_lookups);
+
+    /* a path is looked up one component at a time; the second time it is all hits */
+    ASSERT(4 == nodetab_resolve(Table, "/a/b/c.txt"));
+    ASSERT(3 == nodetab_backend_lookups && 3 == Table->Misses && 0 == Table->Hits);
+    ASSERT(4 == Table->NodeCount && 3 == Table->EntryCount);
+    ASSERT(4 == nodetab_resolve(Table, "//a//b/c.txt/"));
+    ASSERT(3 == nodetab_backend_lookups && 3 == Table->Hits);
+    ASSERT(6 == nodetab_resolve(Table, "/a/e.txt"));
+    ASSERT(4 == nodetab_backend_lookups);
+
+    /* a missing last component is a missing name; a missing directory is a missing path */
+    ASSERT(STATUS_OBJECT_NAME_NOT_FOUND == FspNodeTableResolve(Table, "/a/x", FALSE,
+        nodetab_backend_lookup, Table, &Node, 0));
+    ASSERT(STATUS_OBJECT_PATH_NOT_FOUND == FspNodeTableResolve(Table, "/a/x/y", FALSE,
+        nodetab_backend_lookup, Table, &Node, 0));
+    ASSERT(4 == nodetab_backend_lookups && 6 == Table->Misses);
+    ASSERT(0 == nodetab_backend_forget(Table));
+
+    /* parent resolution does not look up the last component */
+    ASSERT(STATUS_SUCCESS == FspNodeTableResolve(Table, "/a/b/new.txt", TRUE,
+        nodetab_backend_lookup, Table, &Parent, &Name));
+    ASSERT(3 == Parent->Ino && 0 == strcmp(Name, "new.txt"));
+    ASSERT(4 == nodetab_backend_lookups);
+    FspNodeTableDereference(Table, Parent);
+    ASSERT(STATUS_SUCCESS == FspNodeTableResolve(Table, "/", TRUE,
+        nodetab_backend_lookup, Table, &Parent, &Name));
+    ASSERT(&Table->Root == Parent && '\0' == Name[0]);
+    FspNodeTableDereference(Table, Parent);
+
+    /* an unlinked file that is open stays until it is closed; then it is forgotten */
+    ASSERT(STATUS_SUCCESS == FspNodeTableResolve(Table, "/a/e.txt", FALSE,
+        nodetab_backend_lookup, Table, &Node, 0));
+    nodetab_unbind(Table, FspNodeTableGetNode(Table, 2), "e.txt");
+    ASSERT(0 == nodetab_backend_forget(Table));
+    ASSERT(Node == FspNodeTableGetNode(Table, 6) && 0 == Node->EntryCount);
+    FspNodeTableDereference(Table, Node);
+    ASSERT(0 == FspNodeTableGetNode(Table, 6));
+    ASSERT(1 == nodetab_backend_forget(Table) && 1 == nodetab_backend_forgets);
+
+    /* a directory that has entries in it is not forgotten even if it has no name */
+    nodetab_unbind(Table, FspNodeTableGetNode(Table, 2), "b");
+    ASSERT(0 == nodetab_backend_forget(Table));
+    ASSERT(0 != FspNodeTableGetNode(Table, 3));
+    nodetab_unbind(Table, FspNodeTableGetNode(Table, 3), "c.txt");
+    ASSERT(2 == nodetab_backend_forget(Table) && 3 == nodetab_backend_forgets);
+    ASSERT(0 == FspNodeTableGetNode(Table, 3) && 0 == FspNodeTableGetNode(Table, 4));
+
+    /* a second name for the same node ID (hard link) uses the resident node */
+    Parent = FspNodeTableGetNode(Table, 2);
+    Entry = malloc(sizeof *Entry + 4);
+    NewNode = malloc(sizeof *NewNode);
+    memcpy(Entry->Name, "link", 4);
+    Entry->NameLength = 4;
+    NewNode->Ino = 2;
+    Node = FspNodeTableInsert(Table, &Table->Root, Entry, NewNode);
+    ASSERT(Parent == Node && Node != NewNode);
+    ASSERT(2 == Node->LookupCount && 2 == Node->EntryCount);
+    free(NewNode);
+    ASSERT(2 == nodetab_resolve(Table, "/link"));
+
+    /* a name that now refers to a different node ID (rename over) replaces the old entry */
+    Entry = malloc(sizeof *Entry + 5);
+    NewNode = malloc(sizeof *NewNode);
+    memcpy(Entry->Name, "d.txt", 5);
+    Entry->NameLength = 5;
+    NewNode->Ino = 100;
+    ASSERT(5 == nodetab_resolve(Table, "/d.txt"));
+    Node = FspNodeTableInsert(Table, &Table->Root, Entry, NewNode);
+    ASSERT(NewNode == Node);
+    ASSERT(100 == nodetab_resolve(Table, "/d.txt"));
+    ASSERT(1 == nodetab_backend_forget(Table) && 4 == nodetab_backend_forgets);
+
+    nodetab_delete(Table);
+    ASSERT(nodetab_backend_lookups + 2/* link, rename */ == nodetab_backend_forgets);
+    nodetab_backend_fini();
+}
+
+void nodetab_evict_test(void)
+{
+    static NODETAB_BACKEND_FILE Files[] =
+    {
+        /* 2 */ { 1, "a" },
+        /* 3 */ { 2, "b" },
+        /* 4 */ { 3, "c.txt" },
+        /* 5 */ { 1, "d.txt" },
+        /* 6 */ { 1, "e.txt" },
+    };
+    FSP_NODE_TABLE *Table;
+    FSP_NODE_TABLE_NODE *Node;
+
+    nodetab_backend_init(Files, sizeof Files / sizeof Files[0]);
+
+    Table = malloc(sizeof *Table);
+    ASSERT(0 != Table);
+    FspNodeTableInitialize(Table, 3);
+
+    /* only leaves are evicted: the directories on the path of a cached entry stay */
+    ASSERT(4 == nodetab_resolve(Table, "/a/b/c.txt"));
+    ASSERT(3 == Table->EntryCount);
+    ASSERT(5 == nodetab_resolve(Table, "/d.txt"));
+    ASSERT(3 == Table->EntryCount && 1 == Table->Evictions);
+    ASSERT(0 == FspNodeTableGetNode(Table, 4));
+    ASSERT(0 != FspNodeTableGetNode(Table, 2) && 0 != FspNodeTableGetNode(Table, 3));
+    ASSERT(1 == nodetab_backend_forget(Table));
+
+    /* b is a leaf now and is least recently used */
+    ASSERT(6 == nodetab_resolve(Table, "/e.txt"));
+    ASSERT(3 == Table->EntryCount && 2 == Table->Evictions);
+    ASSERT(0 == FspNodeTableGetNode(Table, 3));
+    ASSERT(1 == nodetab_backend_forget(Table));
+
+    /* a referenced node loses its entry when evicted but it is forgotten only when released */
+    ASSERT(STATUS_SUCCESS == FspNodeTableResolve(Table, "/a", FALSE,
+        nodetab_backend_lookup, Table, &Node, 0));
+    FspNodeTableEvict(Table, 0);
+    ASSERT(0 == Table->EntryCount);
+    ASSERT(2 == nodetab_backend_forget(Table));
+    ASSERT(Node == FspNodeTableGetNode(Table, 2) && 0 == Node->EntryCount);
+    FspNodeTableDereference(Table, Node);
+    ASSERT(1 == nodetab_backend_forget(Table));
+
+    nodetab_delete(Table);
+    ASSERT(nodetab_backend_lookups == nodetab_backend_forgets);
+    nodetab_backend_fini();
+}
+
+static void nodetab_bench_dotest(ULONG DirCount, ULONG FileCount, ULONG MaxEntryCount,
+    ULONG ResolveCount)
+{
+    /*
+     * benchmark: resolve random paths of the form /dN/fM; compare the lookups that reach
+     * the backend against the number of path components that have been resolved
+     */
+    FSP_NODE_TABLE *Table;
+    NODETAB_BACKEND_FILE *Files;
+    char (*Names)[16], Path[64];
+    ULONG Seed = 1, Dir, File;
+    LARGE_INTEGER Frequency, Start, End;
+
+    Files = malloc((DirCount + DirCount * FileCount) * sizeof *Files);
+    Names = malloc((DirCount + DirCount * FileCount) * sizeof *Names);
+    ASSERT(0 != Files && 0 != Names);
+    for (ULONG I = 0; DirCount > I; I++)
+    {
+        sprintf(Names[I], "d%lu", I);
+        Files[I].ParentIno = FspNodeTableRootIno;
+        Files[I].Name = Names[I];
+        for (ULONG J = 0; FileCount > J; J++)
+        {
+            ULONG K = DirCount + I * FileCount + J;
+            sprintf(Names[K], "f%lu", J);
+            Files[K].ParentIno = FspNodeTableRootIno + 1 + I;
+            Files[K].Name = Names[K];
+        }
+    }
+    nodetab_backend_init(Files, DirCount + DirCount * FileCount);
+
+    Table = malloc(sizeof *Table);
+    ASSERT(0 != Table);
+    FspNodeTableInitialize(Table, MaxEntryCount);
+
+    QueryPerformanceFrequency(&Frequency);
+    QueryPerformanceCounter(&Start);
+    for (ULONG I = 0; ResolveCount > I; I++)
+    {
+        /* skewed: most resolves go to a few hot directories */
+        Seed = Seed * 1103515245 + 12345;
+        Dir = (Seed >> 16) % (0 == (I & 3) ? DirCount : (DirCount + 7) / 8);
+        Seed = Seed * 1103515245 + 12345;
+        File = (Seed >> 16) % FileCount;
+        sprintf(Path, "/d%lu/f%lu", Dir, File);
+        ASSERT(FspNodeTableRootIno + 1 + DirCount + Dir * FileCount + File ==
+            nodetab_resolve(Table, Path));
+        nodetab_backend_forget(Table);
+    }
+    QueryPerformanceCounter(&End);
+
+    tlib_printf("max=%lu: components=%lu backend=%lu hits=%lu%% evictions=%lu time=%lums ",
+        MaxEntryCount,
+        ResolveCount * 2,
+        (ULONG)nodetab_backend_lookups,
+        (ULONG)(Table->Hits * 100 / (Table->Hits + Table->Misses)),
+        (ULONG)Table->Evictions,
+        (ULONG)((End.QuadPart - Start.QuadPart) * 1000 / Frequency.QuadPart));
+
+    nodetab_delete(Table);
+    ASSERT(nodetab_backend_lookups == nodetab_backend_forgets);
+    nodetab_backend_fini();
+    free(Names);
+    free(Files);
+}
+
+void nodetab_bench(void)
+{
+    nodetab_bench_dotest(256, 256, 1024, 1000000);
+    nodetab_bench_dotest(256, 256, 16384, 1000000);
+    nodetab_bench_dotest(256, 256, 65536, 1000000);
+}
+
+void nodetab_tests(void)
+{
+    TEST(nodetab_test);
+    TEST(nodetab_evict_test);
+    TEST_OPT(nodetab_bench);
+}
@@ -0,0 +1,457 @@
+#include <winfsp/winfsp.h>
+#include <process.h>
+#include <strsafe.h>
+#include <tlib/testsuite.h>
+
+/*
+ * Load generator for the operation guard strategies. Threads feed a mix of requests to a
+ * detached file system the way the dispatcher does (EnterOperation, operation, LeaveOperation);
+ * the operations count how many of them run at the same time.
+ */
+
+enum
+{
+    opguard_create = 0,                 /* create new file: exclusive (FINE) */
+    opguard_open,                       /* open existing file: shared (FINE) */
+    opguard_read,                       /* unguarded (FINE) */
+    opguard_querydir,                   /* shared (FINE) */
+    opguard_rename,                     /* exclusive (FINE) */
+    opguard_count,
+};
+
+/*
+ * The operations check exclusion per lock domain. FINE and COARSE have a single domain (the
+ * volume). STRIPED has a domain per directory: the root and for every top level directory
+ * \dN the directory itself and its subdirectory \dN\s. A rename excludes all domains, because
+ * renaming \dN also renames everything in \dN\s.
+ */
+#define OPGUARD_DIRS                    8
+#define OPGUARD_DOMAINS                 (1 + 2 * OPGUARD_DIRS)
+#define OPGUARD_DOMAIN_ALL              ((ULONG)-1)
+
+typedef struct
+{
+    FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY Strategy;
+    ULONG DirCount;                     /* top level directories shared by the threads */
+    ULONG Work;                         /* simulated file system work per operation */
+    LONG Rendezvous;                    /* operations wait until this many are inside */
+    BOOLEAN SameLevel;                  /* all threads access \dN rather than alternate */
+    volatile LONG Inside, InsideMax;
+    volatile LONG Shared[OPGUARD_DOMAINS], Exclusive[OPGUARD_DOMAINS];
+    volatile LONG Violations;
+} OPGUARD_DATA;
+
+typedef struct
+{
+    FSP_FILE_SYSTEM *FileSystem;
+    ULONG Index, Iterations;
+    LONG Kind;                          /* -1 for the mix of requests */
+} OPGUARD_THREAD_DATA;
+
+static BOOLEAN opguard_guarded(FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY Strategy,
+    FSP_FSCTL_TRANSACT_REQ *Request, PULONG PDomain, PBOOLEAN PExclusive)
+{
+    BOOLEAN Exclusive = FALSE, Guarded = FALSE, Rename;
+    ULONG Domain = 0;
+
+    Rename = FspFsctlTransactSetInformationKind == Request->Kind &&
+        10/*FileRenameInformation*/ == Request->Req.SetInformation.FileInformationClass;
+
+    switch (Strategy)
+    {
+    case FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY_FINE:
+    case FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY_STRIPED:
+        switch (Request->Kind)
+        {
+        case FspFsctlTransactCreateKind:
+            Exclusive = FILE_OPEN != ((Request->Req.Create.CreateOptions >> 24) & 0xff);
+            Guarded = TRUE;
+            break;
+        case FspFsctlTransactSetInformationKind:
+            Exclusive = Guarded = Rename;
+            break;
+        case FspFsctlTransactQueryDirectoryKind:
+            Guarded = TRUE;
+            break;
+        }
+        /* the domain of the accessed directory is passed in the high part of the hint */
+        if (FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY_STRIPED == Strategy)
+            Domain = Rename ? OPGUARD_DOMAIN_ALL : (ULONG)(Request->Hint >> 32);
+        break;
+    case FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY_COARSE:
+        Exclusive = Guarded = TRUE;
+        break;
+    default:
+        /* NONE guards nothing */
+        break;
+    }
+
+    *PDomain = Domain;
+    *PExclusive = Exclusive;
+    return Guarded;
+}
+
+static VOID opguard_check(OPGUARD_DATA *Data, ULONG Domain, BOOLEAN Exclusive)
+{
+    ULONG First = OPGUARD_DOMAIN_ALL == Domain ? 0 : Domain;
+    ULONG Last = OPGUARD_DOMAIN_ALL == Domain ? OPGUARD_DOMAINS - 1 : Domain;
+
+    for (ULONG I = First; Last >= I; I++)
+        if (Exclusive ?
+            1 != Data->Exclusive[I] || 0 != Data->Shared[I] :
+            0 != Data->Exclusive[I])
+            InterlockedIncrement(&Data->Violations);
+}
+
+static NTSTATUS opguard_operation(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FSCTL_TRANSACT_REQ *Request, FSP_FSCTL_TRANSACT_RSP *Response)
+{
+    OPGUARD_DATA *Data = FileSystem->UserContext;
+    BOOLEAN Guarded, Exclusive;
+    ULONG Domain, First = 0, Last = 0;
+    volatile LONG *Counts = 0;
+    LONG Inside, InsideMax;
+    volatile ULONG Seed = (ULONG)Request->Hint;
+    ULONG Ticks;
+
+    Guarded = opguard_guarded(Data->Strategy, Request, &Domain, &Exclusive);
+
+    Inside = InterlockedIncrement(&Data->Inside);
+    while (Inside > (InsideMax = Data->InsideMax))
+        if (InsideMax == InterlockedCompareExchange(&Data->InsideMax, Inside, InsideMax))
+            break;
+    if (Guarded)
+    {
+        /* both sides check on entry and exit, so any overlap is caught by one of them */
+        First = OPGUARD_DOMAIN_ALL == Domain ? 0 : Domain;
+        Last = OPGUARD_DOMAIN_ALL == Domain ? OPGUARD_DOMAINS - 1 : Domain;
+        Counts = Exclusive ? Data->Exclusive : Data->Shared;
+        for (ULONG I = First; Last >= I; I++)
+            InterlockedIncrement(&Counts[I]);
+        opguard_check(Data, Domain, Exclusive);
+    }
+
+    if (0 != Data->Rendezvous)
+    {
+        Ticks = GetTickCount();
+        while (Data->Rendezvous > Data->Inside && 2000 > GetTickCount() - Ticks)
+            SwitchToThread();
+    }
+    for (ULONG I = 0; Data->Work > I; I++)
+        Seed = Seed * 1103515245 + 12345;
+
+    if (Guarded)
+    {
+        opguard_check(Data, Domain, Exclusive);
+        for (ULONG I = First; Last >= I; I++)
+            InterlockedDecrement(&Counts[I]);
+    }
+    InterlockedDecrement(&Data->Inside);
+
+    Response->IoStatus.Status = STATUS_SUCCESS;
+    return STATUS_SUCCESS;
+}
+
+static FSP_FSCTL_TRANSACT_REQ *opguard_request(UINT32 Kind, PWSTR FileName, PWSTR Extra)
+{
+    /*
+     * Requests have the shape that the FSD sends: Read has no file name; QueryDirectory has
+     * the directory name and an optional Pattern; Rename has the NewFileName. The buffer is
+     * not term-0 past the strings, so that the guard cannot rely on it.
+     */
+    FSP_FSCTL_TRANSACT_REQ *Request;
+    UINT16 FileNameSize, ExtraSize;
+
+    FileNameSize = 0 != FileName ? (UINT16)((lstrlenW(FileName) + 1) * sizeof(WCHAR)) : 0;
+    ExtraSize = 0 != Extra ? (UINT16)((lstrlenW(Extra) + 1) * sizeof(WCHAR)) : 0;
+
+    Request = malloc(sizeof *Request + FileNameSize + ExtraSize + 16);
+    ASSERT(0 != Request);
+    memset(Request, 0, sizeof *Request);
+    memset(Request->Buffer, 0xcc, FileNameSize + ExtraSize + 16);
+    Request->Size = (UINT16)(sizeof *Request + FileNameSize + ExtraSize);
+    Request->Kind = Kind;
+    Request->FileName.Offset = 0;
+    Request->FileName.Size = FileNameSize;
+    if (0 != FileName)
+        memcpy(Request->Buffer, FileName, FileNameSize);
+    if (0 != Extra)
+    {
+        switch (Kind)
+        {
+        case FspFsctlTransactQueryDirectoryKind:
+            Request->Req.QueryDirectory.Pattern.Offset = FileNameSize;
+            Request->Req.QueryDirectory.Pattern.Size = ExtraSize;
+            break;
+        case FspFsctlTransactSetInformationKind:
+            Request->Req.SetInformation.FileInformationClass = 10/*FileRenameInformation*/;
+            Request->Req.SetInformation.Info.Rename.NewFileName.Offset = FileNameSize;
+            Request->Req.SetInformation.Info.Rename.NewFileName.Size = ExtraSize;
+            break;
+        default:
+            ASSERT(0);
+            break;
+        }
+        memcpy(Request->Buffer + FileNameSize, Extra, ExtraSize);
+    }
+
+    return Request;
+}
+
+static unsigned __stdcall opguard_dotest_thread(void *Data0)
+{
+    OPGUARD_THREAD_DATA *Data = Data0;
+    FSP_FILE_SYSTEM *FileSystem = Data->FileSystem;
+    OPGUARD_DATA *OpGuardData = FileSystem->UserContext;
+    FSP_FSCTL_TRANSACT_REQ *Requests[2][opguard_count], *Request;
+    FSP_FSCTL_TRANSACT_RSP Response;
+    WCHAR DirName[64], FileName[64], NewFileName[64];
+    ULONG Dir, Level, Kind;
+
+    /*
+     * Threads share the top level directories \dN. Operations alternate between \dN (level 0)
+     * and its subdirectory \dN\s (level 1); renames always rename \dN itself.
+     */
+    Dir = Data->Index % OpGuardData->DirCount;
+    for (Level = 0; 2 > Level; Level++)
+    {
+        StringCbPrintfW(DirName, sizeof DirName, 0 == Level ? L"\\d%lu" : L"\\d%lu\\s", Dir);
+        StringCbPrintfW(FileName, sizeof FileName, L"%s\\file%lu", DirName, Data->Index);
+        Requests[Level][opguard_create] = opguard_request(FspFsctlTransactCreateKind, FileName, 0);
+        Requests[Level][opguard_create]->Req.Create.CreateOptions = FILE_CREATE << 24;
+        Requests[Level][opguard_open] = opguard_request(FspFsctlTransactCreateKind, FileName, 0);
+        Requests[Level][opguard_open]->Req.Create.CreateOptions = FILE_OPEN << 24;
+        Requests[Level][opguard_read] = opguard_request(FspFsctlTransactReadKind, 0, 0);
+        Requests[Level][opguard_querydir] = opguard_request(FspFsctlTransactQueryDirectoryKind,
+            DirName, 0 == Data->Index % 2 ? L"file*" : 0);
+        StringCbPrintfW(FileName, sizeof FileName, L"\\d%lu", Dir);
+        StringCbPrintfW(NewFileName, sizeof NewFileName, L"\\d%lu.new", Dir);
+        Requests[Level][opguard_rename] = opguard_request(FspFsctlTransactSetInformationKind,
+            FileName, NewFileName);
+    }
+
+    for (ULONG I = 0; Data->Iterations > I; I++)
+    {
+        if (-1 == Data->Kind)
+        {
+            /* mostly opens and reads */
+            Kind = (I * 7 + Data->Index) % 20;
+            Kind = 0 == Kind ? opguard_create : 19 == Kind ? opguard_rename :
+                17 <= Kind ? opguard_querydir : 9 > Kind ? opguard_open : opguard_read;
+        }
+        else
+            Kind = Data->Kind;
+        Level = OpGuardData->SameLevel ? 0 : (I / 20 + Data->Index) % 2;
+
+        /* lock domain of the accessed directory: 0 is the root, then \dN and \dN\s */
+        Request = Requests[Level][Kind];
+        Request->Hint = ((UINT64)(1 + 2 * Dir + Level) << 32) | I;
+
+        memset(&Response, 0, sizeof Response);
+        Response.Size = sizeof Response;
+        Response.Kind = Request->Kind;
+        Response.Hint = Request->Hint;
+        Response.IoStatus.Status = FspFileSystemEnterOperation(FileSystem, Request, &Response);
+        if (NT_SUCCESS(Response.IoStatus.Status))
+        {
+            FileSystem->Operations[Request->Kind](FileSystem, Request, &Response);
+            FspFileSystemLeaveOperation(FileSystem, Request, &Response);
+        }
+        if (!NT_SUCCESS(Response.IoStatus.Status))
+            break;
+    }
+
+    for (Level = 0; 2 > Level; Level++)
+        for (ULONG I = 0; opguard_count > I; I++)
+            free(Requests[Level][I]);
+
+    return 0;
+}
+
+static ULONG opguard_dotest(OPGUARD_DATA *Data, ULONG ThreadCount, ULONG Iterations,
+    const LONG *Kinds)
+{
+    FSP_FILE_SYSTEM *FileSystem;
+    OPGUARD_THREAD_DATA ThreadData[16];
+    HANDLE Threads[16];
+    LARGE_INTEGER Frequency, Start, End;
+    NTSTATUS Result;
+
+    ASSERT(sizeof Threads / sizeof Threads[0] >= ThreadCount);
+    ASSERT(0 < Data->DirCount && OPGUARD_DIRS >= Data->DirCount);
+
+    Result = FspFileSystemCreate(0, 0, 0, &FileSystem);
+    ASSERT(NT_SUCCESS(Result));
+    FileSystem->UserContext = Data;
+    FspFileSystemSetOperationGuardStrategy(FileSystem, Data->Strategy);
+    FspFileSystemSetOperation(FileSystem, FspFsctlTransactCreateKind, opguard_operation);
+    FspFileSystemSetOperation(FileSystem, FspFsctlTransactReadKind, opguard_operation);
+    FspFileSystemSetOperation(FileSystem, FspFsctlTransactQueryDirectoryKind, opguard_operation);
+    FspFileSystemSetOperation(FileSystem, FspFsctlTransactSetInformationKind, opguard_operation);
+
+    QueryPerformanceFrequency(&Frequency);
+    QueryPerformanceCounter(&Start);
+
+    for (ULONG I = 0; ThreadCount > I; I++)
+    {
+        ThreadData[I].FileSystem = FileSystem;
+        ThreadData[I].Index = I;
+        ThreadData[I].Iterations = Iterations;
+        ThreadData[I].Kind = 0 != Kinds ? Kinds[I] : -1;
+        Threads[I] = (HANDLE)_beginthreadex(0, 0, opguard_dotest_thread, &ThreadData[I], 0, 0);
+        ASSERT(0 != Threads[I]);
+    }
+
+    for (ULONG I = 0; ThreadCount > I; I++)
+    {
+        WaitForSingleObject(Threads[I], INFINITE);
+        CloseHandle(Threads[I]);
+    }
+
+    QueryPerformanceCounter(&End);
+
+    FspFileSystemDelete(FileSystem);
+
+    ASSERT(0 == Data->Inside);
+    for (ULONG I = 0; OPGUARD_DOMAINS > I; I++)
+        ASSERT(0 == Data->Shared[I] && 0 == Data->Exclusive[I]);
+
+    return (ULONG)((End.QuadPart - Start.QuadPart) * 1000 / Frequency.QuadPart);
+}
+
+static void opguard_exclusion_test(void)
+{
+    static const FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY Strategies[] =
+    {
+        FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY_COARSE,
+        FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY_FINE,
+        FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY_STRIPED,
+    };
+    OPGUARD_DATA Data;
+
+    for (ULONG I = 0; sizeof Strategies / sizeof Strategies[0] > I; I++)
+    {
+        /* 8 threads in 2 directories, so that they contend within and across directories */
+        memset(&Data, 0, sizeof Data);
+        Data.Strategy = Strategies[I];
+        Data.DirCount = 2;
+        Data.Work = 100;
+        opguard_dotest(&Data, 8, 10000, 0);
+        ASSERT(0 == Data.Violations);
+        if (FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY_COARSE == Strategies[I])
+            ASSERT(1 == Data.InsideMax);
+    }
+}
+
+static void opguard_striped_test(void)
+{
+    static const LONG CreateCreate[] = { opguard_create, opguard_create };
+    static const LONG RenameCreate[] = { opguard_rename, opguard_create };
+    static const LONG QueryDirCreate[] = { opguard_querydir, opguard_create };
+    OPGUARD_DATA Data;
+
+    /* creates are exclusive under FINE; with STRIPED two of them in \d0 and \d1\s can meet */
+    memset(&Data, 0, sizeof Data);
+    Data.Strategy = FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY_STRIPED;
+    Data.DirCount = 2;
+    Data.Rendezvous = 2;
+    opguard_dotest(&Data, 2, 1, CreateCreate);
+    ASSERT(2 == Data.InsideMax);
+    ASSERT(0 == Data.Violations);
+
+    /* a rename of \d0 and a create in \d0\s must not meet (the rendezvous times out) */
+    memset(&Data, 0, sizeof Data);
+    Data.Strategy = FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY_STRIPED;
+    Data.DirCount = 1;
+    Data.Rendezvous = 2;
+    opguard_dotest(&Data, 2, 1, RenameCreate);
+    ASSERT(1 == Data.InsideMax);
+    ASSERT(0 == Data.Violations);
+
+    /* reading \d0 and creating \d0\file1 must not meet (the rendezvous times out) */
+    memset(&Data, 0, sizeof Data);
+    Data.Strategy = FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY_STRIPED;
+    Data.DirCount = 1;
+    Data.Rendezvous = 2;
+    Data.SameLevel = TRUE;
+    opguard_dotest(&Data, 2, 1, QueryDirCreate);
+    ASSERT(1 == Data.InsideMax);
+    ASSERT(0 == Data.Violations);
+
+    /* renames of \dN exclude everything below it, e.g. creates in \dN\s */
+    memset(&Data, 0, sizeof Data);
+    Data.Strategy = FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY_STRIPED;
+    Data.DirCount = 1;
+    Data.Work = 100;
+    opguard_dotest(&Data, 8, 10000, 0);
+    ASSERT(0 == Data.Violations);
+}
+
+static void opguard_none_test(void)
+{
+    static const LONG CreateCreate[] = { opguard_create, opguard_create };
+    OPGUARD_DATA Data;
+
+    /* creates are exclusive under FINE; with NONE two of them can meet */
+    memset(&Data, 0, sizeof Data);
+    Data.Strategy = FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY_NONE;
+    Data.DirCount = 1;
+    Data.Rendezvous = 2;
+    opguard_dotest(&Data, 2, 1, CreateCreate);
+    ASSERT(2 == Data.InsideMax);
+    ASSERT(0 == Data.Violations);
+
+    memset(&Data, 0, sizeof Data);
+    Data.Strategy = FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY_NONE;
+    Data.DirCount = 2;
+    Data.Work = 100;
+    opguard_dotest(&Data, 8, 10000, 0);
+    ASSERT(0 == Data.Inside);
+}
+
+static void opguard_bench(void)
+{
+    /*
+     * benchmark: operations per second for every guard strategy and dispatcher thread count;
+     * the mix is 40% opens, 40% reads, 10% directory queries, 5% creates, 5% renames and
+     * every thread works in its own directory
+     */
+    static const struct
+    {
+        const char *Name;
+        FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY Strategy;
+    } Strategies[] =
+    {
+        { "coarse", FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY_COARSE },
+        { "fine", FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY_FINE },
+        { "striped", FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY_STRIPED },
+        { "none", FSP_FILE_SYSTEM_OPERATION_GUARD_STRATEGY_NONE },
+    };
+    static const ULONG ThreadCounts[] = { 1, 2, 4, 8 };
+    ULONG Iterations = 200000, Millis;
+    OPGUARD_DATA Data;
+
+    for (ULONG I = 0; sizeof Strategies / sizeof Strategies[0] > I; I++)
+    {
+        tlib_printf("%s:", Strategies[I].Name);
+        for (ULONG J = 0; sizeof ThreadCounts / sizeof ThreadCounts[0] > J; J++)
+        {
+            memset(&Data, 0, sizeof Data);
+            Data.Strategy = Strategies[I].Strategy;
+            Data.DirCount = ThreadCounts[J];
+            Data.Work = 1000;
+            Millis = opguard_dotest(&Data, ThreadCounts[J], Iterations, 0);
+            tlib_printf(" threads=%lu %lu/s", ThreadCounts[J],
+                (ULONG)((UINT64)ThreadCounts[J] * Iterations * 1000 / (Millis + 1)));
+        }
+        tlib_printf(" ");
+    }
+}
+
+void opguard_tests(void)
+{
+    TEST(opguard_exclusion_test);
+    TEST(opguard_striped_test);
+    TEST(opguard_none_test);
+    TEST_OPT(opguard_bench);
+}
@@ -0,0 +1,67 @@
+#include <winfsp/winfsp.h>
+#include <shared/payload.h>
+#include <tlib/testsuite.h>
+
+static FSP_FSCTL_DECLSPEC_ALIGN UINT8 payload_message_buf[FSP_FSCTL_TRANSACT_EXT_RSP_SIZEMAX];
+
+void payload_sizemax_test(void)
+{
+    ASSERT(FSP_FSCTL_TRANSACT_REQ_SIZEMAX == FspPayloadRequestSizeMax(FALSE));
+    ASSERT(FSP_FSCTL_TRANSACT_RSP_SIZEMAX == FspPayloadResponseSizeMax(FALSE));
+    ASSERT(FSP_FSCTL_TRANSACT_EXT_REQ_SIZEMAX == FspPayloadRequestSizeMax(TRUE));
+    ASSERT(FSP_FSCTL_TRANSACT_EXT_RSP_SIZEMAX == FspPayloadResponseSizeMax(TRUE));
+
+    /* message sizes are UINT16 */
+    ASSERT(0xffff >= FspPayloadRequestSizeMax(TRUE));
+    ASSERT(0xffff >= FspPayloadResponseSizeMax(TRUE));
+    ASSERT(FSP_FSCTL_TRANSACT_EXT_BUFFER_SIZEMIN >= FspPayloadRequestSizeMax(TRUE));
+}
+
+void payload_response_test(void)
+{
+    FSP_FSCTL_TRANSACT_RSP *Response = (PVOID)payload_message_buf;
+    FSP_FSCTL_TRANSACT_BUF Buf;
+    PVOID Data;
+
+    memset(payload_message_buf, 0xcc, sizeof payload_message_buf);
+    memset(Response, 0, sizeof *Response);
+
+    /* a security descriptor that fits in a regular response */
+    Response->Size = FSP_FSCTL_TRANSACT_RSP_SIZEMAX;
+    Response->Rsp.QuerySecurity.SecurityDescriptor.Offset = 0;
+    Response->Rsp.QuerySecurity.SecurityDescriptor.Size =
+        FSP_FSCTL_TRANSACT_RSP_SIZEMAX - sizeof *Response;
+    Data = FspPayloadResponseUnpack(Response, &Response->Rsp.QuerySecurity.SecurityDescriptor);
+    ASSERT(Response->Buffer == Data);
+
+    /* one that needs the raised limit */
+    Response->Size = sizeof *Response + 20000;
+    Response->Rsp.QuerySecurity.SecurityDescriptor.Size = 20000;
+    Data = FspPayloadResponseUnpack(Response, &Response->Rsp.QuerySecurity.SecurityDescriptor);
+    ASSERT(Response->Buffer == Data);
+
+    /* a truncated response is rejected */
+    Response->Size--;
+    ASSERT(0 == FspPayloadResponseUnpack(Response, &Response->Rsp.QuerySecurity.SecurityDescriptor));
+
+    /* unpack rejects references outside the message */
+    Response->Size = FSP_FSCTL_TRANSACT_EXT_RSP_SIZEMAX;
+    Buf.Offset = (UINT16)(Response->Size - sizeof *Response);
+    Buf.Size = 0;
+    ASSERT((PUINT8)Response + Response->Size == FspPayloadResponseUnpack(Response, &Buf));
+    Buf.Size = 1;
+    ASSERT(0 == FspPayloadResponseUnpack(Response, &Buf));
+    Buf.Offset = 0xffff;
+    Buf.Size = 0xffff;
+    ASSERT(0 == FspPayloadResponseUnpack(Response, &Buf));
+    Buf.Offset = 0;
+    Buf.Size = 0;
+    Response->Size = sizeof *Response - 1;
+    ASSERT(0 == FspPayloadResponseUnpack(Response, &Buf));
+}
+
+void payload_tests(void)
+{
+    TEST(payload_sizemax_test);
+    TEST(payload_response_test);
+}
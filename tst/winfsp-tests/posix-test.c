@@ -214,6 +214,120 @@ void posix_map_sd_test(void)
     }
 }
 
+void posix_map_cache_test(void)
+{
+    /* mappings are cached; results must not depend on whether they come from the cache */
+    PWSTR SidStrs[] =
+    {
+        L"S-1-5-18", L"S-1-5-32-544", L"S-1-5-64-10", L"S-1-16-8192", L"S-1-1-0", L"S-1-0-65534",
+    };
+    UINT32 Uids[] = { 18, 544, 0x10100, 65534 };
+    NTSTATUS Result;
+    BOOL Success;
+    PSID Sid;
+    UINT32 Uid0, Uid1;
+    PSECURITY_DESCRIPTOR SecurityDescriptor0, SecurityDescriptor1, SecurityDescriptor2;
+    ULONG Size;
+
+    for (size_t i = 0; sizeof SidStrs / sizeof SidStrs[0] > i; i++)
+    {
+        Success = ConvertStringSidToSidW(SidStrs[i], &Sid);
+        ASSERT(Success);
+
+        Result = FspPosixMapSidToUid(Sid, &Uid0);
+        ASSERT(NT_SUCCESS(Result));
+        Result = FspPosixMapSidToUid(Sid, &Uid1);
+        ASSERT(NT_SUCCESS(Result));
+        ASSERT(Uid0 == Uid1);
+
+        LocalFree(Sid);
+    }
+
+    for (size_t i = 0; sizeof Uids / sizeof Uids[0] > i; i++)
+        for (size_t j = 0; sizeof Uids / sizeof Uids[0] > j; j++)
+            for (UINT32 Mode = 0; 01777 >= Mode; Mode++)
+            {
+                Result = FspPosixMapPermissionsToSecurityDescriptor(
+                    Uids[i], Uids[j], 0040000 | Mode, &SecurityDescriptor0);
+                ASSERT(NT_SUCCESS(Result));
+                Result = FspPosixMapPermissionsToSecurityDescriptor(
+                    Uids[i], Uids[j], 0040000 | Mode, &SecurityDescriptor1);
+                ASSERT(NT_SUCCESS(Result));
+                Result = FspPosixMapPermissionsToSecurityDescriptor(
+                    Uids[i], Uids[j], 0100000 | Mode, &SecurityDescriptor2);
+                ASSERT(NT_SUCCESS(Result));
+
+                /* a returned security descriptor belongs to the caller */
+                ASSERT(SecurityDescriptor0 != SecurityDescriptor1);
+                Size = GetSecurityDescriptorLength(SecurityDescriptor0);
+                ASSERT(Size == GetSecurityDescriptorLength(SecurityDescriptor1));
+                ASSERT(0 == memcmp(SecurityDescriptor0, SecurityDescriptor1, Size));
+                FspDeleteSecurityDescriptor(SecurityDescriptor1,
+                    FspPosixMapPermissionsToSecurityDescriptor);
+
+                /* the file type bits other than directory do not change the security descriptor */
+                Result = FspPosixMapPermissionsToSecurityDescriptor(
+                    Uids[i], Uids[j], Mode, &SecurityDescriptor1);
+                ASSERT(NT_SUCCESS(Result));
+                Size = GetSecurityDescriptorLength(SecurityDescriptor1);
+                ASSERT(Size == GetSecurityDescriptorLength(SecurityDescriptor2));
+                ASSERT(0 == memcmp(SecurityDescriptor1, SecurityDescriptor2, Size));
+
+                FspDeleteSecurityDescriptor(SecurityDescriptor2,
+                    FspPosixMapPermissionsToSecurityDescriptor);
+                FspDeleteSecurityDescriptor(SecurityDescriptor1,
+                    FspPosixMapPermissionsToSecurityDescriptor);
+                FspDeleteSecurityDescriptor(SecurityDescriptor0,
+                    FspPosixMapPermissionsToSecurityDescriptor);
+            }
+}
+
+void posix_map_bench(void)
+{
+    /* benchmark: the mappings done by the FUSE layer on Create and GetSecurity */
+    HANDLE Token;
+    union
+    {
+        TOKEN_USER V;
+        UINT8 B[128];
+    } UserInfoBuf;
+    DWORD Size;
+    PSECURITY_DESCRIPTOR SecurityDescriptor;
+    UINT32 Uid, Gid = 544;
+    ULONG Count = 1000000;
+    LARGE_INTEGER Frequency, T0, T1, T2;
+    NTSTATUS Result;
+    BOOL Success;
+
+    Success = OpenProcessToken(GetCurrentProcess(), TOKEN_QUERY, &Token);
+    ASSERT(Success);
+    Success = GetTokenInformation(Token, TokenUser, &UserInfoBuf, sizeof UserInfoBuf, &Size);
+    ASSERT(Success);
+    CloseHandle(Token);
+
+    QueryPerformanceFrequency(&Frequency);
+
+    QueryPerformanceCounter(&T0);
+    for (ULONG I = 0; Count > I; I++)
+    {
+        Result = FspPosixMapSidToUid(UserInfoBuf.V.User.Sid, &Uid);
+        ASSERT(NT_SUCCESS(Result));
+    }
+    QueryPerformanceCounter(&T1);
+    for (ULONG I = 0; Count > I; I++)
+    {
+        Result = FspPosixMapPermissionsToSecurityDescriptor(Uid, Gid, 0100644, &SecurityDescriptor);
+        ASSERT(NT_SUCCESS(Result));
+        FspDeleteSecurityDescriptor(SecurityDescriptor,
+            FspPosixMapPermissionsToSecurityDescriptor);
+    }
+    QueryPerformanceCounter(&T2);
+
+    tlib_printf("sid->uid %lu ns perm->sd %lu ns ",
+        (ULONG)((T1.QuadPart - T0.QuadPart) * 1000000000 / (Frequency.QuadPart * Count)),
+        (ULONG)((T2.QuadPart - T1.QuadPart) * 1000000000 / (Frequency.QuadPart * Count)));
+}
+
 void posix_map_path_test(void)
 {
     struct
@@ -244,9 +358,215 @@ void posix_map_path_test(void)
     }
 }
 
+void posix_map_path_buffer_test(void)
+{
+    struct
+    {
+        PWSTR WindowsPath;
+        const char *PosixPath;
+    } map[] =
+    {
+        { L"", "" },
+        { L"\\", "/" },
+        { L"\\foo\\bar", "/foo/bar" },
+        { L"\\0123456789abcdef\\0123456789abcdef\\0123456789abcdef", "/0123456789abcdef/0123456789abcdef/0123456789abcdef" },
+        { L"\\0123456789abcdef\xf03c\xf03e\xf03a\xf02f\xf05c\xf022\xf07c\xf03f\xf02a\\0123456789abcdef", "/0123456789abcdef<>:\xef\x80\xaf\\\"|?*/0123456789abcdef" },
+        { L"\\0123456789\x00e9\x20ac\xd83d\xde00\\abcdef", "/0123456789\xc3\xa9\xe2\x82\xac\xf0\x9f\x98\x80/abcdef" },
+    };
+    NTSTATUS Result;
+    WCHAR WindowsPath[128];
+    char PosixPath[128];
+    ULONG Size, ResultSize, PosixSize, WindowsSize;
+
+    for (size_t i = 0; sizeof map / sizeof map[0] > i; i++)
+    {
+        PosixSize = (ULONG)strlen(map[i].PosixPath) + 1;
+        for (Size = 0; PosixSize + 1 >= Size; Size++)
+        {
+            memset(PosixPath, 0x5a, sizeof PosixPath);
+            ResultSize = Size;
+            Result = FspPosixMapWindowsToPosixPathBuffer(map[i].WindowsPath, PosixPath, &ResultSize);
+            ASSERT(PosixSize == ResultSize);
+            ASSERT(0x5a == PosixPath[Size]);
+            if (PosixSize <= Size)
+            {
+                ASSERT(STATUS_SUCCESS == Result);
+                ASSERT(0 == strcmp(map[i].PosixPath, PosixPath));
+            }
+            else
+                ASSERT(STATUS_BUFFER_OVERFLOW == Result);
+        }
+
+        WindowsSize = (ULONG)(wcslen(map[i].WindowsPath) + 1) * sizeof(WCHAR);
+        for (Size = 0; WindowsSize + sizeof(WCHAR) >= Size; Size += sizeof(WCHAR))
+        {
+            memset(WindowsPath, 0x5a, sizeof WindowsPath);
+            ResultSize = Size;
+            Result = FspPosixMapPosixToWindowsPathBuffer(map[i].PosixPath, WindowsPath, &ResultSize);
+            ASSERT(WindowsSize == ResultSize);
+            ASSERT(0x5a5a == WindowsPath[Size / sizeof(WCHAR)]);
+            if (WindowsSize <= Size)
+            {
+                ASSERT(STATUS_SUCCESS == Result);
+                ASSERT(0 == wcscmp(map[i].WindowsPath, WindowsPath));
+            }
+            else
+                ASSERT(STATUS_BUFFER_OVERFLOW == Result);
+        }
+    }
+
+    /* unpaired surrogates are replaced; invalid UTF-8 is converted like MultiByteToWideChar does */
+    Size = sizeof PosixPath;
+    Result = FspPosixMapWindowsToPosixPathBuffer(L"\\\xd800\\\xdc00", PosixPath, &Size);
+    ASSERT(STATUS_SUCCESS == Result);
+    ASSERT(0 == strcmp("/\xef\xbf\xbd/\xef\xbf\xbd", PosixPath));
+    Size = sizeof WindowsPath;
+    Result = FspPosixMapPosixToWindowsPathBuffer("/\xc3\\\xff", WindowsPath, &Size);
+    ASSERT(STATUS_SUCCESS == Result);
+    ASSERT(0 == wcscmp(L"\\\xfffd\xf05c\xfffd", WindowsPath));
+}
+
+static BOOLEAN posix_map_path_is_invalid(UINT32 c)
+{
+    return 0 != c && 128 > c && (32 > c || 0 != strchr("<>:\"\\|?*", c));
+}
+
+static char *posix_map_path_reference(PWSTR WindowsPath)
+{
+    /* the original implementation: WideCharToMultiByte followed by a transformation pass */
+    char *PosixPath, *p, *q;
+    int Size;
+
+    Size = WideCharToMultiByte(CP_UTF8, 0, WindowsPath, -1, 0, 0, 0, 0);
+    ASSERT(0 != Size);
+    PosixPath = malloc(Size);
+    ASSERT(0 != PosixPath);
+    Size = WideCharToMultiByte(CP_UTF8, 0, WindowsPath, -1, PosixPath, Size, 0, 0);
+    ASSERT(0 != Size);
+
+    for (p = PosixPath, q = p; *p; p++)
+    {
+        unsigned char c = *p;
+
+        if ('\\' == c)
+            *q++ = '/';
+        else if (0xef == c && 0x80 == (0xfc & p[1]) && 0x80 == (0xc0 & p[2]))
+        {
+            c = ((p[1] & 0x3) << 6) | (p[2] & 0x3f);
+            if (posix_map_path_is_invalid(c))
+                *q++ = c, p += 2;
+            else
+                *q++ = *p++, *q++ = *p++, *q++ = *p;
+        }
+        else
+            *q++ = c;
+    }
+    *q = '\0';
+
+    return PosixPath;
+}
+
+void posix_map_path_unicode_test(void)
+{
+    /* every code unit and code point; alone and after a run of ASCII (vectorized) characters */
+    static const WCHAR Prefix[] = L"\\0123456789abcdefghij\\";
+    WCHAR WindowsPath[64];
+    PWSTR WindowsPath2;
+    char *PosixPath, *RefPosixPath;
+    ULONG Start, Length;
+    NTSTATUS Result;
+
+    for (UINT32 c = 1; 0x110000 > c; c++)
+        for (Start = 0; sizeof Prefix / sizeof(WCHAR) > Start; Start += sizeof Prefix / sizeof(WCHAR) - 1)
+        {
+            Length = Start;
+            memcpy(WindowsPath, Prefix, Start * sizeof(WCHAR));
+            if (0x10000 > c)
+                WindowsPath[Length++] = (WCHAR)c;
+            else
+            {
+                WindowsPath[Length++] = (WCHAR)(0xd800 + ((c - 0x10000) >> 10));
+                WindowsPath[Length++] = (WCHAR)(0xdc00 + ((c - 0x10000) & 0x3ff));
+            }
+            WindowsPath[Length++] = L'x';
+            WindowsPath[Length] = L'\0';
+
+            Result = FspPosixMapWindowsToPosixPath(WindowsPath, &PosixPath);
+            ASSERT(NT_SUCCESS(Result));
+            RefPosixPath = posix_map_path_reference(WindowsPath);
+            ASSERT(0 == strcmp(RefPosixPath, PosixPath));
+            free(RefPosixPath);
+
+            /* everything but surrogates, '/' and characters invalid in Windows file names round trips */
+            Result = FspPosixMapPosixToWindowsPath(PosixPath, &WindowsPath2);
+            ASSERT(NT_SUCCESS(Result));
+            if ((0xd800 > c || 0xdfff < c) && L'/' != c && (L'\\' == c || !posix_map_path_is_invalid(c)))
+                ASSERT(0 == wcscmp(WindowsPath, WindowsPath2));
+
+            FspPosixDeletePath(WindowsPath2);
+            FspPosixDeletePath(PosixPath);
+        }
+}
+
+void posix_map_path_bench(void)
+{
+    /* benchmark: conversion of a typical path with and without allocation */
+    PWSTR WindowsPath = L"\\Users\\user\\Documents\\Projects\\winfsp\\src\\dll\\fuse\\fuse_intf.c";
+    const char *PosixPath = "/Users/user/Documents/Projects/winfsp/src/dll/fuse/fuse_intf.c";
+    char PosixPathBuf[512], *PosixPath2;
+    WCHAR WindowsPathBuf[256];
+    PWSTR WindowsPath2;
+    ULONG Count = 1000000, Size;
+    LARGE_INTEGER Frequency, T0, T1, T2, T3, T4;
+    NTSTATUS Result;
+
+    QueryPerformanceFrequency(&Frequency);
+
+    QueryPerformanceCounter(&T0);
+    for (ULONG I = 0; Count > I; I++)
+    {
+        Result = FspPosixMapWindowsToPosixPath(WindowsPath, &PosixPath2);
+        ASSERT(NT_SUCCESS(Result));
+        FspPosixDeletePath(PosixPath2);
+    }
+    QueryPerformanceCounter(&T1);
+    for (ULONG I = 0; Count > I; I++)
+    {
+        Size = sizeof PosixPathBuf;
+        Result = FspPosixMapWindowsToPosixPathBuffer(WindowsPath, PosixPathBuf, &Size);
+        ASSERT(NT_SUCCESS(Result));
+    }
+    QueryPerformanceCounter(&T2);
+    for (ULONG I = 0; Count > I; I++)
+    {
+        Result = FspPosixMapPosixToWindowsPath(PosixPath, &WindowsPath2);
+        ASSERT(NT_SUCCESS(Result));
+        FspPosixDeletePath(WindowsPath2);
+    }
+    QueryPerformanceCounter(&T3);
+    for (ULONG I = 0; Count > I; I++)
+    {
+        Size = sizeof WindowsPathBuf;
+        Result = FspPosixMapPosixToWindowsPathBuffer(PosixPath, WindowsPathBuf, &Size);
+        ASSERT(NT_SUCCESS(Result));
+    }
+    QueryPerformanceCounter(&T4);
+
+    tlib_printf("w2p %lu/%lu ns p2w %lu/%lu ns (alloc/buffer) ",
+        (ULONG)((T1.QuadPart - T0.QuadPart) * 1000000000 / (Frequency.QuadPart * Count)),
+        (ULONG)((T2.QuadPart - T1.QuadPart) * 1000000000 / (Frequency.QuadPart * Count)),
+        (ULONG)((T3.QuadPart - T2.QuadPart) * 1000000000 / (Frequency.QuadPart * Count)),
+        (ULONG)((T4.QuadPart - T3.QuadPart) * 1000000000 / (Frequency.QuadPart * Count)));
+}
+
 void posix_tests(void)
 {
     TEST(posix_map_sid_test);
     TEST(posix_map_sd_test);
+    TEST(posix_map_cache_test);
+    TEST_OPT(posix_map_bench);
     TEST(posix_map_path_test);
+    TEST(posix_map_path_buffer_test);
+    TEST(posix_map_path_unicode_test);
+    TEST_OPT(posix_map_path_bench);
 }
@@ -0,0 +1,131 @@
+#include <winfsp/winfsp.h>
+#include <shared/ptrset.h>
+#include <tlib/testsuite.h>
+
+#define PTRSET_KEY(Keys, I)             ((PVOID)((PUINT8)(Keys) + (I) * 256))
+
+static void ptrset_grow(FSP_PTRSET *Set)
+{
+    PVOID *Slots;
+    ULONG SlotCount;
+
+    SlotCount = FspPtrSetGrowSlotCount(Set);
+    if (0 == SlotCount)
+        return;
+
+    Slots = malloc(SlotCount * sizeof Slots[0]);
+    ASSERT(0 != Slots);
+    free(FspPtrSetRehash(Set, Slots, SlotCount));
+    ASSERT(SlotCount == FspPtrSetSlotCount(Set));
+}
+
+void ptrset_test(void)
+{
+    FSP_PTRSET Set;
+    PVOID Slots[FspPtrSetMinimumSlotCount];
+    PUINT8 Keys;
+    ULONG Index;
+
+    Keys = malloc(1000 * 256);
+    ASSERT(0 != Keys);
+
+    FspPtrSetInitialize(&Set, Slots, FspPtrSetMinimumSlotCount);
+    ASSERT(0 == FspPtrSetCount(&Set));
+    ASSERT(0 == FspPtrSetFind(&Set, PTRSET_KEY(Keys, 0)));
+    ASSERT(!FspPtrSetRemove(&Set, PTRSET_KEY(Keys, 0)));
+
+    /* a set keeps one free slot and refuses to become completely full */
+    for (Index = 0; FspPtrSetMinimumSlotCount - 1 > Index; Index++)
+        ASSERT(FspPtrSetInsert(&Set, PTRSET_KEY(Keys, Index)));
+    ASSERT(!FspPtrSetInsert(&Set, PTRSET_KEY(Keys, Index)));
+    ASSERT(FspPtrSetMinimumSlotCount - 1 == FspPtrSetCount(&Set));
+    for (Index = 0; FspPtrSetMinimumSlotCount - 1 > Index; Index++)
+        ASSERT(PTRSET_KEY(Keys, Index) == FspPtrSetFind(&Set, PTRSET_KEY(Keys, Index)));
+    ASSERT(0 == FspPtrSetFind(&Set, PTRSET_KEY(Keys, Index)));
+    for (Index = 0; FspPtrSetMinimumSlotCount - 1 > Index; Index++)
+        ASSERT(FspPtrSetRemove(&Set, PTRSET_KEY(Keys, Index)));
+    ASSERT(0 == FspPtrSetCount(&Set));
+    for (Index = 0; FspPtrSetMinimumSlotCount > Index; Index++)
+        ASSERT(0 == Slots[Index]);
+
+    /* grow from the minimum size; remove in an order different from insertion */
+    FspPtrSetInitialize(&Set, malloc(FspPtrSetMinimumSlotCount * sizeof(PVOID)),
+        FspPtrSetMinimumSlotCount);
+    ASSERT(0 != Set.Slots);
+    for (Index = 0; 1000 > Index; Index++)
+    {
+        ptrset_grow(&Set);
+        ASSERT(FspPtrSetInsert(&Set, PTRSET_KEY(Keys, Index)));
+    }
+    ASSERT(1000 == FspPtrSetCount(&Set));
+    ASSERT(2048 == FspPtrSetSlotCount(&Set));
+    for (Index = 0; 1000 > Index; Index++)
+    {
+        ASSERT(PTRSET_KEY(Keys, Index) == FspPtrSetFind(&Set, PTRSET_KEY(Keys, Index)));
+        ASSERT(0 == FspPtrSetFind(&Set, (PUINT8)PTRSET_KEY(Keys, Index) + 8));
+    }
+    for (Index = 0; 1000 > Index; Index += 2)
+        ASSERT(FspPtrSetRemove(&Set, PTRSET_KEY(Keys, Index)));
+    for (Index = 0; 1000 > Index; Index++)
+        ASSERT((Index & 1 ? PTRSET_KEY(Keys, Index) : 0) ==
+            FspPtrSetFind(&Set, PTRSET_KEY(Keys, Index)));
+    for (Index = 999; 1000 > Index; Index -= 2)
+        ASSERT(FspPtrSetRemove(&Set, PTRSET_KEY(Keys, Index)));
+    ASSERT(0 == FspPtrSetCount(&Set));
+    for (Index = 0; FspPtrSetSlotCount(&Set) > Index; Index++)
+        ASSERT(0 == Set.Slots[Index]);
+
+    free(Set.Slots);
+    free(Keys);
+}
+
+void ptrset_bench(void)
+{
+    /* benchmark: insert/lookup/remove with 10000 outstanding entries (as with an IRP dictionary) */
+    FSP_PTRSET Set;
+    PUINT8 Keys;
+    ULONG Count = 10000, Rounds = 1000, Index, Round;
+    LARGE_INTEGER Frequency, Start, End;
+
+    Keys = malloc(Count * 256);
+    ASSERT(0 != Keys);
+
+    FspPtrSetInitialize(&Set, malloc(FspPtrSetMinimumSlotCount * sizeof(PVOID)),
+        FspPtrSetMinimumSlotCount);
+    ASSERT(0 != Set.Slots);
+    for (Index = 0; Count > Index; Index++)
+    {
+        ptrset_grow(&Set);
+        ASSERT(FspPtrSetInsert(&Set, PTRSET_KEY(Keys, Index)));
+    }
+    for (Index = 0; Count > Index; Index++)
+        FspPtrSetRemove(&Set, PTRSET_KEY(Keys, Index));
+
+    QueryPerformanceFrequency(&Frequency);
+    QueryPerformanceCounter(&Start);
+    for (Round = 0; Rounds > Round; Round++)
+    {
+        for (Index = 0; Count > Index; Index++)
+            FspPtrSetInsert(&Set, PTRSET_KEY(Keys, Index));
+        for (Index = 0; Count > Index; Index++)
+            ASSERT(0 != FspPtrSetFind(&Set, PTRSET_KEY(Keys, Index)));
+        for (Index = 0; Count > Index; Index++)
+            FspPtrSetRemove(&Set, PTRSET_KEY(Keys, Index));
+    }
+    QueryPerformanceCounter(&End);
+    ASSERT(0 == FspPtrSetCount(&Set));
+
+    tlib_printf("%lu ns/op (%lu slots) ",
+        (ULONG)((End.QuadPart - Start.QuadPart) * 1000000000 /
+            (Frequency.QuadPart * 3 * Count * Rounds)),
+        FspPtrSetSlotCount(&Set));
+
+    free(Set.Slots);
+    free(Keys);
+}
+
+void ptrset_tests(void)
+{
+    TEST(ptrset_test);
+    TEST_OPT(ptrset_bench);
+}
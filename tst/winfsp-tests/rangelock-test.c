@@ -0,0 +1,201 @@
+#include <winfsp/winfsp.h>
+#include <process.h>
+#include <shared/rangelock.h>
+#include <tlib/testsuite.h>
+
+static FSP_RANGE_LOCK_ENTRY *rangelock_entry(FSP_RANGE_LOCK_ENTRY *Entry,
+    UINT64 Offset, UINT64 Length, BOOLEAN Exclusive)
+{
+    FspRangeLockEntryInitialize(Entry, Offset, Length, Exclusive);
+    return Entry;
+}
+
+void rangelock_test(void)
+{
+    FSP_RANGE_LOCK Lock;
+    FSP_RANGE_LOCK_ENTRY R1, R2, R3, W1, W2, W3, E1, E2;
+
+    FspRangeLockInitialize(&Lock);
+
+    /* shared entries never conflict; exclusive entries conflict with overlapping ranges */
+    ASSERT(FspRangeLockAcquire(&Lock, rangelock_entry(&R1, 0, 100, FALSE)));
+    ASSERT(FspRangeLockAcquire(&Lock, rangelock_entry(&R2, 50, 100, FALSE)));
+    ASSERT(FspRangeLockAcquire(&Lock, rangelock_entry(&W1, 150, 50, TRUE)));
+    ASSERT(FspRangeLockAcquire(&Lock, rangelock_entry(&W2, 200, 50, TRUE)));
+    ASSERT(!FspRangeLockAcquire(&Lock, rangelock_entry(&W3, 99, 2, TRUE)));
+    ASSERT(4 == Lock.GrantedCount && 1 == Lock.WaitingCount);
+
+    /* FIFO: a read that overlaps a waiting write waits behind it */
+    ASSERT(!FspRangeLockAcquire(&Lock, rangelock_entry(&R3, 100, 1, FALSE)));
+    ASSERT(4 == Lock.GrantedCount && 2 == Lock.WaitingCount);
+
+    /* empty ranges never conflict */
+    ASSERT(FspRangeLockAcquire(&Lock, rangelock_entry(&E1, 100, 0, TRUE)));
+    ASSERT(0 == FspRangeLockRelease(&Lock, &E1));
+
+    /* W3 still conflicts with R2 */
+    ASSERT(0 == FspRangeLockRelease(&Lock, &R1));
+    ASSERT(!W3.Granted && !R3.Granted);
+
+    /* releasing R2 grants W3 but not R3 */
+    ASSERT(&W3 == FspRangeLockRelease(&Lock, &R2));
+    ASSERT(0 == W3.GrantNext);
+    ASSERT(W3.Granted && !R3.Granted);
+    ASSERT(3 == Lock.GrantedCount && 1 == Lock.WaitingCount);
+
+    /* releasing W3 grants R3 */
+    ASSERT(&R3 == FspRangeLockRelease(&Lock, &W3));
+    ASSERT(R3.Granted);
+    ASSERT(3 == Lock.GrantedCount && 0 == Lock.WaitingCount);
+
+    /* withdrawing a waiting entry grants the entries that were waiting behind it */
+    ASSERT(!FspRangeLockAcquire(&Lock, rangelock_entry(&R1, 150, 100, FALSE)));
+    ASSERT(!FspRangeLockAcquire(&Lock, rangelock_entry(&W3, 0, 300, TRUE)));
+    ASSERT(!FspRangeLockAcquire(&Lock, rangelock_entry(&R2, 0, 10, FALSE)));
+    ASSERT(&R2 == FspRangeLockRelease(&Lock, &W3));
+    ASSERT(R2.Granted && !R1.Granted);
+
+    /* releasing both writes grants R1 */
+    ASSERT(0 == FspRangeLockRelease(&Lock, &W1));
+    ASSERT(&R1 == FspRangeLockRelease(&Lock, &W2));
+    ASSERT(R1.Granted);
+
+    /* an exclusive entry that overlaps multiple waiters grants them together */
+    ASSERT(FspRangeLockAcquire(&Lock, rangelock_entry(&W1, 1000, 1000, TRUE)));
+    ASSERT(!FspRangeLockAcquire(&Lock, rangelock_entry(&W2, 1000, 10, TRUE)));
+    ASSERT(!FspRangeLockAcquire(&Lock, rangelock_entry(&W3, 1990, 10, TRUE)));
+    ASSERT(&W2 == FspRangeLockRelease(&Lock, &W1));
+    ASSERT(&W3 == W2.GrantNext && 0 == W3.GrantNext);
+    ASSERT(0 == FspRangeLockRelease(&Lock, &W2));
+    ASSERT(0 == FspRangeLockRelease(&Lock, &W3));
+
+    /* ranges at the end of the offset space */
+    ASSERT(FspRangeLockAcquire(&Lock, rangelock_entry(&E1, (UINT64)-1LL - 10, 100, TRUE)));
+    ASSERT((UINT64)-1LL == E1.EndOffset);
+    ASSERT(!FspRangeLockAcquire(&Lock, rangelock_entry(&E2, (UINT64)-1LL - 1, 1, FALSE)));
+    ASSERT(&E2 == FspRangeLockRelease(&Lock, &E1));
+    ASSERT(0 == FspRangeLockRelease(&Lock, &E2));
+
+    ASSERT(0 == FspRangeLockRelease(&Lock, &R1));
+    ASSERT(0 == FspRangeLockRelease(&Lock, &R2));
+    ASSERT(0 == FspRangeLockRelease(&Lock, &R3));
+    ASSERT(0 == Lock.GrantedCount && 0 == Lock.WaitingCount);
+    ASSERT(&Lock.EntryList == Lock.EntryList.Next && &Lock.EntryList == Lock.EntryList.Prev);
+}
+
+/*
+ * Threads issue non-cached I/O to the same file: each I/O locks its range, spends a
+ * fixed time in "user mode" and then unlocks its range. Waiting I/O sleeps on a condition
+ * variable, as an FSD thread waits on its range lock entry's event.
+ */
+enum
+{
+    rangelock_bench_whole_file = 0,     /* every I/O locks the whole file exclusive (old design) */
+    rangelock_bench_disjoint,           /* each thread writes to its own region */
+    rangelock_bench_shared,             /* 3 reads per write to random ranges of a small file */
+};
+static struct
+{
+    SRWLOCK Lock;
+    CONDITION_VARIABLE Granted;
+    FSP_RANGE_LOCK RangeLock;
+    ULONG Mode;
+    ULONG IoCount;
+    LONGLONG IoTicks;
+} rangelock_bench_file;
+
+static void rangelock_bench_io(UINT64 Offset, ULONG Length, BOOLEAN Exclusive)
+{
+    FSP_RANGE_LOCK_ENTRY Entry;
+    LARGE_INTEGER Start, Now;
+
+    FspRangeLockEntryInitialize(&Entry, Offset, Length, Exclusive);
+    AcquireSRWLockExclusive(&rangelock_bench_file.Lock);
+    if (!FspRangeLockAcquire(&rangelock_bench_file.RangeLock, &Entry))
+        while (!Entry.Granted)
+            SleepConditionVariableSRW(&rangelock_bench_file.Granted, &rangelock_bench_file.Lock, INFINITE, 0);
+    ReleaseSRWLockExclusive(&rangelock_bench_file.Lock);
+
+    QueryPerformanceCounter(&Start);
+    do
+        QueryPerformanceCounter(&Now);
+    while (Now.QuadPart - Start.QuadPart < rangelock_bench_file.IoTicks);
+
+    AcquireSRWLockExclusive(&rangelock_bench_file.Lock);
+    if (0 != FspRangeLockRelease(&rangelock_bench_file.RangeLock, &Entry))
+        WakeAllConditionVariable(&rangelock_bench_file.Granted);
+    ReleaseSRWLockExclusive(&rangelock_bench_file.Lock);
+}
+
+static unsigned __stdcall rangelock_bench_thread(void *Data)
+{
+    ULONG ThreadIndex = (ULONG)(UINT_PTR)Data, Seed = ThreadIndex + 1;
+
+    for (ULONG I = 0; rangelock_bench_file.IoCount > I; I++)
+    {
+        Seed = Seed * 1103515245 + 12345;
+        switch (rangelock_bench_file.Mode)
+        {
+        case rangelock_bench_whole_file:
+            rangelock_bench_io(0, (ULONG)-1L, TRUE);
+            break;
+        case rangelock_bench_disjoint:
+            rangelock_bench_io((UINT64)ThreadIndex * 1024 * 1024 + (I % 16) * 65536, 65536, TRUE);
+            break;
+        case rangelock_bench_shared:
+            rangelock_bench_io(((Seed >> 16) % 256) * 4096, 65536, 0 == (Seed >> 8) % 4);
+            break;
+        }
+    }
+
+    return 0;
+}
+
+static void rangelock_bench_dotest(ULONG Mode, ULONG IoCount, ULONG IoMicroseconds)
+{
+    /* benchmark: 8 threads; report I/O per second */
+    static const char *ModeNames[] = { "whole-file", "disjoint", "shared" };
+    HANDLE Threads[8];
+    LARGE_INTEGER Frequency, Start, End;
+
+    QueryPerformanceFrequency(&Frequency);
+
+    InitializeSRWLock(&rangelock_bench_file.Lock);
+    InitializeConditionVariable(&rangelock_bench_file.Granted);
+    FspRangeLockInitialize(&rangelock_bench_file.RangeLock);
+    rangelock_bench_file.Mode = Mode;
+    rangelock_bench_file.IoCount = IoCount;
+    rangelock_bench_file.IoTicks = Frequency.QuadPart * IoMicroseconds / 1000000;
+
+    QueryPerformanceCounter(&Start);
+    for (ULONG I = 0; 8 > I; I++)
+    {
+        Threads[I] = (HANDLE)_beginthreadex(0, 0, rangelock_bench_thread, (void *)(UINT_PTR)I, 0, 0);
+        ASSERT(0 != Threads[I]);
+    }
+    WaitForMultipleObjects(8, Threads, TRUE, INFINITE);
+    QueryPerformanceCounter(&End);
+    for (ULONG I = 0; 8 > I; I++)
+        CloseHandle(Threads[I]);
+
+    ASSERT(0 == rangelock_bench_file.RangeLock.GrantedCount);
+    ASSERT(0 == rangelock_bench_file.RangeLock.WaitingCount);
+
+    tlib_printf("%s: %lu io/s %lu%% conflicts ",
+        ModeNames[Mode],
+        (ULONG)(8ULL * IoCount * Frequency.QuadPart / (End.QuadPart - Start.QuadPart)),
+        (ULONG)(rangelock_bench_file.RangeLock.Conflicts * 100 / rangelock_bench_file.RangeLock.Acquires));
+}
+
+void rangelock_bench(void)
+{
+    rangelock_bench_dotest(rangelock_bench_whole_file, 2000, 50);
+    rangelock_bench_dotest(rangelock_bench_disjoint, 2000, 50);
+    rangelock_bench_dotest(rangelock_bench_shared, 2000, 50);
+}
+
+void rangelock_tests(void)
+{
+    TEST(rangelock_test);
+    TEST_OPT(rangelock_bench);
+}
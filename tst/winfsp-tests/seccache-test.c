@@ -0,0 +1,238 @@
+#include <winfsp/winfsp.h>
+#include <tlib/testsuite.h>
+#include <sddl.h>
+#include "memfs.h"
+
+static const FSP_FILE_SYSTEM_INTERFACE *seccache_interface0;
+static FSP_FILE_SYSTEM_INTERFACE seccache_interface;
+static volatile LONG seccache_count;
+
+static NTSTATUS seccache_GetSecurityByName(FSP_FILE_SYSTEM *FileSystem,
+    PWSTR FileName, PUINT32 PFileAttributes,
+    PSECURITY_DESCRIPTOR SecurityDescriptor, SIZE_T *PSecurityDescriptorSize)
+{
+    InterlockedIncrement(&seccache_count);
+    return seccache_interface0->GetSecurityByName(FileSystem,
+        FileName, PFileAttributes, SecurityDescriptor, PSecurityDescriptorSize);
+}
+
+static FSP_FSCTL_TRANSACT_REQ *seccache_request(ULONG Kind, PWSTR FileName)
+{
+    FSP_FSCTL_TRANSACT_REQ *Request;
+    ULONG FileNameSize = (ULONG)(wcslen(FileName) + 1) * sizeof(WCHAR);
+
+    Request = malloc(sizeof *Request + FileNameSize);
+    ASSERT(0 != Request);
+    memset(Request, 0, sizeof *Request);
+    Request->Size = (UINT16)(sizeof *Request + FileNameSize);
+    Request->Kind = Kind;
+    Request->FileName.Offset = 0;
+    Request->FileName.Size = (UINT16)FileNameSize;
+    memcpy(Request->Buffer, FileName, FileNameSize);
+
+    return Request;
+}
+
+static PVOID seccache_create(FSP_FILE_SYSTEM *FileSystem,
+    PWSTR FileName, UINT32 CreateOptions, PWSTR Sddl)
+{
+    PSECURITY_DESCRIPTOR SecurityDescriptor;
+    PVOID FileNode = 0;
+    FSP_FSCTL_FILE_INFO FileInfo;
+    NTSTATUS Result;
+    BOOL Success;
+
+    Success = ConvertStringSecurityDescriptorToSecurityDescriptorW(Sddl, SDDL_REVISION_1,
+        &SecurityDescriptor, 0);
+    ASSERT(Success);
+
+    Result = FileSystem->Interface->Create(FileSystem, 0, FileName, FALSE, CreateOptions,
+        FILE_DIRECTORY_FILE == CreateOptions ? FILE_ATTRIBUTE_DIRECTORY : FILE_ATTRIBUTE_NORMAL,
+        SecurityDescriptor, 0, &FileNode, &FileInfo);
+    ASSERT(NT_SUCCESS(Result));
+
+    LocalFree(SecurityDescriptor);
+
+    return FileNode;
+}
+
+static NTSTATUS seccache_open(FSP_FILE_SYSTEM *FileSystem,
+    FSP_FSCTL_TRANSACT_REQ *Request, HANDLE AccessToken, UINT32 DesiredAccess)
+{
+    UINT32 GrantedAccess;
+
+    /* an open by a user that does not have the bypass traverse checking privilege */
+    Request->Req.Create.UserMode = TRUE;
+    Request->Req.Create.HasTraversePrivilege = FALSE;
+    Request->Req.Create.AccessToken = (UINT_PTR)AccessToken;
+    return FspAccessCheck(FileSystem, Request, FALSE, TRUE, DesiredAccess, &GrantedAccess);
+}
+
+static void seccache_setup(MEMFS **PMemfs, HANDLE *PAccessToken, PVOID *PFileNode)
+{
+    static PWSTR Dirs[] =
+    {
+        L"\\a", L"\\a\\b", L"\\a\\b\\c", L"\\a\\b\\c\\d", L"\\a\\b\\c\\d\\e", L"\\a\\b\\c\\d\\e\\f",
+    };
+    FSP_FILE_SYSTEM *FileSystem;
+    MEMFS *Memfs;
+    HANDLE ProcessToken;
+    NTSTATUS Result;
+    BOOL Success;
+
+    Result = MemfsCreate(MemfsDetached, 1000, 1024, 1024 * 1024, 0,
+        L"O:BAG:BAD:P(A;;GA;;;WD)", &Memfs);
+    ASSERT(NT_SUCCESS(Result));
+    FileSystem = MemfsFileSystem(Memfs);
+
+    for (ULONG I = 0; sizeof Dirs / sizeof Dirs[0] > I; I++)
+        FileSystem->Interface->Close(FileSystem, 0,
+            seccache_create(FileSystem, Dirs[I], FILE_DIRECTORY_FILE, L"O:BAG:BAD:P(A;;GA;;;WD)"));
+    *PFileNode = seccache_create(FileSystem, L"\\a\\b\\c\\d\\e\\f\\file", 0, L"O:BAG:BAD:P(A;;GA;;;WD)");
+    FileSystem->Interface->Close(FileSystem, 0,
+        seccache_create(FileSystem, L"\\a\\b\\c\\d\\e\\f\\denied", 0, L"O:SYG:SYD:P"));
+
+    memcpy(&seccache_interface, FileSystem->Interface, sizeof seccache_interface);
+    seccache_interface0 = FileSystem->Interface;
+    seccache_interface.GetSecurityByName = seccache_GetSecurityByName;
+    FileSystem->Interface = &seccache_interface;
+    seccache_count = 0;
+
+    Success = OpenProcessToken(GetCurrentProcess(), TOKEN_QUERY | TOKEN_DUPLICATE, &ProcessToken);
+    ASSERT(Success);
+    Success = DuplicateToken(ProcessToken, SecurityImpersonation, PAccessToken);
+    ASSERT(Success);
+    CloseHandle(ProcessToken);
+
+    *PMemfs = Memfs;
+}
+
+void seccache_test(void)
+{
+    MEMFS *Memfs;
+    FSP_FILE_SYSTEM *FileSystem;
+    HANDLE AccessToken;
+    PVOID FileNode;
+    FSP_FSCTL_TRANSACT_REQ *Request, *DeniedRequest, *CleanupRequest;
+    NTSTATUS Result;
+    LONG PerOpenCount;
+
+    seccache_setup(&Memfs, &AccessToken, &FileNode);
+    FileSystem = MemfsFileSystem(Memfs);
+    Request = seccache_request(FspFsctlTransactCreateKind, L"\\a\\b\\c\\d\\e\\f\\file");
+    DeniedRequest = seccache_request(FspFsctlTransactCreateKind, L"\\a\\b\\c\\d\\e\\f\\denied");
+
+    /* without a cache every open checks every directory on the path */
+    Result = seccache_open(FileSystem, Request, AccessToken, FILE_READ_DATA);
+    ASSERT(STATUS_SUCCESS == Result);
+    PerOpenCount = seccache_count;
+    ASSERT(8 == PerOpenCount);
+    Result = seccache_open(FileSystem, Request, AccessToken, FILE_READ_DATA);
+    ASSERT(STATUS_SUCCESS == Result);
+    ASSERT(2 * PerOpenCount == seccache_count);
+
+    Result = FspFileSystemEnableSecurityCache(FileSystem, 0);
+    ASSERT(STATUS_INVALID_PARAMETER == Result);
+    Result = FspFileSystemEnableSecurityCache(FileSystem, 60000);
+    ASSERT(NT_SUCCESS(Result));
+
+    /* with a cache only the first open goes to the file system */
+    seccache_count = 0;
+    for (ULONG I = 0; 10 > I; I++)
+    {
+        Result = seccache_open(FileSystem, Request, AccessToken, FILE_READ_DATA);
+        ASSERT(STATUS_SUCCESS == Result);
+    }
+    ASSERT(PerOpenCount == seccache_count);
+
+    /* the cache does not change access check results */
+    seccache_count = 0;
+    for (ULONG I = 0; 2 > I; I++)
+    {
+        Result = seccache_open(FileSystem, DeniedRequest, AccessToken, FILE_READ_DATA);
+        ASSERT(STATUS_ACCESS_DENIED == Result);
+    }
+    ASSERT(1 == seccache_count);
+
+    /* invalidating a directory invalidates its descendants */
+    seccache_count = 0;
+    FspFileSystemInvalidateSecurityCache(FileSystem, L"\\A\\B\\C");
+    Result = seccache_open(FileSystem, Request, AccessToken, FILE_READ_DATA);
+    ASSERT(STATUS_SUCCESS == Result);
+    ASSERT(5 == seccache_count);
+
+    seccache_count = 0;
+    FspFileSystemInvalidateSecurityCache(FileSystem, 0);
+    Result = seccache_open(FileSystem, Request, AccessToken, FILE_READ_DATA);
+    ASSERT(STATUS_SUCCESS == Result);
+    ASSERT(PerOpenCount == seccache_count);
+
+    /* a deleted file must not be found in the cache */
+    CleanupRequest = seccache_request(FspFsctlTransactCleanupKind, L"\\a\\b\\c\\d\\e\\f\\file");
+    CleanupRequest->Req.Cleanup.UserContext = (UINT_PTR)FileNode;
+    CleanupRequest->Req.Cleanup.Delete = TRUE;
+    FspFileSystemOpCleanup(FileSystem, CleanupRequest, 0);
+    FileSystem->Interface->Close(FileSystem, 0, FileNode);
+    Result = seccache_open(FileSystem, Request, AccessToken, FILE_READ_DATA);
+    ASSERT(STATUS_OBJECT_NAME_NOT_FOUND == Result);
+
+    free(CleanupRequest);
+    free(DeniedRequest);
+    free(Request);
+    CloseHandle(AccessToken);
+    MemfsDelete(Memfs);
+}
+
+static void seccache_bench_dotest(BOOLEAN Cache)
+{
+    /* benchmark: open storm below a deep directory by a user without traverse privilege */
+    MEMFS *Memfs;
+    FSP_FILE_SYSTEM *FileSystem;
+    HANDLE AccessToken;
+    PVOID FileNode;
+    FSP_FSCTL_TRANSACT_REQ *Request;
+    ULONG Count = 10000;
+    LARGE_INTEGER Frequency, Start, End;
+    NTSTATUS Result;
+
+    seccache_setup(&Memfs, &AccessToken, &FileNode);
+    FileSystem = MemfsFileSystem(Memfs);
+    FileSystem->Interface->Close(FileSystem, 0, FileNode);
+    Request = seccache_request(FspFsctlTransactCreateKind, L"\\a\\b\\c\\d\\e\\f\\file");
+
+    if (Cache)
+    {
+        Result = FspFileSystemEnableSecurityCache(FileSystem, 60000);
+        ASSERT(NT_SUCCESS(Result));
+    }
+
+    QueryPerformanceFrequency(&Frequency);
+    QueryPerformanceCounter(&Start);
+    for (ULONG I = 0; Count > I; I++)
+    {
+        Result = seccache_open(FileSystem, Request, AccessToken, FILE_READ_DATA);
+        ASSERT(STATUS_SUCCESS == Result);
+    }
+    QueryPerformanceCounter(&End);
+
+    tlib_printf("%s: %lu ns/open %lu GetSecurityByName/1000 opens ",
+        Cache ? "cache" : "nocache",
+        (ULONG)((End.QuadPart - Start.QuadPart) * 1000000000 / (Frequency.QuadPart * Count)),
+        (ULONG)((UINT64)seccache_count * 1000 / Count));
+
+    free(Request);
+    CloseHandle(AccessToken);
+    MemfsDelete(Memfs);
+}
+
+void seccache_bench(void)
+{
+    seccache_bench_dotest(FALSE);
+    seccache_bench_dotest(TRUE);
+}
+
+void seccache_tests(void)
+{
+    TEST(seccache_test);
+    TEST_OPT(seccache_bench);
+}
@@ -247,8 +247,141 @@ void setsecurity_test(void)
     }
 }
 
+static PWSTR largesecurity_sddl(ULONG AceCount, ULONG Seed)
+{
+    /* D:P(A;;FA;;;WD)(A;;FA;;;S-1-5-21-<Seed>-...) */
+    ULONG Size = (16 + AceCount * 48) * sizeof(WCHAR);
+    PWSTR Sddl = malloc(Size), P;
+
+    ASSERT(0 != Sddl);
+    StringCbCopyW(Sddl, Size, L"D:P(A;;FA;;;WD)");
+    for (ULONG I = 0; AceCount > I; I++)
+    {
+        P = Sddl + wcslen(Sddl);
+        StringCbPrintfW(P, Size - (P - Sddl) * sizeof(WCHAR),
+            L"(A;;FA;;;S-1-5-21-%lu-2-3-%lu)", Seed, 1000 + I);
+    }
+
+    return Sddl;
+}
+
+static void largesecurity_check(HANDLE Handle, PWSTR Sddl)
+{
+    PSECURITY_DESCRIPTOR FileSecurityDescriptor;
+    PWSTR ConvertedSddl;
+    DWORD Length;
+    BOOLEAN Success;
+
+    Success = GetKernelObjectSecurity(Handle, DACL_SECURITY_INFORMATION, 0, 0, &Length);
+    ASSERT(!Success);
+    ASSERT(ERROR_INSUFFICIENT_BUFFER == GetLastError());
+    ASSERT(FSP_FSCTL_TRANSACT_RSP_SIZEMAX < Length);
+    FileSecurityDescriptor = malloc(Length);
+    Success = GetKernelObjectSecurity(Handle, DACL_SECURITY_INFORMATION,
+        FileSecurityDescriptor, Length, &Length);
+    ASSERT(Success);
+    ASSERT(ConvertSecurityDescriptorToStringSecurityDescriptorW(FileSecurityDescriptor, SDDL_REVISION_1,
+        DACL_SECURITY_INFORMATION, &ConvertedSddl, 0));
+    ASSERT(0 == wcscmp(Sddl, ConvertedSddl));
+    LocalFree(ConvertedSddl);
+    free(FileSecurityDescriptor);
+}
+
+void largesecurity_dotest(ULONG Flags, PWSTR Prefix, ULONG FileInfoTimeout)
+{
+    void *memfs = memfs_start_ex(Flags, FileInfoTimeout);
+
+    /* security descriptors larger than a regular transact message need ExtendedPayload */
+    PWSTR Sddl, Sddl2;
+    PSECURITY_DESCRIPTOR SecurityDescriptor;
+    SECURITY_ATTRIBUTES SecurityAttributes = { 0 };
+    HANDLE Handle;
+    BOOLEAN Success;
+    WCHAR FilePath[MAX_PATH];
+
+    Sddl = largesecurity_sddl(300, 1);
+    Sddl2 = largesecurity_sddl(600, 2);
+
+    Success = ConvertStringSecurityDescriptorToSecurityDescriptorW(Sddl, SDDL_REVISION_1, &SecurityDescriptor, 0);
+    ASSERT(Success);
+    ASSERT(FSP_FSCTL_TRANSACT_REQ_SIZEMAX < GetSecurityDescriptorLength(SecurityDescriptor));
+
+    SecurityAttributes.nLength = sizeof SecurityAttributes;
+    SecurityAttributes.lpSecurityDescriptor = SecurityDescriptor;
+
+    StringCbPrintfW(FilePath, sizeof FilePath, L"%s%s\\file0",
+        Prefix ? L"" : L"\\\\?\\GLOBALROOT", Prefix ? Prefix : memfs_volumename(memfs));
+
+    Handle = CreateFileW(FilePath,
+        GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, &SecurityAttributes,
+        CREATE_NEW, FILE_ATTRIBUTE_NORMAL, 0);
+    if (!(Flags & MemfsExtendedPayload))
+    {
+        /* the request does not fit and is rejected by the FSD */
+        ASSERT(INVALID_HANDLE_VALUE == Handle);
+        ASSERT(ERROR_INVALID_PARAMETER == GetLastError());
+
+        LocalFree(SecurityDescriptor);
+        free(Sddl);
+        free(Sddl2);
+
+        memfs_stop(memfs);
+        return;
+    }
+    ASSERT(INVALID_HANDLE_VALUE != Handle);
+    CloseHandle(Handle);
+
+    LocalFree(SecurityDescriptor);
+
+    Handle = CreateFileW(FilePath,
+        GENERIC_READ | GENERIC_WRITE | WRITE_DAC, FILE_SHARE_READ | FILE_SHARE_WRITE, 0, OPEN_EXISTING, FILE_FLAG_DELETE_ON_CLOSE, 0);
+    ASSERT(INVALID_HANDLE_VALUE != Handle);
+
+    largesecurity_check(Handle, Sddl);
+
+    Success = ConvertStringSecurityDescriptorToSecurityDescriptorW(Sddl2, SDDL_REVISION_1, &SecurityDescriptor, 0);
+    ASSERT(Success);
+
+    Success = SetKernelObjectSecurity(Handle, DACL_SECURITY_INFORMATION, SecurityDescriptor);
+    ASSERT(Success);
+
+    largesecurity_check(Handle, Sddl2);
+
+    LocalFree(SecurityDescriptor);
+
+    CloseHandle(Handle);
+
+    free(Sddl);
+    free(Sddl2);
+
+    memfs_stop(memfs);
+}
+
+void largesecurity_test(void)
+{
+    if (NtfsTests)
+    {
+        WCHAR DirBuf[MAX_PATH] = L"\\\\?\\";
+        GetCurrentDirectoryW(MAX_PATH - 4, DirBuf + 4);
+        largesecurity_dotest(-1, DirBuf, 0);
+    }
+    if (WinFspDiskTests)
+    {
+        largesecurity_dotest(MemfsDisk, 0, 0);
+        largesecurity_dotest(MemfsDisk | MemfsExtendedPayload, 0, 0);
+        largesecurity_dotest(MemfsDisk | MemfsExtendedPayload, 0, 1000);
+    }
+    if (WinFspNetTests)
+    {
+        largesecurity_dotest(MemfsNet, L"\\\\memfs\\share", 0);
+        largesecurity_dotest(MemfsNet | MemfsExtendedPayload, L"\\\\memfs\\share", 0);
+        largesecurity_dotest(MemfsNet | MemfsExtendedPayload, L"\\\\memfs\\share", 1000);
+    }
+}
+
 void security_tests(void)
 {
     TEST(getsecurity_test);
     TEST(setsecurity_test);
+    TEST(largesecurity_test);
 }
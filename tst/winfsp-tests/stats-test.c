@@ -0,0 +1,162 @@
+#include <winfsp/winfsp.h>
+#include <tlib/testsuite.h>
+#include <strsafe.h>
+#include "memfs.h"
+
+extern int WinFspDiskTests;
+extern int WinFspNetTests;
+
+void stats_bucket_test(void)
+{
+    ULONG Index, PrevIndex;
+    UINT64 Value;
+
+    for (Value = 0; 4 > Value; Value++)
+    {
+        ASSERT(Value == FspFileSystemStatisticsBucketIndex(Value));
+        ASSERT(Value == FspFileSystemStatisticsBucketValue((ULONG)Value));
+    }
+
+    PrevIndex = 0;
+    for (Value = 1; 0 != Value; Value = Value * 3 / 2 + 1)
+    {
+        Index = FspFileSystemStatisticsBucketIndex(Value);
+        ASSERT(FspFileSystemStatisticsBucketCount > Index);
+        ASSERT(PrevIndex <= Index);
+        ASSERT(FspFileSystemStatisticsBucketValue(Index) <= Value);
+        if (FspFileSystemStatisticsBucketCount - 1 > Index)
+            ASSERT(Value < FspFileSystemStatisticsBucketValue(Index + 1));
+        PrevIndex = Index;
+        if (Value > (UINT64)-1 / 2)
+            break;
+    }
+
+    for (Index = 0; FspFileSystemStatisticsBucketCount > Index; Index++)
+        ASSERT(Index == FspFileSystemStatisticsBucketIndex(FspFileSystemStatisticsBucketValue(Index)));
+
+    ASSERT(FspFileSystemStatisticsBucketCount - 1 == FspFileSystemStatisticsBucketIndex((UINT64)-1));
+}
+
+void stats_percentile_test(void)
+{
+    FSP_FILE_SYSTEM_OPERATION_STATISTICS *Statistics;
+    UINT64 Value;
+
+    Statistics = malloc(sizeof *Statistics);
+    ASSERT(0 != Statistics);
+    memset(Statistics, 0, sizeof *Statistics);
+
+    ASSERT(0 == FspFileSystemStatisticsPercentile(Statistics, 99));
+
+    Statistics->Histogram[FspFileSystemStatisticsBucketIndex(10)] += 98;
+    Statistics->Histogram[FspFileSystemStatisticsBucketIndex(1000)] += 1;
+    Statistics->Histogram[FspFileSystemStatisticsBucketIndex(1000000)] += 1;
+
+    Value = FspFileSystemStatisticsPercentile(Statistics, 50);
+    ASSERT(10 <= Value && Value < 10 * 5 / 4);
+    Value = FspFileSystemStatisticsPercentile(Statistics, 98);
+    ASSERT(10 <= Value && Value < 10 * 5 / 4);
+    Value = FspFileSystemStatisticsPercentile(Statistics, 99);
+    ASSERT(1000 <= Value && Value < 1000 * 5 / 4);
+    Value = FspFileSystemStatisticsPercentile(Statistics, 100);
+    ASSERT(1000000 <= Value && Value < 1000000 * 5 / 4);
+
+    free(Statistics);
+}
+
+void stats_memfs_dotest(ULONG Flags, PWSTR Prefix)
+{
+    MEMFS *Memfs;
+    NTSTATUS Result;
+    HANDLE Handle;
+    BOOL Success;
+    WCHAR FilePath[MAX_PATH];
+    char Buffer[16];
+    DWORD BytesTransferred;
+    FSP_FILE_SYSTEM_STATISTICS *Statistics;
+    FSP_FILE_SYSTEM_OPERATION_STATISTICS *OpStatistics;
+    UINT64 Count;
+
+    Result = MemfsCreate(Flags, 1000, 1024, 1024 * 1024,
+        MemfsNet == Flags ? L"\\memfs\\share" : 0, 0, &Memfs);
+    ASSERT(NT_SUCCESS(Result));
+    ASSERT(0 != Memfs);
+
+    Statistics = malloc(sizeof *Statistics);
+    ASSERT(0 != Statistics);
+
+    Result = FspFileSystemGetStatistics(MemfsFileSystem(Memfs), Statistics);
+    ASSERT(STATUS_INVALID_DEVICE_REQUEST == Result);
+
+    Result = FspFileSystemEnableStatistics(MemfsFileSystem(Memfs));
+    ASSERT(NT_SUCCESS(Result));
+
+    Result = MemfsStart(Memfs);
+    ASSERT(NT_SUCCESS(Result));
+
+    Result = FspFileSystemEnableStatistics(MemfsFileSystem(Memfs));
+    ASSERT(STATUS_INVALID_PARAMETER == Result);
+
+    StringCbPrintfW(FilePath, sizeof FilePath, L"%s%s\\file0",
+        Prefix ? L"" : L"\\\\?\\GLOBALROOT", Prefix ? Prefix : MemfsFileSystem(Memfs)->VolumeName);
+
+    Handle = CreateFileW(FilePath,
+        GENERIC_READ | GENERIC_WRITE, 0, 0, CREATE_NEW, FILE_FLAG_DELETE_ON_CLOSE, 0);
+    ASSERT(INVALID_HANDLE_VALUE != Handle);
+
+    Success = WriteFile(Handle, "Hello, world!", 13, &BytesTransferred, 0);
+    ASSERT(Success);
+    Success = FlushFileBuffers(Handle);
+    ASSERT(Success);
+    ASSERT(0 == SetFilePointer(Handle, 0, 0, FILE_BEGIN));
+    Success = ReadFile(Handle, Buffer, sizeof Buffer, &BytesTransferred, 0);
+    ASSERT(Success);
+    ASSERT(13 == BytesTransferred);
+
+    Success = CloseHandle(Handle);
+    ASSERT(Success);
+
+    MemfsStop(Memfs);
+
+    Result = FspFileSystemGetStatistics(MemfsFileSystem(Memfs), Statistics);
+    ASSERT(NT_SUCCESS(Result));
+
+    ASSERT(1 <= Statistics->Operations[FspFsctlTransactCreateKind].Count);
+    ASSERT(1 <= Statistics->Operations[FspFsctlTransactCleanupKind].Count);
+    ASSERT(1 <= Statistics->Operations[FspFsctlTransactWriteKind].Count);
+    ASSERT(13 <= Statistics->Operations[FspFsctlTransactWriteKind].BytesTransferred);
+    ASSERT(0 != Statistics->Transact.Count);
+    ASSERT(0 != Statistics->Transact.BytesTransferred);
+
+    for (ULONG Kind = 0; FspFsctlTransactKindCount >= Kind; Kind++)
+    {
+        OpStatistics = FspFsctlTransactKindCount > Kind ?
+            &Statistics->Operations[Kind] : &Statistics->Transact;
+
+        ASSERT(OpStatistics->ErrorCount + OpStatistics->PendingCount <= OpStatistics->Count);
+
+        Count = 0;
+        for (ULONG Index = 0; FspFileSystemStatisticsBucketCount > Index; Index++)
+            Count += OpStatistics->Histogram[Index];
+        ASSERT(OpStatistics->Count == Count);
+    }
+
+    free(Statistics);
+
+    MemfsDelete(Memfs);
+}
+
+void stats_memfs_test(void)
+{
+    if (WinFspDiskTests)
+        stats_memfs_dotest(MemfsDisk, 0);
+    if (WinFspNetTests)
+        stats_memfs_dotest(MemfsNet, L"\\\\memfs\\share");
+}
+
+void stats_tests(void)
+{
+    TEST(stats_bucket_test);
+    TEST(stats_percentile_test);
+    TEST(stats_memfs_test);
+}
@@ -0,0 +1,158 @@
+#include <winfsp/winfsp.h>
+#include <tlib/testsuite.h>
+#include <strsafe.h>
+#include "memfs.h"
+
+extern int WinFspDiskTests;
+extern int WinFspNetTests;
+
+static void trace_filename(PWSTR TraceFileName, SIZE_T Size)
+{
+    WCHAR TempPath[MAX_PATH];
+
+    ASSERT(0 != GetTempPathW(MAX_PATH, TempPath));
+    StringCbPrintfW(TraceFileName, Size, L"%swinfsp-tests-%lu.trace",
+        TempPath, GetCurrentProcessId());
+}
+
+void trace_memfs_dotest(ULONG Flags, PWSTR Prefix, ULONG TraceSize, ULONG FileCount)
+{
+    MEMFS *Memfs;
+    NTSTATUS Result;
+    HANDLE Handle;
+    BOOL Success;
+    WCHAR TraceFileName[MAX_PATH];
+    WCHAR FilePath[MAX_PATH];
+    char Buffer[16];
+    DWORD BytesTransferred;
+    FSP_FILE_SYSTEM_STATISTICS *Statistics;
+    ULONG RequestCount;
+
+    trace_filename(TraceFileName, sizeof TraceFileName);
+
+    Result = MemfsCreate(Flags, 1000, 1024, 1024 * 1024,
+        MemfsNet == Flags ? L"\\memfs\\share" : 0, 0, &Memfs);
+    ASSERT(NT_SUCCESS(Result));
+    ASSERT(0 != Memfs);
+
+    Result = FspFileSystemStartTrace(MemfsFileSystem(Memfs), TraceFileName, TraceSize);
+    ASSERT(NT_SUCCESS(Result));
+
+    Result = MemfsStart(Memfs);
+    ASSERT(NT_SUCCESS(Result));
+
+    Result = FspFileSystemStartTrace(MemfsFileSystem(Memfs), TraceFileName, TraceSize);
+    ASSERT(STATUS_INVALID_PARAMETER == Result);
+
+    for (ULONG I = 0; FileCount > I; I++)
+    {
+        StringCbPrintfW(FilePath, sizeof FilePath, L"%s%s\\file%lu",
+            Prefix ? L"" : L"\\\\?\\GLOBALROOT", Prefix ? Prefix : MemfsFileSystem(Memfs)->VolumeName,
+            I);
+
+        Handle = CreateFileW(FilePath,
+            GENERIC_READ | GENERIC_WRITE, 0, 0, CREATE_NEW, FILE_FLAG_DELETE_ON_CLOSE, 0);
+        ASSERT(INVALID_HANDLE_VALUE != Handle);
+
+        Success = WriteFile(Handle, "Hello, world!", 13, &BytesTransferred, 0);
+        ASSERT(Success);
+        ASSERT(0 == SetFilePointer(Handle, 0, 0, FILE_BEGIN));
+        Success = ReadFile(Handle, Buffer, sizeof Buffer, &BytesTransferred, 0);
+        ASSERT(Success);
+        ASSERT(13 == BytesTransferred);
+
+        Success = CloseHandle(Handle);
+        ASSERT(Success);
+    }
+
+    MemfsStop(Memfs);
+    MemfsDelete(Memfs);
+
+    Result = MemfsCreate(MemfsDetached, 1000, 1024, 1024 * 1024, 0, 0, &Memfs);
+    ASSERT(NT_SUCCESS(Result));
+    ASSERT(0 != Memfs);
+
+    Result = MemfsStart(Memfs);
+    ASSERT(STATUS_INVALID_PARAMETER == Result);
+
+    Statistics = malloc(sizeof *Statistics);
+    ASSERT(0 != Statistics);
+
+    Result = FspFileSystemEnableStatistics(MemfsFileSystem(Memfs));
+    ASSERT(NT_SUCCESS(Result));
+
+    Result = FspFileSystemReplayTrace(MemfsFileSystem(Memfs), TraceFileName, &RequestCount);
+    ASSERT(NT_SUCCESS(Result));
+    ASSERT(0 != RequestCount);
+
+    Result = FspFileSystemGetStatistics(MemfsFileSystem(Memfs), Statistics);
+    ASSERT(NT_SUCCESS(Result));
+    ASSERT(1 <= Statistics->Operations[FspFsctlTransactCreateKind].Count);
+    ASSERT(1 <= Statistics->Operations[FspFsctlTransactWriteKind].Count);
+    ASSERT(1 <= Statistics->Operations[FspFsctlTransactReadKind].Count);
+    ASSERT(0 == Statistics->Operations[FspFsctlTransactWriteKind].ErrorCount);
+    ASSERT(0 == Statistics->Operations[FspFsctlTransactReadKind].ErrorCount);
+
+    free(Statistics);
+
+    MemfsDelete(Memfs);
+
+    Success = DeleteFileW(TraceFileName);
+    ASSERT(Success);
+}
+
+void trace_memfs_test(void)
+{
+    if (WinFspDiskTests)
+        trace_memfs_dotest(MemfsDisk, 0, 0, 10);
+    if (WinFspNetTests)
+        trace_memfs_dotest(MemfsNet, L"\\\\memfs\\share", 0, 10);
+}
+
+void trace_memfs_wrap_test(void)
+{
+    /* minimum size trace; records wrap around the ring many times */
+    if (WinFspDiskTests)
+        trace_memfs_dotest(MemfsDisk, 0, 1, 500);
+    if (WinFspNetTests)
+        trace_memfs_dotest(MemfsNet, L"\\\\memfs\\share", 1, 500);
+}
+
+void trace_corrupt_test(void)
+{
+    MEMFS *Memfs;
+    NTSTATUS Result;
+    HANDLE Handle;
+    BOOL Success;
+    WCHAR TraceFileName[MAX_PATH];
+    DWORD BytesTransferred;
+    static char Garbage[4096] = "not a trace";
+
+    trace_filename(TraceFileName, sizeof TraceFileName);
+
+    Handle = CreateFileW(TraceFileName,
+        GENERIC_READ | GENERIC_WRITE, 0, 0, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, 0);
+    ASSERT(INVALID_HANDLE_VALUE != Handle);
+    Success = WriteFile(Handle, Garbage, sizeof Garbage, &BytesTransferred, 0);
+    ASSERT(Success);
+    Success = CloseHandle(Handle);
+    ASSERT(Success);
+
+    Result = MemfsCreate(MemfsDetached, 1000, 1024, 1024 * 1024, 0, 0, &Memfs);
+    ASSERT(NT_SUCCESS(Result));
+
+    Result = FspFileSystemReplayTrace(MemfsFileSystem(Memfs), TraceFileName, 0);
+    ASSERT(STATUS_FILE_CORRUPT_ERROR == Result);
+
+    MemfsDelete(Memfs);
+
+    Success = DeleteFileW(TraceFileName);
+    ASSERT(Success);
+}
+
+void trace_tests(void)
+{
+    TEST(trace_memfs_test);
+    TEST(trace_memfs_wrap_test);
+    TEST(trace_corrupt_test);
+}
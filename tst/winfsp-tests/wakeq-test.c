@@ -0,0 +1,349 @@
+#include <winfsp/winfsp.h>
+#include <process.h>
+#include <shared/wakeq.h>
+#include <tlib/testsuite.h>
+
+void wakeq_test(void)
+{
+    FSP_WAKE_QUEUE WakeQueue;
+    FSP_WAKE_QUEUE_WAITER W1, W2, W3, *WakeList;
+
+    FspWakeQueueInitialize(&WakeQueue, 2, 64);
+    ASSERT(2 == WakeQueue.SpinMin && 64 == WakeQueue.SpinMax);
+    ASSERT(2 + (64 - 2) / 4 == WakeQueue.Spin);
+    ASSERT(0 == FspWakeQueueSignal(&WakeQueue, 10));
+
+    /* waiters are woken LIFO, one per work item */
+    FspWakeQueueWait(&WakeQueue, &W1);
+    FspWakeQueueWait(&WakeQueue, &W2);
+    FspWakeQueueWait(&WakeQueue, &W3);
+    ASSERT(3 == WakeQueue.WaiterCount);
+    WakeList = FspWakeQueueSignal(&WakeQueue, 1);
+    ASSERT(&W3 == WakeList && 0 == W3.Next);
+    ASSERT(2 == WakeQueue.WaiterCount && 1 == WakeQueue.WokenCount);
+
+    /* a woken waiter claims a work item until it comes back */
+    ASSERT(0 == FspWakeQueueSignal(&WakeQueue, 1));
+    WakeList = FspWakeQueueSignal(&WakeQueue, 2);
+    ASSERT(&W2 == WakeList && 0 == W2.Next);
+    ASSERT(FspWakeQueueWaitEnd(&WakeQueue, &W3));
+    ASSERT(FspWakeQueueWaitEnd(&WakeQueue, &W2));
+    ASSERT(0 == WakeQueue.WokenCount);
+
+    /* batch: K work items wake K waiters */
+    FspWakeQueueWait(&WakeQueue, &W2);
+    FspWakeQueueWait(&WakeQueue, &W3);
+    WakeList = FspWakeQueueSignal(&WakeQueue, 2);
+    ASSERT(&W3 == WakeList && &W2 == W3.Next && 0 == W2.Next);
+    ASSERT(1 == WakeQueue.WaiterCount && 2 == WakeQueue.WokenCount);
+    ASSERT(FspWakeQueueWaitEnd(&WakeQueue, &W3));
+    ASSERT(FspWakeQueueWaitEnd(&WakeQueue, &W2));
+
+    /* a waiter that times out leaves the stack */
+    FspWakeQueueWait(&WakeQueue, &W2);
+    FspWakeQueueWait(&WakeQueue, &W3);
+    ASSERT(!FspWakeQueueWaitEnd(&WakeQueue, &W1));
+    ASSERT(!FspWakeQueueWaitEnd(&WakeQueue, &W3));
+    ASSERT(&W2 == WakeQueue.WaiterStack && 0 == W2.Next);
+    ASSERT(1 == WakeQueue.WaiterCount && 0 == WakeQueue.WokenCount);
+
+    /* only one thread spins; a spinning thread claims a work item */
+    ASSERT(17 == FspWakeQueueSpinBegin(&WakeQueue));
+    ASSERT(0 == FspWakeQueueSpinBegin(&WakeQueue));
+    ASSERT(0 == FspWakeQueueSignal(&WakeQueue, 1));
+    ASSERT(&W2 == FspWakeQueueSignal(&WakeQueue, 2));
+    ASSERT(FspWakeQueueWaitEnd(&WakeQueue, &W2));
+
+    /* the spin budget doubles when spinning finds work and halves when it does not */
+    FspWakeQueueSpinEnd(&WakeQueue, TRUE);
+    ASSERT(34 == WakeQueue.Spin);
+    ASSERT(34 == FspWakeQueueSpinBegin(&WakeQueue));
+    FspWakeQueueSpinEnd(&WakeQueue, TRUE);
+    ASSERT(64 == WakeQueue.Spin);
+    for (ULONG I = 0; 10 > I; I++)
+    {
+        ASSERT(0 != FspWakeQueueSpinBegin(&WakeQueue));
+        FspWakeQueueSpinEnd(&WakeQueue, FALSE);
+    }
+    ASSERT(2 == WakeQueue.Spin);
+    ASSERT(12 == WakeQueue.Spins && 2 == WakeQueue.SpinHits);
+
+    /* stop wakes everybody */
+    FspWakeQueueWait(&WakeQueue, &W1);
+    FspWakeQueueWait(&WakeQueue, &W2);
+    FspWakeQueueWait(&WakeQueue, &W3);
+    WakeList = FspWakeQueueSignalAll(&WakeQueue);
+    ASSERT(&W3 == WakeList && &W2 == W3.Next && &W1 == W2.Next && 0 == W1.Next);
+    ASSERT(0 == WakeQueue.WaiterCount && 3 == WakeQueue.WokenCount);
+
+    /* spinning can be disabled */
+    FspWakeQueueInitialize(&WakeQueue, 0, 0);
+    ASSERT(0 == FspWakeQueueSpinBegin(&WakeQueue));
+}
+
+/*
+ * A producer posts bursts of 1-4 work items with idle gaps in between; 8 consumer threads
+ * take work items and "process" them for a few microseconds. This is how FSP_FSCTL_TRANSACT
+ * threads wait for pending IRP's. We compare an auto-reset event (as used by the FSP_IOQ by
+ * default) against the wake queue with and without spinning, and report the average wake
+ * latency (from the time a work item is posted until a thread takes it) against the CPU
+ * spent spinning and the number of times threads went to sleep and woke up for nothing.
+ */
+enum
+{
+    wakeq_bench_event = 0,
+    wakeq_bench_lifo,
+    wakeq_bench_adaptive,
+    wakeq_bench_thread_count = 8,
+    wakeq_bench_item_max = 1024,
+};
+typedef struct
+{
+    FSP_WAKE_QUEUE_WAITER Waiter;
+    CONDITION_VARIABLE Cond;
+} WAKEQ_BENCH_WAITER;
+static struct
+{
+    SRWLOCK Lock;
+    CONDITION_VARIABLE EventCond;
+    BOOLEAN EventSignaled;
+    FSP_WAKE_QUEUE WakeQueue;
+    ULONG Mode;
+    LONGLONG ItemTimes[wakeq_bench_item_max];
+    ULONG ItemHead, ItemCount;
+    BOOLEAN Done;
+    LONGLONG TicksPerMicrosecond;
+    LONGLONG WorkTicks;
+    LONGLONG TotalLatency;
+    LONGLONG SpinTicks;
+    ULONG Taken, Sleeps, FutileWakes;
+} wakeq_bench_queue;
+
+static LONGLONG wakeq_bench_now(void)
+{
+    LARGE_INTEGER Now;
+    QueryPerformanceCounter(&Now);
+    return Now.QuadPart;
+}
+
+static void wakeq_bench_wake(void)
+{
+    /* called under the lock after the item count changes */
+    FSP_WAKE_QUEUE_WAITER *Waiter, *NextWaiter;
+    if (wakeq_bench_event == wakeq_bench_queue.Mode)
+    {
+        /* auto-reset event; SetEvent on a signaled event is lost */
+        if ((0 != wakeq_bench_queue.ItemCount || wakeq_bench_queue.Done) &&
+            !wakeq_bench_queue.EventSignaled)
+        {
+            wakeq_bench_queue.EventSignaled = TRUE;
+            WakeConditionVariable(&wakeq_bench_queue.EventCond);
+        }
+        return;
+    }
+    Waiter = wakeq_bench_queue.Done ?
+        FspWakeQueueSignalAll(&wakeq_bench_queue.WakeQueue) :
+        FspWakeQueueSignal(&wakeq_bench_queue.WakeQueue, wakeq_bench_queue.ItemCount);
+    for (; 0 != Waiter; Waiter = NextWaiter)
+    {
+        NextWaiter = Waiter->Next;
+        WakeConditionVariable(&CONTAINING_RECORD(Waiter, WAKEQ_BENCH_WAITER, Waiter)->Cond);
+    }
+}
+
+static BOOLEAN wakeq_bench_take(void)
+{
+    /* called under the lock */
+    if (0 == wakeq_bench_queue.ItemCount)
+        return FALSE;
+    wakeq_bench_queue.TotalLatency +=
+        wakeq_bench_now() - wakeq_bench_queue.ItemTimes[wakeq_bench_queue.ItemHead];
+    wakeq_bench_queue.ItemHead = (wakeq_bench_queue.ItemHead + 1) % wakeq_bench_item_max;
+    wakeq_bench_queue.ItemCount--;
+    wakeq_bench_queue.Taken++;
+    if (wakeq_bench_event == wakeq_bench_queue.Mode)
+    {
+        /* equivalent to FspIoqPendingResetSynch */
+        wakeq_bench_queue.EventSignaled = FALSE;
+        wakeq_bench_wake();
+    }
+    return TRUE;
+}
+
+static BOOLEAN wakeq_bench_wait(void)
+{
+    /* called under the lock; returns with the lock held and an item taken or FALSE when done */
+    WAKEQ_BENCH_WAITER Waiter;
+    LONGLONG Start;
+    ULONG Spin;
+    BOOLEAN Found;
+
+    for (;;)
+    {
+        if (wakeq_bench_take())
+            return TRUE;
+        if (wakeq_bench_queue.Done)
+            return FALSE;
+
+        if (wakeq_bench_event == wakeq_bench_queue.Mode)
+        {
+            wakeq_bench_queue.Sleeps++;
+            while (!wakeq_bench_queue.EventSignaled)
+                SleepConditionVariableSRW(&wakeq_bench_queue.EventCond, &wakeq_bench_queue.Lock,
+                    INFINITE, 0);
+            wakeq_bench_queue.EventSignaled = FALSE;
+            if (!wakeq_bench_take())
+            {
+                if (!wakeq_bench_queue.Done)
+                    wakeq_bench_queue.FutileWakes++;
+                wakeq_bench_wake();
+                continue;
+            }
+            return TRUE;
+        }
+
+        Spin = FspWakeQueueSpinBegin(&wakeq_bench_queue.WakeQueue);
+        if (0 != Spin)
+        {
+            ReleaseSRWLockExclusive(&wakeq_bench_queue.Lock);
+            Start = wakeq_bench_now();
+            while (0 == *(volatile ULONG *)&wakeq_bench_queue.ItemCount &&
+                !*(volatile BOOLEAN *)&wakeq_bench_queue.Done &&
+                wakeq_bench_now() - Start < Spin * wakeq_bench_queue.TicksPerMicrosecond)
+                YieldProcessor();
+            AcquireSRWLockExclusive(&wakeq_bench_queue.Lock);
+            wakeq_bench_queue.SpinTicks += wakeq_bench_now() - Start;
+            Found = wakeq_bench_take();
+            FspWakeQueueSpinEnd(&wakeq_bench_queue.WakeQueue, Found);
+            wakeq_bench_wake();
+            if (Found)
+                return TRUE;
+            continue;
+        }
+
+        InitializeConditionVariable(&Waiter.Cond);
+        FspWakeQueueWait(&wakeq_bench_queue.WakeQueue, &Waiter.Waiter);
+        wakeq_bench_queue.Sleeps++;
+        while (Waiter.Waiter.Waiting)
+            SleepConditionVariableSRW(&Waiter.Cond, &wakeq_bench_queue.Lock, INFINITE, 0);
+        FspWakeQueueWaitEnd(&wakeq_bench_queue.WakeQueue, &Waiter.Waiter);
+        if (!wakeq_bench_take())
+        {
+            if (!wakeq_bench_queue.Done)
+                wakeq_bench_queue.FutileWakes++;
+            continue;
+        }
+        return TRUE;
+    }
+}
+
+static unsigned __stdcall wakeq_bench_consumer(void *Data)
+{
+    LONGLONG Start;
+
+    AcquireSRWLockExclusive(&wakeq_bench_queue.Lock);
+    while (wakeq_bench_wait())
+    {
+        ReleaseSRWLockExclusive(&wakeq_bench_queue.Lock);
+        Start = wakeq_bench_now();
+        while (wakeq_bench_now() - Start < wakeq_bench_queue.WorkTicks)
+            ;
+        AcquireSRWLockExclusive(&wakeq_bench_queue.Lock);
+    }
+    ReleaseSRWLockExclusive(&wakeq_bench_queue.Lock);
+
+    return 0;
+}
+
+static void wakeq_bench_dotest(ULONG Mode, ULONG BurstCount, ULONG GapMicroseconds)
+{
+    static const char *ModeNames[] = { "event", "lifo", "adaptive" };
+    HANDLE Threads[wakeq_bench_thread_count];
+    LARGE_INTEGER Frequency;
+    LONGLONG Start, Gap;
+    ULONG Seed = 1, Burst, Posted = 0;
+
+    QueryPerformanceFrequency(&Frequency);
+    memset(&wakeq_bench_queue, 0, sizeof wakeq_bench_queue);
+    InitializeSRWLock(&wakeq_bench_queue.Lock);
+    InitializeConditionVariable(&wakeq_bench_queue.EventCond);
+    FspWakeQueueInitialize(&wakeq_bench_queue.WakeQueue, 2, wakeq_bench_adaptive == Mode ? 64 : 0);
+    wakeq_bench_queue.Mode = Mode;
+    wakeq_bench_queue.TicksPerMicrosecond = Frequency.QuadPart / 1000000;
+    if (0 == wakeq_bench_queue.TicksPerMicrosecond)
+        wakeq_bench_queue.TicksPerMicrosecond = 1;
+    wakeq_bench_queue.WorkTicks = 5 * wakeq_bench_queue.TicksPerMicrosecond;
+
+    for (ULONG I = 0; wakeq_bench_thread_count > I; I++)
+    {
+        Threads[I] = (HANDLE)_beginthreadex(0, 0, wakeq_bench_consumer, 0, 0, 0);
+        ASSERT(0 != Threads[I]);
+    }
+
+    for (ULONG I = 0; BurstCount > I; I++)
+    {
+        Seed = Seed * 1103515245 + 12345;
+        Burst = 1 + (Seed >> 16) % 4;
+        AcquireSRWLockExclusive(&wakeq_bench_queue.Lock);
+        for (ULONG J = 0; Burst > J && wakeq_bench_item_max > wakeq_bench_queue.ItemCount; J++)
+        {
+            wakeq_bench_queue.ItemTimes[
+                (wakeq_bench_queue.ItemHead + wakeq_bench_queue.ItemCount) % wakeq_bench_item_max] =
+                wakeq_bench_now();
+            wakeq_bench_queue.ItemCount++;
+            Posted++;
+            if (wakeq_bench_event == Mode)
+                wakeq_bench_wake();
+        }
+        if (wakeq_bench_event != Mode)
+            wakeq_bench_wake();
+        ReleaseSRWLockExclusive(&wakeq_bench_queue.Lock);
+
+        /* idle gap of 1/2 to 3/2 the requested gap */
+        Start = wakeq_bench_now();
+        Gap = (GapMicroseconds / 2 + (Seed >> 8) % (GapMicroseconds + 1)) *
+            wakeq_bench_queue.TicksPerMicrosecond;
+        while (wakeq_bench_now() - Start < Gap)
+            ;
+    }
+
+    AcquireSRWLockExclusive(&wakeq_bench_queue.Lock);
+    while (0 != wakeq_bench_queue.ItemCount)
+    {
+        ReleaseSRWLockExclusive(&wakeq_bench_queue.Lock);
+        Sleep(1);
+        AcquireSRWLockExclusive(&wakeq_bench_queue.Lock);
+    }
+    wakeq_bench_queue.Done = TRUE;
+    wakeq_bench_wake();
+    ReleaseSRWLockExclusive(&wakeq_bench_queue.Lock);
+
+    WaitForMultipleObjects(wakeq_bench_thread_count, Threads, TRUE, INFINITE);
+    for (ULONG I = 0; wakeq_bench_thread_count > I; I++)
+        CloseHandle(Threads[I]);
+
+    ASSERT(Posted == wakeq_bench_queue.Taken);
+
+    tlib_printf("%s/%lu: latency=%lu.%02luus spin=%lums sleeps=%lu futile=%lu ",
+        ModeNames[Mode], GapMicroseconds,
+        (ULONG)(wakeq_bench_queue.TotalLatency * 1000000 / Frequency.QuadPart / Posted),
+        (ULONG)(wakeq_bench_queue.TotalLatency * 100000000 / Frequency.QuadPart / Posted % 100),
+        (ULONG)(wakeq_bench_queue.SpinTicks * 1000 / Frequency.QuadPart),
+        wakeq_bench_queue.Sleeps, wakeq_bench_queue.FutileWakes);
+}
+
+void wakeq_bench(void)
+{
+    wakeq_bench_dotest(wakeq_bench_event, 10000, 20);
+    wakeq_bench_dotest(wakeq_bench_lifo, 10000, 20);
+    wakeq_bench_dotest(wakeq_bench_adaptive, 10000, 20);
+    wakeq_bench_dotest(wakeq_bench_event, 2000, 500);
+    wakeq_bench_dotest(wakeq_bench_lifo, 2000, 500);
+    wakeq_bench_dotest(wakeq_bench_adaptive, 2000, 500);
+}
+
+void wakeq_tests(void)
+{
+    TEST(wakeq_test);
+    TEST_OPT(wakeq_bench);
+}
@@ -1,18 +1,46 @@
+#include <winfsp/winfsp.h>
+#include <string.h>
 #include <tlib/testsuite.h>
+#include "memfs.h"
 
 int NtfsTests = 0;
 int WinFspDiskTests = 1;
 int WinFspNetTests = 1;
+ULONG MemfsTestFlags = 0;               /* optional FSD features for the memfs test volumes */
 
 int main(int argc, char *argv[])
 {
+    for (int argi = 1; argc > argi; argi++)
+    {
+        if (0 == strcmp("--negative-name-cache", argv[argi]))
+            MemfsTestFlags |= MemfsNegativeNameCache;
+        else if (0 == strcmp("--adaptive-wakeup", argv[argi]))
+            MemfsTestFlags |= MemfsAdaptiveWakeup;
+    }
+
     TESTSUITE(fuse_opt_tests);
+    TESTSUITE(fuse_buf_tests);
     TESTSUITE(posix_tests);
     TESTSUITE(eventlog_tests);
     TESTSUITE(path_tests);
+    TESTSUITE(stats_tests);
+    TESTSUITE(ptrset_tests);
+    TESTSUITE(metacache_tests);
+    TESTSUITE(negcache_tests);
+    TESTSUITE(attrcache_tests);
+    TESTSUITE(dircache_tests);
+    TESTSUITE(rangelock_tests);
+    TESTSUITE(payload_tests);
+    TESTSUITE(iosched_tests);
+    TESTSUITE(wakeq_tests);
+    TESTSUITE(nodetab_tests);
+    TESTSUITE(opguard_tests);
+    TESTSUITE(seccache_tests);
+    TESTSUITE(trace_tests);
     TESTSUITE(mount_tests);
     TESTSUITE(timeout_tests);
     TESTSUITE(memfs_tests);
+    TESTSUITE(fuse_tests);
     TESTSUITE(create_tests);
     TESTSUITE(info_tests);
     TESTSUITE(security_tests);